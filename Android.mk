@@ -15,7 +15,7 @@ QEMU_HARDWARE := true
 
 LOCAL_SHARED_LIBRARIES += libdl
 
-LOCAL_SRC_FILES += hardware.c
+LOCAL_SRC_FILES += hardware.c hal_trace.c
 
 LOCAL_MODULE:= libhardware
 
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <hardware/hal_trace.h>
+
+#include <cutils/properties.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * A slot of the ring. seq is the index of the event plus one once the
+ * event is complete, 0 while a writer fills the slot, so that a dump
+ * racing with writers skips the slots it would read torn.
+ */
+typedef struct {
+    volatile uint32_t seq;
+    int32_t type;
+    int32_t tid;
+    int32_t reserved;
+    int64_t timestamp_ns;
+    int64_t value;
+    char name[HAL_TRACE_NAME_MAX];
+} hal_trace_slot_t;
+
+volatile int hal_trace_enabled = 0;
+
+static hal_trace_slot_t ring[HAL_TRACE_RING_SIZE];
+/* index of the next event, slots are reused modulo HAL_TRACE_RING_SIZE */
+static volatile uint32_t ring_next = 0;
+
+__attribute__((constructor)) static void hal_trace_init(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get("debug.hal.trace", value, "0");
+    hal_trace_enabled = atoi(value) != 0;
+}
+
+void hal_trace_set_enabled(int enabled)
+{
+    hal_trace_enabled = enabled != 0;
+}
+
+void hal_trace_record(int type, const char *name, int64_t value)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint32_t index = __atomic_fetch_add(&ring_next, 1, __ATOMIC_RELAXED);
+    hal_trace_slot_t *slot = &ring[index & (HAL_TRACE_RING_SIZE - 1)];
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->type = type;
+    slot->tid = gettid();
+    slot->timestamp_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    slot->value = value;
+    strncpy(slot->name, name, HAL_TRACE_NAME_MAX - 1);
+    slot->name[HAL_TRACE_NAME_MAX - 1] = '\0';
+    __atomic_store_n(&slot->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+/* copies event index out of the ring, false if it was overwritten */
+static int read_event(uint32_t index, hal_trace_slot_t *event)
+{
+    const hal_trace_slot_t *slot = &ring[index & (HAL_TRACE_RING_SIZE - 1)];
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != index + 1)
+        return 0;
+    memcpy(event, (const void *)slot, sizeof(*event));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == index + 1;
+}
+
+static int format_event(char *buff, size_t size, const hal_trace_slot_t *event,
+        int64_t first_ns)
+{
+    static const char types[] = "BEIC";
+    int64_t us = (event->timestamp_ns - first_ns) / 1000;
+
+    if (event->type == HAL_TRACE_EVENT_COUNTER)
+        return snprintf(buff, size, "  %10lld.%03lld %5d C %s = %lld\n",
+                (long long)(us / 1000), (long long)(us % 1000), event->tid,
+                event->name, (long long)event->value);
+    return snprintf(buff, size, "  %10lld.%03lld %5d %c %s\n",
+            (long long)(us / 1000), (long long)(us % 1000), event->tid,
+            types[event->type & 3], event->name);
+}
+
+/* the first event of a dump of at most max_events */
+static uint32_t dump_start(uint32_t end, unsigned max_events)
+{
+    uint32_t count = end < HAL_TRACE_RING_SIZE ? end : HAL_TRACE_RING_SIZE;
+    if (count > max_events)
+        count = max_events;
+    return end - count;
+}
+
+void hal_trace_dump(int fd, unsigned max_events)
+{
+    uint32_t end = __atomic_load_n(&ring_next, __ATOMIC_ACQUIRE);
+    uint32_t start = dump_start(end, max_events);
+    hal_trace_slot_t event;
+    int64_t first_ns = -1;
+    char line[128];
+
+    dprintf(fd, "  HAL trace%s: %u events, ms since the first shown, tid, "
+            "Begin/End/Instant/Counter\n", hal_trace_enabled ? "" : " (off)", end);
+    for (uint32_t i = start; i != end; i++) {
+        if (!read_event(i, &event))
+            continue;
+        if (first_ns < 0)
+            first_ns = event.timestamp_ns;
+        format_event(line, sizeof(line), &event, first_ns);
+        dprintf(fd, "%s", line);
+    }
+}
+
+int hal_trace_dump_buffer(char *buff, int buff_len, unsigned max_events)
+{
+    uint32_t end = __atomic_load_n(&ring_next, __ATOMIC_ACQUIRE);
+    uint32_t start = dump_start(end, max_events);
+    hal_trace_slot_t event;
+    int64_t first_ns = -1;
+    int len;
+
+    if (buff_len <= 0)
+        return 0;
+    len = snprintf(buff, buff_len, "  HAL trace%s: %u events, ms since the first shown, "
+            "tid, Begin/End/Instant/Counter\n", hal_trace_enabled ? "" : " (off)", end);
+    for (uint32_t i = start; i != end && len < buff_len; i++) {
+        if (!read_event(i, &event))
+            continue;
+        if (first_ns < 0)
+            first_ns = event.timestamp_ns;
+        len += format_event(buff + len, buff_len - len, &event, first_ns);
+    }
+    return len < buff_len ? len : buff_len - 1;
+}
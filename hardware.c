@@ -18,11 +18,16 @@
 
 #include <cutils/properties.h>
 
+#include <dirent.h>
 #include <dlfcn.h>
 #include <string.h>
+#include <stdlib.h>
 #include <pthread.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 
 #define LOG_TAG "HAL"
 #include <utils/Log.h>
@@ -60,25 +65,188 @@ static const char *variant_keys[] = {
 static const int HAL_VARIANT_KEYS_COUNT =
     (sizeof(variant_keys)/sizeof(variant_keys[0]));
 
+/**
+ * Modules linked into the process, registered by the constructors of
+ * HAL_MODULE_BUILTIN(). They are looked up before the cache and the HAL
+ * directories, and never loaded or unloaded.
+ */
+static pthread_mutex_t builtin_modules_lock = PTHREAD_MUTEX_INITIALIZER;
+static hw_builtin_module_t *builtin_modules = NULL;
+
+void hw_register_builtin_module(hw_builtin_module_t *builtin)
+{
+    pthread_mutex_lock(&builtin_modules_lock);
+    builtin->next = builtin_modules;
+    builtin_modules = builtin;
+    pthread_mutex_unlock(&builtin_modules_lock);
+}
+
+static const struct hw_module_t *builtin_module_find(const char *class_id,
+        const char *name)
+{
+    const struct hw_module_t *module = NULL;
+    hw_builtin_module_t *builtin;
+
+    pthread_mutex_lock(&builtin_modules_lock);
+    for (builtin = builtin_modules; builtin != NULL; builtin = builtin->next) {
+        if (strcmp(builtin->name, name) != 0)
+            continue;
+        if (strcmp(builtin->module->id, class_id) == 0) {
+            module = builtin->module;
+            break;
+        }
+        ALOGE("builtin: id=%s != hmi->id=%s", class_id, builtin->module->id);
+    }
+    pthread_mutex_unlock(&builtin_modules_lock);
+    return module;
+}
+
+static int builtin_module_is(const struct hw_module_t *module)
+{
+    hw_builtin_module_t *builtin;
+    int found = 0;
+
+    pthread_mutex_lock(&builtin_modules_lock);
+    for (builtin = builtin_modules; builtin != NULL && !found;
+            builtin = builtin->next)
+        found = builtin->module == module;
+    pthread_mutex_unlock(&builtin_modules_lock);
+    return found;
+}
+
+/**
+ * Process-wide cache of resolved modules, keyed by the "<class_id>.<inst>"
+ * name built in hw_get_module_by_class(). A cached hw_module_t stays valid
+ * until hw_module_cache_invalidate() is called, after which the next
+ * lookup walks the variants again, or until it is unloaded: every lookup
+ * takes a reference that hw_put_module() drops, and a module nobody holds
+ * is dlclose()d once idle for the time its ro.hal.unload_idle_ms property
+ * gives. Callers that never put their modules keep them loaded for good.
+ *
+ * An entry is inserted in the LOADING state before its dlopen() starts and
+ * the lock is dropped for the load itself, so independent modules load in
+ * parallel while a second lookup of the same module waits on
+ * module_cache_cond for the first one to finish instead of racing it. The
+ * lock is dropped the same way around dlclose(), in the UNLOADING state.
+ */
+enum {
+    HW_MODULE_LOADING,
+    HW_MODULE_LOADED,
+    HW_MODULE_FAILED,
+    HW_MODULE_UNLOADING,
+    HW_MODULE_UNLOADED,
+};
+
+struct hw_module_cache_entry {
+    struct hw_module_cache_entry *next;
+    const struct hw_module_t *module;
+    int state;
+    int status;
+    /* lookups not put yet */
+    int refs;
+    /* CLOCK_MONOTONIC time to unload the module at, 0 if not scheduled */
+    int64_t unload_ns;
+    hw_module_load_timing_t timing;
+    char name[];
+};
+
+static pthread_mutex_t module_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t module_cache_cond = PTHREAD_COND_INITIALIZER;
+static struct hw_module_cache_entry *module_cache = NULL;
+
+static struct hw_module_cache_entry *module_cache_find_l(const char *name)
+{
+    struct hw_module_cache_entry *entry;
+
+    for (entry = module_cache; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+static struct hw_module_cache_entry *module_cache_add_l(const char *name)
+{
+    size_t len = strlen(name) + 1;
+    struct hw_module_cache_entry *entry;
+
+    entry = (struct hw_module_cache_entry *)malloc(sizeof(*entry) + len);
+    if (entry == NULL)
+        return NULL;
+    memcpy(entry->name, name, len);
+    entry->module = NULL;
+    entry->state = HW_MODULE_LOADING;
+    entry->status = 0;
+    entry->refs = 0;
+    entry->unload_ns = 0;
+    memset(&entry->timing, 0, sizeof(entry->timing));
+    entry->next = module_cache;
+    module_cache = entry;
+    return entry;
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Pick the dlopen() binding mode for a module. By default modules are
+ * loaded with RTLD_NOW so that missing symbols are reported at load time.
+ * ro.hal.bind.<name> ("lazy" or "now") selects the mode for one module
+ * and ro.hal.bind sets the default for all others; anything else, or no
+ * property at all, keeps RTLD_NOW.
+ *
+ * With "lazy" only function symbols are bound on first call: a module
+ * with an unresolved function reference still loads, and the process
+ * aborts if that function is ever called. Linkers that do not implement
+ * lazy binding treat RTLD_LAZY like RTLD_NOW.
+ */
+static int load_bind_mode(const char *name)
+{
+    char prop[PROPERTY_VALUE_MAX];
+    char prop_name[PATH_MAX];
+
+    snprintf(prop_name, sizeof(prop_name), "ro.hal.bind.%s", name);
+    if (property_get(prop_name, prop, NULL) <= 0 &&
+            property_get("ro.hal.bind", prop, NULL) <= 0)
+        return RTLD_NOW;
+
+    if (strcmp(prop, "lazy") == 0)
+        return RTLD_LAZY;
+    if (strcmp(prop, "now") != 0)
+        ALOGW("load: unknown bind mode '%s' for %s, using now", prop, name);
+    return RTLD_NOW;
+}
+
 /**
  * Load the file defined by the variant and if successful
- * return the dlopen handle and the hmi.
+ * return the dlopen handle and the hmi. The time spent in dlopen()
+ * (including relocation) and dlsym() is recorded in timing.
  * @return 0 = success, !0 = failure.
  */
 static int load(const char *id,
         const char *path,
-        const struct hw_module_t **pHmi)
+        int mode,
+        const struct hw_module_t **pHmi,
+        hw_module_load_timing_t *timing)
 {
     int status;
     void *handle;
     struct hw_module_t *hmi;
+    int64_t start;
 
     /*
-     * load the symbols resolving undefined symbols before
-     * dlopen returns. Since RTLD_GLOBAL is not or'd in with
-     * RTLD_NOW the external symbols will not be global
+     * With RTLD_NOW, load the symbols resolving undefined symbols
+     * before dlopen returns. Since RTLD_GLOBAL is not or'd in with
+     * the mode the external symbols will not be global
      */
-    handle = dlopen(path, RTLD_NOW);
+    start = now_ns();
+    handle = dlopen(path, mode);
+    timing->dlopen_ns = now_ns() - start;
     if (handle == NULL) {
         char const *err_str = dlerror();
         ALOGE("load: module=%s\n%s", path, err_str?err_str:"unknown");
@@ -88,7 +256,9 @@ static int load(const char *id,
 
     /* Get the address of the struct hal_module_info. */
     const char *sym = HAL_MODULE_INFO_SYM_AS_STR;
+    start = now_ns();
     hmi = (struct hw_module_t *)dlsym(handle, sym);
+    timing->dlsym_ns = now_ns() - start;
     if (hmi == NULL) {
         ALOGE("load: couldn't find symbol %s", sym);
         status = -EINVAL;
@@ -115,8 +285,8 @@ static int load(const char *id,
             handle = NULL;
         }
     } else {
-        ALOGV("loaded HAL id=%s path=%s hmi=%p handle=%p",
-                id, path, *pHmi, handle);
+        ALOGV("loaded HAL id=%s path=%s hmi=%p handle=%p%s",
+                id, path, *pHmi, handle, mode == RTLD_LAZY ? " (lazy)" : "");
     }
 
     *pHmi = hmi;
@@ -124,6 +294,133 @@ static int load(const char *id,
     return status;
 }
 
+/**
+ * In-memory index of the .so files present in the HAL directories, so that
+ * probing every variant does not cost an access() per directory. It is
+ * built with a single readdir pass over each directory the first time a
+ * module is resolved, and rebuilt when inotify reports that one of the
+ * directories changed or when the module cache is invalidated.
+ *
+ * The index is only used with module_cache_lock held.
+ */
+#define HAL_INDEX_BUCKETS 256
+
+static const char *hal_library_paths[] = {
+    HAL_LIBRARY_PATH3,
+    HAL_LIBRARY_PATH2,
+    HAL_LIBRARY_PATH1
+};
+
+static const int HAL_LIBRARY_PATH_COUNT =
+    (sizeof(hal_library_paths)/sizeof(hal_library_paths[0]));
+
+struct hw_module_index_entry {
+    struct hw_module_index_entry *next;
+    int dir;
+    char file[];
+};
+
+static struct hw_module_index_entry *module_index[HAL_INDEX_BUCKETS];
+static int module_index_valid = 0;
+static int module_index_notify_fd = -1;
+
+static uint32_t module_index_hash(const char *str)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void module_index_clear_l(void)
+{
+    int i;
+
+    for (i = 0; i < HAL_INDEX_BUCKETS; i++) {
+        struct hw_module_index_entry *entry = module_index[i];
+        while (entry != NULL) {
+            struct hw_module_index_entry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        module_index[i] = NULL;
+    }
+    if (module_index_notify_fd >= 0) {
+        close(module_index_notify_fd);
+        module_index_notify_fd = -1;
+    }
+    module_index_valid = 0;
+}
+
+static void module_index_add_l(int dir, const char *file)
+{
+    size_t len = strlen(file) + 1;
+    uint32_t bucket = module_index_hash(file) % HAL_INDEX_BUCKETS;
+    struct hw_module_index_entry *entry;
+
+    entry = (struct hw_module_index_entry *)malloc(sizeof(*entry) + len);
+    if (entry == NULL)
+        return;
+    memcpy(entry->file, file, len);
+    entry->dir = dir;
+    /* Keep each chain sorted by directory so lookups honour path order. */
+    struct hw_module_index_entry **link = &module_index[bucket];
+    while (*link != NULL && (*link)->dir <= dir)
+        link = &(*link)->next;
+    entry->next = *link;
+    *link = entry;
+}
+
+static void module_index_build_l(void)
+{
+    int i;
+
+    module_index_clear_l();
+
+    /*
+     * Watch before reading so that a module installed while the
+     * directories are being scanned triggers a rebuild.
+     */
+    module_index_notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (i = 0; i < HAL_LIBRARY_PATH_COUNT; i++) {
+        DIR *dir;
+        struct dirent *de;
+
+        if (module_index_notify_fd >= 0) {
+            inotify_add_watch(module_index_notify_fd, hal_library_paths[i],
+                    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+        }
+
+        dir = opendir(hal_library_paths[i]);
+        if (dir == NULL)
+            continue;
+        while ((de = readdir(dir)) != NULL) {
+            size_t len = strlen(de->d_name);
+            if (len > 3 && strcmp(de->d_name + len - 3, ".so") == 0)
+                module_index_add_l(i, de->d_name);
+        }
+        closedir(dir);
+    }
+    module_index_valid = 1;
+}
+
+static void module_index_refresh_l(void)
+{
+    char events[sizeof(struct inotify_event) + NAME_MAX + 1];
+    int changed = 0;
+
+    if (module_index_valid && module_index_notify_fd >= 0) {
+        while (read(module_index_notify_fd, events, sizeof(events)) > 0)
+            changed = 1;
+    }
+    if (!module_index_valid || changed)
+        module_index_build_l();
+}
+
 /*
  * Check if a HAL with given name and subname exists, if so return 0, otherwise
  * otherwise return negative.  On success path will contain the path to the HAL.
@@ -131,77 +428,518 @@ static int load(const char *id,
 static int hw_module_exists(char *path, size_t path_len, const char *name,
                             const char *subname)
 {
-    snprintf(path, path_len, "%s/%s.%s.so",
-             HAL_LIBRARY_PATH3, name, subname);
-    if (access(path, R_OK) == 0)
-        return 0;
+    char file[PATH_MAX];
+    struct hw_module_index_entry *entry;
 
-    snprintf(path, path_len, "%s/%s.%s.so",
-             HAL_LIBRARY_PATH2, name, subname);
-    if (access(path, R_OK) == 0)
-        return 0;
+    snprintf(file, sizeof(file), "%s.%s.so", name, subname);
+    entry = module_index[module_index_hash(file) % HAL_INDEX_BUCKETS];
+    for (; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->file, file) != 0)
+            continue;
+        snprintf(path, path_len, "%s/%s", hal_library_paths[entry->dir], file);
+        if (access(path, R_OK) == 0)
+            return 0;
+    }
 
-    snprintf(path, path_len, "%s/%s.%s.so",
-             HAL_LIBRARY_PATH1, name, subname);
-    if (access(path, R_OK) == 0)
+    return -ENOENT;
+}
+
+/*
+ * Find the path of the module file to load for name, probing the
+ * ro.hardware.<name> property, the variant keys and finally "default".
+ * Must be called with module_cache_lock held.
+ */
+static int hw_find_module_path_l(const char *name, char *path, size_t path_len)
+{
+    int i;
+    char prop[PATH_MAX];
+    char prop_name[PATH_MAX];
+
+    module_index_refresh_l();
+
+    /* First try a property specific to the class and possibly instance */
+    snprintf(prop_name, sizeof(prop_name), "ro.hardware.%s", name);
+    if (property_get(prop_name, prop, NULL) > 0) {
+        if (hw_module_exists(path, path_len, name, prop) == 0) {
+            return 0;
+        }
+    }
+
+    /* Loop through the configuration variants looking for a module */
+    for (i=0 ; i<HAL_VARIANT_KEYS_COUNT; i++) {
+        if (property_get(variant_keys[i], prop, NULL) == 0) {
+            continue;
+        }
+        if (hw_module_exists(path, path_len, name, prop) == 0) {
+            return 0;
+        }
+    }
+
+    /* Nothing found, try the default */
+    if (hw_module_exists(path, path_len, name, "default") == 0) {
         return 0;
+    }
 
     return -ENOENT;
 }
 
+static void log_load_timing(const hw_module_load_timing_t *timing, int force)
+{
+    char prop[PROPERTY_VALUE_MAX];
+
+    if (!force && (property_get("debug.hal.log_load_timing", prop, "0") <= 0 ||
+            strcmp(prop, "0") == 0))
+        return;
+
+    ALOGI("load timing: %s status=%d probe=%lldus dlopen=%lldus dlsym=%lldus "
+            "total=%lldus", timing->name, timing->status,
+            (long long)(timing->probe_ns / 1000),
+            (long long)(timing->dlopen_ns / 1000),
+            (long long)(timing->dlsym_ns / 1000),
+            (long long)(timing->total_ns / 1000));
+}
+
 int hw_get_module_by_class(const char *class_id, const char *inst,
                            const struct hw_module_t **module)
 {
-    int i;
-    char prop[PATH_MAX];
+    int status;
     char path[PATH_MAX];
     char name[PATH_MAX];
-    char prop_name[PATH_MAX];
+    struct hw_module_cache_entry *entry;
+    hw_module_load_timing_t timing;
+    int64_t start;
 
     if (inst)
         snprintf(name, PATH_MAX, "%s.%s", class_id, inst);
     else
         strlcpy(name, class_id, PATH_MAX);
 
+    *module = builtin_module_find(class_id, name);
+    if (*module != NULL)
+        return 0;
+
+    pthread_mutex_lock(&module_cache_lock);
+    /*
+     * hw_module_cache_invalidate() may free the entry while we wait, look
+     * it up again after every wakeup.
+     */
+    entry = module_cache_find_l(name);
+    while (entry != NULL && (entry->state == HW_MODULE_LOADING ||
+            entry->state == HW_MODULE_UNLOADING)) {
+        pthread_cond_wait(&module_cache_cond, &module_cache_lock);
+        entry = module_cache_find_l(name);
+    }
+    if (entry != NULL && entry->state == HW_MODULE_LOADED) {
+        entry->refs++;
+        entry->unload_ns = 0;
+        *module = entry->module;
+        pthread_mutex_unlock(&module_cache_lock);
+        return 0;
+    }
+
+    /*
+     * Not loaded yet, unloaded, or the last attempt failed: (re)try it
+     * ourselves.
+     */
+    if (entry == NULL)
+        entry = module_cache_add_l(name);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&module_cache_lock);
+        *module = NULL;
+        return -ENOMEM;
+    }
+    entry->state = HW_MODULE_LOADING;
+    memset(&timing, 0, sizeof(timing));
+    strlcpy(timing.name, name, sizeof(timing.name));
+
+    start = now_ns();
+    status = hw_find_module_path_l(name, path, sizeof(path));
+    timing.probe_ns = now_ns() - start;
+    pthread_mutex_unlock(&module_cache_lock);
+
     /*
      * Here we rely on the fact that calling dlopen multiple times on
      * the same .so will simply increment a refcount (and not load
      * a new copy of the library).
      * We also assume that dlopen() is thread-safe.
      */
+    if (status == 0) {
+        /* load the module, if this fails, we're doomed, and we should not
+         * try to load a different variant. */
+        status = load(class_id, path, load_bind_mode(name), module,
+                &timing);
+    } else {
+        *module = NULL;
+    }
+    timing.status = status;
+    timing.total_ns = now_ns() - start;
+    log_load_timing(&timing, 0);
 
-    /* First try a property specific to the class and possibly instance */
-    snprintf(prop_name, sizeof(prop_name), "ro.hardware.%s", name);
-    if (property_get(prop_name, prop, NULL) > 0) {
-        if (hw_module_exists(path, sizeof(path), name, prop) == 0) {
-            goto found;
+    pthread_mutex_lock(&module_cache_lock);
+    entry->module = *module;
+    entry->status = status;
+    entry->timing = timing;
+    entry->state = status == 0 ? HW_MODULE_LOADED : HW_MODULE_FAILED;
+    entry->refs = status == 0 ? 1 : 0;
+    entry->unload_ns = 0;
+    pthread_cond_broadcast(&module_cache_cond);
+    pthread_mutex_unlock(&module_cache_lock);
+
+    return status;
+}
+
+/**
+ * How long a module nobody holds stays loaded, in ms:
+ * ro.hal.unload_idle_ms.<name> for one module, ro.hal.unload_idle_ms for
+ * all others. 0 unloads it as soon as it is put, no property or a negative
+ * value keeps it loaded, as modules always were.
+ */
+static int64_t unload_idle_ms(const char *name)
+{
+    char prop[PROPERTY_VALUE_MAX];
+    char prop_name[PATH_MAX];
+
+    snprintf(prop_name, sizeof(prop_name), "ro.hal.unload_idle_ms.%s", name);
+    if (property_get(prop_name, prop, NULL) <= 0 &&
+            property_get("ro.hal.unload_idle_ms", prop, NULL) <= 0)
+        return -1;
+    return strtoll(prop, NULL, 0);
+}
+
+/*
+ * dlclose() the module of a LOADED entry nobody holds. Drops
+ * module_cache_lock around the dlclose(), meanwhile lookups of the module
+ * wait for it to be gone and load it again.
+ */
+static void module_unload_l(struct hw_module_cache_entry *entry)
+{
+    void *handle = entry->module->dso;
+
+    entry->state = HW_MODULE_UNLOADING;
+    entry->unload_ns = 0;
+    pthread_mutex_unlock(&module_cache_lock);
+
+    ALOGV("unloading HAL %s", entry->name);
+    dlclose(handle);
+
+    pthread_mutex_lock(&module_cache_lock);
+    entry->module = NULL;
+    entry->state = HW_MODULE_UNLOADED;
+    pthread_cond_broadcast(&module_cache_cond);
+}
+
+/*
+ * Thread unloading the modules whose idle time is over, while some are
+ * scheduled; it exits once none is.
+ */
+static pthread_cond_t module_reaper_cond = PTHREAD_COND_INITIALIZER;
+static int module_reaper_running = 0;
+
+static void *module_reaper_thread(void *arg __attribute__((unused)))
+{
+    struct hw_module_cache_entry *entry;
+
+    pthread_mutex_lock(&module_cache_lock);
+    for (;;) {
+        int64_t now = now_ns();
+        int64_t next = 0;
+
+        for (entry = module_cache; entry != NULL; entry = entry->next) {
+            if (entry->state != HW_MODULE_LOADED || entry->refs > 0 ||
+                    entry->unload_ns == 0)
+                continue;
+            if (entry->unload_ns <= now) {
+                module_unload_l(entry);
+                /* the lock was dropped, start over */
+                break;
+            }
+            if (next == 0 || entry->unload_ns < next)
+                next = entry->unload_ns;
         }
+        if (entry != NULL)
+            continue;
+        if (next == 0)
+            break;
+
+        /* the realtime clock only matters for the length of the wait */
+        struct timespec ts;
+        int64_t deadline;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        deadline = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec + next - now;
+        ts.tv_sec = deadline / 1000000000LL;
+        ts.tv_nsec = deadline % 1000000000LL;
+        pthread_cond_timedwait(&module_reaper_cond, &module_cache_lock, &ts);
     }
+    module_reaper_running = 0;
+    pthread_mutex_unlock(&module_cache_lock);
+    return NULL;
+}
 
-    /* Loop through the configuration variants looking for a module */
-    for (i=0 ; i<HAL_VARIANT_KEYS_COUNT; i++) {
-        if (property_get(variant_keys[i], prop, NULL) == 0) {
-            continue;
+static void module_reaper_kick_l(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (module_reaper_running) {
+        pthread_cond_signal(&module_reaper_cond);
+        return;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, module_reaper_thread, NULL) == 0)
+        module_reaper_running = 1;
+    else
+        ALOGW("put: no thread to unload idle modules, keeping them");
+    pthread_attr_destroy(&attr);
+}
+
+int hw_put_module(const struct hw_module_t *module)
+{
+    struct hw_module_cache_entry *entry;
+    int64_t idle_ms;
+
+    if (module == NULL)
+        return -EINVAL;
+    if (builtin_module_is(module))
+        return 0;
+
+    pthread_mutex_lock(&module_cache_lock);
+    for (entry = module_cache; entry != NULL; entry = entry->next) {
+        if (entry->state == HW_MODULE_LOADED && entry->module == module &&
+                entry->refs > 0)
+            break;
+    }
+    if (entry == NULL) {
+        /* not from a lookup, put too often, or dropped by an invalidate */
+        pthread_mutex_unlock(&module_cache_lock);
+        return -ENOENT;
+    }
+
+    if (--entry->refs == 0) {
+        idle_ms = unload_idle_ms(entry->name);
+        if (idle_ms == 0) {
+            module_unload_l(entry);
+        } else if (idle_ms > 0) {
+            entry->unload_ns = now_ns() + idle_ms * 1000000LL;
+            module_reaper_kick_l();
         }
-        if (hw_module_exists(path, sizeof(path), name, prop) == 0) {
-            goto found;
+    }
+    pthread_mutex_unlock(&module_cache_lock);
+    return 0;
+}
+
+void hw_module_cache_invalidate(void)
+{
+    struct hw_module_cache_entry **link;
+
+    pthread_mutex_lock(&module_cache_lock);
+    /*
+     * Entries still being loaded or unloaded are owned by their loader or
+     * unloader; keep them.
+     */
+    link = &module_cache;
+    while (*link != NULL) {
+        struct hw_module_cache_entry *entry = *link;
+        if (entry->state == HW_MODULE_LOADING ||
+                entry->state == HW_MODULE_UNLOADING) {
+            link = &entry->next;
+        } else {
+            *link = entry->next;
+            free(entry);
         }
     }
+    module_index_clear_l();
+    pthread_mutex_unlock(&module_cache_lock);
+}
 
-    /* Nothing found, try the default */
-    if (hw_module_exists(path, sizeof(path), name, "default") == 0) {
-        goto found;
+size_t hw_get_module_load_timings(hw_module_load_timing_t *timings,
+                                  size_t count)
+{
+    struct hw_module_cache_entry *entry;
+    size_t n = 0;
+
+    pthread_mutex_lock(&module_cache_lock);
+    for (entry = module_cache; entry != NULL; entry = entry->next) {
+        if (entry->state == HW_MODULE_LOADING)
+            continue;
+        if (timings != NULL && n < count)
+            timings[n] = entry->timing;
+        n++;
     }
+    pthread_mutex_unlock(&module_cache_lock);
 
-    return -ENOENT;
+    return n;
+}
 
-found:
-    /* load the module, if this fails, we're doomed, and we should not try
-     * to load a different variant. */
-    return load(class_id, path, module);
+void hw_dump_module_load_timings(void)
+{
+    struct hw_module_cache_entry *entry;
+
+    pthread_mutex_lock(&module_cache_lock);
+    for (entry = module_cache; entry != NULL; entry = entry->next) {
+        if (entry->state != HW_MODULE_LOADING)
+            log_load_timing(&entry->timing, 1);
+    }
+    pthread_mutex_unlock(&module_cache_lock);
+}
+
+/**
+ * Work list shared by the hw_preload_modules() worker threads. Each worker
+ * claims the next id and resolves it through hw_get_module(), so the
+ * results land in the module cache.
+ */
+#define HW_PRELOAD_MAX_THREADS 4
+
+struct hw_preload_work {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t count;
+    int threads;
+    char **ids;
+};
+
+static void hw_preload_work_release(struct hw_preload_work *work)
+{
+    size_t i;
+    int last;
+
+    pthread_mutex_lock(&work->lock);
+    last = --work->threads == 0;
+    pthread_mutex_unlock(&work->lock);
+    if (!last)
+        return;
+
+    for (i = 0; i < work->count; i++)
+        free(work->ids[i]);
+    free(work->ids);
+    pthread_mutex_destroy(&work->lock);
+    free(work);
+}
+
+static void *hw_preload_thread(void *arg)
+{
+    struct hw_preload_work *work = (struct hw_preload_work *)arg;
+
+    for (;;) {
+        const struct hw_module_t *module;
+        const char *id = NULL;
+
+        pthread_mutex_lock(&work->lock);
+        if (work->next < work->count)
+            id = work->ids[work->next++];
+        pthread_mutex_unlock(&work->lock);
+        if (id == NULL)
+            break;
+
+        /* preloading must not keep the module from being unloaded */
+        if (hw_get_module(id, &module) != 0)
+            ALOGW("preload: module %s not loaded", id);
+        else
+            hw_put_module(module);
+    }
+
+    hw_preload_work_release(work);
+    return NULL;
+}
+
+int hw_preload_modules(const char **ids, size_t count)
+{
+    struct hw_preload_work *work;
+    pthread_attr_t attr;
+    size_t i;
+    int threads;
+    int started = 0;
+
+    if (ids == NULL || count == 0)
+        return 0;
+
+    work = (struct hw_preload_work *)calloc(1, sizeof(*work));
+    if (work == NULL)
+        return -ENOMEM;
+    work->ids = (char **)calloc(count, sizeof(work->ids[0]));
+    if (work->ids == NULL) {
+        free(work);
+        return -ENOMEM;
+    }
+    for (i = 0; i < count; i++) {
+        work->ids[i] = strdup(ids[i]);
+        if (work->ids[i] == NULL)
+            break;
+    }
+    work->count = i;
+    pthread_mutex_init(&work->lock, NULL);
+
+    threads = count < HW_PRELOAD_MAX_THREADS ? (int)count
+                                             : HW_PRELOAD_MAX_THREADS;
+    /* Hold a reference for ourselves until every thread is started. */
+    work->threads = threads + 1;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < (size_t)threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, hw_preload_thread, work) == 0) {
+            started++;
+        } else {
+            hw_preload_work_release(work);
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    hw_preload_work_release(work);
+    return started > 0 ? 0 : -EAGAIN;
 }
 
 int hw_get_module(const char *id, const struct hw_module_t **module)
 {
     return hw_get_module_by_class(id, NULL, module);
 }
+
+int hw_device_get_perf_counters(const struct hw_device_t *device,
+                                hw_perf_counter_t *counters, size_t count)
+{
+    const struct hw_device_ext *ext;
+
+    if (device == NULL || device->tag != HARDWARE_DEVICE_TAG)
+        return -EINVAL;
+
+    /* ext is leftover padding in the devices of older modules */
+    if (device->module == NULL ||
+            device->module->hal_api_version < HARDWARE_HAL_API_VERSION_1_1)
+        return -ENOSYS;
+
+    ext = device->ext;
+    if (ext == NULL || ext->tag != HARDWARE_DEVICE_EXT_TAG ||
+            ext->version < HARDWARE_DEVICE_EXT_VERSION_1 ||
+            ext->get_perf_counters == NULL)
+        return -ENOSYS;
+
+    return ext->get_perf_counters(device, counters, count);
+}
+
+int hw_device_dump_perf_counters(const struct hw_device_t *device, int fd,
+                                 const char *prefix)
+{
+    hw_perf_counter_t *counters;
+    int count, i;
+
+    count = hw_device_get_perf_counters(device, NULL, 0);
+    if (count <= 0)
+        return count;
+
+    counters = calloc(count, sizeof(*counters));
+    if (counters == NULL)
+        return -ENOMEM;
+
+    /* counters may have been added in between, print those there was room for */
+    i = hw_device_get_perf_counters(device, counters, count);
+    if (i < count)
+        count = i;
+    for (i = 0; i < count; i++)
+        dprintf(fd, "%s%s %lld\n", prefix ? prefix : "", counters[i].name,
+                (long long)counters[i].value);
+
+    free(counters);
+    return count;
+}
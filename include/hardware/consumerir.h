@@ -23,6 +23,10 @@
 #include <hardware/hwcomposer_defs.h>
 
 #define CONSUMERIR_MODULE_API_VERSION_1_0 HARDWARE_MODULE_API_VERSION(1, 0)
+
+/* Device API version 1.1 adds transmit_async() */
+#define CONSUMERIR_DEVICE_API_VERSION_1_0 HARDWARE_DEVICE_API_VERSION(1, 0)
+#define CONSUMERIR_DEVICE_API_VERSION_1_1 HARDWARE_DEVICE_API_VERSION(1, 1)
 #define CONSUMERIR_HARDWARE_MODULE_ID "consumerir"
 #define CONSUMERIR_TRANSMITTER "transmitter"
 
@@ -31,6 +35,17 @@ typedef struct consumerir_freq_range {
     int max;
 } consumerir_freq_range_t;
 
+struct consumerir_device;
+
+/*
+ * Called by the HAL once a transmission queued by (*transmit_async)() is
+ * complete, with the id transmit_async() returned and the status transmit()
+ * would have returned, -ECANCELED if the device was closed before it was
+ * sent. Called on a thread of the HAL, which must not be blocked for long.
+ */
+typedef void (*consumerir_transmit_callback_t)(struct consumerir_device *dev,
+        int id, int status, void *cookie);
+
 typedef struct consumerir_module {
     /**
      * Common methods of the consumer IR module.  This *must* be the first member of
@@ -85,8 +100,25 @@ typedef struct consumerir_device {
     int (*get_carrier_freqs)(struct consumerir_device *dev,
             size_t len, consumerir_freq_range_t *ranges);
 
+    /*
+     * (*transmit_async)() queues a pattern as (*transmit)() sends it and
+     * returns right away, so that the caller is not blocked for the whole
+     * burst. Patterns are sent in the order they are queued, including
+     * those of (*transmit)(), and callback is called after each, if not
+     * NULL. The pattern is copied.
+     *
+     * Only present from CONSUMERIR_DEVICE_API_VERSION_1_1.
+     *
+     * returns: an id > 0 of the transmission on success. -EAGAIN if too
+     * many transmissions are queued already. A negative error code on
+     * error.
+     */
+    int (*transmit_async)(struct consumerir_device *dev, int carrier_freq,
+            const int pattern[], int pattern_len,
+            consumerir_transmit_callback_t callback, void *cookie);
+
     /* Reserved for future use. Must be NULL. */
-    void* reserved[8 - 3];
+    void* reserved[8 - 4];
 } consumerir_device_t;
 
 #endif /* ANDROID_INCLUDE_HARDWARE_CONSUMERIR_H */
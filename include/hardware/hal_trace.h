@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_INCLUDE_HARDWARE_HAL_TRACE_H
+#define ANDROID_INCLUDE_HARDWARE_HAL_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/**
+ * Trace points and counters of HAL modules, recorded by libhardware into
+ * one ring of the process shared by every module, the newest
+ * HAL_TRACE_RING_SIZE events kept. Recording takes no lock: a writer claims
+ * a slot with an atomic increment, so trace points may be hit from any
+ * thread, including real-time ones.
+ *
+ * Tracing is off unless the debug.hal.trace property is 1 when libhardware
+ * is loaded, or hal_trace_set_enabled() turns it on; a trace point that is
+ * off costs a load and a branch. A module built with HAL_TRACE_DISABLED
+ * defined has no trace points at all.
+ *
+ * The ring is printed by hal_trace_dump() or hal_trace_dump_buffer(),
+ * meant to be called from the dump() of a module.
+ */
+
+#define HAL_TRACE_RING_SIZE     4096    /* a power of two */
+#define HAL_TRACE_NAME_MAX      24      /* longer names are cut */
+
+enum {
+    HAL_TRACE_EVENT_BEGIN,
+    HAL_TRACE_EVENT_END,
+    HAL_TRACE_EVENT_INSTANT,
+    HAL_TRACE_EVENT_COUNTER,
+};
+
+/** Nonzero while trace points record, read without a barrier */
+extern volatile int hal_trace_enabled;
+
+void hal_trace_set_enabled(int enabled);
+
+/**
+ * Records an event of type HAL_TRACE_EVENT_* at the current
+ * CLOCK_MONOTONIC time. Name is copied, value is the value of counters.
+ */
+void hal_trace_record(int type, const char *name, int64_t value);
+
+/**
+ * Prints at most max_events of the newest events, oldest first, to fd or
+ * into buff. hal_trace_dump_buffer() returns the length of what it wrote,
+ * buff is always terminated.
+ */
+void hal_trace_dump(int fd, unsigned max_events);
+int hal_trace_dump_buffer(char *buff, int buff_len, unsigned max_events);
+
+#ifdef HAL_TRACE_DISABLED
+#define HAL_TRACE_ON()              0
+#else
+#define HAL_TRACE_ON()              __builtin_expect(hal_trace_enabled, 0)
+#endif
+
+#define HAL_TRACE_EVENT(type, name, value) \
+    do { \
+        if (HAL_TRACE_ON()) \
+            hal_trace_record((type), (name), (value)); \
+    } while (0)
+
+#define HAL_TRACE_BEGIN(name)       HAL_TRACE_EVENT(HAL_TRACE_EVENT_BEGIN, (name), 0)
+#define HAL_TRACE_END(name)         HAL_TRACE_EVENT(HAL_TRACE_EVENT_END, (name), 0)
+#define HAL_TRACE_INSTANT(name)     HAL_TRACE_EVENT(HAL_TRACE_EVENT_INSTANT, (name), 0)
+#define HAL_TRACE_COUNTER(name, value) \
+    HAL_TRACE_EVENT(HAL_TRACE_EVENT_COUNTER, (name), (int64_t)(value))
+
+static inline const char *hal_trace_scope_begin(const char *name)
+{
+    hal_trace_record(HAL_TRACE_EVENT_BEGIN, name, 0);
+    return name;
+}
+
+static inline void hal_trace_scope_end(const char **name)
+{
+    if (*name)
+        hal_trace_record(HAL_TRACE_EVENT_END, *name, 0);
+}
+
+#define HAL_TRACE_CONCAT_(a, b)     a##b
+#define HAL_TRACE_CONCAT(a, b)      HAL_TRACE_CONCAT_(a, b)
+
+/**
+ * Traces the rest of the enclosing block, from BEGIN here to END when it
+ * is left however it is. Tracing turned on within the block records
+ * neither.
+ */
+#ifdef HAL_TRACE_DISABLED
+#define HAL_TRACE_SCOPE(name)       do { } while (0)
+#else
+#define HAL_TRACE_SCOPE(name) \
+    const char *HAL_TRACE_CONCAT(hal_trace_scope_, __LINE__) \
+            __attribute__((cleanup(hal_trace_scope_end), unused)) = \
+            HAL_TRACE_ON() ? hal_trace_scope_begin(name) : NULL
+#endif
+
+/** Traces the rest of the function it is used in, as ATRACE_CALL() */
+#define HAL_TRACE_CALL()            HAL_TRACE_SCOPE(__func__)
+
+__END_DECLS
+
+#endif  /* ANDROID_INCLUDE_HARDWARE_HAL_TRACE_H */
@@ -17,6 +17,7 @@
 #ifndef ANDROID_INCLUDE_HARDWARE_HARDWARE_H
 #define ANDROID_INCLUDE_HARDWARE_HARDWARE_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/cdefs.h>
 
@@ -56,6 +57,13 @@ __BEGIN_DECLS
  */
 #define HARDWARE_HAL_API_VERSION HARDWARE_MAKE_API_VERSION(1, 0)
 
+/*
+ * HAL API version of the modules whose devices all set hw_device_t.ext,
+ * if only to NULL. libhardware ignores ext in the devices of the modules
+ * of an older version, which may have left it uninitialized.
+ */
+#define HARDWARE_HAL_API_VERSION_1_1 HARDWARE_MAKE_API_VERSION(1, 1)
+
 /*
  * Helper macros for module implementors.
  *
@@ -189,11 +197,19 @@ typedef struct hw_device_t {
     /** reference to the module this device belongs to */
     struct hw_module_t* module;
 
+    /**
+     * Optional extensions common to all devices, see hw_device_ext_t,
+     * NULL if the device has none. This used to be padding, so it is only
+     * valid when the hal_api_version of the module is at least
+     * HARDWARE_HAL_API_VERSION_1_1.
+     */
+    const struct hw_device_ext* ext;
+
     /** padding reserved for future use */
 #ifdef __LP64__
-    uint64_t reserved[12];
+    uint64_t reserved[11];
 #else
-    uint32_t reserved[12];
+    uint32_t reserved[11];
 #endif
 
     /** Close this device */
@@ -201,10 +217,110 @@ typedef struct hw_device_t {
 
 } hw_device_t;
 
+/*
+ * Performance counters of a device, so that a single collector can read
+ * those of every HAL the same way rather than parsing the text of each
+ * dump(). The names are fixed for a module, lower case words separated by
+ * '_' and '.', e.g. "alloc.bytes" or "frames_dropped", and the values of
+ * the same name across devices of a module add up.
+ */
+#define HW_PERF_COUNTER_NAME_MAX    48
+
+enum {
+    /**
+     * number of events since the device was opened, only ever grows
+     * unless the device documents when it starts over, e.g. a camera on
+     * every stream configuration
+     */
+    HW_PERF_COUNTER_TYPE_COUNT = 1,
+    /** current value of something that goes up and down */
+    HW_PERF_COUNTER_TYPE_GAUGE = 2,
+    /** a gauge in bytes */
+    HW_PERF_COUNTER_TYPE_BYTES = 3,
+    /** ns spent since the device was opened, as a COUNT */
+    HW_PERF_COUNTER_TYPE_TIME_NS = 4,
+    /** the largest duration seen in ns, a gauge */
+    HW_PERF_COUNTER_TYPE_MAX_NS = 5,
+};
+
+typedef struct hw_perf_counter {
+    /** nul terminated, at most HW_PERF_COUNTER_NAME_MAX - 1 characters */
+    char name[HW_PERF_COUNTER_NAME_MAX];
+    /** HW_PERF_COUNTER_TYPE_* */
+    uint32_t type;
+    uint32_t reserved;
+    int64_t value;
+} hw_perf_counter_t;
+
+#define HARDWARE_DEVICE_EXT_TAG MAKE_TAG_CONSTANT('H', 'W', 'D', 'X')
+
+/** hw_device_ext_t up to get_perf_counters */
+#define HARDWARE_DEVICE_EXT_VERSION_1   1
+#define HARDWARE_DEVICE_EXT_VERSION     HARDWARE_DEVICE_EXT_VERSION_1
+
 /**
- * Name of the hal_module_info
+ * Extensions of hw_device_t, pointed to by its ext field, typically a
+ * static const of the module. Later versions only append fields: users
+ * check version before using a field and go through libhardware, e.g.
+ * hw_device_get_perf_counters(), rather than calling them directly.
  */
+typedef struct hw_device_ext {
+    /** tag must be initialized to HARDWARE_DEVICE_EXT_TAG */
+    uint32_t tag;
+
+    /** HARDWARE_DEVICE_EXT_VERSION_* this implements */
+    uint32_t version;
+
+    /**
+     * Fills in up to count of the performance counters of the device, in
+     * an order that is the same for every call as long as the number of
+     * counters does not change. counters may be NULL to only query how
+     * many there are. May be called from any thread, at any time the
+     * device is open, and must not block on I/O. NULL if the device has
+     * no counters.
+     *
+     * Version 1.
+     *
+     * @return: the number of counters of the device, which may exceed
+     *          count, or a negative errno
+     */
+    int (*get_perf_counters)(const struct hw_device_t* device,
+            hw_perf_counter_t* counters, size_t count);
+
+    /** reserved for future use, zero */
+    void* reserved[8];
+} hw_device_ext_t;
+
+/**
+ * For implementations of get_perf_counters(): sets the counter at *index
+ * if there is room for it and moves *index on either way, so that the
+ * final *index is the number of counters to return.
+ */
+static inline void hw_perf_counter_put(hw_perf_counter_t* counters,
+        size_t count, size_t* index, const char* name, uint32_t type,
+        int64_t value)
+{
+    if (counters && *index < count) {
+        hw_perf_counter_t* c = &counters[*index];
+        size_t i;
+        for (i = 0; i + 1 < HW_PERF_COUNTER_NAME_MAX && name[i]; i++)
+            c->name[i] = name[i];
+        c->name[i] = '\0';
+        c->type = type;
+        c->reserved = 0;
+        c->value = value;
+    }
+    (*index)++;
+}
+
+/**
+ * Name of the hal_module_info. A module built into a process with
+ * HAL_MODULE_BUILTIN() gives it a name of its own with
+ * -DHAL_MODULE_INFO_SYM=..., so that several can be linked together.
+ */
+#ifndef HAL_MODULE_INFO_SYM
 #define HAL_MODULE_INFO_SYM         HMI
+#endif
 
 /**
  * Name of the hal_module_info as a string
@@ -233,6 +349,145 @@ int hw_get_module(const char *id, const struct hw_module_t **module);
 int hw_get_module_by_class(const char *class_id, const char *inst,
                            const struct hw_module_t **module);
 
+/**
+ * A module linked into the process rather than loaded from a file, see
+ * HAL_MODULE_BUILTIN().
+ */
+typedef struct hw_builtin_module {
+    /** "<class_id>[.<inst>]", as looked up by hw_get_module_by_class() */
+    const char *name;
+    const struct hw_module_t *module;
+    struct hw_builtin_module *next;
+} hw_builtin_module_t;
+
+/**
+ * Make a module linked into the process the one hw_get_module_by_class()
+ * returns for its name, before any file in the HAL directories and
+ * without a dlopen(). The entry is not copied and must stay valid.
+ */
+void hw_register_builtin_module(hw_builtin_module_t *builtin);
+
+/**
+ * Registers the HAL_MODULE_INFO_SYM of the file it is used in under name,
+ * from a constructor, e.g. HAL_MODULE_BUILTIN("power"). The file must be
+ * built with HAL_MODULE_INFO_SYM defined to a name unique in the process,
+ * and linked as a whole static library, as nothing references it.
+ */
+#define HAL_MODULE_BUILTIN(name) \
+    static hw_builtin_module_t hal_builtin_module = { \
+        (name), (const struct hw_module_t *)&HAL_MODULE_INFO_SYM, NULL \
+    }; \
+    __attribute__((constructor)) static void hal_builtin_module_register(void) \
+    { \
+        hw_register_builtin_module(&hal_builtin_module); \
+    }
+
+/**
+ * Release a module returned by hw_get_module() or hw_get_module_by_class().
+ *
+ * Every successful lookup takes a reference on the module. Once all of
+ * them are put, the module is unloaded after being idle for
+ * ro.hal.unload_idle_ms.<class_id>[.<inst>] ms, or ro.hal.unload_idle_ms
+ * if that is not set: 0 unloads it right away, and without either
+ * property it stays loaded for the life of the process. A later lookup
+ * loads it again. Every device opened from the module must be closed
+ * before its last reference is put, as the module's code goes away.
+ *
+ * Built-in modules are never unloaded.
+ *
+ * @return: 0 == success, -ENOENT if the module is not held by a lookup
+ *          that was not put yet, or was dropped by
+ *          hw_module_cache_invalidate(), in which case it stays loaded
+ */
+int hw_put_module(const struct hw_module_t *module);
+
+/**
+ * Drop every module resolved so far from the process-wide lookup cache.
+ *
+ * hw_get_module() and hw_get_module_by_class() remember the module they
+ * resolved for each (class_id, inst) pair and return it directly on later
+ * calls. After this call the next lookup re-reads the variant properties
+ * and probes the HAL directories again. Already loaded modules are not
+ * unloaded and pointers previously returned remain valid; hw_put_module()
+ * does not unload them either.
+ */
+void hw_module_cache_invalidate(void);
+
+/**
+ * Start loading the modules listed in 'ids' in the background.
+ *
+ * The ids are the ones passed to hw_get_module(). They are copied, so the
+ * caller may free them as soon as this returns. Up to four worker threads
+ * resolve and dlopen the modules while the caller continues; a later
+ * hw_get_module() for a module that is still being loaded waits for that
+ * load to complete rather than starting a second one.
+ *
+ * @return: 0 if the preload was started, <0 == error
+ */
+int hw_preload_modules(const char **ids, size_t count);
+
+/**
+ * Time spent resolving and loading one module, as recorded by
+ * hw_get_module_by_class() the last time it had to load it.
+ */
+typedef struct hw_module_load_timing {
+    /** "<class_id>.<inst>" name of the module, possibly truncated */
+    char name[64];
+
+    /** result of the load, 0 or a negative errno */
+    int status;
+
+    /** looking up properties and the HAL directories for a variant */
+    int64_t probe_ns;
+
+    /** dlopen(), including relocation of the module */
+    int64_t dlopen_ns;
+
+    /** dlsym() of HAL_MODULE_INFO_SYM */
+    int64_t dlsym_ns;
+
+    /** the whole lookup, from the first probe to the loaded module */
+    int64_t total_ns;
+} hw_module_load_timing_t;
+
+/**
+ * Copy the recorded load timings of up to 'count' modules into 'timings'.
+ * 'timings' may be NULL to only query the number of records.
+ *
+ * Setting the debug.hal.log_load_timing property to 1 additionally logs
+ * each record as the load completes.
+ *
+ * @return: the number of records available, which may exceed 'count'
+ */
+size_t hw_get_module_load_timings(hw_module_load_timing_t *timings,
+                                  size_t count);
+
+/**
+ * Log the recorded load timing of every module loaded so far.
+ */
+void hw_dump_module_load_timings(void);
+
+/**
+ * Copy up to 'count' performance counters of an open device into
+ * 'counters', see hw_device_ext_t. 'counters' may be NULL to only query
+ * the number of counters.
+ *
+ * @return: the number of counters of the device, which may exceed
+ *          'count', -ENOSYS if it has none or its module predates
+ *          HARDWARE_HAL_API_VERSION_1_1, or another negative errno
+ */
+int hw_device_get_perf_counters(const struct hw_device_t *device,
+                                hw_perf_counter_t *counters, size_t count);
+
+/**
+ * Print the performance counters of an open device to fd, one
+ * "<prefix><name> <value>" line each, e.g. from its dump().
+ *
+ * @return: the number of counters printed, or a negative errno
+ */
+int hw_device_dump_perf_counters(const struct hw_device_t *device, int fd,
+                                 const char *prefix);
+
 __END_DECLS
 
 #endif  /* ANDROID_INCLUDE_HARDWARE_HARDWARE_H */
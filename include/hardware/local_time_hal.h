@@ -19,6 +19,7 @@
 #define ANDROID_LOCAL_TIME_HAL_INTERFACE_H
 
 #include <stdint.h>
+#include <time.h>
 
 #include <hardware/hardware.h>
 
@@ -34,6 +35,11 @@ __BEGIN_DECLS
  */
 #define LOCAL_TIME_HARDWARE_INTERFACE "local_time_hw_if"
 
+/**
+ * Device versions, get_shared_time_fd is available from 1.0 on
+ */
+#define LOCAL_TIME_DEVICE_API_VERSION_1_0 HARDWARE_DEVICE_API_VERSION(1, 0)
+
 /**********************************************************************/
 
 /**
@@ -98,10 +104,74 @@ struct local_time_hw_device {
     int (*get_debug_log)(struct local_time_hw_device* dev,
                          struct local_time_debug_event* records,
                          int max_records);
+
+    /**
+     * Only present from LOCAL_TIME_DEVICE_API_VERSION_1_0 on, and may be
+     * NULL for HALs whose counter is not derived from CLOCK_MONOTONIC.
+     *
+     * Returns a read only fd of a shared memory region holding a struct
+     * local_time_shared, to be mapped with PROT_READ and read with
+     * local_time_shared_read(), or a negative errno. The caller owns the
+     * fd; the mapping stays valid after the device is closed.
+     */
+    int (*get_shared_time_fd)(struct local_time_hw_device* dev);
 };
 
 typedef struct local_time_hw_device local_time_hw_device_t;
 
+/**
+ * The time base of a HAL that counts local time in software, published in
+ * shared memory so that clients querying it at a high rate neither call
+ * into the HAL nor make a syscall: local time is
+ *
+ *   base_local + d + d * slew_q32 / 2^32, d = CLOCK_MONOTONIC - base_mono
+ *
+ * in nanoseconds. The HAL rebases whenever the slew changes. Readers use
+ * local_time_shared_read(), base_* and slew_q32 are written under the
+ * sequence lock seq, which is odd while they change.
+ */
+#define LOCAL_TIME_SHARED_MAGIC 0x4c544d42  /* 'LTMB' */
+
+struct local_time_shared {
+    uint32_t magic;
+    uint32_t seq;
+    int64_t base_mono;
+    int64_t base_local;
+    /* slew as a fraction of the nominal rate, in units of 2^-32 */
+    int64_t slew_q32;
+};
+
+static inline int64_t local_time_from_base(int64_t base_mono, int64_t base_local,
+        int64_t slew_q32, int64_t mono)
+{
+    int64_t d = mono - base_mono;
+    /* split so that neither product overflows for years */
+    int64_t adj = (d >> 32) * slew_q32 +
+            ((int64_t)((uint64_t)d & 0xffffffffu) * slew_q32 >> 32);
+    return base_local + d + adj;
+}
+
+/** The local time read from a mapped struct local_time_shared */
+static inline int64_t local_time_shared_read(const struct local_time_shared* s)
+{
+    uint32_t seq;
+    int64_t base_mono, base_local, slew_q32;
+    struct timespec ts;
+
+    do {
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        base_mono = __atomic_load_n(&s->base_mono, __ATOMIC_RELAXED);
+        base_local = __atomic_load_n(&s->base_local, __ATOMIC_RELAXED);
+        slew_q32 = __atomic_load_n(&s->slew_q32, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&s->seq, __ATOMIC_RELAXED));
+
+    /* served by the vDSO, no syscall */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return local_time_from_base(base_mono, base_local, slew_q32,
+            (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
 /** convenience API for opening and closing a supported device */
 
 static inline int local_time_hw_device_open(
@@ -52,7 +52,8 @@ typedef enum {
      */
     POWER_HINT_VIDEO_ENCODE = 0x00000003,
     POWER_HINT_VIDEO_DECODE = 0x00000004,
-    POWER_HINT_LOW_POWER = 0x00000005
+    POWER_HINT_LOW_POWER = 0x00000005,
+    POWER_HINT_LAUNCH = 0x00000008
 } power_hint_t;
 
 typedef enum {
@@ -131,6 +132,13 @@ typedef struct power_module {
      *     parameter is non-zero when low power mode is activated, and zero
      *     when deactivated.
      *
+     * POWER_HINT_LAUNCH
+     *
+     *     An app is being launched. CPU load is expected until its first
+     *     frame is drawn, and it may be appropriate to raise speeds of CPU,
+     *     memory bus, etc. The data parameter is non-zero when the launch
+     *     starts, and zero once it is done.
+     *
      * A particular platform may choose to ignore any hint.
      *
      * availability: version 0.2
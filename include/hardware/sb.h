@@ -20,6 +20,28 @@
 
 #define SHAREBUFFER_HARDWARE_MODULE_ID "sharebuffer"
 
+/*
+ * The hooks up to (*setFrameTimingCallback)() take the place of reserved
+ * slots and are present in every device, each device API version from
+ * 1.1 on appends hooks past the end of the original structure:
+ *
+ * 1.1 adds setLayerHints()
+ * 1.2 adds isFormatSupported()
+ * 1.3 adds getVsync()
+ * 1.4 adds setMailbox()
+ * 1.5 adds setAcquireFence()
+ * 1.6 adds registerLayer(), selectLayer() and closeLayerId()
+ * 1.7 adds setLayerPosition()
+ */
+#define SHAREBUFFER_DEVICE_API_VERSION_1_0 HARDWARE_DEVICE_API_VERSION(1, 0)
+#define SHAREBUFFER_DEVICE_API_VERSION_1_1 HARDWARE_DEVICE_API_VERSION(1, 1)
+#define SHAREBUFFER_DEVICE_API_VERSION_1_2 HARDWARE_DEVICE_API_VERSION(1, 2)
+#define SHAREBUFFER_DEVICE_API_VERSION_1_3 HARDWARE_DEVICE_API_VERSION(1, 3)
+#define SHAREBUFFER_DEVICE_API_VERSION_1_4 HARDWARE_DEVICE_API_VERSION(1, 4)
+#define SHAREBUFFER_DEVICE_API_VERSION_1_5 HARDWARE_DEVICE_API_VERSION(1, 5)
+#define SHAREBUFFER_DEVICE_API_VERSION_1_6 HARDWARE_DEVICE_API_VERSION(1, 6)
+#define SHAREBUFFER_DEVICE_API_VERSION_1_7 HARDWARE_DEVICE_API_VERSION(1, 7)
+
 #include <stdint.h>
 #include <sys/cdefs.h>
 #include <sys/types.h>
@@ -33,6 +55,111 @@ __BEGIN_DECLS
 
 /*****************************************************************************/
 
+/* A rectangle in buffer coordinates, right and bottom are exclusive. */
+typedef struct sb_rect {
+    int left;
+    int top;
+    int right;
+    int bottom;
+} sb_rect_t;
+
+/* Geometry of a buffer, as passed to (*post)(). */
+typedef struct sb_buffer_info {
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    int32_t pixel_format;
+} sb_buffer_info_t;
+
+/*
+ * What became of a posted frame, see (*setFrameTimingCallback)(). Times
+ * are CLOCK_MONOTONIC nanoseconds, 0 when the renderer did not report
+ * them.
+ */
+typedef struct sb_frame_timing {
+    buffer_handle_t buffer;
+    /* counts the posts of the layer, starting at 1 */
+    uint64_t frame_number;
+    /* when (*post)() handed the frame to the renderer */
+    int64_t post_ns;
+    /* when the renderer latched the buffer for composition */
+    int64_t latch_ns;
+    /* when the composition showing the frame reached the display */
+    int64_t present_ns;
+    /* nonzero if the renderer failed to show the frame */
+    int failed;
+} sb_frame_timing_t;
+
+typedef void (*sb_frame_timing_callback_t)(void *data, const char *layer,
+        const sb_frame_timing_t *timing);
+
+/* sb_layer_hints_t flags */
+enum {
+    /* the buffer has no meaningful alpha, blending may be skipped */
+    SB_HINT_OPAQUE      = 0x01,
+    /* the layer covers the whole output and may be scanned out directly */
+    SB_HINT_FULLSCREEN  = 0x02,
+    /*
+     * the layer is shown below the other layers of the process, through
+     * their transparent pixels, e.g. a camera preview behind its controls
+     */
+    SB_HINT_UNDERLAY    = 0x04,
+    /*
+     * the layer is a small buffer shown above the other layers of the
+     * process at its frame, e.g. a cursor, and moved with
+     * (*setLayerPosition)() rather than posted again
+     */
+    SB_HINT_OVERLAY     = 0x08,
+};
+
+/*
+ * How the layer is to be composited, see (*setLayerHints)(). Empty
+ * rectangles select the whole buffer or output.
+ */
+typedef struct sb_layer_hints {
+    uint32_t flags;
+    /* HAL_TRANSFORM_* to apply to the buffer */
+    int32_t transform;
+    /* part of the buffer to show */
+    sb_rect_t crop;
+    /* where to show it on the output */
+    sb_rect_t frame;
+    /* 0 (transparent) to 255 (opaque) */
+    uint8_t plane_alpha;
+} sb_layer_hints_t;
+
+#define SB_LATENCY_BUCKETS 16
+
+/*
+ * Transport statistics of one layer, see (*getStats)().
+ *
+ * Latency runs from a post to its acknowledgement: the status reply when
+ * posting over the socket, the release of the buffer by the renderer when
+ * the post went through the shared memory ring. Bucket 0 counts latencies
+ * below 32us, bucket i latencies in [2^(i+4), 2^(i+5)) us and the last
+ * bucket everything above.
+ */
+typedef struct sharebuffer_layer_stats {
+    char name[64];
+    int connected;
+
+    uint64_t frames_posted;
+    /* posts that never reached the renderer */
+    uint64_t frames_dropped;
+    /* posts the renderer reported it failed to show */
+    uint64_t frames_failed;
+    /* mailbox posts a newer post replaced before they were shown */
+    uint64_t frames_replaced;
+    /* posts not sent since the screen was blank or the layer occluded */
+    uint64_t frames_skipped;
+    uint64_t reconnects;
+    uint64_t registrations;
+
+    uint64_t latency_count;
+    int64_t latency_total_ns;
+    int64_t latency_max_ns;
+    uint32_t latency_histogram[SB_LATENCY_BUCKETS];
+} sharebuffer_layer_stats_t;
 
 /*****************************************************************************/
 
@@ -141,17 +268,259 @@ typedef struct sharebuffer_device_t {
      * (*enableScreen)() is used to either blank (enable=0) or
      * unblank (enable=1) the screen this framebuffer is attached to.
      *
+     * While the screen is blank, and while the renderer reports a layer
+     * as occluded, posts of that layer are not sent to the renderer: they
+     * return at once, with a release fence of -1, and still count as
+     * posted. The first post once the layer can be seen again damages
+     * the whole buffer.
+     *
      * Returns 0 on success or -errno on error.
      */
     int (*enableScreen)(struct sharebuffer_device_t* dev, int enable);
 
     int (*is_connected)(struct sharebuffer_device_t *dev);
 
+    /*
+     * Select the layer that posts from the calling thread go to. Every
+     * layer has its own connection to the renderer, so threads posting
+     * different layers do not serialize against each other.
+     */
     void (*set_layer_name)(struct sharebuffer_device_t *dev, const char *name);
 
+    /*
+     * Tell the renderer that the layer is gone and drop its connection.
+     */
     void (*close_layer)(struct sharebuffer_device_t *dev, const char *name);
 
-    void* reserved_proc[6];
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Same as (*post)() but pipelined: once the buffer is known to the
+     * renderer this returns as soon as it is queued, blocking only while
+     * the configured number of frames (ro.sharebuffer.post_depth, 2 by
+     * default) is still held by the renderer.
+     *
+     * *releaseFenceFd is set to a sync fence that signals when the
+     * renderer no longer reads <buffer>, or to -1 if the buffer may be
+     * reused as soon as this returns. The caller owns the fence.
+     *
+     * Returns 0 on success or -errno on error.
+     */
+    int (*postAsync)(struct sharebuffer_device_t* dev, buffer_handle_t buffer,
+            uint32_t width, uint32_t height, uint32_t stride,
+            int32_t pixel_format, int *releaseFenceFd);
+
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Tells sharebuffer that <buffer> is about to be freed so that the
+     * renderer can drop its import and the slot can be reused. Must be
+     * called before the handle is released if it was ever posted.
+     */
+    void (*freeBuffer)(struct sharebuffer_device_t* dev, buffer_handle_t buffer);
+
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Sets the areas of the next buffer posted from the calling thread
+     * that changed since the previous post of its layer, so the renderer
+     * only has to upload and recomposite those. The damage applies to a
+     * single post; with num_rects == 0 the whole buffer is damaged, which
+     * is also the default. (*setUpdateRect)() is the single rectangle
+     * version of this call.
+     *
+     * Returns 0 on success or -errno on error.
+     */
+    int (*setDamage)(struct sharebuffer_device_t* dev,
+            const sb_rect_t *rects, size_t num_rects);
+
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Copies the statistics of up to <count> layers into <stats>, which
+     * may be NULL to only query the number of layers.
+     *
+     * Returns the number of layers, which may exceed <count>.
+     */
+    size_t (*getStats)(struct sharebuffer_device_t* dev,
+            sharebuffer_layer_stats_t *stats, size_t count);
+
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Registers <count> buffers of the calling thread's layer with the
+     * renderer ahead of their first post, e.g. all buffers of a
+     * BufferQueue once they are allocated, so the first frames do not pay
+     * a round trip each. Nothing is shown. Buffers already known to the
+     * renderer are skipped; when the renderer does not support batched
+     * registration the buffers are registered by their first post instead.
+     *
+     * Returns 0 on success or -errno on error.
+     */
+    int (*registerBuffers)(struct sharebuffer_device_t* dev,
+            const buffer_handle_t *buffers, const sb_buffer_info_t *info,
+            size_t count);
+
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Installs a callback receiving the timing of every frame posted on
+     * any layer once the renderer acknowledged it, for frame pacing and
+     * latency aware scheduling. With the shared memory ring the callback
+     * runs when the renderer releases the buffer, on a sharebuffer thread
+     * or the posting thread; it must not call back into the device. Pass
+     * NULL to remove it.
+     */
+    void (*setFrameTimingCallback)(struct sharebuffer_device_t* dev,
+            sb_frame_timing_callback_t callback, void *data);
+
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Only present from SHAREBUFFER_DEVICE_API_VERSION_1_1.
+     *
+     * Sets the composition hints of the calling thread's layer, which
+     * apply to all its following posts until changed. A fullscreen opaque
+     * layer lets the renderer scan the buffer out directly or at least
+     * skip blending. NULL restores the defaults: no flags, no transform,
+     * the whole buffer on the whole output, fully opaque plane alpha.
+     * Hints are dropped silently by renderers that do not support them,
+     * except SB_HINT_UNDERLAY, which changes what is shown: it fails with
+     * -ENOTSUP while the layer is connected to a renderer that does not
+     * stack layers that way. A layer is not both an underlay and an
+     * overlay.
+     *
+     * Returns 0 on success or -errno on error.
+     */
+    int (*setLayerHints)(struct sharebuffer_device_t* dev,
+            const sb_layer_hints_t *hints);
+
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Only present from SHAREBUFFER_DEVICE_API_VERSION_1_2.
+     *
+     * Tells whether the renderer of the calling thread's layer imports
+     * buffers of the HAL_PIXEL_FORMAT_* <format> as they are, e.g. YUV
+     * video buffers, so producers only convert when they have to. Without
+     * a connection, or with a renderer that does not report its formats,
+     * only the RGB formats of the gralloc module are reported.
+     *
+     * Posting a buffer of a format the renderer reported it does not
+     * support fails with -EINVAL.
+     *
+     * Returns 1 if supported, 0 if not.
+     */
+    int (*isFormatSupported)(struct sharebuffer_device_t* dev, int32_t format);
+
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Only present from SHAREBUFFER_DEVICE_API_VERSION_1_3.
+     *
+     * Returns in *timestamp the CLOCK_MONOTONIC time in nanoseconds of the
+     * latest vsync of the renderer's output, as last reported by the
+     * renderer on any layer of the process, and in *period its refresh
+     * period. Does not block.
+     *
+     * Returns 0 on success, or -ENODEV if the renderer did not report any
+     * vsync, in which case *timestamp is 0 and *period is derived from fps.
+     */
+    int (*getVsync)(struct sharebuffer_device_t* dev, int64_t *timestamp,
+            int64_t *period);
+
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Only present from SHAREBUFFER_DEVICE_API_VERSION_1_4.
+     *
+     * Switches the posts of the calling thread's layer to mailbox mode
+     * when <enable> is nonzero: instead of showing every post in order,
+     * the renderer shows the newest one when it composes and releases the
+     * posts it skipped without showing them, and (*post)() no longer
+     * waits for the renderer to catch up. Interactive layers get the
+     * lowest latency this way when the renderer is slower than they are.
+     * Skipped posts are reported to the frame timing callback with a
+     * present time of 0 and counted in frames_replaced.
+     *
+     * Only renderers supporting version 5 of the post ring replace posts,
+     * with others every post is still shown in order.
+     *
+     * Returns 0 on success or -errno on error.
+     */
+    int (*setMailbox)(struct sharebuffer_device_t* dev, int enable);
+
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Only present from SHAREBUFFER_DEVICE_API_VERSION_1_5.
+     *
+     * Hands over the acquire fence of the next buffer posted from the
+     * calling thread, a sync fence that signals once its producer is done
+     * writing it, or -1 for none. sharebuffer owns the fence from then on.
+     * With a renderer that supports it, the fence is sent along with the
+     * post and the renderer waits for it on its GPU; otherwise, and when
+     * the buffer is registered by this post, (*post)() waits for it on the
+     * CPU first. A fence the post is skipped or dropped with is closed.
+     *
+     * Returns 0 on success or -errno on error.
+     */
+    int (*setAcquireFence)(struct sharebuffer_device_t* dev, int fenceFd);
+
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Only present from SHAREBUFFER_DEVICE_API_VERSION_1_6.
+     *
+     * Registers the layer <name> and returns its id, a small positive
+     * integer, or -errno on error. Registering a name again returns the
+     * same id until the layer is closed; ids are not reused afterwards.
+     * Nothing is selected, see (*selectLayer)().
+     */
+    int (*registerLayer)(struct sharebuffer_device_t* dev, const char *name);
+
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Only present from SHAREBUFFER_DEVICE_API_VERSION_1_6.
+     *
+     * Same as (*set_layer_name)() for a layer returned by
+     * (*registerLayer)(), without looking up its name: selecting the layer
+     * the calling thread already posts to costs nothing, so it may be
+     * called before every post.
+     *
+     * Returns 0 on success, or -ENOENT if the layer was closed.
+     */
+    int (*selectLayer)(struct sharebuffer_device_t* dev, int layer);
+
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Only present from SHAREBUFFER_DEVICE_API_VERSION_1_6.
+     *
+     * Same as (*close_layer)() for a layer returned by (*registerLayer)().
+     *
+     * Returns 0 on success, or -ENOENT if the layer was closed already.
+     */
+    int (*closeLayerId)(struct sharebuffer_device_t* dev, int layer);
+
+    /*
+     * This hook is OPTIONAL.
+     *
+     * Only present from SHAREBUFFER_DEVICE_API_VERSION_1_7.
+     *
+     * Moves the calling thread's layer, which must have SB_HINT_OVERLAY
+     * and a frame set with (*setLayerHints)(), so that the top left corner
+     * of its frame is at <x>, <y> on the output. The frame keeps its size.
+     * The renderer moves what it shows of the layer without the buffer
+     * being posted again, so moving a cursor costs one small message and
+     * no round trip. Renderers that do not support overlays only show
+     * the move with the next post of the layer.
+     *
+     * Returns 0 on success, or -EINVAL if the layer is not an overlay with
+     * a frame.
+     */
+    int (*setLayerPosition)(struct sharebuffer_device_t* dev, int x, int y);
 
 } sharebuffer_device_t;
 
@@ -23,6 +23,12 @@ __BEGIN_DECLS
 
 #define VIBRATOR_API_VERSION HARDWARE_MODULE_API_VERSION(1,0)
 
+/**
+ * Device versions, vibrator_pattern is available from 1.1 on
+ */
+#define VIBRATOR_DEVICE_API_VERSION_1_0 HARDWARE_DEVICE_API_VERSION(1,0)
+#define VIBRATOR_DEVICE_API_VERSION_1_1 HARDWARE_DEVICE_API_VERSION(1,1)
+
 /**
  * The id of this module
  */
@@ -62,8 +68,32 @@ typedef struct vibrator_device {
      * @return 0 in case of success, negative errno code else
      */
     int (*vibrator_off)(struct vibrator_device* vibradev);
+
+    /** Play an on/off waveform
+     *
+     * Only present from VIBRATOR_DEVICE_API_VERSION_1_1 on.
+     *
+     * The waveform is played by the HAL on its own, so that e.g. keyboard
+     * haptics cost a single call per pattern rather than one per step. It
+     * replaces whatever is playing; vibrator_on and vibrator_off stop it.
+     *
+     * @param timings_ms durations in milliseconds of alternating off and
+     *        on steps, starting with off, as in android.os.Vibrator
+     * @param count number of timings, at most VIBRATOR_MAX_PATTERN
+     * @param repeat index in timings_ms to play again from once the end is
+     *        reached, or -1 to play it once
+     *
+     * @return 0 in case of success, negative errno code else
+     */
+    int (*vibrator_pattern)(struct vibrator_device* vibradev,
+            const unsigned int* timings_ms, size_t count, int repeat);
 } vibrator_device_t;
 
+/**
+ * Longest pattern vibrator_pattern takes
+ */
+#define VIBRATOR_MAX_PATTERN 64
+
 static inline int vibrator_open(const struct hw_module_t* module, vibrator_device_t** device)
 {
     return module->methods->open(module, VIBRATOR_DEVICE_ID_MAIN, (struct hw_device_t**)device);
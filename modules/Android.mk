@@ -1,4 +1,5 @@
 hardware_modules := gralloc hwcomposer audio nfc nfc-nci local_time \
 	power usbaudio audio_remote_submix camera consumerir sensors vibrator \
-	tv_input fingerprint
+	tv_input fingerprint memtrack sfdroid_ipc sfdroid_audio sfdroid_gps \
+	audio_effect_chain
 include $(call all-named-subdir-makefiles,$(hardware_modules))
@@ -18,28 +18,137 @@
 //#define LOG_NDEBUG 0
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/time.h>
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
+#include <cutils/str_parms.h>
 
 #include <hardware/hardware.h>
 #include <system/audio.h>
 #include <hardware/audio.h>
 
+/*
+ * A null sink and source: nothing is played or recorded, but streams are
+ * paced by an absolute CLOCK_MONOTONIC schedule, so that the framework
+ * sees the timing a real device with one buffer of latency would have
+ * and its mixing throughput can be benchmarked. A write returns once the
+ * buffer before it would have been played; a read once its buffer would
+ * have been recorded. A caller late by more than a buffer is an underrun
+ * (or overrun): the schedule restarts from the time of the late call
+ * rather than letting the stream catch up in a burst.
+ *
+ * With audio.null.capture_kb set, the last that many KiB written to an
+ * output are kept in a ring, written to a file by the set_parameters()
+ * key "null_capture_path", e.g. to check what the mixer produced.
+ */
+
 struct stub_audio_device {
     struct audio_hw_device device;
 };
 
+/* the schedule of a stream, since it left standby */
+struct null_clock {
+    uint32_t rate;
+    bool running;
+    /* CLOCK_MONOTONIC time of the first frame */
+    int64_t start_ns;
+    /* frames scheduled since start_ns */
+    uint64_t frames;
+    /* underruns or overruns */
+    uint32_t xruns;
+};
+
 struct stub_stream_out {
     struct audio_stream_out stream;
+
+    pthread_mutex_t lock;
+    struct null_clock clock;
+    /* frames rendered before the current run */
+    uint64_t frames_base;
+
+    /* written PCM, kept while audio.null.capture_kb is set */
+    uint8_t *capture;
+    size_t capture_size;
+    size_t capture_pos;
+    bool capture_wrapped;
 };
 
 struct stub_stream_in {
     struct audio_stream_in stream;
+
+    pthread_mutex_t lock;
+    struct null_clock clock;
 };
 
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t frames_to_ns(uint64_t frames, uint32_t rate)
+{
+    return (int64_t)(frames * 1000000000ULL / rate);
+}
+
+static void sleep_until(int64_t deadline_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = deadline_ns / 1000000000LL;
+    ts.tv_nsec = deadline_ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* frames of the current run played or recorded by now */
+static uint64_t null_clock_position(const struct null_clock *clock, int64_t now)
+{
+    uint64_t elapsed;
+
+    if (!clock->running || now <= clock->start_ns)
+        return 0;
+    elapsed = (uint64_t)(now - clock->start_ns) * clock->rate / 1000000000ULL;
+    return elapsed < clock->frames ? elapsed : clock->frames;
+}
+
+/*
+ * Schedules frames more frames and returns the time at which the call
+ * should return: with lag frames of latency, when all but that many of
+ * the frames scheduled so far are due.
+ */
+static int64_t null_clock_advance(struct null_clock *clock, uint64_t frames,
+                                  uint64_t lag, int64_t now)
+{
+    uint64_t due;
+
+    if (!clock->running) {
+        clock->running = true;
+        clock->start_ns = now;
+        clock->frames = 0;
+    } else if (now > clock->start_ns + frames_to_ns(clock->frames + frames,
+                                                    clock->rate)) {
+        /* missed the whole buffer, start over from now */
+        clock->xruns++;
+        clock->start_ns = now - frames_to_ns(clock->frames, clock->rate);
+    }
+    clock->frames += frames;
+    due = clock->frames > lag ? clock->frames - lag : 0;
+    return clock->start_ns + frames_to_ns(due, clock->rate);
+}
+
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
     return 44100;
@@ -72,17 +181,70 @@ static int out_set_format(struct audio_stream *stream, audio_format_t format)
 
 static int out_standby(struct audio_stream *stream)
 {
+    struct stub_stream_out *out = (struct stub_stream_out *)stream;
+
+    pthread_mutex_lock(&out->lock);
+    /* what was not played yet is dropped, as by a device */
+    out->frames_base += null_clock_position(&out->clock, now_ns());
+    out->clock.running = false;
+    pthread_mutex_unlock(&out->lock);
     return 0;
 }
 
 static int out_dump(const struct audio_stream *stream, int fd)
 {
+    struct stub_stream_out *out = (struct stub_stream_out *)stream;
+
+    pthread_mutex_lock(&out->lock);
+    dprintf(fd, "    null output: %s, rendered %llu frames, underruns %u, "
+            "capture %zu bytes\n", out->clock.running ? "running" : "standby",
+            (unsigned long long)(out->frames_base +
+                                 null_clock_position(&out->clock, now_ns())),
+            out->clock.xruns,
+            out->capture_wrapped ? out->capture_size : out->capture_pos);
+    pthread_mutex_unlock(&out->lock);
     return 0;
 }
 
+/* with out->lock held */
+static int out_save_capture_l(struct stub_stream_out *out, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ret = 0;
+
+    if (fd < 0)
+        return -errno;
+    /* oldest first */
+    if (out->capture_wrapped &&
+            write(fd, out->capture + out->capture_pos,
+                  out->capture_size - out->capture_pos) < 0)
+        ret = -errno;
+    if (ret == 0 && write(fd, out->capture, out->capture_pos) < 0)
+        ret = -errno;
+    close(fd);
+    return ret;
+}
+
 static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
 {
-    return 0;
+    struct stub_stream_out *out = (struct stub_stream_out *)stream;
+    struct str_parms *parms;
+    char value[PATH_MAX];
+    int ret = 0;
+
+    parms = str_parms_create_str(kvpairs);
+    if (!parms)
+        return -ENOMEM;
+    if (str_parms_get_str(parms, "null_capture_path", value,
+                          sizeof(value)) >= 0) {
+        pthread_mutex_lock(&out->lock);
+        ret = out->capture ? out_save_capture_l(out, value) : -ENOSYS;
+        pthread_mutex_unlock(&out->lock);
+        ALOGE_IF(ret < 0, "couldn't save the capture to %s: %s", value,
+                 strerror(-ret));
+    }
+    str_parms_destroy(parms);
+    return ret;
 }
 
 static char * out_get_parameters(const struct audio_stream *stream, const char *keys)
@@ -92,7 +254,10 @@ static char * out_get_parameters(const struct audio_stream *stream, const char *
 
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
-    return 0;
+    /* the one buffer a write may be ahead of the schedule */
+    return out_get_buffer_size(&stream->common) * 1000 /
+            audio_stream_out_frame_size(stream) /
+            out_get_sample_rate(&stream->common);
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left,
@@ -101,19 +266,74 @@ static int out_set_volume(struct audio_stream_out *stream, float left,
     return 0;
 }
 
+/* with out->lock held */
+static void out_capture_l(struct stub_stream_out *out, const uint8_t *buffer,
+                          size_t bytes)
+{
+    size_t n;
+
+    if (bytes > out->capture_size) {
+        buffer += bytes - out->capture_size;
+        bytes = out->capture_size;
+    }
+    while (bytes > 0) {
+        n = out->capture_size - out->capture_pos;
+        if (n > bytes)
+            n = bytes;
+        memcpy(out->capture + out->capture_pos, buffer, n);
+        buffer += n;
+        bytes -= n;
+        out->capture_pos += n;
+        if (out->capture_pos == out->capture_size) {
+            out->capture_pos = 0;
+            out->capture_wrapped = true;
+        }
+    }
+}
+
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
                          size_t bytes)
 {
-    /* XXX: fake timing for audio output */
-    usleep(bytes * 1000000 / audio_stream_out_frame_size(stream) /
-           out_get_sample_rate(&stream->common));
+    struct stub_stream_out *out = (struct stub_stream_out *)stream;
+    size_t frame_size = audio_stream_out_frame_size(stream);
+    uint64_t lag = out_get_buffer_size(&stream->common) / frame_size;
+    int64_t deadline;
+
+    pthread_mutex_lock(&out->lock);
+    deadline = null_clock_advance(&out->clock, bytes / frame_size, lag,
+                                  now_ns());
+    if (out->capture)
+        out_capture_l(out, buffer, bytes);
+    pthread_mutex_unlock(&out->lock);
+
+    sleep_until(deadline);
     return bytes;
 }
 
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
-    return -EINVAL;
+    struct stub_stream_out *out = (struct stub_stream_out *)stream;
+
+    pthread_mutex_lock(&out->lock);
+    *dsp_frames = (uint32_t)null_clock_position(&out->clock, now_ns());
+    pthread_mutex_unlock(&out->lock);
+    return 0;
+}
+
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames,
+                                         struct timespec *timestamp)
+{
+    struct stub_stream_out *out = (struct stub_stream_out *)stream;
+    int64_t now = now_ns();
+
+    pthread_mutex_lock(&out->lock);
+    *frames = out->frames_base + null_clock_position(&out->clock, now);
+    pthread_mutex_unlock(&out->lock);
+    timestamp->tv_sec = now / 1000000000LL;
+    timestamp->tv_nsec = now % 1000000000LL;
+    return 0;
 }
 
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
@@ -165,6 +385,11 @@ static int in_set_format(struct audio_stream *stream, audio_format_t format)
 
 static int in_standby(struct audio_stream *stream)
 {
+    struct stub_stream_in *in = (struct stub_stream_in *)stream;
+
+    pthread_mutex_lock(&in->lock);
+    in->clock.running = false;
+    pthread_mutex_unlock(&in->lock);
     return 0;
 }
 
@@ -192,9 +417,18 @@ static int in_set_gain(struct audio_stream_in *stream, float gain)
 static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
                        size_t bytes)
 {
-    /* XXX: fake timing for audio input */
-    usleep(bytes * 1000000 / audio_stream_in_frame_size(stream) /
-           in_get_sample_rate(&stream->common));
+    struct stub_stream_in *in = (struct stub_stream_in *)stream;
+    int64_t deadline;
+
+    /* silence, available once it would have been recorded */
+    pthread_mutex_lock(&in->lock);
+    deadline = null_clock_advance(&in->clock,
+                                  bytes / audio_stream_in_frame_size(stream),
+                                  0, now_ns());
+    pthread_mutex_unlock(&in->lock);
+
+    memset(buffer, 0, bytes);
+    sleep_until(deadline);
     return bytes;
 }
 
@@ -223,12 +457,22 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 {
     struct stub_audio_device *ladev = (struct stub_audio_device *)dev;
     struct stub_stream_out *out;
+    char value[PROPERTY_VALUE_MAX];
     int ret;
 
     out = (struct stub_stream_out *)calloc(1, sizeof(struct stub_stream_out));
     if (!out)
         return -ENOMEM;
 
+    pthread_mutex_init(&out->lock, NULL);
+    out->clock.rate = out_get_sample_rate(&out->stream.common);
+    if (property_get("audio.null.capture_kb", value, "0") > 0 &&
+            atoi(value) > 0) {
+        out->capture_size = (size_t)atoi(value) * 1024;
+        out->capture = (uint8_t *)malloc(out->capture_size);
+        ALOGE_IF(!out->capture, "no memory for a %s KiB capture", value);
+    }
+
     out->stream.common.get_sample_rate = out_get_sample_rate;
     out->stream.common.set_sample_rate = out_set_sample_rate;
     out->stream.common.get_buffer_size = out_get_buffer_size;
@@ -246,6 +490,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.write = out_write;
     out->stream.get_render_position = out_get_render_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
+    out->stream.get_presentation_position = out_get_presentation_position;
 
     *stream_out = &out->stream;
     return 0;
@@ -259,7 +504,11 @@ err_open:
 static void adev_close_output_stream(struct audio_hw_device *dev,
                                      struct audio_stream_out *stream)
 {
-    free(stream);
+    struct stub_stream_out *out = (struct stub_stream_out *)stream;
+
+    pthread_mutex_destroy(&out->lock);
+    free(out->capture);
+    free(out);
 }
 
 static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
@@ -341,6 +590,9 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     if (!in)
         return -ENOMEM;
 
+    pthread_mutex_init(&in->lock, NULL);
+    in->clock.rate = in_get_sample_rate(&in->stream.common);
+
     in->stream.common.get_sample_rate = in_get_sample_rate;
     in->stream.common.set_sample_rate = in_set_sample_rate;
     in->stream.common.get_buffer_size = in_get_buffer_size;
@@ -367,9 +619,12 @@ err_open:
 }
 
 static void adev_close_input_stream(struct audio_hw_device *dev,
-                                   struct audio_stream_in *in)
+                                   struct audio_stream_in *stream)
 {
-    return;
+    struct stub_stream_in *in = (struct stub_stream_in *)stream;
+
+    pthread_mutex_destroy(&in->lock);
+    free(in);
 }
 
 static int adev_dump(const audio_hw_device_t *device, int fd)
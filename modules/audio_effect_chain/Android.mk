@@ -0,0 +1,25 @@
+# Copyright (C) 2014 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+LOCAL_PATH := $(call my-dir)
+
+# effects run by the audio HALs on the buffers of their streams, linked into
+# usbaudio and audio_remote_submix
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libaudio_effect_chain
+LOCAL_SRC_FILES := audio_effect_chain.c
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+
+include $(BUILD_STATIC_LIBRARY)
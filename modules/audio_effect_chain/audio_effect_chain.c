@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_effect_chain"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#include "audio_effect_chain.h"
+
+void audio_effect_chain_init(struct audio_effect_chain *chain)
+{
+    memset(chain, 0, sizeof(*chain));
+    pthread_mutex_init(&chain->lock, (const pthread_mutexattr_t *) NULL);
+}
+
+void audio_effect_chain_destroy(struct audio_effect_chain *chain)
+{
+    pthread_mutex_destroy(&chain->lock);
+}
+
+int audio_effect_chain_add(struct audio_effect_chain *chain, effect_handle_t effect)
+{
+    int ret = 0;
+    int i;
+
+    if (effect == NULL)
+        return -EINVAL;
+
+    pthread_mutex_lock(&chain->lock);
+    for (i = 0; i < chain->count; i++) {
+        if (chain->effects[i] == effect) {
+            ret = -EEXIST;
+            goto exit;
+        }
+    }
+    if (chain->count == AUDIO_EFFECT_CHAIN_MAX_EFFECTS) {
+        ALOGW("%s: no room for effect %p", __func__, effect);
+        ret = -ENOSPC;
+        goto exit;
+    }
+    chain->effects[chain->count] = effect;
+    android_atomic_release_store(chain->count + 1, &chain->count);
+    ALOGV("%s: effect %p, %d effects", __func__, effect, chain->count);
+
+exit:
+    pthread_mutex_unlock(&chain->lock);
+    return ret;
+}
+
+int audio_effect_chain_remove(struct audio_effect_chain *chain, effect_handle_t effect)
+{
+    int ret = -EINVAL;
+    int i;
+
+    pthread_mutex_lock(&chain->lock);
+    for (i = 0; i < chain->count; i++) {
+        if (chain->effects[i] == effect) {
+            /* keep the order the others were added in */
+            memmove(&chain->effects[i], &chain->effects[i + 1],
+                    (chain->count - i - 1) * sizeof(chain->effects[0]));
+            chain->effects[chain->count - 1] = NULL;
+            android_atomic_release_store(chain->count - 1, &chain->count);
+            ALOGV("%s: effect %p, %d effects", __func__, effect, chain->count);
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&chain->lock);
+    return ret;
+}
+
+bool audio_effect_chain_process(struct audio_effect_chain *chain, const int16_t *in,
+                                int16_t *out, size_t frames)
+{
+    bool processed = false;
+    audio_buffer_t in_buffer;
+    audio_buffer_t out_buffer;
+    int i;
+
+    if (audio_effect_chain_is_empty(chain) || frames == 0)
+        return false;
+
+    pthread_mutex_lock(&chain->lock);
+    for (i = 0; i < chain->count; i++) {
+        effect_handle_t effect = chain->effects[i];
+        int32_t status;
+
+        /* effects only read their input buffer when it is not their output */
+        in_buffer.frameCount = frames;
+        in_buffer.s16 = processed ? out : (int16_t *) in;
+        out_buffer.frameCount = frames;
+        out_buffer.s16 = out;
+        status = (*effect)->process(effect, &in_buffer, &out_buffer);
+        if (status == 0) {
+            processed = true;
+        } else if (status != -ENODATA) {
+            /* -ENODATA is an effect that is disabled, or done fading out */
+            ALOGV("%s: effect %p failed: %d", __func__, effect, status);
+        }
+    }
+    pthread_mutex_unlock(&chain->lock);
+    return processed;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_EFFECT_CHAIN_H_
+#define AUDIO_EFFECT_CHAIN_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <cutils/atomic.h>
+#include <hardware/audio_effect.h>
+
+__BEGIN_DECLS
+
+/*
+ * Effects the framework attached to a stream with add_audio_effect(), run by
+ * the HAL on the 16-bit PCM of the stream while it converts it, instead of
+ * in a buffer of their own in the framework. The effects are configured by
+ * the framework for the format of the stream; they are run in the order they
+ * were added.
+ */
+
+#define AUDIO_EFFECT_CHAIN_MAX_EFFECTS  8
+
+struct audio_effect_chain {
+    /* held while the effects are run, so that none is removed meanwhile */
+    pthread_mutex_t lock;
+    /* number of effects, read without the lock to skip an empty chain */
+    volatile int32_t count;
+    effect_handle_t effects[AUDIO_EFFECT_CHAIN_MAX_EFFECTS];
+};
+
+void audio_effect_chain_init(struct audio_effect_chain *chain);
+void audio_effect_chain_destroy(struct audio_effect_chain *chain);
+
+/*
+ * Adds effect at the end of the chain, or removes it. Add returns -EEXIST if
+ * the effect is in the chain already and -ENOSPC if the chain is full,
+ * remove returns -EINVAL if the effect is not in the chain.
+ */
+int audio_effect_chain_add(struct audio_effect_chain *chain, effect_handle_t effect);
+int audio_effect_chain_remove(struct audio_effect_chain *chain, effect_handle_t effect);
+
+static inline bool audio_effect_chain_is_empty(struct audio_effect_chain *chain)
+{
+    return android_atomic_acquire_load(&chain->count) == 0;
+}
+
+/*
+ * Runs the effects over frames of in, writing the result to out, which may
+ * be in itself. The first effect that processes reads in, the others process
+ * out in place. Returns false when no effect processed, an empty chain or
+ * effects that are all disabled: out was not written then and in holds the
+ * result.
+ */
+bool audio_effect_chain_process(struct audio_effect_chain *chain, const int16_t *in,
+                                int16_t *out, size_t frames);
+
+__END_DECLS
+
+#endif /* AUDIO_EFFECT_CHAIN_H_ */
@@ -22,11 +22,14 @@ LOCAL_SRC_FILES := \
 	audio_hw.cpp
 LOCAL_C_INCLUDES += \
 	frameworks/av/include/ \
-	frameworks/native/include/
-LOCAL_SHARED_LIBRARIES := liblog libcutils libutils libnbaio
-LOCAL_STATIC_LIBRARIES := libmedia_helper
+	frameworks/native/include/ \
+	$(call include-path-for, audio-utils) \
+	$(LOCAL_PATH)/../audio_effect_chain
+LOCAL_SHARED_LIBRARIES := liblog libcutils libutils libnbaio libaudioutils
+LOCAL_STATIC_LIBRARIES := libmedia_helper libaudio_effect_chain
 LOCAL_MODULE_TAGS := optional
 LOCAL_CFLAGS := -Wno-unused-parameter
 
 include $(BUILD_SHARED_LIBRARY)
 
+include $(call all-makefiles-under, $(LOCAL_PATH))
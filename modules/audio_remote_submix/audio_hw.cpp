@@ -24,7 +24,11 @@
 #include <sys/param.h>
 #include <sys/time.h>
 #include <sys/limits.h>
+#include <time.h>
 
+#include <new>
+
+#include <cutils/atomic.h>
 #include <cutils/log.h>
 #include <cutils/properties.h>
 #include <cutils/str_parms.h>
@@ -33,6 +37,9 @@
 #include <hardware/hardware.h>
 #include <system/audio.h>
 
+#include <audio_utils/format.h>
+#include <audio_utils/resampler.h>
+
 #include <media/AudioParameter.h>
 #include <media/AudioBufferProvider.h>
 #include <media/nbaio/MonoPipe.h>
@@ -40,6 +47,8 @@
 
 #include <utils/String8.h>
 
+#include "audio_effect_chain.h"
+
 #define LOG_STREAMS_TO_FILES 0
 #if LOG_STREAMS_TO_FILES
 #include <fcntl.h>
@@ -67,22 +76,25 @@ namespace android {
 // read from the sink.  The maximum latency of the device is the size of the MonoPipe's buffer
 // the minimum latency is the MonoPipe buffer size divided by this value.
 #define DEFAULT_PIPE_PERIOD_COUNT    4
-// The duration of MAX_READ_ATTEMPTS * READ_ATTEMPT_SLEEP_MS must be stricly inferior to
-//   the duration of a record buffer at the current record sample rate (of the device, not of
-//   the recording itself). Here we have:
-//      3 * 5ms = 15ms < 1024 frames * 1000 / 48000 = 21.333ms
-#define MAX_READ_ATTEMPTS            3
-#define READ_ATTEMPT_SLEEP_MS        5 // 5ms between two read attempts when pipe is empty
+// Pipe size of a route whose address asks for low latency (about 21 ms at 48 kHz), and range of
+// pipe sizes an address can ask for, see submix_pipe_size_from_address().
+#define LOW_LATENCY_PIPE_SIZE_IN_FRAMES  1024
+#define MIN_PIPE_SIZE_IN_FRAMES          256
+#define MAX_PIPE_SIZE_IN_FRAMES          (1024*64)
 #define DEFAULT_SAMPLE_RATE_HZ       48000 // default sample rate
-// See NBAIO_Format frameworks/av/include/media/nbaio/NBAIO.h.
+// See NBAIO_Format frameworks/av/include/media/nbaio/NBAIO.h.  The pipe holds the format of the
+// output stream, DEFAULT_FORMAT or AUDIO_FORMAT_PCM_FLOAT, see pipe_format_supported().
 #define DEFAULT_FORMAT               AUDIO_FORMAT_PCM_16_BIT
 // A legacy user of this device does not close the input stream when it shuts down, which
 // results in the application opening a new input stream before closing the old input stream
 // handle it was previously using.  Setting this value to 1 allows multiple clients to open
-// multiple input streams from this device.  If this option is enabled, each input stream returned
-// is *the same stream* which means that readers will race to read data from these streams.
+// multiple input streams from this device.  If this option is enabled, each input stream opened
+// while another one is open on the same address reads from the route's fan-out ring, with its own
+// config and read position, so that every reader gets all of the audio.
 #define ENABLE_LEGACY_INPUT_OPEN     1
-// Whether channel conversion (16-bit signed PCM mono->stereo, stereo->mono) is enabled.
+// Maximum number of input streams opened on an address at the same time.
+#define MAX_READERS_PER_ROUTE        4
+// Whether channel conversion (16-bit signed or float PCM mono->stereo, stereo->mono) is enabled.
 #define ENABLE_CHANNEL_CONVERSION    1
 // Whether resampling is enabled.
 #define ENABLE_RESAMPLING            1
@@ -97,6 +109,14 @@ namespace android {
 #endif // LOG_STREAMS_TO_FILES
 // limit for number of read error log entries to avoid spamming the logs
 #define MAX_READ_ERROR_LOGS 5
+// Range of sample rates an input stream can be opened at when resampling is enabled.
+#define MIN_INPUT_SAMPLE_RATE_HZ     8000
+#define MAX_INPUT_SAMPLE_RATE_HZ     192000
+// Number of frames converted at once from the pipe to the format of an input stream.
+#define CONVERSION_BUFFER_FRAMES     1024
+
+// Length of the fade of input data resuming after, or followed by, silence padding a read.
+#define SILENCE_RAMP_MS              5
 
 // Common limits macros.
 #ifndef min
@@ -134,13 +154,46 @@ struct submix_config {
     uint32_t input_sample_rate;
     uint32_t output_sample_rate;
 #endif // ENABLE_RESAMPLING
+    // Format of the last output stream, that of the pipe an input stream opened first creates.
+    audio_format_t output_format;
     size_t pipe_frame_size;  // Number of bytes in each audio frame in the pipe.
+    uint32_t pipe_channel_count; // Number of channels in each audio frame in the pipe.
     size_t buffer_size_frames; // Size of the audio pipe in frames.
     // Maximum number of frames buffered by the input and output streams.
     size_t buffer_period_size_frames;
 };
 
-#define MAX_ROUTES 10
+// Ring the input streams opened on a route while its input is open read from.  A MonoPipe has a
+// single reader: the output stream copies what it writes to the pipe into this ring as well, once
+// for all of these readers, which each have their own position in it.  The output stream never
+// waits for them, a reader falling more than a ring behind loses the oldest frames instead.
+struct submix_fanout : public RefBase {
+    submix_fanout(const size_t frames, const size_t frame_size)
+        : buffer((uint8_t *)calloc(frames, frame_size)), frames(frames), frame_size(frame_size),
+          rear(0), write_end(0) {}
+    virtual ~submix_fanout() { free(buffer); }
+
+    uint8_t * const buffer;
+    // Capacity in frames, a power of 2.
+    const size_t frames;
+    const size_t frame_size;
+    // Number of frames ever written, modulo 2^32: frames before rear can be read.
+    volatile int32_t rear;
+    // Set past the frames being written before they're written: earlier frames, now overwritten,
+    // can't be read anymore.  Both are only written by the output stream.
+    volatile int32_t write_end;
+};
+
+// Frame count of a stream and the CLOCK_MONOTONIC time it was measured at, written by the thread
+// reading or writing the stream and read by any thread: seq is odd while it is being updated.
+struct submix_position {
+    volatile int32_t seq;
+    int64_t frames;
+    int64_t time_ns;
+};
+
+// Buckets of the route table when the device is opened, doubled whenever there are more routes.
+#define INITIAL_ROUTE_BUCKETS 16
 typedef struct route_config {
     struct submix_config config;
     char address[AUDIO_DEVICE_MAX_ADDRESS_LEN];
@@ -158,16 +211,38 @@ typedef struct route_config {
     // destroyed if both and input and output streams are destroyed.
     struct submix_stream_out *output;
     struct submix_stream_in *input;
-#if ENABLE_RESAMPLING
-    // Buffer used as temporary storage for resampled data prior to returning data to the output
-    // stream.
-    int16_t resampler_buffer[DEFAULT_PIPE_SIZE_IN_FRAMES];
-#endif // ENABLE_RESAMPLING
+    // Input streams opened while input was open, reading from fanout.  fanout is only allocated
+    // while there is one.
+    struct submix_stream_in *fanout_readers[MAX_READERS_PER_ROUTE - 1];
+    sp<submix_fanout> fanout;
+    // Incremented whenever rsxSink, rsxSource, fanout, input or its standby state change, with the
+    // device lock held, so that the output stream can cache them and only take the lock when they
+    // changed.
+    volatile int32_t pipe_generation;
+    // Readers finding the pipe empty wait on read_cond (CLOCK_MONOTONIC) with read_lock held,
+    // having incremented reader_waiting.  The output stream only takes read_lock to signal them
+    // while reader_waiting is non zero, so writing to a pipe nobody waits on costs no syscall.
+    pthread_mutex_t read_lock;
+    pthread_cond_t read_cond;
+    volatile int32_t reader_waiting;
+    // Links of the device's route table, see submix_audio_device.
+    struct route_config *next;
+    struct route_config *hash_next;
+    uint32_t hash;
+    bool in_use;
 } route_config_t;
 
 struct submix_audio_device {
     struct audio_hw_device device;
-    route_config_t routes[MAX_ROUTES];
+    // Routes are allocated on demand and stay where they are in memory until the device is closed,
+    // so that streams point to theirs and use it without the lock.  Routes in use are hashed by
+    // address in route_buckets; released ones are kept for reuse in free_routes, linked by
+    // hash_next.  all_routes lists both.
+    route_config_t *all_routes;
+    route_config_t *free_routes;
+    route_config_t **route_buckets;
+    size_t route_bucket_count;
+    size_t routes_in_use;
     // Device lock, also used to protect access to submix_audio_device from the input and output
     // streams.
     pthread_mutex_t lock;
@@ -176,8 +251,29 @@ struct submix_audio_device {
 struct submix_stream_out {
     struct audio_stream_out stream;
     struct submix_audio_device *dev;
-    int route_handle;
+    route_config_t *route;
     bool output_standby;
+    // Copy of the route's pipe and fan-out ring and whether its input reads from the pipe, valid
+    // while pipe_generation matches the route's.  Only accessed by the thread writing to the
+    // stream, or with the device lock held when the stream is opened or closed.
+    sp<MonoPipe> sink;
+    sp<MonoPipeReader> source;
+    sp<submix_fanout> fanout;
+    bool has_input;
+    int32_t pipe_generation;
+    // Frames written since the stream was opened, only accessed by the thread writing to it.
+    int64_t frames_written;
+    // Frames read from the pipe since the stream was opened, as of the last write.
+    struct submix_position presentation;
+    // Low 32 bits of presentation.frames when the stream last left standby.
+    volatile int32_t standby_exit_frames;
+    // Effects the framework attached to the stream, run from the buffer written into
+    // effect_buffer which the pipe is then written from.  effect_buffer holds a buffer of the
+    // stream, it is allocated with the device lock held when the first effect is added, before the
+    // chain publishes the effect, and kept until the stream is closed.
+    struct audio_effect_chain effects;
+    void *effect_buffer;
+    size_t effect_buffer_frames;
 #if LOG_STREAMS_TO_FILES
     int log_fd;
 #endif // LOG_STREAMS_TO_FILES
@@ -186,24 +282,66 @@ struct submix_stream_out {
 struct submix_stream_in {
     struct audio_stream_in stream;
     struct submix_audio_device *dev;
-    int route_handle;
+    route_config_t *route;
+    // Sanitized config the stream was opened with.
+    struct audio_config config;
     bool input_standby;
     bool output_standby_rec_thr; // output standby state as seen from record thread
 
-    // wall clock when recording starts
-    struct timespec record_start_time;
+    // CLOCK_MONOTONIC time recording started, or the output stream last entered or left standby
+    int64_t record_start_ns;
     // how many frames have been requested to be read
     int64_t read_counter_frames;
+    // Frames returned by in_read() since the stream was opened, and frames received, that is read
+    // or still waiting in the pipe, as of the last read.
+    int64_t frames_read;
+    struct submix_position capture;
+    // Whether the last read ended with silence, the next data read fades in.
+    bool silent;
 
-#if ENABLE_LEGACY_INPUT_OPEN
-    // Number of references to this input stream.
-    volatile int32_t ref_count;
-#endif // ENABLE_LEGACY_INPUT_OPEN
 #if LOG_STREAMS_TO_FILES
     int log_fd;
 #endif // LOG_STREAMS_TO_FILES
 
     volatile int16_t read_error_count;
+
+    // Whether the stream is one of the route's fanout_readers.  Its fan-out ring, refreshed from
+    // the route on every read, and its position in it.
+    bool fanout_reader;
+    sp<submix_fanout> fanout;
+    int32_t fanout_front;
+    // Frames lost because the stream fell more than a fan-out ring behind, since
+    // in_get_input_frames_lost() was last called.
+    volatile int32_t fanout_frames_lost;
+
+    // Conversion from the pipe to the format of the stream, see submix_in_configure_conversion_l().
+    // Pipe sample rate, channel count and format the conversion was set up for, 0 if it is not set
+    // up.
+    uint32_t conversion_pipe_sample_rate;
+    uint32_t conversion_pipe_channel_count;
+    audio_format_t conversion_pipe_format;
+    uint32_t conversion_channel_count;
+    // Format channels are converted and resampled in: that of the pipe, or DEFAULT_FORMAT when
+    // resampling as the resampler only takes 16-bit samples.
+    audio_format_t conversion_format;
+    // NULL when the pipe and the stream have the same sample rate.
+    struct resampler_itfe *resampler;
+    // Feeds the resampler from the pipe, with channels converted already.
+    struct resampler_buffer_provider resampler_provider;
+    // CONVERSION_BUFFER_FRAMES frames of the larger of the pipe and the stream channel counts, in
+    // the pipe format.
+    void *pipe_buffer;
+    // CONVERSION_BUFFER_FRAMES frames of the stream channel count in conversion_format, converted
+    // to the stream format when it is another one.
+    void *conversion_buffer;
+    // Pipe or fan-out ring and deadline of the read in progress, used by the resampler provider.
+    MonoPipeReader *read_source;
+    submix_fanout *read_fanout;
+    int64_t read_deadline_ns;
+
+    // Effects the framework attached to the stream, run in place on each chunk read, once it is
+    // converted to the stream format.
+    struct audio_effect_chain effects;
 };
 
 // Determine whether the specified sample rate is supported by the submix module.
@@ -225,19 +363,45 @@ static uint32_t get_supported_sample_rate(uint32_t sample_rate)
   return sample_rate_supported(sample_rate) ? sample_rate : DEFAULT_SAMPLE_RATE_HZ;
 }
 
-// Determine whether the specified channel in mask is supported by the submix module.
-static bool channel_in_mask_supported(const audio_channel_mask_t channel_in_mask)
+// Determine whether the specified sample rate is supported for an input stream.
+static bool input_sample_rate_supported(const uint32_t sample_rate)
 {
-    // Set of channel in masks supported by Format_from_SR_C()
-    // frameworks/av/media/libnbaio/NAIO.cpp.
-    static const audio_channel_mask_t supported_channel_in_masks[] = {
-        AUDIO_CHANNEL_IN_MONO, AUDIO_CHANNEL_IN_STEREO,
+#if ENABLE_RESAMPLING
+    // Input streams are resampled from the pipe in in_read().
+    return sample_rate >= MIN_INPUT_SAMPLE_RATE_HZ && sample_rate <= MAX_INPUT_SAMPLE_RATE_HZ;
+#else
+    return sample_rate_supported(sample_rate);
+#endif // ENABLE_RESAMPLING
+}
+
+// Determine whether the specified format is supported for the pipe, and so for an output stream.
+static bool pipe_format_supported(const audio_format_t format)
+{
+    return format == DEFAULT_FORMAT || format == AUDIO_FORMAT_PCM_FLOAT;
+}
+
+// Determine whether the specified format is supported for an input stream.
+static bool input_format_supported(const audio_format_t format)
+{
+    // Set of formats memcpy_by_audio_format() converts the pipe formats to.
+    static const audio_format_t supported_input_formats[] = {
+        AUDIO_FORMAT_PCM_16_BIT, AUDIO_FORMAT_PCM_8_24_BIT, AUDIO_FORMAT_PCM_24_BIT_PACKED,
+        AUDIO_FORMAT_PCM_32_BIT, AUDIO_FORMAT_PCM_FLOAT,
     };
     bool return_value;
-    SUBMIX_VALUE_IN_SET(channel_in_mask, supported_channel_in_masks, &return_value);
+    SUBMIX_VALUE_IN_SET(format, supported_input_formats, &return_value);
     return return_value;
 }
 
+// Determine whether the specified channel in mask is supported by the submix module: any
+// positional mask of up to FCC_8 channels.
+static bool channel_in_mask_supported(const audio_channel_mask_t channel_in_mask)
+{
+    const uint32_t channel_count = audio_channel_count_from_in_mask(channel_in_mask);
+    return channel_count > 0 && channel_count <= FCC_8 &&
+            (channel_in_mask & ~AUDIO_CHANNEL_IN_ALL) == 0;
+}
+
 // Determine whether the specified channel in mask is supported, if it is return the specified
 // channel in mask, otherwise return the default channel in mask for the submix module.
 static audio_channel_mask_t get_supported_channel_in_mask(
@@ -247,17 +411,13 @@ static audio_channel_mask_t get_supported_channel_in_mask(
             static_cast<audio_channel_mask_t>(AUDIO_CHANNEL_IN_STEREO);
 }
 
-// Determine whether the specified channel out mask is supported by the submix module.
+// Determine whether the specified channel out mask is supported by the submix module: any
+// positional mask of up to FCC_8 channels.
 static bool channel_out_mask_supported(const audio_channel_mask_t channel_out_mask)
 {
-    // Set of channel out masks supported by Format_from_SR_C()
-    // frameworks/av/media/libnbaio/NAIO.cpp.
-    static const audio_channel_mask_t supported_channel_out_masks[] = {
-        AUDIO_CHANNEL_OUT_MONO, AUDIO_CHANNEL_OUT_STEREO,
-    };
-    bool return_value;
-    SUBMIX_VALUE_IN_SET(channel_out_mask, supported_channel_out_masks, &return_value);
-    return return_value;
+    const uint32_t channel_count = audio_channel_count_from_out_mask(channel_out_mask);
+    return channel_count > 0 && channel_count <= FCC_8 &&
+            (channel_out_mask & ~AUDIO_CHANNEL_OUT_ALL) == 0;
 }
 
 // Determine whether the specified channel out mask is supported, if it is return the specified
@@ -331,25 +491,135 @@ static bool audio_config_compare(const audio_config * const input_config,
         return false;
     }
 #endif // !ENABLE_CHANNEL_CONVERSION
-#if ENABLE_RESAMPLING
-    if (input_config->sample_rate != output_config->sample_rate &&
-            audio_channel_count_from_in_mask(input_config->channel_mask) != 1) {
-#else
+#if !ENABLE_RESAMPLING
     if (input_config->sample_rate != output_config->sample_rate) {
-#endif // ENABLE_RESAMPLING
         ALOGE("audio_config_compare() sample rate mismatch %ul vs. %ul",
               input_config->sample_rate, output_config->sample_rate);
         return false;
     }
-    if (input_config->format != output_config->format) {
-        ALOGE("audio_config_compare() format mismatch %x vs. %x",
-              input_config->format, output_config->format);
-        return false;
-    }
+#endif // !ENABLE_RESAMPLING
+    // The format of the input may differ, in_read() converts it from the pipe's format.
     // This purposely ignores offload_info as it's not required for the submix device.
     return true;
 }
 
+// Make in the input of the route if it has none, else one of its fan-out readers.
+// Must be called with lock held on the submix_audio_device
+static void submix_audio_device_add_reader_l(route_config_t * const route,
+                                             struct submix_stream_in * const in)
+{
+    if (route->input == NULL || route->input == in) {
+        route->input = in;
+        in->fanout_reader = false;
+        return;
+    }
+    for (int i = 0; i < MAX_READERS_PER_ROUTE - 1; i++) {
+        if (route->fanout_readers[i] == NULL || route->fanout_readers[i] == in) {
+            route->fanout_readers[i] = in;
+            in->fanout_reader = true;
+            return;
+        }
+    }
+    // submix_open_validate_l() checked there is room.
+    ALOG_ASSERT(false);
+}
+
+// Number of input streams reading from the route.
+// Must be called with lock held on the submix_audio_device
+static int submix_audio_device_reader_count_l(const route_config_t * const route)
+{
+    int count = route->input != NULL ? 1 : 0;
+    for (int i = 0; i < MAX_READERS_PER_ROUTE - 1; i++) {
+        if (route->fanout_readers[i] != NULL) count++;
+    }
+    return count;
+}
+
+// FNV-1a hash of a route address.
+static uint32_t submix_address_hash(const char * const address)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < AUDIO_DEVICE_MAX_ADDRESS_LEN && address[i] != '\0'; i++) {
+        hash ^= (uint8_t)address[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Route in use for address, or NULL.
+// Must be called with lock held on the submix_audio_device
+static route_config_t *submix_find_route_l(const struct submix_audio_device * const rsxadev,
+                                           const char * const address)
+{
+    const uint32_t hash = submix_address_hash(address);
+    route_config_t *route = rsxadev->route_buckets[hash % rsxadev->route_bucket_count];
+    while (route != NULL && (route->hash != hash ||
+            strncmp(route->address, address, AUDIO_DEVICE_MAX_ADDRESS_LEN) != 0)) {
+        route = route->hash_next;
+    }
+    return route;
+}
+
+// Put a released or new route in use under its address.
+// Must be called with lock held on the submix_audio_device
+static void submix_hash_route_l(struct submix_audio_device * const rsxadev,
+                                route_config_t * const route)
+{
+    ALOG_ASSERT(!route->in_use);
+    for (route_config_t **link = &rsxadev->free_routes; *link != NULL;
+            link = &(*link)->hash_next) {
+        if (*link == route) {
+            *link = route->hash_next;
+            break;
+        }
+    }
+
+    // Keep about one route per bucket; without memory for more buckets, chains just get longer.
+    if (rsxadev->routes_in_use >= rsxadev->route_bucket_count) {
+        const size_t bucket_count = rsxadev->route_bucket_count * 2;
+        route_config_t ** const buckets =
+                (route_config_t **)calloc(bucket_count, sizeof(buckets[0]));
+        if (buckets != NULL) {
+            for (route_config_t *r = rsxadev->all_routes; r != NULL; r = r->next) {
+                if (r->in_use) {
+                    r->hash_next = buckets[r->hash % bucket_count];
+                    buckets[r->hash % bucket_count] = r;
+                }
+            }
+            free(rsxadev->route_buckets);
+            rsxadev->route_buckets = buckets;
+            rsxadev->route_bucket_count = bucket_count;
+        }
+    }
+
+    route->hash = submix_address_hash(route->address);
+    route_config_t ** const bucket =
+            &rsxadev->route_buckets[route->hash % rsxadev->route_bucket_count];
+    route->hash_next = *bucket;
+    *bucket = route;
+    route->in_use = true;
+    rsxadev->routes_in_use++;
+}
+
+// Take a route out of use, keeping it for reuse.
+// Must be called with lock held on the submix_audio_device
+static void submix_unhash_route_l(struct submix_audio_device * const rsxadev,
+                                  route_config_t * const route)
+{
+    ALOG_ASSERT(route->in_use);
+    for (route_config_t **link = &rsxadev->route_buckets[route->hash % rsxadev->route_bucket_count];
+            *link != NULL; link = &(*link)->hash_next) {
+        if (*link == route) {
+            *link = route->hash_next;
+            break;
+        }
+    }
+    route->in_use = false;
+    rsxadev->routes_in_use--;
+    route->hash_next = rsxadev->free_routes;
+    rsxadev->free_routes = route;
+}
+
 // If one doesn't exist, create a pipe for the submix audio device rsxadev of size
 // buffer_size_frames and optionally associate "in" or "out" with the submix audio device.
 // Must be called with lock held on the submix_audio_device
@@ -360,60 +630,71 @@ static void submix_audio_device_create_pipe_l(struct submix_audio_device * const
                                             struct submix_stream_in * const in,
                                             struct submix_stream_out * const out,
                                             const char *address,
-                                            int route_idx)
+                                            route_config_t * const route)
 {
     ALOG_ASSERT(in || out);
-    ALOG_ASSERT(route_idx > -1);
-    ALOG_ASSERT(route_idx < MAX_ROUTES);
-    ALOGD("submix_audio_device_create_pipe_l(addr=%s, idx=%d)", address, route_idx);
+    ALOG_ASSERT(route != NULL);
+    ALOGD("submix_audio_device_create_pipe_l(addr=%s, route=%p)", address, route);
 
     // Save a reference to the specified input or output stream and the associated channel
     // mask.
     if (in) {
-        in->route_handle = route_idx;
-        rsxadev->routes[route_idx].input = in;
-        rsxadev->routes[route_idx].config.input_channel_mask = config->channel_mask;
+        in->route = route;
+        memcpy(&in->config, config, sizeof(in->config));
+        route->config.input_channel_mask = config->channel_mask;
 #if ENABLE_RESAMPLING
-        rsxadev->routes[route_idx].config.input_sample_rate = config->sample_rate;
+        route->config.input_sample_rate = config->sample_rate;
         // If the output isn't configured yet, set the output sample rate to the maximum supported
         // sample rate such that the smallest possible input buffer is created, and put a default
         // value for channel count
-        if (!rsxadev->routes[route_idx].output) {
-            rsxadev->routes[route_idx].config.output_sample_rate = 48000;
-            rsxadev->routes[route_idx].config.output_channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+        if (!route->output) {
+            route->config.output_sample_rate = 48000;
+            route->config.output_channel_mask = AUDIO_CHANNEL_OUT_STEREO;
         }
 #endif // ENABLE_RESAMPLING
     }
     if (out) {
-        out->route_handle = route_idx;
-        rsxadev->routes[route_idx].output = out;
-        rsxadev->routes[route_idx].config.output_channel_mask = config->channel_mask;
+        out->route = route;
+        route->output = out;
+        route->config.output_channel_mask = config->channel_mask;
 #if ENABLE_RESAMPLING
-        rsxadev->routes[route_idx].config.output_sample_rate = config->sample_rate;
+        route->config.output_sample_rate = config->sample_rate;
 #endif // ENABLE_RESAMPLING
+        route->config.output_format = config->format;
     }
     // Save the address
-    strncpy(rsxadev->routes[route_idx].address, address, AUDIO_DEVICE_MAX_ADDRESS_LEN);
-    ALOGD("  now using address %s for route %d", rsxadev->routes[route_idx].address, route_idx);
+    strncpy(route->address, address, AUDIO_DEVICE_MAX_ADDRESS_LEN);
+    if (!route->in_use) {
+        submix_hash_route_l(rsxadev, route);
+    }
+    ALOGD("  now using address %s for route %p", route->address, route);
     // If a pipe isn't associated with the device, create one.
-    if (rsxadev->routes[route_idx].rsxSink == NULL || rsxadev->routes[route_idx].rsxSource == NULL)
+    if (route->rsxSink == NULL || route->rsxSource == NULL)
     {
-        struct submix_config * const device_config = &rsxadev->routes[route_idx].config;
-        uint32_t channel_count;
-        if (out)
-            channel_count = audio_channel_count_from_out_mask(config->channel_mask);
-        else
-            channel_count = audio_channel_count_from_in_mask(config->channel_mask);
+        struct submix_config * const device_config = &route->config;
+        // The pipe holds frames laid out as written by the output stream, or as the last output
+        // stream or the input stream reads them until an output is opened.  in_read() converts
+        // them to the format of the input stream.
+        uint32_t pipe_channel_count;
+        uint32_t pipe_sample_rate = config->sample_rate;
+        audio_format_t pipe_format = config->format;
+        if (out) {
+            pipe_channel_count = audio_channel_count_from_out_mask(config->channel_mask);
+        } else {
+            pipe_format = pipe_format_supported(device_config->output_format) ?
+                    device_config->output_format : DEFAULT_FORMAT;
 #if ENABLE_CHANNEL_CONVERSION
-        // If channel conversion is enabled, allocate enough space for the maximum number of
-        // possible channels stored in the pipe for the situation when the number of channels in
-        // the output stream don't match the number in the input stream.
-        const uint32_t pipe_channel_count = max(channel_count, 2);
+            pipe_channel_count = audio_channel_count_from_out_mask(
+                    device_config->output_channel_mask);
 #else
-        const uint32_t pipe_channel_count = channel_count;
+            pipe_channel_count = audio_channel_count_from_in_mask(config->channel_mask);
 #endif // ENABLE_CHANNEL_CONVERSION
-        const NBAIO_Format format = Format_from_SR_C(config->sample_rate, pipe_channel_count,
-            config->format);
+#if ENABLE_RESAMPLING
+            pipe_sample_rate = device_config->output_sample_rate;
+#endif // ENABLE_RESAMPLING
+        }
+        const NBAIO_Format format = Format_from_SR_C(pipe_sample_rate, pipe_channel_count,
+            pipe_format);
         const NBAIO_Format offers[1] = {format};
         size_t numCounterOffers = 0;
         // Create a MonoPipe with optional blocking set to true.
@@ -429,27 +710,41 @@ static void submix_audio_device_create_pipe_l(struct submix_audio_device * const
         ALOGV("submix_audio_device_create_pipe_l(): created pipe");
 
         // Save references to the source and sink.
-        ALOG_ASSERT(rsxadev->routes[route_idx].rsxSink == NULL);
-        ALOG_ASSERT(rsxadev->routes[route_idx].rsxSource == NULL);
-        rsxadev->routes[route_idx].rsxSink = sink;
-        rsxadev->routes[route_idx].rsxSource = source;
+        ALOG_ASSERT(route->rsxSink == NULL);
+        ALOG_ASSERT(route->rsxSource == NULL);
+        route->rsxSink = sink;
+        route->rsxSource = source;
         // Store the sanitized audio format in the device so that it's possible to determine
         // the format of the pipe source when opening the input device.
         memcpy(&device_config->common, config, sizeof(device_config->common));
+        device_config->common.sample_rate = pipe_sample_rate;
+        device_config->common.format = pipe_format;
         device_config->buffer_size_frames = sink->maxFrames();
         device_config->buffer_period_size_frames = device_config->buffer_size_frames /
                 buffer_period_count;
-        if (in) device_config->pipe_frame_size = audio_stream_in_frame_size(&in->stream);
-        if (out) device_config->pipe_frame_size = audio_stream_out_frame_size(&out->stream);
-#if ENABLE_CHANNEL_CONVERSION
-        // Calculate the pipe frame size based upon the number of channels.
-        device_config->pipe_frame_size = (device_config->pipe_frame_size * pipe_channel_count) /
-                channel_count;
-#endif // ENABLE_CHANNEL_CONVERSION
+        device_config->pipe_channel_count = pipe_channel_count;
+        device_config->pipe_frame_size = pipe_channel_count *
+                audio_bytes_per_sample(pipe_format);
         SUBMIX_ALOGV("submix_audio_device_create_pipe_l(): pipe frame size %zd, pipe size %zd, "
                      "period size %zd", device_config->pipe_frame_size,
                      device_config->buffer_size_frames, device_config->buffer_period_size_frames);
     }
+    if (in) {
+        submix_audio_device_add_reader_l(route, in);
+    }
+    // (Re)create the fan-out ring of a new pipe.
+    if (route->fanout == NULL) {
+        for (int i = 0; i < MAX_READERS_PER_ROUTE - 1; i++) {
+            if (route->fanout_readers[i] != NULL) {
+                const struct submix_config * const device_config =
+                        &route->config;
+                route->fanout = new submix_fanout(
+                        device_config->buffer_size_frames, device_config->pipe_frame_size);
+                break;
+            }
+        }
+    }
+    android_atomic_inc(&route->pipe_generation);
 }
 
 // Release references to the sink and source.  Input and output threads may maintain references
@@ -457,25 +752,24 @@ static void submix_audio_device_create_pipe_l(struct submix_audio_device * const
 // before they shutdown.
 // Must be called with lock held on the submix_audio_device
 static void submix_audio_device_release_pipe_l(struct submix_audio_device * const rsxadev,
-        int route_idx)
-{
-    ALOG_ASSERT(route_idx > -1);
-    ALOG_ASSERT(route_idx < MAX_ROUTES);
-    ALOGD("submix_audio_device_release_pipe_l(idx=%d) addr=%s", route_idx,
-            rsxadev->routes[route_idx].address);
-    if (rsxadev->routes[route_idx].rsxSink != 0) {
-        rsxadev->routes[route_idx].rsxSink.clear();
-        rsxadev->routes[route_idx].rsxSink = 0;
-    }
-    if (rsxadev->routes[route_idx].rsxSource != 0) {
-        rsxadev->routes[route_idx].rsxSource.clear();
-        rsxadev->routes[route_idx].rsxSource = 0;
-    }
-    memset(rsxadev->routes[route_idx].address, 0, AUDIO_DEVICE_MAX_ADDRESS_LEN);
-#ifdef ENABLE_RESAMPLING
-    memset(rsxadev->routes[route_idx].resampler_buffer, 0,
-            sizeof(int16_t) * DEFAULT_PIPE_SIZE_IN_FRAMES);
-#endif
+        route_config_t * const route)
+{
+    ALOG_ASSERT(route != NULL);
+    ALOGD("submix_audio_device_release_pipe_l(route=%p) addr=%s", route, route->address);
+    if (route->rsxSink != 0) {
+        route->rsxSink.clear();
+        route->rsxSink = 0;
+    }
+    if (route->rsxSource != 0) {
+        route->rsxSource.clear();
+        route->rsxSource = 0;
+    }
+    route->fanout.clear();
+    if (route->in_use) {
+        submix_unhash_route_l(rsxadev, route);
+    }
+    memset(route->address, 0, AUDIO_DEVICE_MAX_ADDRESS_LEN);
+    android_atomic_inc(&route->pipe_generation);
 }
 
 // Remove references to the specified input and output streams.  When the device no longer
@@ -485,30 +779,37 @@ static void submix_audio_device_destroy_pipe_l(struct submix_audio_device * cons
                                              const struct submix_stream_in * const in,
                                              const struct submix_stream_out * const out)
 {
-    MonoPipe* sink;
     ALOGV("submix_audio_device_destroy_pipe_l()");
-    int route_idx = -1;
+    route_config_t *route = NULL;
     if (in != NULL) {
-#if ENABLE_LEGACY_INPUT_OPEN
-        const_cast<struct submix_stream_in*>(in)->ref_count--;
-        route_idx = in->route_handle;
-        ALOG_ASSERT(rsxadev->routes[route_idx].input == in);
-        if (in->ref_count == 0) {
-            rsxadev->routes[route_idx].input = NULL;
+        route = in->route;
+        if (in->fanout_reader) {
+            bool fanout_readers = false;
+            for (int i = 0; i < MAX_READERS_PER_ROUTE - 1; i++) {
+                if (route->fanout_readers[i] == in) {
+                    route->fanout_readers[i] = NULL;
+                }
+                fanout_readers = fanout_readers || route->fanout_readers[i] != NULL;
+            }
+            if (!fanout_readers) {
+                route->fanout.clear();
+            }
+        } else {
+            ALOG_ASSERT(route->input == in);
+            route->input = NULL;
         }
-        ALOGV("submix_audio_device_destroy_pipe_l(): input ref_count %d", in->ref_count);
-#else
-        rsxadev->input = NULL;
-#endif // ENABLE_LEGACY_INPUT_OPEN
+        android_atomic_inc(&route->pipe_generation);
+        ALOGV("submix_audio_device_destroy_pipe_l(): %d readers left",
+              submix_audio_device_reader_count_l(route));
     }
     if (out != NULL) {
-        route_idx = out->route_handle;
-        ALOG_ASSERT(rsxadev->routes[route_idx].output == out);
-        rsxadev->routes[route_idx].output = NULL;
+        route = out->route;
+        ALOG_ASSERT(route->output == out);
+        route->output = NULL;
     }
-    if (route_idx != -1 &&
-            rsxadev->routes[route_idx].input == NULL && rsxadev->routes[route_idx].output == NULL) {
-        submix_audio_device_release_pipe_l(rsxadev, route_idx);
+    if (route != NULL && route->output == NULL &&
+            submix_audio_device_reader_count_l(route) == 0) {
+        submix_audio_device_release_pipe_l(rsxadev, route);
         ALOGD("submix_audio_device_destroy_pipe_l(): pipe destroyed");
     }
 }
@@ -516,16 +817,26 @@ static void submix_audio_device_destroy_pipe_l(struct submix_audio_device * cons
 // Sanitize the user specified audio config for a submix input / output stream.
 static void submix_sanitize_config(struct audio_config * const config, const bool is_input_format)
 {
-    config->channel_mask = is_input_format ? get_supported_channel_in_mask(config->channel_mask) :
-            get_supported_channel_out_mask(config->channel_mask);
-    config->sample_rate = get_supported_sample_rate(config->sample_rate);
-    config->format = DEFAULT_FORMAT;
+    if (is_input_format) {
+        config->channel_mask = get_supported_channel_in_mask(config->channel_mask);
+        if (!input_sample_rate_supported(config->sample_rate)) {
+            config->sample_rate = DEFAULT_SAMPLE_RATE_HZ;
+        }
+        if (!input_format_supported(config->format)) {
+            config->format = DEFAULT_FORMAT;
+        }
+    } else {
+        config->channel_mask = get_supported_channel_out_mask(config->channel_mask);
+        config->sample_rate = get_supported_sample_rate(config->sample_rate);
+        if (!pipe_format_supported(config->format)) {
+            config->format = DEFAULT_FORMAT;
+        }
+    }
 }
 
 // Verify a submix input or output stream can be opened.
 // Must be called with lock held on the submix_audio_device
-static bool submix_open_validate_l(const struct submix_audio_device * const rsxadev,
-                                 int route_idx,
+static bool submix_open_validate_l(const route_config_t * const route,
                                  const struct audio_config * const config,
                                  const bool opening_input)
 {
@@ -534,9 +845,9 @@ static bool submix_open_validate_l(const struct submix_audio_device * const rsxa
     audio_config pipe_config;
 
     // Query the device for the current audio config and whether input and output streams are open.
-    output_open = rsxadev->routes[route_idx].output != NULL;
-    input_open = rsxadev->routes[route_idx].input != NULL;
-    memcpy(&pipe_config, &rsxadev->routes[route_idx].config.common, sizeof(pipe_config));
+    output_open = route->output != NULL;
+    input_open = route->input != NULL;
+    memcpy(&pipe_config, &route->config.common, sizeof(pipe_config));
 
     // If the stream is already open, don't open it again.
     if (opening_input ? !ENABLE_LEGACY_INPUT_OPEN && input_open : output_open) {
@@ -544,6 +855,11 @@ static bool submix_open_validate_l(const struct submix_audio_device * const rsxa
                 "Output");
         return false;
     }
+    if (opening_input &&
+            submix_audio_device_reader_count_l(route) == MAX_READERS_PER_ROUTE) {
+        ALOGE("submix_open_validate_l(): %d input streams already open.", MAX_READERS_PER_ROUTE);
+        return false;
+    }
 
     SUBMIX_ALOGV("submix_open_validate_l(): sample rate=%d format=%x "
                  "%s_channel_mask=%x", config->sample_rate, config->format,
@@ -556,8 +872,8 @@ static bool submix_open_validate_l(const struct submix_audio_device * const rsxa
         const audio_config * const output_config = opening_input ? &pipe_config : config;
         // Get the channel mask of the open device.
         pipe_config.channel_mask =
-            opening_input ? rsxadev->routes[route_idx].config.output_channel_mask :
-                rsxadev->routes[route_idx].config.input_channel_mask;
+            opening_input ? route->config.output_channel_mask :
+                route->config.input_channel_mask;
         if (!audio_config_compare(input_config, output_config)) {
             ALOGE("submix_open_validate_l(): Unsupported format.");
             return false;
@@ -566,36 +882,96 @@ static bool submix_open_validate_l(const struct submix_audio_device * const rsxa
     return true;
 }
 
+// Route for address: the one in use for it, else a released or new one, put in use for the
+// address once a stream is attached to it by submix_audio_device_create_pipe_l().
 // Must be called with lock held on the submix_audio_device
-static status_t submix_get_route_idx_for_address_l(const struct submix_audio_device * const rsxadev,
-                                                 const char* address, /*in*/
-                                                 int *idx /*out*/)
+static status_t submix_get_route_for_address_l(struct submix_audio_device * const rsxadev,
+                                               const char* address, /*in*/
+                                               route_config_t **route /*out*/)
 {
-    // Do we already have a route for this address
-    int route_idx = -1;
-    int route_empty_idx = -1; // index of an empty route slot that can be used if needed
-    for (int i=0 ; i < MAX_ROUTES ; i++) {
-        if (strcmp(rsxadev->routes[i].address, "") == 0) {
-            route_empty_idx = i;
-        }
-        if (strncmp(rsxadev->routes[i].address, address, AUDIO_DEVICE_MAX_ADDRESS_LEN) == 0) {
-            route_idx = i;
-            break;
-        }
+    *route = submix_find_route_l(rsxadev, address);
+    if (*route == NULL) {
+        *route = rsxadev->free_routes;
+    }
+    if (*route != NULL) {
+        return OK;
     }
 
-    if ((route_idx == -1) && (route_empty_idx == -1)) {
-        ALOGE("Cannot create new route for address %s, max number of routes reached", address);
+    route_config_t * const new_route = new (std::nothrow) route_config_t();
+    if (new_route == NULL) {
+        ALOGE("Cannot create new route for address %s", address);
         return -ENOMEM;
     }
-    if (route_idx == -1) {
-        route_idx = route_empty_idx;
-    }
-    *idx = route_idx;
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&new_route->read_lock, NULL);
+    pthread_cond_init(&new_route->read_cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+    new_route->next = rsxadev->all_routes;
+    rsxadev->all_routes = new_route;
+    new_route->hash_next = rsxadev->free_routes;
+    rsxadev->free_routes = new_route;
+    *route = new_route;
     return OK;
 }
 
 
+static int64_t submix_monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Publish the frame count of a stream.  Only called by the thread reading or writing the stream.
+static void submix_position_update(struct submix_position * const position, const int64_t frames,
+                                   const int64_t time_ns)
+{
+    // android_atomic_inc() is a full barrier, ordering the stores in between.
+    android_atomic_inc(&position->seq);
+    position->frames = frames;
+    position->time_ns = time_ns;
+    android_atomic_inc(&position->seq);
+}
+
+// Get the frame count of a stream last published.  Returns false if none was.
+static bool submix_position_get(const struct submix_position * const position,
+                                int64_t * const frames, int64_t * const time_ns)
+{
+    int32_t seq;
+    do {
+        seq = android_atomic_acquire_load(&position->seq);
+        *frames = position->frames;
+        *time_ns = position->time_ns;
+        android_memory_barrier();
+    } while ((seq & 1) || seq != position->seq);
+    return *time_ns != 0;
+}
+
+// Size in frames of the pipe of the route of address.  An address can carry parameters after the
+// name of the route, separated by semicolons as in set_parameters(): "latency=low" selects
+// LOW_LATENCY_PIPE_SIZE_IN_FRAMES and "pipe_frames=<frames>" any size within
+// [MIN_PIPE_SIZE_IN_FRAMES, MAX_PIPE_SIZE_IN_FRAMES].  The output and the input streams of a route
+// are opened with the same address, so they agree on its size.  The size is rounded up to a power
+// of 2 as by MonoPipe().
+static size_t submix_pipe_size_from_address(const char *address)
+{
+    AudioParameter parms = AudioParameter(String8(address));
+    String8 latency;
+    int requested_frames = DEFAULT_PIPE_SIZE_IN_FRAMES;
+    if (parms.getInt(String8("pipe_frames"), requested_frames) != NO_ERROR &&
+            parms.get(String8("latency"), latency) == NO_ERROR && latency == "low") {
+        requested_frames = LOW_LATENCY_PIPE_SIZE_IN_FRAMES;
+    }
+    size_t frames = MIN_PIPE_SIZE_IN_FRAMES;
+    while (frames < (size_t)max(requested_frames, 0) && frames < MAX_PIPE_SIZE_IN_FRAMES) {
+        frames <<= 1;
+    }
+    SUBMIX_ALOGV("submix_pipe_size_from_address(%s) returns %zu frames", address, frames);
+    return frames;
+}
+
 // Calculate the maximum size of the pipe buffer in frames for the specified stream.
 static size_t calculate_stream_pipe_size_in_frames(const struct audio_stream *stream,
                                                    const struct submix_config *config,
@@ -614,12 +990,12 @@ static uint32_t out_get_sample_rate(const struct audio_stream *stream)
     const struct submix_stream_out * const out = audio_stream_get_submix_stream_out(
             const_cast<struct audio_stream *>(stream));
 #if ENABLE_RESAMPLING
-    const uint32_t out_rate = out->dev->routes[out->route_handle].config.output_sample_rate;
+    const uint32_t out_rate = out->route->config.output_sample_rate;
 #else
-    const uint32_t out_rate = out->dev->routes[out->route_handle].config.common.sample_rate;
+    const uint32_t out_rate = out->route->config.common.sample_rate;
 #endif // ENABLE_RESAMPLING
     SUBMIX_ALOGV("out_get_sample_rate() returns %u for addr %s",
-            out_rate, out->dev->routes[out->route_handle].address);
+            out_rate, out->route->address);
     return out_rate;
 }
 
@@ -629,11 +1005,11 @@ static int out_set_sample_rate(struct audio_stream *stream, uint32_t rate)
 #if ENABLE_RESAMPLING
     // The sample rate of the stream can't be changed once it's set since this would change the
     // output buffer size and hence break playback to the shared pipe.
-    if (rate != out->dev->routes[out->route_handle].config.output_sample_rate) {
+    if (rate != out->route->config.output_sample_rate) {
         ALOGE("out_set_sample_rate() resampling enabled can't change sample rate from "
               "%u to %u for addr %s",
-              out->dev->routes[out->route_handle].config.output_sample_rate, rate,
-              out->dev->routes[out->route_handle].address);
+              out->route->config.output_sample_rate, rate,
+              out->route->address);
         return -ENOSYS;
     }
 #endif // ENABLE_RESAMPLING
@@ -642,7 +1018,7 @@ static int out_set_sample_rate(struct audio_stream *stream, uint32_t rate)
         return -ENOSYS;
     }
     SUBMIX_ALOGV("out_set_sample_rate(rate=%u)", rate);
-    out->dev->routes[out->route_handle].config.common.sample_rate = rate;
+    out->route->config.common.sample_rate = rate;
     return 0;
 }
 
@@ -650,7 +1026,7 @@ static size_t out_get_buffer_size(const struct audio_stream *stream)
 {
     const struct submix_stream_out * const out = audio_stream_get_submix_stream_out(
             const_cast<struct audio_stream *>(stream));
-    const struct submix_config * const config = &out->dev->routes[out->route_handle].config;
+    const struct submix_config * const config = &out->route->config;
     const size_t stream_frame_size =
                             audio_stream_out_frame_size((const struct audio_stream_out *)stream);
     const size_t buffer_size_frames = calculate_stream_pipe_size_in_frames(
@@ -665,7 +1041,7 @@ static audio_channel_mask_t out_get_channels(const struct audio_stream *stream)
 {
     const struct submix_stream_out * const out = audio_stream_get_submix_stream_out(
             const_cast<struct audio_stream *>(stream));
-    uint32_t channel_mask = out->dev->routes[out->route_handle].config.output_channel_mask;
+    uint32_t channel_mask = out->route->config.output_channel_mask;
     SUBMIX_ALOGV("out_get_channels() returns %08x", channel_mask);
     return channel_mask;
 }
@@ -674,7 +1050,7 @@ static audio_format_t out_get_format(const struct audio_stream *stream)
 {
     const struct submix_stream_out * const out = audio_stream_get_submix_stream_out(
             const_cast<struct audio_stream *>(stream));
-    const audio_format_t format = out->dev->routes[out->route_handle].config.common.format;
+    const audio_format_t format = out->route->config.common.format;
     SUBMIX_ALOGV("out_get_format() returns %x", format);
     return format;
 }
@@ -682,7 +1058,7 @@ static audio_format_t out_get_format(const struct audio_stream *stream)
 static int out_set_format(struct audio_stream *stream, audio_format_t format)
 {
     const struct submix_stream_out * const out = audio_stream_get_submix_stream_out(stream);
-    if (format != out->dev->routes[out->route_handle].config.common.format) {
+    if (format != out->route->config.common.format) {
         ALOGE("out_set_format(format=%x) format unsupported", format);
         return -ENOSYS;
     }
@@ -726,8 +1102,7 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
         pthread_mutex_lock(&rsxadev->lock);
         { // using the sink
             sp<MonoPipe> sink =
-                    rsxadev->routes[audio_stream_get_submix_stream_out(stream)->route_handle]
-                                    .rsxSink;
+                    audio_stream_get_submix_stream_out(stream)->route->rsxSink;
             if (sink == NULL) {
                 pthread_mutex_unlock(&rsxadev->lock);
                 return 0;
@@ -752,7 +1127,7 @@ static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
     const struct submix_stream_out * const out = audio_stream_out_get_submix_stream_out(
             const_cast<struct audio_stream_out *>(stream));
-    const struct submix_config * const config = &out->dev->routes[out->route_handle].config;
+    const struct submix_config * const config = &out->route->config;
     const size_t stream_frame_size =
                             audio_stream_out_frame_size(stream);
     const size_t buffer_size_frames = calculate_stream_pipe_size_in_frames(
@@ -773,6 +1148,41 @@ static int out_set_volume(struct audio_stream_out *stream, float left,
     return -ENOSYS;
 }
 
+// Copy frames written to the pipe to the fan-out ring.  Only called by the output stream.
+static void submix_fanout_write(submix_fanout * const fanout, const void *buffer, size_t frames)
+{
+    const uint8_t *data = (const uint8_t *)buffer;
+    int32_t rear = fanout->rear;
+    // Only the last ring of frames could be read.
+    if (frames > fanout->frames) {
+        data += (frames - fanout->frames) * fanout->frame_size;
+        rear += frames - fanout->frames;
+        frames = fanout->frames;
+    }
+    android_atomic_release_store(rear + (int32_t)frames, &fanout->write_end);
+    // orders the store of write_end before the frames it allows overwriting
+    android_memory_barrier();
+    const size_t index = (uint32_t)rear & (fanout->frames - 1);
+    const size_t first = min(frames, fanout->frames - index);
+    memcpy(fanout->buffer + index * fanout->frame_size, data, first * fanout->frame_size);
+    memcpy(fanout->buffer, data + first * fanout->frame_size,
+           (frames - first) * fanout->frame_size);
+    android_atomic_release_store(rear + (int32_t)frames, &fanout->rear);
+}
+
+// Refresh the pipe cached by the output stream from its route.
+// Must be called with lock held on the submix_audio_device
+static void submix_stream_out_update_pipe_l(struct submix_stream_out * const out)
+{
+    route_config_t * const route = out->route;
+    out->pipe_generation = android_atomic_acquire_load(&route->pipe_generation);
+    out->sink = route->rsxSink;
+    out->source = route->rsxSource;
+    out->fanout = route->fanout;
+    // Nobody reads from the pipe while the input is in standby: the output must not block.
+    out->has_input = route->input != NULL && !route->input->input_standby;
+}
+
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
                          size_t bytes)
 {
@@ -781,52 +1191,77 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     const size_t frame_size = audio_stream_out_frame_size(stream);
     struct submix_stream_out * const out = audio_stream_out_get_submix_stream_out(stream);
     struct submix_audio_device * const rsxadev = out->dev;
-    const size_t frames = bytes / frame_size;
-
-    pthread_mutex_lock(&rsxadev->lock);
+    route_config_t * const route = out->route;
+    size_t frames = bytes / frame_size;
+
+    // The effects write what they processed to the effect buffer, at most a buffer of the stream
+    // is written then.  Only PCM16 streams have effects, see out_add_audio_effect().
+    if (!audio_effect_chain_is_empty(&out->effects)) {
+        frames = min(frames, out->effect_buffer_frames);
+        if (audio_effect_chain_process(&out->effects, (const int16_t *)buffer,
+                                       (int16_t *)out->effect_buffer, frames)) {
+            buffer = out->effect_buffer;
+        }
+    }
 
-    out->output_standby = false;
+    // The lock is only needed when leaving standby, which in_read() observes, or when the route's
+    // pipe changed since the previous write; otherwise the cached references are used as they are.
+    // out_standby() is called by the thread writing to the stream so output_standby can be read
+    // here without the lock.
+    if (out->output_standby ||
+            android_atomic_acquire_load(&route->pipe_generation) != out->pipe_generation) {
+        pthread_mutex_lock(&rsxadev->lock);
+        if (out->output_standby) {
+            android_atomic_release_store((int32_t)out->presentation.frames,
+                                         &out->standby_exit_frames);
+        }
+        out->output_standby = false;
+        submix_stream_out_update_pipe_l(out);
+        pthread_mutex_unlock(&rsxadev->lock);
+    }
 
-    sp<MonoPipe> sink = rsxadev->routes[out->route_handle].rsxSink;
+    MonoPipe * const sink = out->sink.get();
     if (sink != NULL) {
         if (sink->isShutdown()) {
-            sink.clear();
-            pthread_mutex_unlock(&rsxadev->lock);
             SUBMIX_ALOGV("out_write(): pipe shutdown, ignoring the write.");
             // the pipe has already been shutdown, this buffer will be lost but we must
             //   simulate timing so we don't drain the output faster than realtime
             usleep(frames * 1000000 / out_get_sample_rate(&stream->common));
-            return bytes;
+            out->frames_written += frames;
+            submix_position_update(&out->presentation, out->frames_written,
+                                   submix_monotonic_ns());
+            return frames * frame_size;
         }
     } else {
-        pthread_mutex_unlock(&rsxadev->lock);
         ALOGE("out_write without a pipe!");
         ALOG_ASSERT("out_write without a pipe!");
         return 0;
     }
 
     // If the write to the sink would block when no input stream is present, flush enough frames
-    // from the pipe to make space to write the most recent data.
-    {
+    // from the pipe to make space to write the most recent data.  The flush buffer holds a whole
+    // stereo pipe so this is usually a single read: frames are only discarded, so it is shared by
+    // all routes.
+    if (!out->has_input) {
         const size_t availableToWrite = sink->availableToWrite();
-        sp<MonoPipeReader> source = rsxadev->routes[out->route_handle].rsxSource;
-        if (rsxadev->routes[out->route_handle].input == NULL && availableToWrite < frames) {
-            static uint8_t flush_buffer[64];
-            const size_t flushBufferSizeFrames = sizeof(flush_buffer) / frame_size;
+        if (availableToWrite < frames) {
+            static uint8_t flush_buffer[DEFAULT_PIPE_SIZE_IN_FRAMES * FCC_2 * sizeof(int16_t)];
+            const size_t flushBufferSizeFrames = sizeof(flush_buffer) /
+                    route->config.pipe_frame_size;
             size_t frames_to_flush_from_source = frames - availableToWrite;
-            SUBMIX_ALOGV("out_write(): flushing %d frames from the pipe to avoid blocking",
+            SUBMIX_ALOGV("out_write(): flushing %zu frames from the pipe to avoid blocking",
                          frames_to_flush_from_source);
             while (frames_to_flush_from_source) {
                 const size_t flush_size = min(frames_to_flush_from_source, flushBufferSizeFrames);
-                frames_to_flush_from_source -= flush_size;
                 // read does not block
-                source->read(flush_buffer, flush_size, AudioBufferProvider::kInvalidPTS);
+                const ssize_t flushed = out->source->read(flush_buffer, flush_size,
+                        AudioBufferProvider::kInvalidPTS);
+                if (flushed <= 0) break;
+                frames_to_flush_from_source -= min((size_t)flushed, frames_to_flush_from_source);
             }
         }
     }
 
-    pthread_mutex_unlock(&rsxadev->lock);
-
     written_frames = sink->write(buffer, frames);
 
 #if LOG_STREAMS_TO_FILES
@@ -836,12 +1271,6 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     if (written_frames < 0) {
         if (written_frames == (ssize_t)NEGOTIATE) {
             ALOGE("out_write() write to pipe returned NEGOTIATE");
-
-            pthread_mutex_lock(&rsxadev->lock);
-            sink.clear();
-            pthread_mutex_unlock(&rsxadev->lock);
-
-            written_frames = 0;
             return 0;
         } else {
             // write() returned UNDERRUN or WOULD_BLOCK, retry
@@ -850,14 +1279,32 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
         }
     }
 
-    pthread_mutex_lock(&rsxadev->lock);
-    sink.clear();
-    pthread_mutex_unlock(&rsxadev->lock);
-
     if (written_frames < 0) {
         ALOGE("out_write() failed writing to pipe with %zd", written_frames);
         return 0;
     }
+
+    if (out->fanout != NULL) {
+        submix_fanout_write(out->fanout.get(), buffer, written_frames);
+    }
+
+    // The frames still in the pipe are yet to be read by the input stream.
+    out->frames_written += written_frames;
+    const ssize_t available_to_write = sink->availableToWrite();
+    const int64_t frames_in_pipe = available_to_write >= 0 ?
+            (int64_t)sink->maxFrames() - available_to_write : 0;
+    submix_position_update(&out->presentation, out->frames_written - frames_in_pipe,
+                           submix_monotonic_ns());
+
+    // Wake up readers waiting for data: the barrier orders the write to the pipe before the load
+    // of reader_waiting, submix_wait_for_data() orders them the other way round.
+    android_memory_barrier();
+    if (route->reader_waiting) {
+        pthread_mutex_lock(&route->read_lock);
+        pthread_cond_broadcast(&route->read_cond);
+        pthread_mutex_unlock(&route->read_lock);
+    }
+
     const ssize_t written_bytes = written_frames * frame_size;
     SUBMIX_ALOGV("out_write() wrote %zd bytes %zd frames", written_bytes, written_frames);
     return written_bytes;
@@ -866,31 +1313,87 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
-    (void)stream;
-    (void)dsp_frames;
-    return -EINVAL;
+    const struct submix_stream_out * const out = audio_stream_out_get_submix_stream_out(
+            const_cast<struct audio_stream_out *>(stream));
+    int64_t frames;
+    int64_t time_ns;
+    if (!submix_position_get(&out->presentation, &frames, &time_ns)) {
+        return -EINVAL;
+    }
+    *dsp_frames = (uint32_t)frames -
+            (uint32_t)android_atomic_acquire_load(&out->standby_exit_frames);
+    SUBMIX_ALOGV("out_get_render_position() returns %u", *dsp_frames);
+    return 0;
 }
 
+// Effects are only run on PCM16 streams, the framework keeps running them itself on others.
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-    (void)stream;
-    (void)effect;
-    return 0;
+    struct submix_stream_out * const out = audio_stream_get_submix_stream_out(
+            const_cast<struct audio_stream *>(stream));
+    struct submix_audio_device * const rsxadev = out->dev;
+    if (out_get_format(stream) != AUDIO_FORMAT_PCM_16_BIT) {
+        return -ENOSYS;
+    }
+
+    pthread_mutex_lock(&rsxadev->lock);
+    if (out->effect_buffer == NULL) {
+        const size_t frame_size = audio_stream_out_frame_size(&out->stream);
+        const size_t buffer_size = out_get_buffer_size(stream);
+        out->effect_buffer = malloc(buffer_size);
+        if (out->effect_buffer == NULL) {
+            pthread_mutex_unlock(&rsxadev->lock);
+            return -ENOMEM;
+        }
+        out->effect_buffer_frames = buffer_size / frame_size;
+    }
+    pthread_mutex_unlock(&rsxadev->lock);
+
+    return audio_effect_chain_add(&out->effects, effect);
 }
 
 static int out_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-    (void)stream;
-    (void)effect;
-    return 0;
+    struct submix_stream_out * const out = audio_stream_get_submix_stream_out(
+            const_cast<struct audio_stream *>(stream));
+    return audio_effect_chain_remove(&out->effects, effect);
 }
 
+// Only called by the thread writing to the stream.
 static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
                                         int64_t *timestamp)
 {
-    (void)stream;
-    (void)timestamp;
-    return -EINVAL;
+    const struct submix_stream_out * const out = audio_stream_out_get_submix_stream_out(
+            const_cast<struct audio_stream_out *>(stream));
+    int64_t frames;
+    int64_t time_ns;
+    if (!submix_position_get(&out->presentation, &frames, &time_ns)) {
+        return -EINVAL;
+    }
+    // The next frame written is read once the frames in the pipe before it are.
+    const uint32_t sample_rate = out_get_sample_rate(&stream->common);
+    *timestamp = (time_ns + (out->frames_written - frames) * 1000000000LL / sample_rate) / 1000;
+    SUBMIX_ALOGV("out_get_next_write_timestamp() returns %lld us", (long long)*timestamp);
+    return 0;
+}
+
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames, struct timespec *timestamp)
+{
+    const struct submix_stream_out * const out = audio_stream_out_get_submix_stream_out(
+            const_cast<struct audio_stream_out *>(stream));
+    int64_t presented_frames;
+    int64_t time_ns;
+    if (!submix_position_get(&out->presentation, &presented_frames, &time_ns) ||
+            presented_frames < 0) {
+        return -EINVAL;
+    }
+    *frames = presented_frames;
+    timestamp->tv_sec = time_ns / 1000000000LL;
+    timestamp->tv_nsec = time_ns % 1000000000LL;
+    SUBMIX_ALOGV("out_get_presentation_position() returns %llu frames",
+                 (unsigned long long)*frames);
+    return 0;
 }
 
 /** audio_stream_in implementation **/
@@ -899,9 +1402,9 @@ static uint32_t in_get_sample_rate(const struct audio_stream *stream)
     const struct submix_stream_in * const in = audio_stream_get_submix_stream_in(
         const_cast<struct audio_stream*>(stream));
 #if ENABLE_RESAMPLING
-    const uint32_t rate = in->dev->routes[in->route_handle].config.input_sample_rate;
+    const uint32_t rate = in->config.sample_rate;
 #else
-    const uint32_t rate = in->dev->routes[in->route_handle].config.common.sample_rate;
+    const uint32_t rate = in->route->config.common.sample_rate;
 #endif // ENABLE_RESAMPLING
     SUBMIX_ALOGV("in_get_sample_rate() returns %u", rate);
     return rate;
@@ -913,17 +1416,19 @@ static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate)
 #if ENABLE_RESAMPLING
     // The sample rate of the stream can't be changed once it's set since this would change the
     // input buffer size and hence break recording from the shared pipe.
-    if (rate != in->dev->routes[in->route_handle].config.input_sample_rate) {
+    if (rate != in->config.sample_rate) {
         ALOGE("in_set_sample_rate() resampling enabled can't change sample rate from "
-              "%u to %u", in->dev->routes[in->route_handle].config.input_sample_rate, rate);
+              "%u to %u", in->config.sample_rate, rate);
         return -ENOSYS;
     }
 #endif // ENABLE_RESAMPLING
-    if (!sample_rate_supported(rate)) {
+    if (!input_sample_rate_supported(rate)) {
         ALOGE("in_set_sample_rate(rate=%u) rate unsupported", rate);
         return -ENOSYS;
     }
-    in->dev->routes[in->route_handle].config.common.sample_rate = rate;
+#if !ENABLE_RESAMPLING
+    in->route->config.common.sample_rate = rate;
+#endif // !ENABLE_RESAMPLING
     SUBMIX_ALOGV("in_set_sample_rate() set %u", rate);
     return 0;
 }
@@ -932,7 +1437,7 @@ static size_t in_get_buffer_size(const struct audio_stream *stream)
 {
     const struct submix_stream_in * const in = audio_stream_get_submix_stream_in(
             const_cast<struct audio_stream*>(stream));
-    const struct submix_config * const config = &in->dev->routes[in->route_handle].config;
+    const struct submix_config * const config = &in->route->config;
     const size_t stream_frame_size =
                             audio_stream_in_frame_size((const struct audio_stream_in *)stream);
     size_t buffer_size_frames = calculate_stream_pipe_size_in_frames(
@@ -941,7 +1446,7 @@ static size_t in_get_buffer_size(const struct audio_stream *stream)
     // Scale the size of the buffer based upon the maximum number of frames that could be returned
     // given the ratio of output to input sample rate.
     buffer_size_frames = (size_t)(((float)buffer_size_frames *
-                                   (float)config->input_sample_rate) /
+                                   (float)in->config.sample_rate) /
                                   (float)config->output_sample_rate);
 #endif // ENABLE_RESAMPLING
     const size_t buffer_size_bytes = buffer_size_frames * stream_frame_size;
@@ -954,8 +1459,7 @@ static audio_channel_mask_t in_get_channels(const struct audio_stream *stream)
 {
     const struct submix_stream_in * const in = audio_stream_get_submix_stream_in(
             const_cast<struct audio_stream*>(stream));
-    const audio_channel_mask_t channel_mask =
-            in->dev->routes[in->route_handle].config.input_channel_mask;
+    const audio_channel_mask_t channel_mask = in->config.channel_mask;
     SUBMIX_ALOGV("in_get_channels() returns %x", channel_mask);
     return channel_mask;
 }
@@ -964,7 +1468,7 @@ static audio_format_t in_get_format(const struct audio_stream *stream)
 {
     const struct submix_stream_in * const in = audio_stream_get_submix_stream_in(
             const_cast<struct audio_stream*>(stream));
-    const audio_format_t format = in->dev->routes[in->route_handle].config.common.format;
+    const audio_format_t format = in->config.format;
     SUBMIX_ALOGV("in_get_format() returns %x", format);
     return format;
 }
@@ -972,7 +1476,7 @@ static audio_format_t in_get_format(const struct audio_stream *stream)
 static int in_set_format(struct audio_stream *stream, audio_format_t format)
 {
     const struct submix_stream_in * const in = audio_stream_get_submix_stream_in(stream);
-    if (format != in->dev->routes[in->route_handle].config.common.format) {
+    if (format != in->config.format) {
         ALOGE("in_set_format(format=%x) format unsupported", format);
         return -ENOSYS;
     }
@@ -989,6 +1493,10 @@ static int in_standby(struct audio_stream *stream)
     pthread_mutex_lock(&rsxadev->lock);
 
     in->input_standby = true;
+    // the output stream flushes the pipe while its reader is in standby
+    if (in->route->input == in) {
+        android_atomic_inc(&in->route->pipe_generation);
+    }
 
     pthread_mutex_unlock(&rsxadev->lock);
 
@@ -1024,229 +1532,477 @@ static int in_set_gain(struct audio_stream_in *stream, float gain)
     return 0;
 }
 
+// Number of frames the read in progress can read from the fan-out ring, more than a ring if the
+// stream fell behind.
+static size_t submix_fanout_available(const struct submix_stream_in * const in)
+{
+    return (uint32_t)(android_atomic_acquire_load(&in->read_fanout->rear) - in->fanout_front);
+}
+
+// Read up to frames frames from the fan-out ring for the read in progress.  Returns the number of
+// frames read, 0 if there are none or the stream fell more than a ring behind: it then skips to
+// the most recent half ring, and counts the frames it lost.
+static size_t submix_fanout_read(struct submix_stream_in * const in, void *buffer, size_t frames)
+{
+    submix_fanout * const fanout = in->read_fanout;
+    size_t available = submix_fanout_available(in);
+    if (available <= fanout->frames) {
+        frames = min(frames, available);
+        const size_t index = (uint32_t)in->fanout_front & (fanout->frames - 1);
+        const size_t first = min(frames, fanout->frames - index);
+        memcpy(buffer, fanout->buffer + index * fanout->frame_size, first * fanout->frame_size);
+        memcpy((uint8_t *)buffer + first * fanout->frame_size, fanout->buffer,
+               (frames - first) * fanout->frame_size);
+        // orders the copy before the load of write_end
+        android_memory_barrier();
+        if ((uint32_t)(fanout->write_end - in->fanout_front) <= fanout->frames) {
+            in->fanout_front += frames;
+            return frames;
+        }
+        // overwritten while being copied
+    }
+    const int32_t front = android_atomic_acquire_load(&fanout->write_end) -
+            (int32_t)(fanout->frames / 2);
+    android_atomic_add(front - in->fanout_front, &in->fanout_frames_lost);
+    in->fanout_front = front;
+    return 0;
+}
+
+// Wait until the read in progress has frames to read or deadline_ns (CLOCK_MONOTONIC) has passed.
+// Returns false if the deadline passed.
+static bool submix_wait_for_data(route_config_t * const route,
+                                 const struct submix_stream_in * const in,
+                                 const int64_t deadline_ns)
+{
+    struct timespec deadline;
+    deadline.tv_sec = deadline_ns / 1000000000LL;
+    deadline.tv_nsec = deadline_ns % 1000000000LL;
+    bool timed_out = false;
+
+    pthread_mutex_lock(&route->read_lock);
+    android_atomic_inc(&route->reader_waiting);
+    android_memory_barrier();
+    // availableToRead() only returns a negative value once, when it recovers from an overrun.
+    if (in->read_fanout ? submix_fanout_available(in) == 0 :
+            in->read_source->availableToRead() == 0) {
+        timed_out = pthread_cond_timedwait(&route->read_cond, &route->read_lock,
+                                           &deadline) == ETIMEDOUT;
+    }
+    android_atomic_dec(&route->reader_waiting);
+    pthread_mutex_unlock(&route->read_lock);
+    return !timed_out;
+}
+
+// Convert frames of src_channels channels to dst_channels channels.  Mono is copied to every
+// channel and every channel is averaged into mono, other channels are matched by index: extra
+// source channels are dropped and extra destination channels are silent.  src and dst may be the
+// same buffer as long as it can hold frames of the larger channel count.  Sums of samples of type
+// T are accumulated in type S.
+extern "C++" {
+template <typename T, typename S>
+static void submix_convert_channels_t(const T *src, const uint32_t src_channels,
+                                      T *dst, const uint32_t dst_channels,
+                                      const size_t frames)
+{
+    ALOG_ASSERT(src_channels <= FCC_8 && dst_channels <= FCC_8);
+    if (src_channels == dst_channels) {
+        if (src != dst) {
+            memcpy(dst, src, frames * src_channels * sizeof(T));
+        }
+        return;
+    }
+    // Contract front to back and expand back to front so that a frame is never overwritten
+    // before it's converted when converting in place.
+    const bool expand = dst_channels > src_channels;
+    T samples[FCC_8];
+    for (size_t i = 0; i < frames; i++) {
+        const size_t frame = expand ? frames - 1 - i : i;
+        memcpy(samples, &src[frame * src_channels], src_channels * sizeof(T));
+        T * const out = &dst[frame * dst_channels];
+        if (dst_channels == 1) {
+            S sum = 0;
+            for (uint32_t channel = 0; channel < src_channels; channel++) {
+                sum += samples[channel];
+            }
+            out[0] = (T)(sum / (S)src_channels);
+        } else {
+            for (uint32_t channel = 0; channel < dst_channels; channel++) {
+                out[channel] = src_channels == 1 ? samples[0] :
+                        channel < src_channels ? samples[channel] : 0;
+            }
+        }
+    }
+}
+}  // extern "C++"
+
+// Convert frames of format, a pipe format, as submix_convert_channels_t() does.
+static void submix_convert_channels(const void *src, const uint32_t src_channels,
+                                    void *dst, const uint32_t dst_channels,
+                                    const size_t frames, const audio_format_t format)
+{
+    if (format == AUDIO_FORMAT_PCM_FLOAT) {
+        submix_convert_channels_t<float, float>((const float *)src, src_channels,
+                                                (float *)dst, dst_channels, frames);
+    } else {
+        submix_convert_channels_t<int16_t, int32_t>((const int16_t *)src, src_channels,
+                                                    (int16_t *)dst, dst_channels, frames);
+    }
+}
+
+// Scale frames of channels samples by a gain rising linearly to 1 from 1 / frames when fade_in is
+// set, else falling to 0 from (frames - 1) / frames.  Samples of type T are scaled in type S.
+extern "C++" {
+template <typename T, typename S>
+static void submix_ramp_t(T *samples, const uint32_t channels, const size_t frames,
+                          const bool fade_in)
+{
+    for (size_t i = 0; i < frames; i++) {
+        const S gain = (S)(fade_in ? i + 1 : frames - 1 - i) / (S)frames;
+        for (uint32_t channel = 0; channel < channels; channel++, samples++) {
+            *samples = (T)(*samples * gain);
+        }
+    }
+}
+}  // extern "C++"
+
+// Ramp frames of format, an input stream format, as submix_ramp_t() does.
+static void submix_ramp(void *buffer, const audio_format_t format, const uint32_t channels,
+                        const size_t frames, const bool fade_in)
+{
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+        submix_ramp_t<int16_t, float>((int16_t *)buffer, channels, frames, fade_in);
+        break;
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+    case AUDIO_FORMAT_PCM_32_BIT:
+        submix_ramp_t<int32_t, double>((int32_t *)buffer, channels, frames, fade_in);
+        break;
+    case AUDIO_FORMAT_PCM_FLOAT:
+        submix_ramp_t<float, float>((float *)buffer, channels, frames, fade_in);
+        break;
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED: {
+        uint8_t *sample = (uint8_t *)buffer;
+        for (size_t i = 0; i < frames; i++) {
+            const double gain = (double)(fade_in ? i + 1 : frames - 1 - i) / (double)frames;
+            for (uint32_t channel = 0; channel < channels; channel++, sample += 3) {
+                const int32_t value = (int32_t)((uint32_t)sample[0] << 8 |
+                        (uint32_t)sample[1] << 16 | (uint32_t)sample[2] << 24) >> 8;
+                const int32_t scaled = (int32_t)(value * gain);
+                sample[0] = (uint8_t)scaled;
+                sample[1] = (uint8_t)(scaled >> 8);
+                sample[2] = (uint8_t)(scaled >> 16);
+            }
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Read up to frames frames from the pipe or fan-out ring of the read in progress into dst,
+// converted to the channel count of the input stream and conversion_format, waiting for the output
+// stream to write them if there are none.  Returns the number of frames read, 0 if the read
+// deadline passed.
+static size_t submix_in_read_pipe(struct submix_stream_in * const in, void * const dst,
+                                  size_t frames)
+{
+    const uint32_t pipe_channels = in->conversion_pipe_channel_count;
+    const uint32_t channels = in->conversion_channel_count;
+    const audio_format_t pipe_format = in->conversion_pipe_format;
+    const audio_format_t format = in->conversion_format;
+    // Read straight into dst unless channels or samples are converted.
+    void *pipe_data = dst;
+    if (pipe_channels != channels || pipe_format != format) {
+        pipe_data = in->pipe_buffer;
+        frames = min(frames, (size_t)CONVERSION_BUFFER_FRAMES);
+    }
+    if (frames == 0) {
+        return 0;
+    }
+
+    ssize_t frames_read;
+    while ((frames_read = in->read_fanout ? submix_fanout_read(in, pipe_data, frames) :
+            in->read_source->read(pipe_data, frames, AudioBufferProvider::kInvalidPTS)) <= 0) {
+        SUBMIX_ALOGE("  in_read read returned %zd", frames_read);
+        if (!submix_wait_for_data(in->route, in,
+                                  in->read_deadline_ns)) {
+            return 0;
+        }
+    }
+    if (pipe_format != format) {
+        // in place, samples of format are not larger
+        memcpy_by_audio_format(pipe_data, format, pipe_data, pipe_format,
+                               frames_read * pipe_channels);
+    }
+    submix_convert_channels(pipe_data, pipe_channels, dst, channels, frames_read, format);
+    return frames_read;
+}
+
+#if ENABLE_RESAMPLING
+// Resampler provider reading from the pipe into the pipe buffer of the input stream.
+static int submix_in_get_next_buffer(struct resampler_buffer_provider *provider,
+                                     struct resampler_buffer *buffer)
+{
+    struct submix_stream_in * const in = reinterpret_cast<struct submix_stream_in *>(
+            reinterpret_cast<uint8_t *>(provider) -
+                    offsetof(struct submix_stream_in, resampler_provider));
+    buffer->frame_count = submix_in_read_pipe(in, in->pipe_buffer, buffer->frame_count);
+    if (buffer->frame_count == 0) {
+        buffer->raw = NULL;
+        return -ETIMEDOUT;
+    }
+    buffer->i16 = (int16_t *)in->pipe_buffer;
+    return 0;
+}
+
+static void submix_in_release_buffer(struct resampler_buffer_provider *provider,
+                                     struct resampler_buffer *buffer)
+{
+    (void)provider;
+    (void)buffer;
+}
+#endif // ENABLE_RESAMPLING
+
+// Release the conversion from the pipe to the format of the input stream.
+static void submix_in_release_conversion(struct submix_stream_in * const in)
+{
+    if (in->resampler) {
+        release_resampler(in->resampler);
+        in->resampler = NULL;
+    }
+    free(in->pipe_buffer);
+    in->pipe_buffer = NULL;
+    free(in->conversion_buffer);
+    in->conversion_buffer = NULL;
+    in->conversion_pipe_sample_rate = 0;
+    in->conversion_pipe_channel_count = 0;
+    in->conversion_pipe_format = AUDIO_FORMAT_DEFAULT;
+}
+
+// Set up the conversion from the pipe to the format of the input stream, unless it was set up for
+// the current sample rate, channel count and format of the pipe already: they only change when an
+// output stream with another config is opened.  Returns false if it could not be set up.
+// Must be called with lock held on the submix_audio_device
+static bool submix_in_configure_conversion_l(struct submix_stream_in * const in)
+{
+    const struct submix_config * const config = &in->route->config;
+    if (in->conversion_pipe_sample_rate == config->common.sample_rate &&
+            in->conversion_pipe_channel_count == config->pipe_channel_count &&
+            in->conversion_pipe_format == config->common.format) {
+        return true;
+    }
+    submix_in_release_conversion(in);
+
+    const uint32_t channels = audio_channel_count_from_in_mask(in->config.channel_mask);
+    const uint32_t max_channels = max(channels, config->pipe_channel_count);
+    audio_format_t format = config->common.format;
+#if ENABLE_RESAMPLING
+    if (config->common.sample_rate != in->config.sample_rate) {
+        format = DEFAULT_FORMAT;
+    }
+#endif // ENABLE_RESAMPLING
+    in->pipe_buffer = malloc(CONVERSION_BUFFER_FRAMES * max_channels *
+                             audio_bytes_per_sample(config->common.format));
+    in->conversion_buffer = malloc(CONVERSION_BUFFER_FRAMES * channels *
+                                   audio_bytes_per_sample(format));
+    if (!in->pipe_buffer || !in->conversion_buffer) {
+        submix_in_release_conversion(in);
+        return false;
+    }
+#if ENABLE_RESAMPLING
+    if (config->common.sample_rate != in->config.sample_rate) {
+        in->resampler_provider.get_next_buffer = submix_in_get_next_buffer;
+        in->resampler_provider.release_buffer = submix_in_release_buffer;
+        const int ret = create_resampler(config->common.sample_rate, in->config.sample_rate,
+                                         channels, RESAMPLER_QUALITY_DEFAULT,
+                                         &in->resampler_provider, &in->resampler);
+        if (ret != 0) {
+            ALOGE("submix_in_configure_conversion_l(): create_resampler(%u, %u, %u) failed %d",
+                  config->common.sample_rate, in->config.sample_rate, channels, ret);
+            in->resampler = NULL;
+            submix_in_release_conversion(in);
+            return false;
+        }
+    }
+#endif // ENABLE_RESAMPLING
+    in->conversion_pipe_sample_rate = config->common.sample_rate;
+    in->conversion_pipe_channel_count = config->pipe_channel_count;
+    in->conversion_pipe_format = config->common.format;
+    in->conversion_channel_count = channels;
+    in->conversion_format = format;
+    ALOGV("submix_in_configure_conversion_l(): pipe %u Hz %u channels format %x to %u channels, "
+          "format %x%s", config->common.sample_rate, config->pipe_channel_count,
+          config->common.format, channels, in->config.format, in->resampler ? ", resampled" : "");
+    return true;
+}
+
 static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
                        size_t bytes)
 {
     struct submix_stream_in * const in = audio_stream_in_get_submix_stream_in(stream);
     struct submix_audio_device * const rsxadev = in->dev;
-    struct audio_config *format;
     const size_t frame_size = audio_stream_in_frame_size(stream);
     const size_t frames_to_read = bytes / frame_size;
 
     SUBMIX_ALOGV("in_read bytes=%zu", bytes);
     pthread_mutex_lock(&rsxadev->lock);
 
-    const bool output_standby = rsxadev->routes[in->route_handle].output == NULL
-            ? true : rsxadev->routes[in->route_handle].output->output_standby;
+    const bool output_standby = in->route->output == NULL
+            ? true : in->route->output->output_standby;
     const bool output_standby_transition = (in->output_standby_rec_thr != output_standby);
     in->output_standby_rec_thr = output_standby;
 
     if (in->input_standby || output_standby_transition) {
+        if (in->input_standby && in->route->input == in) {
+            // the output stream stops flushing the pipe
+            android_atomic_inc(&in->route->pipe_generation);
+        }
         in->input_standby = false;
         // keep track of when we exit input standby (== first read == start "real recording")
         // or when we start recording silence, and reset projected time
-        int rc = clock_gettime(CLOCK_MONOTONIC, &in->record_start_time);
-        if (rc == 0) {
-            in->read_counter_frames = 0;
+        in->record_start_ns = submix_monotonic_ns();
+        in->read_counter_frames = 0;
+        in->silent = true;
+        // drop what the resampler kept from before the transition
+        if (in->resampler) {
+            in->resampler->reset(in->resampler);
         }
     }
 
     in->read_counter_frames += frames_to_read;
     size_t remaining_frames = frames_to_read;
+    const uint32_t sample_rate = in_get_sample_rate(&stream->common);
 
-    {
-        // about to read from audio source
-        sp<MonoPipeReader> source = rsxadev->routes[in->route_handle].rsxSource;
-        if (source == NULL) {
-            in->read_error_count++;// ok if it rolls over
-            ALOGE_IF(in->read_error_count < MAX_READ_ERROR_LOGS,
-                    "no audio pipe yet we're trying to read! (not all errors will be logged)");
-            pthread_mutex_unlock(&rsxadev->lock);
-            usleep(frames_to_read * 1000000 / in_get_sample_rate(&stream->common));
-            memset(buffer, 0, bytes);
-            return bytes;
+    // Wait for data from the output stream until the time this read is projected to return at,
+    // then pad with silence.  The read returns at that time whether it got data or not, so it is
+    // paced without reading the clock again.
+    const int64_t read_deadline_ns = in->record_start_ns +
+            in->read_counter_frames * 1000000000LL / sample_rate;
+
+    // about to read from audio source
+    sp<MonoPipeReader> source = in->route->rsxSource;
+    bool received = false;
+    int64_t now_ns = 0;
+    if (source == NULL) {
+        in->read_error_count++;// ok if it rolls over
+        ALOGE_IF(in->read_error_count < MAX_READ_ERROR_LOGS,
+                "no audio pipe yet we're trying to read! (not all errors will be logged)");
+        pthread_mutex_unlock(&rsxadev->lock);
+    } else if (!submix_in_configure_conversion_l(in)) {
+        source.clear();
+        pthread_mutex_unlock(&rsxadev->lock);
+    } else {
+        if (in->fanout_reader) {
+            // A new ring only holds frames written after it was created.
+            const sp<submix_fanout>& fanout = in->route->fanout;
+            if (in->fanout != fanout) {
+                in->fanout = fanout;
+                in->fanout_front = fanout != NULL ? fanout->rear : 0;
+            }
         }
+        const audio_format_t format = in->config.format;
+        const audio_format_t conversion_format = in->conversion_format;
 
         pthread_mutex_unlock(&rsxadev->lock);
 
-        // read the data from the pipe (it's non blocking)
-        int attempts = 0;
+        // read the data from the pipe (it's non blocking), converted to the stream's config
+        const uint32_t channel_count = in->conversion_channel_count;
+        in->read_fanout = in->fanout_reader ? in->fanout.get() : NULL;
+        in->read_source = source.get();
+        in->read_deadline_ns = read_deadline_ns;
         char* buff = (char*)buffer;
-#if ENABLE_CHANNEL_CONVERSION
-        // Determine whether channel conversion is required.
-        const uint32_t input_channels = audio_channel_count_from_in_mask(
-            rsxadev->routes[in->route_handle].config.input_channel_mask);
-        const uint32_t output_channels = audio_channel_count_from_out_mask(
-            rsxadev->routes[in->route_handle].config.output_channel_mask);
-        if (input_channels != output_channels) {
-            SUBMIX_ALOGV("in_read(): %d output channels will be converted to %d "
-                         "input channels", output_channels, input_channels);
-            // Only support 16-bit PCM channel conversion from mono to stereo or stereo to mono.
-            ALOG_ASSERT(rsxadev->routes[in->route_handle].config.common.format ==
-                    AUDIO_FORMAT_PCM_16_BIT);
-            ALOG_ASSERT((input_channels == 1 && output_channels == 2) ||
-                        (input_channels == 2 && output_channels == 1));
-        }
-#endif // ENABLE_CHANNEL_CONVERSION
-
-#if ENABLE_RESAMPLING
-        const uint32_t input_sample_rate = in_get_sample_rate(&stream->common);
-        const uint32_t output_sample_rate =
-                rsxadev->routes[in->route_handle].config.output_sample_rate;
-        const size_t resampler_buffer_size_frames =
-            sizeof(rsxadev->routes[in->route_handle].resampler_buffer) /
-                sizeof(rsxadev->routes[in->route_handle].resampler_buffer[0]);
-        float resampler_ratio = 1.0f;
-        // Determine whether resampling is required.
-        if (input_sample_rate != output_sample_rate) {
-            resampler_ratio = (float)output_sample_rate / (float)input_sample_rate;
-            // Only support 16-bit PCM mono resampling.
-            // NOTE: Resampling is performed after the channel conversion step.
-            ALOG_ASSERT(rsxadev->routes[in->route_handle].config.common.format ==
-                    AUDIO_FORMAT_PCM_16_BIT);
-            ALOG_ASSERT(audio_channel_count_from_in_mask(
-                    rsxadev->routes[in->route_handle].config.input_channel_mask) == 1);
-        }
-#endif // ENABLE_RESAMPLING
-
-        while ((remaining_frames > 0) && (attempts < MAX_READ_ATTEMPTS)) {
-            ssize_t frames_read = -1977;
-            size_t read_frames = remaining_frames;
-#if ENABLE_RESAMPLING
-            char* const saved_buff = buff;
-            if (resampler_ratio != 1.0f) {
-                // Calculate the number of frames from the pipe that need to be read to generate
-                // the data for the input stream read.
-                const size_t frames_required_for_resampler = (size_t)(
-                    (float)read_frames * (float)resampler_ratio);
-                read_frames = min(frames_required_for_resampler, resampler_buffer_size_frames);
-                // Read into the resampler buffer.
-                buff = (char*)rsxadev->routes[in->route_handle].resampler_buffer;
+        while (remaining_frames > 0) {
+            // Frames are produced in conversion_format, straight into the buffer if that is the
+            // format of the stream.
+            void * const data = format == conversion_format ? (void *)buff :
+                    in->conversion_buffer;
+            const size_t frames = format == conversion_format ? remaining_frames :
+                    min(remaining_frames, (size_t)CONVERSION_BUFFER_FRAMES);
+            size_t frames_read;
+            if (in->resampler) {
+                frames_read = frames;
+                in->resampler->resample_from_provider(in->resampler, (int16_t *)data,
+                                                      &frames_read);
+            } else {
+                frames_read = submix_in_read_pipe(in, data, frames);
             }
-#endif // ENABLE_RESAMPLING
-#if ENABLE_CHANNEL_CONVERSION
-            if (output_channels == 1 && input_channels == 2) {
-                // Need to read half the requested frames since the converted output
-                // data will take twice the space (mono->stereo).
-                read_frames /= 2;
+            if (frames_read == 0) {
+                // The deadline passed without data from the output stream.
+                break;
             }
-#endif // ENABLE_CHANNEL_CONVERSION
-
-            SUBMIX_ALOGV("in_read(): frames available to read %zd", source->availableToRead());
-
-            frames_read = source->read(buff, read_frames, AudioBufferProvider::kInvalidPTS);
-
-            SUBMIX_ALOGV("in_read(): frames read %zd", frames_read);
-
-#if ENABLE_CHANNEL_CONVERSION
-            // Perform in-place channel conversion.
-            // NOTE: In the following "input stream" refers to the data returned by this function
-            // and "output stream" refers to the data read from the pipe.
-            if (input_channels != output_channels && frames_read > 0) {
-                int16_t *data = (int16_t*)buff;
-                if (output_channels == 2 && input_channels == 1) {
-                    // Offset into the output stream data in samples.
-                    ssize_t output_stream_offset = 0;
-                    for (ssize_t input_stream_frame = 0; input_stream_frame < frames_read;
-                         input_stream_frame++, output_stream_offset += 2) {
-                        // Average the content from both channels.
-                        data[input_stream_frame] = ((int32_t)data[output_stream_offset] +
-                                                    (int32_t)data[output_stream_offset + 1]) / 2;
-                    }
-                } else if (output_channels == 1 && input_channels == 2) {
-                    // Offset into the input stream data in samples.
-                    ssize_t input_stream_offset = (frames_read - 1) * 2;
-                    for (ssize_t output_stream_frame = frames_read - 1; output_stream_frame >= 0;
-                         output_stream_frame--, input_stream_offset -= 2) {
-                        const short sample = data[output_stream_frame];
-                        data[input_stream_offset] = sample;
-                        data[input_stream_offset + 1] = sample;
-                    }
-                }
+            if (format != conversion_format) {
+                memcpy_by_audio_format(buff, format, data, conversion_format,
+                                       frames_read * channel_count);
             }
-#endif // ENABLE_CHANNEL_CONVERSION
-
-#if ENABLE_RESAMPLING
-            if (resampler_ratio != 1.0f) {
-                SUBMIX_ALOGV("in_read(): resampling %zd frames", frames_read);
-                const int16_t * const data = (int16_t*)buff;
-                int16_t * const resampled_buffer = (int16_t*)saved_buff;
-                // Resample with *no* filtering - if the data from the ouptut stream was really
-                // sampled at a different rate this will result in very nasty aliasing.
-                const float output_stream_frames = (float)frames_read;
-                size_t input_stream_frame = 0;
-                for (float output_stream_frame = 0.0f;
-                     output_stream_frame < output_stream_frames &&
-                     input_stream_frame < remaining_frames;
-                     output_stream_frame += resampler_ratio, input_stream_frame++) {
-                    resampled_buffer[input_stream_frame] = data[(size_t)output_stream_frame];
-                }
-                ALOG_ASSERT(input_stream_frame <= (ssize_t)resampler_buffer_size_frames);
-                SUBMIX_ALOGV("in_read(): resampler produced %zd frames", input_stream_frame);
-                frames_read = input_stream_frame;
-                buff = saved_buff;
+            if (format == AUDIO_FORMAT_PCM_16_BIT) {
+                audio_effect_chain_process(&in->effects, (const int16_t *)buff, (int16_t *)buff,
+                                           frames_read);
             }
-#endif // ENABLE_RESAMPLING
 
-            if (frames_read > 0) {
 #if LOG_STREAMS_TO_FILES
-                if (in->log_fd >= 0) write(in->log_fd, buff, frames_read * frame_size);
+            if (in->log_fd >= 0) write(in->log_fd, buff, frames_read * frame_size);
 #endif // LOG_STREAMS_TO_FILES
 
-                remaining_frames -= frames_read;
-                buff += frames_read * frame_size;
-                SUBMIX_ALOGV("  in_read (att=%d) got %zd frames, remaining=%zu",
-                             attempts, frames_read, remaining_frames);
-            } else {
-                attempts++;
-                SUBMIX_ALOGE("  in_read read returned %zd", frames_read);
-                usleep(READ_ATTEMPT_SLEEP_MS * 1000);
-            }
+            remaining_frames -= frames_read;
+            buff += frames_read * frame_size;
+            SUBMIX_ALOGV("  in_read got %zu frames, remaining=%zu",
+                         frames_read, remaining_frames);
         }
+        // Frames the output stream wrote that are still waiting to be read have been received.
+        const size_t pipe_frames = in->read_fanout ?
+                min(submix_fanout_available(in), in->read_fanout->frames) :
+                (size_t)max(in->read_source->availableToRead(), (ssize_t)0);
+        in->frames_read += frames_to_read;
+        now_ns = submix_monotonic_ns();
+        submix_position_update(&in->capture, in->frames_read +
+                               (int64_t)pipe_frames * sample_rate /
+                                       in->conversion_pipe_sample_rate,
+                               now_ns);
+        in->read_fanout = NULL;
+        in->read_source = NULL;
+        received = true;
         // done using the source
         pthread_mutex_lock(&rsxadev->lock);
         source.clear();
         pthread_mutex_unlock(&rsxadev->lock);
     }
 
+    // Conceal the gaps in what the output stream wrote: data resuming after silence fades in and
+    // data followed by silence fades out, rather than stepping to or from zero.
+    const size_t data_frames = frames_to_read - remaining_frames;
+    const size_t ramp_frames = min(data_frames, (size_t)(sample_rate * SILENCE_RAMP_MS / 1000));
+    if (ramp_frames > 0) {
+        const uint32_t channels = frame_size / audio_bytes_per_sample(in->config.format);
+        if (in->silent) {
+            submix_ramp(buffer, in->config.format, channels, ramp_frames, true);
+        }
+        if (remaining_frames > 0) {
+            submix_ramp((char *)buffer + (data_frames - ramp_frames) * frame_size,
+                        in->config.format, channels, ramp_frames, false);
+        }
+    }
+    in->silent = remaining_frames > 0;
+
     if (remaining_frames > 0) {
         const size_t remaining_bytes = remaining_frames * frame_size;
         SUBMIX_ALOGV("  clearing remaining_frames = %zu", remaining_frames);
         memset(((char*)buffer)+ bytes - remaining_bytes, 0, remaining_bytes);
     }
 
-    // compute how much we need to sleep after reading the data by comparing the wall clock with
-    //   the projected time at which we should return.
-    struct timespec time_after_read;// wall clock after reading from the pipe
-    struct timespec record_duration;// observed record duration
-    int rc = clock_gettime(CLOCK_MONOTONIC, &time_after_read);
-    const uint32_t sample_rate = in_get_sample_rate(&stream->common);
-    if (rc == 0) {
-        // for how long have we been recording?
-        record_duration.tv_sec  = time_after_read.tv_sec - in->record_start_time.tv_sec;
-        record_duration.tv_nsec = time_after_read.tv_nsec - in->record_start_time.tv_nsec;
-        if (record_duration.tv_nsec < 0) {
-            record_duration.tv_sec--;
-            record_duration.tv_nsec += 1000000000;
-        }
-
-        // read_counter_frames contains the number of frames that have been read since the
-        // beginning of recording (including this call): it's converted to usec and compared to
-        // how long we've been recording for, which gives us how long we must wait to sync the
-        // projected recording time, and the observed recording time.
-        long projected_vs_observed_offset_us =
-                ((int64_t)(in->read_counter_frames
-                            - (record_duration.tv_sec*sample_rate)))
-                        * 1000000 / sample_rate
-                - (record_duration.tv_nsec / 1000);
-
-        SUBMIX_ALOGV("  record duration %5lds %3ldms, will wait: %7ldus",
-                record_duration.tv_sec, record_duration.tv_nsec/1000000,
-                projected_vs_observed_offset_us);
-        if (projected_vs_observed_offset_us > 0) {
-            usleep(projected_vs_observed_offset_us);
+    // Return at the projected time, unless the read is late already.
+    if (!received || read_deadline_ns > now_ns) {
+        struct timespec deadline;
+        deadline.tv_sec = read_deadline_ns / 1000000000LL;
+        deadline.tv_nsec = read_deadline_ns % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
         }
     }
+    if (!received) {
+        // Silence only: the frames were returned at the deadline.
+        in->frames_read += frames_to_read;
+        submix_position_update(&in->capture, in->frames_read, read_deadline_ns);
+    }
 
     SUBMIX_ALOGV("in_read returns %zu", bytes);
     return bytes;
@@ -1255,22 +2011,41 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
 
 static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
 {
-    (void)stream;
+    struct submix_stream_in * const in = audio_stream_in_get_submix_stream_in(stream);
+    return (uint32_t)android_atomic_and(0, &in->fanout_frames_lost);
+}
+
+static int in_get_capture_position(const struct audio_stream_in *stream,
+                                   int64_t *frames, int64_t *time)
+{
+    const struct submix_stream_in * const in = audio_stream_in_get_submix_stream_in(
+            const_cast<struct audio_stream_in *>(stream));
+    if (frames == NULL || time == NULL) {
+        return -EINVAL;
+    }
+    if (!submix_position_get(&in->capture, frames, time)) {
+        return -ENOSYS;
+    }
+    SUBMIX_ALOGV("in_get_capture_position() returns %lld frames", (long long)*frames);
     return 0;
 }
 
+// As on output, only PCM16 streams run effects.
 static int in_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-    (void)stream;
-    (void)effect;
-    return 0;
+    struct submix_stream_in * const in = audio_stream_get_submix_stream_in(
+            const_cast<struct audio_stream *>(stream));
+    if (in->config.format != AUDIO_FORMAT_PCM_16_BIT) {
+        return -ENOSYS;
+    }
+    return audio_effect_chain_add(&in->effects, effect);
 }
 
 static int in_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-    (void)stream;
-    (void)effect;
-    return 0;
+    struct submix_stream_in * const in = audio_stream_get_submix_stream_in(
+            const_cast<struct audio_stream *>(stream));
+    return audio_effect_chain_remove(&in->effects, effect);
 }
 
 static int adev_open_output_stream(struct audio_hw_device *dev,
@@ -1294,18 +2069,18 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     // Make sure it's possible to open the device given the current audio config.
     submix_sanitize_config(config, false);
 
-    int route_idx = -1;
+    route_config_t *route = NULL;
 
     pthread_mutex_lock(&rsxadev->lock);
 
-    status_t res = submix_get_route_idx_for_address_l(rsxadev, address, &route_idx);
+    status_t res = submix_get_route_for_address_l(rsxadev, address, &route);
     if (res != OK) {
         ALOGE("Error %d looking for address=%s in adev_open_output_stream", res, address);
         pthread_mutex_unlock(&rsxadev->lock);
         return res;
     }
 
-    if (!submix_open_validate_l(rsxadev, route_idx, config, false)) {
+    if (!submix_open_validate_l(route, config, false)) {
         ALOGE("adev_open_output_stream(): Unable to open output stream for address %s", address);
         pthread_mutex_unlock(&rsxadev->lock);
         return -EINVAL;
@@ -1335,27 +2110,44 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.write = out_write;
     out->stream.get_render_position = out_get_render_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
+    out->stream.get_presentation_position = out_get_presentation_position;
+    audio_effect_chain_init(&out->effects);
 
 #if ENABLE_RESAMPLING
     // Recreate the pipe with the correct sample rate so that MonoPipe.write() rate limits
     // writes correctly.
-    force_pipe_creation = rsxadev->routes[route_idx].config.common.sample_rate
+    force_pipe_creation = route->config.common.sample_rate
             != config->sample_rate;
 #endif // ENABLE_RESAMPLING
+#if ENABLE_CHANNEL_CONVERSION
+    // Likewise the pipe holds frames laid out as written by the output stream.
+    force_pipe_creation = force_pipe_creation ||
+            route->config.pipe_channel_count !=
+                    audio_channel_count_from_out_mask(config->channel_mask);
+#endif // ENABLE_CHANNEL_CONVERSION
+    // The pipe holds samples as written by the output stream.
+    force_pipe_creation = force_pipe_creation ||
+            (route->rsxSink != NULL && route->config.common.format != config->format);
+    // An input stream opened first may have sized the pipe for another address.
+    const size_t pipe_size_frames = submix_pipe_size_from_address(address);
+    force_pipe_creation = force_pipe_creation ||
+            (route->rsxSink != NULL &&
+             route->config.buffer_size_frames != pipe_size_frames);
 
     // If the sink has been shutdown or pipe recreation is forced (see above), delete the pipe so
     // that it's recreated.
-    if ((rsxadev->routes[route_idx].rsxSink != NULL
-            && rsxadev->routes[route_idx].rsxSink->isShutdown()) || force_pipe_creation) {
-        submix_audio_device_release_pipe_l(rsxadev, route_idx);
+    if ((route->rsxSink != NULL
+            && route->rsxSink->isShutdown()) || force_pipe_creation) {
+        submix_audio_device_release_pipe_l(rsxadev, route);
     }
 
     // Store a pointer to the device from the output stream.
     out->dev = rsxadev;
     // Initialize the pipe.
-    ALOGV("adev_open_output_stream(): about to create pipe at index %d", route_idx);
-    submix_audio_device_create_pipe_l(rsxadev, config, DEFAULT_PIPE_SIZE_IN_FRAMES,
-            DEFAULT_PIPE_PERIOD_COUNT, NULL, out, address, route_idx);
+    ALOGV("adev_open_output_stream(): about to create pipe for route %p", route);
+    submix_audio_device_create_pipe_l(rsxadev, config, pipe_size_frames,
+            DEFAULT_PIPE_PERIOD_COUNT, NULL, out, address, route);
+    submix_stream_out_update_pipe_l(out);
 #if LOG_STREAMS_TO_FILES
     out->log_fd = open(LOG_STREAM_OUT_FILENAME, O_CREAT | O_TRUNC | O_WRONLY,
                        LOG_STREAM_FILE_PERMISSIONS);
@@ -1378,13 +2170,18 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     struct submix_stream_out * const out = audio_stream_out_get_submix_stream_out(stream);
 
     pthread_mutex_lock(&rsxadev->lock);
-    ALOGD("adev_close_output_stream() addr = %s", rsxadev->routes[out->route_handle].address);
+    ALOGD("adev_close_output_stream() addr = %s", out->route->address);
     submix_audio_device_destroy_pipe_l(audio_hw_device_get_submix_audio_device(dev), NULL, out);
+    out->sink.clear();
+    out->source.clear();
+    out->fanout.clear();
 #if LOG_STREAMS_TO_FILES
     if (out->log_fd >= 0) close(out->log_fd);
 #endif // LOG_STREAMS_TO_FILES
 
     pthread_mutex_unlock(&rsxadev->lock);
+    audio_effect_chain_destroy(&out->effects);
+    free(out->effect_buffer);
     free(out);
 }
 
@@ -1473,13 +2270,16 @@ static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
         size_t max_buffer_period_size_frames = 0;
         struct submix_audio_device * rsxadev = audio_hw_device_get_submix_audio_device(
                 const_cast<struct audio_hw_device*>(dev));
-        // look for the largest buffer period size
-        for (int i = 0 ; i < MAX_ROUTES ; i++) {
-            if (rsxadev->routes[i].config.buffer_period_size_frames > max_buffer_period_size_frames)
+        // look for the largest buffer period size, released routes included
+        pthread_mutex_lock(&rsxadev->lock);
+        for (const route_config_t *route = rsxadev->all_routes; route != NULL;
+                route = route->next) {
+            if (route->config.buffer_period_size_frames > max_buffer_period_size_frames)
             {
-                max_buffer_period_size_frames = rsxadev->routes[i].config.buffer_period_size_frames;
+                max_buffer_period_size_frames = route->config.buffer_period_size_frames;
             }
         }
+        pthread_mutex_unlock(&rsxadev->lock);
         const size_t frame_size_in_bytes = audio_channel_count_from_in_mask(config->channel_mask) *
                 audio_bytes_per_sample(config->format);
         const size_t buffer_size = max_buffer_period_size_frames * frame_size_in_bytes;
@@ -1508,11 +2308,11 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     *stream_in = NULL;
 
     // Do we already have a route for this address
-    int route_idx = -1;
+    route_config_t *route = NULL;
 
     pthread_mutex_lock(&rsxadev->lock);
 
-    status_t res = submix_get_route_idx_for_address_l(rsxadev, address, &route_idx);
+    status_t res = submix_get_route_for_address_l(rsxadev, address, &route);
     if (res != OK) {
         ALOGE("Error %d looking for address=%s in adev_open_output_stream", res, address);
         pthread_mutex_unlock(&rsxadev->lock);
@@ -1521,68 +2321,57 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 
     // Make sure it's possible to open the device given the current audio config.
     submix_sanitize_config(config, true);
-    if (!submix_open_validate_l(rsxadev, route_idx, config, true)) {
+    if (!submix_open_validate_l(route, config, true)) {
         ALOGE("adev_open_input_stream(): Unable to open input stream.");
         pthread_mutex_unlock(&rsxadev->lock);
         return -EINVAL;
     }
 
-#if ENABLE_LEGACY_INPUT_OPEN
-    in = rsxadev->routes[route_idx].input;
-    if (in) {
-        in->ref_count++;
-        sp<MonoPipe> sink = rsxadev->routes[route_idx].rsxSink;
-        ALOG_ASSERT(sink != NULL);
-        // If the sink has been shutdown, delete the pipe.
-        if (sink != NULL) {
-            if (sink->isShutdown()) {
-                ALOGD(" Non-NULL shut down sink when opening input stream, releasing, refcount=%d",
-                        in->ref_count);
-                submix_audio_device_release_pipe_l(rsxadev, in->route_handle);
-            } else {
-                ALOGD(" Non-NULL sink when opening input stream, refcount=%d", in->ref_count);
-            }
-        } else {
-            ALOGE("NULL sink when opening input stream, refcount=%d", in->ref_count);
-        }
+    // If the sink has been shutdown, delete the pipe.
+    sp<MonoPipe> sink = route->rsxSink;
+    if (sink != NULL && sink->isShutdown()) {
+        ALOGD(" Non-NULL shut down sink when opening input stream, releasing, readers=%d",
+              submix_audio_device_reader_count_l(route));
+        submix_audio_device_release_pipe_l(rsxadev, route);
     }
-#else
-    in = NULL;
-#endif // ENABLE_LEGACY_INPUT_OPEN
+    sink.clear();
 
+    in = (struct submix_stream_in *)calloc(1, sizeof(struct submix_stream_in));
     if (!in) {
-        in = (struct submix_stream_in *)calloc(1, sizeof(struct submix_stream_in));
-        if (!in) return -ENOMEM;
-        in->ref_count = 1;
-
-        // Initialize the function pointer tables (v-tables).
-        in->stream.common.get_sample_rate = in_get_sample_rate;
-        in->stream.common.set_sample_rate = in_set_sample_rate;
-        in->stream.common.get_buffer_size = in_get_buffer_size;
-        in->stream.common.get_channels = in_get_channels;
-        in->stream.common.get_format = in_get_format;
-        in->stream.common.set_format = in_set_format;
-        in->stream.common.standby = in_standby;
-        in->stream.common.dump = in_dump;
-        in->stream.common.set_parameters = in_set_parameters;
-        in->stream.common.get_parameters = in_get_parameters;
-        in->stream.common.add_audio_effect = in_add_audio_effect;
-        in->stream.common.remove_audio_effect = in_remove_audio_effect;
-        in->stream.set_gain = in_set_gain;
-        in->stream.read = in_read;
-        in->stream.get_input_frames_lost = in_get_input_frames_lost;
-
-        in->dev = rsxadev;
+        pthread_mutex_unlock(&rsxadev->lock);
+        return -ENOMEM;
+    }
+
+    // Initialize the function pointer tables (v-tables).
+    in->stream.common.get_sample_rate = in_get_sample_rate;
+    in->stream.common.set_sample_rate = in_set_sample_rate;
+    in->stream.common.get_buffer_size = in_get_buffer_size;
+    in->stream.common.get_channels = in_get_channels;
+    in->stream.common.get_format = in_get_format;
+    in->stream.common.set_format = in_set_format;
+    in->stream.common.standby = in_standby;
+    in->stream.common.dump = in_dump;
+    in->stream.common.set_parameters = in_set_parameters;
+    in->stream.common.get_parameters = in_get_parameters;
+    in->stream.common.add_audio_effect = in_add_audio_effect;
+    in->stream.common.remove_audio_effect = in_remove_audio_effect;
+    in->stream.set_gain = in_set_gain;
+    in->stream.read = in_read;
+    in->stream.get_input_frames_lost = in_get_input_frames_lost;
+    in->stream.get_capture_position = in_get_capture_position;
+    audio_effect_chain_init(&in->effects);
+
+    in->dev = rsxadev;
 #if LOG_STREAMS_TO_FILES
-        in->log_fd = -1;
+    in->log_fd = -1;
 #endif
-    }
 
     // Initialize the input stream.
     in->read_counter_frames = 0;
     in->input_standby = true;
-    if (rsxadev->routes[route_idx].output != NULL) {
-        in->output_standby_rec_thr = rsxadev->routes[route_idx].output->output_standby;
+    in->silent = true;
+    if (route->output != NULL) {
+        in->output_standby_rec_thr = route->output->output_standby;
     } else {
         in->output_standby_rec_thr = true;
     }
@@ -1590,10 +2379,9 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->read_error_count = 0;
     // Initialize the pipe.
     ALOGV("adev_open_input_stream(): about to create pipe");
-    submix_audio_device_create_pipe_l(rsxadev, config, DEFAULT_PIPE_SIZE_IN_FRAMES,
-                                    DEFAULT_PIPE_PERIOD_COUNT, in, NULL, address, route_idx);
+    submix_audio_device_create_pipe_l(rsxadev, config, submix_pipe_size_from_address(address),
+                                    DEFAULT_PIPE_PERIOD_COUNT, in, NULL, address, route);
 #if LOG_STREAMS_TO_FILES
-    if (in->log_fd >= 0) close(in->log_fd);
     in->log_fd = open(LOG_STREAM_IN_FILENAME, O_CREAT | O_TRUNC | O_WRONLY,
                       LOG_STREAM_FILE_PERMISSIONS);
     ALOGE_IF(in->log_fd < 0, "adev_open_input_stream(): log file open failed %s",
@@ -1619,37 +2407,55 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
 #if LOG_STREAMS_TO_FILES
     if (in->log_fd >= 0) close(in->log_fd);
 #endif // LOG_STREAMS_TO_FILES
-#if ENABLE_LEGACY_INPUT_OPEN
-    if (in->ref_count == 0) free(in);
-#else
+    in->fanout.clear();
+    submix_in_release_conversion(in);
+    audio_effect_chain_destroy(&in->effects);
     free(in);
-#endif // ENABLE_LEGACY_INPUT_OPEN
 
     pthread_mutex_unlock(&rsxadev->lock);
 }
 
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
-    const struct submix_audio_device * rsxadev = //audio_hw_device_get_submix_audio_device(device);
-            reinterpret_cast<const struct submix_audio_device *>(
-                    reinterpret_cast<const uint8_t *>(device) -
+    struct submix_audio_device * rsxadev = //audio_hw_device_get_submix_audio_device(device);
+            reinterpret_cast<struct submix_audio_device *>(
+                    reinterpret_cast<uint8_t *>(const_cast<audio_hw_device_t *>(device)) -
                             offsetof(struct submix_audio_device, device));
     char msg[100];
     int n = sprintf(msg, "\nReroute submix audio module:\n");
     write(fd, &msg, n);
-    for (int i=0 ; i < MAX_ROUTES ; i++) {
-        n = sprintf(msg, " route[%d] rate in=%d out=%d, addr=[%s]\n", i,
-                rsxadev->routes[i].config.input_sample_rate,
-                rsxadev->routes[i].config.output_sample_rate,
-                rsxadev->routes[i].address);
-        write(fd, &msg, n);
+    pthread_mutex_lock(&rsxadev->lock);
+    n = sprintf(msg, " %zu routes in use, %zu buckets\n", rsxadev->routes_in_use,
+            rsxadev->route_bucket_count);
+    write(fd, &msg, n);
+    int i = 0;
+    for (const route_config_t *route = rsxadev->all_routes; route != NULL;
+            route = route->next, i++) {
+        n = snprintf(msg, sizeof(msg), " route[%d] rate in=%d out=%d, readers=%d, addr=[%s]\n", i,
+                route->config.input_sample_rate,
+                route->config.output_sample_rate,
+                submix_audio_device_reader_count_l(route),
+                route->address);
+        write(fd, &msg, n < (int)sizeof(msg) ? n : (int)sizeof(msg) - 1);
     }
+    pthread_mutex_unlock(&rsxadev->lock);
     return 0;
 }
 
 static int adev_close(hw_device_t *device)
 {
     ALOGI("adev_close()");
+    struct submix_audio_device * const rsxadev = audio_hw_device_get_submix_audio_device(
+            reinterpret_cast<struct audio_hw_device *>(device));
+    route_config_t *route = rsxadev->all_routes;
+    while (route != NULL) {
+        route_config_t * const next = route->next;
+        pthread_mutex_destroy(&route->read_lock);
+        pthread_cond_destroy(&route->read_cond);
+        delete route;
+        route = next;
+    }
+    free(rsxadev->route_buckets);
     free(device);
     return 0;
 }
@@ -1690,10 +2496,14 @@ static int adev_open(const hw_module_t* module, const char* name,
     rsxadev->device.close_input_stream = adev_close_input_stream;
     rsxadev->device.dump = adev_dump;
 
-    for (int i=0 ; i < MAX_ROUTES ; i++) {
-            memset(&rsxadev->routes[i], 0, sizeof(route_config));
-            strcpy(rsxadev->routes[i].address, "");
-        }
+    // Routes are created as addresses are opened.
+    rsxadev->route_bucket_count = INITIAL_ROUTE_BUCKETS;
+    rsxadev->route_buckets = (route_config_t **)calloc(rsxadev->route_bucket_count,
+                                                       sizeof(rsxadev->route_buckets[0]));
+    if (!rsxadev->route_buckets) {
+        free(rsxadev);
+        return -ENOMEM;
+    }
 
     *device = &rsxadev->device.common;
 
@@ -0,0 +1,26 @@
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	r_submix_benchmark.cpp
+
+LOCAL_MODULE := r_submixbenchmark
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_CFLAGS := -O2 -Wno-unused-parameter
+
+LOCAL_SHARED_LIBRARIES := liblog libcutils libutils libnbaio libaudioutils libstlport
+LOCAL_STATIC_LIBRARIES := libmedia_helper libaudio_effect_chain
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/.. \
+	$(LOCAL_PATH)/../../audio_effect_chain \
+	$(LOCAL_PATH)/../../../tests/include \
+	frameworks/av/include/ \
+	frameworks/native/include/ \
+	$(call include-path-for, audio-utils) \
+	external/stlport/stlport \
+	bionic
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <cutils/atomic.h>
+#include <hardware/audio.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "audio_hw.cpp"
+#include "BenchmarkStats.h"
+
+using benchmark::MonotonicNs;
+
+// Throughput and latency benchmark for the remote submix: an output and input streams opened on
+// the same address as AudioFlinger and a capturing app would, fed with synthetic audio.
+
+// Run it like this:
+//
+// make r_submixbenchmark -j32 && adb sync && adb shell /system/bin/r_submixbenchmark \
+//         [seconds per config] [frames per write] [input streams] [address]
+//
+// The address can carry the parameters of the route, "bench;latency=low" for instance.
+
+static int64_t threadCpuNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct Config {
+    uint32_t outRate;
+    audio_channel_mask_t outChannels;
+    uint32_t inRate;
+    audio_channel_mask_t inChannels;
+    const char* name;
+};
+
+static const Config CONFIGS[] = {
+    { 48000, AUDIO_CHANNEL_OUT_STEREO, 48000, AUDIO_CHANNEL_IN_STEREO, "48 kHz stereo" },
+    { 48000, AUDIO_CHANNEL_OUT_STEREO, 48000, AUDIO_CHANNEL_IN_MONO, "stereo to mono" },
+    { 48000, AUDIO_CHANNEL_OUT_MONO, 48000, AUDIO_CHANNEL_IN_STEREO, "mono to stereo" },
+    { 48000, AUDIO_CHANNEL_OUT_5POINT1, 48000, AUDIO_CHANNEL_IN_STEREO, "5.1 to stereo" },
+    { 48000, AUDIO_CHANNEL_OUT_STEREO, 16000, AUDIO_CHANNEL_IN_MONO, "48 kHz to 16 kHz mono" },
+    { 44100, AUDIO_CHANNEL_OUT_STEREO, 48000, AUDIO_CHANNEL_IN_STEREO, "44.1 kHz to 48 kHz" },
+};
+
+/*
+ * The output carries a constant level, which survives channel conversion and resampling, so
+ * that silence read from the input is the padding of an underrun. Every PULSE_PERIOD_MS it
+ * carries a pulse of PULSE_MS at full scale instead, long enough to survive resampling, which the
+ * primary input stream times to measure the latency.
+ */
+static const int16_t LEVEL = 8192;
+static const int16_t PULSE_THRESHOLD = 24000;
+static const int PULSE_PERIOD_MS = 100;
+static const int PULSE_MS = 1;
+static const int MAX_PULSES = 4096;
+
+struct Run {
+    audio_stream_out* out;
+    uint32_t outChannelCount;
+    int framesPerWrite;
+    volatile int32_t stopWriter;
+    volatile int32_t stopReaders;
+
+    // Time out_write() was called with each pulse, written by the writer only.
+    int64_t pulseTimes[MAX_PULSES];
+    volatile int32_t pulses;
+
+    int64_t framesWritten;
+    int64_t writerCpuNs;
+};
+
+struct Reader {
+    Run* run;
+    audio_stream_in* in;
+    bool primary;
+    int64_t framesRead;
+    int64_t silentFrames;
+    int64_t framesLost;
+    int64_t cpuNs;
+    std::vector<int64_t> latencies;
+};
+
+static void* writerTask(void* ptr) {
+    Run* run = (Run*) ptr;
+    const uint32_t rate = run->out->common.get_sample_rate(&run->out->common);
+    const int pulsePeriod = rate * PULSE_PERIOD_MS / 1000;
+    const int pulseFrames = rate * PULSE_MS / 1000;
+    std::vector<int16_t> buffer(run->framesPerWrite * run->outChannelCount);
+    while (!android_atomic_acquire_load(&run->stopWriter)) {
+        bool pulse = false;
+        for (int i = 0; i < run->framesPerWrite; i++) {
+            const bool inPulse = (run->framesWritten + i) % pulsePeriod < pulseFrames;
+            pulse = pulse || (run->framesWritten + i) % pulsePeriod == 0;
+            for (uint32_t c = 0; c < run->outChannelCount; c++) {
+                buffer[i * run->outChannelCount + c] = inPulse ? 32767 : LEVEL;
+            }
+        }
+        if (pulse && run->pulses < MAX_PULSES) {
+            run->pulseTimes[run->pulses] = MonotonicNs();
+            android_atomic_release_store(run->pulses + 1, &run->pulses);
+        }
+        ssize_t written = run->out->write(run->out, &buffer[0],
+                buffer.size() * sizeof(int16_t));
+        if (written <= 0) {
+            printf("  out_write() returned %zd\n", written);
+            break;
+        }
+        run->framesWritten += run->framesPerWrite;
+    }
+    run->writerCpuNs = threadCpuNs();
+    return NULL;
+}
+
+static void* readerTask(void* ptr) {
+    Reader* reader = (Reader*) ptr;
+    audio_stream_in* in = reader->in;
+    const uint32_t channels = audio_channel_count_from_in_mask(
+            in->common.get_channels(&in->common));
+    const size_t bytes = in->common.get_buffer_size(&in->common);
+    const size_t frames = bytes / (channels * sizeof(int16_t));
+    std::vector<int16_t> buffer(frames * channels);
+    bool started = false;
+    bool inPulse = false;
+    int pulse = 0;
+    while (!android_atomic_acquire_load(&reader->run->stopReaders)) {
+        ssize_t read = in->read(in, &buffer[0], frames * channels * sizeof(int16_t));
+        int64_t now = MonotonicNs();
+        if (read <= 0) {
+            printf("  in_read() returned %zd\n", read);
+            break;
+        }
+        size_t n = read / (channels * sizeof(int16_t));
+        for (size_t i = 0; i < n; i++) {
+            int16_t sample = buffer[i * channels];
+            if (sample != 0) {
+                started = true;
+            } else if (started) {
+                reader->silentFrames++;
+            }
+            if (sample >= PULSE_THRESHOLD && !inPulse && reader->primary &&
+                    pulse < android_atomic_acquire_load(&reader->run->pulses)) {
+                reader->latencies.push_back(now - reader->run->pulseTimes[pulse++]);
+            }
+            inPulse = sample >= PULSE_THRESHOLD;
+        }
+        reader->framesRead += n;
+        reader->framesLost += in->get_input_frames_lost(in);
+    }
+    reader->cpuNs = threadCpuNs();
+    return NULL;
+}
+
+static void benchmarkConfig(audio_hw_device* dev, const Config& config, int seconds,
+        int framesPerWrite, int readers, const char* address) {
+    printf("%s, %u Hz %u channels to %u Hz %u channels, %d input streams\n", config.name,
+            config.outRate, audio_channel_count_from_out_mask(config.outChannels),
+            config.inRate, audio_channel_count_from_in_mask(config.inChannels), readers);
+
+    Run* run = new Run();
+    memset(run, 0, sizeof(*run));
+    run->framesPerWrite = framesPerWrite;
+    run->outChannelCount = audio_channel_count_from_out_mask(config.outChannels);
+
+    audio_config outConfig;
+    memset(&outConfig, 0, sizeof(outConfig));
+    outConfig.sample_rate = config.outRate;
+    outConfig.channel_mask = config.outChannels;
+    outConfig.format = AUDIO_FORMAT_PCM_16_BIT;
+    int ret = dev->open_output_stream(dev, 0, AUDIO_DEVICE_OUT_REMOTE_SUBMIX,
+            AUDIO_OUTPUT_FLAG_NONE, &outConfig, &run->out, address);
+    if (ret != 0) {
+        printf("  open_output_stream() failed %d\n", ret);
+        delete run;
+        return;
+    }
+
+    std::vector<Reader*> inputs;
+    for (int i = 0; i < readers; i++) {
+        audio_config inConfig;
+        memset(&inConfig, 0, sizeof(inConfig));
+        inConfig.sample_rate = config.inRate;
+        inConfig.channel_mask = config.inChannels;
+        inConfig.format = AUDIO_FORMAT_PCM_16_BIT;
+        Reader* reader = new Reader();
+        reader->run = run;
+        reader->primary = i == 0;
+        reader->framesRead = reader->silentFrames = reader->framesLost = reader->cpuNs = 0;
+        ret = dev->open_input_stream(dev, 0, AUDIO_DEVICE_IN_REMOTE_SUBMIX, &inConfig,
+                &reader->in, AUDIO_INPUT_FLAG_NONE, address, AUDIO_SOURCE_REMOTE_SUBMIX);
+        if (ret != 0) {
+            printf("  open_input_stream() failed %d\n", ret);
+            delete reader;
+            break;
+        }
+        inputs.push_back(reader);
+    }
+
+    int64_t start = MonotonicNs();
+    pthread_t writer;
+    pthread_create(&writer, NULL, writerTask, run);
+    std::vector<pthread_t> threads(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++) {
+        pthread_create(&threads[i], NULL, readerTask, inputs[i]);
+    }
+    struct timespec duration = { seconds, 0 };
+    nanosleep(&duration, NULL);
+
+    // The writer blocks on a full pipe, so the readers keep reading until it returned.
+    android_atomic_release_store(1, &run->stopWriter);
+    pthread_join(writer, NULL);
+    android_atomic_release_store(1, &run->stopReaders);
+    for (size_t i = 0; i < threads.size(); i++) {
+        pthread_join(threads[i], NULL);
+    }
+    int64_t elapsed = MonotonicNs() - start;
+
+    double writtenSeconds = (double) run->framesWritten / config.outRate;
+    printf("  %.2f s of audio written in %.2f s, writer %.0f us CPU per s of audio\n",
+            writtenSeconds, elapsed / 1e9,
+            writtenSeconds > 0 ? run->writerCpuNs / 1e3 / writtenSeconds : 0.0);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        Reader* reader = inputs[i];
+        double readSeconds = (double) reader->framesRead / config.inRate;
+        printf("  input %zu: %.0f us CPU per s of audio, %lld underrun frames, "
+                "%lld overrun frames\n", i,
+                readSeconds > 0 ? reader->cpuNs / 1e3 / readSeconds : 0.0,
+                (long long) reader->silentFrames, (long long) reader->framesLost);
+        if (reader->primary) {
+            benchmark::PrintLatencies("end-to-end", "pulse delivered", &reader->latencies);
+        }
+        dev->close_input_stream(dev, reader->in);
+        delete reader;
+    }
+    dev->close_output_stream(dev, run->out);
+    delete run;
+}
+
+int main(int argc, char **argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 2;
+    int framesPerWrite = argc > 2 ? atoi(argv[2]) : 960;
+    int readers = argc > 3 ? atoi(argv[3]) : 1;
+    const char* address = argc > 4 ? argv[4] : "r_submixbenchmark";
+    if (seconds <= 0 || framesPerWrite <= 0 || readers <= 0 ||
+            readers > MAX_READERS_PER_ROUTE) {
+        printf("usage: %s [seconds per config] [frames per write] [input streams, at most %d] "
+                "[address]\n", argv[0], MAX_READERS_PER_ROUTE);
+        return EXIT_FAILURE;
+    }
+
+    audio_hw_device* dev;
+    int ret = audio_hw_device_open(&android::HAL_MODULE_INFO_SYM.common, &dev);
+    if (ret != 0) {
+        printf("audio_hw_device_open() failed %d\n", ret);
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < sizeof(CONFIGS) / sizeof(CONFIGS[0]); i++) {
+        benchmarkConfig(dev, CONFIGS[i], seconds, framesPerWrite, readers, address);
+    }
+    audio_hw_device_close(dev);
+    return EXIT_SUCCESS;
+}
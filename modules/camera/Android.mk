@@ -20,24 +20,40 @@ LOCAL_MODULE := camera.default
 LOCAL_MODULE_RELATIVE_PATH := hw
 
 LOCAL_C_INCLUDES += \
+	external/jpeg \
 	system/core/include \
+	system/core/libsync \
 	system/media/camera/include \
+	$(LOCAL_PATH)/../sfdroid_ipc \
 
 LOCAL_SRC_FILES := \
 	CameraHAL.cpp \
 	Camera.cpp \
+	CaptureStats.cpp \
 	ExampleCamera.cpp \
+	FrameProcessor.cpp \
+	JpegEncoder.cpp \
 	Metadata.cpp \
+	RequestQueue.cpp \
+	ResourceArbiter.cpp \
+	SfdroidCamera.cpp \
 	Stream.cpp \
+	V4L2Camera.cpp \
 	VendorTags.cpp \
+	WorkerPool.cpp \
+	YuvImage.cpp \
 
 LOCAL_SHARED_LIBRARIES := \
 	libcamera_metadata \
 	libcutils \
+	libhardware \
+	libjpeg \
 	liblog \
 	libsync \
 	libutils \
 
+LOCAL_STATIC_LIBRARIES := libsfdroid_ipc
+
 LOCAL_CFLAGS += -Wall -Wextra -fvisibility=hidden
 
 LOCAL_MODULE_TAGS := optional
@@ -15,14 +15,20 @@
  */
 
 #include <cstdlib>
+#include <pthread.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <cutils/atomic.h>
 #include <hardware/camera3.h>
+#include <sw_sync.h>
 #include <sync/sync.h>
 #include <system/camera_metadata.h>
 #include <system/graphics.h>
 #include <utils/Mutex.h>
+#include <utils/Timers.h>
 #include "CameraHAL.h"
 #include "Metadata.h"
+#include "RequestQueue.h"
 #include "Stream.h"
 
 //#define LOG_NDEBUG 0
@@ -35,6 +41,7 @@
 #include "Camera.h"
 
 #define CAMERA_SYNC_TIMEOUT 5000 // in msecs
+#define CAMERA_FLUSH_TIMEOUT 1000 // in msecs
 
 namespace default_camera_hal {
 
@@ -46,22 +53,81 @@ static int close_device(hw_device_t* dev)
     Camera* cam = static_cast<Camera*>(cam_dev->priv);
     return cam->close();
 }
+
+// Entry points of the capture pipeline worker threads
+static void *capture_thread(void *arg)
+{
+    static_cast<Camera*>(arg)->captureLoop();
+    return NULL;
+}
+
+static void *result_thread(void *arg)
+{
+    static_cast<Camera*>(arg)->resultLoop();
+    return NULL;
+}
+} // extern "C"
+
+// Output buffers of a request being filled by fillOutputBuffers()
+struct BufferWork {
+    Camera *camera;
+    CaptureRequest *request;
+    bool releaseFences;
+    // Index of the next buffer to fill
+    volatile int32_t next;
+    // Number of buffers whose release fence was signalled, in order
+    uint32_t released;
+    // Lock protecting request->bufferResults and released
+    android::Mutex lock;
+};
+
+// request->bufferResults of a buffer not filled yet
+static const int kBufferPending = 1;
+
+extern "C" {
+// Entry point of mBufferWorkers, each part fills buffers until none is left
+static void fill_buffers_part(void *arg, int /*part*/, int /*parts*/)
+{
+    BufferWork *work = static_cast<BufferWork*>(arg);
+    work->camera->fillBuffersPart(work);
+}
 } // extern "C"
 
 Camera::Camera(int id)
   : mId(id),
     mStaticInfo(NULL),
     mBusy(false),
+    mArbiter(NULL),
     mCallbackOps(NULL),
     mStreams(NULL),
     mNumStreams(0),
-    mSettings(NULL)
+    mTemplatesInitialized(false),
+    mSettings(NULL),
+    mSettingsBuffer(NULL),
+    mSettingsBufferSize(0),
+    mChangedTags(NULL),
+    mNumChangedTags(0),
+    mChangedTagsCapacity(0),
+    mSettingsChecked(false),
+    mSettingsValid(false),
+    mRequestPool(kPipelineMaxDepth),
+    mPendingQueue(kPipelineMaxDepth),
+    mResultQueue(kPipelineMaxDepth),
+    mPipelineRunning(false),
+    mReleaseTimeline(-1),
+    mReleaseSeq(0),
+    mInputTimeline(-1),
+    mInputSeq(0),
+    mFlushing(0),
+    mInFlight(0),
+    mStats(id)
 {
     memset(&mTemplates, 0, sizeof(mTemplates));
     memset(&mDevice, 0, sizeof(mDevice));
     mDevice.common.tag    = HARDWARE_DEVICE_TAG;
-    mDevice.common.version = CAMERA_DEVICE_API_VERSION_3_0;
+    mDevice.common.version = CAMERA_DEVICE_API_VERSION_3_1;
     mDevice.common.close  = close_device;
+    mDevice.common.ext    = &sExt;
     mDevice.ops           = const_cast<camera3_device_ops_t*>(&sOps);
     mDevice.priv          = this;
 }
@@ -71,10 +137,19 @@ Camera::~Camera()
     if (mStaticInfo != NULL) {
         free_camera_metadata(mStaticInfo);
     }
+    for (int i = 0; i < CAMERA3_TEMPLATE_COUNT; i++) {
+        if (mTemplates[i] != NULL)
+            free_camera_metadata(mTemplates[i]);
+    }
+    free(mSettingsBuffer);
+    delete [] mChangedTags;
 }
 
-int Camera::open(const hw_module_t *module, hw_device_t **device)
+int Camera::open(const hw_module_t *module, hw_device_t **device,
+        ResourceArbiter *arbiter)
 {
+    int res;
+
     ALOGI("%s:%d: Opening camera device", __func__, mId);
     ATRACE_CALL();
     android::Mutex::Autolock al(mDeviceLock);
@@ -83,9 +158,13 @@ int Camera::open(const hw_module_t *module, hw_device_t **device)
         ALOGE("%s:%d: Error! Camera device already opened", __func__, mId);
         return -EBUSY;
     }
+    res = arbiter->acquire(mId, getResourceCost());
+    if (res != 0)
+        return res;
 
     // TODO: open camera dev nodes, etc
     mBusy = true;
+    mArbiter = arbiter;
     mDevice.common.module = const_cast<hw_module_t*>(module);
     *device = &mDevice.common;
     return 0;
@@ -95,8 +174,8 @@ int Camera::getInfo(struct camera_info *info)
 {
     android::Mutex::Autolock al(mStaticInfoLock);
 
-    info->facing = CAMERA_FACING_FRONT;
-    info->orientation = 0;
+    info->facing = getFacing();
+    info->orientation = getOrientation();
     info->device_version = mDevice.common.version;
     if (mStaticInfo == NULL) {
         mStaticInfo = initStaticInfo();
@@ -116,11 +195,31 @@ int Camera::close()
         return -EINVAL;
     }
 
-    // TODO: close camera dev nodes, etc
+    // Return all requests still in flight before the device goes away
+    stopPipeline();
+    mProcessor.stop();
+    closeDevice();
+    mArbiter->release(mId, getResourceCost());
+    mArbiter = NULL;
     mBusy = false;
     return 0;
 }
 
+int Camera::getResourceCost()
+{
+    return CAMERA_RESOURCE_CAPACITY / 2;
+}
+
+int Camera::getFacing()
+{
+    return CAMERA_FACING_FRONT;
+}
+
+int Camera::getOrientation()
+{
+    return 0;
+}
+
 int Camera::initialize(const camera3_callback_ops_t *callback_ops)
 {
     int res;
@@ -133,9 +232,106 @@ int Camera::initialize(const camera3_callback_ops_t *callback_ops)
         ALOGE("%s:%d: Failed to initialize device!", __func__, mId);
         return res;
     }
+    res = startProcessor();
+    if (res != 0) {
+        ALOGE("%s:%d: Failed to start software stage", __func__, mId);
+        closeDevice();
+        return res;
+    }
+    return startPipeline();
+}
+
+int Camera::startProcessor()
+{
+    camera_metadata_ro_entry_t entry;
+
+    {
+        android::Mutex::Autolock al(mStaticInfoLock);
+        if (mStaticInfo == NULL)
+            mStaticInfo = initStaticInfo();
+        if (mStaticInfo != NULL && find_camera_metadata_ro_entry(mStaticInfo,
+                    ANDROID_JPEG_MAX_SIZE, &entry) == 0)
+            mProcessor.setJpegMaxSize(entry.data.i32[0]);
+    }
+    return mProcessor.start();
+}
+
+int Camera::startPipeline()
+{
+    int res;
+
+    if (mPipelineRunning) {
+        ALOGE("%s:%d: Capture pipeline already running", __func__, mId);
+        return -EINVAL;
+    }
+
+    mReleaseTimeline = sw_sync_timeline_create();
+    mReleaseSeq = 0;
+    mInputTimeline = sw_sync_timeline_create();
+    mInputSeq = 0;
+    if (mReleaseTimeline < 0 || mInputTimeline < 0) {
+        // Without release fences buffers are filled before being returned,
+        // and input buffers cannot be reprocessed
+        ALOGW("%s:%d: No sw_sync timeline, release fences disabled", __func__,
+                mId);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cpus > kMaxParallelBuffers ? kMaxParallelBuffers - 1 :
+            (cpus > 1 ? cpus - 1 : 0);
+    // Without workers the capture thread fills the buffers one by one
+    if (workers > 0)
+        mBufferWorkers.start(workers);
+    mPendingQueue.start();
+    mResultQueue.start();
+    res = pthread_create(&mResultThread, NULL, result_thread, this);
+    if (res != 0) {
+        ALOGE("%s:%d: Failed to start result thread: %s(%d)", __func__, mId,
+                strerror(res), res);
+        mBufferWorkers.stop();
+        return -ENODEV;
+    }
+    res = pthread_create(&mCaptureThread, NULL, capture_thread, this);
+    if (res != 0) {
+        ALOGE("%s:%d: Failed to start capture thread: %s(%d)", __func__, mId,
+                strerror(res), res);
+        mResultQueue.stop();
+        pthread_join(mResultThread, NULL);
+        mBufferWorkers.stop();
+        closeReleaseTimeline();
+        return -ENODEV;
+    }
+    mPipelineRunning = true;
     return 0;
 }
 
+void Camera::stopPipeline()
+{
+    if (!mPipelineRunning)
+        return;
+
+    // Each stage drains its queue before exiting, so every pending request
+    // is captured and its result sent before this returns
+    mPendingQueue.stop();
+    pthread_join(mCaptureThread, NULL);
+    mBufferWorkers.stop();
+    mResultQueue.stop();
+    pthread_join(mResultThread, NULL);
+    closeReleaseTimeline();
+    mPipelineRunning = false;
+}
+
+void Camera::closeReleaseTimeline()
+{
+    // Every buffer was filled by the capture thread and mBufferWorkers, no
+    // fence is left pending
+    if (mReleaseTimeline >= 0)
+        ::close(mReleaseTimeline);
+    mReleaseTimeline = -1;
+    if (mInputTimeline >= 0)
+        ::close(mInputTimeline);
+    mInputTimeline = -1;
+}
+
 int Camera::configureStreams(camera3_stream_configuration_t *stream_config)
 {
     camera3_stream_t *astream;
@@ -189,13 +385,23 @@ int Camera::configureStreams(camera3_stream_configuration_t *stream_config)
     // Set up all streams (calculate usage/max_buffers for each)
     setupStreams(newStreams, stream_config->num_streams);
 
+    if (configureDevice(newStreams, stream_config->num_streams) != 0) {
+        ALOGE("%s:%d: Failed to configure device for stream set", __func__,
+                mId);
+        goto err_out;
+    }
+
     // Destroy all old streams and replace stream array with new one
     destroyStreams(mStreams, mNumStreams);
     mStreams = newStreams;
     mNumStreams = stream_config->num_streams;
+    mStreamIndex.reset(mNumStreams);
+    for (int i = 0; i < mNumStreams; i++)
+        mStreamIndex.put(mStreams[i]->getStream(), mStreams[i]);
 
     // Clear out last seen settings metadata
     setSettings(NULL);
+    mStats.reset();
     return 0;
 
 err_out:
@@ -216,9 +422,23 @@ void Camera::destroyStreams(Stream **streams, int count)
     delete [] streams;
 }
 
+Stream *Camera::findStream(const camera3_stream_t *astream)
+{
+    Stream *stream;
+
+    if (!mStreamIndex.get(astream, &stream))
+        return NULL;
+    return stream;
+}
+
 Stream *Camera::reuseStream(camera3_stream_t *astream)
 {
-    Stream *priv = reinterpret_cast<Stream*>(astream->priv);
+    Stream *priv = findStream(astream);
+    if (priv == NULL) {
+        ALOGE("%s:%d: Reused stream %p is not configured", __func__, mId,
+                astream);
+        return NULL;
+    }
     // Verify the re-used stream's parameters match
     if (!priv->isValidReuseStream(mId, astream)) {
         ALOGE("%s:%d: Mismatched parameter in reused stream", __func__, mId);
@@ -287,7 +507,8 @@ void Camera::setupStreams(Stream **streams, int count)
                      GRALLOC_USAGE_HW_CAMERA_READ;
 
         streams[i]->setUsage(usage);
-        streams[i]->setMaxBuffers(1);
+        // Every request in the pipeline may hold a buffer of each stream
+        streams[i]->setMaxBuffers(kPipelineMaxDepth);
     }
 }
 
@@ -302,29 +523,71 @@ int Camera::registerStreamBuffers(const camera3_stream_buffer_set_t *buf_set)
         ALOGE("%s:%d: NULL stream handle", __func__, mId);
         return -EINVAL;
     }
-    Stream *stream = reinterpret_cast<Stream*>(buf_set->stream->priv);
+    Stream *stream = findStream(buf_set->stream);
+    if (stream == NULL) {
+        ALOGE("%s:%d: Buffers for unconfigured stream %p", __func__, mId,
+                buf_set->stream);
+        return -EINVAL;
+    }
     return stream->registerBuffers(buf_set);
 }
 
+bool Camera::isValidOutputBuffer(const camera3_stream_buffer_t *buffer)
+{
+    Stream *stream = findStream(buffer->stream);
+
+    if (stream == NULL || !stream->isOutputType()) {
+        ALOGE("%s:%d: Buffer %p of invalid output stream %p", __func__, mId,
+                buffer->buffer, buffer->stream);
+        return false;
+    }
+    if (stream->isRegistered() && stream->getBufferIndex(buffer->buffer) < 0) {
+        ALOGE("%s:%d: Buffer %p not registered with stream %p", __func__, mId,
+                buffer->buffer, buffer->stream);
+        return false;
+    }
+    return true;
+}
+
+bool Camera::isValidInputBuffer(const camera3_stream_buffer_t *buffer)
+{
+    Stream *stream = findStream(buffer->stream);
+
+    if (stream == NULL || !stream->isInputType()) {
+        ALOGE("%s:%d: Buffer %p of invalid input stream %p", __func__, mId,
+                buffer->buffer, buffer->stream);
+        return false;
+    }
+    return true;
+}
+
 bool Camera::isValidTemplateType(int type)
 {
-    return type < 1 || type >= CAMERA3_TEMPLATE_COUNT;
+    return type >= 1 && type < CAMERA3_TEMPLATE_COUNT;
 }
 
 const camera_metadata_t* Camera::constructDefaultRequestSettings(int type)
 {
     ALOGV("%s:%d: type=%d", __func__, mId, type);
+    android::Mutex::Autolock al(mStaticInfoLock);
 
     if (!isValidTemplateType(type)) {
         ALOGE("%s:%d: Invalid template request type: %d", __func__, mId, type);
         return NULL;
     }
+    // Built once per camera, every later query and open shares them
+    if (!mTemplatesInitialized) {
+        ATRACE_NAME("initTemplates");
+        if (initTemplates() != 0)
+            ALOGE("%s:%d: Failed to initialize templates", __func__, mId);
+        mTemplatesInitialized = true;
+    }
     return mTemplates[type];
 }
 
 int Camera::processCaptureRequest(camera3_capture_request_t *request)
 {
-    camera3_capture_result result;
+    CaptureRequest *r;
 
     ALOGV("%s:%d: request=%p", __func__, mId, request);
     ATRACE_CALL();
@@ -346,6 +609,8 @@ int Camera::processCaptureRequest(camera3_capture_request_t *request)
         }
     } else {
         setSettings(request->settings);
+        if (mSettings == NULL)
+            return -ENOMEM;
     }
 
     if (request->input_buffer != NULL) {
@@ -357,69 +622,501 @@ int Camera::processCaptureRequest(camera3_capture_request_t *request)
                     __func__, mId, request->settings);
             return -EINVAL;
         }
+        if (!isValidInputBuffer(request->input_buffer))
+            return -EINVAL;
+        if (mInputTimeline < 0) {
+            ALOGE("%s:%d: Cannot release input buffers without sw_sync",
+                    __func__, mId);
+            return -EINVAL;
+        }
     } else {
         ALOGV("%s:%d: Capturing new frame.", __func__, mId);
 
-        if (!isValidCaptureSettings(request->settings)) {
+        if (!isValidCurrentSettings()) {
             ALOGE("%s:%d: Invalid settings for capture request: %p",
                     __func__, mId, request->settings);
             return -EINVAL;
         }
     }
 
-    if (request->num_output_buffers <= 0) {
+    if (request->num_output_buffers <= 0 || request->output_buffers == NULL) {
         ALOGE("%s:%d: Invalid number of output buffers: %d", __func__, mId,
                 request->num_output_buffers);
         return -EINVAL;
     }
-    result.num_output_buffers = request->num_output_buffers;
-    result.output_buffers = new camera3_stream_buffer_t[result.num_output_buffers];
-    for (unsigned int i = 0; i < request->num_output_buffers; i++) {
-        int res = processCaptureBuffer(&request->output_buffers[i],
-                const_cast<camera3_stream_buffer_t*>(&result.output_buffers[i]));
-        if (res)
-            goto err_out;
+    for (uint32_t i = 0; i < request->num_output_buffers; i++) {
+        if (!isValidOutputBuffer(&request->output_buffers[i]))
+            return -EINVAL;
     }
 
-    result.frame_number = request->frame_number;
-    // TODO: return actual captured/reprocessed settings
-    result.result = request->settings;
-    // TODO: asynchronously return results
-    notifyShutter(request->frame_number, 0);
-    mCallbackOps->process_capture_result(mCallbackOps, &result);
+    // The framework owns request once this returns, keep a copy to capture
+    // and return asynchronously
+    r = mRequestPool.get(request, mSettings);
+    if (r == NULL)
+        return -ENOMEM;
+    r->startTime = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (r->hasInputBuffer) {
+        // The input buffer is released here, with a fence signalled once it
+        // has been reprocessed. Requests are captured in order.
+        int fence = sw_sync_fence_create(mInputTimeline, "camera-input",
+                mInputSeq + 1);
+        if (fence < 0) {
+            ALOGE("%s:%d: Failed to create input release fence: %s(%d)",
+                    __func__, mId, strerror(errno), errno);
+            releaseCaptureRequest(r);
+            return -ENOMEM;
+        }
+        mInputSeq++;
+        request->input_buffer->release_fence = fence;
+    }
+    requestStarted();
+    // Blocks while kPipelineMaxDepth requests are waiting to be captured
+    if (!mPendingQueue.push(r)) {
+        ALOGE("%s:%d: Capture pipeline stopped, dropping Frame:%d", __func__,
+                mId, request->frame_number);
+        if (r->hasInputBuffer)
+            releaseInputBuffer(r);
+        releaseCaptureRequest(r);
+        requestDone();
+        return -ENODEV;
+    }
+    return 0;
+}
+
+int Camera::flush()
+{
+    nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) +
+            ms2ns(CAMERA_FLUSH_TIMEOUT);
+    int res = 0;
+
+    ALOGV("%s:%d: Flushing", __func__, mId);
+    ATRACE_CALL();
+
+    // Requests still queued are failed as soon as the capture thread pops
+    // them, the request being captured only skips the buffers left to fill.
+    // At most kPipelineMaxDepth results are then left to send.
+    android_atomic_inc(&mFlushing);
+    {
+        android::Mutex::Autolock al(mInFlightLock);
+        while (mInFlight > 0) {
+            nsecs_t remaining = deadline - systemTime(SYSTEM_TIME_MONOTONIC);
+            if (remaining <= 0 ||
+                    mAllReturned.waitRelative(mInFlightLock, remaining) ==
+                    android::TIMED_OUT) {
+                ALOGE("%s:%d: %d requests still in flight after %d ms",
+                        __func__, mId, mInFlight, CAMERA_FLUSH_TIMEOUT);
+                res = -ENODEV;
+                break;
+            }
+        }
+    }
+    android_atomic_dec(&mFlushing);
+    return res;
+}
+
+void Camera::requestStarted()
+{
+    android::Mutex::Autolock al(mInFlightLock);
+
+    mInFlight++;
+    mStats.inFlight(mInFlight);
+}
+
+void Camera::requestDone()
+{
+    android::Mutex::Autolock al(mInFlightLock);
+
+    if (--mInFlight == 0)
+        mAllReturned.broadcast();
+    mStats.inFlight(mInFlight);
+}
+
+void Camera::captureLoop()
+{
+    CaptureRequest *request;
+
+    // The result queue is only stopped once this loop has exited
+    while ((request = mPendingQueue.pop()) != NULL)
+        captureRequest(request);
+}
 
+void Camera::captureRequest(CaptureRequest *request)
+{
+    int failures = 0;
+    int res;
+
+    ATRACE_CALL();
+    ALOGV("%s:%d: Capturing Frame:%d", __func__, mId, request->frameNumber);
+
+    // The HAL owns the acquire fences, the framework gets release fences
+    for (uint32_t i = 0; i < request->numOutputBuffers; i++) {
+        camera3_stream_buffer_t *b = &request->outputBuffers[i];
+        request->acquireFences[i] = b->acquire_fence;
+        b->acquire_fence = -1;
+        b->release_fence = -1;
+        b->status = CAMERA3_BUFFER_STATUS_OK;
+    }
+
+    if (android_atomic_acquire_load(&mFlushing)) {
+        ALOGV("%s:%d: Flushing Frame:%d", __func__, mId, request->frameNumber);
+        failRequest(request);
+        return;
+    }
+
+    res = request->hasInputBuffer ? startReprocess(request) :
+            startCapture(request);
+    if (res != 0) {
+        ALOGE("%s:%d: Failed to capture Frame:%d", __func__, mId,
+                request->frameNumber);
+        failRequest(request);
+        return;
+    }
+
+    // The input buffer is returned with the outputs, it must not be read
+    // anymore by then
+    if (!request->hasInputBuffer && createReleaseFences(request)) {
+        // Return the buffers right away: consumers wait on each release fence
+        // for that buffer only, not on the whole request
+        notifyShutter(request->frameNumber, request->timestamp);
+        mStats.shutter(systemTime(SYSTEM_TIME_MONOTONIC) - request->startTime);
+        holdCaptureRequest(request);
+        requestStarted();
+        mResultQueue.push(request);
+        fillOutputBuffers(request, true);
+        finishCapture(request);
+        releaseCaptureRequest(request);
+        requestDone();
+        return;
+    }
+
+    // Without release fences, fill every buffer before returning it. Once
+    // flushing, the buffers left are not waited on nor filled.
+    fillOutputBuffers(request, false);
+    for (uint32_t i = 0; i < request->numOutputBuffers; i++) {
+        camera3_stream_buffer_t *b = &request->outputBuffers[i];
+        if (request->bufferResults[i]) {
+            // The buffer is returned unfilled, the framework must still wait
+            // on the acquire fence if it was not waited on
+            b->status = CAMERA3_BUFFER_STATUS_ERROR;
+            b->release_fence = request->acquireFences[i];
+            mStats.bufferError();
+            failures++;
+        }
+    }
+    if (request->hasInputBuffer)
+        finishReprocess(request);
+    else
+        finishCapture(request);
+
+    if (failures == (int)request->numOutputBuffers) {
+        // Nothing was captured, the whole request failed
+        request->failed = true;
+        notifyError(request->frameNumber, NULL, CAMERA3_MSG_ERROR_REQUEST);
+    } else {
+        notifyShutter(request->frameNumber, request->timestamp);
+        mStats.shutter(systemTime(SYSTEM_TIME_MONOTONIC) - request->startTime);
+        for (uint32_t i = 0; i < request->numOutputBuffers; i++) {
+            if (request->outputBuffers[i].status == CAMERA3_BUFFER_STATUS_ERROR)
+                notifyError(request->frameNumber,
+                        request->outputBuffers[i].stream,
+                        CAMERA3_MSG_ERROR_BUFFER);
+        }
+    }
+    mResultQueue.push(request);
+}
+
+void Camera::failRequest(CaptureRequest *request)
+{
+    for (uint32_t i = 0; i < request->numOutputBuffers; i++) {
+        request->outputBuffers[i].status = CAMERA3_BUFFER_STATUS_ERROR;
+        request->outputBuffers[i].release_fence = request->acquireFences[i];
+    }
+    if (request->hasInputBuffer)
+        releaseInputBuffer(request);
+    request->failed = true;
+    notifyError(request->frameNumber, NULL, CAMERA3_MSG_ERROR_REQUEST);
+    mResultQueue.push(request);
+}
+
+int Camera::startCapture(CaptureRequest *request)
+{
+    struct timespec ts;
+
+    // No sensor, the start of exposure is now
+    if (clock_gettime(CLOCK_BOOTTIME, &ts) == 0) {
+        request->timestamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    } else {
+        ALOGE("%s:%d: Failed to get CLOCK_BOOTTIME %s(%d)", __func__, mId,
+                strerror(errno), errno);
+    }
     return 0;
+}
 
-err_out:
-    delete [] result.output_buffers;
-    // TODO: this should probably be a total device failure; transient for now
-    return -EINVAL;
+int Camera::fillBuffer(CaptureRequest *request,
+        const camera3_stream_buffer_t *buffer)
+{
+    // No sensor, paint a test pattern moving from frame to frame
+    return mProcessor.fillTestPattern(request->frameNumber, buffer,
+            request->settings);
+}
+
+int Camera::startReprocess(CaptureRequest *request)
+{
+    camera3_stream_buffer_t *in = &request->inputBuffer;
+    camera_metadata_ro_entry_t entry;
+    struct timespec ts;
+    int res;
+
+    ATRACE_CALL();
+
+    if (in->acquire_fence != -1) {
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+        res = sync_wait(in->acquire_fence, CAMERA_SYNC_TIMEOUT);
+        mStats.fenceWait(systemTime(SYSTEM_TIME_MONOTONIC) - start);
+        if (res) {
+            ALOGE("%s:%d: Error waiting on input buffer acquire fence: "
+                    "%s(%d)", __func__, mId, strerror(-res), res);
+            return res;
+        }
+        ::close(in->acquire_fence);
+        in->acquire_fence = -1;
+    }
+    res = mProcessor.lockInput(in, &mReprocessSource);
+    if (res)
+        return res;
+
+    // The frame keeps the start of exposure of its original capture
+    if (find_camera_metadata_ro_entry(request->settings,
+                ANDROID_SENSOR_TIMESTAMP, &entry) == 0 && entry.count == 1) {
+        request->timestamp = entry.data.i64[0];
+    } else if (clock_gettime(CLOCK_BOOTTIME, &ts) == 0) {
+        request->timestamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+    return 0;
+}
+
+void Camera::finishReprocess(CaptureRequest *request)
+{
+    mProcessor.unlockInput(&request->inputBuffer);
+    releaseInputBuffer(request);
+}
+
+void Camera::releaseInputBuffer(CaptureRequest *request)
+{
+    camera3_stream_buffer_t *in = &request->inputBuffer;
+
+    if (in->acquire_fence != -1)
+        ::close(in->acquire_fence);
+    in->acquire_fence = -1;
+    // Signal the release fence set by processCaptureRequest()
+    sw_sync_timeline_inc(mInputTimeline, 1);
+}
+
+void Camera::finishCapture(CaptureRequest* /*request*/)
+{
+}
+
+int Camera::configureDevice(Stream** /*streams*/, int /*count*/)
+{
+    return 0;
+}
+
+void Camera::closeDevice()
+{
+}
+
+bool Camera::createReleaseFences(CaptureRequest *request)
+{
+    uint32_t n = request->numOutputBuffers;
+
+    if (mReleaseTimeline < 0)
+        return false;
+
+    // The timeline counts the buffers filled, in order, see fillBuffersPart()
+    for (uint32_t i = 0; i < n; i++) {
+        int fence = sw_sync_fence_create(mReleaseTimeline, "camera-release",
+                mReleaseSeq + i + 1);
+        if (fence < 0) {
+            ALOGE("%s:%d: Failed to create release fence: %s(%d)", __func__,
+                    mId, strerror(errno), errno);
+            for (uint32_t j = 0; j < i; j++) {
+                ::close(request->outputBuffers[j].release_fence);
+                request->outputBuffers[j].release_fence = -1;
+            }
+            return false;
+        }
+        request->outputBuffers[i].release_fence = fence;
+    }
+    mReleaseSeq += n;
+    return true;
+}
+
+void Camera::resultLoop()
+{
+    CaptureRequest *request;
+
+    while ((request = mResultQueue.pop()) != NULL) {
+        sendResult(request);
+        releaseCaptureRequest(request);
+        requestDone();
+    }
+}
+
+void Camera::sendResult(CaptureRequest *request)
+{
+    camera3_capture_result_t result;
+
+    ATRACE_CALL();
+    ALOGV("%s:%d: Returning Frame:%d", __func__, mId, request->frameNumber);
+
+    memset(&result, 0, sizeof(result));
+    result.frame_number = request->frameNumber;
+    if (!request->failed) {
+        // TODO: return actual captured/reprocessed settings
+        // The request settings have room for the result entries
+        if (setResultTimestamp(request) == 0) {
+            result.result = request->settings;
+        } else {
+            ALOGE("%s:%d: Failed to build result metadata for Frame:%d",
+                    __func__, mId, request->frameNumber);
+            notifyError(request->frameNumber, NULL, CAMERA3_MSG_ERROR_RESULT);
+        }
+    }
+    result.num_output_buffers = request->numOutputBuffers;
+    result.output_buffers = request->outputBuffers;
+    mCallbackOps->process_capture_result(mCallbackOps, &result);
+    mStats.result(systemTime(SYSTEM_TIME_MONOTONIC) - request->startTime,
+            request->failed);
+}
+
+int Camera::setResultTimestamp(CaptureRequest *request)
+{
+    camera_metadata_entry_t entry;
+    int64_t timestamp = request->timestamp;
+
+    if (find_camera_metadata_entry(request->settings, ANDROID_SENSOR_TIMESTAMP,
+                &entry) == 0)
+        return update_camera_metadata_entry(request->settings, entry.index,
+                &timestamp, 1, NULL);
+    return add_camera_metadata_entry(request->settings,
+            ANDROID_SENSOR_TIMESTAMP, &timestamp, 1);
 }
 
 void Camera::setSettings(const camera_metadata_t *new_settings)
 {
-    if (mSettings != NULL) {
-        free_camera_metadata(mSettings);
-        mSettings = NULL;
+    size_t size;
+
+    if (new_settings != NULL && mSettings != NULL &&
+            updateSettings(new_settings))
+        return;
+
+    mSettings = NULL;
+    mSettingsChecked = false;
+    mNumChangedTags = 0;
+    if (new_settings == NULL)
+        return;
+
+    // Reuse the storage of previous settings, only growing it when needed
+    size = get_camera_metadata_compact_size(new_settings);
+    if (size > mSettingsBufferSize) {
+        void *buffer = malloc(size);
+        if (buffer == NULL) {
+            ALOGE("%s:%d: Failed to allocate %zu bytes of settings", __func__,
+                    mId, size);
+            return;
+        }
+        free(mSettingsBuffer);
+        mSettingsBuffer = buffer;
+        mSettingsBufferSize = size;
+    }
+    mSettings = copy_camera_metadata(mSettingsBuffer, mSettingsBufferSize,
+            new_settings);
+}
+
+bool Camera::updateSettings(const camera_metadata_t *new_settings)
+{
+    size_t count = get_camera_metadata_entry_count(new_settings);
+    camera_metadata_ro_entry_t old_entry, new_entry;
+
+    if (count != get_camera_metadata_entry_count(mSettings))
+        return false;
+    if (count > mChangedTagsCapacity) {
+        delete [] mChangedTags;
+        mChangedTags = new uint32_t[count];
+        mChangedTagsCapacity = count;
+        // The changes not verified yet are lost, verify everything
+        mSettingsChecked = false;
+        mNumChangedTags = 0;
     }
 
-    if (new_settings != NULL)
-        mSettings = clone_camera_metadata(new_settings);
+    for (size_t i = 0; i < count; i++) {
+        if (get_camera_metadata_ro_entry(mSettings, i, &old_entry) ||
+                get_camera_metadata_ro_entry(new_settings, i, &new_entry))
+            return false;
+        if (old_entry.tag != new_entry.tag ||
+                old_entry.type != new_entry.type ||
+                old_entry.count != new_entry.count ||
+                new_entry.type >= NUM_TYPES)
+            return false;
+        if (memcmp(old_entry.data.u8, new_entry.data.u8,
+                    camera_metadata_type_size[new_entry.type] *
+                    new_entry.count) == 0)
+            continue;
+        // Of the same size, the entry is updated in place
+        if (update_camera_metadata_entry(mSettings, i, new_entry.data.u8,
+                    new_entry.count, NULL))
+            return false;
+        if (!mSettingsChecked)
+            continue;
+        if (mNumChangedTags == mChangedTagsCapacity) {
+            // Changed over several requests not verified for a capture,
+            // e.g. reprocess requests, verify everything
+            mSettingsChecked = false;
+            mNumChangedTags = 0;
+            continue;
+        }
+        mChangedTags[mNumChangedTags++] = new_entry.tag;
+    }
+    ALOGV("%s:%d: %zu changed entries of %zu to verify", __func__, mId,
+            mNumChangedTags, count);
+    return true;
+}
+
+bool Camera::isValidCurrentSettings()
+{
+    if (!mSettingsChecked || !mSettingsValid) {
+        mSettingsValid = isValidCaptureSettings(mSettings);
+        mSettingsChecked = true;
+    } else if (mNumChangedTags > 0) {
+        mSettingsValid = isValidCaptureChange(mSettings, mChangedTags,
+                mNumChangedTags);
+    }
+    // Checked, later requests without settings reuse the result
+    mNumChangedTags = 0;
+    return mSettingsValid;
+}
+
+bool Camera::isValidCaptureChange(const camera_metadata_t *settings,
+        const uint32_t* /*tags*/, size_t /*count*/)
+{
+    return isValidCaptureSettings(settings);
 }
 
 bool Camera::isValidReprocessSettings(const camera_metadata_t* /*settings*/)
 {
     // TODO: reject settings that cannot be reprocessed
-    // input buffers unimplemented, use this to reject reprocessing requests
-    ALOGE("%s:%d: Input buffer reprocessing not implemented", __func__, mId);
-    return false;
+    // Input buffers are scaled or encoded into the outputs by mProcessor
+    return true;
 }
 
-int Camera::processCaptureBuffer(const camera3_stream_buffer_t *in,
-        camera3_stream_buffer_t *out)
+int Camera::processCaptureBuffer(CaptureRequest *request, uint32_t index)
 {
-    if (in->acquire_fence != -1) {
-        int res = sync_wait(in->acquire_fence, CAMERA_SYNC_TIMEOUT);
+    int acquire_fence = request->acquireFences[index];
+
+    if (acquire_fence != -1) {
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+        int res = sync_wait(acquire_fence, CAMERA_SYNC_TIMEOUT);
+        mStats.fenceWait(systemTime(SYSTEM_TIME_MONOTONIC) - start);
         if (res == -ETIME) {
             ALOGE("%s:%d: Timeout waiting on buffer acquire fence",
                     __func__, mId);
@@ -429,17 +1126,71 @@ int Camera::processCaptureBuffer(const camera3_stream_buffer_t *in,
                     __func__, mId, strerror(-res), res);
             return res;
         }
+        ::close(acquire_fence);
+        request->acquireFences[index] = -1;
     }
 
-    out->stream = in->stream;
-    out->buffer = in->buffer;
-    out->status = CAMERA3_BUFFER_STATUS_OK;
-    // TODO: use driver-backed release fences
-    out->acquire_fence = -1;
-    out->release_fence = -1;
+    if (request->hasInputBuffer)
+        return mProcessor.fill(mReprocessSource, &request->outputBuffers[index],
+                request->settings);
+    return fillBuffer(request, &request->outputBuffers[index]);
+}
 
-    // TODO: lock and software-paint buffer
-    return 0;
+void Camera::fillOutputBuffers(CaptureRequest *request, bool release_fences)
+{
+    BufferWork work;
+
+    ATRACE_CALL();
+
+    work.camera = this;
+    work.request = request;
+    work.releaseFences = release_fences;
+    work.next = 0;
+    work.released = 0;
+    for (uint32_t i = 0; i < request->numOutputBuffers; i++)
+        request->bufferResults[i] = kBufferPending;
+
+    // A single buffer is not worth waking up the workers for
+    if (request->numOutputBuffers > 1)
+        mBufferWorkers.run(fill_buffers_part, &work);
+    else
+        fillBuffersPart(&work);
+}
+
+void Camera::fillBuffersPart(BufferWork *work)
+{
+    CaptureRequest *request = work->request;
+    uint32_t i;
+    int res;
+
+    // android_atomic_inc returns the previous value
+    while ((i = android_atomic_inc(&work->next)) < request->numOutputBuffers) {
+        if (!work->releaseFences && android_atomic_acquire_load(&mFlushing))
+            res = -ECANCELED;
+        else
+            res = processCaptureBuffer(request, i);
+        if (res && work->releaseFences) {
+            // Too late to fail the buffer, it is released unfilled
+            ALOGE("%s:%d: Frame:%d buffer %d released unfilled", __func__,
+                    mId, request->frameNumber, i);
+            mStats.bufferError();
+            if (request->acquireFences[i] != -1) {
+                ::close(request->acquireFences[i]);
+                request->acquireFences[i] = -1;
+            }
+        }
+
+        android::Mutex::Autolock al(work->lock);
+        request->bufferResults[i] = res;
+        if (!work->releaseFences)
+            continue;
+        // The timeline counts the buffers filled in order
+        while (work->released < request->numOutputBuffers &&
+                request->bufferResults[work->released] != kBufferPending) {
+            sw_sync_timeline_inc(mReleaseTimeline, 1);
+            work->released++;
+        }
+    }
 }
 
 void Camera::notifyShutter(uint32_t frame_number, uint64_t timestamp)
@@ -467,6 +1218,18 @@ void Camera::notifyShutter(uint32_t frame_number, uint64_t timestamp)
     mCallbackOps->notify(mCallbackOps, &m);
 }
 
+void Camera::notifyError(uint32_t frame_number, camera3_stream_t *stream,
+        int code)
+{
+    camera3_notify_msg_t m;
+    memset(&m, 0, sizeof(m));
+    m.type = CAMERA3_MSG_ERROR;
+    m.message.error.frame_number = frame_number;
+    m.message.error.error_stream = stream;
+    m.message.error.error_code = code;
+    mCallbackOps->notify(mCallbackOps, &m);
+}
+
 void Camera::dump(int fd)
 {
     ALOGV("%s:%d: Dumping to fd %d", __func__, mId, fd);
@@ -483,6 +1246,21 @@ void Camera::dump(int fd)
         dprintf(fd, "Stream %d/%d:\n", i, mNumStreams);
         mStreams[i]->dump(fd);
     }
+    mStats.dump(fd);
+}
+
+int Camera::getPerfCounters(hw_perf_counter_t *counters, size_t count)
+{
+    size_t n = 0;
+    int inFlight;
+
+    {
+        android::Mutex::Autolock al(mInFlightLock);
+        inFlight = mInFlight;
+    }
+    hw_perf_counter_put(counters, count, &n, "requests_in_flight",
+            HW_PERF_COUNTER_TYPE_GAUGE, inFlight);
+    return mStats.getCounters(counters, count, n);
 }
 
 const char* Camera::templateToString(int type)
@@ -505,8 +1283,7 @@ const char* Camera::templateToString(int type)
 
 int Camera::setTemplate(int type, camera_metadata_t *settings)
 {
-    android::Mutex::Autolock al(mDeviceLock);
-
+    // mStaticInfoLock is held by constructDefaultRequestSettings()
     if (!isValidTemplateType(type)) {
         ALOGE("%s:%d: Invalid template request type: %d", __func__, mId, type);
         return -EINVAL;
@@ -570,10 +1347,16 @@ static void dump(const camera3_device_t *dev, int fd)
     camdev_to_camera(dev)->dump(fd);
 }
 
-static int flush(const camera3_device_t*)
+static int get_perf_counters(const hw_device_t *dev,
+        hw_perf_counter_t *counters, size_t count)
+{
+    return camdev_to_camera(reinterpret_cast<const camera3_device_t*>(dev))
+            ->getPerfCounters(counters, count);
+}
+
+static int flush(const camera3_device_t *dev)
 {
-    ALOGE("%s: unimplemented.", __func__);
-    return -1;
+    return camdev_to_camera(dev)->flush();
 }
 
 } // extern "C"
@@ -591,4 +1374,10 @@ const camera3_device_ops_t Camera::sOps = {
     .reserved = {0},
 };
 
+const hw_device_ext_t Camera::sExt = {
+    .tag = HARDWARE_DEVICE_EXT_TAG,
+    .version = HARDWARE_DEVICE_EXT_VERSION_1,
+    .get_perf_counters = default_camera_hal::get_perf_counters,
+};
+
 } // namespace default_camera_hal
@@ -17,13 +17,22 @@
 #ifndef CAMERA_H_
 #define CAMERA_H_
 
+#include <pthread.h>
 #include <hardware/hardware.h>
 #include <hardware/camera3.h>
+#include <utils/Condition.h>
 #include <utils/Mutex.h>
+#include "CaptureStats.h"
+#include "FrameProcessor.h"
 #include "Metadata.h"
+#include "RequestQueue.h"
+#include "ResourceArbiter.h"
 #include "Stream.h"
+#include "WorkerPool.h"
 
 namespace default_camera_hal {
+struct BufferWork;
+
 // Camera represents a physical camera on a device.
 // This is constructed when the HAL module is loaded, one per physical camera.
 // It is opened by the framework, and must be closed before it can be opened
@@ -38,7 +47,9 @@ class Camera {
         virtual ~Camera();
 
         // Common Camera Device Operations (see <hardware/camera_common.h>)
-        int open(const hw_module_t *module, hw_device_t **device);
+        // The cost of the camera is reserved from arbiter until closed.
+        int open(const hw_module_t *module, hw_device_t **device,
+                ResourceArbiter *arbiter);
         int getInfo(struct camera_info *info);
         int close();
 
@@ -49,19 +60,68 @@ class Camera {
         const camera_metadata_t *constructDefaultRequestSettings(int type);
         int processCaptureRequest(camera3_capture_request_t *request);
         void dump(int fd);
+        int flush();
+        // Performance counters, see hw_device_ext_t
+        int getPerfCounters(hw_perf_counter_t *counters, size_t count);
 
+        // Stages of the capture pipeline, each run by its own worker thread
+        void captureLoop();
+        void resultLoop();
+        // Body of the workers filling the output buffers of a request
+        void fillBuffersPart(BufferWork *work);
 
     protected:
         // Initialize static camera characteristics for individual device
         virtual camera_metadata_t *initStaticInfo() = 0;
         // Verify settings are valid for a capture
         virtual bool isValidCaptureSettings(const camera_metadata_t *) = 0;
+        // Verify settings found valid for a capture still are after the
+        // entries of count tags changed in place. By default all of settings
+        // are verified again with isValidCaptureSettings().
+        virtual bool isValidCaptureChange(const camera_metadata_t *settings,
+                const uint32_t *tags, size_t count);
         // Separate initialization method for individual devices when opened
         virtual int initDevice() = 0;
-        // Accessor used by initDevice() to set the templates' metadata
+        // Close what initDevice() opened, once no request is in flight
+        virtual void closeDevice();
+        // Configure the device for a valid stream set, before any request
+        virtual int configureDevice(Stream **streams, int count);
+        // Capture the frame of a request and set its timestamp. Devices that
+        // write into the output buffers directly must wait on and clear
+        // their acquire fences themselves.
+        virtual int startCapture(CaptureRequest *request);
+        // Fill an output buffer of the captured frame, once it is free. By
+        // default it is filled with a test pattern.
+        virtual int fillBuffer(CaptureRequest *request,
+                const camera3_stream_buffer_t *buffer);
+        // Release the captured frame once all its buffers are filled
+        virtual void finishCapture(CaptureRequest *request);
+        // Build the settings templates with setTemplate(), called once on the
+        // first template query with mStaticInfoLock held
+        virtual int initTemplates() = 0;
+        // Accessor used by initTemplates() to set the templates' metadata
         int setTemplate(int type, camera_metadata_t *static_info);
         // Prettyprint template names
         const char* templateToString(int type);
+        // Number of requests in flight between processCaptureRequest() and
+        // process_capture_result, reported as android.request.pipelineMaxDepth
+        static const uint8_t kPipelineMaxDepth = 4;
+        // Share of the HAL's capture resources the camera needs while open,
+        // out of CAMERA_RESOURCE_CAPACITY. By default two cameras can stream
+        // at once.
+        virtual int getResourceCost();
+        // Direction the camera faces, CAMERA_FACING_*, and clockwise rotation
+        // of its image to be upright, as reported by getInfo(). By default
+        // a front camera needing no rotation.
+        virtual int getFacing();
+        virtual int getOrientation();
+        // Configured stream of a framework stream handle, or NULL
+        Stream *findStream(const camera3_stream_t *astream);
+        // Identifier used by framework to distinguish cameras
+        const int mId;
+        // Software stage filling output buffers from frames, running while
+        // the device is open
+        FrameProcessor mProcessor;
 
     private:
         // Camera device handle returned to framework for use
@@ -74,43 +134,157 @@ class Camera {
         bool isValidStreamSet(Stream **array, int count);
         // Calculate usage and max_bufs of each stream
         void setupStreams(Stream **array, int count);
-        // Copy new settings for re-use and clean up old settings.
+        // Verify an output buffer belongs to a configured output stream
+        bool isValidOutputBuffer(const camera3_stream_buffer_t *buffer);
+        // Verify an input buffer belongs to a configured input stream
+        bool isValidInputBuffer(const camera3_stream_buffer_t *buffer);
+        // Start the software stage, with the JPEG buffer size of the device
+        int startProcessor();
+        // Copy new settings for re-use and clean up old settings. Settings
+        // laid out as the previous ones, as a burst changing only some
+        // values sends them, only have the changed entries written to
+        // mSettings, and listed in mChangedTags until verified.
         void setSettings(const camera_metadata_t *new_settings);
+        // Write the entries of new_settings differing from mSettings into
+        // it. Returns false, with mSettings partly updated, if new_settings
+        // does not have the same tags, types and counts in the same order.
+        bool updateSettings(const camera_metadata_t *new_settings);
+        // Verify mSettings are valid for a capture, only checking what
+        // changed since they were last verified
+        bool isValidCurrentSettings();
         // Verify settings are valid for reprocessing an input buffer
         bool isValidReprocessSettings(const camera_metadata_t *settings);
-        // Process an output buffer
-        int processCaptureBuffer(const camera3_stream_buffer_t *in,
-                camera3_stream_buffer_t *out);
+        // Wait for an output buffer of a request to be free and fill it. Its
+        // acquire fence is closed and cleared once waited on.
+        int processCaptureBuffer(CaptureRequest *request, uint32_t index);
+        // Fill all output buffers of a request with processCaptureBuffer(),
+        // concurrently on mBufferWorkers, storing the result of each in
+        // request->bufferResults. With release fences each one is signalled
+        // as soon as it and the buffers before it are filled, and a buffer
+        // that failed is released unfilled.
+        void fillOutputBuffers(CaptureRequest *request, bool release_fences);
+        // Give every output buffer of a request a release fence, signalled
+        // once the buffer is filled. Returns false if fences are unavailable.
+        bool createReleaseFences(CaptureRequest *request);
+        void closeReleaseTimeline();
         // Send a shutter notify message with start of exposure time
         void notifyShutter(uint32_t frame_number, uint64_t timestamp);
+        // Send an error notify message, stream is NULL unless the error is
+        // CAMERA3_MSG_ERROR_BUFFER
+        void notifyError(uint32_t frame_number, camera3_stream_t *stream,
+                int code);
+        // Start and stop the worker threads of the capture pipeline
+        int startPipeline();
+        void stopPipeline();
+        // Capture all output buffers of a request and notify the shutter
+        void captureRequest(CaptureRequest *request);
+        // Return a request that will not be captured with an error, its
+        // buffers released on their acquire fences
+        void failRequest(CaptureRequest *request);
+        // Count a request in flight, once accepted and again while its
+        // buffers are filled after its result was queued
+        void requestStarted();
+        // Count it out once its result was sent, its buffers were filled or
+        // it failed to be queued, waking up flush() with the last one
+        void requestDone();
+        // Wait for the input buffer of a reprocess request and lock it as
+        // mReprocessSource, and unlock it once the outputs are filled
+        int startReprocess(CaptureRequest *request);
+        void finishReprocess(CaptureRequest *request);
+        // Close the input acquire fence if not waited on and signal the input
+        // release fence
+        void releaseInputBuffer(CaptureRequest *request);
+        // Return a captured request to the framework
+        void sendResult(CaptureRequest *request);
+        // Add the start of exposure to the settings returned as result
+        int setResultTimestamp(CaptureRequest *request);
         // Is type a valid template type (and valid index into mTemplates)
         bool isValidTemplateType(int type);
 
-        // Identifier used by framework to distinguish cameras
-        const int mId;
         // Metadata containing persistent camera characteristics
         Metadata mMetadata;
         // camera_metadata structure containing static characteristics
         camera_metadata_t *mStaticInfo;
         // Busy flag indicates camera is in use
         bool mBusy;
+        // Arbiter the cost of the camera is reserved from while busy
+        ResourceArbiter *mArbiter;
         // Camera device operations handle shared by all devices
         const static camera3_device_ops_t sOps;
+        // Extensions of mDevice.common, for the performance counters
+        const static hw_device_ext_t sExt;
         // Methods used to call back into the framework
         const camera3_callback_ops_t *mCallbackOps;
         // Lock protecting the Camera object for modifications
         android::Mutex mDeviceLock;
-        // Lock protecting only static camera characteristics, which may
-        // be accessed without the camera device open
+        // Lock protecting only static camera characteristics and templates,
+        // which may be accessed without the camera device open
         android::Mutex mStaticInfoLock;
         // Array of handles to streams currently in use by the device
         Stream **mStreams;
         // Number of streams in mStreams
         int mNumStreams;
-        // Static array of standard camera settings templates
+        // Stream of mStreams for each framework stream handle
+        PointerMap<Stream*> mStreamIndex;
+        // Static array of standard camera settings templates, built on the
+        // first query and immutable from then on, across opens
         camera_metadata_t *mTemplates[CAMERA3_TEMPLATE_COUNT];
-        // Most recent request settings seen, memoized to be reused
+        // initTemplates() has been called
+        bool mTemplatesInitialized;
+        // Most recent request settings seen, memoized to be reused.
+        // Placed in mSettingsBuffer, which is reused by later settings.
         camera_metadata_t *mSettings;
+        void *mSettingsBuffer;
+        size_t mSettingsBufferSize;
+        // Tags of the entries setSettings() changed in place since mSettings
+        // were last verified, and the number of tags mChangedTags has room
+        // for
+        uint32_t *mChangedTags;
+        size_t mNumChangedTags;
+        size_t mChangedTagsCapacity;
+        // mSettings were verified for a capture since they were last
+        // replaced as a whole, with mSettingsValid as result
+        bool mSettingsChecked;
+        bool mSettingsValid;
+        // Preallocated requests, one per request in flight
+        RequestPool mRequestPool;
+        // Requests accepted by processCaptureRequest() waiting to be captured
+        RequestQueue mPendingQueue;
+        // Captured requests waiting for their results to be sent
+        RequestQueue mResultQueue;
+        // Worker threads popping mPendingQueue and mResultQueue
+        pthread_t mCaptureThread;
+        pthread_t mResultThread;
+        // Threads filling the output buffers of a request along with the
+        // capture thread, so a JPEG encode overlaps the preview and video
+        // buffers of the same request
+        WorkerPool mBufferWorkers;
+        // Up to this many buffers of a request are filled at once
+        static const int kMaxParallelBuffers = 3;
+        // Pipeline threads are running, from initialize() to close()
+        bool mPipelineRunning;
+        // sw_sync timeline signalling release fences, -1 if unavailable
+        int mReleaseTimeline;
+        // Timeline value of the last release fence created
+        uint32_t mReleaseSeq;
+        // sw_sync timeline signalling input buffer release fences, and value
+        // of the last one created, by processCaptureRequest()
+        int mInputTimeline;
+        uint32_t mInputSeq;
+        // Input buffer of the request being reprocessed, capture thread only
+        YuvImage mReprocessSource;
+        // Number of flush() calls in progress. Requests not captured yet are
+        // failed while it is non-zero.
+        volatile int32_t mFlushing;
+        // Requests accepted by processCaptureRequest() whose result has not
+        // been sent or buffers not been filled yet
+        int mInFlight;
+        // Lock protecting mInFlight
+        android::Mutex mInFlightLock;
+        // Signalled when mInFlight drops to zero
+        android::Condition mAllReturned;
+        // Frame timing of the current stream configuration
+        CaptureStats mStats;
 };
 } // namespace default_camera_hal
 
@@ -14,10 +14,13 @@
  * limitations under the License.
  */
 
+#include <cstdio>
 #include <cstdlib>
 #include <hardware/camera_common.h>
 #include <hardware/hardware.h>
 #include "ExampleCamera.h"
+#include "SfdroidCamera.h"
+#include "V4L2Camera.h"
 #include "VendorTags.h"
 
 //#define LOG_NDEBUG 0
@@ -37,17 +40,51 @@
 
 namespace default_camera_hal {
 
-// Default Camera HAL has 2 cameras, front and rear.
+// Default Camera HAL has 2 cameras, front and rear, when no V4L2 capture
+// device nor sfdroid camera is found.
 static CameraHAL gCameraHAL(2);
 // Handle containing vendor tag functionality
 static VendorTags gVendorTags;
 
+// Device nodes probed for V4L2 capture devices, /dev/video0 onwards, and
+// most cameras of all kinds
+#define V4L2_MAX_DEVICES 8
+
 CameraHAL::CameraHAL(int num_cameras)
-  : mNumberOfCameras(num_cameras),
-    mCallbacks(NULL)
+  : mNumberOfCameras(0),
+    mCallbacks(NULL),
+    mArbiter(CAMERA_RESOURCE_CAPACITY)
 {
+    char path[32];
+
     // Allocate camera array and instantiate camera devices
-    mCameras = new Camera*[mNumberOfCameras];
+    mCameras = new Camera*[V4L2_MAX_DEVICES > num_cameras ?
+            V4L2_MAX_DEVICES : num_cameras];
+    for (int i = 0; i < V4L2_MAX_DEVICES; i++) {
+        snprintf(path, sizeof(path), "/dev/video%d", i);
+        if (V4L2Camera::isCaptureDevice(path)) {
+            ALOGI("%s: camera id %d: %s", __func__, mNumberOfCameras, path);
+            mCameras[mNumberOfCameras] = new V4L2Camera(mNumberOfCameras, path);
+            mNumberOfCameras++;
+        }
+    }
+    // Cameras of the Sailfish host, when running on top of it
+    for (uint32_t i = 0; mNumberOfCameras < V4L2_MAX_DEVICES; i++) {
+        sfdroid_camera_info_t info;
+        if (SfdroidCamera::queryInfo(i, &info) != 0)
+            break;
+        ALOGI("%s: camera id %d: sfdroid camera %d", __func__,
+                mNumberOfCameras, i);
+        mCameras[mNumberOfCameras] = new SfdroidCamera(mNumberOfCameras, i,
+                info);
+        mNumberOfCameras++;
+        if (i + 1 >= info.num_cameras)
+            break;
+    }
+    if (mNumberOfCameras > 0)
+        return;
+
+    mNumberOfCameras = num_cameras;
     // Rear camera
     mCameras[0] = new ExampleCamera(0);
     // Front camera
@@ -104,7 +141,7 @@ int CameraHAL::open(const hw_module_t* mod, const char* name, hw_device_t** dev)
         ALOGE("%s: Invalid camera id %d", __func__, id);
         return -ENODEV;
     }
-    return mCameras[id]->open(mod, dev);
+    return mCameras[id]->open(mod, dev, &mArbiter);
 }
 
 extern "C" {
@@ -172,7 +209,7 @@ camera_module_t HAL_MODULE_INFO_SYM __attribute__ ((visibility("default"))) = {
     common : {
         tag                : HARDWARE_MODULE_TAG,
         module_api_version : CAMERA_MODULE_API_VERSION_2_2,
-        hal_api_version    : HARDWARE_HAL_API_VERSION,
+        hal_api_version    : HARDWARE_HAL_API_VERSION_1_1,
         id                 : CAMERA_HARDWARE_MODULE_ID,
         name               : "Default Camera HAL",
         author             : "The Android Open Source Project",
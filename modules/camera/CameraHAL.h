@@ -22,8 +22,13 @@
 #include <hardware/camera_common.h>
 #include <system/camera_vendor_tags.h>
 #include "Camera.h"
+#include "ResourceArbiter.h"
 #include "VendorTags.h"
 
+// Total resource cost of the cameras open at once, see
+// Camera::getResourceCost()
+#define CAMERA_RESOURCE_CAPACITY 100
+
 namespace default_camera_hal {
 // CameraHAL contains all module state that isn't specific to an individual
 // camera device.
@@ -43,11 +48,13 @@ class CameraHAL {
 
     private:
         // Number of cameras
-        const int mNumberOfCameras;
+        int mNumberOfCameras;
         // Callback handle
         const camera_module_callbacks_t *mCallbacks;
         // Array of camera devices, contains mNumberOfCameras device pointers
         Camera **mCameras;
+        // Capture resources shared by the open cameras
+        ResourceArbiter mArbiter;
 };
 } // namespace default_camera_hal
 
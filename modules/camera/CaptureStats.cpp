@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <utils/Mutex.h>
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "CaptureStats"
+#include <cutils/log.h>
+
+#define ATRACE_TAG (ATRACE_TAG_CAMERA | ATRACE_TAG_HAL)
+#include <utils/Trace.h>
+
+#include "CaptureStats.h"
+
+namespace default_camera_hal {
+
+static int64_t monotonicNs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+CaptureStats::CaptureStats(int id)
+{
+    snprintf(mShutterCounter, sizeof(mShutterCounter),
+            "Camera %d shutter latency us", id);
+    snprintf(mResultCounter, sizeof(mResultCounter),
+            "Camera %d result latency us", id);
+    snprintf(mFenceCounter, sizeof(mFenceCounter),
+            "Camera %d fence wait us", id);
+    snprintf(mDroppedCounter, sizeof(mDroppedCounter),
+            "Camera %d dropped frames", id);
+    snprintf(mInFlightCounter, sizeof(mInFlightCounter),
+            "Camera %d requests in flight", id);
+    reset();
+}
+
+CaptureStats::~CaptureStats()
+{
+}
+
+void CaptureStats::reset()
+{
+    android::Mutex::Autolock al(mLock);
+
+    memset(&mShutter, 0, sizeof(mShutter));
+    memset(&mResult, 0, sizeof(mResult));
+    memset(&mFenceWait, 0, sizeof(mFenceWait));
+    mDroppedFrames = 0;
+    mBufferErrors = 0;
+    mStartNs = monotonicNs();
+    mLastResultNs = mStartNs;
+}
+
+void CaptureStats::shutter(int64_t latency_ns)
+{
+    android::Mutex::Autolock al(mLock);
+
+    ATRACE_INT(mShutterCounter, record(&mShutter, latency_ns));
+}
+
+void CaptureStats::result(int64_t latency_ns, bool failed)
+{
+    android::Mutex::Autolock al(mLock);
+
+    ATRACE_INT(mResultCounter, record(&mResult, latency_ns));
+    mLastResultNs = monotonicNs();
+    if (failed) {
+        mDroppedFrames++;
+        ATRACE_INT(mDroppedCounter, (int32_t)mDroppedFrames);
+    }
+}
+
+void CaptureStats::fenceWait(int64_t wait_ns)
+{
+    android::Mutex::Autolock al(mLock);
+
+    ATRACE_INT(mFenceCounter, record(&mFenceWait, wait_ns));
+}
+
+void CaptureStats::bufferError()
+{
+    android::Mutex::Autolock al(mLock);
+
+    mBufferErrors++;
+}
+
+void CaptureStats::inFlight(int count)
+{
+    ATRACE_INT(mInFlightCounter, count);
+}
+
+int32_t CaptureStats::record(LatencyHistogram *h, int64_t latency_ns)
+{
+    int64_t us = latency_ns / 1000;
+    int bucket = 0;
+
+    while (bucket < LatencyHistogram::kBuckets - 1 && us >= (1LL << bucket))
+        bucket++;
+    h->buckets[bucket]++;
+    h->count++;
+    h->totalNs += latency_ns;
+    if (latency_ns > h->maxNs)
+        h->maxNs = latency_ns;
+    return us > INT32_MAX ? INT32_MAX : (int32_t)us;
+}
+
+int64_t CaptureStats::percentileUs(const LatencyHistogram *h, double fraction)
+{
+    uint64_t wanted = (uint64_t)(h->count * fraction);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < LatencyHistogram::kBuckets - 1; i++) {
+        seen += h->buckets[i];
+        if (seen > wanted)
+            return 1LL << i;
+    }
+    return h->maxNs / 1000;
+}
+
+void CaptureStats::dumpHistogram(int fd, const char *name,
+        const LatencyHistogram *h)
+{
+    if (h->count == 0) {
+        dprintf(fd, "  %s: none\n", name);
+        return;
+    }
+    dprintf(fd, "  %s: %" PRIu64 ", mean %" PRId64 " us, p50 < %" PRId64
+            " us, p99 < %" PRId64 " us, max %" PRId64 " us\n", name, h->count,
+            h->totalNs / (int64_t)h->count / 1000, percentileUs(h, 0.5),
+            percentileUs(h, 0.99), h->maxNs / 1000);
+}
+
+void CaptureStats::dump(int fd)
+{
+    android::Mutex::Autolock al(mLock);
+    int64_t elapsed = mLastResultNs - mStartNs;
+
+    dprintf(fd, "Capture statistics since streams were configured:\n");
+    dumpHistogram(fd, "Request to shutter", &mShutter);
+    dumpHistogram(fd, "Request to result", &mResult);
+    dumpHistogram(fd, "Acquire fence waits", &mFenceWait);
+    dprintf(fd, "  Throughput: %.2f fps over %.2f s\n",
+            elapsed > 0 ? mResult.count * 1e9 / elapsed : 0.0, elapsed / 1e9);
+    dprintf(fd, "  Dropped frames: %" PRIu64 ", buffer errors: %" PRIu64 "\n",
+            mDroppedFrames, mBufferErrors);
+}
+
+size_t CaptureStats::getCounters(hw_perf_counter_t *counters, size_t count,
+        size_t index)
+{
+    android::Mutex::Autolock al(mLock);
+
+    hw_perf_counter_put(counters, count, &index, "results",
+            HW_PERF_COUNTER_TYPE_COUNT, mResult.count);
+    hw_perf_counter_put(counters, count, &index, "frames_dropped",
+            HW_PERF_COUNTER_TYPE_COUNT, mDroppedFrames);
+    hw_perf_counter_put(counters, count, &index, "buffer_errors",
+            HW_PERF_COUNTER_TYPE_COUNT, mBufferErrors);
+    hw_perf_counter_put(counters, count, &index, "shutter.total_ns",
+            HW_PERF_COUNTER_TYPE_TIME_NS, mShutter.totalNs);
+    hw_perf_counter_put(counters, count, &index, "shutter.max_ns",
+            HW_PERF_COUNTER_TYPE_MAX_NS, mShutter.maxNs);
+    hw_perf_counter_put(counters, count, &index, "result.total_ns",
+            HW_PERF_COUNTER_TYPE_TIME_NS, mResult.totalNs);
+    hw_perf_counter_put(counters, count, &index, "result.max_ns",
+            HW_PERF_COUNTER_TYPE_MAX_NS, mResult.maxNs);
+    hw_perf_counter_put(counters, count, &index, "fence_wait.count",
+            HW_PERF_COUNTER_TYPE_COUNT, mFenceWait.count);
+    hw_perf_counter_put(counters, count, &index, "fence_wait.total_ns",
+            HW_PERF_COUNTER_TYPE_TIME_NS, mFenceWait.totalNs);
+    hw_perf_counter_put(counters, count, &index, "fence_wait.max_ns",
+            HW_PERF_COUNTER_TYPE_MAX_NS, mFenceWait.maxNs);
+    return index;
+}
+
+} // namespace default_camera_hal
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef CAPTURE_STATS_H_
+#define CAPTURE_STATS_H_
+
+#include <stdint.h>
+#include <hardware/hardware.h>
+#include <utils/Mutex.h>
+
+namespace default_camera_hal {
+// Histogram of latencies: bucket i counts latencies below 2^i microseconds,
+// the last one everything larger.
+struct LatencyHistogram {
+    static const int kBuckets = 21;
+
+    uint32_t buckets[kBuckets];
+    uint64_t count;
+    int64_t totalNs;
+    int64_t maxNs;
+};
+
+// CaptureStats accumulates the frame timing of a camera since its streams
+// were last configured, for dump() and as systrace counters. All methods may
+// be called from any pipeline thread.
+class CaptureStats {
+    public:
+        CaptureStats(int id);
+        ~CaptureStats();
+
+        // Forget everything recorded, from now on
+        void reset();
+        // A request was captured, latency after processCaptureRequest()
+        void shutter(int64_t latency_ns);
+        // The result of a request was sent, latency after
+        // processCaptureRequest(). failed requests count as dropped frames.
+        void result(int64_t latency_ns, bool failed);
+        // Time spent waiting on an acquire fence before filling a buffer
+        void fenceWait(int64_t wait_ns);
+        // A buffer was returned unfilled
+        void bufferError();
+        // Number of requests in flight, as a systrace counter only
+        void inFlight(int count);
+
+        // Print the statistics to fd
+        void dump(int fd);
+        // Performance counters of the statistics, see hw_device_ext_t.
+        // Adds them from index on and returns the index after them.
+        size_t getCounters(hw_perf_counter_t *counters, size_t count,
+                size_t index);
+
+    private:
+        // Add a latency to a histogram, and return it in microseconds
+        static int32_t record(LatencyHistogram *h, int64_t latency_ns);
+        // Upper bound in microseconds of the bucket holding the given fraction
+        // of the latencies
+        static int64_t percentileUs(const LatencyHistogram *h, double fraction);
+        static void dumpHistogram(int fd, const char *name,
+                const LatencyHistogram *h);
+
+        // Request to shutter, request to result and fence wait latencies
+        LatencyHistogram mShutter;
+        LatencyHistogram mResult;
+        LatencyHistogram mFenceWait;
+        // Requests failed as a whole, and single buffers returned unfilled
+        uint64_t mDroppedFrames;
+        uint64_t mBufferErrors;
+        // CLOCK_MONOTONIC time of reset() and of the last result
+        int64_t mStartNs;
+        int64_t mLastResultNs;
+        // Names of the systrace counters, including the camera id
+        char mShutterCounter[40];
+        char mResultCounter[40];
+        char mFenceCounter[40];
+        char mDroppedCounter[40];
+        char mInFlightCounter[40];
+        // Lock protecting all of the above
+        android::Mutex mLock;
+};
+} // namespace default_camera_hal
+
+#endif // CAPTURE_STATS_H_
@@ -43,8 +43,9 @@ camera_metadata_t *ExampleCamera::initStaticInfo()
     /*
      * Setup static camera info.  This will have to customized per camera
      * device.
+     * Sized for all of the entries below, so none of them reallocates.
      */
-    Metadata m;
+    Metadata m(32, 1024);
 
     /* android.control */
     int32_t android_control_ae_available_target_fps_ranges[] = {30, 30};
@@ -90,6 +91,8 @@ camera_metadata_t *ExampleCamera::initStaticInfo()
             ARRAY_SIZE(android_request_max_num_output_streams),
             android_request_max_num_output_streams);
 
+    m.add1UInt8(ANDROID_REQUEST_PIPELINE_MAX_DEPTH, kPipelineMaxDepth);
+
     /* android.scaler */
     int32_t android_scaler_available_formats[] = {
             HAL_PIXEL_FORMAT_RAW_SENSOR,
@@ -178,6 +181,12 @@ camera_metadata_t *ExampleCamera::initStaticInfo()
 }
 
 int ExampleCamera::initDevice()
+{
+    // TODO: open and configure device specific nodes
+    return 0;
+}
+
+int ExampleCamera::initTemplates()
 {
     int res;
     Metadata base;
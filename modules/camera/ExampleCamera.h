@@ -33,8 +33,10 @@ class ExampleCamera : public Camera {
     private:
         // Initialize static camera characteristics for individual device
         camera_metadata_t *initStaticInfo();
-        // Initialize whole device (templates/etc) when opened
+        // Initialize whole device when opened
         int initDevice();
+        // Initialize all templates, on first query
+        int initTemplates();
         // Initialize each template metadata controls
         int setPreviewTemplate(Metadata m);
         int setStillTemplate(Metadata m);
@@ -0,0 +1,369 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <hardware/camera3.h>
+#include <hardware/gralloc.h>
+#include <system/camera_metadata.h>
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "FrameProcessor"
+#include <cutils/log.h>
+
+#define ATRACE_TAG (ATRACE_TAG_CAMERA | ATRACE_TAG_HAL)
+#include <utils/Trace.h>
+
+#include "FrameProcessor.h"
+
+namespace default_camera_hal {
+
+// JPEG settings used when the request has none
+static const int kDefaultJpegQuality = 90;
+// Images smaller than this many lines are not worth splitting in bands
+static const uint32_t kMinBandedLines = 64;
+
+// A scale() or paint() call, run in bands of lines by each part
+struct BandWork {
+    const YuvImage *src;
+    const YuvImage *dst;
+    uint32_t offset;
+};
+
+// Even lines [*first, *first + *lines) of the band of part
+static void getBand(const YuvImage *dst, int part, int parts, uint32_t *first,
+        uint32_t *lines)
+{
+    uint32_t per_part = ((dst->height + parts - 1) / parts + 1) & ~1;
+
+    *first = part * per_part;
+    *lines = per_part;
+}
+
+extern "C" {
+static void scale_band(void *arg, int part, int parts)
+{
+    BandWork *work = static_cast<BandWork*>(arg);
+    uint32_t first, lines;
+
+    getBand(work->dst, part, parts, &first, &lines);
+    if (first < work->dst->height)
+        scaleYuvImage(*work->src, *work->dst, first, lines);
+}
+
+static void paint_band(void *arg, int part, int parts)
+{
+    BandWork *work = static_cast<BandWork*>(arg);
+    uint32_t first, lines;
+
+    getBand(work->dst, part, parts, &first, &lines);
+    if (first < work->dst->height)
+        paintColorBars(*work->dst, work->offset, first, lines);
+}
+} // extern "C"
+
+// Value of a single valued entry of settings, or def if absent
+static int32_t getSetting(const camera_metadata_t *settings, uint32_t tag,
+        int32_t def)
+{
+    camera_metadata_ro_entry_t entry;
+
+    if (settings == NULL ||
+            find_camera_metadata_ro_entry(settings, tag, &entry) != 0 ||
+            entry.count < 1)
+        return def;
+    if (entry.type == TYPE_BYTE)
+        return entry.data.u8[0];
+    if (entry.type == TYPE_INT32)
+        return entry.data.i32[0];
+    return def;
+}
+
+FrameProcessor::FrameProcessor()
+  : mGralloc(NULL),
+    mJpegMaxSize(0),
+    mPattern(NULL),
+    mPatternSize(0),
+    mThumbnail(NULL),
+    mThumbnailSize(0)
+{
+}
+
+FrameProcessor::~FrameProcessor()
+{
+    stop();
+    free(mPattern);
+    free(mThumbnail);
+}
+
+int FrameProcessor::start()
+{
+    int res;
+
+    if (mGralloc == NULL) {
+        res = hw_get_module(GRALLOC_HARDWARE_MODULE_ID,
+                reinterpret_cast<const hw_module_t**>(&mGralloc));
+        if (res) {
+            ALOGE("%s: Failed to load gralloc module: %d", __func__, res);
+            mGralloc = NULL;
+            return -ENODEV;
+        }
+    }
+    // One thread per CPU, the calling thread included
+    return mWorkers.start(0);
+}
+
+void FrameProcessor::stop()
+{
+    mWorkers.stop();
+}
+
+void FrameProcessor::setJpegMaxSize(size_t size)
+{
+    mJpegMaxSize = size;
+}
+
+int FrameProcessor::fill(const YuvImage &src,
+        const camera3_stream_buffer_t *buffer,
+        const camera_metadata_t *settings)
+{
+    YuvImage dst;
+    int res;
+
+    ATRACE_CALL();
+
+    if (buffer->stream->format == HAL_PIXEL_FORMAT_BLOB) {
+        android::Mutex::Autolock al(mJpegLock);
+        return encodeJpeg_L(src, buffer, settings);
+    }
+
+    res = lockYcbcr(buffer, GRALLOC_USAGE_SW_WRITE_OFTEN, &dst);
+    if (res)
+        return res;
+    scale(src, dst);
+    mGralloc->unlock(mGralloc, *buffer->buffer);
+    return 0;
+}
+
+int FrameProcessor::fillTestPattern(uint32_t frame,
+        const camera3_stream_buffer_t *buffer,
+        const camera_metadata_t *settings)
+{
+    const camera3_stream_t *stream = buffer->stream;
+    // Scroll by 4 pixels a frame
+    uint32_t offset = frame * 4;
+    YuvImage dst;
+    int res;
+
+    ATRACE_CALL();
+
+    if (stream->format == HAL_PIXEL_FORMAT_BLOB) {
+        android::Mutex::Autolock al(mJpegLock);
+        res = allocateImage(&mPattern, &mPatternSize, stream->width,
+                stream->height, &dst);
+        if (res)
+            return res;
+        paint(dst, offset);
+        return encodeJpeg_L(dst, buffer, settings);
+    }
+
+    res = lockYcbcr(buffer, GRALLOC_USAGE_SW_WRITE_OFTEN, &dst);
+    if (res)
+        return res;
+    paint(dst, offset);
+    mGralloc->unlock(mGralloc, *buffer->buffer);
+    return 0;
+}
+
+int FrameProcessor::writeJpeg(const camera3_stream_buffer_t *buffer,
+        const void *jpeg, size_t size)
+{
+    uint8_t *data;
+    int res;
+
+    ATRACE_CALL();
+
+    if (size + sizeof(camera3_jpeg_blob_t) > mJpegMaxSize) {
+        ALOGE("%s: %zu bytes JPEG larger than %zu bytes buffer", __func__,
+                size, mJpegMaxSize);
+        return -ENOSPC;
+    }
+    res = lockBlob(buffer, &data);
+    if (res)
+        return res;
+    memcpy(data, jpeg, size);
+    finishBlob(buffer, data, size);
+    return 0;
+}
+
+int FrameProcessor::lockInput(const camera3_stream_buffer_t *buffer,
+        YuvImage *image)
+{
+    return lockYcbcr(buffer, GRALLOC_USAGE_SW_READ_OFTEN, image);
+}
+
+void FrameProcessor::unlockInput(const camera3_stream_buffer_t *buffer)
+{
+    mGralloc->unlock(mGralloc, *buffer->buffer);
+}
+
+int FrameProcessor::lockYcbcr(const camera3_stream_buffer_t *buffer,
+        int usage, YuvImage *image)
+{
+    const camera3_stream_t *stream = buffer->stream;
+    struct android_ycbcr ycbcr;
+    int res;
+
+    if (mGralloc == NULL ||
+            mGralloc->common.module_api_version < GRALLOC_MODULE_API_VERSION_0_2 ||
+            mGralloc->lock_ycbcr == NULL) {
+        ALOGE("%s: Gralloc cannot lock YCbCr buffers", __func__);
+        return -ENOSYS;
+    }
+    memset(&ycbcr, 0, sizeof(ycbcr));
+    res = mGralloc->lock_ycbcr(mGralloc, *buffer->buffer, usage, 0, 0,
+            stream->width, stream->height, &ycbcr);
+    if (res) {
+        ALOGE("%s: Failed to lock buffer: %d", __func__, res);
+        return res;
+    }
+    initYuvImage(image, &ycbcr, stream->width, stream->height);
+    return 0;
+}
+
+int FrameProcessor::lockBlob(const camera3_stream_buffer_t *buffer,
+        uint8_t **data)
+{
+    void *vaddr;
+    int res;
+
+    if (mGralloc == NULL || mJpegMaxSize <= sizeof(camera3_jpeg_blob_t)) {
+        ALOGE("%s: No BLOB buffer size", __func__);
+        return -EINVAL;
+    }
+    // BLOB buffers are android.jpeg.maxSize bytes wide, one pixel high
+    res = mGralloc->lock(mGralloc, *buffer->buffer,
+            GRALLOC_USAGE_SW_WRITE_OFTEN, 0, 0, mJpegMaxSize, 1, &vaddr);
+    if (res) {
+        ALOGE("%s: Failed to lock BLOB buffer: %d", __func__, res);
+        return res;
+    }
+    *data = static_cast<uint8_t*>(vaddr);
+    return 0;
+}
+
+void FrameProcessor::finishBlob(const camera3_stream_buffer_t *buffer,
+        uint8_t *data, size_t size)
+{
+    camera3_jpeg_blob_t blob;
+
+    blob.jpeg_blob_id = CAMERA3_JPEG_BLOB_ID;
+    blob.jpeg_size = size;
+    memcpy(data + mJpegMaxSize - sizeof(blob), &blob, sizeof(blob));
+    mGralloc->unlock(mGralloc, *buffer->buffer);
+}
+
+int FrameProcessor::encodeJpeg_L(const YuvImage &src,
+        const camera3_stream_buffer_t *buffer,
+        const camera_metadata_t *settings)
+{
+    const camera3_stream_t *stream = buffer->stream;
+    int quality = getSetting(settings, ANDROID_JPEG_QUALITY,
+            kDefaultJpegQuality);
+    int thumbnail_quality = getSetting(settings,
+            ANDROID_JPEG_THUMBNAIL_QUALITY, kDefaultJpegQuality);
+    int orientation = getSetting(settings, ANDROID_JPEG_ORIENTATION, 0);
+    camera_metadata_ro_entry_t entry;
+    YuvImage image = src;
+    YuvImage thumbnail;
+    bool has_thumbnail = false;
+    uint8_t *data;
+    int res;
+
+    // Encode at the size of the stream. Test patterns are painted at that
+    // size already, src is never mPattern here.
+    if (src.width != stream->width || src.height != stream->height) {
+        res = allocateImage(&mPattern, &mPatternSize, stream->width,
+                stream->height, &image);
+        if (res)
+            return res;
+        scale(src, image);
+    }
+    if (settings != NULL && find_camera_metadata_ro_entry(settings,
+                ANDROID_JPEG_THUMBNAIL_SIZE, &entry) == 0 &&
+            entry.count == 2 && entry.data.i32[0] > 0 &&
+            entry.data.i32[1] > 0) {
+        has_thumbnail = allocateImage(&mThumbnail, &mThumbnailSize,
+                entry.data.i32[0], entry.data.i32[1], &thumbnail) == 0;
+        if (has_thumbnail)
+            scale(image, thumbnail);
+    }
+
+    res = lockBlob(buffer, &data);
+    if (res)
+        return res;
+    res = mEncoder.encode(image, quality, has_thumbnail ? &thumbnail : NULL,
+            thumbnail_quality, orientation, data,
+            mJpegMaxSize - sizeof(camera3_jpeg_blob_t));
+    if (res < 0) {
+        mGralloc->unlock(mGralloc, *buffer->buffer);
+        return res;
+    }
+    finishBlob(buffer, data, res);
+    return 0;
+}
+
+void FrameProcessor::scale(const YuvImage &src, const YuvImage &dst)
+{
+    BandWork work = { &src, &dst, 0 };
+
+    ATRACE_CALL();
+    if (dst.height < kMinBandedLines)
+        scale_band(&work, 0, 1);
+    else
+        mWorkers.run(scale_band, &work);
+}
+
+void FrameProcessor::paint(const YuvImage &dst, uint32_t offset)
+{
+    BandWork work = { NULL, &dst, offset };
+
+    ATRACE_CALL();
+    if (dst.height < kMinBandedLines)
+        paint_band(&work, 0, 1);
+    else
+        mWorkers.run(paint_band, &work);
+}
+
+int FrameProcessor::allocateImage(uint8_t **buffer, size_t *size,
+        uint32_t width, uint32_t height, YuvImage *image)
+{
+    size_t needed = yuvImageSize(width, height);
+
+    // Scratch images only grow, so steady state capture does not allocate
+    if (needed > *size) {
+        uint8_t *data = static_cast<uint8_t*>(realloc(*buffer, needed));
+        if (data == NULL)
+            return -ENOMEM;
+        *buffer = data;
+        *size = needed;
+    }
+    initYuvImage(image, *buffer, width, height);
+    return 0;
+}
+
+} // namespace default_camera_hal
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FRAME_PROCESSOR_H_
+#define FRAME_PROCESSOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <hardware/camera3.h>
+#include <hardware/gralloc.h>
+#include <system/camera_metadata.h>
+#include <utils/Mutex.h>
+#include "JpegEncoder.h"
+#include "WorkerPool.h"
+#include "YuvImage.h"
+
+namespace default_camera_hal {
+// FrameProcessor is the software stage filling output buffers from a source
+// frame: YUV outputs are scaled and converted from it, BLOB outputs are JPEG
+// encoded with the JPEG settings of their request. Lines are processed in
+// bands on a worker pool. Different buffers may be filled concurrently,
+// JPEG encodes are serialized.
+class FrameProcessor {
+    public:
+        FrameProcessor();
+        ~FrameProcessor();
+
+        // Load gralloc and start the worker pool
+        int start();
+        void stop();
+        // Size of BLOB buffers, android.jpeg.maxSize
+        void setJpegMaxSize(size_t size);
+
+        // Fill an output buffer from src
+        int fill(const YuvImage &src, const camera3_stream_buffer_t *buffer,
+                const camera_metadata_t *settings);
+        // Fill an output buffer with colour bars, scrolling with frame
+        int fillTestPattern(uint32_t frame,
+                const camera3_stream_buffer_t *buffer,
+                const camera_metadata_t *settings);
+        // Copy a JPEG produced elsewhere into a BLOB output buffer
+        int writeJpeg(const camera3_stream_buffer_t *buffer, const void *jpeg,
+                size_t size);
+        // Lock an input buffer to read it as source, and unlock it
+        int lockInput(const camera3_stream_buffer_t *buffer, YuvImage *image);
+        void unlockInput(const camera3_stream_buffer_t *buffer);
+
+    private:
+        FrameProcessor(const FrameProcessor&);
+        FrameProcessor& operator=(const FrameProcessor&);
+
+        // Lock a YUV buffer for software access of usage GRALLOC_USAGE_SW_*
+        int lockYcbcr(const camera3_stream_buffer_t *buffer, int usage,
+                YuvImage *image);
+        // Lock a BLOB buffer, mJpegMaxSize bytes
+        int lockBlob(const camera3_stream_buffer_t *buffer, uint8_t **data);
+        // Write the transport header at the end of a locked BLOB buffer
+        void finishBlob(const camera3_stream_buffer_t *buffer, uint8_t *data,
+                size_t size);
+        // Encode src into a BLOB output buffer, mJpegLock held
+        int encodeJpeg_L(const YuvImage &src,
+                const camera3_stream_buffer_t *buffer,
+                const camera_metadata_t *settings);
+        // Scale src into dst, in bands on the worker pool
+        void scale(const YuvImage &src, const YuvImage &dst);
+        // Paint colour bars into dst, in bands on the worker pool
+        void paint(const YuvImage &dst, uint32_t offset);
+        // Make a scratch planar image of width x height out of *buffer
+        int allocateImage(uint8_t **buffer, size_t *size, uint32_t width,
+                uint32_t height, YuvImage *image);
+
+        // Gralloc module, used to lock buffers for software access
+        const gralloc_module_t *mGralloc;
+        // Threads running the bands of scale() and paint()
+        WorkerPool mWorkers;
+        JpegEncoder mEncoder;
+        // Lock protecting mEncoder, mPattern and mThumbnail
+        android::Mutex mJpegLock;
+        // Size of BLOB buffers
+        size_t mJpegMaxSize;
+        // Test pattern frame encoded into BLOB buffers
+        uint8_t *mPattern;
+        size_t mPatternSize;
+        // Thumbnail scaled from the frame encoded into BLOB buffers
+        uint8_t *mThumbnail;
+        size_t mThumbnailSize;
+};
+} // namespace default_camera_hal
+
+#endif // FRAME_PROCESSOR_H_
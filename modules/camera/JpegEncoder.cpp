@@ -0,0 +1,328 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern "C" {
+#include <jpeglib.h>
+}
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "JpegEncoder"
+#include <cutils/log.h>
+
+#define ATRACE_TAG (ATRACE_TAG_CAMERA | ATRACE_TAG_HAL)
+#include <utils/Trace.h>
+
+#include "JpegEncoder.h"
+
+namespace default_camera_hal {
+
+// Largest payload of a JPEG marker segment
+static const size_t kMaxApp1Size = 65533;
+// EXIF header, TIFF header, IFD0 with one entry and IFD1 with three
+static const size_t kExifHeaderSize = 6 + 8 + (2 + 12 + 4) + (2 + 36 + 4);
+// Lines of an MCU row: 4:2:0 MCUs are 16x16 pixels
+static const uint32_t kMcuLines = 2 * DCTSIZE;
+
+// Error manager returning to compress() instead of exiting
+struct JpegError {
+    struct jpeg_error_mgr mgr;
+    jmp_buf env;
+};
+
+// Destination manager writing into a fixed buffer, data past its end is
+// dropped and flagged
+struct JpegDestination {
+    struct jpeg_destination_mgr mgr;
+    bool overflow;
+    JOCTET spill[512];
+};
+
+extern "C" {
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    char msg[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message)(cinfo, msg);
+    ALOGE("%s: %s", __func__, msg);
+    longjmp(reinterpret_cast<JpegError*>(cinfo->err)->env, 1);
+}
+
+static void jpeg_output_message(j_common_ptr /*cinfo*/)
+{
+}
+
+static void jpeg_init_destination(j_compress_ptr /*cinfo*/)
+{
+}
+
+static boolean jpeg_empty_output_buffer(j_compress_ptr cinfo)
+{
+    JpegDestination *dest = reinterpret_cast<JpegDestination*>(cinfo->dest);
+
+    dest->overflow = true;
+    dest->mgr.next_output_byte = dest->spill;
+    dest->mgr.free_in_buffer = sizeof(dest->spill);
+    return TRUE;
+}
+
+static void jpeg_term_destination(j_compress_ptr /*cinfo*/)
+{
+}
+} // extern "C"
+
+static uint8_t *put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v)
+{
+    p = put16(p, v & 0xffff);
+    return put16(p, v >> 16);
+}
+
+// Little endian TIFF IFD entry of a single SHORT or LONG value
+static uint8_t *putEntry(uint8_t *p, uint16_t tag, uint16_t type, uint32_t v)
+{
+    p = put16(p, tag);
+    p = put16(p, type);
+    p = put32(p, 1);
+    // SHORT values are left justified in the value field
+    if (type == 3)
+        return put16(put16(p, v), 0);
+    return put32(p, v);
+}
+
+JpegEncoder::JpegEncoder()
+  : mLines(NULL),
+    mLinesSize(0),
+    mExif(NULL),
+    mThumbnail(NULL)
+{
+}
+
+JpegEncoder::~JpegEncoder()
+{
+    free(mLines);
+    free(mExif);
+}
+
+int JpegEncoder::encode(const YuvImage &src, int quality,
+        const YuvImage *thumbnail, int thumbnail_quality, int orientation,
+        uint8_t *dst, size_t capacity)
+{
+    size_t exif_size = 0;
+
+    ATRACE_CALL();
+
+    if (thumbnail != NULL) {
+        if (mExif == NULL)
+            mExif = static_cast<uint8_t*>(malloc(kMaxApp1Size));
+        if (mExif == NULL)
+            return -ENOMEM;
+        mThumbnail = mExif + kExifHeaderSize;
+        int res = compress(*thumbnail, thumbnail_quality, NULL, 0, mThumbnail,
+                kMaxApp1Size - kExifHeaderSize);
+        if (res < 0) {
+            // The image is still valid without its thumbnail
+            ALOGW("%s: %dx%d thumbnail does not fit in EXIF", __func__,
+                    thumbnail->width, thumbnail->height);
+        } else {
+            exif_size = buildExif(res, orientation);
+        }
+    }
+    return compress(src, quality, exif_size ? mExif : NULL, exif_size, dst,
+            capacity);
+}
+
+size_t JpegEncoder::buildExif(size_t thumbnail_size, int orientation)
+{
+    // TIFF offsets are from the TIFF header, after "Exif\0\0"
+    static const uint32_t kIfd0 = 8;
+    static const uint32_t kIfd1 = kIfd0 + 2 + 12 + 4;
+    static const uint32_t kThumbnail = kExifHeaderSize - 6;
+    uint16_t exif_orientation;
+    uint8_t *p = mExif;
+
+    switch (orientation) {
+    case 90:
+        exif_orientation = 6;
+        break;
+    case 180:
+        exif_orientation = 3;
+        break;
+    case 270:
+        exif_orientation = 8;
+        break;
+    default:
+        exif_orientation = 1;
+        break;
+    }
+
+    memcpy(p, "Exif\0\0", 6);
+    p += 6;
+    memcpy(p, "II", 2);
+    p = put16(p + 2, 42);
+    p = put32(p, kIfd0);
+    // IFD0: orientation
+    p = put16(p, 1);
+    p = putEntry(p, 0x0112, 3, exif_orientation);
+    p = put32(p, kIfd1);
+    // IFD1: JPEG compressed thumbnail, its offset and size
+    p = put16(p, 3);
+    p = putEntry(p, 0x0103, 3, 6);
+    p = putEntry(p, 0x0201, 4, kThumbnail);
+    p = putEntry(p, 0x0202, 4, thumbnail_size);
+    p = put32(p, 0);
+    return kExifHeaderSize + thumbnail_size;
+}
+
+int JpegEncoder::compress(const YuvImage &src, int quality,
+        const uint8_t *app1, size_t app1_size, uint8_t *dst, size_t capacity)
+{
+    struct jpeg_compress_struct cinfo;
+    JpegError err;
+    JpegDestination dest;
+    JSAMPROW y_lines[kMcuLines];
+    JSAMPROW cb_lines[kMcuLines / 2];
+    JSAMPROW cr_lines[kMcuLines / 2];
+    JSAMPARRAY planes[3] = { y_lines, cb_lines, cr_lines };
+    uint32_t width = (src.width + kMcuLines - 1) & ~(kMcuLines - 1);
+    uint32_t chroma_width = width / 2;
+    size_t size = (size_t)width * kMcuLines * 3 / 2;
+
+    if (src.width == 0 || src.height == 0)
+        return -EINVAL;
+    if (size > mLinesSize) {
+        uint8_t *lines = static_cast<uint8_t*>(realloc(mLines, size));
+        if (lines == NULL)
+            return -ENOMEM;
+        mLines = lines;
+        mLinesSize = size;
+    }
+    // Planar staging lines, as laid out by initYuvImage()
+    YuvImage lines;
+    lines.y = mLines;
+    lines.cb = mLines + width * kMcuLines;
+    lines.cr = lines.cb + chroma_width * kMcuLines / 2;
+    lines.width = src.width;
+    lines.yStride = width;
+    lines.yStep = 1;
+    lines.cStride = chroma_width;
+    lines.chromaStep = 1;
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpeg_error_exit;
+    err.mgr.output_message = jpeg_output_message;
+    if (setjmp(err.env)) {
+        jpeg_destroy_compress(&cinfo);
+        return -EINVAL;
+    }
+    jpeg_create_compress(&cinfo);
+
+    dest.mgr.next_output_byte = dst;
+    dest.mgr.free_in_buffer = capacity;
+    dest.mgr.init_destination = jpeg_init_destination;
+    dest.mgr.empty_output_buffer = jpeg_empty_output_buffer;
+    dest.mgr.term_destination = jpeg_term_destination;
+    dest.overflow = false;
+    cinfo.dest = &dest.mgr;
+
+    cinfo.image_width = src.width;
+    cinfo.image_height = src.height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+    cinfo.do_fancy_downsampling = FALSE;
+#endif
+    cinfo.dct_method = JDCT_IFAST;
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = 2;
+    cinfo.comp_info[1].h_samp_factor = 1;
+    cinfo.comp_info[1].v_samp_factor = 1;
+    cinfo.comp_info[2].h_samp_factor = 1;
+    cinfo.comp_info[2].v_samp_factor = 1;
+    // EXIF files do not carry a JFIF segment
+    if (app1 != NULL)
+        cinfo.write_JFIF_header = FALSE;
+
+    jpeg_start_compress(&cinfo, TRUE);
+    if (app1 != NULL)
+        jpeg_write_marker(&cinfo, JPEG_APP0 + 1, app1, app1_size);
+
+    for (uint32_t first = 0; first < src.height; first += kMcuLines) {
+        uint32_t n = src.height - first < kMcuLines ? src.height - first :
+                kMcuLines;
+        uint32_t chroma_n = (n + 1) / 2;
+
+        // Stage an MCU row of src, unscaled lines are copied with vectors
+        YuvImage band = src;
+        band.y += first * src.yStride;
+        band.cb += first / 2 * src.cStride;
+        band.cr += first / 2 * src.cStride;
+        band.height = n;
+        lines.height = n;
+        scaleYuvImage(band, lines, 0, n);
+
+        // Lines past the bottom of the image repeat its last line
+        for (uint32_t i = 0; i < kMcuLines; i++) {
+            uint32_t line = i < n ? i : n - 1;
+            y_lines[i] = lines.y + line * width;
+        }
+        for (uint32_t i = 0; i < kMcuLines / 2; i++) {
+            uint32_t line = i < chroma_n ? i : chroma_n - 1;
+            cb_lines[i] = lines.cb + line * chroma_width;
+            cr_lines[i] = lines.cr + line * chroma_width;
+        }
+        // Pad the staged lines by repeating their last pixel
+        if (width != src.width) {
+            uint32_t cw = (src.width + 1) / 2;
+            for (uint32_t i = 0; i < n; i++)
+                memset(lines.y + i * width + src.width,
+                        lines.y[i * width + src.width - 1], width - src.width);
+            for (uint32_t i = 0; i < chroma_n; i++) {
+                memset(lines.cb + i * chroma_width + cw,
+                        lines.cb[i * chroma_width + cw - 1], chroma_width - cw);
+                memset(lines.cr + i * chroma_width + cw,
+                        lines.cr[i * chroma_width + cw - 1], chroma_width - cw);
+            }
+        }
+        jpeg_write_raw_data(&cinfo, planes, kMcuLines);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    size = capacity - dest.mgr.free_in_buffer;
+    jpeg_destroy_compress(&cinfo);
+    if (dest.overflow) {
+        ALOGE("%s: %dx%d JPEG larger than %zu bytes", __func__, src.width,
+                src.height, capacity);
+        return -ENOSPC;
+    }
+    return size;
+}
+
+} // namespace default_camera_hal
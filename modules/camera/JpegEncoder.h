@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef JPEG_ENCODER_H_
+#define JPEG_ENCODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "YuvImage.h"
+
+namespace default_camera_hal {
+// JpegEncoder compresses YuvImages with libjpeg, fed with raw 4:2:0 lines so
+// that libjpeg does no colour conversion nor downsampling of its own. The
+// lines are staged in buffers kept across frames.
+class JpegEncoder {
+    public:
+        JpegEncoder();
+        ~JpegEncoder();
+
+        // Encode src at quality (1-100) into dst. If thumbnail is not NULL,
+        // it is encoded at thumbnail_quality and embedded in an EXIF segment,
+        // along with the orientation of the image in degrees. Returns the
+        // size of the JPEG, or a negative error if it does not fit.
+        int encode(const YuvImage &src, int quality, const YuvImage *thumbnail,
+                int thumbnail_quality, int orientation, uint8_t *dst,
+                size_t capacity);
+
+    private:
+        JpegEncoder(const JpegEncoder&);
+        JpegEncoder& operator=(const JpegEncoder&);
+
+        // Compress src into dst, with an APP1 segment if app1 is not NULL
+        int compress(const YuvImage &src, int quality, const uint8_t *app1,
+                size_t app1_size, uint8_t *dst, size_t capacity);
+        // Build the EXIF segment around the thumbnail in mThumbnail
+        size_t buildExif(size_t thumbnail_size, int orientation);
+
+        // Planar lines of one MCU row, padded to whole MCUs
+        uint8_t *mLines;
+        size_t mLinesSize;
+        // EXIF APP1 segment, the encoded thumbnail at its end
+        uint8_t *mExif;
+        uint8_t *mThumbnail;
+};
+} // namespace default_camera_hal
+
+#endif // JPEG_ENCODER_H_
@@ -28,10 +28,36 @@
 namespace default_camera_hal {
 
 Metadata::Metadata():
-    mData(NULL)
+    mData(NULL),
+    mIndex(NULL),
+    mIndexSize(0)
 {
 }
 
+Metadata::Metadata(size_t entry_capacity, size_t data_capacity):
+    mData(NULL),
+    mIndex(NULL),
+    mIndexSize(0)
+{
+    replace(allocate_camera_metadata(entry_capacity, data_capacity));
+}
+
+Metadata::Metadata(const Metadata &other):
+    mData(NULL),
+    mIndex(NULL),
+    mIndexSize(0)
+{
+    if (other.mData != NULL)
+        replace(clone_camera_metadata(other.mData));
+}
+
+Metadata &Metadata::operator=(const Metadata &other)
+{
+    if (this != &other)
+        replace(other.mData != NULL ? clone_camera_metadata(other.mData) : NULL);
+    return *this;
+}
+
 Metadata::~Metadata()
 {
     replace(NULL);
@@ -39,13 +65,62 @@ Metadata::~Metadata()
 
 void Metadata::replace(camera_metadata_t *m)
 {
-    if (m == mData) {
+    if (m != NULL && m == mData) {
         ALOGE("%s: Replacing metadata with itself?!", __func__);
         return;
     }
     if (mData)
         free_camera_metadata(mData);
     mData = m;
+    buildIndex();
+}
+
+void Metadata::buildIndex()
+{
+    size_t capacity;
+    size_t count;
+    size_t size = 16;
+
+    if (mData == NULL) {
+        delete [] mIndex;
+        mIndex = NULL;
+        mIndexSize = 0;
+        return;
+    }
+    capacity = get_camera_metadata_entry_capacity(mData);
+    count = get_camera_metadata_entry_count(mData);
+
+    // Keep the table at most half full
+    while (size < capacity * 2)
+        size *= 2;
+    if (size != mIndexSize) {
+        delete [] mIndex;
+        mIndex = new IndexSlot[size];
+        mIndexSize = size;
+    }
+    for (size_t i = 0; i < mIndexSize; i++)
+        mIndex[i].entry = -1;
+
+    for (size_t i = 0; i < count; i++) {
+        camera_metadata_ro_entry_t entry;
+        get_camera_metadata_ro_entry(mData, i, &entry);
+        IndexSlot *slot = lookup(entry.tag);
+        // As find_camera_metadata_entry, the first entry of a tag wins
+        if (slot->entry == -1) {
+            slot->tag = entry.tag;
+            slot->entry = i;
+        }
+    }
+}
+
+Metadata::IndexSlot* Metadata::lookup(uint32_t tag)
+{
+    // Tags are dense within a section, mix in the section bits
+    size_t i = ((tag ^ (tag >> 16)) * 2654435761u) & (mIndexSize - 1);
+
+    while (mIndex[i].entry != -1 && mIndex[i].tag != tag)
+        i = (i + 1) & (mIndexSize - 1);
+    return &mIndex[i];
 }
 
 int Metadata::init(const camera_metadata_t *metadata)
@@ -63,10 +138,51 @@ int Metadata::init(const camera_metadata_t *metadata)
     return 0;
 }
 
+int Metadata::reserve(size_t entry_count, size_t data_count)
+{
+    size_t entries = entry_count;
+    size_t data = data_count;
+
+    if (mData != NULL) {
+        entries += get_camera_metadata_entry_count(mData);
+        data += get_camera_metadata_data_count(mData);
+        if (entries <= get_camera_metadata_entry_capacity(mData) &&
+                data <= get_camera_metadata_data_capacity(mData))
+            return 0;
+    }
+    return resize(entries, data);
+}
+
+int Metadata::resize(size_t entry_capacity, size_t data_capacity)
+{
+    int res;
+    camera_metadata_t* tmp;
+
+    tmp = allocate_camera_metadata(entry_capacity, data_capacity);
+    if (tmp == NULL) {
+        ALOGE("%s: Failed to allocate new metadata with %zu entries, %zu data",
+                __func__, entry_capacity, data_capacity);
+        return -ENOMEM;
+    }
+    // Append the current metadata to the new (empty) metadata. Entries keep
+    // their order, the index stays valid.
+    if (mData != NULL) {
+        res = append_camera_metadata(tmp, mData);
+        if (res) {
+            ALOGE("%s: Failed to append old metadata %p to new %p",
+                    __func__, mData, tmp);
+            free_camera_metadata(tmp);
+            return res;
+        }
+    }
+    replace(tmp);
+    return 0;
+}
+
 int Metadata::addUInt8(uint32_t tag, int count, const uint8_t *data)
 {
     if (!validate(tag, TYPE_BYTE, count)) return -EINVAL;
-    return add(tag, count, data);
+    return add(tag, TYPE_BYTE, count, data);
 }
 
 int Metadata::add1UInt8(uint32_t tag, const uint8_t data)
@@ -77,37 +193,40 @@ int Metadata::add1UInt8(uint32_t tag, const uint8_t data)
 int Metadata::addInt32(uint32_t tag, int count, const int32_t *data)
 {
     if (!validate(tag, TYPE_INT32, count)) return -EINVAL;
-    return add(tag, count, data);
+    return add(tag, TYPE_INT32, count, data);
 }
 
 int Metadata::addFloat(uint32_t tag, int count, const float *data)
 {
     if (!validate(tag, TYPE_FLOAT, count)) return -EINVAL;
-    return add(tag, count, data);
+    return add(tag, TYPE_FLOAT, count, data);
 }
 
 int Metadata::addInt64(uint32_t tag, int count, const int64_t *data)
 {
     if (!validate(tag, TYPE_INT64, count)) return -EINVAL;
-    return add(tag, count, data);
+    return add(tag, TYPE_INT64, count, data);
 }
 
 int Metadata::addDouble(uint32_t tag, int count, const double *data)
 {
     if (!validate(tag, TYPE_DOUBLE, count)) return -EINVAL;
-    return add(tag, count, data);
+    return add(tag, TYPE_DOUBLE, count, data);
 }
 
 int Metadata::addRational(uint32_t tag, int count,
         const camera_metadata_rational_t *data)
 {
     if (!validate(tag, TYPE_RATIONAL, count)) return -EINVAL;
-    return add(tag, count, data);
+    return add(tag, TYPE_RATIONAL, count, data);
 }
 
 bool Metadata::validate(uint32_t tag, int tag_type, int count)
 {
-    if (get_camera_metadata_tag_type(tag) < 0) {
+    // Vendor tags are resolved through the vendor tag ops, look up only once
+    int actual_type = get_camera_metadata_tag_type(tag);
+
+    if (actual_type < 0) {
         ALOGE("%s: Invalid metadata entry tag: %d", __func__, tag);
         return false;
     }
@@ -115,7 +234,7 @@ bool Metadata::validate(uint32_t tag, int tag_type, int count)
         ALOGE("%s: Invalid metadata entry tag type: %d", __func__, tag_type);
         return false;
     }
-    if (tag_type != get_camera_metadata_tag_type(tag)) {
+    if (tag_type != actual_type) {
         ALOGE("%s: Tag %d called with incorrect type: %s(%d)", __func__, tag,
                 camera_metadata_type_names[tag_type], tag_type);
         return false;
@@ -127,45 +246,74 @@ bool Metadata::validate(uint32_t tag, int tag_type, int count)
     return true;
 }
 
-int Metadata::add(uint32_t tag, int count, const void *tag_data)
+int Metadata::add(uint32_t tag, int tag_type, int count,
+        const void *tag_data)
 {
     int res;
-    camera_metadata_t* tmp;
-    int tag_type = get_camera_metadata_tag_type(tag);
     size_t size = calculate_camera_metadata_entry_data_size(tag_type, count);
-    size_t entry_capacity = get_camera_metadata_entry_count(mData) + 1;
-    size_t data_capacity = get_camera_metadata_data_count(mData) + size;
-
-    // Opportunistically attempt to add if metadata has room for it
-    if (!add_camera_metadata_entry(mData, tag, tag_data, count))
-        return 0;
+    size_t entry_count = mData ? get_camera_metadata_entry_count(mData) : 0;
+    size_t data_count = mData ? get_camera_metadata_data_count(mData) : 0;
+    IndexSlot *slot;
 
     // Double new dimensions to minimize future reallocations
-    tmp = allocate_camera_metadata(entry_capacity * 2, data_capacity * 2);
-    if (tmp == NULL) {
-        ALOGE("%s: Failed to allocate new metadata with %zu entries, %zu data",
-                __func__, entry_capacity, data_capacity);
-        return -ENOMEM;
-    }
-    // Append the current metadata to the new (empty) metadata
-    res = append_camera_metadata(tmp, mData);
-    if (res) {
-        ALOGE("%s: Failed to append old metadata %p to new %p",
-                __func__, mData, tmp);
-        return res;
+    if (mData == NULL ||
+            entry_count + 1 > get_camera_metadata_entry_capacity(mData) ||
+            data_count + size > get_camera_metadata_data_capacity(mData)) {
+        res = resize((entry_count + 1) * 2, (data_count + size) * 2);
+        if (res)
+            return res;
     }
-    // Add the remaining new item
-    res = add_camera_metadata_entry(tmp, tag, tag_data, count);
+
+    res = add_camera_metadata_entry(mData, tag, tag_data, count);
     if (res) {
         ALOGE("%s: Failed to add new entry (%d, %p, %d) to metadata %p",
-                __func__, tag, tag_data, count, tmp);
+                __func__, tag, tag_data, count, mData);
         return res;
     }
 
-    replace(tmp);
+    slot = lookup(tag);
+    if (slot->entry == -1) {
+        slot->tag = tag;
+        slot->entry = entry_count;
+    }
     return 0;
 }
 
+int Metadata::find(uint32_t tag, camera_metadata_ro_entry_t *entry)
+{
+    if (mData == NULL)
+        return -ENOENT;
+
+    IndexSlot *slot = lookup(tag);
+    if (slot->entry == -1)
+        return -ENOENT;
+    return get_camera_metadata_ro_entry(mData, slot->entry, entry);
+}
+
+int Metadata::update(uint32_t tag, int count, const void *data)
+{
+    int res;
+    int tag_type = get_camera_metadata_tag_type(tag);
+
+    if (!validate(tag, tag_type, count)) return -EINVAL;
+    if (mData == NULL || lookup(tag)->entry == -1)
+        return add(tag, tag_type, count, data);
+
+    size_t index = lookup(tag)->entry;
+    res = update_camera_metadata_entry(mData, index, data, count, NULL);
+    if (res) {
+        // Out of data space, the old data is not reclaimed when growing
+        size_t size = calculate_camera_metadata_entry_data_size(tag_type,
+                count);
+        res = resize(get_camera_metadata_entry_capacity(mData),
+                (get_camera_metadata_data_count(mData) + size) * 2);
+        if (res)
+            return res;
+        res = update_camera_metadata_entry(mData, index, data, count, NULL);
+    }
+    return res;
+}
+
 camera_metadata_t* Metadata::get()
 {
     return mData;
@@ -26,9 +26,16 @@ namespace default_camera_hal {
 class Metadata {
     public:
         Metadata();
+        // Preallocate room for a known number of entries and bytes of data
+        Metadata(size_t entry_capacity, size_t data_capacity);
+        Metadata(const Metadata &other);
+        Metadata &operator=(const Metadata &other);
         ~Metadata();
         // Initialize with framework metadata
         int init(const camera_metadata_t *metadata);
+        // Make room for a batch of entry_count more entries holding
+        // data_count more bytes of data, so adding them does not reallocate
+        int reserve(size_t entry_count, size_t data_count);
 
         // Parse and add an entry. Allocates and copies new storage for *data.
         int addUInt8(uint32_t tag, int count, const uint8_t *data);
@@ -40,19 +47,42 @@ class Metadata {
         int addRational(uint32_t tag, int count,
                 const camera_metadata_rational_t *data);
 
+        // Find the entry of a tag, in constant time. Returns -ENOENT if the
+        // tag is not present.
+        int find(uint32_t tag, camera_metadata_ro_entry_t *entry);
+        // Replace the data of an entry, or add it if the tag is not present.
+        // data must be of the type of the tag.
+        int update(uint32_t tag, int count, const void *data);
+
         // Get a handle to the current metadata
         // This is not a durable handle, and may be destroyed by add*/init
         camera_metadata_t* get();
 
     private:
+        // Slot of the tag index, entry is -1 if the slot is empty
+        struct IndexSlot {
+            uint32_t tag;
+            int32_t entry;
+        };
+
         // Actual internal storage
         camera_metadata_t* mData;
+        // Open addressing hash table from tags to entry indices of mData
+        IndexSlot* mIndex;
+        // Number of slots of mIndex, a power of two
+        size_t mIndexSize;
         // Destroy old metadata and replace with new
         void replace(camera_metadata_t *m);
+        // Copy the metadata into new storage with the given capacities
+        int resize(size_t entry_capacity, size_t data_capacity);
+        // Rebuild mIndex for all entries of mData
+        void buildIndex();
+        // Slot holding tag, or the empty slot it would be inserted in
+        IndexSlot* lookup(uint32_t tag);
         // Validate the tag, type and count for a metadata entry
         bool validate(uint32_t tag, int tag_type, int count);
-        // Add a verified tag with data
-        int add(uint32_t tag, int count, const void *tag_data);
+        // Add a verified tag of tag_type with data
+        int add(uint32_t tag, int tag_type, int count, const void *tag_data);
 };
 } // namespace default_camera_hal
 
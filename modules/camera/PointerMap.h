@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POINTER_MAP_H_
+#define POINTER_MAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace default_camera_hal {
+// PointerMap is a hash table keyed by pointers, such as framework stream and
+// buffer handles, for constant time lookups on the capture path. It is left
+// to its owner to lock.
+template <typename T>
+class PointerMap {
+    public:
+        PointerMap() : mSlots(NULL), mNumSlots(0), mSize(0) {}
+        ~PointerMap() { delete [] mSlots; }
+
+        // Drop all entries, with room for count entries without growing
+        void reset(size_t count);
+        // Map key to value, replacing any previous value. key must not be NULL
+        void put(const void *key, const T &value);
+        // Copy the value of key to value, return false if key is absent
+        bool get(const void *key, T *value) const;
+        // Number of entries
+        size_t size() const { return mSize; }
+
+    private:
+        PointerMap(const PointerMap&);
+        PointerMap& operator=(const PointerMap&);
+
+        struct Slot {
+            const void *key;
+            T value;
+        };
+        // Slot holding key, or the empty slot it would be inserted in
+        Slot* lookup(const void *key) const;
+
+        // Open addressing table, at most half full, NULL keys are empty
+        Slot *mSlots;
+        // Number of slots of mSlots, a power of two
+        size_t mNumSlots;
+        // Number of entries
+        size_t mSize;
+};
+
+template <typename T>
+void PointerMap<T>::reset(size_t count)
+{
+    size_t slots = 8;
+
+    while (slots < count * 2)
+        slots *= 2;
+    if (slots != mNumSlots) {
+        delete [] mSlots;
+        mSlots = new Slot[slots];
+        mNumSlots = slots;
+    }
+    for (size_t i = 0; i < mNumSlots; i++)
+        mSlots[i].key = NULL;
+    mSize = 0;
+}
+
+template <typename T>
+void PointerMap<T>::put(const void *key, const T &value)
+{
+    if (mSlots == NULL || (mSize + 1) * 2 > mNumSlots) {
+        // Rehash into a table twice as large
+        Slot *old = mSlots;
+        size_t num_old = mNumSlots;
+        mSlots = NULL;
+        mNumSlots = 0;
+        reset(mSize * 2 + 1);
+        for (size_t i = 0; i < num_old; i++) {
+            if (old[i].key != NULL)
+                put(old[i].key, old[i].value);
+        }
+        delete [] old;
+    }
+    Slot *slot = lookup(key);
+    if (slot->key == NULL)
+        mSize++;
+    slot->key = key;
+    slot->value = value;
+}
+
+template <typename T>
+bool PointerMap<T>::get(const void *key, T *value) const
+{
+    if (mSlots == NULL || key == NULL)
+        return false;
+    Slot *slot = lookup(key);
+    if (slot->key == NULL)
+        return false;
+    *value = slot->value;
+    return true;
+}
+
+template <typename T>
+typename PointerMap<T>::Slot* PointerMap<T>::lookup(const void *key) const
+{
+    // Fibonacci hashing, the low bits of heap pointers are mostly zero
+    size_t i = (size_t)(((uint64_t)(uintptr_t)key * 0x9e3779b97f4a7c15ULL) >>
+            32) & (mNumSlots - 1);
+    while (mSlots[i].key != NULL && mSlots[i].key != key)
+        i = (i + 1) & (mNumSlots - 1);
+    return &mSlots[i];
+}
+} // namespace default_camera_hal
+
+#endif // POINTER_MAP_H_
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <cutils/atomic.h>
+#include <hardware/camera3.h>
+#include <system/camera_metadata.h>
+#include <utils/Mutex.h>
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "RequestQueue"
+#include <cutils/log.h>
+
+#include "RequestQueue.h"
+
+namespace default_camera_hal {
+
+// Result entries added to the settings: android.sensor.timestamp
+static const size_t kResultEntries = 1;
+
+void holdCaptureRequest(CaptureRequest *request)
+{
+    android_atomic_inc(&request->refs);
+}
+
+void releaseCaptureRequest(CaptureRequest *request)
+{
+    // android_atomic_dec returns the previous value
+    if (android_atomic_dec(&request->refs) == 1)
+        request->pool->put(request);
+}
+
+RequestPool::RequestPool(int capacity)
+  : mRequests(new CaptureRequest[capacity]),
+    mFree(new CaptureRequest*[capacity]),
+    mCapacity(capacity),
+    mNumFree(capacity)
+{
+    memset(mRequests, 0, sizeof(mRequests[0]) * capacity);
+    for (int i = 0; i < capacity; i++) {
+        mRequests[i].pool = this;
+        mFree[i] = &mRequests[i];
+    }
+}
+
+RequestPool::~RequestPool()
+{
+    for (int i = 0; i < mCapacity; i++) {
+        free(mRequests[i].settingsBuffer);
+        delete [] mRequests[i].outputBuffers;
+        delete [] mRequests[i].acquireFences;
+        delete [] mRequests[i].bufferResults;
+    }
+    delete [] mFree;
+    delete [] mRequests;
+}
+
+CaptureRequest *RequestPool::get(const camera3_capture_request_t *request,
+        const camera_metadata_t *settings)
+{
+    CaptureRequest *r;
+
+    {
+        android::Mutex::Autolock al(mLock);
+        while (mNumFree == 0)
+            mNotEmpty.wait(mLock);
+        r = mFree[--mNumFree];
+    }
+
+    if (copySettings(r, settings) != 0) {
+        ALOGE("%s: Failed to copy settings for frame %d", __func__,
+                request->frame_number);
+        put(r);
+        return NULL;
+    }
+    if (request->num_output_buffers > r->bufferCapacity) {
+        delete [] r->outputBuffers;
+        delete [] r->acquireFences;
+        delete [] r->bufferResults;
+        r->bufferCapacity = request->num_output_buffers;
+        r->outputBuffers = new camera3_stream_buffer_t[r->bufferCapacity];
+        r->acquireFences = new int[r->bufferCapacity];
+        r->bufferResults = new int[r->bufferCapacity];
+    }
+
+    r->frameNumber = request->frame_number;
+    r->hasInputBuffer = request->input_buffer != NULL;
+    if (r->hasInputBuffer)
+        r->inputBuffer = *request->input_buffer;
+    r->numOutputBuffers = request->num_output_buffers;
+    for (uint32_t i = 0; i < r->numOutputBuffers; i++) {
+        r->outputBuffers[i] = request->output_buffers[i];
+        r->acquireFences[i] = -1;
+    }
+    r->timestamp = 0;
+    r->failed = false;
+    r->refs = 1;
+    return r;
+}
+
+void RequestPool::put(CaptureRequest *request)
+{
+    android::Mutex::Autolock al(mLock);
+
+    mFree[mNumFree++] = request;
+    mNotEmpty.signal();
+}
+
+int RequestPool::copySettings(CaptureRequest *request,
+        const camera_metadata_t *settings)
+{
+    size_t entries = get_camera_metadata_entry_count(settings) +
+            kResultEntries;
+    size_t data = get_camera_metadata_data_count(settings) +
+            calculate_camera_metadata_entry_data_size(TYPE_INT64, 1);
+    size_t size = calculate_camera_metadata_size(entries, data);
+
+    if (size > request->settingsBufferSize) {
+        void *buffer = malloc(size);
+        if (buffer == NULL)
+            return -ENOMEM;
+        free(request->settingsBuffer);
+        request->settingsBuffer = buffer;
+        request->settingsBufferSize = size;
+    }
+    request->settings = place_camera_metadata(request->settingsBuffer,
+            request->settingsBufferSize, entries, data);
+    if (request->settings == NULL)
+        return -EINVAL;
+    return append_camera_metadata(request->settings, settings);
+}
+
+RequestQueue::RequestQueue(int capacity)
+  : mRequests(new CaptureRequest*[capacity]),
+    mCapacity(capacity),
+    mHead(0),
+    mCount(0),
+    mStopped(false)
+{
+}
+
+RequestQueue::~RequestQueue()
+{
+    delete [] mRequests;
+}
+
+bool RequestQueue::push(CaptureRequest *request)
+{
+    android::Mutex::Autolock al(mLock);
+
+    while (mCount == mCapacity && !mStopped)
+        mNotFull.wait(mLock);
+    if (mStopped)
+        return false;
+
+    mRequests[(mHead + mCount) % mCapacity] = request;
+    mCount++;
+    mNotEmpty.signal();
+    return true;
+}
+
+CaptureRequest *RequestQueue::pop()
+{
+    android::Mutex::Autolock al(mLock);
+    CaptureRequest *request;
+
+    while (mCount == 0 && !mStopped)
+        mNotEmpty.wait(mLock);
+    if (mCount == 0)
+        return NULL;
+
+    request = mRequests[mHead];
+    mHead = (mHead + 1) % mCapacity;
+    mCount--;
+    mNotFull.signal();
+    return request;
+}
+
+void RequestQueue::stop()
+{
+    android::Mutex::Autolock al(mLock);
+
+    mStopped = true;
+    mNotEmpty.broadcast();
+    mNotFull.broadcast();
+}
+
+void RequestQueue::start()
+{
+    android::Mutex::Autolock al(mLock);
+
+    mStopped = false;
+}
+
+} // namespace default_camera_hal
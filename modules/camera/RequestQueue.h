@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REQUEST_QUEUE_H_
+#define REQUEST_QUEUE_H_
+
+#include <stdint.h>
+#include <hardware/camera3.h>
+#include <system/camera_metadata.h>
+#include <utils/Condition.h>
+#include <utils/Mutex.h>
+
+namespace default_camera_hal {
+class RequestPool;
+
+// CaptureRequest is the HAL's own copy of a camera3_capture_request_t, which
+// must outlive the framework's call to process_capture_request.
+struct CaptureRequest {
+    // Frame number assigned by the framework
+    uint32_t frameNumber;
+    // Settings used for this capture, placed in settingsBuffer with room left
+    // for the result entries
+    camera_metadata_t *settings;
+    void *settingsBuffer;
+    size_t settingsBufferSize;
+    // Input buffer to reprocess, valid if hasInputBuffer
+    camera3_stream_buffer_t inputBuffer;
+    bool hasInputBuffer;
+    // Output buffers, filled in place as the request is processed
+    camera3_stream_buffer_t *outputBuffers;
+    uint32_t numOutputBuffers;
+    // Acquire fences taken from outputBuffers, closed once waited on
+    int *acquireFences;
+    // Result of filling each output buffer, see Camera::fillOutputBuffers()
+    int *bufferResults;
+    // Number of buffers outputBuffers, acquireFences and bufferResults have
+    // room for
+    uint32_t bufferCapacity;
+    // Start of exposure, set once the frame has been captured
+    uint64_t timestamp;
+    // CLOCK_MONOTONIC time processCaptureRequest() accepted the request
+    int64_t startTime;
+    // A buffer or the whole request failed, already notified to the framework
+    bool failed;
+    // Number of pipeline stages still using the request
+    volatile int32_t refs;
+    // Pool the request returns to once released
+    RequestPool *pool;
+};
+
+// Take another reference, for a stage running concurrently with the next one
+void holdCaptureRequest(CaptureRequest *request);
+// Drop a reference, returning the request to its pool with the last one
+void releaseCaptureRequest(CaptureRequest *request);
+
+// RequestPool preallocates the requests in flight. Their buffer arrays and
+// settings storage are kept across uses and only grow, so steady state
+// capture does not allocate.
+class RequestPool {
+    public:
+        RequestPool(int capacity);
+        ~RequestPool();
+
+        // Copy a request from the framework into a free pooled request,
+        // blocking while all of them are in flight; settings must be
+        // non-NULL. Returns a request holding one reference, or NULL if out
+        // of memory.
+        CaptureRequest *get(const camera3_capture_request_t *request,
+                const camera_metadata_t *settings);
+        // Make a released request available again
+        void put(CaptureRequest *request);
+
+    private:
+        // Copy settings into request, leaving room for the result entries
+        int copySettings(CaptureRequest *request,
+                const camera_metadata_t *settings);
+
+        // All requests owned by the pool
+        CaptureRequest *mRequests;
+        // Stack of requests not in flight
+        CaptureRequest **mFree;
+        // Size of mRequests and mFree
+        const int mCapacity;
+        // Number of requests in mFree
+        int mNumFree;
+        // Lock protecting mFree and mNumFree
+        android::Mutex mLock;
+        // Signalled when a request is put back
+        android::Condition mNotEmpty;
+};
+
+// RequestQueue is a bounded blocking FIFO handing requests from one stage of
+// the capture pipeline to the next.
+class RequestQueue {
+    public:
+        RequestQueue(int capacity);
+        ~RequestQueue();
+
+        // Append a request, blocking while the queue is full.
+        // Returns false without queueing if the queue was stopped.
+        bool push(CaptureRequest *request);
+        // Remove the oldest request, blocking while the queue is empty.
+        // Once stopped, returns the requests left and then NULL.
+        CaptureRequest *pop();
+        // Wake up all waiters and refuse new requests
+        void stop();
+        // Accept requests again after stop()
+        void start();
+
+    private:
+        // Ring of queued requests
+        CaptureRequest **mRequests;
+        // Size of mRequests
+        const int mCapacity;
+        // Index of the oldest request
+        int mHead;
+        // Number of requests queued
+        int mCount;
+        // Set by stop(), cleared by start()
+        bool mStopped;
+        // Lock protecting all of the above
+        android::Mutex mLock;
+        // Signalled when a request is pushed or the queue stops
+        android::Condition mNotEmpty;
+        // Signalled when a request is popped or the queue stops
+        android::Condition mNotFull;
+};
+} // namespace default_camera_hal
+
+#endif // REQUEST_QUEUE_H_
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <errno.h>
+#include <utils/Mutex.h>
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "ResourceArbiter"
+#include <cutils/log.h>
+
+#include "ResourceArbiter.h"
+
+namespace default_camera_hal {
+
+ResourceArbiter::ResourceArbiter(int capacity)
+  : mCapacity(capacity),
+    mUsed(0)
+{
+}
+
+ResourceArbiter::~ResourceArbiter()
+{
+}
+
+int ResourceArbiter::acquire(int id, int cost)
+{
+    android::Mutex::Autolock al(mLock);
+
+    if (mUsed + cost > mCapacity) {
+        ALOGE("%s: Camera %d needs %d of %d, %d used by open cameras",
+                __func__, id, cost, mCapacity, mUsed);
+        return -EUSERS;
+    }
+    mUsed += cost;
+    ALOGV("%s: Camera %d reserved %d, %d of %d used", __func__, id, cost,
+            mUsed, mCapacity);
+    return 0;
+}
+
+void ResourceArbiter::release(int id, int cost)
+{
+    android::Mutex::Autolock al(mLock);
+
+    mUsed -= cost;
+    ALOGV("%s: Camera %d released %d, %d of %d used", __func__, id, cost,
+            mUsed, mCapacity);
+}
+
+} // namespace default_camera_hal
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef RESOURCE_ARBITER_H_
+#define RESOURCE_ARBITER_H_
+
+#include <utils/Mutex.h>
+
+namespace default_camera_hal {
+// ResourceArbiter shares the capture resources of the HAL, such as sensor
+// interfaces or bus bandwidth, between the cameras opened concurrently. Each
+// camera reserves its cost when opened and gives it back when closed, cameras
+// are otherwise independent and never wait on each other.
+class ResourceArbiter {
+    public:
+        // capacity is the total cost of the cameras that may be open at once
+        ResourceArbiter(int capacity);
+        ~ResourceArbiter();
+
+        // Reserve cost for camera id. Returns -EUSERS if the cameras already
+        // open leave less than cost.
+        int acquire(int id, int cost);
+        // Give back the cost reserved by acquire()
+        void release(int id, int cost);
+
+    private:
+        // Total cost available
+        const int mCapacity;
+        // Sum of the costs reserved by the open cameras
+        int mUsed;
+        // Lock protecting mUsed
+        android::Mutex mLock;
+};
+} // namespace default_camera_hal
+
+#endif // RESOURCE_ARBITER_H_
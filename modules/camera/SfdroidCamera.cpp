@@ -0,0 +1,676 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+#include <hardware/camera3.h>
+#include <hardware/camera_common.h>
+#include <hardware/gralloc.h>
+#include <sync/sync.h>
+#include <system/camera_metadata.h>
+#include <system/graphics.h>
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "SfdroidCamera"
+#include <cutils/log.h>
+
+#define ATRACE_TAG (ATRACE_TAG_CAMERA | ATRACE_TAG_HAL)
+#include <utils/Trace.h>
+
+#include "SfdroidCamera.h"
+#include "sfdroid_ipc.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+// Longest wait for an answer of the host, including a frame, in msecs
+#define SFDROID_FRAME_TIMEOUT 2000
+// Longest wait for queryInfo(), called while the HAL module loads
+#define SFDROID_INFO_TIMEOUT 500
+// Longest wait for an acquire fence, in msecs
+#define SFDROID_SYNC_TIMEOUT 5000
+// Frame duration reported if the host does not tell, in nsecs
+#define SFDROID_FRAME_DURATION 33333333LL
+// Capture request index of an output buffer not registered with its stream
+#define SFDROID_NO_SLOT 0xffffffffu
+
+namespace default_camera_hal {
+
+// Bytes needed for one frame of a YUV format, 0 if unsupported
+static size_t frameSize(uint32_t fourcc, uint32_t bytes_per_line,
+        uint32_t height)
+{
+    switch (fourcc) {
+    case V4L2_PIX_FMT_YUYV:
+        return bytes_per_line * height;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+        return bytes_per_line * height * 3 / 2;
+    }
+    return 0;
+}
+
+// Size of the JPEG buffers for frames of at most width x height
+static int32_t jpegMaxSize(int32_t width, int32_t height)
+{
+    // Bound by an uncompressed 4:2:0 frame, plus the transport header
+    return width * height * 3 / 2 + sizeof(camera3_jpeg_blob_t);
+}
+
+SfdroidCamera::SfdroidCamera(int id, uint32_t camera,
+        const sfdroid_camera_info_t &info)
+  : Camera(id),
+    mCamera(camera),
+    mInfo(info),
+    mSocket(-1),
+    mRequestedWidth(0),
+    mRequestedHeight(0),
+    mFourcc(0),
+    mWidth(0),
+    mHeight(0),
+    mBytesPerLine(0),
+    mZeroCopyStream(NULL),
+    mHaveFrame(false)
+{
+    memset(mMappings, 0, sizeof(mMappings));
+    memset(mMappingSizes, 0, sizeof(mMappingSizes));
+    memset(&mFrame, 0, sizeof(mFrame));
+    if (mInfo.num_sizes > SFDROID_CAMERA_MAX_SIZES)
+        mInfo.num_sizes = SFDROID_CAMERA_MAX_SIZES;
+}
+
+SfdroidCamera::~SfdroidCamera()
+{
+    closeDevice();
+}
+
+int SfdroidCamera::queryInfo(uint32_t camera, sfdroid_camera_info_t *info)
+{
+    sfdroid_camera_request_t req;
+    struct iovec iov;
+    int num_fds;
+    int res = 0;
+
+    int fd = sfdroid_ipc_connect(SFDROID_CAMERA_SOCKET_NAME,
+            SFDROID_INFO_TIMEOUT);
+    if (fd < 0)
+        return -errno;
+
+    memset(&req, 0, sizeof(req));
+    req.magic = SFDROID_CAMERA_MAGIC;
+    req.op = SFDROID_CAMERA_OP_INFO;
+    req.camera = camera;
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    if (sfdroid_ipc_send(fd, &iov, 1, NULL, 0) < 0 ||
+            sfdroid_ipc_recv(fd, info, sizeof(*info), NULL, 0, &num_fds) < 0)
+        res = -errno;
+    else if (info->magic != SFDROID_CAMERA_MAGIC ||
+            info->version != SFDROID_CAMERA_VERSION)
+        res = -EPROTO;
+    else if (info->status != 0)
+        res = info->status;
+    else if (info->num_sizes == 0 || frameSize(info->format, 1, 2) == 0)
+        res = -ENODEV;
+    ::close(fd);
+    return res;
+}
+
+camera_metadata_t *SfdroidCamera::initStaticInfo()
+{
+    int32_t sizes[SFDROID_CAMERA_MAX_SIZES * 2];
+    int64_t durations[SFDROID_CAMERA_MAX_SIZES];
+    int num_sizes = mInfo.num_sizes;
+    int64_t duration = mInfo.frame_duration_ns > 0 ?
+            mInfo.frame_duration_ns : SFDROID_FRAME_DURATION;
+
+    // Largest first, as the host lists them
+    for (int i = 0; i < num_sizes; i++) {
+        sizes[i * 2] = mInfo.sizes[i * 2];
+        sizes[i * 2 + 1] = mInfo.sizes[i * 2 + 1];
+        durations[i] = duration;
+    }
+
+    // Sized for all of the entries below, so none of them reallocates
+    Metadata m(32, 1024);
+
+    /* android.control */
+    int32_t fps = (int32_t)(1000000000LL / duration);
+    int32_t android_control_ae_available_target_fps_ranges[] = {fps, fps};
+    m.addInt32(ANDROID_CONTROL_AE_AVAILABLE_TARGET_FPS_RANGES,
+            ARRAY_SIZE(android_control_ae_available_target_fps_ranges),
+            android_control_ae_available_target_fps_ranges);
+
+    int32_t android_control_ae_compensation_range[] = {0, 0};
+    m.addInt32(ANDROID_CONTROL_AE_COMPENSATION_RANGE,
+            ARRAY_SIZE(android_control_ae_compensation_range),
+            android_control_ae_compensation_range);
+
+    camera_metadata_rational_t android_control_ae_compensation_step[] = {{1,1}};
+    m.addRational(ANDROID_CONTROL_AE_COMPENSATION_STEP,
+            ARRAY_SIZE(android_control_ae_compensation_step),
+            android_control_ae_compensation_step);
+
+    int32_t android_control_max_regions[] = {/*AE*/ 0,/*AWB*/ 0,/*AF*/ 0};
+    m.addInt32(ANDROID_CONTROL_MAX_REGIONS,
+            ARRAY_SIZE(android_control_max_regions),
+            android_control_max_regions);
+
+    /* android.jpeg */
+    int32_t android_jpeg_available_thumbnail_sizes[] = {0, 0};
+    m.addInt32(ANDROID_JPEG_AVAILABLE_THUMBNAIL_SIZES,
+            ARRAY_SIZE(android_jpeg_available_thumbnail_sizes),
+            android_jpeg_available_thumbnail_sizes);
+
+    int32_t android_jpeg_max_size[] = {jpegMaxSize(sizes[0], sizes[1])};
+    m.addInt32(ANDROID_JPEG_MAX_SIZE,
+            ARRAY_SIZE(android_jpeg_max_size),
+            android_jpeg_max_size);
+
+    /* android.lens */
+    float android_lens_info_available_focal_lengths[] = {1.0};
+    m.addFloat(ANDROID_LENS_INFO_AVAILABLE_FOCAL_LENGTHS,
+            ARRAY_SIZE(android_lens_info_available_focal_lengths),
+            android_lens_info_available_focal_lengths);
+
+    /* android.request */
+    int32_t android_request_max_num_output_streams[] = {0, 2, 1};
+    m.addInt32(ANDROID_REQUEST_MAX_NUM_OUTPUT_STREAMS,
+            ARRAY_SIZE(android_request_max_num_output_streams),
+            android_request_max_num_output_streams);
+
+    m.add1UInt8(ANDROID_REQUEST_PIPELINE_MAX_DEPTH, kPipelineMaxDepth);
+
+    /* android.scaler */
+    int32_t android_scaler_available_formats[] = {
+            HAL_PIXEL_FORMAT_BLOB,
+            HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED,
+            HAL_PIXEL_FORMAT_YCrCb_420_SP,
+            HAL_PIXEL_FORMAT_YCbCr_420_888};
+    m.addInt32(ANDROID_SCALER_AVAILABLE_FORMATS,
+            ARRAY_SIZE(android_scaler_available_formats),
+            android_scaler_available_formats);
+
+    // JPEG is encoded in software from the YUV frames
+    m.addInt64(ANDROID_SCALER_AVAILABLE_JPEG_MIN_DURATIONS, num_sizes,
+            durations);
+    m.addInt32(ANDROID_SCALER_AVAILABLE_JPEG_SIZES, num_sizes * 2, sizes);
+
+    float android_scaler_available_max_digital_zoom[] = {1};
+    m.addFloat(ANDROID_SCALER_AVAILABLE_MAX_DIGITAL_ZOOM,
+            ARRAY_SIZE(android_scaler_available_max_digital_zoom),
+            android_scaler_available_max_digital_zoom);
+
+    m.addInt64(ANDROID_SCALER_AVAILABLE_PROCESSED_MIN_DURATIONS, num_sizes,
+            durations);
+    m.addInt32(ANDROID_SCALER_AVAILABLE_PROCESSED_SIZES, num_sizes * 2,
+            sizes);
+
+    /* android.sensor */
+
+    int32_t android_sensor_info_active_array_size[] = {0, 0, sizes[0],
+            sizes[1]};
+    m.addInt32(ANDROID_SENSOR_INFO_ACTIVE_ARRAY_SIZE,
+            ARRAY_SIZE(android_sensor_info_active_array_size),
+            android_sensor_info_active_array_size);
+
+    int32_t android_sensor_info_sensitivity_range[] = {100, 100};
+    m.addInt32(ANDROID_SENSOR_INFO_SENSITIVITY_RANGE,
+            ARRAY_SIZE(android_sensor_info_sensitivity_range),
+            android_sensor_info_sensitivity_range);
+
+    int64_t android_sensor_info_max_frame_duration[] = {duration};
+    m.addInt64(ANDROID_SENSOR_INFO_MAX_FRAME_DURATION,
+            ARRAY_SIZE(android_sensor_info_max_frame_duration),
+            android_sensor_info_max_frame_duration);
+
+    // TODO: have the host report the physical size of its sensors
+    float android_sensor_info_physical_size[] = {3.2, 2.4};
+    m.addFloat(ANDROID_SENSOR_INFO_PHYSICAL_SIZE,
+            ARRAY_SIZE(android_sensor_info_physical_size),
+            android_sensor_info_physical_size);
+
+    int32_t android_sensor_info_pixel_array_size[] = {sizes[0], sizes[1]};
+    m.addInt32(ANDROID_SENSOR_INFO_PIXEL_ARRAY_SIZE,
+            ARRAY_SIZE(android_sensor_info_pixel_array_size),
+            android_sensor_info_pixel_array_size);
+
+    int32_t android_sensor_orientation[] = {getOrientation()};
+    m.addInt32(ANDROID_SENSOR_ORIENTATION,
+            ARRAY_SIZE(android_sensor_orientation),
+            android_sensor_orientation);
+
+    /* End of static camera characteristics */
+
+    return clone_camera_metadata(m.get());
+}
+
+bool SfdroidCamera::isValidCaptureSettings(
+        const camera_metadata_t* /*settings*/)
+{
+    // TODO: reject settings that cannot be captured
+    return true;
+}
+
+int SfdroidCamera::initDevice()
+{
+    // Connected once the streams are configured
+    return 0;
+}
+
+void SfdroidCamera::closeDevice()
+{
+    stopStream();
+    mZeroCopyStream = NULL;
+    mRequestedWidth = 0;
+    mRequestedHeight = 0;
+}
+
+int SfdroidCamera::initTemplates()
+{
+    static const struct {
+        int type;
+        uint8_t intent;
+    } templates[] = {
+        { CAMERA3_TEMPLATE_PREVIEW, ANDROID_CONTROL_CAPTURE_INTENT_PREVIEW },
+        { CAMERA3_TEMPLATE_STILL_CAPTURE,
+                ANDROID_CONTROL_CAPTURE_INTENT_STILL_CAPTURE },
+        { CAMERA3_TEMPLATE_VIDEO_RECORD,
+                ANDROID_CONTROL_CAPTURE_INTENT_VIDEO_RECORD },
+        { CAMERA3_TEMPLATE_VIDEO_SNAPSHOT,
+                ANDROID_CONTROL_CAPTURE_INTENT_VIDEO_SNAPSHOT },
+        { CAMERA3_TEMPLATE_ZERO_SHUTTER_LAG,
+                ANDROID_CONTROL_CAPTURE_INTENT_ZERO_SHUTTER_LAG },
+    };
+    int res;
+
+    // 3A runs on the host, templates only differ in their intent
+    for (size_t i = 0; i < ARRAY_SIZE(templates); i++) {
+        Metadata m(2, 0);
+        res = m.add1UInt8(ANDROID_CONTROL_MODE, ANDROID_CONTROL_MODE_OFF);
+        if (res)
+            return res;
+        res = m.add1UInt8(ANDROID_CONTROL_CAPTURE_INTENT, templates[i].intent);
+        if (res)
+            return res;
+        res = setTemplate(templates[i].type, m.get());
+        if (res)
+            return res;
+    }
+    return 0;
+}
+
+int SfdroidCamera::getFacing()
+{
+    return mInfo.facing == CAMERA_FACING_BACK ? CAMERA_FACING_BACK :
+            CAMERA_FACING_FRONT;
+}
+
+int SfdroidCamera::getOrientation()
+{
+    return mInfo.orientation % 360;
+}
+
+int SfdroidCamera::configureDevice(Stream **streams, int count)
+{
+    uint32_t width = 0;
+    uint32_t height = 0;
+    int outputs = 0;
+    Stream *output = NULL;
+    int res;
+
+    ATRACE_CALL();
+
+    // Stream at the largest size of the streams, others are scaled down
+    for (int i = 0; i < count; i++) {
+        if (!streams[i]->isOutputType())
+            continue;
+        outputs++;
+        output = streams[i];
+        uint32_t w = streams[i]->getWidth();
+        uint32_t h = streams[i]->getHeight();
+        if (w * h > width * height) {
+            width = w;
+            height = h;
+        }
+    }
+
+    stopStream();
+    mZeroCopyStream = NULL;
+    mRequestedWidth = width;
+    mRequestedHeight = height;
+    res = startStream();
+    if (res)
+        return res;
+
+    // A single stream in the host format can be written into directly
+    if (outputs == 1 && mFourcc == V4L2_PIX_FMT_NV21 &&
+            output->getFormat() == HAL_PIXEL_FORMAT_YCrCb_420_SP &&
+            output->getWidth() == mWidth && output->getHeight() == mHeight) {
+        mZeroCopyStream = output->getStream();
+        ALOGV("%s:%d: Capturing %dx%d into output buffers", __func__, mId,
+                mWidth, mHeight);
+    }
+    return 0;
+}
+
+int SfdroidCamera::startStream()
+{
+    sfdroid_camera_request_t req;
+    sfdroid_camera_reply_t reply;
+    struct iovec iov;
+    int num_fds;
+    int res;
+
+    mSocket = sfdroid_ipc_connect(SFDROID_CAMERA_SOCKET_NAME,
+            SFDROID_FRAME_TIMEOUT);
+    if (mSocket < 0) {
+        ALOGE("%s:%d: Failed to connect to the camera bridge: %s(%d)",
+                __func__, mId, strerror(errno), errno);
+        return -ENODEV;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.magic = SFDROID_CAMERA_MAGIC;
+    req.op = SFDROID_CAMERA_OP_START;
+    req.camera = mCamera;
+    req.width = mRequestedWidth;
+    req.height = mRequestedHeight;
+    req.format = mInfo.format;
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    if (sfdroid_ipc_send(mSocket, &iov, 1, NULL, 0) < 0 ||
+            sfdroid_ipc_recv(mSocket, &reply, sizeof(reply), NULL, 0,
+                    &num_fds) < 0) {
+        res = -errno;
+        goto err_out;
+    }
+    if (reply.magic != SFDROID_CAMERA_MAGIC) {
+        res = -EPROTO;
+        goto err_out;
+    }
+    if (reply.status != 0) {
+        res = reply.status;
+        goto err_out;
+    }
+    if (frameSize(reply.format, reply.stride, reply.height) == 0 ||
+            reply.width == 0 || reply.height == 0) {
+        ALOGE("%s:%d: Host streams unsupported format %08x", __func__, mId,
+                reply.format);
+        res = -EINVAL;
+        goto err_out;
+    }
+
+    mFourcc = reply.format;
+    mWidth = reply.width;
+    mHeight = reply.height;
+    mBytesPerLine = reply.stride;
+    ALOGV("%s:%d: Streaming %dx%d (%d bytes per line) in %08x", __func__, mId,
+            mWidth, mHeight, mBytesPerLine, mFourcc);
+    return 0;
+
+err_out:
+    ALOGE("%s:%d: Failed to start streaming %dx%d: %s(%d)", __func__, mId,
+            mRequestedWidth, mRequestedHeight, strerror(-res), res);
+    stopStream();
+    return res;
+}
+
+void SfdroidCamera::stopStream()
+{
+    // Closing the connection stops the stream and frees the host buffers
+    if (mSocket >= 0)
+        ::close(mSocket);
+    mSocket = -1;
+    for (uint32_t i = 0; i < kMaxHostBuffers; i++) {
+        if (mMappings[i] != NULL)
+            munmap(mMappings[i], mMappingSizes[i]);
+        mMappings[i] = NULL;
+        mMappingSizes[i] = 0;
+    }
+    mHaveFrame = false;
+}
+
+int SfdroidCamera::sendRequest(uint32_t op, uint32_t index, int fd)
+{
+    sfdroid_camera_request_t req;
+    struct iovec iov;
+
+    memset(&req, 0, sizeof(req));
+    req.magic = SFDROID_CAMERA_MAGIC;
+    req.op = op;
+    req.camera = mCamera;
+    req.index = index;
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    if (sfdroid_ipc_send(mSocket, &iov, 1, &fd, fd >= 0 ? 1 : 0) < 0) {
+        int res = -errno;
+        ALOGE("%s:%d: Lost the camera bridge: %s(%d)", __func__, mId,
+                strerror(-res), res);
+        stopStream();
+        return res;
+    }
+    return 0;
+}
+
+int SfdroidCamera::receiveFrame()
+{
+    int fd = -1;
+    int num_fds;
+    int res;
+
+    ATRACE_CALL();
+
+    if (sfdroid_ipc_recv(mSocket, &mFrame, sizeof(mFrame), &fd, 1,
+                &num_fds) < 0) {
+        res = errno == EAGAIN || errno == EWOULDBLOCK ? -ETIME : -errno;
+        ALOGE("%s:%d: No frame from the camera bridge: %s(%d)", __func__, mId,
+                strerror(-res), res);
+        stopStream();
+        return res;
+    }
+    if (num_fds == 0)
+        fd = -1;
+
+    if (mFrame.magic != SFDROID_CAMERA_MAGIC) {
+        res = -EPROTO;
+    } else if (mFrame.status != 0) {
+        res = mFrame.status;
+    } else if (mFrame.flags & SFDROID_CAMERA_FRAME_INTO) {
+        res = 0;
+    } else if (mFrame.index >= kMaxHostBuffers) {
+        ALOGE("%s:%d: Host buffer %d out of range", __func__, mId,
+                mFrame.index);
+        res = -EPROTO;
+    } else if (mFrame.flags & SFDROID_CAMERA_FRAME_NEW_BUFFER) {
+        // The host replaced the buffer, map the new one in its place
+        if (mMappings[mFrame.index] != NULL)
+            munmap(mMappings[mFrame.index], mMappingSizes[mFrame.index]);
+        mMappings[mFrame.index] = NULL;
+        mMappingSizes[mFrame.index] = 0;
+        void *mapping = fd >= 0 ? mmap(NULL, mFrame.size, PROT_READ,
+                MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (mapping == MAP_FAILED) {
+            ALOGE("%s:%d: Failed to map host buffer %d: %s(%d)", __func__,
+                    mId, mFrame.index, strerror(errno), errno);
+            res = -ENOMEM;
+        } else {
+            mMappings[mFrame.index] = mapping;
+            mMappingSizes[mFrame.index] = mFrame.size;
+            res = 0;
+        }
+    } else {
+        res = mMappings[mFrame.index] != NULL ? 0 : -EPROTO;
+    }
+    if (fd >= 0)
+        ::close(fd);
+
+    if (res == 0 && !(mFrame.flags & SFDROID_CAMERA_FRAME_INTO))
+        mHaveFrame = true;
+    else if (res == -EPROTO)
+        stopStream();
+    return res;
+}
+
+int SfdroidCamera::captureZeroCopy(CaptureRequest *request)
+{
+    uint32_t i;
+    int res;
+
+    for (i = 0; i < request->numOutputBuffers; i++) {
+        if (request->outputBuffers[i].stream == mZeroCopyStream)
+            break;
+    }
+    if (i == request->numOutputBuffers)
+        return -EINVAL;
+
+    // The host writes the buffer, it must be free before it is handed over
+    if (request->acquireFences[i] != -1) {
+        res = sync_wait(request->acquireFences[i], SFDROID_SYNC_TIMEOUT);
+        if (res) {
+            ALOGE("%s:%d: Error waiting on buffer acquire fence: %s(%d)",
+                    __func__, mId, strerror(-res), res);
+            return res;
+        }
+        ::close(request->acquireFences[i]);
+        request->acquireFences[i] = -1;
+    }
+
+    // Registered buffers keep their slot, so that the host can keep them
+    // imported from one frame to the next
+    Stream *stream = findStream(mZeroCopyStream);
+    int registered = stream != NULL ?
+            stream->getBufferIndex(request->outputBuffers[i].buffer) : -ENOENT;
+    uint32_t slot = registered >= 0 ? registered : SFDROID_NO_SLOT;
+
+    // Gralloc buffers carry their dmabuf as first fd
+    const native_handle_t *handle = *request->outputBuffers[i].buffer;
+    if (handle->numFds > 0) {
+        res = sendRequest(SFDROID_CAMERA_OP_CAPTURE, slot, handle->data[0]);
+        if (res)
+            return res;
+        res = receiveFrame();
+        if (res != -EINVAL)
+            return res;
+    }
+
+    ALOGW("%s:%d: Host refused output buffer, copying frames", __func__, mId);
+    mZeroCopyStream = NULL;
+    res = sendRequest(SFDROID_CAMERA_OP_CAPTURE, SFDROID_NO_SLOT, -1);
+    if (res)
+        return res;
+    return receiveFrame();
+}
+
+int SfdroidCamera::startCapture(CaptureRequest *request)
+{
+    struct timespec mono, boot;
+    int res;
+
+    ATRACE_CALL();
+
+    // Reconnect if the host went away since the last frame
+    if (mSocket < 0) {
+        if (mRequestedWidth == 0) {
+            ALOGE("%s:%d: Device not streaming", __func__, mId);
+            return -ENODEV;
+        }
+        res = startStream();
+        if (res)
+            return res;
+    }
+    if (mZeroCopyStream != NULL) {
+        res = captureZeroCopy(request);
+    } else {
+        res = sendRequest(SFDROID_CAMERA_OP_CAPTURE, SFDROID_NO_SLOT, -1);
+        if (res == 0)
+            res = receiveFrame();
+    }
+    if (res)
+        return res;
+
+    // Frames are stamped with CLOCK_MONOTONIC, shutters use CLOCK_BOOTTIME
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    request->timestamp = boot.tv_sec * 1000000000ULL + boot.tv_nsec;
+    if (mFrame.timestamp_ns > 0) {
+        request->timestamp -= mono.tv_sec * 1000000000ULL + mono.tv_nsec;
+        request->timestamp += mFrame.timestamp_ns;
+    }
+    return 0;
+}
+
+int SfdroidCamera::fillBuffer(CaptureRequest *request,
+        const camera3_stream_buffer_t *buffer)
+{
+    if (buffer->stream == mZeroCopyStream)
+        return 0; // Written by the host in startCapture()
+    if (!mHaveFrame)
+        return -ENODATA;
+    return copyFrame(request, buffer);
+}
+
+int SfdroidCamera::copyFrame(CaptureRequest *request,
+        const camera3_stream_buffer_t *buffer)
+{
+    uint8_t *src = static_cast<uint8_t*>(mMappings[mFrame.index]);
+    size_t size = frameSize(mFourcc, mBytesPerLine, mHeight);
+    YuvImage frame;
+
+    if (size == 0 || mFrame.size < size ||
+            mMappingSizes[mFrame.index] < size) {
+        ALOGE("%s:%d: Cannot convert %d bytes frame in %08x", __func__, mId,
+                mFrame.size, mFourcc);
+        return -EINVAL;
+    }
+
+    // Describe the frame as 4:2:0, YUYV chroma is read every other line
+    frame.y = src;
+    frame.width = mWidth;
+    frame.height = mHeight;
+    frame.yStride = mBytesPerLine;
+    if (mFourcc == V4L2_PIX_FMT_YUYV) {
+        frame.cb = src + 1;
+        frame.cr = src + 3;
+        frame.yStep = 2;
+        frame.cStride = mBytesPerLine * 2;
+        frame.chromaStep = 4;
+    } else {
+        uint8_t *uv = src + mBytesPerLine * mHeight;
+        frame.cb = mFourcc == V4L2_PIX_FMT_NV21 ? uv + 1 : uv;
+        frame.cr = mFourcc == V4L2_PIX_FMT_NV21 ? uv : uv + 1;
+        frame.yStep = 1;
+        frame.cStride = mBytesPerLine;
+        frame.chromaStep = 2;
+    }
+    return mProcessor.fill(frame, buffer, request->settings);
+}
+
+void SfdroidCamera::finishCapture(CaptureRequest* /*request*/)
+{
+    if (!mHaveFrame)
+        return;
+    mHaveFrame = false;
+    // Give the host buffer back to fill with a later frame
+    sendRequest(SFDROID_CAMERA_OP_RELEASE, mFrame.index, -1);
+}
+
+} // namespace default_camera_hal
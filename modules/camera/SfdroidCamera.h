@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFDROID_CAMERA_H_
+#define SFDROID_CAMERA_H_
+
+#include <system/camera_metadata.h>
+#include "Camera.h"
+#include "sfdroid_camera_protocol.h"
+
+namespace default_camera_hal {
+// SfdroidCamera is a camera of the Sailfish camera stack, streamed over the
+// sfdroid socket (see sfdroid_camera_protocol.h) when Android runs on top of
+// Sailfish. Frames come in buffers of the host, mapped once, and are
+// converted into the output buffers in software, except when a single
+// output stream matches the host format: the host then writes into the
+// output buffers directly, as V4L2Camera captures into them.
+class SfdroidCamera : public Camera {
+    public:
+        // camera is the index of the camera on the host, info its
+        // description as returned by queryInfo()
+        SfdroidCamera(int id, uint32_t camera,
+                const sfdroid_camera_info_t &info);
+        ~SfdroidCamera();
+
+        // Ask the camera bridge for the description of a host camera.
+        // Returns 0, or -errno if the bridge is not up or has no such camera.
+        static int queryInfo(uint32_t camera, sfdroid_camera_info_t *info);
+
+    private:
+        // Camera hooks, see Camera.h
+        camera_metadata_t *initStaticInfo();
+        bool isValidCaptureSettings(const camera_metadata_t *settings);
+        int initDevice();
+        void closeDevice();
+        int initTemplates();
+        int configureDevice(Stream **streams, int count);
+        int startCapture(CaptureRequest *request);
+        int fillBuffer(CaptureRequest *request,
+                const camera3_stream_buffer_t *buffer);
+        void finishCapture(CaptureRequest *request);
+        int getFacing();
+        int getOrientation();
+
+        // Connect and start streaming mRequestedWidth x mRequestedHeight
+        int startStream();
+        // Disconnect and unmap the host buffers
+        void stopStream();
+        // Send a request, with the fd attached if not -1
+        int sendRequest(uint32_t op, uint32_t index, int fd);
+        // Receive the answer to a capture request into mFrame, mapping the
+        // buffer it carries if new
+        int receiveFrame();
+        // Have the host write the next frame into the output buffer of
+        // mZeroCopyStream, copying frames from then on if it can't
+        int captureZeroCopy(CaptureRequest *request);
+        // Convert or encode the frame in mFrame into an output buffer
+        int copyFrame(CaptureRequest *request,
+                const camera3_stream_buffer_t *buffer);
+
+        // Maximum number of host buffers
+        static const uint32_t kMaxHostBuffers = 8;
+
+        // Index of the camera on the host and its description
+        const uint32_t mCamera;
+        sfdroid_camera_info_t mInfo;
+        // Stream connection, -1 when not streaming
+        int mSocket;
+        // Size asked for by the stream configuration
+        uint32_t mRequestedWidth;
+        uint32_t mRequestedHeight;
+        // Current stream format as given by the host: fourcc, size and line
+        // stride
+        uint32_t mFourcc;
+        uint32_t mWidth;
+        uint32_t mHeight;
+        uint32_t mBytesPerLine;
+        // Host buffers, mapped for the rest of the stream once received
+        void *mMappings[kMaxHostBuffers];
+        size_t mMappingSizes[kMaxHostBuffers];
+        // Output stream the host writes into directly, NULL to copy frames
+        camera3_stream_t *mZeroCopyStream;
+        // Host buffer holding the frame being captured, if mHaveFrame
+        sfdroid_camera_frame_t mFrame;
+        bool mHaveFrame;
+};
+} // namespace default_camera_hal
+
+#endif // SFDROID_CAMERA_H_
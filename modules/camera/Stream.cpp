@@ -78,6 +78,26 @@ int Stream::getType()
     return mType;
 }
 
+uint32_t Stream::getWidth()
+{
+    return mWidth;
+}
+
+uint32_t Stream::getHeight()
+{
+    return mHeight;
+}
+
+int Stream::getFormat()
+{
+    return mFormat;
+}
+
+camera3_stream_t *Stream::getStream()
+{
+    return mStream;
+}
+
 bool Stream::isInputType()
 {
     return mType == CAMERA3_STREAM_INPUT ||
@@ -198,13 +218,17 @@ int Stream::registerBuffers(const camera3_stream_buffer_set_t *buf_set)
         return -EINVAL;
     }
 
+    // Replace any buffer set registered before
+    unregisterBuffers_L();
     mNumBuffers = buf_set->num_buffers;
     mBuffers = new buffer_handle_t*[mNumBuffers];
+    mBufferIndex.reset(mNumBuffers);
 
     for (unsigned int i = 0; i < mNumBuffers; i++) {
         ALOGV("%s:%d: Registering buffer %p", __func__, mId,
                 buf_set->buffers[i]);
         mBuffers[i] = buf_set->buffers[i];
+        mBufferIndex.put(mBuffers[i], i);
         // TODO: register buffers with hw, handle error cases
     }
     mRegistered = true;
@@ -212,12 +236,24 @@ int Stream::registerBuffers(const camera3_stream_buffer_set_t *buf_set)
     return 0;
 }
 
+int Stream::getBufferIndex(const buffer_handle_t *buffer)
+{
+    android::Mutex::Autolock al(mLock);
+    int index;
+
+    if (!mBufferIndex.get(buffer, &index))
+        return -ENOENT;
+    return index;
+}
+
 // This must only be called with mLock held
 void Stream::unregisterBuffers_L()
 {
     mRegistered = false;
     mNumBuffers = 0;
     delete [] mBuffers;
+    mBuffers = NULL;
+    mBufferIndex.reset(0);
     // TODO: unregister buffers from hw
 }
 
@@ -21,6 +21,7 @@
 #include <hardware/gralloc.h>
 #include <system/graphics.h>
 #include <utils/Mutex.h>
+#include "PointerMap.h"
 
 namespace default_camera_hal {
 // Stream represents a single input or output stream for a camera device.
@@ -34,11 +35,19 @@ class Stream {
 
         // Register buffers with hardware
         int registerBuffers(const camera3_stream_buffer_set_t *buf_set);
+        // Index of a registered buffer in the registered buffer set, stable
+        // until the next registration, or -ENOENT
+        int getBufferIndex(const buffer_handle_t *buffer);
 
         void setUsage(uint32_t usage);
         void setMaxBuffers(uint32_t max_buffers);
 
         int getType();
+        uint32_t getWidth();
+        uint32_t getHeight();
+        int getFormat();
+        // Handle of the framework stream, as found in stream buffers
+        camera3_stream_t *getStream();
         bool isInputType();
         bool isOutputType();
         bool isRegistered();
@@ -75,6 +84,8 @@ class Stream {
         buffer_handle_t **mBuffers;
         // Number of buffers in mBuffers
         unsigned int mNumBuffers;
+        // Index in mBuffers of each registered buffer handle
+        PointerMap<int> mBufferIndex;
         // Lock protecting the Stream object for modifications
         android::Mutex mLock;
 };
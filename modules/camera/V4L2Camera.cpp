@@ -0,0 +1,808 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+#include <hardware/camera3.h>
+#include <hardware/gralloc.h>
+#include <sync/sync.h>
+#include <system/camera_metadata.h>
+#include <system/graphics.h>
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "V4L2Camera"
+#include <cutils/log.h>
+
+#define ATRACE_TAG (ATRACE_TAG_CAMERA | ATRACE_TAG_HAL)
+#include <utils/Trace.h>
+
+#include "V4L2Camera.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+// Driver buffers streamed, enough for the driver to never run dry
+#define V4L2_STREAM_BUFFERS 4
+// Longest wait for a frame or an acquire fence, in msecs
+#define V4L2_FRAME_TIMEOUT 2000
+#define V4L2_SYNC_TIMEOUT 5000
+// Most frame sizes reported in the static info
+#define V4L2_MAX_SIZES 16
+// Frame duration reported for every size, in nsecs
+#define V4L2_FRAME_DURATION 33333333LL
+
+namespace default_camera_hal {
+
+// Retry ioctls interrupted by signals, returns -errno on failure
+static int xioctl(int fd, unsigned long request, void *arg)
+{
+    int res;
+
+    do {
+        res = ioctl(fd, request, arg);
+    } while (res == -1 && errno == EINTR);
+    return res == -1 ? -errno : res;
+}
+
+// Bytes needed for one frame of a YUV format, 0 if unsupported
+static size_t frameSize(uint32_t fourcc, uint32_t bytes_per_line,
+        uint32_t height)
+{
+    switch (fourcc) {
+    case V4L2_PIX_FMT_YUYV:
+        return bytes_per_line * height;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+        return bytes_per_line * height * 3 / 2;
+    }
+    return 0;
+}
+
+// Size of the JPEG buffers for frames of at most width x height
+static int32_t jpegMaxSize(int32_t width, int32_t height)
+{
+    // Bound by an uncompressed 4:2:0 frame, plus the transport header
+    return width * height * 3 / 2 + sizeof(camera3_jpeg_blob_t);
+}
+
+V4L2Camera::V4L2Camera(int id, const char *path)
+  : Camera(id),
+    mPath(strdup(path)),
+    mFd(-1),
+    mYuvFourcc(0),
+    mMjpeg(false),
+    mFourcc(0),
+    mWidth(0),
+    mHeight(0),
+    mBytesPerLine(0),
+    mMemory(0),
+    mNumBuffers(0),
+    mZeroCopyStream(NULL),
+    mNextIndex(0),
+    mHaveFrame(false)
+{
+    memset(mMappings, 0, sizeof(mMappings));
+    memset(mMappingSizes, 0, sizeof(mMappingSizes));
+    memset(&mFrame, 0, sizeof(mFrame));
+}
+
+V4L2Camera::~V4L2Camera()
+{
+    closeDevice();
+    free(mPath);
+}
+
+bool V4L2Camera::isCaptureDevice(const char *path)
+{
+    struct v4l2_capability cap;
+    uint32_t yuv_fourcc;
+    bool mjpeg;
+    bool res = false;
+    int fd = ::open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd < 0)
+        return false;
+    memset(&cap, 0, sizeof(cap));
+    if (xioctl(fd, VIDIOC_QUERYCAP, &cap) == 0) {
+        uint32_t caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ?
+                cap.device_caps : cap.capabilities;
+        res = (caps & V4L2_CAP_VIDEO_CAPTURE) && (caps & V4L2_CAP_STREAMING) &&
+                probeFormats(fd, &yuv_fourcc, &mjpeg) == 0;
+    }
+    ::close(fd);
+    return res;
+}
+
+int V4L2Camera::probeFormats(int fd, uint32_t *yuv_fourcc, bool *mjpeg)
+{
+    // In order of preference, NV21 can be captured into gralloc buffers
+    static const uint32_t yuv[] = {
+        V4L2_PIX_FMT_NV21,
+        V4L2_PIX_FMT_NV12,
+        V4L2_PIX_FMT_YUYV,
+    };
+    struct v4l2_fmtdesc desc;
+    size_t best = ARRAY_SIZE(yuv);
+
+    *mjpeg = false;
+    memset(&desc, 0, sizeof(desc));
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for (desc.index = 0; xioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++) {
+        if (desc.pixelformat == V4L2_PIX_FMT_MJPEG)
+            *mjpeg = true;
+        for (size_t i = 0; i < best; i++) {
+            if (desc.pixelformat == yuv[i])
+                best = i;
+        }
+    }
+    if (best == ARRAY_SIZE(yuv))
+        return -ENODEV;
+    *yuv_fourcc = yuv[best];
+    return 0;
+}
+
+int V4L2Camera::enumerateSizes(int fd, uint32_t fourcc, int32_t *sizes,
+        int max)
+{
+    struct v4l2_frmsizeenum size;
+    int n = 0;
+
+    memset(&size, 0, sizeof(size));
+    size.pixel_format = fourcc;
+    for (size.index = 0; n < max &&
+            xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++) {
+        if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+            sizes[n * 2] = size.discrete.width;
+            sizes[n * 2 + 1] = size.discrete.height;
+            n++;
+        } else {
+            // Stepwise or continuous, only report the largest size
+            sizes[n * 2] = size.stepwise.max_width;
+            sizes[n * 2 + 1] = size.stepwise.max_height;
+            n++;
+            break;
+        }
+    }
+
+    // Largest first, by area
+    for (int i = 1; i < n; i++) {
+        for (int j = i; j > 0 && sizes[j * 2] * sizes[j * 2 + 1] >
+                sizes[j * 2 - 2] * sizes[j * 2 - 1]; j--) {
+            int32_t w = sizes[j * 2], h = sizes[j * 2 + 1];
+            sizes[j * 2] = sizes[j * 2 - 2];
+            sizes[j * 2 + 1] = sizes[j * 2 - 1];
+            sizes[j * 2 - 2] = w;
+            sizes[j * 2 - 1] = h;
+        }
+    }
+    return n;
+}
+
+camera_metadata_t *V4L2Camera::initStaticInfo()
+{
+    int32_t yuv_sizes[V4L2_MAX_SIZES * 2];
+    int32_t jpeg_sizes[V4L2_MAX_SIZES * 2];
+    int64_t durations[V4L2_MAX_SIZES];
+    int num_yuv = 0;
+    int num_jpeg = 0;
+    uint32_t yuv_fourcc;
+    bool mjpeg;
+
+    // The device may be streaming, query it through a node of its own
+    int fd = ::open(mPath, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        ALOGE("%s:%d: Failed to open %s: %s(%d)", __func__, mId, mPath,
+                strerror(errno), errno);
+        return NULL;
+    }
+    if (probeFormats(fd, &yuv_fourcc, &mjpeg) == 0) {
+        num_yuv = enumerateSizes(fd, yuv_fourcc, yuv_sizes, V4L2_MAX_SIZES);
+        if (mjpeg)
+            num_jpeg = enumerateSizes(fd, V4L2_PIX_FMT_MJPEG, jpeg_sizes,
+                    V4L2_MAX_SIZES);
+    }
+    ::close(fd);
+    if (num_yuv == 0) {
+        ALOGE("%s:%d: No usable frame size on %s", __func__, mId, mPath);
+        return NULL;
+    }
+    if (num_jpeg == 0) {
+        // Encoded in software from YUV frames
+        memcpy(jpeg_sizes, yuv_sizes, sizeof(yuv_sizes[0]) * num_yuv * 2);
+        num_jpeg = num_yuv;
+    }
+    for (int i = 0; i < V4L2_MAX_SIZES; i++)
+        durations[i] = V4L2_FRAME_DURATION;
+
+    // Sized for all of the entries below, so none of them reallocates
+    Metadata m(32, 1024);
+
+    /* android.control */
+    int32_t android_control_ae_available_target_fps_ranges[] = {30, 30};
+    m.addInt32(ANDROID_CONTROL_AE_AVAILABLE_TARGET_FPS_RANGES,
+            ARRAY_SIZE(android_control_ae_available_target_fps_ranges),
+            android_control_ae_available_target_fps_ranges);
+
+    int32_t android_control_ae_compensation_range[] = {0, 0};
+    m.addInt32(ANDROID_CONTROL_AE_COMPENSATION_RANGE,
+            ARRAY_SIZE(android_control_ae_compensation_range),
+            android_control_ae_compensation_range);
+
+    camera_metadata_rational_t android_control_ae_compensation_step[] = {{1,1}};
+    m.addRational(ANDROID_CONTROL_AE_COMPENSATION_STEP,
+            ARRAY_SIZE(android_control_ae_compensation_step),
+            android_control_ae_compensation_step);
+
+    int32_t android_control_max_regions[] = {/*AE*/ 0,/*AWB*/ 0,/*AF*/ 0};
+    m.addInt32(ANDROID_CONTROL_MAX_REGIONS,
+            ARRAY_SIZE(android_control_max_regions),
+            android_control_max_regions);
+
+    /* android.jpeg */
+    int32_t android_jpeg_available_thumbnail_sizes[] = {0, 0};
+    m.addInt32(ANDROID_JPEG_AVAILABLE_THUMBNAIL_SIZES,
+            ARRAY_SIZE(android_jpeg_available_thumbnail_sizes),
+            android_jpeg_available_thumbnail_sizes);
+
+    int32_t android_jpeg_max_size[] = {jpegMaxSize(jpeg_sizes[0],
+            jpeg_sizes[1])};
+    m.addInt32(ANDROID_JPEG_MAX_SIZE,
+            ARRAY_SIZE(android_jpeg_max_size),
+            android_jpeg_max_size);
+
+    /* android.lens */
+    float android_lens_info_available_focal_lengths[] = {1.0};
+    m.addFloat(ANDROID_LENS_INFO_AVAILABLE_FOCAL_LENGTHS,
+            ARRAY_SIZE(android_lens_info_available_focal_lengths),
+            android_lens_info_available_focal_lengths);
+
+    /* android.request */
+    int32_t android_request_max_num_output_streams[] = {0, 2, 1};
+    m.addInt32(ANDROID_REQUEST_MAX_NUM_OUTPUT_STREAMS,
+            ARRAY_SIZE(android_request_max_num_output_streams),
+            android_request_max_num_output_streams);
+
+    m.add1UInt8(ANDROID_REQUEST_PIPELINE_MAX_DEPTH, kPipelineMaxDepth);
+
+    /* android.scaler */
+    int32_t android_scaler_available_formats[] = {
+            HAL_PIXEL_FORMAT_BLOB,
+            HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED,
+            HAL_PIXEL_FORMAT_YCrCb_420_SP,
+            HAL_PIXEL_FORMAT_YCbCr_420_888};
+    m.addInt32(ANDROID_SCALER_AVAILABLE_FORMATS,
+            ARRAY_SIZE(android_scaler_available_formats),
+            android_scaler_available_formats);
+
+    m.addInt64(ANDROID_SCALER_AVAILABLE_JPEG_MIN_DURATIONS, num_jpeg,
+            durations);
+    m.addInt32(ANDROID_SCALER_AVAILABLE_JPEG_SIZES, num_jpeg * 2, jpeg_sizes);
+
+    float android_scaler_available_max_digital_zoom[] = {1};
+    m.addFloat(ANDROID_SCALER_AVAILABLE_MAX_DIGITAL_ZOOM,
+            ARRAY_SIZE(android_scaler_available_max_digital_zoom),
+            android_scaler_available_max_digital_zoom);
+
+    m.addInt64(ANDROID_SCALER_AVAILABLE_PROCESSED_MIN_DURATIONS, num_yuv,
+            durations);
+    m.addInt32(ANDROID_SCALER_AVAILABLE_PROCESSED_SIZES, num_yuv * 2,
+            yuv_sizes);
+
+    /* android.sensor */
+
+    int32_t android_sensor_info_active_array_size[] = {0, 0, yuv_sizes[0],
+            yuv_sizes[1]};
+    m.addInt32(ANDROID_SENSOR_INFO_ACTIVE_ARRAY_SIZE,
+            ARRAY_SIZE(android_sensor_info_active_array_size),
+            android_sensor_info_active_array_size);
+
+    int32_t android_sensor_info_sensitivity_range[] = {100, 100};
+    m.addInt32(ANDROID_SENSOR_INFO_SENSITIVITY_RANGE,
+            ARRAY_SIZE(android_sensor_info_sensitivity_range),
+            android_sensor_info_sensitivity_range);
+
+    int64_t android_sensor_info_max_frame_duration[] = {V4L2_FRAME_DURATION};
+    m.addInt64(ANDROID_SENSOR_INFO_MAX_FRAME_DURATION,
+            ARRAY_SIZE(android_sensor_info_max_frame_duration),
+            android_sensor_info_max_frame_duration);
+
+    // TODO: report the physical size of known sensors
+    float android_sensor_info_physical_size[] = {3.2, 2.4};
+    m.addFloat(ANDROID_SENSOR_INFO_PHYSICAL_SIZE,
+            ARRAY_SIZE(android_sensor_info_physical_size),
+            android_sensor_info_physical_size);
+
+    int32_t android_sensor_info_pixel_array_size[] = {yuv_sizes[0],
+            yuv_sizes[1]};
+    m.addInt32(ANDROID_SENSOR_INFO_PIXEL_ARRAY_SIZE,
+            ARRAY_SIZE(android_sensor_info_pixel_array_size),
+            android_sensor_info_pixel_array_size);
+
+    int32_t android_sensor_orientation[] = {0};
+    m.addInt32(ANDROID_SENSOR_ORIENTATION,
+            ARRAY_SIZE(android_sensor_orientation),
+            android_sensor_orientation);
+
+    /* End of static camera characteristics */
+
+    return clone_camera_metadata(m.get());
+}
+
+bool V4L2Camera::isValidCaptureSettings(const camera_metadata_t* /*settings*/)
+{
+    // TODO: reject settings that cannot be captured
+    return true;
+}
+
+int V4L2Camera::initDevice()
+{
+    int res;
+
+    mFd = ::open(mPath, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (mFd < 0) {
+        ALOGE("%s:%d: Failed to open %s: %s(%d)", __func__, mId, mPath,
+                strerror(errno), errno);
+        return -ENODEV;
+    }
+    res = probeFormats(mFd, &mYuvFourcc, &mMjpeg);
+    if (res) {
+        ALOGE("%s:%d: No supported capture format on %s", __func__, mId, mPath);
+        closeDevice();
+        return res;
+    }
+    return 0;
+}
+
+void V4L2Camera::closeDevice()
+{
+    stopStreaming();
+    mZeroCopyStream = NULL;
+    if (mFd >= 0)
+        ::close(mFd);
+    mFd = -1;
+}
+
+int V4L2Camera::initTemplates()
+{
+    static const struct {
+        int type;
+        uint8_t intent;
+    } templates[] = {
+        { CAMERA3_TEMPLATE_PREVIEW, ANDROID_CONTROL_CAPTURE_INTENT_PREVIEW },
+        { CAMERA3_TEMPLATE_STILL_CAPTURE,
+                ANDROID_CONTROL_CAPTURE_INTENT_STILL_CAPTURE },
+        { CAMERA3_TEMPLATE_VIDEO_RECORD,
+                ANDROID_CONTROL_CAPTURE_INTENT_VIDEO_RECORD },
+        { CAMERA3_TEMPLATE_VIDEO_SNAPSHOT,
+                ANDROID_CONTROL_CAPTURE_INTENT_VIDEO_SNAPSHOT },
+        { CAMERA3_TEMPLATE_ZERO_SHUTTER_LAG,
+                ANDROID_CONTROL_CAPTURE_INTENT_ZERO_SHUTTER_LAG },
+    };
+    int res;
+
+    // The device has no 3A controls, templates only differ in their intent
+    for (size_t i = 0; i < ARRAY_SIZE(templates); i++) {
+        Metadata m(2, 0);
+        res = m.add1UInt8(ANDROID_CONTROL_MODE, ANDROID_CONTROL_MODE_OFF);
+        if (res)
+            return res;
+        res = m.add1UInt8(ANDROID_CONTROL_CAPTURE_INTENT, templates[i].intent);
+        if (res)
+            return res;
+        res = setTemplate(templates[i].type, m.get());
+        if (res)
+            return res;
+    }
+    return 0;
+}
+
+int V4L2Camera::configureDevice(Stream **streams, int count)
+{
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t jpeg_width = 0;
+    uint32_t jpeg_height = 0;
+    int outputs = 0;
+    int jpegs = 0;
+    Stream *output = NULL;
+    int res;
+
+    ATRACE_CALL();
+
+    if (mFd < 0) {
+        ALOGE("%s:%d: Device not initialized", __func__, mId);
+        return -ENODEV;
+    }
+
+    // Capture at the largest size of the streams, others are scaled down
+    for (int i = 0; i < count; i++) {
+        if (!streams[i]->isOutputType())
+            continue;
+        outputs++;
+        output = streams[i];
+        uint32_t w = streams[i]->getWidth();
+        uint32_t h = streams[i]->getHeight();
+        if (streams[i]->getFormat() == HAL_PIXEL_FORMAT_BLOB) {
+            jpegs++;
+            if (w * h > jpeg_width * jpeg_height) {
+                jpeg_width = w;
+                jpeg_height = h;
+            }
+        } else if (w * h > width * height) {
+            width = w;
+            height = h;
+        }
+    }
+
+    stopStreaming();
+    mZeroCopyStream = NULL;
+
+    if (jpegs > 0 && outputs == jpegs && mMjpeg) {
+        // Only JPEG streams, take the JPEG frames of the device
+        res = setFormat(V4L2_PIX_FMT_MJPEG, jpeg_width, jpeg_height);
+    } else {
+        if (width == 0) {
+            width = jpeg_width;
+            height = jpeg_height;
+        }
+        res = setFormat(mYuvFourcc, width, height);
+    }
+    if (res)
+        return res;
+    // fillBuffer() has no JPEG decoder, MJPEG frames only go to BLOB streams
+    ALOG_ASSERT(mFourcc != V4L2_PIX_FMT_MJPEG || outputs == jpegs,
+            "MJPEG capture with %d non-BLOB outputs", outputs - jpegs);
+
+    // A single stream in the device format can be captured into directly
+    if (outputs == 1 && mFourcc == V4L2_PIX_FMT_NV21 &&
+            output->getFormat() == HAL_PIXEL_FORMAT_YCrCb_420_SP &&
+            output->getWidth() == mWidth && output->getHeight() == mHeight) {
+        mNextIndex = 0;
+        if (startStreaming(V4L2_MEMORY_DMABUF, V4L2_STREAM_BUFFERS) == 0) {
+            mZeroCopyStream = output->getStream();
+            ALOGV("%s:%d: Capturing %dx%d into output buffers", __func__, mId,
+                    mWidth, mHeight);
+            return 0;
+        }
+        ALOGW("%s:%d: No dmabuf import, copying frames", __func__, mId);
+    }
+    return startStreaming(V4L2_MEMORY_MMAP, V4L2_STREAM_BUFFERS);
+}
+
+int V4L2Camera::setFormat(uint32_t fourcc, uint32_t width, uint32_t height)
+{
+    struct v4l2_format fmt;
+    int res;
+
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = fourcc;
+    fmt.fmt.pix.field = V4L2_FIELD_ANY;
+    res = xioctl(mFd, VIDIOC_S_FMT, &fmt);
+    if (res) {
+        ALOGE("%s:%d: Failed to set format %dx%d: %s(%d)", __func__, mId,
+                width, height, strerror(-res), res);
+        return res;
+    }
+    if (fmt.fmt.pix.pixelformat != fourcc) {
+        ALOGE("%s:%d: Device refused format %08x", __func__, mId, fourcc);
+        return -EINVAL;
+    }
+
+    mFourcc = fourcc;
+    mWidth = fmt.fmt.pix.width;
+    mHeight = fmt.fmt.pix.height;
+    mBytesPerLine = fmt.fmt.pix.bytesperline;
+    if (mBytesPerLine == 0)
+        mBytesPerLine = fourcc == V4L2_PIX_FMT_YUYV ? mWidth * 2 : mWidth;
+    ALOGV("%s:%d: Capturing %dx%d (%d bytes per line) in %08x", __func__, mId,
+            mWidth, mHeight, mBytesPerLine, mFourcc);
+    return 0;
+}
+
+int V4L2Camera::startStreaming(uint32_t memory, uint32_t count)
+{
+    struct v4l2_requestbuffers req;
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int res;
+
+    memset(&req, 0, sizeof(req));
+    req.count = count < kMaxDriverBuffers ? count : kMaxDriverBuffers;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = memory;
+    res = xioctl(mFd, VIDIOC_REQBUFS, &req);
+    if (res)
+        return res;
+    if (req.count == 0)
+        return -ENOMEM;
+    mMemory = memory;
+    mNumBuffers = req.count < kMaxDriverBuffers ? req.count : kMaxDriverBuffers;
+
+    if (memory == V4L2_MEMORY_MMAP) {
+        for (uint32_t i = 0; i < mNumBuffers; i++) {
+            struct v4l2_buffer buf;
+            memset(&buf, 0, sizeof(buf));
+            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buf.memory = V4L2_MEMORY_MMAP;
+            buf.index = i;
+            res = xioctl(mFd, VIDIOC_QUERYBUF, &buf);
+            if (res)
+                goto err_out;
+            void *mapping = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, mFd,
+                    buf.m.offset);
+            if (mapping == MAP_FAILED) {
+                res = -errno;
+                goto err_out;
+            }
+            mMappings[i] = mapping;
+            mMappingSizes[i] = buf.length;
+            res = queueBuffer(i, -1);
+            if (res)
+                goto err_out;
+        }
+    }
+
+    res = xioctl(mFd, VIDIOC_STREAMON, &type);
+    if (res)
+        goto err_out;
+    return 0;
+
+err_out:
+    ALOGE("%s:%d: Failed to start streaming: %s(%d)", __func__, mId,
+            strerror(-res), res);
+    stopStreaming();
+    return res;
+}
+
+void V4L2Camera::stopStreaming()
+{
+    struct v4l2_requestbuffers req;
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (mMemory == 0)
+        return;
+
+    xioctl(mFd, VIDIOC_STREAMOFF, &type);
+    for (uint32_t i = 0; i < kMaxDriverBuffers; i++) {
+        if (mMappings[i] != NULL)
+            munmap(mMappings[i], mMappingSizes[i]);
+        mMappings[i] = NULL;
+        mMappingSizes[i] = 0;
+    }
+    memset(&req, 0, sizeof(req));
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = mMemory;
+    xioctl(mFd, VIDIOC_REQBUFS, &req);
+    mMemory = 0;
+    mNumBuffers = 0;
+    mHaveFrame = false;
+}
+
+int V4L2Camera::queueBuffer(uint32_t index, int fd)
+{
+    struct v4l2_buffer buf;
+
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = mMemory;
+    buf.index = index;
+    if (mMemory == V4L2_MEMORY_DMABUF)
+        buf.m.fd = fd;
+    return xioctl(mFd, VIDIOC_QBUF, &buf);
+}
+
+int V4L2Camera::dequeueBuffer()
+{
+    struct pollfd pfd;
+    int res;
+
+    ATRACE_CALL();
+
+    pfd.fd = mFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    do {
+        res = poll(&pfd, 1, V4L2_FRAME_TIMEOUT);
+    } while (res < 0 && errno == EINTR);
+    if (res == 0) {
+        ALOGE("%s:%d: Timeout waiting for a frame", __func__, mId);
+        return -ETIME;
+    } else if (res < 0) {
+        return -errno;
+    }
+
+    memset(&mFrame, 0, sizeof(mFrame));
+    mFrame.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    mFrame.memory = mMemory;
+    res = xioctl(mFd, VIDIOC_DQBUF, &mFrame);
+    if (res) {
+        ALOGE("%s:%d: Failed to dequeue a frame: %s(%d)", __func__, mId,
+                strerror(-res), res);
+        return res;
+    }
+    if (mFrame.flags & V4L2_BUF_FLAG_ERROR) {
+        ALOGE("%s:%d: Driver returned a corrupted frame", __func__, mId);
+        if (mMemory == V4L2_MEMORY_MMAP)
+            queueBuffer(mFrame.index, -1);
+        return -EIO;
+    }
+    mHaveFrame = true;
+    return 0;
+}
+
+int V4L2Camera::captureZeroCopy(CaptureRequest *request)
+{
+    uint32_t i;
+    int res;
+
+    for (i = 0; i < request->numOutputBuffers; i++) {
+        if (request->outputBuffers[i].stream == mZeroCopyStream)
+            break;
+    }
+    if (i == request->numOutputBuffers)
+        return -EINVAL;
+
+    // The driver writes the buffer, it must be free before it is queued
+    if (request->acquireFences[i] != -1) {
+        res = sync_wait(request->acquireFences[i], V4L2_SYNC_TIMEOUT);
+        if (res) {
+            ALOGE("%s:%d: Error waiting on buffer acquire fence: %s(%d)",
+                    __func__, mId, strerror(-res), res);
+            return res;
+        }
+        ::close(request->acquireFences[i]);
+        request->acquireFences[i] = -1;
+    }
+
+    // Queue every registered buffer in a driver buffer of its own, so the
+    // driver keeps its dmabuf imported and mapped from one frame to the next
+    uint32_t index = mNextIndex;
+    Stream *stream = findStream(mZeroCopyStream);
+    int registered = stream != NULL ?
+            stream->getBufferIndex(request->outputBuffers[i].buffer) : -ENOENT;
+    if (registered >= 0)
+        index = registered % mNumBuffers;
+    else
+        mNextIndex = (mNextIndex + 1) % mNumBuffers;
+
+    // Gralloc buffers carry their dmabuf as first fd
+    const native_handle_t *handle = *request->outputBuffers[i].buffer;
+    res = handle->numFds > 0 ? queueBuffer(index, handle->data[0]) : -EINVAL;
+    if (res) {
+        ALOGW("%s:%d: Driver refused output buffer (%d), copying frames",
+                __func__, mId, res);
+        stopStreaming();
+        mZeroCopyStream = NULL;
+        res = startStreaming(V4L2_MEMORY_MMAP, V4L2_STREAM_BUFFERS);
+        if (res)
+            return res;
+        return dequeueBuffer();
+    }
+    return dequeueBuffer();
+}
+
+int V4L2Camera::startCapture(CaptureRequest *request)
+{
+    struct timespec mono, boot;
+    int res;
+
+    ATRACE_CALL();
+
+    if (mMemory == 0) {
+        ALOGE("%s:%d: Device not streaming", __func__, mId);
+        return -ENODEV;
+    }
+    if (mZeroCopyStream != NULL)
+        res = captureZeroCopy(request);
+    else
+        res = dequeueBuffer();
+    if (res)
+        return res;
+
+    // Frames are stamped with CLOCK_MONOTONIC, shutters use CLOCK_BOOTTIME
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    request->timestamp = boot.tv_sec * 1000000000ULL + boot.tv_nsec;
+    if (mFrame.flags & V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        uint64_t frame = mFrame.timestamp.tv_sec * 1000000000ULL +
+                mFrame.timestamp.tv_usec * 1000ULL;
+        request->timestamp -= mono.tv_sec * 1000000000ULL + mono.tv_nsec;
+        request->timestamp += frame;
+    }
+    return 0;
+}
+
+int V4L2Camera::fillBuffer(CaptureRequest *request,
+        const camera3_stream_buffer_t *buffer)
+{
+    if (buffer->stream == mZeroCopyStream)
+        return 0; // Written by the driver in startCapture()
+    if (!mHaveFrame || mMemory != V4L2_MEMORY_MMAP)
+        return -ENODATA;
+    if (mFourcc == V4L2_PIX_FMT_MJPEG) {
+        // Only captured for BLOB streams, see configureDevice()
+        if (buffer->stream->format != HAL_PIXEL_FORMAT_BLOB) {
+            ALOGE("%s:%d: MJPEG frame for a stream of format %d", __func__,
+                    mId, buffer->stream->format);
+            return -EINVAL;
+        }
+        return mProcessor.writeJpeg(buffer, mMappings[mFrame.index],
+                mFrame.bytesused);
+    }
+    return copyFrame(request, buffer);
+}
+
+int V4L2Camera::copyFrame(CaptureRequest *request,
+        const camera3_stream_buffer_t *buffer)
+{
+    uint8_t *src = static_cast<uint8_t*>(mMappings[mFrame.index]);
+    size_t size = frameSize(mFourcc, mBytesPerLine, mHeight);
+    YuvImage frame;
+
+    if (size == 0 || mFrame.bytesused < size) {
+        ALOGE("%s:%d: Cannot convert %d bytes frame in %08x", __func__, mId,
+                mFrame.bytesused, mFourcc);
+        return -EINVAL;
+    }
+
+    // Describe the frame as 4:2:0, YUYV chroma is read every other line
+    frame.y = src;
+    frame.width = mWidth;
+    frame.height = mHeight;
+    frame.yStride = mBytesPerLine;
+    if (mFourcc == V4L2_PIX_FMT_YUYV) {
+        frame.cb = src + 1;
+        frame.cr = src + 3;
+        frame.yStep = 2;
+        frame.cStride = mBytesPerLine * 2;
+        frame.chromaStep = 4;
+    } else {
+        uint8_t *uv = src + mBytesPerLine * mHeight;
+        frame.cb = mFourcc == V4L2_PIX_FMT_NV21 ? uv + 1 : uv;
+        frame.cr = mFourcc == V4L2_PIX_FMT_NV21 ? uv : uv + 1;
+        frame.yStep = 1;
+        frame.cStride = mBytesPerLine;
+        frame.chromaStep = 2;
+    }
+    return mProcessor.fill(frame, buffer, request->settings);
+}
+
+void V4L2Camera::finishCapture(CaptureRequest* /*request*/)
+{
+    int res;
+
+    if (!mHaveFrame)
+        return;
+    mHaveFrame = false;
+    // Give the driver buffer back to fill with a later frame
+    if (mMemory == V4L2_MEMORY_MMAP) {
+        res = queueBuffer(mFrame.index, -1);
+        if (res)
+            ALOGE("%s:%d: Failed to requeue buffer %d: %s(%d)", __func__, mId,
+                    mFrame.index, strerror(-res), res);
+    }
+}
+
+} // namespace default_camera_hal
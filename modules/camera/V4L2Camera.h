@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef V4L2_CAMERA_H_
+#define V4L2_CAMERA_H_
+
+#include <linux/videodev2.h>
+#include <system/camera_metadata.h>
+#include "Camera.h"
+
+namespace default_camera_hal {
+// V4L2Camera is a camera backed by a Video4Linux2 streaming capture device,
+// such as a USB (UVC) camera or a simple CSI sensor. Frames are dequeued from
+// driver buffers and converted into the output buffers in software, except
+// when a single output stream matches the device format: its buffers are
+// then imported into the driver as dmabufs and captured into directly.
+class V4L2Camera : public Camera {
+    public:
+        // path is the device node, e.g. /dev/video0
+        V4L2Camera(int id, const char *path);
+        ~V4L2Camera();
+
+        // Returns true if path is a V4L2 streaming video capture device
+        static bool isCaptureDevice(const char *path);
+
+    private:
+        // Camera hooks, see Camera.h
+        camera_metadata_t *initStaticInfo();
+        bool isValidCaptureSettings(const camera_metadata_t *settings);
+        int initDevice();
+        void closeDevice();
+        int initTemplates();
+        int configureDevice(Stream **streams, int count);
+        int startCapture(CaptureRequest *request);
+        int fillBuffer(CaptureRequest *request,
+                const camera3_stream_buffer_t *buffer);
+        void finishCapture(CaptureRequest *request);
+
+        // Find the formats of the device: the YUV format frames are captured
+        // in and whether it also produces JPEG frames (V4L2_PIX_FMT_MJPEG)
+        static int probeFormats(int fd, uint32_t *yuv_fourcc, bool *mjpeg);
+        // Fill sizes with up to max width, height pairs fourcc is available
+        // in, largest first. Returns the number of pairs.
+        static int enumerateSizes(int fd, uint32_t fourcc, int32_t *sizes,
+                int max);
+        // Set the capture format, the driver may adjust the size
+        int setFormat(uint32_t fourcc, uint32_t width, uint32_t height);
+        // Allocate count driver buffers of the memory type and stream
+        int startStreaming(uint32_t memory, uint32_t count);
+        // Stop streaming and free the driver buffers
+        void stopStreaming();
+        // Queue driver buffer index, backed by dmabuf fd for DMABUF memory
+        int queueBuffer(uint32_t index, int fd);
+        // Wait for the next filled driver buffer and dequeue it into mFrame
+        int dequeueBuffer();
+        // Capture straight into the output buffer of mZeroCopyStream
+        int captureZeroCopy(CaptureRequest *request);
+        // Convert or encode the YUV frame in mFrame into an output buffer
+        int copyFrame(CaptureRequest *request,
+                const camera3_stream_buffer_t *buffer);
+
+        // Maximum number of driver buffers
+        static const uint32_t kMaxDriverBuffers = 8;
+
+        // Path of the device node
+        char *mPath;
+        // Device node, -1 when closed
+        int mFd;
+        // YUV format of the device and whether it can produce JPEG frames
+        uint32_t mYuvFourcc;
+        bool mMjpeg;
+        // Current capture format: V4L2_PIX_FMT_*, size and line stride
+        uint32_t mFourcc;
+        uint32_t mWidth;
+        uint32_t mHeight;
+        uint32_t mBytesPerLine;
+        // Memory type of the driver buffers, 0 when not streaming
+        uint32_t mMemory;
+        // Number of driver buffers
+        uint32_t mNumBuffers;
+        // Driver buffers mapped for V4L2_MEMORY_MMAP
+        void *mMappings[kMaxDriverBuffers];
+        size_t mMappingSizes[kMaxDriverBuffers];
+        // Output stream captured into directly, NULL to copy frames
+        camera3_stream_t *mZeroCopyStream;
+        // Driver buffer the next zero-copy capture of an unregistered buffer
+        // is queued in
+        uint32_t mNextIndex;
+        // Driver buffer holding the frame being captured, if mHaveFrame
+        struct v4l2_buffer mFrame;
+        bool mHaveFrame;
+};
+} // namespace default_camera_hal
+
+#endif // V4L2_CAMERA_H_
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <utils/Condition.h>
+#include <utils/Mutex.h>
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "WorkerPool"
+#include <cutils/log.h>
+
+#include "WorkerPool.h"
+
+namespace default_camera_hal {
+
+extern "C" {
+// Shim passed to pthread_create, calls back to the pool
+static void *worker_thread(void *arg)
+{
+    static_cast<WorkerPool*>(arg)->workerLoop();
+    return NULL;
+}
+} // extern "C"
+
+WorkerPool::WorkerPool()
+  : mThreads(NULL),
+    mNumThreads(0),
+    mFn(NULL),
+    mArg(NULL),
+    mParts(0),
+    mNextPart(0),
+    mPending(0),
+    mGeneration(0),
+    mStopping(false)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+    stop();
+}
+
+int WorkerPool::start(int num_threads)
+{
+    android::Mutex::Autolock rl(mRunLock);
+    int res;
+
+    if (mThreads != NULL) {
+        ALOGE("%s: Worker pool already started", __func__);
+        return -EINVAL;
+    }
+    if (num_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 1 ? cpus - 1 : 0;
+    }
+    if (num_threads == 0)
+        return 0;
+
+    mStopping = false;
+    mThreads = new pthread_t[num_threads];
+    for (mNumThreads = 0; mNumThreads < num_threads; mNumThreads++) {
+        res = pthread_create(&mThreads[mNumThreads], NULL, worker_thread, this);
+        if (res != 0) {
+            // Run with the threads started so far
+            ALOGW("%s: Failed to start worker thread: %s(%d)", __func__,
+                    strerror(res), res);
+            break;
+        }
+    }
+    ALOGV("%s: Started %d worker threads", __func__, mNumThreads);
+    return 0;
+}
+
+void WorkerPool::stop()
+{
+    android::Mutex::Autolock rl(mRunLock);
+
+    if (mThreads == NULL)
+        return;
+    mLock.lock();
+    mStopping = true;
+    mWork.broadcast();
+    mLock.unlock();
+    for (int i = 0; i < mNumThreads; i++)
+        pthread_join(mThreads[i], NULL);
+    delete [] mThreads;
+    mThreads = NULL;
+    mNumThreads = 0;
+}
+
+int WorkerPool::getParts()
+{
+    android::Mutex::Autolock rl(mRunLock);
+    return mNumThreads + 1;
+}
+
+void WorkerPool::run(void (*fn)(void *arg, int part, int parts), void *arg)
+{
+    android::Mutex::Autolock rl(mRunLock);
+
+    if (mNumThreads == 0) {
+        fn(arg, 0, 1);
+        return;
+    }
+
+    android::Mutex::Autolock al(mLock);
+    mFn = fn;
+    mArg = arg;
+    mParts = mNumThreads + 1;
+    mNextPart = 0;
+    mPending = mParts;
+    mGeneration++;
+    mWork.broadcast();
+    runParts_L();
+    while (mPending > 0)
+        mDone.wait(mLock);
+}
+
+void WorkerPool::workerLoop()
+{
+    android::Mutex::Autolock al(mLock);
+    unsigned int generation = mGeneration;
+
+    while (true) {
+        while (!mStopping && generation == mGeneration)
+            mWork.wait(mLock);
+        if (mStopping)
+            return;
+        generation = mGeneration;
+        runParts_L();
+    }
+}
+
+void WorkerPool::runParts_L()
+{
+    while (mNextPart < mParts) {
+        int part = mNextPart++;
+        mLock.unlock();
+        mFn(mArg, part, mParts);
+        mLock.lock();
+        if (--mPending == 0)
+            mDone.signal();
+    }
+}
+
+} // namespace default_camera_hal
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <pthread.h>
+#include <utils/Condition.h>
+#include <utils/Mutex.h>
+
+namespace default_camera_hal {
+// WorkerPool runs data parallel work, such as converting the rows of a frame,
+// on a set of threads started once, with the calling thread taking a part of
+// the work too.
+class WorkerPool {
+    public:
+        WorkerPool();
+        ~WorkerPool();
+
+        // Start num_threads worker threads, 0 for one per other online CPU
+        int start(int num_threads);
+        // Stop and join the worker threads, run() then runs on the caller
+        void stop();
+        // Number of parts run() splits work in
+        int getParts();
+        // Call fn(arg, part, parts) once for each part, in parallel, and
+        // return once every call returned
+        void run(void (*fn)(void *arg, int part, int parts), void *arg);
+
+        // Body of the worker threads
+        void workerLoop();
+
+    private:
+        // Run the parts of the current work not taken yet, mLock held
+        void runParts_L();
+
+        // Worker threads
+        pthread_t *mThreads;
+        int mNumThreads;
+        // Current work, valid while mPending > 0
+        void (*mFn)(void *arg, int part, int parts);
+        void *mArg;
+        int mParts;
+        // Next part to run, and number of parts not returned yet
+        int mNextPart;
+        int mPending;
+        // Incremented for every work, tells workers there is new work
+        unsigned int mGeneration;
+        // Workers must exit
+        bool mStopping;
+        // Lock protecting the current work
+        android::Mutex mLock;
+        // Signalled when there is new work, and when stopping
+        android::Condition mWork;
+        // Signalled when the last part returned
+        android::Condition mDone;
+        // Lock serializing run() callers
+        android::Mutex mRunLock;
+};
+} // namespace default_camera_hal
+
+#endif // WORKER_POOL_H_
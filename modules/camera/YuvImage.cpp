@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <system/graphics.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define USE_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SSE 1
+#endif
+
+#include "YuvImage.h"
+
+namespace default_camera_hal {
+
+void initYuvImage(YuvImage *image, const struct android_ycbcr *ycbcr,
+        uint32_t width, uint32_t height)
+{
+    image->y = static_cast<uint8_t*>(ycbcr->y);
+    image->cb = static_cast<uint8_t*>(ycbcr->cb);
+    image->cr = static_cast<uint8_t*>(ycbcr->cr);
+    image->width = width;
+    image->height = height;
+    image->yStride = ycbcr->ystride;
+    image->yStep = 1;
+    image->cStride = ycbcr->cstride;
+    image->chromaStep = ycbcr->chroma_step;
+}
+
+size_t yuvImageSize(uint32_t width, uint32_t height)
+{
+    return (size_t)width * height + 2 * (size_t)((width + 1) / 2) *
+            ((height + 1) / 2);
+}
+
+void initYuvImage(YuvImage *image, uint8_t *data, uint32_t width,
+        uint32_t height)
+{
+    image->y = data;
+    image->cb = data + (size_t)width * height;
+    image->cr = image->cb + (size_t)((width + 1) / 2) * ((height + 1) / 2);
+    image->width = width;
+    image->height = height;
+    image->yStride = width;
+    image->yStep = 1;
+    image->cStride = (width + 1) / 2;
+    image->chromaStep = 1;
+}
+
+/*
+ * Vector kernels of the unscaled line copies. They process as many samples as
+ * they can in whole vectors and return that count, the rest is left to the
+ * scalar loops.
+ */
+
+// Split n pairs of interleaved bytes: even bytes to a, odd bytes to b
+static size_t deinterleave(const uint8_t *src, uint8_t *a, uint8_t *b,
+        size_t n)
+{
+    size_t done = 0;
+#if defined(USE_NEON)
+    for (; done + 16 <= n; done += 16) {
+        uint8x16x2_t in = vld2q_u8(src + done * 2);
+        vst1q_u8(a + done, in.val[0]);
+        vst1q_u8(b + done, in.val[1]);
+    }
+#elif defined(USE_SSE)
+    const __m128i mask = _mm_set1_epi16(0xff);
+    for (; done + 16 <= n; done += 16) {
+        __m128i low = _mm_loadu_si128((const __m128i *)(src + done * 2));
+        __m128i high = _mm_loadu_si128((const __m128i *)(src + done * 2 + 16));
+        _mm_storeu_si128((__m128i *)(a + done), _mm_packus_epi16(
+                _mm_and_si128(low, mask), _mm_and_si128(high, mask)));
+        _mm_storeu_si128((__m128i *)(b + done), _mm_packus_epi16(
+                _mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8)));
+    }
+#endif
+    for (; done < n; done++) {
+        a[done] = src[done * 2];
+        b[done] = src[done * 2 + 1];
+    }
+    return done;
+}
+
+// Interleave n bytes of a and b, a first
+static size_t interleave(const uint8_t *a, const uint8_t *b, uint8_t *dst,
+        size_t n)
+{
+    size_t done = 0;
+#if defined(USE_NEON)
+    for (; done + 16 <= n; done += 16) {
+        uint8x16x2_t out;
+        out.val[0] = vld1q_u8(a + done);
+        out.val[1] = vld1q_u8(b + done);
+        vst2q_u8(dst + done * 2, out);
+    }
+#elif defined(USE_SSE)
+    for (; done + 16 <= n; done += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + done));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + done));
+        _mm_storeu_si128((__m128i *)(dst + done * 2), _mm_unpacklo_epi8(va, vb));
+        _mm_storeu_si128((__m128i *)(dst + done * 2 + 16),
+                _mm_unpackhi_epi8(va, vb));
+    }
+#endif
+    for (; done < n; done++) {
+        dst[done * 2] = a[done];
+        dst[done * 2 + 1] = b[done];
+    }
+    return done;
+}
+
+// Swap the bytes of n pairs, NV12 to NV21 and back
+static size_t swapPairs(const uint8_t *src, uint8_t *dst, size_t n)
+{
+    size_t done = 0;
+#if defined(USE_NEON)
+    for (; done + 8 <= n; done += 8)
+        vst1q_u8(dst + done * 2, vrev16q_u8(vld1q_u8(src + done * 2)));
+#elif defined(USE_SSE)
+    for (; done + 8 <= n; done += 8) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(src + done * 2));
+        _mm_storeu_si128((__m128i *)(dst + done * 2),
+                _mm_or_si128(_mm_slli_epi16(in, 8), _mm_srli_epi16(in, 8)));
+    }
+#endif
+    for (; done < n; done++) {
+        dst[done * 2] = src[done * 2 + 1];
+        dst[done * 2 + 1] = src[done * 2];
+    }
+    return done;
+}
+
+// Copy a line of n luma samples yStep bytes apart into contiguous bytes
+static void copyLuma(const uint8_t *src, uint32_t step, uint8_t *dst,
+        uint32_t n)
+{
+    if (step == 1) {
+        memcpy(dst, src, n);
+        return;
+    }
+    if (step == 2) {
+        // YUYV, the chroma bytes in between are dropped
+        size_t done = 0;
+#if defined(USE_NEON)
+        for (; done + 16 <= n; done += 16)
+            vst1q_u8(dst + done, vld2q_u8(src + done * 2).val[0]);
+#elif defined(USE_SSE)
+        const __m128i mask = _mm_set1_epi16(0xff);
+        for (; done + 16 <= n; done += 16) {
+            __m128i low = _mm_loadu_si128((const __m128i *)(src + done * 2));
+            __m128i high = _mm_loadu_si128((const __m128i *)(src + done * 2 +
+                    16));
+            _mm_storeu_si128((__m128i *)(dst + done), _mm_packus_epi16(
+                    _mm_and_si128(low, mask), _mm_and_si128(high, mask)));
+        }
+#endif
+        for (; done < n; done++)
+            dst[done] = src[done * 2];
+        return;
+    }
+    for (uint32_t i = 0; i < n; i++)
+        dst[i] = src[i * step];
+}
+
+// Copy a line of n chroma sample pairs between chroma layouts
+static void copyChroma(const uint8_t *scb, const uint8_t *scr, uint32_t sstep,
+        uint8_t *dcb, uint8_t *dcr, uint32_t dstep, uint32_t n)
+{
+    if (n == 0)
+        return;
+    if (sstep == 1 && dstep == 1) {
+        memcpy(dcb, scb, n);
+        memcpy(dcr, scr, n);
+        return;
+    }
+    if (sstep == 2 && dstep == 2) {
+        bool same_order = (scr > scb) == (dcr > dcb);
+        uint8_t *d = dcr > dcb ? dcb : dcr;
+        const uint8_t *s = scr > scb ? scb : scr;
+        if (same_order)
+            memcpy(d, s, n * 2);
+        else
+            swapPairs(s, d, n);
+        return;
+    }
+    if (sstep == 2 && dstep == 1) {
+        if (scr > scb)
+            deinterleave(scb, dcb, dcr, n);
+        else
+            deinterleave(scr, dcr, dcb, n);
+        return;
+    }
+    if (sstep == 1 && dstep == 2) {
+        if (dcr > dcb)
+            interleave(scb, scr, dcb, n);
+        else
+            interleave(scr, scb, dcr, n);
+        return;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        dcb[i * dstep] = scb[i * sstep];
+        dcr[i * dstep] = scr[i * sstep];
+    }
+}
+
+void scaleYuvImage(const YuvImage &src, const YuvImage &dst,
+        uint32_t first_line, uint32_t lines)
+{
+    uint32_t last_line = first_line + lines;
+    bool unscaled_x = src.width == dst.width;
+    // 16.16 fixed point source positions
+    uint32_t x_step = (src.width << 16) / dst.width;
+    uint32_t chroma_width = (dst.width + 1) / 2;
+
+    if (last_line > dst.height)
+        last_line = dst.height;
+
+    for (uint32_t y = first_line; y < last_line; y++) {
+        uint32_t sy = (uint64_t)y * src.height / dst.height;
+        const uint8_t *s = src.y + sy * src.yStride;
+        uint8_t *d = dst.y + y * dst.yStride;
+        if (unscaled_x) {
+            copyLuma(s, src.yStep, d, dst.width);
+        } else {
+            uint32_t sx = 0;
+            for (uint32_t x = 0; x < dst.width; x++, sx += x_step)
+                d[x] = s[(sx >> 16) * src.yStep];
+        }
+    }
+
+    for (uint32_t cy = first_line / 2; cy < (last_line + 1) / 2; cy++) {
+        uint32_t sy = (uint64_t)cy * 2 * src.height / dst.height / 2;
+        const uint8_t *scb = src.cb + sy * src.cStride;
+        const uint8_t *scr = src.cr + sy * src.cStride;
+        uint8_t *dcb = dst.cb + cy * dst.cStride;
+        uint8_t *dcr = dst.cr + cy * dst.cStride;
+        if (unscaled_x) {
+            copyChroma(scb, scr, src.chromaStep, dcb, dcr, dst.chromaStep,
+                    chroma_width);
+        } else {
+            uint32_t sx = 0;
+            for (uint32_t x = 0; x < chroma_width; x++, sx += x_step * 2) {
+                uint32_t i = (sx >> 17) * src.chromaStep;
+                dcb[x * dst.chromaStep] = scb[i];
+                dcr[x * dst.chromaStep] = scr[i];
+            }
+        }
+    }
+}
+
+void paintColorBars(const YuvImage &dst, uint32_t offset, uint32_t first_line,
+        uint32_t lines)
+{
+    // BT.601 white, yellow, cyan, green, magenta, red, blue, black
+    static const uint8_t kBars[][3] = {
+        { 235, 128, 128 }, { 210, 16, 146 }, { 170, 166, 16 },
+        { 145, 54, 34 }, { 106, 202, 222 }, { 81, 90, 240 },
+        { 41, 240, 110 }, { 16, 128, 128 },
+    };
+    static const uint32_t kNumBars = sizeof(kBars) / sizeof(kBars[0]);
+    uint32_t last_line = first_line + lines;
+    uint32_t chroma_width = (dst.width + 1) / 2;
+
+    if (last_line > dst.height)
+        last_line = dst.height;
+    if (first_line >= last_line)
+        return;
+
+    // Every line is the same, paint the first and copy it
+    uint8_t *line = dst.y + first_line * dst.yStride;
+    for (uint32_t x = 0; x < dst.width; x++)
+        line[x] = kBars[(x + offset) % dst.width * kNumBars / dst.width][0];
+    for (uint32_t y = first_line + 1; y < last_line; y++)
+        memcpy(dst.y + y * dst.yStride, line, dst.width);
+
+    uint32_t cy = first_line / 2;
+    uint8_t *cb = dst.cb + cy * dst.cStride;
+    uint8_t *cr = dst.cr + cy * dst.cStride;
+    for (uint32_t x = 0; x < chroma_width; x++) {
+        const uint8_t *bar = kBars[(x * 2 + offset) % dst.width * kNumBars /
+                dst.width];
+        cb[x * dst.chromaStep] = bar[1];
+        cr[x * dst.chromaStep] = bar[2];
+    }
+    for (cy++; cy < (last_line + 1) / 2; cy++)
+        copyChroma(cb, cr, dst.chromaStep, dst.cb + cy * dst.cStride,
+                dst.cr + cy * dst.cStride, dst.chromaStep, chroma_width);
+}
+
+} // namespace default_camera_hal
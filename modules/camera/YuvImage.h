@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef YUV_IMAGE_H_
+#define YUV_IMAGE_H_
+
+#include <stdint.h>
+#include <system/graphics.h>
+
+namespace default_camera_hal {
+// YuvImage describes a YCbCr 4:2:0 image by its planes, as android_ycbcr
+// does, plus a luma step so that packed 4:2:2 frames can be read as 4:2:0:
+// for YUYV, y steps by 2, cb and cr by 4 and the chroma stride skips every
+// other line.
+struct YuvImage {
+    uint8_t *y;
+    uint8_t *cb;
+    uint8_t *cr;
+    uint32_t width;
+    uint32_t height;
+    // Bytes between lines and between pixels of the luma plane
+    uint32_t yStride;
+    uint32_t yStep;
+    // Bytes between lines and between samples of the chroma planes, a chroma
+    // sample covering 2x2 pixels
+    uint32_t cStride;
+    uint32_t chromaStep;
+};
+
+// Describe a buffer locked with gralloc lock_ycbcr
+void initYuvImage(YuvImage *image, const struct android_ycbcr *ycbcr,
+        uint32_t width, uint32_t height);
+// Describe a planar (I420) image in memory of at least yuvImageSize() bytes
+void initYuvImage(YuvImage *image, uint8_t *data, uint32_t width,
+        uint32_t height);
+size_t yuvImageSize(uint32_t width, uint32_t height);
+
+// Scale src into lines [first_line, first_line + lines) of dst, by nearest
+// neighbour, first_line even. dst must have a luma step of 1.
+void scaleYuvImage(const YuvImage &src, const YuvImage &dst,
+        uint32_t first_line, uint32_t lines);
+// Paint colour bars into lines [first_line, first_line + lines) of dst,
+// first_line even, scrolled by offset pixels. dst must have a luma step of 1.
+void paintColorBars(const YuvImage &dst, uint32_t offset, uint32_t first_line,
+        uint32_t lines);
+} // namespace default_camera_hal
+
+#endif // YUV_IMAGE_H_
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFDROID_CAMERA_PROTOCOL_H_
+#define SFDROID_CAMERA_PROTOCOL_H_
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * Protocol between the camera HAL and the camera bridge of the Sailfish
+ * camera stack, on the socket SFDROID_CAMERA_SOCKET_NAME in /tmp/sfdroid.
+ *
+ * Every request is a sfdroid_camera_request_t. SFDROID_CAMERA_OP_INFO is
+ * answered with a sfdroid_camera_info_t and may be sent on a connection
+ * of its own. A stream is a connection: SFDROID_CAMERA_OP_START is
+ * answered with a sfdroid_camera_reply_t carrying the format frames come
+ * in, then every SFDROID_CAMERA_OP_CAPTURE with a sfdroid_camera_frame_t.
+ * Closing the socket stops the stream.
+ *
+ * Frames are in buffers of the server, passed once each: a frame with
+ * SFDROID_CAMERA_FRAME_NEW_BUFFER carries the fd of buffer index, which
+ * the HAL maps for the rest of the stream. The server does not write a
+ * buffer again until the HAL gives it back with SFDROID_CAMERA_OP_RELEASE.
+ *
+ * For zero copy, a capture request may carry the dmabuf of the output
+ * buffer to fill; the server either writes the frame into it and answers
+ * with SFDROID_CAMERA_FRAME_INTO, or answers with -EINVAL if it cannot
+ * write that buffer, e.g. because its stride differs from the frames'.
+ */
+#define SFDROID_CAMERA_SOCKET_NAME  "camera_handle"
+
+#define SFDROID_CAMERA_MAGIC    0x53464341  /* 'SFCA' */
+#define SFDROID_CAMERA_VERSION  1
+
+#define SFDROID_CAMERA_MAX_SIZES    16
+
+/* request.camera: describe that camera */
+#define SFDROID_CAMERA_OP_INFO      1
+/* request.camera, width, height, format: start streaming */
+#define SFDROID_CAMERA_OP_START     2
+/* the next frame; request.index is the slot of the attached output buffer */
+#define SFDROID_CAMERA_OP_CAPTURE   3
+/* request.index: the HAL is done with the frame in that buffer, no answer */
+#define SFDROID_CAMERA_OP_RELEASE   4
+
+/* sfdroid_camera_frame_t.flags */
+#define SFDROID_CAMERA_FRAME_NEW_BUFFER     0x01
+#define SFDROID_CAMERA_FRAME_INTO           0x02
+
+typedef struct sfdroid_camera_request_t {
+    uint32_t magic;
+    /* SFDROID_CAMERA_OP_* */
+    uint32_t op;
+    uint32_t camera;
+    uint32_t index;
+    uint32_t width;
+    uint32_t height;
+    /* a fourcc of linux/videodev2.h: V4L2_PIX_FMT_NV21, NV12 or YUYV */
+    uint32_t format;
+    uint32_t reserved;
+} sfdroid_camera_request_t;
+
+typedef struct sfdroid_camera_info_t {
+    uint32_t magic;
+    /* 0, or -ENODEV if there is no such camera */
+    int32_t status;
+    uint32_t version;
+    uint32_t num_cameras;
+    /* CAMERA_FACING_* of hardware/camera_common.h */
+    uint32_t facing;
+    /* degrees the image must be rotated clockwise to be upright */
+    uint32_t orientation;
+    /* the fourcc frames are natively in */
+    uint32_t format;
+    uint32_t num_sizes;
+    /* width, height pairs */
+    uint32_t sizes[SFDROID_CAMERA_MAX_SIZES * 2];
+    int64_t frame_duration_ns;
+} sfdroid_camera_info_t;
+
+typedef struct sfdroid_camera_reply_t {
+    uint32_t magic;
+    /* 0, or -errno if the stream can't be started */
+    int32_t status;
+    /* of every frame of the stream, the server may pick another size */
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    /* bytes between lines, of the luma plane for planar formats */
+    uint32_t stride;
+    uint32_t reserved[2];
+} sfdroid_camera_reply_t;
+
+typedef struct sfdroid_camera_frame_t {
+    uint32_t magic;
+    /* 0, or -errno if there is no frame */
+    int32_t status;
+    /* server buffer the frame is in, unless SFDROID_CAMERA_FRAME_INTO */
+    uint32_t index;
+    uint32_t flags;
+    /* bytes of the frame, and of the buffer to map with NEW_BUFFER */
+    uint32_t size;
+    uint32_t reserved;
+    /* start of exposure, CLOCK_MONOTONIC */
+    int64_t timestamp_ns;
+} sfdroid_camera_frame_t;
+
+__END_DECLS
+
+#endif /* SFDROID_CAMERA_PROTOCOL_H_ */
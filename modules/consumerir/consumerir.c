@@ -16,13 +16,47 @@
 #define LOG_TAG "ConsumerIrHal"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 #include <cutils/log.h>
+#include <cutils/properties.h>
 #include <hardware/hardware.h>
 #include <hardware/consumerir.h>
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
 
+/*
+ * Patterns are sent by a worker thread of the device, in the order they
+ * were queued by transmit() or transmit_async(): transmit() waits for its
+ * own to be sent, transmit_async() does not.
+ *
+ * The LIRC transmitter, ro.consumerir.device or /dev/lirc0, takes a
+ * pattern as an odd number of non-zero pulse and space durations, which
+ * the pattern of the framework is compiled to: entries of zero merge the
+ * periods around them, a leading space is slept off before and a trailing
+ * one after, so that the gap between repeats is kept. Remote controls
+ * resend the same few patterns again and again, so the compiled patterns
+ * are cached. Without a transmitter, sending is simulated by sleeping.
+ */
+
+/* the few LIRC ioctls used, as in linux/lirc.h */
+#ifndef LIRC_SET_SEND_CARRIER
+#define LIRC_GET_FEATURES       _IOR('i', 0x00000000, uint32_t)
+#define LIRC_SET_SEND_CARRIER   _IOW('i', 0x00000013, uint32_t)
+#define LIRC_CAN_SEND_PULSE     0x00000002
+#endif
+
+#define IR_DEFAULT_DEVICE       "/dev/lirc0"
+/* transmissions queued at most, beyond which transmit_async() fails */
+#define IR_QUEUE_SIZE           16
+#define IR_CACHE_SIZE           8
+
 static const consumerir_freq_range_t consumerir_freqs[] = {
     {.min = 30000, .max = 30000},
     {.min = 33000, .max = 33000},
@@ -32,22 +66,329 @@ static const consumerir_freq_range_t consumerir_freqs[] = {
     {.min = 56000, .max = 56000},
 };
 
-static int consumerir_transmit(struct consumerir_device *dev __unused,
-   int carrier_freq, const int pattern[], int pattern_len)
+/* a pattern compiled for the transmitter, shared by the cache and jobs */
+typedef struct ir_pattern {
+    int carrier_freq;
+    uint32_t hash;
+    /* the pattern as given, to tell cached ones apart */
+    int *source;
+    int source_len;
+    /* pulse, space, ..., pulse, in us */
+    unsigned *durations;
+    int count;
+    unsigned lead_us;
+    unsigned tail_us;
+    unsigned refs;
+    uint64_t last_used;
+} ir_pattern_t;
+
+/* what transmit() waits on */
+typedef struct ir_sync {
+    int done;
+    int status;
+} ir_sync_t;
+
+typedef struct ir_job {
+    int id;
+    ir_pattern_t *pattern;
+    consumerir_transmit_callback_t callback;
+    void *cookie;
+    ir_sync_t *sync;
+} ir_job_t;
+
+typedef struct ir_device {
+    consumerir_device_t device;
+
+    /* the LIRC transmitter, -1 to simulate, worker thread only */
+    int fd;
+    int carrier_freq;
+
+    pthread_mutex_t lock;
+    /* a job was queued or the device is closing */
+    pthread_cond_t queued_cond;
+    /* a job was sent */
+    pthread_cond_t done_cond;
+    pthread_t worker;
+    int exiting;
+
+    /* everything below is protected by lock */
+    ir_job_t queue[IR_QUEUE_SIZE];
+    int queue_head;
+    int queue_count;
+    int next_id;
+
+    ir_pattern_t *cache[IR_CACHE_SIZE];
+    uint64_t use_clock;
+} ir_device_t;
+
+/** PATTERNS **/
+
+static uint32_t pattern_hash(int carrier_freq, const int pattern[], int pattern_len)
 {
-    int total_time = 0;
-    long i;
+    /* FNV-1a */
+    uint32_t hash = 2166136261u ^ (uint32_t)carrier_freq;
+    int i;
 
-    for (i = 0; i < pattern_len; i++)
-        total_time += pattern[i];
+    for (i = 0; i < pattern_len; i++) {
+        hash ^= (uint32_t)pattern[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void pattern_free(ir_pattern_t *p)
+{
+    free(p->source);
+    free(p->durations);
+    free(p);
+}
+
+static ir_pattern_t *pattern_compile(int carrier_freq, const int pattern[],
+        int pattern_len, uint32_t hash)
+{
+    ir_pattern_t *p = calloc(1, sizeof(*p));
+    int i;
 
-    /* simulate the time spent transmitting by sleeping */
-    ALOGD("transmit for %d uS at %d Hz", total_time, carrier_freq);
-    usleep(total_time);
+    if (!p)
+        return NULL;
+    p->source = malloc(pattern_len * sizeof(*p->source) + 1);
+    p->durations = malloc(pattern_len * sizeof(*p->durations) + 1);
+    if (!p->source || !p->durations) {
+        pattern_free(p);
+        return NULL;
+    }
+    memcpy(p->source, pattern, pattern_len * sizeof(*p->source));
+    p->source_len = pattern_len;
+    p->carrier_freq = carrier_freq;
+    p->hash = hash;
+
+    for (i = 0; i < pattern_len; i++) {
+        unsigned us = pattern[i];
+        int pulse = (i & 1) == 0;
+
+        if (us == 0)
+            continue;
+        if (p->count == 0 && !pulse) {
+            /* the carrier is off already */
+            p->lead_us += us;
+        } else if (p->count > 0 && ((p->count - 1) & 1) == !pulse) {
+            /* the previous entry was zero, merge the periods around it */
+            p->durations[p->count - 1] += us;
+        } else {
+            p->durations[p->count++] = us;
+        }
+    }
+    /* the driver ends on a pulse and turns the carrier off after it */
+    if (p->count > 0 && (p->count & 1) == 0)
+        p->tail_us = p->durations[--p->count];
+
+    return p;
+}
+
+static void pattern_put_l(ir_pattern_t *p)
+{
+    if (--p->refs == 0)
+        pattern_free(p);
+}
+
+/* the compiled pattern, from the cache if it was sent lately */
+static ir_pattern_t *pattern_get_l(ir_device_t *ir, int carrier_freq,
+        const int pattern[], int pattern_len)
+{
+    uint32_t hash = pattern_hash(carrier_freq, pattern, pattern_len);
+    ir_pattern_t *p;
+    int i, slot = 0;
+
+    for (i = 0; i < IR_CACHE_SIZE; i++) {
+        p = ir->cache[i];
+        if (!p) {
+            slot = i;
+            continue;
+        }
+        if (p->hash == hash && p->carrier_freq == carrier_freq &&
+                p->source_len == pattern_len &&
+                memcmp(p->source, pattern, pattern_len * sizeof(*pattern)) == 0) {
+            p->last_used = ++ir->use_clock;
+            p->refs++;
+            return p;
+        }
+        if (ir->cache[slot] && p->last_used < ir->cache[slot]->last_used)
+            slot = i;
+    }
+
+    p = pattern_compile(carrier_freq, pattern, pattern_len, hash);
+    if (!p)
+        return NULL;
+    if (ir->cache[slot])
+        pattern_put_l(ir->cache[slot]);
+    ir->cache[slot] = p;
+    p->last_used = ++ir->use_clock;
+    /* one for the cache, one for the caller */
+    p->refs = 2;
+    return p;
+}
+
+/** TRANSMISSION **/
+
+static void sleep_us(unsigned us)
+{
+    struct timespec ts;
+
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+static int ir_send(ir_device_t *ir, const ir_pattern_t *p)
+{
+    if (p->lead_us)
+        sleep_us(p->lead_us);
 
+    if (ir->fd >= 0 && p->count > 0) {
+        size_t bytes = p->count * sizeof(*p->durations);
+        ssize_t written;
+
+        if (ir->carrier_freq != p->carrier_freq) {
+            uint32_t carrier = p->carrier_freq;
+            if (ioctl(ir->fd, LIRC_SET_SEND_CARRIER, &carrier) < 0) {
+                ALOGE("can't transmit at %d Hz: %s", p->carrier_freq, strerror(errno));
+                return -errno;
+            }
+            ir->carrier_freq = p->carrier_freq;
+        }
+        /* returns once the driver sent it all */
+        written = TEMP_FAILURE_RETRY(write(ir->fd, p->durations, bytes));
+        if (written < 0) {
+            ALOGE("transmit failed: %s", strerror(errno));
+            return -errno;
+        }
+        if ((size_t)written != bytes)
+            return -EIO;
+    } else if (p->count > 0) {
+        unsigned total_us = 0;
+        int i;
+
+        for (i = 0; i < p->count; i++)
+            total_us += p->durations[i];
+        /* simulate the time spent transmitting by sleeping */
+        ALOGD("transmit for %u uS at %d Hz", total_us, p->carrier_freq);
+        sleep_us(total_us);
+    }
+
+    if (p->tail_us)
+        sleep_us(p->tail_us);
     return 0;
 }
 
+static void *ir_worker(void *arg)
+{
+    ir_device_t *ir = arg;
+
+    pthread_mutex_lock(&ir->lock);
+    for (;;) {
+        ir_job_t job;
+        int status;
+
+        while (!ir->queue_count && !ir->exiting)
+            pthread_cond_wait(&ir->queued_cond, &ir->lock);
+        if (!ir->queue_count)
+            break;
+
+        job = ir->queue[ir->queue_head];
+        ir->queue_head = (ir->queue_head + 1) % IR_QUEUE_SIZE;
+        ir->queue_count--;
+
+        if (ir->exiting) {
+            status = -ECANCELED;
+        } else {
+            pthread_mutex_unlock(&ir->lock);
+            status = ir_send(ir, job.pattern);
+            pthread_mutex_lock(&ir->lock);
+        }
+        pattern_put_l(job.pattern);
+
+        if (job.sync) {
+            job.sync->status = status;
+            job.sync->done = 1;
+        }
+        pthread_cond_broadcast(&ir->done_cond);
+
+        if (job.callback) {
+            pthread_mutex_unlock(&ir->lock);
+            job.callback(&ir->device, job.id, status, job.cookie);
+            pthread_mutex_lock(&ir->lock);
+        }
+    }
+    pthread_mutex_unlock(&ir->lock);
+
+    return NULL;
+}
+
+/* queues a job, called with lock held, returns its id */
+static int ir_queue_l(ir_device_t *ir, int carrier_freq, const int pattern[],
+        int pattern_len, consumerir_transmit_callback_t callback, void *cookie,
+        ir_sync_t *sync)
+{
+    ir_job_t *job;
+    ir_pattern_t *p;
+    int i;
+
+    for (i = 0; i < pattern_len; i++) {
+        if (pattern[i] < 0)
+            return -EINVAL;
+    }
+    p = pattern_get_l(ir, carrier_freq, pattern, pattern_len);
+    if (!p)
+        return -ENOMEM;
+
+    job = &ir->queue[(ir->queue_head + ir->queue_count) % IR_QUEUE_SIZE];
+    ir->queue_count++;
+    if (++ir->next_id <= 0)
+        ir->next_id = 1;
+    job->id = ir->next_id;
+    job->pattern = p;
+    job->callback = callback;
+    job->cookie = cookie;
+    job->sync = sync;
+    pthread_cond_signal(&ir->queued_cond);
+
+    return job->id;
+}
+
+static int consumerir_transmit(struct consumerir_device *dev,
+   int carrier_freq, const int pattern[], int pattern_len)
+{
+    ir_device_t *ir = (ir_device_t *)dev;
+    ir_sync_t sync = { 0, 0 };
+    int ret;
+
+    pthread_mutex_lock(&ir->lock);
+    while (ir->queue_count == IR_QUEUE_SIZE)
+        pthread_cond_wait(&ir->done_cond, &ir->lock);
+    ret = ir_queue_l(ir, carrier_freq, pattern, pattern_len, NULL, NULL, &sync);
+    while (ret > 0 && !sync.done)
+        pthread_cond_wait(&ir->done_cond, &ir->lock);
+    pthread_mutex_unlock(&ir->lock);
+
+    return ret > 0 ? sync.status : ret;
+}
+
+static int consumerir_transmit_async(struct consumerir_device *dev,
+   int carrier_freq, const int pattern[], int pattern_len,
+   consumerir_transmit_callback_t callback, void *cookie)
+{
+    ir_device_t *ir = (ir_device_t *)dev;
+    int ret = -EAGAIN;
+
+    pthread_mutex_lock(&ir->lock);
+    if (ir->queue_count < IR_QUEUE_SIZE)
+        ret = ir_queue_l(ir, carrier_freq, pattern, pattern_len, callback, cookie, NULL);
+    pthread_mutex_unlock(&ir->lock);
+
+    return ret;
+}
+
 static int consumerir_get_num_carrier_freqs(struct consumerir_device *dev __unused)
 {
     return ARRAY_SIZE(consumerir_freqs);
@@ -63,9 +404,50 @@ static int consumerir_get_carrier_freqs(struct consumerir_device *dev __unused,
     return to_copy;
 }
 
+/* the LIRC transmitter, -1 if there is none that sends pulses */
+static int ir_open_transmitter(void)
+{
+    char path[PROPERTY_VALUE_MAX];
+    uint32_t features = 0;
+    int fd;
+
+    property_get("ro.consumerir.device", path, IR_DEFAULT_DEVICE);
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        ALOGI("no transmitter at %s, simulating it", path);
+        return -1;
+    }
+    if (ioctl(fd, LIRC_GET_FEATURES, &features) < 0 ||
+            !(features & LIRC_CAN_SEND_PULSE)) {
+        ALOGW("%s can't send pulses, simulating it", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 static int consumerir_close(hw_device_t *dev)
 {
-    free(dev);
+    ir_device_t *ir = (ir_device_t *)dev;
+    int i;
+
+    /* what is still queued is cancelled */
+    pthread_mutex_lock(&ir->lock);
+    ir->exiting = 1;
+    pthread_cond_signal(&ir->queued_cond);
+    pthread_mutex_unlock(&ir->lock);
+    pthread_join(ir->worker, NULL);
+
+    for (i = 0; i < IR_CACHE_SIZE; i++) {
+        if (ir->cache[i])
+            pattern_put_l(ir->cache[i]);
+    }
+    if (ir->fd >= 0)
+        close(ir->fd);
+    pthread_cond_destroy(&ir->done_cond);
+    pthread_cond_destroy(&ir->queued_cond);
+    pthread_mutex_destroy(&ir->lock);
+    free(ir);
     return 0;
 }
 
@@ -83,17 +465,36 @@ static int consumerir_open(const hw_module_t* module, const char* name,
         return -EINVAL;
     }
 
-    consumerir_device_t *dev = malloc(sizeof(consumerir_device_t));
-    memset(dev, 0, sizeof(consumerir_device_t));
+    ir_device_t *ir = malloc(sizeof(ir_device_t));
+    if (ir == NULL)
+        return -ENOMEM;
+    memset(ir, 0, sizeof(ir_device_t));
 
+    consumerir_device_t *dev = &ir->device;
     dev->common.tag = HARDWARE_DEVICE_TAG;
-    dev->common.version = 0;
+    dev->common.version = CONSUMERIR_DEVICE_API_VERSION_1_1;
     dev->common.module = (struct hw_module_t*) module;
     dev->common.close = consumerir_close;
 
     dev->transmit = consumerir_transmit;
     dev->get_num_carrier_freqs = consumerir_get_num_carrier_freqs;
     dev->get_carrier_freqs = consumerir_get_carrier_freqs;
+    dev->transmit_async = consumerir_transmit_async;
+
+    ir->fd = ir_open_transmitter();
+    pthread_mutex_init(&ir->lock, NULL);
+    pthread_cond_init(&ir->queued_cond, NULL);
+    pthread_cond_init(&ir->done_cond, NULL);
+    if (pthread_create(&ir->worker, NULL, ir_worker, ir) != 0) {
+        ALOGE("can't start the transmit thread");
+        if (ir->fd >= 0)
+            close(ir->fd);
+        pthread_cond_destroy(&ir->done_cond);
+        pthread_cond_destroy(&ir->queued_cond);
+        pthread_mutex_destroy(&ir->lock);
+        free(ir);
+        return -ENOMEM;
+    }
 
     *device = (hw_device_t*) dev;
     return 0;
@@ -20,9 +20,10 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE_RELATIVE_PATH := hw
-LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_SHARED_LIBRARIES := liblog libcutils libsync libion
 
 LOCAL_SRC_FILES := 	\
+	allocator.cpp 	\
 	gralloc.cpp 	\
 	framebuffer.cpp \
 	mapper.cpp
@@ -32,5 +33,8 @@ LOCAL_CFLAGS:= -DLOG_TAG=\"gralloc\" -Wno-missing-field-initializers
 ifeq ($(TARGET_USE_PAN_DISPLAY),true)
 LOCAL_CFLAGS += -DUSE_PAN_DISPLAY=1
 endif
+ifneq ($(TARGET_GRALLOC_STRIDE_ALIGNMENT),)
+LOCAL_CFLAGS += -DGRALLOC_STRIDE_ALIGNMENT=$(TARGET_GRALLOC_STRIDE_ALIGNMENT)
+endif
 
 include $(BUILD_SHARED_LIBRARY)
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include <linux/types.h>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include <ion/ion.h>
+
+#include <hardware/gralloc.h>
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*
+ * Heaps buffers are allocated from, per usage class. Buffers are ashmem
+ * unless ro.gralloc.heap.<class> (class as in usageClassName()) names
+ * another heap, so that buffers the GPU, the host renderer of sharebuffer
+ * or a camera DMA engine works on can be imported without a copy:
+ *
+ *   ashmem                   the default
+ *   dmabuf:<name>            the dma-buf heap /dev/dma_heap/<name>, e.g.
+ *                            dmabuf:system or dmabuf:linux,cma for
+ *                            physically contiguous memory
+ *   ion:<heap mask>[:flags]  ION, for kernels without dma-buf heaps
+ *
+ * A heap that fails to allocate falls back to ashmem with a warning, so a
+ * misconfigured device keeps working with the copies it had before.
+ */
+
+/* the uapi of linux/dma-heap.h and linux/dma-buf.h, newer than our headers */
+struct gralloc_dma_heap_allocation_data {
+    __u64 len;
+    __u32 fd;
+    __u32 fd_flags;
+    __u64 heap_flags;
+};
+#define GRALLOC_DMA_HEAP_IOCTL_ALLOC \
+        _IOWR('H', 0x0, struct gralloc_dma_heap_allocation_data)
+
+struct gralloc_dma_buf_sync {
+    __u64 flags;
+};
+#define GRALLOC_DMA_BUF_SYNC_READ   (1 << 0)
+#define GRALLOC_DMA_BUF_SYNC_WRITE  (2 << 0)
+#define GRALLOC_DMA_BUF_SYNC_START  (0 << 2)
+#define GRALLOC_DMA_BUF_SYNC_END    (1 << 2)
+#define GRALLOC_DMA_BUF_IOCTL_SYNC \
+        _IOW('b', 0, struct gralloc_dma_buf_sync)
+
+enum {
+    HEAP_ASHMEM,
+    HEAP_DMABUF,
+    HEAP_ION,
+};
+
+struct heap_t {
+    int type;
+    // the opened heap or ION device
+    int fd;
+    unsigned int ionHeapMask;
+    unsigned int ionFlags;
+};
+
+static pthread_once_t sHeapsOnce = PTHREAD_ONCE_INIT;
+static heap_t sHeaps[USAGE_CLASS_COUNT];
+/* shared by every class using ION */
+static int sIonFd = -1;
+
+static void heap_parse(heap_t* heap, const char* cls, const char* value)
+{
+    heap->type = HEAP_ASHMEM;
+    heap->fd = -1;
+
+    if (!strncmp(value, "dmabuf:", 7)) {
+        char path[PROPERTY_VALUE_MAX + 16];
+        snprintf(path, sizeof(path), "/dev/dma_heap/%s", value + 7);
+        heap->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (heap->fd < 0) {
+            ALOGE("couldn't open %s for %s buffers (%s)", path, cls,
+                    strerror(errno));
+            return;
+        }
+        heap->type = HEAP_DMABUF;
+    } else if (!strncmp(value, "ion:", 4)) {
+        char* end;
+        heap->ionHeapMask = strtoul(value + 4, &end, 0);
+        heap->ionFlags = *end == ':' ? strtoul(end + 1, NULL, 0) : 0;
+        if (sIonFd < 0)
+            sIonFd = ion_open();
+        if (sIonFd < 0) {
+            ALOGE("couldn't open ION for %s buffers", cls);
+            return;
+        }
+        heap->fd = sIonFd;
+        heap->type = HEAP_ION;
+    } else if (strcmp(value, "ashmem")) {
+        ALOGE("unknown heap \"%s\" for %s buffers, using ashmem", value, cls);
+    }
+}
+
+static void heaps_init()
+{
+    char name[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    for (int c = 0; c < USAGE_CLASS_COUNT; c++) {
+        snprintf(name, sizeof(name), "ro.gralloc.heap.%s", usageClassName(c));
+        property_get(name, value, "ashmem");
+        heap_parse(&sHeaps[c], usageClassName(c), value);
+    }
+}
+
+int allocHeapRegion(size_t size, int usage)
+{
+    pthread_once(&sHeapsOnce, heaps_init);
+    heap_t const* heap = &sHeaps[usageClass(usage)];
+    int fd = -1;
+
+    switch (heap->type) {
+        case HEAP_DMABUF: {
+            gralloc_dma_heap_allocation_data data;
+            memset(&data, 0, sizeof(data));
+            data.len = size;
+            data.fd_flags = O_RDWR | O_CLOEXEC;
+            if (ioctl(heap->fd, GRALLOC_DMA_HEAP_IOCTL_ALLOC, &data) == 0)
+                fd = data.fd;
+            break;
+        }
+        case HEAP_ION:
+            if (ion_alloc_fd(heap->fd, size, 0, heap->ionHeapMask,
+                    heap->ionFlags, &fd) < 0)
+                fd = -1;
+            break;
+        default:
+            return -1;
+    }
+
+    ALOGW_IF(fd < 0, "heap of %s buffers couldn't allocate %zu bytes (%s), "
+            "using ashmem", usageClassName(usageClass(usage)), size,
+            strerror(errno));
+    return fd;
+}
+
+void syncHeapRegion(private_handle_t const* hnd, int usage, bool start)
+{
+    if (!(hnd->flags & private_handle_t::PRIV_FLAGS_DMABUF))
+        return;
+
+    gralloc_dma_buf_sync sync;
+    sync.flags = start ? GRALLOC_DMA_BUF_SYNC_START : GRALLOC_DMA_BUF_SYNC_END;
+    if (usage & GRALLOC_USAGE_SW_READ_MASK)
+        sync.flags |= GRALLOC_DMA_BUF_SYNC_READ;
+    if (usage & GRALLOC_USAGE_SW_WRITE_MASK)
+        sync.flags |= GRALLOC_DMA_BUF_SYNC_WRITE;
+    // ION buffers of older kernels don't know the ioctl and are coherent
+    if (ioctl(hnd->fd, GRALLOC_DMA_BUF_IOCTL_SYNC, &sync) < 0 &&
+            errno != ENOTTY) {
+        ALOGW("couldn't sync buffer %p for the CPU (%s)", hnd, strerror(errno));
+    }
+}
@@ -32,6 +32,7 @@
 
 #include <cutils/log.h>
 #include <cutils/atomic.h>
+#include <cutils/properties.h>
 
 #if HAVE_ANDROID_OS
 #include <linux/fb.h>
@@ -49,8 +50,15 @@
 #define USE_PAN_DISPLAY 0
 #endif
 
-// numbers of buffers for page flipping
-#define NUM_BUFFERS 2
+// numbers of buffers for page flipping, overridden by ro.gralloc.fb_buffers;
+// fewer are used if the driver can't provide them
+#ifndef NUM_BUFFERS
+#define NUM_BUFFERS 3
+#endif
+
+#ifndef FBIO_WAITFORVSYNC
+#define FBIO_WAITFORVSYNC _IOW('F', 0x20, __u32)
+#endif
 
 
 enum {
@@ -58,12 +66,245 @@ enum {
     LOCKED = 0x00000002
 };
 
+/*
+ * A copy of a posted buffer into the front buffer, for framebuffers that
+ * can't flip. Only the update rectangle is copied, row by row, so that
+ * buffers with an other stride or an other 32 bit channel order than the
+ * framebuffer, or 32 bit buffers on a RGB 565 framebuffer, get through
+ * without an intermediate copy.
+ */
+struct blit_job_t {
+    buffer_handle_t buffer;
+    const uint8_t* src;
+    uint8_t* dst;
+    size_t srcStride;       // bytes
+    size_t dstStride;       // bytes
+    int srcFormat;
+    int dstFormat;
+    int l, t, r, b;
+};
+
 struct fb_context_t {
     framebuffer_device_t  device;
+    // HAL_PIXEL_FORMAT_* of the framebuffer
+    int format;
+
+    // rectangle of the next post to copy, see fb_setUpdateRect()
+    bool hasUpdateRect;
+    int updateL, updateT, updateR, updateB;
+
+    /*
+     * Copies run on blitThread when ro.gralloc.fb_async_copy is set, so
+     * fb_post() returns while the front buffer is written and only the
+     * next post waits for it. Off by default: the compositor may render
+     * into the previous buffer as soon as the next one is posted.
+     */
+    bool asyncCopy;
+    pthread_t blitThread;
+    pthread_mutex_t blitLock;
+    pthread_cond_t blitCond;
+    bool blitPending;
+    bool blitExit;
+    blit_job_t blitJob;
+
+    /*
+     * With 3 or more buffers flips are queued to flipThread, which pans
+     * at the next vsync, so fb_post() returns while the previous frame is
+     * still scanned out. At most one flip is queued: the compositor renders
+     * into the oldest free buffer, which is off screen once the flip queued
+     * before it completed, so the next post waits for that one.
+     */
+    bool asyncFlip;
+    pthread_t flipThread;
+    pthread_mutex_t flipLock;
+    pthread_cond_t flipCond;
+    buffer_handle_t flipPending;
+    bool flipExit;
 };
 
 /*****************************************************************************/
 
+static inline uint16_t to_rgb565(uint32_t pixel, bool bgra)
+{
+    // in memory order, R G B X (little endian) unless bgra
+    uint32_t r = bgra ? (pixel >> 16) & 0xff : pixel & 0xff;
+    uint32_t g = (pixel >> 8) & 0xff;
+    uint32_t b = bgra ? pixel & 0xff : (pixel >> 16) & 0xff;
+    return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+}
+
+static inline bool is_bgra(int format)
+{
+    return format == HAL_PIXEL_FORMAT_BGRA_8888;
+}
+
+/*
+ * The loops below have no dependency between pixels and are written for
+ * the compiler to vectorize them (NEON, SSE2); same format rows go through
+ * memcpy, which the C library already implements with vector stores.
+ */
+static void blit_rows(const blit_job_t& job)
+{
+    const int width = job.r - job.l;
+    const uint8_t* src = job.src + job.t * job.srcStride;
+    uint8_t* dst = job.dst + job.t * job.dstStride;
+
+    if (job.dstFormat == HAL_PIXEL_FORMAT_RGB_565) {
+        const bool bgra = is_bgra(job.srcFormat);
+        if (job.srcFormat == HAL_PIXEL_FORMAT_RGB_565) {
+            for (int y = job.t; y < job.b; y++, src += job.srcStride, dst += job.dstStride)
+                memcpy(dst + job.l * 2, src + job.l * 2, width * 2);
+            return;
+        }
+        for (int y = job.t; y < job.b; y++, src += job.srcStride, dst += job.dstStride) {
+            const uint32_t* s = (const uint32_t*)src + job.l;
+            uint16_t* d = (uint16_t*)dst + job.l;
+            for (int x = 0; x < width; x++)
+                d[x] = to_rgb565(s[x], bgra);
+        }
+        return;
+    }
+
+    if (is_bgra(job.srcFormat) != is_bgra(job.dstFormat)) {
+        // swap R and B
+        for (int y = job.t; y < job.b; y++, src += job.srcStride, dst += job.dstStride) {
+            const uint32_t* s = (const uint32_t*)src + job.l;
+            uint32_t* d = (uint32_t*)dst + job.l;
+            for (int x = 0; x < width; x++) {
+                uint32_t p = s[x];
+                d[x] = (p & 0xff00ff00) | ((p & 0xff) << 16) | ((p >> 16) & 0xff);
+            }
+        }
+        return;
+    }
+
+    for (int y = job.t; y < job.b; y++, src += job.srcStride, dst += job.dstStride)
+        memcpy(dst + job.l * 4, src + job.l * 4, width * 4);
+}
+
+static void blit_finish(fb_context_t* ctx, const blit_job_t& job)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            ctx->device.common.module);
+    m->base.unlock(&m->base, job.buffer);
+    m->base.unlock(&m->base, m->framebuffer);
+}
+
+static void* blit_thread(void* arg)
+{
+    fb_context_t* ctx = (fb_context_t*)arg;
+
+    pthread_mutex_lock(&ctx->blitLock);
+    while (true) {
+        while (!ctx->blitPending && !ctx->blitExit)
+            pthread_cond_wait(&ctx->blitCond, &ctx->blitLock);
+        if (!ctx->blitPending)
+            break;
+        blit_job_t job = ctx->blitJob;
+        pthread_mutex_unlock(&ctx->blitLock);
+
+        blit_rows(job);
+        blit_finish(ctx, job);
+
+        pthread_mutex_lock(&ctx->blitLock);
+        ctx->blitPending = false;
+        pthread_cond_broadcast(&ctx->blitCond);
+    }
+    pthread_mutex_unlock(&ctx->blitLock);
+    return NULL;
+}
+
+// waits for the copy of the previous post, called with blitLock held
+static void blit_wait_locked(fb_context_t* ctx)
+{
+    while (ctx->blitPending)
+        pthread_cond_wait(&ctx->blitCond, &ctx->blitLock);
+}
+
+static int bytes_per_pixel(int format)
+{
+    return format == HAL_PIXEL_FORMAT_RGB_565 ? 2 : 4;
+}
+
+static int fb_copy(fb_context_t* ctx, private_module_t* m,
+        private_handle_t const* hnd)
+{
+    int srcFormat = hnd->format ? hnd->format : ctx->format;
+    switch (srcFormat) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+        case HAL_PIXEL_FORMAT_RGB_565:
+            break;
+        default:
+            ALOGE("can't copy buffers of format %d to the framebuffer", srcFormat);
+            return -EINVAL;
+    }
+    if (srcFormat == HAL_PIXEL_FORMAT_RGB_565 &&
+            ctx->format != HAL_PIXEL_FORMAT_RGB_565) {
+        ALOGE("can't copy RGB 565 buffers to a 32 bit framebuffer");
+        return -EINVAL;
+    }
+
+    blit_job_t job;
+    job.buffer = hnd;
+    job.srcFormat = srcFormat;
+    job.dstFormat = ctx->format;
+    job.dstStride = m->finfo.line_length;
+    job.srcStride = hnd->stride ? hnd->stride * bytes_per_pixel(srcFormat) :
+            job.dstStride;
+    job.l = 0;
+    job.t = 0;
+    job.r = m->info.xres;
+    job.b = m->info.yres;
+    if (hnd->width && hnd->height) {
+        job.r = hnd->width < job.r ? hnd->width : job.r;
+        job.b = hnd->height < job.b ? hnd->height : job.b;
+    }
+    if (ctx->hasUpdateRect) {
+        // only this area of the buffer is valid
+        job.l = ctx->updateL;
+        job.t = ctx->updateT;
+        job.r = ctx->updateR < job.r ? ctx->updateR : job.r;
+        job.b = ctx->updateB < job.b ? ctx->updateB : job.b;
+        ctx->hasUpdateRect = false;
+    }
+    if (job.l >= job.r || job.t >= job.b)
+        return 0;
+
+    void* fb_vaddr;
+    void* buffer_vaddr;
+
+    m->base.lock(&m->base, m->framebuffer,
+            GRALLOC_USAGE_SW_WRITE_RARELY,
+            job.l, job.t, job.r - job.l, job.b - job.t,
+            &fb_vaddr);
+
+    m->base.lock(&m->base, hnd,
+            GRALLOC_USAGE_SW_READ_OFTEN,
+            job.l, job.t, job.r - job.l, job.b - job.t,
+            &buffer_vaddr);
+
+    job.src = (const uint8_t*)buffer_vaddr;
+    job.dst = (uint8_t*)fb_vaddr;
+
+    if (!ctx->asyncCopy) {
+        blit_rows(job);
+        blit_finish(ctx, job);
+        return 0;
+    }
+
+    pthread_mutex_lock(&ctx->blitLock);
+    blit_wait_locked(ctx);
+    ctx->blitJob = job;
+    ctx->blitPending = true;
+    pthread_cond_broadcast(&ctx->blitCond);
+    pthread_mutex_unlock(&ctx->blitLock);
+    return 0;
+}
+
+/*****************************************************************************/
+
 static int fb_setSwapInterval(struct framebuffer_device_t* dev,
             int interval)
 {
@@ -86,9 +327,76 @@ static int fb_setUpdateRect(struct framebuffer_device_t* dev,
     m->info.reserved[0] = 0x54445055; // "UPDT";
     m->info.reserved[1] = (uint16_t)l | ((uint32_t)t << 16);
     m->info.reserved[2] = (uint16_t)(l+w) | ((uint32_t)(t+h) << 16);
+    ctx->hasUpdateRect = true;
+    ctx->updateL = l;
+    ctx->updateT = t;
+    ctx->updateR = l + w;
+    ctx->updateB = t + h;
+    return 0;
+}
+
+static int fb_flip(private_module_t* m, buffer_handle_t buffer)
+{
+    private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(buffer);
+    const size_t offset = hnd->base - m->framebuffer->base;
+    m->info.activate = FB_ACTIVATE_VBL;
+    m->info.yoffset = offset / m->finfo.line_length;
+    if (ioctl(m->framebuffer->fd, FBIOPUT_VSCREENINFO, &m->info) == -1) {
+        ALOGE("FBIOPUT_VSCREENINFO failed");
+        return -errno;
+    }
     return 0;
 }
 
+int fb_wait_vsync(private_module_t* m, int64_t* timestamp)
+{
+    if (!m->framebuffer)
+        return -ENODEV;
+
+    uint32_t crtc = 0;
+    if (ioctl(m->framebuffer->fd, FBIO_WAITFORVSYNC, &crtc) == -1)
+        return -errno;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    *timestamp = int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+    return 0;
+}
+
+static void* flip_thread(void* arg)
+{
+    fb_context_t* ctx = (fb_context_t*)arg;
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            ctx->device.common.module);
+    bool waitForVsync = true;
+
+    pthread_mutex_lock(&ctx->flipLock);
+    while (true) {
+        while (!ctx->flipPending && !ctx->flipExit)
+            pthread_cond_wait(&ctx->flipCond, &ctx->flipLock);
+        if (!ctx->flipPending)
+            break;
+        buffer_handle_t buffer = ctx->flipPending;
+        pthread_mutex_unlock(&ctx->flipLock);
+
+        fb_flip(m, buffer);
+        // FB_ACTIVATE_VBL doesn't block on every driver, the flip is only
+        // done and the previous buffer off screen after the vsync
+        int64_t timestamp;
+        if (waitForVsync && fb_wait_vsync(m, &timestamp) < 0) {
+            ALOGW("FBIO_WAITFORVSYNC failed (%s), flips may not wait for "
+                    "vsync", strerror(errno));
+            waitForVsync = false;
+        }
+
+        pthread_mutex_lock(&ctx->flipLock);
+        ctx->flipPending = NULL;
+        pthread_cond_broadcast(&ctx->flipCond);
+    }
+    pthread_mutex_unlock(&ctx->flipLock);
+    return NULL;
+}
+
 static int fb_post(struct framebuffer_device_t* dev, buffer_handle_t buffer)
 {
     if (private_handle_t::validate(buffer) < 0)
@@ -101,37 +409,25 @@ static int fb_post(struct framebuffer_device_t* dev, buffer_handle_t buffer)
             dev->common.module);
 
     if (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER) {
-        const size_t offset = hnd->base - m->framebuffer->base;
-        m->info.activate = FB_ACTIVATE_VBL;
-        m->info.yoffset = offset / m->finfo.line_length;
-        if (ioctl(m->framebuffer->fd, FBIOPUT_VSCREENINFO, &m->info) == -1) {
-            ALOGE("FBIOPUT_VSCREENINFO failed");
-            m->base.unlock(&m->base, buffer); 
-            return -errno;
+        if (ctx->asyncFlip) {
+            pthread_mutex_lock(&ctx->flipLock);
+            while (ctx->flipPending)
+                pthread_cond_wait(&ctx->flipCond, &ctx->flipLock);
+            ctx->flipPending = buffer;
+            pthread_cond_broadcast(&ctx->flipCond);
+            pthread_mutex_unlock(&ctx->flipLock);
+        } else {
+            int err = fb_flip(m, buffer);
+            if (err < 0) {
+                m->base.unlock(&m->base, buffer); 
+                return err;
+            }
         }
         m->currentBuffer = buffer;
         
     } else {
         // If we can't do the page_flip, just copy the buffer to the front 
-        // FIXME: use copybit HAL instead of memcpy
-        
-        void* fb_vaddr;
-        void* buffer_vaddr;
-        
-        m->base.lock(&m->base, m->framebuffer, 
-                GRALLOC_USAGE_SW_WRITE_RARELY, 
-                0, 0, m->info.xres, m->info.yres,
-                &fb_vaddr);
-
-        m->base.lock(&m->base, buffer, 
-                GRALLOC_USAGE_SW_READ_RARELY, 
-                0, 0, m->info.xres, m->info.yres,
-                &buffer_vaddr);
-
-        memcpy(fb_vaddr, buffer_vaddr, m->finfo.line_length * m->info.yres);
-        
-        m->base.unlock(&m->base, buffer); 
-        m->base.unlock(&m->base, m->framebuffer); 
+        return fb_copy(ctx, m, hnd);
     }
     
     return 0;
@@ -179,21 +475,33 @@ int mapFrameBufferLocked(struct private_module_t* module)
     info.activate = FB_ACTIVATE_NOW;
 
     /*
-     * Request NUM_BUFFERS screens (at lest 2 for page flipping)
+     * Request NUM_BUFFERS screens (at lest 2 for page flipping), then
+     * fewer until the driver accepts
      */
-    info.yres_virtual = info.yres * NUM_BUFFERS;
-
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.gralloc.fb_buffers", value, "0");
+    int numBuffers = atoi(value);
+    if (numBuffers < 2 || numBuffers > 32)
+        numBuffers = NUM_BUFFERS;
 
     uint32_t flags = PAGE_FLIP;
+    for (;; numBuffers--) {
+        info.yres_virtual = info.yres * numBuffers;
 #if USE_PAN_DISPLAY
-    if (ioctl(fd, FBIOPAN_DISPLAY, &info) == -1) {
-        ALOGW("FBIOPAN_DISPLAY failed, page flipping not supported");
+        if (ioctl(fd, FBIOPAN_DISPLAY, &info) != -1)
+            break;
+        if (numBuffers <= 2) {
+            ALOGW("FBIOPAN_DISPLAY failed, page flipping not supported");
 #else
-    if (ioctl(fd, FBIOPUT_VSCREENINFO, &info) == -1) {
-        ALOGW("FBIOPUT_VSCREENINFO failed, page flipping not supported");
+        if (ioctl(fd, FBIOPUT_VSCREENINFO, &info) != -1)
+            break;
+        if (numBuffers <= 2) {
+            ALOGW("FBIOPUT_VSCREENINFO failed, page flipping not supported");
 #endif
-        info.yres_virtual = info.yres;
-        flags &= ~PAGE_FLIP;
+            info.yres_virtual = info.yres;
+            flags &= ~PAGE_FLIP;
+            break;
+        }
     }
 
     if (info.yres_virtual < info.yres * 2) {
@@ -314,6 +622,26 @@ static int fb_close(struct hw_device_t *dev)
 {
     fb_context_t* ctx = (fb_context_t*)dev;
     if (ctx) {
+        if (ctx->asyncFlip) {
+            // finishes the pending flip first
+            pthread_mutex_lock(&ctx->flipLock);
+            ctx->flipExit = true;
+            pthread_cond_broadcast(&ctx->flipCond);
+            pthread_mutex_unlock(&ctx->flipLock);
+            pthread_join(ctx->flipThread, NULL);
+            pthread_cond_destroy(&ctx->flipCond);
+            pthread_mutex_destroy(&ctx->flipLock);
+        }
+        if (ctx->asyncCopy) {
+            // finishes the pending copy first
+            pthread_mutex_lock(&ctx->blitLock);
+            ctx->blitExit = true;
+            pthread_cond_broadcast(&ctx->blitCond);
+            pthread_mutex_unlock(&ctx->blitLock);
+            pthread_join(ctx->blitThread, NULL);
+            pthread_cond_destroy(&ctx->blitCond);
+            pthread_mutex_destroy(&ctx->blitLock);
+        }
         free(ctx);
     }
     return 0;
@@ -354,6 +682,26 @@ int fb_device_open(hw_module_t const* module, const char* name,
             const_cast<float&>(dev->device.fps) = m->fps;
             const_cast<int&>(dev->device.minSwapInterval) = 1;
             const_cast<int&>(dev->device.maxSwapInterval) = 1;
+            dev->format = format;
+            if ((m->flags & PAGE_FLIP) && m->numBuffers >= 3) {
+                pthread_mutex_init(&dev->flipLock, NULL);
+                pthread_cond_init(&dev->flipCond, NULL);
+                dev->asyncFlip = pthread_create(&dev->flipThread, NULL,
+                        flip_thread, dev) == 0;
+            }
+            if (!(m->flags & PAGE_FLIP)) {
+                // posts are copied, only the update rectangle needs to be
+                dev->device.setUpdateRect = fb_setUpdateRect;
+
+                char value[PROPERTY_VALUE_MAX];
+                property_get("ro.gralloc.fb_async_copy", value, "0");
+                if (atoi(value)) {
+                    pthread_mutex_init(&dev->blitLock, NULL);
+                    pthread_cond_init(&dev->blitCond, NULL);
+                    dev->asyncCopy = pthread_create(&dev->blitThread, NULL,
+                            blit_thread, dev) == 0;
+                }
+            }
             *device = &dev->device.common;
         }
     }
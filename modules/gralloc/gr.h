@@ -36,9 +36,145 @@ inline size_t roundUpToPageSize(size_t x) {
     return (x + (PAGE_SIZE-1)) & ~(PAGE_SIZE-1);
 }
 
+/* bytes per pixel of the RGB and raw formats of this gralloc, 0 for YUV */
+inline int getBytesPerPixel(int format) {
+    switch (format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+            return 4;
+        case HAL_PIXEL_FORMAT_RGB_888:
+            return 3;
+        case HAL_PIXEL_FORMAT_RGB_565:
+        case HAL_PIXEL_FORMAT_RAW_SENSOR:
+            return 2;
+        case HAL_PIXEL_FORMAT_BLOB:
+            return 1;
+    }
+    return 0;
+}
+
+/* plane layout of a YUV 4:2:0 buffer, offsets in bytes from its base */
+struct yuv_layout_t {
+    size_t ystride;
+    size_t cstride;
+    size_t chroma_step;
+    size_t cb_offset;
+    size_t cr_offset;
+    size_t size;
+};
+
+/*
+ * Returns the stride of the Y plane of a w pixels wide buffer, with rows
+ * aligned to align bytes (a power of two) where the format allows it, or 0
+ * if format is not a YUV format of this gralloc.
+ */
+inline size_t getYuvStride(int format, int w, size_t align) {
+    switch (format) {
+        case HAL_PIXEL_FORMAT_YV12:
+        case HAL_PIXEL_FORMAT_YCbCr_420_888:
+            if (align < 16)
+                align = 16;
+            return (w + (align-1)) & ~(align-1);
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+            return w;
+    }
+    return 0;
+}
+
+/*
+ * Returns false if format is not a YUV format of this gralloc. Layouts:
+ * - YV12: Y, then Cr and Cb planes, chroma stride derived from the Y
+ *   stride as documented in system/graphics.h.
+ * - YCrCb_420_SP (NV21): Y, then interleaved CrCb, stride = width, as the
+ *   camera API expects for preview callbacks.
+ * - YCbCr_420_888: NV12, Y then interleaved CbCr.
+ */
+inline bool getYuvLayout(int format, size_t ystride, int h, yuv_layout_t* l) {
+    const size_t chromaRows = (h + 1) / 2;
+    switch (format) {
+        case HAL_PIXEL_FORMAT_YV12:
+            l->ystride = ystride;
+            l->cstride = (l->ystride / 2 + 15) & ~15;
+            l->chroma_step = 1;
+            l->cr_offset = l->ystride * h;
+            l->cb_offset = l->cr_offset + l->cstride * chromaRows;
+            l->size = l->cb_offset + l->cstride * chromaRows;
+            return true;
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+        case HAL_PIXEL_FORMAT_YCbCr_420_888:
+            l->ystride = ystride;
+            l->cstride = l->ystride;
+            l->chroma_step = 2;
+            l->cr_offset = l->ystride * h;
+            l->cb_offset = l->cr_offset;
+            if (format == HAL_PIXEL_FORMAT_YCrCb_420_SP)
+                l->cb_offset++;
+            else
+                l->cr_offset++;
+            l->size = l->ystride * h + l->cstride * chromaRows;
+            return true;
+    }
+    return false;
+}
+
+/* what a buffer is for, as counted in the stats and to pick its heap */
+enum {
+    USAGE_CLASS_FRAMEBUFFER,
+    USAGE_CLASS_CAMERA,
+    USAGE_CLASS_VIDEO,
+    USAGE_CLASS_COMPOSER,
+    USAGE_CLASS_RENDER,
+    USAGE_CLASS_TEXTURE,
+    USAGE_CLASS_SOFTWARE,
+    USAGE_CLASS_OTHER,
+    USAGE_CLASS_COUNT
+};
+
+/* the first class of the GRALLOC_USAGE_* bits in usage */
+inline int usageClass(int usage) {
+    if (usage & GRALLOC_USAGE_HW_FB)
+        return USAGE_CLASS_FRAMEBUFFER;
+    if (usage & GRALLOC_USAGE_HW_CAMERA_MASK)
+        return USAGE_CLASS_CAMERA;
+    if (usage & GRALLOC_USAGE_HW_VIDEO_ENCODER)
+        return USAGE_CLASS_VIDEO;
+    if (usage & GRALLOC_USAGE_HW_COMPOSER)
+        return USAGE_CLASS_COMPOSER;
+    if (usage & GRALLOC_USAGE_HW_RENDER)
+        return USAGE_CLASS_RENDER;
+    if (usage & GRALLOC_USAGE_HW_TEXTURE)
+        return USAGE_CLASS_TEXTURE;
+    if (usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK))
+        return USAGE_CLASS_SOFTWARE;
+    return USAGE_CLASS_OTHER;
+}
+
+inline const char* usageClassName(int c) {
+    static const char* const names[USAGE_CLASS_COUNT] = {
+        "framebuffer", "camera", "video", "composer", "render", "texture",
+        "software", "other",
+    };
+    return names[c];
+}
+
 int mapFrameBufferLocked(struct private_module_t* module);
+// waits for the next vsync of the framebuffer, CLOCK_MONOTONIC ns
+int fb_wait_vsync(struct private_module_t* module, int64_t* timestamp);
 int terminateBuffer(gralloc_module_t const* module, private_handle_t* hnd);
 int mapBuffer(gralloc_module_t const* module, private_handle_t* hnd);
+uint32_t newHandleGeneration();
+// accounts a mapping of size bytes made (size > 0) or released (size < 0)
+void statsMapping(ssize_t size);
+/*
+ * Returns a dma-buf of size bytes from the heap configured for the class
+ * of usage, or -1 if the buffer should be ashmem, see allocator.cpp.
+ */
+int allocHeapRegion(size_t size, int usage);
+/* brackets CPU access to a PRIV_FLAGS_DMABUF buffer for cache coherency */
+void syncHeapRegion(private_handle_t const* hnd, int usage, bool start);
+// unmaps a mapping nothing uses anymore, on the reclaim thread if enabled
+void reclaimMapping(void* base, size_t size);
 
 /*****************************************************************************/
 
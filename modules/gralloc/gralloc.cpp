@@ -19,6 +19,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -30,6 +31,7 @@
 #include <cutils/ashmem.h>
 #include <cutils/log.h>
 #include <cutils/atomic.h>
+#include <cutils/properties.h>
 
 #include <hardware/hardware.h>
 #include <hardware/gralloc.h>
@@ -60,12 +62,33 @@ extern int gralloc_lock(gralloc_module_t const* module,
         int l, int t, int w, int h,
         void** vaddr);
 
+extern int gralloc_lock_ycbcr(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        struct android_ycbcr *ycbcr);
+
 extern int gralloc_unlock(gralloc_module_t const* module, 
         buffer_handle_t handle);
 
+extern int gralloc_lock_async(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        void** vaddr, int fenceFd);
+
+extern int gralloc_lock_async_ycbcr(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        struct android_ycbcr *ycbcr, int fenceFd);
+
+extern int gralloc_unlock_async(gralloc_module_t const* module,
+        buffer_handle_t handle, int* fenceFd);
+
 extern int gralloc_register_buffer(gralloc_module_t const* module,
         buffer_handle_t handle);
 
+static int gralloc_perform(gralloc_module_t const* module,
+        int operation, ... );
+
 extern int gralloc_unregister_buffer(gralloc_module_t const* module,
         buffer_handle_t handle);
 
@@ -80,7 +103,7 @@ struct private_module_t HAL_MODULE_INFO_SYM = {
         .common = {
             .tag = HARDWARE_MODULE_TAG,
             .version_major = 1,
-            .version_minor = 0,
+            .hal_api_version = HARDWARE_HAL_API_VERSION_1_1,
             .id = GRALLOC_HARDWARE_MODULE_ID,
             .name = "Graphics Memory Allocator Module",
             .author = "The Android Open Source Project",
@@ -90,6 +113,11 @@ struct private_module_t HAL_MODULE_INFO_SYM = {
         .unregisterBuffer = gralloc_unregister_buffer,
         .lock = gralloc_lock,
         .unlock = gralloc_unlock,
+        .perform = gralloc_perform,
+        .lock_ycbcr = gralloc_lock_ycbcr,
+        .lockAsync = gralloc_lock_async,
+        .unlockAsync = gralloc_unlock_async,
+        .lockAsync_ycbcr = gralloc_lock_async_ycbcr,
     },
     .framebuffer = 0,
     .flags = 0,
@@ -101,6 +129,32 @@ struct private_module_t HAL_MODULE_INFO_SYM = {
 
 /*****************************************************************************/
 
+static int gralloc_perform(gralloc_module_t const* module,
+        int operation, ... )
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            const_cast<gralloc_module_t*>(module));
+    int err = -EINVAL;
+    va_list args;
+
+    va_start(args, operation);
+    switch (operation) {
+        case GRALLOC_MODULE_PERFORM_WAIT_VSYNC: {
+            int64_t* timestamp = va_arg(args, int64_t*);
+            pthread_mutex_lock(&m->lock);
+            err = mapFrameBufferLocked(m);
+            pthread_mutex_unlock(&m->lock);
+            if (err == 0)
+                err = fb_wait_vsync(m, timestamp);
+            break;
+        }
+    }
+    va_end(args);
+    return err;
+}
+
+/*****************************************************************************/
+
 static int gralloc_alloc_framebuffer_locked(alloc_device_t* dev,
         size_t size, int usage, buffer_handle_t* pHandle)
 {
@@ -165,28 +219,287 @@ static int gralloc_alloc_framebuffer(alloc_device_t* dev,
     return err;
 }
 
-static int gralloc_alloc_buffer(alloc_device_t* dev,
-        size_t size, int /*usage*/, buffer_handle_t* pHandle)
+/* low half of the allocation ids, the high half is the pid */
+static volatile int32_t sNextBufferId = 0;
+
+/*
+ * Pool of recently freed ashmem regions, reused by allocations of the same
+ * size instead of creating a new region. BufferQueues reallocating on a
+ * resize and relaunched apps mostly ask for the sizes they just freed.
+ *
+ * A region can still be mapped by another process after the allocating
+ * process freed its handle, so the pool is disabled unless
+ * ro.gralloc.pool_max_bytes gives its capacity; only enable it where
+ * consumers release their buffers before the allocator frees them.
+ * Regions are emptied when they enter the pool, which returns their pages
+ * and makes them read back as zeroes, unless ro.gralloc.pool_zero is 0.
+ */
+#define POOL_MAX_REGIONS    32
+
+struct pooled_region_t {
+    int fd;
+    size_t size;
+};
+
+static pthread_once_t sPoolOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t sPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static size_t sPoolMaxBytes;
+static bool sPoolZero;
+/* oldest first */
+static pooled_region_t sPool[POOL_MAX_REGIONS];
+static int sPoolCount;
+static size_t sPoolBytes;
+
+static void pool_init()
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.gralloc.pool_max_bytes", value, "0");
+    sPoolMaxBytes = strtoul(value, NULL, 0);
+    property_get("ro.gralloc.pool_zero", value, "1");
+    sPoolZero = atoi(value) != 0;
+}
+
+static void pool_remove_locked(int i)
+{
+    sPoolBytes -= sPool[i].size;
+    sPoolCount--;
+    memmove(&sPool[i], &sPool[i + 1], (sPoolCount - i) * sizeof(sPool[0]));
+}
+
+/* returns a pooled region of exactly size bytes, or -1 */
+static int pool_get(size_t size)
+{
+    pthread_once(&sPoolOnce, pool_init);
+    int fd = -1;
+    pthread_mutex_lock(&sPoolLock);
+    // most recently freed first, it is the most likely to be cache hot
+    for (int i = sPoolCount - 1; i >= 0; i--) {
+        if (sPool[i].size == size) {
+            fd = sPool[i].fd;
+            pool_remove_locked(i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sPoolLock);
+    return fd;
+}
+
+/* takes ownership of fd, returns false if the region was not pooled */
+static bool pool_put(int fd, size_t size)
+{
+    pthread_once(&sPoolOnce, pool_init);
+    if (size > sPoolMaxBytes)
+        return false;
+
+    if (sPoolZero) {
+        void* vaddr = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        if (vaddr == MAP_FAILED)
+            return false;
+        int err = madvise(vaddr, size, MADV_REMOVE);
+        munmap(vaddr, size);
+        if (err < 0) {
+            ALOGW_IF(errno != EINVAL, "couldn't empty pooled region (%s)",
+                    strerror(errno));
+            return false;
+        }
+    }
+
+    pthread_mutex_lock(&sPoolLock);
+    while (sPoolCount > 0 && (sPoolCount == POOL_MAX_REGIONS ||
+            sPoolBytes + size > sPoolMaxBytes)) {
+        close(sPool[0].fd);
+        pool_remove_locked(0);
+    }
+    sPool[sPoolCount].fd = fd;
+    sPool[sPoolCount].size = size;
+    sPoolCount++;
+    sPoolBytes += size;
+    pthread_mutex_unlock(&sPoolLock);
+    return true;
+}
+
+/*
+ * Optional reclaim thread. With ro.gralloc.reclaim_backlog giving the
+ * number of entries it may have queued, the mappings and regions of freed
+ * and unregistered buffers are unmapped, emptied into the pool or closed
+ * on a thread instead of by gralloc_free() and gralloc_unregister_buffer(),
+ * which SurfaceFlinger calls from its main thread when windows go away.
+ * Nothing queued is ever used again, so only the time it is released
+ * changes. The backlog is also bounded by ro.gralloc.reclaim_max_bytes of
+ * memory it holds on to; past either bound the caller does the work
+ * itself, as it does without the thread.
+ */
+#define RECLAIM_MAX_BACKLOG 256
+/* entries the thread takes at once */
+#define RECLAIM_BATCH       32
+
+struct reclaim_entry_t {
+    void* base;     // mapping to unmap, or NULL
+    size_t size;
+    int fd;         // region to pool or close, or -1
+    bool pool;      // fd is ashmem and may be pooled
+};
+
+static pthread_once_t sReclaimOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t sReclaimLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sReclaimCond = PTHREAD_COND_INITIALIZER;
+static int sReclaimMax;
+static size_t sReclaimMaxBytes;
+/* a ring, oldest first */
+static reclaim_entry_t sReclaimQueue[RECLAIM_MAX_BACKLOG];
+static int sReclaimHead;
+static int sReclaimCount;
+static size_t sReclaimBytes;
+/* the process the thread runs in, 0 before it is started */
+static pid_t sReclaimPid;
+
+static void reclaim_atfork_prepare()
+{
+    pthread_mutex_lock(&sReclaimLock);
+}
+
+static void reclaim_atfork_parent()
+{
+    pthread_mutex_unlock(&sReclaimLock);
+}
+
+static void reclaim_atfork_child()
+{
+    // the thread is not forked, the next entry starts one for the backlog
+    sReclaimPid = 0;
+    pthread_mutex_unlock(&sReclaimLock);
+}
+
+static void reclaim_init()
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.gralloc.reclaim_backlog", value, "0");
+    sReclaimMax = atoi(value);
+    if (sReclaimMax > RECLAIM_MAX_BACKLOG)
+        sReclaimMax = RECLAIM_MAX_BACKLOG;
+    property_get("ro.gralloc.reclaim_max_bytes", value, "134217728");
+    sReclaimMaxBytes = strtoul(value, NULL, 0);
+    if (sReclaimMax > 0) {
+        pthread_atfork(reclaim_atfork_prepare, reclaim_atfork_parent,
+                reclaim_atfork_child);
+    }
+}
+
+static void reclaim_entry(reclaim_entry_t const* e)
+{
+    if (e->base && munmap(e->base, e->size) < 0) {
+        ALOGE("Could not unmap %s", strerror(errno));
+    }
+    if (e->fd >= 0 && !(e->pool && pool_put(e->fd, e->size)))
+        close(e->fd);
+}
+
+static void* reclaim_thread(void* /*arg*/)
+{
+    reclaim_entry_t batch[RECLAIM_BATCH];
+    pthread_mutex_lock(&sReclaimLock);
+    for (;;) {
+        while (sReclaimCount == 0)
+            pthread_cond_wait(&sReclaimCond, &sReclaimLock);
+        int n = 0;
+        while (n < RECLAIM_BATCH && sReclaimCount > 0) {
+            batch[n++] = sReclaimQueue[sReclaimHead];
+            sReclaimHead = (sReclaimHead + 1) % RECLAIM_MAX_BACKLOG;
+            sReclaimCount--;
+        }
+        pthread_mutex_unlock(&sReclaimLock);
+
+        size_t bytes = 0;
+        for (int i = 0; i < n; i++) {
+            reclaim_entry(&batch[i]);
+            bytes += batch[i].size;
+        }
+
+        // only released once done, the bound is on what is still held
+        pthread_mutex_lock(&sReclaimLock);
+        sReclaimBytes -= bytes;
+    }
+    return NULL;
+}
+
+/* with sReclaimLock held, returns false if the thread could not start */
+static bool reclaim_start_locked()
+{
+    if (sReclaimPid == getpid())
+        return true;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int err = pthread_create(&thread, &attr, reclaim_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        ALOGE("couldn't start the reclaim thread (%s)", strerror(err));
+        return false;
+    }
+    sReclaimPid = getpid();
+    return true;
+}
+
+static void reclaim(void* base, size_t size, int fd, bool pool)
+{
+    pthread_once(&sReclaimOnce, reclaim_init);
+    reclaim_entry_t e = { base, size, fd, pool };
+    if (sReclaimMax > 0) {
+        pthread_mutex_lock(&sReclaimLock);
+        bool queued = false;
+        if (sReclaimCount < sReclaimMax &&
+                sReclaimBytes + size <= sReclaimMaxBytes &&
+                reclaim_start_locked()) {
+            int tail = (sReclaimHead + sReclaimCount) % RECLAIM_MAX_BACKLOG;
+            sReclaimQueue[tail] = e;
+            sReclaimCount++;
+            sReclaimBytes += size;
+            pthread_cond_signal(&sReclaimCond);
+            queued = true;
+        }
+        pthread_mutex_unlock(&sReclaimLock);
+        if (queued)
+            return;
+    }
+    reclaim_entry(&e);
+}
+
+void reclaimMapping(void* base, size_t size)
+{
+    reclaim(base, size, -1, false);
+}
+
+static int gralloc_alloc_buffer(alloc_device_t* /*dev*/,
+        size_t size, int usage, buffer_handle_t* pHandle)
 {
     int err = 0;
     int fd = -1;
+    int flags = 0;
 
     size = roundUpToPageSize(size);
     
-    fd = ashmem_create_region("gralloc-buffer", size);
-    if (fd < 0) {
-        ALOGE("couldn't create ashmem (%s)", strerror(-errno));
-        err = -errno;
+    fd = allocHeapRegion(size, usage);
+    if (fd >= 0) {
+        flags |= private_handle_t::PRIV_FLAGS_DMABUF;
+    } else {
+        fd = pool_get(size);
+        if (fd < 0)
+            fd = ashmem_create_region("gralloc-buffer", size);
+        if (fd < 0) {
+            ALOGE("couldn't create ashmem (%s)", strerror(-errno));
+            err = -errno;
+        }
     }
 
     if (err == 0) {
-        private_handle_t* hnd = new private_handle_t(fd, size, 0);
-        gralloc_module_t* module = reinterpret_cast<gralloc_module_t*>(
-                dev->common.module);
-        err = mapBuffer(module, hnd);
-        if (err == 0) {
-            *pHandle = hnd;
-        }
+        private_handle_t* hnd = new private_handle_t(fd, size, flags);
+        hnd->identity.id = (uint64_t(getpid()) << 32) |
+                uint32_t(android_atomic_inc(&sNextBufferId) + 1);
+        hnd->identity.generation = newHandleGeneration();
+        hnd->usage = usage;
+        // mapped by the first gralloc_lock() with software usage
+        *pHandle = hnd;
     }
     
     ALOGE_IF(err, "gralloc failed err=%s", strerror(-err));
@@ -196,6 +509,155 @@ static int gralloc_alloc_buffer(alloc_device_t* dev,
 
 /*****************************************************************************/
 
+/*
+ * Live counters of this process, dumped by gralloc_dump(), reported as the
+ * performance counters of the alloc device and to size the pool. Buffers
+ * are counted once, in their usageClass().
+ */
+struct alloc_stats_t {
+    size_t bytes[USAGE_CLASS_COUNT];
+    size_t buffers[USAGE_CLASS_COUNT];
+    size_t total;
+    size_t peak;
+    size_t mappedBytes;
+    size_t mappings;
+    uint64_t allocs;
+    uint64_t frees;
+};
+
+static pthread_mutex_t sStatsLock = PTHREAD_MUTEX_INITIALIZER;
+static alloc_stats_t sStats;
+
+static void stats_account(private_handle_t const* hnd, bool alloc)
+{
+    int c = usageClass(hnd->usage);
+    pthread_mutex_lock(&sStatsLock);
+    if (alloc) {
+        sStats.bytes[c] += hnd->size;
+        sStats.buffers[c]++;
+        sStats.total += hnd->size;
+        if (sStats.total > sStats.peak)
+            sStats.peak = sStats.total;
+        sStats.allocs++;
+    } else {
+        sStats.bytes[c] -= hnd->size;
+        sStats.buffers[c]--;
+        sStats.total -= hnd->size;
+        sStats.frees++;
+    }
+    pthread_mutex_unlock(&sStatsLock);
+}
+
+void statsMapping(ssize_t size)
+{
+    pthread_mutex_lock(&sStatsLock);
+    sStats.mappedBytes += size;
+    if (size > 0)
+        sStats.mappings++;
+    else
+        sStats.mappings--;
+    pthread_mutex_unlock(&sStatsLock);
+}
+
+static void gralloc_dump(alloc_device_t* /*dev*/, char* buff, int buff_len)
+{
+    pthread_mutex_lock(&sStatsLock);
+    alloc_stats_t stats = sStats;
+    pthread_mutex_unlock(&sStatsLock);
+    pthread_mutex_lock(&sPoolLock);
+    int poolRegions = sPoolCount;
+    size_t poolBytes = sPoolBytes;
+    pthread_mutex_unlock(&sPoolLock);
+
+    int len = snprintf(buff, buff_len,
+            "gralloc: %zu KiB allocated, peak %zu KiB, %zu KiB in %zu "
+            "mappings, %zu KiB in %d pooled regions\n",
+            stats.total / 1024, stats.peak / 1024, stats.mappedBytes / 1024,
+            stats.mappings, poolBytes / 1024, poolRegions);
+    for (int c = 0; c < USAGE_CLASS_COUNT && len >= 0 && len < buff_len; c++) {
+        if (!stats.buffers[c])
+            continue;
+        len += snprintf(buff + len, buff_len - len,
+                "  %-12s %5zu buffers %8zu KiB\n", usageClassName(c),
+                stats.buffers[c], stats.bytes[c] / 1024);
+    }
+}
+
+static int gralloc_get_perf_counters(const hw_device_t* /*dev*/,
+        hw_perf_counter_t* counters, size_t count)
+{
+    pthread_mutex_lock(&sStatsLock);
+    alloc_stats_t stats = sStats;
+    pthread_mutex_unlock(&sStatsLock);
+    pthread_mutex_lock(&sPoolLock);
+    int poolRegions = sPoolCount;
+    size_t poolBytes = sPoolBytes;
+    pthread_mutex_unlock(&sPoolLock);
+
+    size_t n = 0;
+    hw_perf_counter_put(counters, count, &n, "allocs",
+            HW_PERF_COUNTER_TYPE_COUNT, stats.allocs);
+    hw_perf_counter_put(counters, count, &n, "frees",
+            HW_PERF_COUNTER_TYPE_COUNT, stats.frees);
+    hw_perf_counter_put(counters, count, &n, "alloc.bytes",
+            HW_PERF_COUNTER_TYPE_BYTES, stats.total);
+    hw_perf_counter_put(counters, count, &n, "alloc.peak_bytes",
+            HW_PERF_COUNTER_TYPE_BYTES, stats.peak);
+    hw_perf_counter_put(counters, count, &n, "mapped.bytes",
+            HW_PERF_COUNTER_TYPE_BYTES, stats.mappedBytes);
+    hw_perf_counter_put(counters, count, &n, "mapped.buffers",
+            HW_PERF_COUNTER_TYPE_GAUGE, stats.mappings);
+    hw_perf_counter_put(counters, count, &n, "pool.bytes",
+            HW_PERF_COUNTER_TYPE_BYTES, poolBytes);
+    hw_perf_counter_put(counters, count, &n, "pool.regions",
+            HW_PERF_COUNTER_TYPE_GAUGE, poolRegions);
+    for (int c = 0; c < USAGE_CLASS_COUNT; c++) {
+        char name[HW_PERF_COUNTER_NAME_MAX];
+        snprintf(name, sizeof(name), "%s.buffers", usageClassName(c));
+        hw_perf_counter_put(counters, count, &n, name,
+                HW_PERF_COUNTER_TYPE_GAUGE, stats.buffers[c]);
+        snprintf(name, sizeof(name), "%s.bytes", usageClassName(c));
+        hw_perf_counter_put(counters, count, &n, name,
+                HW_PERF_COUNTER_TYPE_BYTES, stats.bytes[c]);
+    }
+    return n;
+}
+
+static const hw_device_ext_t sGrallocExt = {
+    .tag = HARDWARE_DEVICE_EXT_TAG,
+    .version = HARDWARE_DEVICE_EXT_VERSION_1,
+    .get_perf_counters = gralloc_get_perf_counters,
+};
+
+/*****************************************************************************/
+
+/*
+ * Row alignment in bytes of the buffers the GPU or the renderer imports.
+ * Most GPUs and display DMA engines need 64 to 256 byte aligned rows to
+ * use a buffer in place rather than blitting it into an aligned copy. Set
+ * with TARGET_GRALLOC_STRIDE_ALIGNMENT at build time, overridden by the
+ * ro.gralloc.stride_align property.
+ */
+#ifndef GRALLOC_STRIDE_ALIGNMENT
+#define GRALLOC_STRIDE_ALIGNMENT    4
+#endif
+
+static pthread_once_t sStrideAlignOnce = PTHREAD_ONCE_INIT;
+static size_t sStrideAlign = GRALLOC_STRIDE_ALIGNMENT;
+
+static void stride_align_init()
+{
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get("ro.gralloc.stride_align", value, NULL) > 0) {
+        size_t align = strtoul(value, NULL, 0);
+        if (align >= 4 && align <= PAGE_SIZE && !(align & (align-1)))
+            sStrideAlign = align;
+        else
+            ALOGW("ignoring ro.gralloc.stride_align=%s, not a power of two "
+                    "between 4 and %d", value, int(PAGE_SIZE));
+    }
+}
+
 static int gralloc_alloc(alloc_device_t* dev,
         int w, int h, int format, int usage,
         buffer_handle_t* pHandle, int* pStride)
@@ -205,27 +667,41 @@ static int gralloc_alloc(alloc_device_t* dev,
 
     size_t size, stride;
 
-    int align = 4;
-    int bpp = 0;
-    switch (format) {
-        case HAL_PIXEL_FORMAT_RGBA_8888:
-        case HAL_PIXEL_FORMAT_RGBX_8888:
-        case HAL_PIXEL_FORMAT_BGRA_8888:
-            bpp = 4;
-            break;
-        case HAL_PIXEL_FORMAT_RGB_888:
-            bpp = 3;
-            break;
-        case HAL_PIXEL_FORMAT_RGB_565:
-        case HAL_PIXEL_FORMAT_RAW_SENSOR:
-            bpp = 2;
-            break;
-        default:
+    if (format == HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED) {
+        // camera and video buffers stay in YUV, the rest is for the GPU
+        if (usage & (GRALLOC_USAGE_HW_CAMERA_MASK |
+                GRALLOC_USAGE_HW_VIDEO_ENCODER))
+            format = HAL_PIXEL_FORMAT_YCbCr_420_888;
+        else
+            format = HAL_PIXEL_FORMAT_RGBA_8888;
+    }
+
+    pthread_once(&sStrideAlignOnce, stride_align_init);
+    // the framebuffer has the stride of the display
+    size_t align = (usage & GRALLOC_USAGE_HW_FB) ? 4 : sStrideAlign;
+    int bpp = getBytesPerPixel(format);
+    yuv_layout_t yuv;
+    if (format == HAL_PIXEL_FORMAT_BLOB) {
+        // not made of rows
+        align = 1;
+    } else if (!bpp &&
+            !getYuvLayout(format, getYuvStride(format, w, align), h, &yuv)) {
+        return -EINVAL;
+    }
+    if (bpp) {
+        // align is a power of two, so gcd(align, bpp) is the lowest bit
+        // of bpp set, at most align: rows of stride pixels are aligned
+        size_t gcd = size_t(bpp & -bpp) < align ? size_t(bpp & -bpp) : align;
+        size_t pixelAlign = align / gcd;
+        stride = (w + (pixelAlign-1)) / pixelAlign * pixelAlign;
+        size = stride * bpp * h;
+    } else {
+        // the framebuffer only scans out RGB
+        if (usage & GRALLOC_USAGE_HW_FB)
             return -EINVAL;
+        size = yuv.size;
+        stride = yuv.ystride;
     }
-    size_t bpr = (w*bpp + (align-1)) & ~(align-1);
-    size = bpr * h;
-    stride = bpr / bpp;
 
     int err;
     if (usage & GRALLOC_USAGE_HW_FB) {
@@ -238,6 +714,14 @@ static int gralloc_alloc(alloc_device_t* dev,
         return err;
     }
 
+    private_handle_t* hnd = (private_handle_t*)*pHandle;
+    hnd->usage = usage;
+    hnd->format = format;
+    hnd->width = w;
+    hnd->height = h;
+    hnd->stride = stride;
+    stats_account(hnd, true);
+
     *pStride = stride;
     return 0;
 }
@@ -249,6 +733,7 @@ static int gralloc_free(alloc_device_t* dev,
         return -EINVAL;
 
     private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(handle);
+    stats_account(hnd, false);
     if (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER) {
         // free this buffer
         private_module_t* m = reinterpret_cast<private_module_t*>(
@@ -260,6 +745,10 @@ static int gralloc_free(alloc_device_t* dev,
         gralloc_module_t* module = reinterpret_cast<gralloc_module_t*>(
                 dev->common.module);
         terminateBuffer(module, const_cast<private_handle_t*>(hnd));
+        reclaim(NULL, hnd->size, hnd->fd,
+                !(hnd->flags & private_handle_t::PRIV_FLAGS_DMABUF));
+        delete hnd;
+        return 0;
     }
 
     close(hnd->fd);
@@ -297,9 +786,11 @@ int gralloc_device_open(const hw_module_t* module, const char* name,
         dev->device.common.version = 0;
         dev->device.common.module = const_cast<hw_module_t*>(module);
         dev->device.common.close = gralloc_close;
+        dev->device.common.ext = &sGrallocExt;
 
         dev->device.alloc   = gralloc_alloc;
         dev->device.free    = gralloc_free;
+        dev->device.dump    = gralloc_dump;
 
         *device = &dev->device.common;
         status = 0;
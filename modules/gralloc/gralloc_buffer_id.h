@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GRALLOC_BUFFER_ID_H_
+#define GRALLOC_BUFFER_ID_H_
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <cutils/native_handle.h>
+
+__BEGIN_DECLS
+
+/*
+ * Identity of the buffers allocated by this gralloc, for modules that pass
+ * buffers on without owning them, such as sharebuffer, and that must not
+ * tell buffers apart by handle address: a freed handle's address is reused
+ * by the next one.
+ *
+ * Handles of this gralloc hold one fd, put GRALLOC_HANDLE_MAGIC in their
+ * first int and end with a gralloc_buffer_identity_t.
+ */
+#define GRALLOC_HANDLE_MAGIC        0x3141592
+
+/* set on a handle by the module that sent its buffer to a renderer */
+#define GRALLOC_BUFFER_EXPORTED     0x00000001
+
+typedef struct gralloc_buffer_identity_t {
+    /*
+     * Unique per allocation on the device and shared by every handle to
+     * the buffer, in any process. 0 if the buffer has no identity, as the
+     * framebuffer.
+     */
+    uint64_t id;
+    /*
+     * Unique per handle in the process: set when the handle is allocated
+     * or registered, so a handle imported again gets a new generation.
+     */
+    uint32_t generation;
+    /* GRALLOC_BUFFER_*, local to the process like generation */
+    uint32_t flags;
+} gralloc_buffer_identity_t;
+
+/* the identity of handle, or NULL if it is not a buffer of this gralloc */
+static inline gralloc_buffer_identity_t* gralloc_buffer_identity(
+        const native_handle_t* handle)
+{
+    const size_t ints = sizeof(gralloc_buffer_identity_t) / sizeof(int);
+    if (!handle || handle->version != sizeof(native_handle_t) ||
+            handle->numFds != 1 || handle->numInts < (int)ints + 1 ||
+            handle->data[1] != GRALLOC_HANDLE_MAGIC)
+        return NULL;
+    gralloc_buffer_identity_t* identity = (gralloc_buffer_identity_t*)
+            &handle->data[handle->numFds + handle->numInts - ints];
+    return identity->id ? identity : NULL;
+}
+
+__END_DECLS
+
+#endif /* GRALLOC_BUFFER_ID_H_ */
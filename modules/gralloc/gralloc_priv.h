@@ -23,17 +23,31 @@
 #include <hardware/gralloc.h>
 #include <pthread.h>
 #include <errno.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <cutils/native_handle.h>
 
 #include <linux/fb.h>
 
+#include "gralloc_buffer_id.h"
+
 /*****************************************************************************/
 
 struct private_module_t;
 struct private_handle_t;
 
+/*
+ * (*perform)() operations of this gralloc.
+ *
+ * GRALLOC_MODULE_PERFORM_WAIT_VSYNC, int64_t* timestamp: blocks until the
+ * next vsync of the framebuffer and returns its CLOCK_MONOTONIC time in
+ * nanoseconds, -ENODEV or -errno if the driver can't report vsync.
+ */
+enum {
+    GRALLOC_MODULE_PERFORM_WAIT_VSYNC = 0x47520001,
+};
+
 struct private_module_t {
     gralloc_module_t base;
 
@@ -63,7 +77,9 @@ struct private_handle_t {
 #endif
 
     enum {
-        PRIV_FLAGS_FRAMEBUFFER = 0x00000001
+        PRIV_FLAGS_FRAMEBUFFER = 0x00000001,
+        // fd is a dma-buf of an ION or dma-buf heap rather than ashmem
+        PRIV_FLAGS_DMABUF      = 0x00000002
     };
 
     // file-descriptors
@@ -73,22 +89,33 @@ struct private_handle_t {
     int     flags;
     int     size;
     int     offset;
+    // GRALLOC_USAGE_* the buffer was allocated with
+    int     usage;
+    // HAL_PIXEL_FORMAT_* of the buffer, never IMPLEMENTATION_DEFINED
+    int     format;
+    int     width;
+    int     height;
+    // in pixels, of the Y plane for YUV formats
+    int     stride;
 
     // FIXME: the attributes below should be out-of-line
     uint64_t base __attribute__((aligned(8)));
     int     pid;
+    // keys the per-process mapping table, must stay the last member
+    gralloc_buffer_identity_t identity __attribute__((aligned(8)));
 
 #ifdef __cplusplus
     static inline int sNumInts() {
         return (((sizeof(private_handle_t) - sizeof(native_handle_t))/sizeof(int)) - sNumFds);
     }
     static const int sNumFds = 1;
-    static const int sMagic = 0x3141592;
+    static const int sMagic = GRALLOC_HANDLE_MAGIC;
 
     private_handle_t(int fd, int size, int flags) :
         fd(fd), magic(sMagic), flags(flags), size(size), offset(0),
-        base(0), pid(getpid())
+        usage(0), format(0), width(0), height(0), stride(0), base(0), pid(getpid())
     {
+        memset(&identity, 0, sizeof(identity));
         version = sizeof(native_handle);
         numInts = sNumInts();
         numFds = sNumFds;
@@ -26,11 +26,13 @@
 
 #include <cutils/log.h>
 #include <cutils/atomic.h>
+#include <sync/sync.h>
 
 #include <hardware/hardware.h>
 #include <hardware/gralloc.h>
 
 #include "gralloc_priv.h"
+#include "gr.h"
 
 
 /* desktop Linux needs a little help with gettid() */
@@ -41,24 +43,103 @@ pid_t gettid() { return syscall(__NR_gettid);}
 #undef __KERNEL__
 #endif
 
+/* madvise() advice of Linux 5.14, not in older headers */
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ  22
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* before warning that a buffer's producer is late, waiting on */
+#define LOCK_FENCE_WARN_MS  1000
+
 /*****************************************************************************/
 
+/*
+ * Per-process table of buffer mappings. Every handle to a buffer that is
+ * registered or allocated in this process shares one mapping, counted in
+ * refs, so that CPU accesses through any of them go through the same
+ * virtual addresses.
+ *
+ * Mappings are keyed by the allocation id carried in the handle rather
+ * than by the fd: all ashmem fds report the inode of /dev/ashmem, and
+ * every handle received through Binder holds a different fd.
+ */
+struct buffer_mapping_t {
+    uint64_t id;
+    void* base;
+    size_t size;
+    int refs;
+    buffer_mapping_t* next;
+};
+
+static const int MAPPING_BUCKETS = 64;
+static Locker sMappingLock;
+static buffer_mapping_t* sMappings[MAPPING_BUCKETS];
+
+static buffer_mapping_t** find_mapping_locked(uint64_t id)
+{
+    buffer_mapping_t** m = &sMappings[(id ^ (id >> 32)) % MAPPING_BUCKETS];
+    while (*m && (*m)->id != id)
+        m = &(*m)->next;
+    return m;
+}
+
+static bool sw_often(int usage)
+{
+    return (usage & GRALLOC_USAGE_SW_READ_MASK) == GRALLOC_USAGE_SW_READ_OFTEN ||
+            (usage & GRALLOC_USAGE_SW_WRITE_MASK) == GRALLOC_USAGE_SW_WRITE_OFTEN;
+}
+
+/*
+ * Buffers the CPU reads or writes often are usually processed whole right
+ * after locking, populate their mapping at once rather than taking a page
+ * fault for every page, unless the lock is for a part of the buffer only,
+ * see prefault_rect(). GPU and scanout buffers are never mapped at all,
+ * see gralloc_lock().
+ */
+static int mmap_flags(int usage, bool whole)
+{
+    int flags = MAP_SHARED;
+    if (whole && sw_often(usage))
+        flags |= MAP_POPULATE;
+    return flags;
+}
+
 static int gralloc_map(gralloc_module_t const* /*module*/,
-        buffer_handle_t handle,
+        buffer_handle_t handle, int usage, bool whole,
         void** vaddr)
 {
     private_handle_t* hnd = (private_handle_t*)handle;
     if (!(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)) {
-        size_t size = hnd->size;
-        void* mappedAddress = mmap(0, size,
-                PROT_READ|PROT_WRITE, MAP_SHARED, hnd->fd, 0);
-        if (mappedAddress == MAP_FAILED) {
-            ALOGE("Could not mmap %s", strerror(errno));
-            return -errno;
+        Locker::Autolock _l(sMappingLock);
+        buffer_mapping_t** m = find_mapping_locked(hnd->identity.id);
+        if (hnd->base) {
+            // mapped by a concurrent lock of the same handle
+        } else if (hnd->identity.id && *m) {
+            (*m)->refs++;
+            hnd->base = uintptr_t((*m)->base) + hnd->offset;
+        } else {
+            size_t size = hnd->size;
+            void* mappedAddress = mmap(0, size,
+                    PROT_READ|PROT_WRITE, mmap_flags(usage, whole), hnd->fd, 0);
+            if (mappedAddress == MAP_FAILED) {
+                ALOGE("Could not mmap %s", strerror(errno));
+                return -errno;
+            }
+            statsMapping(size);
+            if (hnd->identity.id) {
+                buffer_mapping_t* mapping = new buffer_mapping_t;
+                mapping->id = hnd->identity.id;
+                mapping->base = mappedAddress;
+                mapping->size = size;
+                mapping->refs = 1;
+                mapping->next = NULL;
+                *m = mapping;
+            }
+            hnd->base = uintptr_t(mappedAddress) + hnd->offset;
+            //ALOGD("gralloc_map() succeeded fd=%d, off=%d, size=%d, vaddr=%p",
+            //        hnd->fd, hnd->offset, hnd->size, mappedAddress);
         }
-        hnd->base = uintptr_t(mappedAddress) + hnd->offset;
-        //ALOGD("gralloc_map() succeeded fd=%d, off=%d, size=%d, vaddr=%p",
-        //        hnd->fd, hnd->offset, hnd->size, mappedAddress);
     }
     *vaddr = (void*)hnd->base;
     return 0;
@@ -69,12 +150,27 @@ static int gralloc_unmap(gralloc_module_t const* /*module*/,
 {
     private_handle_t* hnd = (private_handle_t*)handle;
     if (!(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)) {
-        void* base = (void*)hnd->base;
+        Locker::Autolock _l(sMappingLock);
+        if (!hnd->base)
+            return 0;
+        void* base = (void*)(hnd->base - hnd->offset);
         size_t size = hnd->size;
-        //ALOGD("unmapping from %p, size=%d", base, size);
-        if (munmap(base, size) < 0) {
-            ALOGE("Could not unmap %s", strerror(errno));
+        buffer_mapping_t** m = find_mapping_locked(hnd->identity.id);
+        if (hnd->identity.id && *m) {
+            // other handles still use the mapping
+            if (--(*m)->refs > 0) {
+                hnd->base = 0;
+                return 0;
+            }
+            buffer_mapping_t* mapping = *m;
+            base = mapping->base;
+            size = mapping->size;
+            *m = mapping->next;
+            delete mapping;
         }
+        //ALOGD("unmapping from %p, size=%d", base, size);
+        statsMapping(-ssize_t(size));
+        reclaimMapping(base, size);
     }
     hnd->base = 0;
     return 0;
@@ -82,54 +178,39 @@ static int gralloc_unmap(gralloc_module_t const* /*module*/,
 
 /*****************************************************************************/
 
+static volatile int32_t sNextGeneration = 0;
+
+uint32_t newHandleGeneration()
+{
+    return uint32_t(android_atomic_inc(&sNextGeneration) + 1);
+}
+
 int gralloc_register_buffer(gralloc_module_t const* module,
         buffer_handle_t handle)
 {
     if (private_handle_t::validate(handle) < 0)
         return -EINVAL;
 
-    // *** WARNING WARNING WARNING ***
-    //
-    // If a buffer handle is passed from the process that allocated it to a
-    // different process, and then back to the allocator process, we will
-    // create a second mapping of the buffer. If the process reads and writes
-    // through both mappings, normal memory ordering guarantees may be
-    // violated, depending on the processor cache implementation*.
-    //
-    // If you are deriving a new gralloc implementation from this code, don't
-    // do this. A "real" gralloc should provide a single reference-counted
-    // mapping for each buffer in a process.
-    //
-    // In the current system, there is one case that needs a buffer to be
-    // registered in the same process that allocated it. The SurfaceFlinger
-    // process acts as the IGraphicBufferAlloc Binder provider, so all gralloc
-    // allocations happen in its process. After returning the buffer handle to
-    // the IGraphicBufferAlloc client, SurfaceFlinger free's its handle to the
-    // buffer (unmapping it from the SurfaceFlinger process). If
-    // SurfaceFlinger later acts as the producer end of the buffer queue the
-    // buffer belongs to, it will get a new handle to the buffer in response
-    // to IGraphicBufferProducer::requestBuffer(). Like any buffer handle
-    // received through Binder, the SurfaceFlinger process will register it.
-    // Since it already freed its original handle, it will only end up with
-    // one mapping to the buffer and there will be no problem.
-    //
-    // Currently SurfaceFlinger only acts as a buffer producer for a remote
-    // consumer when taking screenshots and when using virtual displays.
-    //
-    // Eventually, each application should be allowed to make its own gralloc
-    // allocations, solving the problem. Also, this ashmem-based gralloc
-    // should go away, replaced with a real ion-based gralloc.
+    // A buffer handle passed from the process that allocated it to a
+    // different process, and then back to the allocator process, used to
+    // get a second mapping of the buffer, which may violate normal memory
+    // ordering guarantees on virtually-indexed caches when both are used.
+    // All handles to a buffer now share the one mapping of the process, see
+    // sMappings, so registering in the allocating process is safe.
     //
-    // * Specifically, associative virtually-indexed caches are likely to have
-    //   problems. Most modern L1 caches fit that description.
+    // The buffer is not mapped here: most buffers are only ever handed to
+    // the GPU or to sharebuffer, so the mapping is made by the first
+    // gralloc_lock() with software usage and kept until unregistration.
 
     private_handle_t* hnd = (private_handle_t*)handle;
-    ALOGD_IF(hnd->pid == getpid(),
-            "Registering a buffer in the process that created it. "
-            "This may cause memory ordering problems.");
-
-    void *vaddr;
-    return gralloc_map(module, handle, &vaddr);
+    if (!(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER))
+        hnd->base = 0;
+    // a new handle to the buffer in this process
+    if (hnd->identity.id) {
+        hnd->identity.generation = newHandleGeneration();
+        hnd->identity.flags = 0;
+    }
+    return 0;
 }
 
 int gralloc_unregister_buffer(gralloc_module_t const* module,
@@ -149,7 +230,7 @@ int mapBuffer(gralloc_module_t const* module,
         private_handle_t* hnd)
 {
     void* vaddr;
-    return gralloc_map(module, hnd, &vaddr);
+    return gralloc_map(module, hnd, hnd->usage, true, &vaddr);
 }
 
 int terminateBuffer(gralloc_module_t const* module,
@@ -163,10 +244,105 @@ int terminateBuffer(gralloc_module_t const* module,
     return 0;
 }
 
-int gralloc_lock(gralloc_module_t const* /*module*/,
-        buffer_handle_t handle, int /*usage*/,
-        int /*l*/, int /*t*/, int /*w*/, int /*h*/,
-        void** vaddr)
+/*
+ * Faults in the pages of rows rows of bytes bytes starting at offset, row
+ * after row stride bytes apart, in one call rather than a fault per page.
+ * Kernels before 5.14 can only be told that the pages will be needed.
+ */
+static void prefault_rows(private_handle_t const* hnd, int usage,
+        size_t offset, size_t stride, size_t rows, size_t bytes)
+{
+    if (!rows || !bytes)
+        return;
+    uintptr_t base = uintptr_t(hnd->base - hnd->offset);
+    uintptr_t start = (base + offset) & ~uintptr_t(PAGE_SIZE-1);
+    uintptr_t end = roundUpToPageSize(base + offset + (rows-1)*stride + bytes);
+    if (end > base + hnd->size)
+        end = base + hnd->size;
+    if (start >= end)
+        return;
+
+    // rows read or written one after the other, let reclaim and
+    // readahead know the pages are used in order
+    if (bytes == stride)
+        madvise((void*)start, end - start, MADV_SEQUENTIAL);
+    int advice = (usage & GRALLOC_USAGE_SW_WRITE_MASK) ?
+            MADV_POPULATE_WRITE : MADV_POPULATE_READ;
+    if (madvise((void*)start, end - start, advice) < 0 && errno == EINVAL)
+        madvise((void*)start, end - start, MADV_WILLNEED);
+}
+
+/* prefaults the pages of the l, t, w, h rectangle of a mapped buffer */
+static void prefault_rect(private_handle_t const* hnd, int usage,
+        int l, int t, int w, int h)
+{
+    int bpp = getBytesPerPixel(hnd->format);
+    if (bpp) {
+        size_t stride = size_t(hnd->stride) * bpp;
+        // a full width rectangle is one run, rows and padding
+        size_t bytes = size_t(w) == size_t(hnd->width) ? stride : size_t(w) * bpp;
+        prefault_rows(hnd, usage, t*stride + l*bpp, stride, h, bytes);
+        return;
+    }
+
+    yuv_layout_t layout;
+    if (!getYuvLayout(hnd->format, hnd->stride, hnd->height, &layout))
+        return;
+    size_t ybytes = w == hnd->width ? layout.ystride : size_t(w);
+    prefault_rows(hnd, usage, t*layout.ystride + l, layout.ystride, h, ybytes);
+
+    // the chroma rows and columns of the rectangle, in each chroma plane
+    size_t ct = t / 2, ch = (t + h + 1) / 2 - ct;
+    size_t cl = (l / 2) * layout.chroma_step;
+    size_t cw = ((l + w + 1) / 2 - l / 2) * layout.chroma_step;
+    size_t cbytes = w == hnd->width ? layout.cstride : cw;
+    size_t cb = layout.cb_offset, cr = layout.cr_offset;
+    if (layout.chroma_step == 2) {
+        // interleaved, one plane from the first of cb and cr
+        prefault_rows(hnd, usage, (cb < cr ? cb : cr) + ct*layout.cstride + cl,
+                layout.cstride, ch, cbytes);
+    } else {
+        prefault_rows(hnd, usage, cb + ct*layout.cstride + cl,
+                layout.cstride, ch, cbytes);
+        prefault_rows(hnd, usage, cr + ct*layout.cstride + cl,
+                layout.cstride, ch, cbytes);
+    }
+}
+
+/*
+ * The buffers of this gralloc are only written by the CPU or by producers
+ * that signal a fence, so an async lock maps the buffer while the producer
+ * may still be busy and then waits on its fence, before the cache is
+ * synced for the CPU as the last step before the caller can touch the
+ * memory. The lock takes the fence in any case.
+ */
+static int wait_lock_fence(buffer_handle_t handle, int fenceFd)
+{
+    if (fenceFd < 0)
+        return 0;
+    int err = sync_wait(fenceFd, LOCK_FENCE_WARN_MS);
+    if (err < 0 && errno == ETIME) {
+        ALOGW("buffer %p still not ready after %d ms, waiting",
+                handle, LOCK_FENCE_WARN_MS);
+        err = sync_wait(fenceFd, -1);
+    }
+    if (err < 0) {
+        err = -errno;
+        ALOGE("buffer %p fence wait failed: %s", handle, strerror(errno));
+    }
+    close(fenceFd);
+    return err;
+}
+
+static void close_lock_fence(int fenceFd)
+{
+    if (fenceFd >= 0)
+        close(fenceFd);
+}
+
+static int lock_buffer(gralloc_module_t const* module,
+        private_handle_t* hnd, int usage,
+        int l, int t, int w, int h, void** vaddr, int fenceFd)
 {
     // this is called when a buffer is being locked for software
     // access. in thin implementation we have nothing to do since
@@ -176,14 +352,96 @@ int gralloc_lock(gralloc_module_t const* /*module*/,
     // flushed or invalidated depending on the usage bits and the
     // hardware.
 
-    if (private_handle_t::validate(handle) < 0)
+    const int swUsage = usage & (GRALLOC_USAGE_SW_READ_MASK |
+            GRALLOC_USAGE_SW_WRITE_MASK);
+    ALOGW_IF(hnd->usage && (swUsage & ~hnd->usage),
+            "lock usage %#x not in allocation usage %#x", usage, hnd->usage);
+
+    // only part of the buffer is about to be touched
+    const bool partial = w > 0 && h > 0 && l >= 0 && t >= 0 &&
+            l + w <= hnd->width && t + h <= hnd->height &&
+            (w < hnd->width || h < hnd->height) &&
+            !(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER);
+    if (!hnd->base && swUsage) {
+        // first software access to the buffer in this process
+        int err = gralloc_map(module, hnd, usage, !partial, vaddr);
+        if (err < 0) {
+            close_lock_fence(fenceFd);
+            return err;
+        }
+    }
+    if (swUsage && partial)
+        prefault_rect(hnd, swUsage, l, t, w, h);
+    // the producer may still write the buffer until its fence signals
+    int err = wait_lock_fence(hnd, fenceFd);
+    if (err < 0)
+        return err;
+    if (swUsage)
+        syncHeapRegion(hnd, swUsage, true);
+    *vaddr = (void*)hnd->base;
+    return 0;
+}
+
+static int lock_handle(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        void** vaddr, int fenceFd)
+{
+    private_handle_t* hnd = (private_handle_t*)handle;
+    // flexible YUV buffers can only be locked with lock_ycbcr
+    if (private_handle_t::validate(handle) < 0 ||
+            hnd->format == HAL_PIXEL_FORMAT_YCbCr_420_888) {
+        close_lock_fence(fenceFd);
         return -EINVAL;
+    }
+    return lock_buffer(module, hnd, usage, l, t, w, h, vaddr, fenceFd);
+}
 
+static int lock_handle_ycbcr(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        struct android_ycbcr *ycbcr, int fenceFd)
+{
     private_handle_t* hnd = (private_handle_t*)handle;
-    *vaddr = (void*)hnd->base;
+    yuv_layout_t layout;
+    if (private_handle_t::validate(handle) < 0 ||
+            !getYuvLayout(hnd->format, hnd->stride, hnd->height, &layout)) {
+        close_lock_fence(fenceFd);
+        return -EINVAL;
+    }
+
+    void* vaddr;
+    int err = lock_buffer(module, hnd, usage, l, t, w, h, &vaddr, fenceFd);
+    if (err < 0)
+        return err;
+
+    uint8_t* base = (uint8_t*)vaddr;
+    memset(ycbcr, 0, sizeof(*ycbcr));
+    ycbcr->y = base;
+    ycbcr->cb = base + layout.cb_offset;
+    ycbcr->cr = base + layout.cr_offset;
+    ycbcr->ystride = layout.ystride;
+    ycbcr->cstride = layout.cstride;
+    ycbcr->chroma_step = layout.chroma_step;
     return 0;
 }
 
+int gralloc_lock(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        void** vaddr)
+{
+    return lock_handle(module, handle, usage, l, t, w, h, vaddr, -1);
+}
+
+int gralloc_lock_ycbcr(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        struct android_ycbcr *ycbcr)
+{
+    return lock_handle_ycbcr(module, handle, usage, l, t, w, h, ycbcr, -1);
+}
+
 int gralloc_unlock(gralloc_module_t const* /*module*/,
         buffer_handle_t handle)
 {
@@ -192,5 +450,35 @@ int gralloc_unlock(gralloc_module_t const* /*module*/,
 
     if (private_handle_t::validate(handle) < 0)
         return -EINVAL;
+
+    private_handle_t* hnd = (private_handle_t*)handle;
+    if (hnd->base) {
+        syncHeapRegion(hnd,
+                GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK, false);
+    }
     return 0;
 }
+
+int gralloc_lock_async(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        void** vaddr, int fenceFd)
+{
+    return lock_handle(module, handle, usage, l, t, w, h, vaddr, fenceFd);
+}
+
+int gralloc_lock_async_ycbcr(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        struct android_ycbcr *ycbcr, int fenceFd)
+{
+    return lock_handle_ycbcr(module, handle, usage, l, t, w, h, ycbcr, fenceFd);
+}
+
+int gralloc_unlock_async(gralloc_module_t const* module,
+        buffer_handle_t handle, int* fenceFd)
+{
+    // software access is over when unlock returns, no work is left pending
+    *fenceFd = -1;
+    return gralloc_unlock(module, handle);
+}
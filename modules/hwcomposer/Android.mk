@@ -20,7 +20,8 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE_RELATIVE_PATH := hw
-LOCAL_SHARED_LIBRARIES := liblog libEGL
+LOCAL_SHARED_LIBRARIES := liblog libcutils libhardware libsync libutils
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../gralloc
 LOCAL_SRC_FILES := hwcomposer.cpp
 LOCAL_MODULE := hwcomposer.default
 LOCAL_CFLAGS:= -DLOG_TAG=\"hwcomposer\"
@@ -14,23 +14,241 @@
  * limitations under the License.
  */
 
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+
 #include <hardware/hardware.h>
 
 #include <fcntl.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
 
 #include <cutils/log.h>
 #include <cutils/atomic.h>
+#include <cutils/properties.h>
+#include <sync/sync.h>
+#include <system/thread_defs.h>
+#include <utils/Trace.h>
 
+#include <hardware/gralloc.h>
+#include <hardware/hal_trace.h>
 #include <hardware/hwcomposer.h>
+#include <hardware/sb.h>
 
-#include <EGL/egl.h>
+#include "gralloc_priv.h"
 
 /*****************************************************************************/
 
+/*
+ * Displays.
+ *
+ * SurfaceFlinger composites everything not handled here into the
+ * framebuffer target of a display. The primary display's framebuffer
+ * target is posted to the framebuffer device of the gralloc module. There
+ * is no external display, it is never reported. Virtual displays, such as
+ * the ones recording the screen, are always composited with GL: the
+ * framebuffer target then is the outbuf, which SurfaceFlinger renders into
+ * directly, and set() only has to hand its fence on.
+ */
+
+/*
+ * Composition strategy for the primary display.
+ *
+ * When the sharebuffer module is connected to the Sailfish renderer, the
+ * topmost layer is handed to the renderer as it is, as the sharebuffer
+ * layer HWC_OVERLAY_LAYER_NAME, instead of being composited by
+ * SurfaceFlinger with GL. Since the renderer shows that layer above
+ * whatever Android composes, this is only done when nothing needs to be
+ * shown on top of it, i.e. when it is the topmost layer, and it either is
+ * the only layer or covers the whole display opaquely. The layers below a
+ * covering layer are hidden: they are marked HWC_OVERLAY too and neither
+ * posted nor composited. Every other frame is composited with GL.
+ *
+ * The renderer only sees the overlay layer while it is in use: it is
+ * closed when a frame goes back to GL composition.
+ *
+ * Layers posted to the renderer take their acquire fence along, so the
+ * renderer waits for the GPU rendering on its own GPU rather than set()
+ * on the CPU, and get the release fence of their post. The release fence
+ * of the previous overlay post is the retire fence of the frame, which
+ * signals once the new one replaced it on screen.
+ */
+#define HWC_OVERLAY_LAYER_NAME  "hwcomposer"
+
+/*
+ * Camera preview underlay.
+ *
+ * A camera preview at the bottom of the primary display, typically behind
+ * the controls of the camera app, cannot be the overlay layer. When its
+ * buffer is YUV as the camera HAL filled it and the renderer imports that
+ * format and stacks underlays, it is handed to the renderer as the
+ * sharebuffer layer HWC_UNDERLAY_LAYER_NAME with SB_HINT_UNDERLAY instead:
+ * it is marked HWC_OVERLAY, so SurfaceFlinger leaves it out of the GL
+ * composition and clears its area to transparent, and the framebuffer
+ * target is posted to the renderer as HWC_OVERLAY_LAYER_NAME, blended
+ * above the preview, rather than to the framebuffer. The preview frames
+ * then are never converted nor composited by Android.
+ */
+#define HWC_UNDERLAY_LAYER_NAME "camera"
+
+/* how long set() waits for the buffer of the overlay layer to be rendered */
+#define HWC_ACQUIRE_TIMEOUT_MS  1000
+
+/*
+ * Frame diffing.
+ *
+ * prepare() compares the layers of every frame with those of the previous
+ * one. When the same buffers are shown with the same geometry, the display
+ * already shows the frame: all layers are marked HWC_OVERLAY and set() does
+ * nothing. Otherwise the union of the display frames of the layers that
+ * changed is set as the update rectangle of the framebuffer, which then
+ * only copies that part of the framebuffer target when it cannot flip.
+ * Layers without a buffer, such as dim layers, and skipped layers may
+ * change without us seeing it and are always considered changed.
+ */
+#define HWC_MAX_CACHED_LAYERS   32
+
+/* what a layer looked like in the previous frame */
+struct hwc_layer_state_t {
+    buffer_handle_t handle;
+    uint32_t flags;
+    uint32_t transform;
+    int32_t blending;
+    /* raw, holds sourceCropf */
+    hwc_rect_t sourceCrop;
+    hwc_rect_t displayFrame;
+    uint8_t planeAlpha;
+};
+
+struct hwc_display_cache_t {
+    /* layers holds the frame on the display */
+    bool valid;
+    size_t numLayers;
+    hwc_layer_state_t layers[HWC_MAX_CACHED_LAYERS];
+
+    /* the current frame is the one on the display */
+    bool unchanged;
+    /* area of the display the current frame changes, may be empty */
+    hwc_rect_t damage;
+};
+
+/*
+ * Timing of the frames of the primary display, for dump(). Waiting for a
+ * fence is the GPU still rendering a layer or the composition, posting is
+ * the transport to the renderer or the framebuffer. The same spans are
+ * traced, together with how the layers were composited.
+ */
+#define HWC_TIMING_FRAMES       32
+
+struct hwc_frame_timing_t {
+    int64_t prepare_ns;
+    /* all of set(), including the fence waits and posts */
+    int64_t set_ns;
+    int64_t fence_ns;
+    int64_t post_ns;
+    /* composited with GL, posted to the renderer, hidden by the overlay */
+    uint32_t framebuffer_layers;
+    uint32_t overlay_layers;
+    uint32_t hidden_layers;
+    /* the display already showed the frame */
+    bool skipped;
+};
+
+struct hwc_timing_t {
+    uint64_t frames;
+    uint64_t skipped;
+    uint64_t overlay_frames;
+    int64_t prepare_total_ns;
+    int64_t prepare_max_ns;
+    int64_t set_total_ns;
+    int64_t set_max_ns;
+    int64_t fence_total_ns;
+    int64_t fence_max_ns;
+    int64_t post_total_ns;
+    int64_t post_max_ns;
+    /* the last frames, frames % HWC_TIMING_FRAMES is the next one */
+    hwc_frame_timing_t recent[HWC_TIMING_FRAMES];
+};
+
+/*
+ * Vsync events are generated by a thread, only while SurfaceFlinger has
+ * them enabled with eventControl(). Their timestamps come from, in order:
+ * the vsync the Sailfish renderer reports through sharebuffer, which is
+ * the display the frames end up on, the framebuffer driver through the
+ * gralloc module, or a timer running at the refresh rate.
+ */
+enum vsync_source_t {
+    VSYNC_SOURCE_RENDERER,
+    VSYNC_SOURCE_FRAMEBUFFER,
+    VSYNC_SOURCE_TIMER,
+};
+
 struct hwc_context_t {
     hwc_composer_device_1_t device;
     /* our private state goes below here */
+
+    /* NULL if the sharebuffer module is not available or disabled */
+    sharebuffer_device_t* sb;
+    /* the sharebuffer layer selected and the thread it was selected on */
+    const char* sb_layer;
+    pthread_t sb_thread;
+    bool sb_thread_valid;
+
+    /* index of the layer posted to the renderer by set(), -1 if none */
+    int overlay;
+    /* the overlay layer is known to the renderer */
+    bool overlay_shown;
+    /* posting failed, composite with GL until the geometry changes */
+    bool overlay_failed;
+    /* the layer last posted to the renderer */
+    hwc_layer_state_t overlay_state;
+    /* release fence of the latest overlay post, -1 if none */
+    int retire_fence;
+
+    /* index of the layer posted as the camera underlay by set(), -1 if none */
+    int underlay;
+    bool underlay_shown;
+    /* the renderer refused the underlay, composite with GL until the geometry changes */
+    bool underlay_failed;
+    hwc_layer_state_t underlay_state;
+
+    /* the primary display */
+    framebuffer_device_t* fb;
+    hwc_display_cache_t cache;
+    /* the framebuffer shows the previous frame, composited with GL */
+    bool composited;
+    /* nothing to do in set() */
+    bool skip;
+
+    /* the primary display frame between prepare() and set() */
+    hwc_frame_timing_t frame;
+    /* dump() runs on another thread */
+    pthread_mutex_t timing_lock;
+    hwc_timing_t timing;
+
+    hwc_procs_t const* procs;
+    gralloc_module_t const* gralloc;
+
+    /* attributes of the primary display */
+    int32_t width;
+    int32_t height;
+    /* dots per thousand inches */
+    int32_t xdpi;
+    int32_t ydpi;
+    int64_t vsync_period;
+
+    pthread_mutex_t vsync_lock;
+    pthread_cond_t vsync_cond;
+    /* protected by vsync_lock */
+    bool vsync_enabled;
+    bool vsync_exit;
+    pthread_t vsync_thread;
+    bool vsync_thread_started;
 };
 
 static int hwc_device_open(const struct hw_module_t* module, const char* name,
@@ -55,40 +273,861 @@ hwc_module_t HAL_MODULE_INFO_SYM = {
 /*****************************************************************************/
 
 static void dump_layer(hwc_layer_1_t const* l) {
-    ALOGD("\ttype=%d, flags=%08x, handle=%p, tr=%02x, blend=%04x, {%d,%d,%d,%d}, {%d,%d,%d,%d}",
+    ALOGD("\ttype=%d, flags=%08x, handle=%p, tr=%02x, blend=%04x, {%.1f,%.1f,%.1f,%.1f}, {%d,%d,%d,%d}",
             l->compositionType, l->flags, l->handle, l->transform, l->blending,
-            l->sourceCrop.left,
-            l->sourceCrop.top,
-            l->sourceCrop.right,
-            l->sourceCrop.bottom,
+            l->sourceCropf.left,
+            l->sourceCropf.top,
+            l->sourceCropf.right,
+            l->sourceCropf.bottom,
             l->displayFrame.left,
             l->displayFrame.top,
             l->displayFrame.right,
             l->displayFrame.bottom);
 }
 
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+/* the buffer of the layer if it was allocated by our gralloc, else NULL */
+static private_handle_t const* overlay_buffer(hwc_layer_1_t const* l) {
+    if (!l->handle || !gralloc_buffer_identity(l->handle) ||
+            l->handle->numInts != private_handle_t::sNumInts()) {
+        return NULL;
+    }
+    return static_cast<private_handle_t const*>(l->handle);
+}
+
+/* sharebuffer keeps the current layer per thread */
+static void sb_select_layer(hwc_context_t* ctx, const char* name) {
+    if (!ctx->sb_thread_valid || !pthread_equal(ctx->sb_thread, pthread_self()) ||
+            ctx->sb_layer != name) {
+        ctx->sb->set_layer_name(ctx->sb, name);
+        ctx->sb_layer = name;
+        ctx->sb_thread = pthread_self();
+        ctx->sb_thread_valid = true;
+    }
+}
+
+/* YUV formats of our gralloc, as the camera HAL fills its buffers */
+static bool is_yuv_format(int format) {
+    switch (format) {
+        case HAL_PIXEL_FORMAT_YV12:
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+        case HAL_PIXEL_FORMAT_YCbCr_420_888:
+            return true;
+    }
+    return false;
+}
+
+static bool covers_display(hwc_context_t* ctx, hwc_layer_1_t const* l) {
+    hwc_rect_t const& f = l->displayFrame;
+    return l->blending == HWC_BLENDING_NONE && l->planeAlpha == 255 &&
+            f.left <= 0 && f.top <= 0 &&
+            f.right >= ctx->width && f.bottom >= ctx->height;
+}
+
+/* the layers to composite, without the framebuffer target */
+static size_t num_layers(hwc_display_contents_1_t const* list) {
+    size_t n = list->numHwLayers;
+    if (n && list->hwLayers[n - 1].compositionType == HWC_FRAMEBUFFER_TARGET) {
+        n--;
+    }
+    return n;
+}
+
+static hwc_layer_1_t* framebuffer_target(hwc_display_contents_1_t* list) {
+    size_t n = list->numHwLayers;
+    if (n && list->hwLayers[n - 1].compositionType == HWC_FRAMEBUFFER_TARGET) {
+        return &list->hwLayers[n - 1];
+    }
+    return NULL;
+}
+
+static bool rect_empty(hwc_rect_t const& r) {
+    return r.left >= r.right || r.top >= r.bottom;
+}
+
+static void rect_union(hwc_rect_t* r, hwc_rect_t const& a) {
+    if (rect_empty(a)) {
+        return;
+    }
+    if (rect_empty(*r)) {
+        *r = a;
+        return;
+    }
+    if (a.left < r->left) r->left = a.left;
+    if (a.top < r->top) r->top = a.top;
+    if (a.right > r->right) r->right = a.right;
+    if (a.bottom > r->bottom) r->bottom = a.bottom;
+}
+
+static void layer_state(hwc_layer_state_t* state, hwc_layer_1_t const* l) {
+    // compared with memcmp(), padding included
+    memset(state, 0, sizeof(*state));
+    state->handle = l->handle;
+    state->flags = l->flags;
+    state->transform = l->transform;
+    state->blending = l->blending;
+    state->sourceCrop = l->sourceCrop;
+    state->displayFrame = l->displayFrame;
+    state->planeAlpha = l->planeAlpha;
+}
+
+static bool layer_unchanged(hwc_layer_state_t const* state, hwc_layer_1_t const* l) {
+    hwc_layer_state_t current;
+    layer_state(&current, l);
+    return l->handle && !(l->flags & HWC_SKIP_LAYER) &&
+            !memcmp(state, &current, sizeof(current));
+}
+
+/* compares list with the previous frame and makes it the cached one */
+static void cache_update(hwc_display_cache_t* cache, hwc_display_contents_1_t* list) {
+    size_t n = num_layers(list);
+    hwc_rect_t damage = { 0, 0, 0, 0 };
+    bool unchanged = cache->valid && n == cache->numLayers &&
+            !(list->flags & HWC_GEOMETRY_CHANGED);
+
+    for (size_t i=0 ; i<n ; i++) {
+        hwc_layer_1_t const* l = &list->hwLayers[i];
+        bool cached = cache->valid && i < cache->numLayers;
+        if (cached && layer_unchanged(&cache->layers[i], l)) {
+            continue;
+        }
+        unchanged = false;
+        rect_union(&damage, l->displayFrame);
+        if (cached) {
+            rect_union(&damage, cache->layers[i].displayFrame);
+        }
+    }
+    // what the layers that went away covered
+    for (size_t i=n ; cache->valid && i<cache->numLayers ; i++) {
+        rect_union(&damage, cache->layers[i].displayFrame);
+    }
+
+    cache->unchanged = unchanged;
+    cache->damage = damage;
+    cache->valid = n <= HWC_MAX_CACHED_LAYERS;
+    cache->numLayers = cache->valid ? n : 0;
+    for (size_t i=0 ; i<cache->numLayers ; i++) {
+        layer_state(&cache->layers[i], &list->hwLayers[i]);
+    }
+}
+
+/* index of the layer to post to the renderer, -1 to composite with GL */
+static int choose_overlay(hwc_context_t* ctx, hwc_display_contents_1_t* list) {
+    size_t n = num_layers(list);
+    if (!ctx->sb || ctx->overlay_failed || n == 0) {
+        return -1;
+    }
+
+    int top = n - 1;
+    hwc_layer_1_t const* l = &list->hwLayers[top];
+    if (l->flags & HWC_SKIP_LAYER) {
+        return -1;
+    }
+    private_handle_t const* hnd = overlay_buffer(l);
+    if (!hnd) {
+        return -1;
+    }
+    if (top > 0 && !covers_display(ctx, l)) {
+        return -1;
+    }
+
+    sb_select_layer(ctx, HWC_OVERLAY_LAYER_NAME);
+    if (!ctx->sb->is_connected(ctx->sb)) {
+        return -1;
+    }
+    if (ctx->sb->common.version >= SHAREBUFFER_DEVICE_API_VERSION_1_2 &&
+            ctx->sb->isFormatSupported && !ctx->sb->isFormatSupported(ctx->sb, hnd->format)) {
+        return -1;
+    }
+    return top;
+}
+
+/* index of the layer to post as the camera underlay, -1 if none */
+static int choose_underlay(hwc_context_t* ctx, hwc_display_contents_1_t* list) {
+    size_t n = num_layers(list);
+    // a preview alone already is the overlay when it can be posted at all
+    if (!ctx->sb || ctx->underlay_failed || ctx->overlay_failed || n < 2 ||
+            !framebuffer_target(list) ||
+            ctx->sb->common.version < SHAREBUFFER_DEVICE_API_VERSION_1_2 ||
+            !ctx->sb->setLayerHints || !ctx->sb->isFormatSupported) {
+        return -1;
+    }
+
+    hwc_layer_1_t const* l = &list->hwLayers[0];
+    if (l->flags & HWC_SKIP_LAYER) {
+        return -1;
+    }
+    private_handle_t const* hnd = overlay_buffer(l);
+    if (!hnd || !(hnd->usage & GRALLOC_USAGE_HW_CAMERA_WRITE) || !is_yuv_format(hnd->format)) {
+        return -1;
+    }
+
+    sb_select_layer(ctx, HWC_UNDERLAY_LAYER_NAME);
+    if (!ctx->sb->is_connected(ctx->sb) || !ctx->sb->isFormatSupported(ctx->sb, hnd->format)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void prepare_primary(hwc_context_t* ctx, hwc_display_contents_1_t* list) {
+    size_t n = num_layers(list);
+    if (list->flags & HWC_GEOMETRY_CHANGED) {
+        ctx->overlay_failed = false;
+        ctx->underlay_failed = false;
+    }
+
+    cache_update(&ctx->cache, list);
+    ctx->skip = ctx->cache.unchanged;
+    if (ctx->skip) {
+        for (size_t i=0 ; i<n ; i++) {
+            list->hwLayers[i].compositionType = HWC_OVERLAY;
+        }
+        return;
+    }
+
+    // The buffers may change without a geometry change, so this is decided
+    // for every frame.
+    ctx->overlay = choose_overlay(ctx, list);
+    ctx->underlay = ctx->overlay < 0 ? choose_underlay(ctx, list) : -1;
+    for (size_t i=0 ; i<n ; i++) {
+        //dump_layer(&list->hwLayers[i]);
+        list->hwLayers[i].compositionType =
+                ctx->overlay >= 0 || (int)i == ctx->underlay ? HWC_OVERLAY : HWC_FRAMEBUFFER;
+    }
+}
+
 static int hwc_prepare(hwc_composer_device_1_t *dev,
         size_t numDisplays, hwc_display_contents_1_t** displays) {
-    if (displays && (displays[0]->flags & HWC_GEOMETRY_CHANGED)) {
-        for (size_t i=0 ; i<displays[0]->numHwLayers ; i++) {
-            //dump_layer(&list->hwLayers[i]);
-            displays[0]->hwLayers[i].compositionType = HWC_FRAMEBUFFER;
+    ATRACE_CALL();
+    HAL_TRACE_CALL();
+    hwc_context_t* ctx = (hwc_context_t*)dev;
+    if (!displays) {
+        return 0;
+    }
+
+    for (size_t d=0 ; d<numDisplays ; d++) {
+        hwc_display_contents_1_t* list = displays[d];
+        if (!list) {
+            continue;
+        }
+        if (d == HWC_DISPLAY_PRIMARY) {
+            int64_t start = now_ns();
+            memset(&ctx->frame, 0, sizeof(ctx->frame));
+            prepare_primary(ctx, list);
+            ctx->frame.prepare_ns = now_ns() - start;
+            continue;
+        }
+        for (size_t i=0 ; i<num_layers(list) ; i++) {
+            list->hwLayers[i].compositionType = HWC_FRAMEBUFFER;
         }
     }
     return 0;
 }
 
-static int hwc_set(hwc_composer_device_1_t *dev,
-        size_t numDisplays, hwc_display_contents_1_t** displays)
-{
+static void close_overlay(hwc_context_t* ctx) {
+    if (ctx->overlay_shown) {
+        ctx->sb->close_layer(ctx->sb, HWC_OVERLAY_LAYER_NAME);
+        // closing dropped the session, it is created again on next use
+        ctx->sb_thread_valid = false;
+        ctx->overlay_shown = false;
+        if (ctx->retire_fence >= 0) {
+            close(ctx->retire_fence);
+            ctx->retire_fence = -1;
+        }
+    }
+}
+
+static void close_underlay(hwc_context_t* ctx) {
+    if (ctx->underlay_shown) {
+        ctx->sb->close_layer(ctx->sb, HWC_UNDERLAY_LAYER_NAME);
+        ctx->sb_thread_valid = false;
+        ctx->underlay_shown = false;
+    }
+}
+
+/* the display still shows the overlay layer as last posted */
+static bool overlay_unchanged(hwc_context_t* ctx, hwc_layer_1_t const* l) {
+    return ctx->overlay_shown && layer_unchanged(&ctx->overlay_state, l);
+}
+
+static bool underlay_unchanged(hwc_context_t* ctx, hwc_layer_1_t const* l) {
+    return ctx->underlay_shown && layer_unchanged(&ctx->underlay_state, l);
+}
+
+/* waits for the GPU to be done with the buffer of l and closes its fence */
+static void wait_acquire_fence(hwc_context_t* ctx, hwc_layer_1_t* l) {
+    if (l->acquireFenceFd < 0) {
+        return;
+    }
+
+    ATRACE_BEGIN("wait acquire fence");
+    int64_t start = now_ns();
+    if (sync_wait(l->acquireFenceFd, HWC_ACQUIRE_TIMEOUT_MS) < 0) {
+        ALOGW("buffer %p not ready: %s", l->handle, strerror(errno));
+    }
+    ctx->frame.fence_ns += now_ns() - start;
+    ATRACE_END();
+
+    close(l->acquireFenceFd);
+    l->acquireFenceFd = -1;
+}
+
+/*
+ * Posts the buffer of l to the sharebuffer layer name, with the hints of
+ * its geometry and hint_flags.
+ */
+static int post_layer(hwc_context_t* ctx, hwc_layer_1_t* l, const char* name,
+        uint32_t hint_flags) {
+    private_handle_t const* hnd = overlay_buffer(l);
+    if (!hnd) {
+        return -EINVAL;
+    }
+
+    sb_select_layer(ctx, name);
+    if (ctx->sb->common.version >= SHAREBUFFER_DEVICE_API_VERSION_1_1 &&
+            ctx->sb->setLayerHints) {
+        sb_layer_hints_t hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.flags = hint_flags;
+        if (l->blending == HWC_BLENDING_NONE) {
+            hints.flags |= SB_HINT_OPAQUE;
+        }
+        if (covers_display(ctx, l)) {
+            hints.flags |= SB_HINT_FULLSCREEN;
+        }
+        hints.transform = l->transform;
+        // the pixels touched by the crop
+        hints.crop.left = (int)floorf(l->sourceCropf.left);
+        hints.crop.top = (int)floorf(l->sourceCropf.top);
+        hints.crop.right = (int)ceilf(l->sourceCropf.right);
+        hints.crop.bottom = (int)ceilf(l->sourceCropf.bottom);
+        hints.frame.left = l->displayFrame.left;
+        hints.frame.top = l->displayFrame.top;
+        hints.frame.right = l->displayFrame.right;
+        hints.frame.bottom = l->displayFrame.bottom;
+        hints.plane_alpha = l->planeAlpha;
+        int err = ctx->sb->setLayerHints(ctx->sb, &hints);
+        // without them the layer would not be where it belongs
+        if (err < 0 && hint_flags) {
+            return err;
+        }
+    }
+
+    // the renderer waits for the GPU rendering on its own GPU
+    if (ctx->sb->common.version >= SHAREBUFFER_DEVICE_API_VERSION_1_5 &&
+            ctx->sb->setAcquireFence) {
+        ctx->sb->setAcquireFence(ctx->sb, l->acquireFenceFd);
+        l->acquireFenceFd = -1;
+    } else {
+        wait_acquire_fence(ctx, l);
+    }
+
+    ATRACE_BEGIN("sharebuffer post");
+    int64_t start = now_ns();
+    int err;
+    if (ctx->sb->postAsync) {
+        err = ctx->sb->postAsync(ctx->sb, l->handle, hnd->width, hnd->height,
+                hnd->stride, hnd->format, &l->releaseFenceFd);
+    } else {
+        err = ctx->sb->post(ctx->sb, l->handle, hnd->width, hnd->height,
+                hnd->stride, hnd->format);
+    }
+    ctx->frame.post_ns += now_ns() - start;
+    ATRACE_END();
+    return err;
+}
+
+static int post_overlay(hwc_context_t* ctx, hwc_layer_1_t* l) {
+    int err = post_layer(ctx, l, HWC_OVERLAY_LAYER_NAME, 0);
+    if (err == 0) {
+        ctx->overlay_shown = true;
+        layer_state(&ctx->overlay_state, l);
+    }
+    return err;
+}
+
+/*
+ * The release fence of the previous overlay post signals once the renderer
+ * shows the post of l in its place, which is what the retire fence of this
+ * frame stands for.
+ */
+static void set_retire_fence(hwc_context_t* ctx, hwc_display_contents_1_t* list,
+        hwc_layer_1_t const* l) {
+    list->retireFenceFd = ctx->retire_fence;
+    ctx->retire_fence = l->releaseFenceFd >= 0 ? dup(l->releaseFenceFd) : -1;
+}
+
+static int post_underlay(hwc_context_t* ctx, hwc_layer_1_t* l) {
+    int err = post_layer(ctx, l, HWC_UNDERLAY_LAYER_NAME, SB_HINT_UNDERLAY);
+    if (err == 0) {
+        ctx->underlay_shown = true;
+        layer_state(&ctx->underlay_state, l);
+    }
+    return err;
+}
+
+static int post_framebuffer(hwc_context_t* ctx, hwc_layer_1_t* target,
+        hwc_rect_t const& damage) {
+    wait_acquire_fence(ctx, target);
+
+    hwc_rect_t r = damage;
+    if (r.left < 0) r.left = 0;
+    if (r.top < 0) r.top = 0;
+    if (r.right > ctx->width) r.right = ctx->width;
+    if (r.bottom > ctx->height) r.bottom = ctx->height;
+    if (ctx->fb->setUpdateRect && !rect_empty(r)) {
+        ctx->fb->setUpdateRect(ctx->fb, r.left, r.top,
+                r.right - r.left, r.bottom - r.top);
+    }
+
+    ATRACE_BEGIN("framebuffer post");
+    int64_t start = now_ns();
+    int err = ctx->fb->post(ctx->fb, target->handle);
+    ctx->frame.post_ns += now_ns() - start;
+    ATRACE_END();
+    return err;
+}
+
+static int set_primary(hwc_context_t* ctx, hwc_display_contents_1_t* list) {
     //for (size_t i=0 ; i<list->numHwLayers ; i++) {
     //    dump_layer(&list->hwLayers[i]);
     //}
 
-    EGLBoolean sucess = eglSwapBuffers((EGLDisplay)displays[0]->dpy,
-            (EGLSurface)displays[0]->sur);
-    if (!sucess) {
-        return HWC_EGL_ERROR;
+    bool composite = false;
+    for (size_t i=0 ; i<num_layers(list) ; i++) {
+        hwc_layer_1_t* l = &list->hwLayers[i];
+        if (l->compositionType == HWC_FRAMEBUFFER) {
+            ctx->frame.framebuffer_layers++;
+        } else if (((int)i == ctx->overlay || (int)i == ctx->underlay) && !ctx->skip) {
+            ctx->frame.overlay_layers++;
+        } else {
+            ctx->frame.hidden_layers++;
+        }
+
+        if (ctx->skip) {
+            // shown already
+        } else if (l->compositionType == HWC_FRAMEBUFFER) {
+            composite = true;
+        } else if ((int)i == ctx->overlay && !overlay_unchanged(ctx, l)) {
+            int err = post_overlay(ctx, l);
+            if (err == 0) {
+                set_retire_fence(ctx, list, l);
+            } else {
+                // this frame is lost, the next ones are composited with GL
+                ALOGW("posting overlay layer failed: %s, falling back to GL",
+                        strerror(-err));
+                ctx->overlay_failed = true;
+                ctx->cache.valid = false;
+            }
+        } else if ((int)i == ctx->underlay && !underlay_unchanged(ctx, l)) {
+            int err = post_underlay(ctx, l);
+            if (err < 0) {
+                ALOGW("posting camera underlay failed: %s, falling back to GL",
+                        strerror(-err));
+                ctx->underlay_failed = true;
+                ctx->cache.valid = false;
+            }
+        }
+        // hidden layers are not read, their buffers are free right away
+        if (l->acquireFenceFd >= 0) {
+            close(l->acquireFenceFd);
+            l->acquireFenceFd = -1;
+        }
+    }
+
+    if (ctx->sb && !ctx->skip && ctx->underlay < 0) {
+        close_underlay(ctx);
+    }
+
+    hwc_layer_1_t* target = framebuffer_target(list);
+    if (ctx->skip || !composite || !target) {
+        if (!ctx->skip && !composite) {
+            ctx->composited = false;
+        }
+        return 0;
+    }
+
+    // The composition has a transparent hole over the underlay, so it goes
+    // to the renderer as the overlay layer above it rather than to the
+    // opaque framebuffer.
+    if (ctx->underlay >= 0 && !ctx->underlay_failed && overlay_buffer(target)) {
+        int err = post_overlay(ctx, target);
+        if (err == 0) {
+            set_retire_fence(ctx, list, target);
+            // the framebuffer keeps its previous content
+            ctx->composited = false;
+            return 0;
+        }
+        ALOGW("posting the composition above the camera underlay failed: %s",
+                strerror(-err));
+        ctx->underlay_failed = true;
+        ctx->cache.valid = false;
+    }
+    if (ctx->sb) {
+        // the renderer would show these above the framebuffer
+        close_overlay(ctx);
+        close_underlay(ctx);
+    }
+
+    // the framebuffer only holds the previous frame if that was composited
+    hwc_rect_t damage = { 0, 0, 0, 0 };
+    if (ctx->composited) {
+        damage = ctx->cache.damage;
+    }
+    int err = post_framebuffer(ctx, target, damage);
+    ctx->composited = err == 0;
+    if (err < 0) {
+        ALOGE("posting the framebuffer target failed: %s", strerror(-err));
+        ctx->cache.valid = false;
+    }
+    return err;
+}
+
+static void set_virtual(hwc_context_t* ctx, hwc_display_contents_1_t* list) {
+    hwc_layer_1_t* target = framebuffer_target(list);
+
+    // SurfaceFlinger rendered straight into outbuf, it is written once the
+    // framebuffer target is
+    if (target && target->handle == list->outbuf) {
+        list->retireFenceFd = target->acquireFenceFd;
+        target->acquireFenceFd = -1;
+    } else if (target && target->handle) {
+        ALOGE("virtual display composited into %p instead of outbuf %p",
+                target->handle, list->outbuf);
+    }
+    if (list->outbufAcquireFenceFd >= 0) {
+        close(list->outbufAcquireFenceFd);
+        list->outbufAcquireFenceFd = -1;
+    }
+}
+
+static void timing_add(int64_t* total, int64_t* max, int64_t ns) {
+    *total += ns;
+    if (ns > *max) {
+        *max = ns;
+    }
+}
+
+/* accounts the frame of the primary display set() just showed */
+static void timing_commit(hwc_context_t* ctx) {
+    hwc_frame_timing_t const& f = ctx->frame;
+    hwc_timing_t* t = &ctx->timing;
+
+    ATRACE_INT("HWC framebuffer layers", f.framebuffer_layers);
+    ATRACE_INT("HWC overlay layers", f.overlay_layers);
+
+    pthread_mutex_lock(&ctx->timing_lock);
+    t->recent[t->frames % HWC_TIMING_FRAMES] = f;
+    t->frames++;
+    if (f.skipped) {
+        t->skipped++;
+    } else if (f.overlay_layers) {
+        t->overlay_frames++;
+    }
+    timing_add(&t->prepare_total_ns, &t->prepare_max_ns, f.prepare_ns);
+    timing_add(&t->set_total_ns, &t->set_max_ns, f.set_ns);
+    timing_add(&t->fence_total_ns, &t->fence_max_ns, f.fence_ns);
+    timing_add(&t->post_total_ns, &t->post_max_ns, f.post_ns);
+    pthread_mutex_unlock(&ctx->timing_lock);
+}
+
+static int hwc_set(hwc_composer_device_1_t *dev,
+        size_t numDisplays, hwc_display_contents_1_t** displays)
+{
+    ATRACE_CALL();
+    HAL_TRACE_CALL();
+    hwc_context_t* ctx = (hwc_context_t*)dev;
+    int err = 0;
+    if (!displays) {
+        return 0;
+    }
+
+    for (size_t d=0 ; d<numDisplays ; d++) {
+        hwc_display_contents_1_t* list = displays[d];
+        if (!list) {
+            continue;
+        }
+        if (d == HWC_DISPLAY_PRIMARY) {
+            int64_t start = now_ns();
+            ctx->frame.skipped = ctx->skip;
+            int ret = set_primary(ctx, list);
+            if (ret < 0) {
+                err = ret;
+            }
+            ctx->frame.set_ns = now_ns() - start;
+            timing_commit(ctx);
+        } else if (d == HWC_DISPLAY_VIRTUAL) {
+            set_virtual(ctx, list);
+        }
+        // we own the fences of the buffers we did not read
+        for (size_t i=0 ; i<list->numHwLayers ; i++) {
+            hwc_layer_1_t* l = &list->hwLayers[i];
+            if (l->acquireFenceFd >= 0) {
+                close(l->acquireFenceFd);
+                l->acquireFenceFd = -1;
+            }
+        }
+    }
+    return err;
+}
+
+static void sleep_until(int64_t deadline) {
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000LL;
+    ts.tv_nsec = deadline % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/*
+ * Blocks until the vsync following <last> and returns its timestamp, 0 if
+ * none could be waited for with <source> and the next one should be tried.
+ */
+static int64_t wait_vsync(hwc_context_t* ctx, vsync_source_t source, int64_t last) {
+    int64_t timestamp = 0;
+    int64_t period = ctx->vsync_period;
+
+    switch (source) {
+    case VSYNC_SOURCE_RENDERER:
+        // the renderer only reports past vsyncs, extrapolate the next one
+        if (!ctx->sb || ctx->sb->common.version < SHAREBUFFER_DEVICE_API_VERSION_1_3 ||
+                !ctx->sb->getVsync ||
+                ctx->sb->getVsync(ctx->sb, &timestamp, &period) < 0) {
+            return 0;
+        }
+        break;
+    case VSYNC_SOURCE_FRAMEBUFFER:
+        if (!ctx->gralloc || !ctx->gralloc->perform ||
+                ctx->gralloc->perform(ctx->gralloc,
+                        GRALLOC_MODULE_PERFORM_WAIT_VSYNC, &timestamp) < 0) {
+            return 0;
+        }
+        return timestamp;
+    case VSYNC_SOURCE_TIMER:
+        timestamp = last ? last : now_ns();
+        break;
+    }
+
+    // the first grid point after the previous event and now, late wakeups
+    // skip a vsync rather than report it twice
+    int64_t after = last > timestamp ? last : timestamp;
+    int64_t now = now_ns();
+    if (now > after) {
+        after = now;
+    }
+    int64_t next = timestamp + ((after - timestamp) / period + 1) * period;
+    sleep_until(next);
+    return next;
+}
+
+static void* vsync_thread(void* arg) {
+    hwc_context_t* ctx = (hwc_context_t*)arg;
+    vsync_source_t source = VSYNC_SOURCE_RENDERER;
+    bool framebufferFailed = false;
+    int64_t last = 0;
+
+    setpriority(PRIO_PROCESS, 0, HAL_PRIORITY_URGENT_DISPLAY);
+
+    pthread_mutex_lock(&ctx->vsync_lock);
+    while (true) {
+        while (!ctx->vsync_enabled && !ctx->vsync_exit) {
+            pthread_cond_wait(&ctx->vsync_cond, &ctx->vsync_lock);
+        }
+        if (ctx->vsync_exit) {
+            break;
+        }
+        pthread_mutex_unlock(&ctx->vsync_lock);
+
+        int64_t timestamp = wait_vsync(ctx, source, last);
+        if (timestamp) {
+            last = timestamp;
+            // the renderer may only start reporting later, try it every time
+            source = VSYNC_SOURCE_RENDERER;
+        } else if (source == VSYNC_SOURCE_RENDERER && !framebufferFailed) {
+            source = VSYNC_SOURCE_FRAMEBUFFER;
+        } else {
+            if (!framebufferFailed) {
+                ALOGI("no framebuffer vsync, using a timer");
+                framebufferFailed = true;
+            }
+            source = VSYNC_SOURCE_TIMER;
+        }
+
+        pthread_mutex_lock(&ctx->vsync_lock);
+        // an event disabled while waiting is not sent; SurfaceFlinger calls
+        // eventControl() from its own locks, so don't hold ours across it
+        hwc_procs_t const* procs = ctx->procs;
+        if (timestamp && ctx->vsync_enabled && procs && procs->vsync) {
+            pthread_mutex_unlock(&ctx->vsync_lock);
+            procs->vsync(procs, HWC_DISPLAY_PRIMARY, timestamp);
+            pthread_mutex_lock(&ctx->vsync_lock);
+        }
+    }
+    pthread_mutex_unlock(&ctx->vsync_lock);
+    return NULL;
+}
+
+static int hwc_event_control(hwc_composer_device_1_t* dev, int disp,
+        int event, int enabled) {
+    hwc_context_t* ctx = (hwc_context_t*)dev;
+    if (disp != HWC_DISPLAY_PRIMARY || event != HWC_EVENT_VSYNC) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&ctx->vsync_lock);
+    ctx->vsync_enabled = enabled != 0;
+    pthread_cond_signal(&ctx->vsync_cond);
+    pthread_mutex_unlock(&ctx->vsync_lock);
+    return 0;
+}
+
+static void hwc_register_procs(hwc_composer_device_1_t* dev,
+        hwc_procs_t const* procs) {
+    hwc_context_t* ctx = (hwc_context_t*)dev;
+    pthread_mutex_lock(&ctx->vsync_lock);
+    ctx->procs = procs;
+    pthread_mutex_unlock(&ctx->vsync_lock);
+}
+
+static int hwc_query(hwc_composer_device_1_t* dev, int what, int* value) {
+    hwc_context_t* ctx = (hwc_context_t*)dev;
+    switch (what) {
+    case HWC_BACKGROUND_LAYER_SUPPORTED:
+        *value = 0;
+        break;
+    case HWC_VSYNC_PERIOD:
+        *value = (int)ctx->vsync_period;
+        break;
+    case HWC_DISPLAY_TYPES_SUPPORTED:
+        *value = HWC_DISPLAY_PRIMARY_BIT | HWC_DISPLAY_VIRTUAL_BIT;
+        break;
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int64_t average(int64_t total, uint64_t count) {
+    return count ? total / (int64_t)count : 0;
+}
+
+static void hwc_dump(hwc_composer_device_1_t* dev, char* buff, int buff_len) {
+    hwc_context_t* ctx = (hwc_context_t*)dev;
+    int len = 0;
+
+    pthread_mutex_lock(&ctx->timing_lock);
+    hwc_timing_t t = ctx->timing;
+    pthread_mutex_unlock(&ctx->timing_lock);
+
+    len += snprintf(buff + len, buff_len - len,
+            "  primary display: %llu frames, %llu skipped, %llu with overlay\n"
+            "  avg/max us: prepare %lld/%lld set %lld/%lld fence %lld/%lld post %lld/%lld\n",
+            (unsigned long long)t.frames, (unsigned long long)t.skipped,
+            (unsigned long long)t.overlay_frames,
+            (long long)average(t.prepare_total_ns, t.frames) / 1000,
+            (long long)t.prepare_max_ns / 1000,
+            (long long)average(t.set_total_ns, t.frames) / 1000,
+            (long long)t.set_max_ns / 1000,
+            (long long)average(t.fence_total_ns, t.frames) / 1000,
+            (long long)t.fence_max_ns / 1000,
+            (long long)average(t.post_total_ns, t.frames) / 1000,
+            (long long)t.post_max_ns / 1000);
+
+    uint64_t n = t.frames < HWC_TIMING_FRAMES ? t.frames : HWC_TIMING_FRAMES;
+    if (n && len < buff_len) {
+        len += snprintf(buff + len, buff_len - len,
+                "  last frames (us): prepare set fence post | gl overlay hidden\n");
+    }
+    for (uint64_t i = t.frames - n; i < t.frames && len < buff_len; i++) {
+        hwc_frame_timing_t const& f = t.recent[i % HWC_TIMING_FRAMES];
+        len += snprintf(buff + len, buff_len - len,
+                "    %6lld %6lld %6lld %6lld | %u %u %u%s\n",
+                (long long)f.prepare_ns / 1000, (long long)f.set_ns / 1000,
+                (long long)f.fence_ns / 1000, (long long)f.post_ns / 1000,
+                f.framebuffer_layers, f.overlay_layers, f.hidden_layers,
+                f.skipped ? " skipped" : "");
+    }
+
+    // the transport side of the overlay layer
+    if (ctx->sb && ctx->sb->dump && len < buff_len) {
+        len += snprintf(buff + len, buff_len - len, "  sharebuffer:\n");
+        if (len < buff_len) {
+            ctx->sb->dump(ctx->sb, buff + len, buff_len - len);
+            len += strlen(buff + len);
+        }
+    }
+
+    // the trace points of every module of the process
+    if (len < buff_len) {
+        hal_trace_dump_buffer(buff + len, buff_len - len, 64);
+    }
+}
+
+static int hwc_blank(hwc_composer_device_1_t* dev, int disp, int blank) {
+    hwc_context_t* ctx = (hwc_context_t*)dev;
+    if (disp != HWC_DISPLAY_PRIMARY) {
+        return -EINVAL;
+    }
+
+    // the framebuffer content is unknown once the screen is back
+    ctx->cache.valid = false;
+    ctx->composited = false;
+    // sharebuffer stops sending frames nobody would see
+    if (ctx->sb && ctx->sb->enableScreen) {
+        ctx->sb->enableScreen(ctx->sb, !blank);
+    }
+    if (ctx->fb->enableScreen) {
+        return ctx->fb->enableScreen(ctx->fb, !blank);
+    }
+    return 0;
+}
+
+/* the primary display has a single configuration, the others are not ours */
+static int hwc_get_display_configs(hwc_composer_device_1_t* dev, int disp,
+        uint32_t* configs, size_t* numConfigs) {
+    if (disp != HWC_DISPLAY_PRIMARY) {
+        return -EINVAL;
+    }
+    if (*numConfigs > 0) {
+        configs[0] = 0;
+        *numConfigs = 1;
+    }
+    return 0;
+}
+
+static int hwc_get_display_attributes(hwc_composer_device_1_t* dev, int disp,
+        uint32_t config, const uint32_t* attributes, int32_t* values) {
+    hwc_context_t* ctx = (hwc_context_t*)dev;
+    if (disp != HWC_DISPLAY_PRIMARY || config != 0) {
+        return -EINVAL;
+    }
+
+    for (size_t i=0 ; attributes[i] != HWC_DISPLAY_NO_ATTRIBUTE ; i++) {
+        switch (attributes[i]) {
+        case HWC_DISPLAY_VSYNC_PERIOD:
+            values[i] = (int32_t)ctx->vsync_period;
+            break;
+        case HWC_DISPLAY_WIDTH:
+            values[i] = ctx->width;
+            break;
+        case HWC_DISPLAY_HEIGHT:
+            values[i] = ctx->height;
+            break;
+        case HWC_DISPLAY_DPI_X:
+            values[i] = ctx->xdpi;
+            break;
+        case HWC_DISPLAY_DPI_Y:
+            values[i] = ctx->ydpi;
+            break;
+        default:
+            ALOGE("unknown display attribute %u", attributes[i]);
+            return -EINVAL;
+        }
     }
     return 0;
 }
@@ -97,11 +1136,47 @@ static int hwc_device_close(struct hw_device_t *dev)
 {
     struct hwc_context_t* ctx = (struct hwc_context_t*)dev;
     if (ctx) {
+        if (ctx->vsync_thread_started) {
+            pthread_mutex_lock(&ctx->vsync_lock);
+            ctx->vsync_exit = true;
+            pthread_cond_signal(&ctx->vsync_cond);
+            pthread_mutex_unlock(&ctx->vsync_lock);
+            pthread_join(ctx->vsync_thread, NULL);
+        }
+        pthread_cond_destroy(&ctx->vsync_cond);
+        pthread_mutex_destroy(&ctx->vsync_lock);
+        pthread_mutex_destroy(&ctx->timing_lock);
+        if (ctx->sb) {
+            close_overlay(ctx);
+            close_underlay(ctx);
+            sharebuffer_close(ctx->sb);
+        }
+        if (ctx->fb) {
+            framebuffer_close(ctx->fb);
+        }
         free(ctx);
     }
     return 0;
 }
 
+/* the sharebuffer device, or NULL to always composite with GL */
+static sharebuffer_device_t* open_sharebuffer() {
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.hwc.sharebuffer_overlay", value, "1");
+    if (!atoi(value)) {
+        return NULL;
+    }
+
+    hw_module_t const* module;
+    sharebuffer_device_t* sb = NULL;
+    if (hw_get_module(SHAREBUFFER_HARDWARE_MODULE_ID, &module) != 0 ||
+            sharebuffer_open(module, &sb) != 0) {
+        ALOGI("no sharebuffer module, compositing all layers with GL");
+        return NULL;
+    }
+    return sb;
+}
+
 /*****************************************************************************/
 
 static int hwc_device_open(const struct hw_module_t* module, const char* name,
@@ -115,15 +1190,56 @@ static int hwc_device_open(const struct hw_module_t* module, const char* name,
         /* initialize our state here */
         memset(dev, 0, sizeof(*dev));
 
+        // the framebuffer target of the primary display goes to the framebuffer
+        hw_module_t const* gralloc;
+        status = hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &gralloc);
+        if (status == 0) {
+            status = framebuffer_open(gralloc, &dev->fb);
+        }
+        if (status != 0) {
+            ALOGE("no framebuffer for the primary display: %s", strerror(-status));
+            free(dev);
+            return status;
+        }
+        dev->gralloc = reinterpret_cast<gralloc_module_t const*>(gralloc);
+        dev->width = dev->fb->width;
+        dev->height = dev->fb->height;
+        dev->xdpi = (int32_t)(dev->fb->xdpi * 1000);
+        dev->ydpi = (int32_t)(dev->fb->ydpi * 1000);
+        float fps = dev->fb->fps > 0 ? dev->fb->fps : 60;
+        dev->vsync_period = int64_t(1000000000LL / fps);
+
         /* initialize the procs */
         dev->device.common.tag = HARDWARE_DEVICE_TAG;
-        dev->device.common.version = HWC_DEVICE_API_VERSION_1_0;
+        dev->device.common.version = HWC_DEVICE_API_VERSION_1_3;
         dev->device.common.module = const_cast<hw_module_t*>(module);
         dev->device.common.close = hwc_device_close;
 
         dev->device.prepare = hwc_prepare;
         dev->device.set = hwc_set;
 
+        dev->device.eventControl = hwc_event_control;
+        dev->device.registerProcs = hwc_register_procs;
+        dev->device.query = hwc_query;
+        dev->device.blank = hwc_blank;
+        dev->device.getDisplayConfigs = hwc_get_display_configs;
+        dev->device.getDisplayAttributes = hwc_get_display_attributes;
+        dev->device.dump = hwc_dump;
+
+        dev->sb = open_sharebuffer();
+        dev->overlay = -1;
+        dev->retire_fence = -1;
+        dev->underlay = -1;
+
+        pthread_mutex_init(&dev->timing_lock, NULL);
+        pthread_mutex_init(&dev->vsync_lock, NULL);
+        pthread_cond_init(&dev->vsync_cond, NULL);
+        dev->vsync_thread_started = pthread_create(&dev->vsync_thread, NULL,
+                vsync_thread, dev) == 0;
+        if (!dev->vsync_thread_started) {
+            ALOGE("failed to start the vsync thread, SurfaceFlinger will use a timer");
+        }
+
         *device = &dev->device.common;
         status = 0;
     }
@@ -14,8 +14,9 @@
 
 LOCAL_PATH := $(call my-dir)
 
-# The default local time HAL module.  The default module simply uses the
-# system's clock_gettime(CLOCK_MONOTONIC) and does not support HW slewing.
+# The default local time HAL module.  The default module uses the system's
+# clock_gettime(CLOCK_MONOTONIC), slewed in software, and publishes its time
+# base in shared memory for clients to read without calling into the HAL.
 # Devices which use the default implementation should take care to ensure that
 # the oscillator backing the CLOCK_MONOTONIC implementation is phase locked to
 # the audio and video output hardware.  This default implementation is loaded
@@ -32,3 +33,16 @@ LOCAL_SHARED_LIBRARIES := liblog libcutils
 LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
+
+# The same module for linking into a process, looked up without a dlopen()
+# once registered, see HAL_MODULE_BUILTIN() in hardware.h. Link it with
+# LOCAL_WHOLE_STATIC_LIBRARIES.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := liblocal_time_builtin
+LOCAL_SRC_FILES := local_time_hw.c
+LOCAL_CFLAGS := -DHAL_BUILTIN -DHAL_MODULE_INFO_SYM=HMI_local_time
+LOCAL_SHARED_LIBRARIES := liblog libcutils libhardware
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_STATIC_LIBRARY)
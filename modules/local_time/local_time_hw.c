@@ -18,23 +18,43 @@
 //#define LOG_NDEBUG 0
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <linux/time.h>
 
+#include <cutils/ashmem.h>
 #include <cutils/log.h>
 
 #include <hardware/hardware.h>
 #include <hardware/local_time_hal.h>
 
+/*
+ * Local time is CLOCK_MONOTONIC slewed in software: set_local_slew() maps
+ * its range linearly to +/- MAX_SLEW_PPM of the nominal rate and rebases,
+ * so local time stays continuous. The time base is kept in an ashmem
+ * region that clients map from get_shared_time_fd() and read without
+ * calling into the HAL.
+ */
+#define MAX_SLEW_PPM 100
+
 struct stub_local_time_device {
     struct local_time_hw_device device;
+
+    /* serializes writers of the sequence lock */
+    pthread_mutex_t lock;
+    int shared_fd;
+    struct local_time_shared* shared;
+    int16_t slew;
 };
 
-static int64_t ltdev_get_local_time(struct local_time_hw_device* dev)
+static int64_t monotonic_ns(struct local_time_hw_device* dev)
 {
     struct timespec ts;
-    uint64_t now;
     int ret;
 
     ret = clock_gettime(CLOCK_MONOTONIC, &ts);
@@ -44,10 +64,15 @@ static int64_t ltdev_get_local_time(struct local_time_hw_device* dev)
         return 0;
     }
 
-    now = (((uint64_t)ts.tv_sec) * 1000000000ull) +
-           ((uint64_t)ts.tv_nsec);
+    return (int64_t)((((uint64_t)ts.tv_sec) * 1000000000ull) +
+           ((uint64_t)ts.tv_nsec));
+}
+
+static int64_t ltdev_get_local_time(struct local_time_hw_device* dev)
+{
+    struct stub_local_time_device* ltdev = (struct stub_local_time_device*)dev;
 
-    return (int64_t)now;
+    return local_time_shared_read(ltdev->shared);
 }
 
 static uint64_t ltdev_get_local_freq(struct local_time_hw_device* dev)
@@ -57,8 +82,51 @@ static uint64_t ltdev_get_local_freq(struct local_time_hw_device* dev)
     return 1000000000ull;
 }
 
+static int ltdev_set_local_slew(struct local_time_hw_device* dev, int16_t rate)
+{
+    struct stub_local_time_device* ltdev = (struct stub_local_time_device*)dev;
+    struct local_time_shared* shared = ltdev->shared;
+    int64_t now, local;
+
+    pthread_mutex_lock(&ltdev->lock);
+    if (rate != ltdev->slew) {
+        now = monotonic_ns(dev);
+        local = local_time_from_base(shared->base_mono, shared->base_local,
+                shared->slew_q32, now);
+
+        __atomic_store_n(&shared->seq, shared->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&shared->base_mono, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&shared->base_local, local, __ATOMIC_RELAXED);
+        // rate / 32768 of MAX_SLEW_PPM, in units of 2^-32
+        __atomic_store_n(&shared->slew_q32,
+                (int64_t)rate * MAX_SLEW_PPM * (1LL << 17) / 1000000,
+                __ATOMIC_RELAXED);
+        __atomic_store_n(&shared->seq, shared->seq + 1, __ATOMIC_RELEASE);
+
+        ltdev->slew = rate;
+    }
+    pthread_mutex_unlock(&ltdev->lock);
+
+    return 0;
+}
+
+static int ltdev_get_shared_time_fd(struct local_time_hw_device* dev)
+{
+    struct stub_local_time_device* ltdev = (struct stub_local_time_device*)dev;
+    int fd;
+
+    fd = dup(ltdev->shared_fd);
+    return fd < 0 ? -errno : fd;
+}
+
 static int ltdev_close(hw_device_t *device)
 {
+    struct stub_local_time_device* ltdev = (struct stub_local_time_device*)device;
+
+    munmap(ltdev->shared, sizeof(*ltdev->shared));
+    close(ltdev->shared_fd);
+    pthread_mutex_destroy(&ltdev->lock);
     free(device);
     return 0;
 }
@@ -67,7 +135,6 @@ static int ltdev_open(const hw_module_t* module, const char* name,
                      hw_device_t** device)
 {
     struct stub_local_time_device *ltdev;
-    struct timespec ts;
     int ret;
 
     if (strcmp(name, LOCAL_TIME_HARDWARE_INTERFACE) != 0)
@@ -77,15 +144,38 @@ static int ltdev_open(const hw_module_t* module, const char* name,
     if (!ltdev)
         return -ENOMEM;
 
+    ltdev->shared_fd = ashmem_create_region("local_time", sizeof(*ltdev->shared));
+    if (ltdev->shared_fd < 0) {
+        ALOGE("failed to create the shared time base");
+        free(ltdev);
+        return -ENOMEM;
+    }
+    ltdev->shared = mmap(NULL, sizeof(*ltdev->shared), PROT_READ | PROT_WRITE,
+            MAP_SHARED, ltdev->shared_fd, 0);
+    if (ltdev->shared == MAP_FAILED) {
+        ret = -errno;
+        ALOGE("failed to map the shared time base: %s", strerror(errno));
+        close(ltdev->shared_fd);
+        free(ltdev);
+        return ret;
+    }
+    // clients only ever get to map it read only
+    ashmem_set_prot_region(ltdev->shared_fd, PROT_READ);
+
+    // no slew: local time is CLOCK_MONOTONIC until set_local_slew()
+    ltdev->shared->magic = LOCAL_TIME_SHARED_MAGIC;
+    pthread_mutex_init(&ltdev->lock, NULL);
+
     ltdev->device.common.tag = HARDWARE_DEVICE_TAG;
-    ltdev->device.common.version = 0;
+    ltdev->device.common.version = LOCAL_TIME_DEVICE_API_VERSION_1_0;
     ltdev->device.common.module = (struct hw_module_t *) module;
     ltdev->device.common.close = ltdev_close;
 
     ltdev->device.get_local_time = ltdev_get_local_time;
     ltdev->device.get_local_freq = ltdev_get_local_freq;
-    ltdev->device.set_local_slew = NULL;
+    ltdev->device.set_local_slew = ltdev_set_local_slew;
     ltdev->device.get_debug_log  = NULL;
+    ltdev->device.get_shared_time_fd = ltdev_get_shared_time_fd;
 
     *device = &ltdev->device.common;
 
@@ -107,3 +197,7 @@ struct local_time_module HAL_MODULE_INFO_SYM = {
         .methods = &hal_module_methods,
     },
 };
+
+#ifdef HAL_BUILTIN
+HAL_MODULE_BUILTIN("local_time")
+#endif
@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define LOG_TAG "memtrack"
+#include <utils/Log.h>
+
+#include <hardware/hardware.h>
+#include <hardware/memtrack.h>
+
+/*
+ * Reports the gralloc buffers of a process as MEMTRACK_TYPE_GRAPHICS, in
+ * two records:
+ *
+ * - the proportional set size of the buffers it mapped, as smaps shows
+ *   them. The default gralloc allocates buffers as ashmem regions named
+ *   "gralloc-buffer", or as dma-bufs of a dma-buf heap or ION depending
+ *   on the usage, see the allocator of the gralloc module. A buffer shared
+ *   by the allocator, the app and the compositor is counted once overall.
+ *
+ * - the size of the dma-bufs it holds a descriptor of without mapping
+ *   them, which smaps does not account: buffers that are only ever
+ *   rendered to by the GPU or scanned out, and those the sharebuffer
+ *   module of the process passed on to the renderer. A dma-buf held through
+ *   several descriptors is counted once per process. Older kernels do not
+ *   report the size of a dma-buf to other processes, their buffers are
+ *   left out.
+ *
+ * ashmem buffers that are not mapped cannot be sized from outside the
+ * process and are not reported.
+ */
+#define GRALLOC_MAPPING_NAME    "/dev/ashmem/gralloc-buffer"
+
+static int memtrack_init(const struct memtrack_module *module)
+{
+    return 0;
+}
+
+static int is_dmabuf(const char *name)
+{
+    return strstr(name, "/dmabuf") == name || strstr(name, "anon_inode:dmabuf") == name;
+}
+
+/* inodes of the dma-bufs a process holds or maps, and their sizes */
+struct dmabuf_set {
+    struct dmabuf {
+        ino_t ino;
+        size_t size;
+        int mapped;
+    } *bufs;
+    size_t count;
+    size_t capacity;
+};
+
+static struct dmabuf *dmabuf_find(struct dmabuf_set *set, ino_t ino)
+{
+    size_t i;
+
+    for (i = 0; i < set->count; i++) {
+        if (set->bufs[i].ino == ino)
+            return &set->bufs[i];
+    }
+    if (set->count == set->capacity) {
+        size_t capacity = set->capacity ? set->capacity * 2 : 64;
+        struct dmabuf *bufs = realloc(set->bufs, capacity * sizeof(*bufs));
+        if (!bufs)
+            return NULL;
+        set->bufs = bufs;
+        set->capacity = capacity;
+    }
+    memset(&set->bufs[set->count], 0, sizeof(set->bufs[0]));
+    set->bufs[set->count].ino = ino;
+    return &set->bufs[set->count++];
+}
+
+/* size of a dma-buf from the fdinfo of a descriptor, 0 if not reported */
+static size_t dmabuf_fdinfo_size(pid_t pid, const char *fd)
+{
+    char path[64];
+    char line[256];
+    unsigned long long size = 0;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/fdinfo/%s", pid, fd);
+    fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "size: %llu", &size) == 1)
+            break;
+    }
+    fclose(fp);
+    return size;
+}
+
+static int held_dmabufs(pid_t pid, struct dmabuf_set *set)
+{
+    char path[64];
+    char link[128];
+    struct dirent *de;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    dir = opendir(path);
+    if (!dir)
+        return -errno;
+
+    while ((de = readdir(dir)) != NULL) {
+        char fd_path[64 + sizeof(de->d_name)];
+        struct dmabuf *buf;
+        struct stat st;
+        ssize_t len;
+
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(fd_path, sizeof(fd_path), "%s/%s", path, de->d_name);
+        len = readlink(fd_path, link, sizeof(link) - 1);
+        if (len <= 0)
+            continue;
+        link[len] = 0;
+        if (!is_dmabuf(link) || stat(fd_path, &st) < 0)
+            continue;
+
+        buf = dmabuf_find(set, st.st_ino);
+        if (!buf)
+            break;
+        /* the inode of a dma-buf has its size, fdinfo too on newer kernels */
+        if (!buf->size)
+            buf->size = st.st_size > 0 ? (size_t)st.st_size :
+                    dmabuf_fdinfo_size(pid, de->d_name);
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+static int graphics_pss(pid_t pid, size_t *pss, struct dmabuf_set *set)
+{
+    char path[64];
+    char line[1024];
+    int gralloc_mapping = 0;
+    unsigned long start, end, kb;
+    unsigned long long ino;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/smaps", pid);
+    fp = fopen(path, "r");
+    if (!fp)
+        return -errno;
+
+    *pss = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        int name;
+
+        if (sscanf(line, "%lx-%lx %*s %*s %*s %llu %n", &start, &end, &ino, &name) >= 3) {
+            /* a new mapping */
+            gralloc_mapping = strstr(line, GRALLOC_MAPPING_NAME) != NULL;
+            if (is_dmabuf(line + name)) {
+                struct dmabuf *buf = dmabuf_find(set, (ino_t)ino);
+                if (buf)
+                    buf->mapped = 1;
+                gralloc_mapping = 1;
+            }
+        } else if (gralloc_mapping && sscanf(line, "Pss: %lu kB", &kb) == 1) {
+            *pss += kb * 1024;
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+static int memtrack_get_memory(const struct memtrack_module *module,
+                               pid_t pid, int type,
+                               struct memtrack_record *records,
+                               size_t *num_records)
+{
+    struct dmabuf_set set = { NULL, 0, 0 };
+    size_t pss, held = 0, i;
+    size_t count = *num_records;
+    int ret;
+
+    if (type != MEMTRACK_TYPE_GRAPHICS)
+        return -ENODEV;
+
+    /* fast path for the caller sizing its array */
+    *num_records = 2;
+    if (count == 0)
+        return 0;
+
+    ret = graphics_pss(pid, &pss, &set);
+    if (ret == 0 && count > 1) {
+        /* a process we can't look at the descriptors of holds none for us */
+        held_dmabufs(pid, &set);
+        for (i = 0; i < set.count; i++) {
+            if (!set.bufs[i].mapped)
+                held += set.bufs[i].size;
+        }
+    }
+    free(set.bufs);
+    if (ret < 0)
+        return ret;
+
+    records[0].size_in_bytes = pss;
+    records[0].flags = MEMTRACK_FLAG_SMAPS_ACCOUNTED |
+            MEMTRACK_FLAG_SHARED_PSS | MEMTRACK_FLAG_SYSTEM |
+            MEMTRACK_FLAG_NONSECURE;
+    if (count > 1) {
+        records[1].size_in_bytes = held;
+        records[1].flags = MEMTRACK_FLAG_SMAPS_UNACCOUNTED |
+                MEMTRACK_FLAG_SHARED | MEMTRACK_FLAG_SYSTEM |
+                MEMTRACK_FLAG_NONSECURE;
+    }
+    return 0;
+}
+
+static struct hw_module_methods_t memtrack_module_methods = {
+    .open = NULL,
+};
+
+struct memtrack_module HAL_MODULE_INFO_SYM = {
+    .common = {
+        .tag = HARDWARE_MODULE_TAG,
+        .module_api_version = MEMTRACK_MODULE_API_VERSION_0_1,
+        .hal_api_version = HARDWARE_HAL_API_VERSION,
+        .id = MEMTRACK_HARDWARE_MODULE_ID,
+        .name = "Default Memory Tracker HAL",
+        .author = "The Android Open Source Project",
+        .methods = &memtrack_module_methods,
+    },
+
+    .init = memtrack_init,
+    .getMemory = memtrack_get_memory,
+};
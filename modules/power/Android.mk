@@ -19,7 +19,24 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := power.default
 LOCAL_MODULE_RELATIVE_PATH := hw
 LOCAL_SRC_FILES := power.c
-LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../sfdroid_ipc
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_STATIC_LIBRARIES := libsfdroid_ipc
 LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
+
+# The same module for linking into a process, looked up without a dlopen()
+# once registered, see HAL_MODULE_BUILTIN() in hardware.h. Link it with
+# LOCAL_WHOLE_STATIC_LIBRARIES.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libpower_builtin
+LOCAL_SRC_FILES := power.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../sfdroid_ipc
+LOCAL_CFLAGS := -DHAL_BUILTIN -DHAL_MODULE_INFO_SYM=HMI_power
+LOCAL_SHARED_LIBRARIES := liblog libcutils libhardware
+LOCAL_STATIC_LIBRARIES := libsfdroid_ipc
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_STATIC_LIBRARY)
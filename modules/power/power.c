@@ -14,10 +14,17 @@
  * limitations under the License.
  */
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <string.h>
-#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
-#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define LOG_TAG "Legacy PowerHAL"
 #include <utils/Log.h>
@@ -25,20 +32,317 @@
 #include <hardware/hardware.h>
 #include <hardware/power.h>
 
+#include "sfdroid_ipc.h"
+#include "sfdroid_power_protocol.h"
+
+/*
+ * Boosts for touch response and app launches. Android runs next to the
+ * Sailfish host, which owns the CPU governors, so every hint is forwarded
+ * to the host; the knobs of the kernel Android can reach are raised here
+ * as well:
+ *
+ *   interaction, vsync   a pulse of the interactive governor, which raises
+ *                        the frequency for its boostpulse_duration
+ *   launch               the interactive governor boost, the scheduler
+ *                        boost and all CPUs for the foreground cpuset,
+ *                        until the launch is done or LAUNCH_BOOST_MAX_MS
+ *
+ * Every knob is optional, missing ones are skipped, and all are kept
+ * open so that a boost is a write() each. Nothing is raised in low power
+ * mode or while the device is not interactive.
+ */
+
+/* the default boostpulse_duration of the interactive governor */
+#define INTERACTION_BOOST_MS    80
+/* a pulse lasts long enough to cover the hints of half of it */
+#define INTERACTION_MIN_INTERVAL_NS (INTERACTION_BOOST_MS * 1000000LL / 2)
+/* in case the end of a launch is never hinted */
+#define LAUNCH_BOOST_MAX_MS     5000
+
+#define HOST_RECONNECT_MIN_MS   1000
+#define HOST_RECONNECT_MAX_MS   60000
+
+#define KNOB_VALUE_MAX  64
+
+typedef struct knob_t {
+    const char* path;
+    /* written while boosted; NULL to take it from boost_from */
+    const char* boost;
+    const char* boost_from;
+    int fd;
+    char boost_value[KNOB_VALUE_MAX];
+    /* the value at init, written back when the boost ends */
+    char restore[KNOB_VALUE_MAX];
+} knob_t;
+
+static knob_t sPulseKnob = {
+    "/sys/devices/system/cpu/cpufreq/interactive/boostpulse", "1", NULL, -1, "", "",
+};
+
+static knob_t sLaunchKnobs[] = {
+    { "/sys/devices/system/cpu/cpufreq/interactive/boost", "1", NULL, -1, "", "" },
+    { "/proc/sys/kernel/sched_boost", "1", NULL, -1, "", "" },
+    { "/dev/cpuset/foreground/cpus", NULL, "/dev/cpuset/cpus", -1, "", "" },
+};
+
+#define NUM_LAUNCH_KNOBS (sizeof(sLaunchKnobs) / sizeof(sLaunchKnobs[0]))
+
+static pthread_once_t sInitOnce = PTHREAD_ONCE_INIT;
+/* protects everything below */
+static pthread_mutex_t sLock = PTHREAD_MUTEX_INITIALIZER;
+static bool sInteractive = true;
+static bool sLowPower;
+static bool sVsync;
+static bool sLaunching;
+static int64_t sLastPulseNs;
+static timer_t sLaunchTimer;
+static bool sLaunchTimerCreated;
+
+/* the host connection, -1 while there is none */
+static int sHostFd = -1;
+static int64_t sHostRetryNs;
+static sfdroid_ipc_backoff_t sHostBackoff;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* the contents of path without the trailing newline, "" if unreadable */
+static void read_value(const char* path, char* value, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? read(fd, value, size - 1) : -1;
+
+    if (fd >= 0)
+        close(fd);
+    if (n < 0)
+        n = 0;
+    while (n > 0 && value[n - 1] == '\n')
+        n--;
+    value[n] = '\0';
+}
+
+static void knob_open(knob_t* knob)
+{
+    knob->fd = open(knob->path, O_RDWR | O_CLOEXEC);
+    if (knob->fd < 0) {
+        ALOGV("no %s, not boosted", knob->path);
+        return;
+    }
+    read_value(knob->path, knob->restore, sizeof(knob->restore));
+    if (knob->boost) {
+        strlcpy(knob->boost_value, knob->boost, sizeof(knob->boost_value));
+    } else {
+        read_value(knob->boost_from, knob->boost_value, sizeof(knob->boost_value));
+    }
+    if (!knob->boost_value[0]) {
+        close(knob->fd);
+        knob->fd = -1;
+    }
+}
+
+static void knob_write(knob_t* knob, const char* value)
+{
+    size_t len = strlen(value);
+
+    if (knob->fd < 0 || !value[0])
+        return;
+    // sysfs and proc files take every write from the start
+    if (pwrite(knob->fd, value, len, 0) != (ssize_t)len)
+        ALOGE("error writing %s to %s: %s", value, knob->path, strerror(errno));
+}
+
+/* with sLock held: a hint the host learns about once it is connected */
+static void host_send(uint32_t hint, int32_t value, uint32_t duration_ms);
+
+static void host_send_states(void)
+{
+    host_send(SFDROID_POWER_HINT_INTERACTIVE, sInteractive, 0);
+    if (sLowPower)
+        host_send(SFDROID_POWER_HINT_LOW_POWER, 1, 0);
+    if (sVsync)
+        host_send(SFDROID_POWER_HINT_VSYNC, 1, 0);
+    if (sLaunching)
+        host_send(SFDROID_POWER_HINT_LAUNCH, 1, LAUNCH_BOOST_MAX_MS);
+}
+
+/* with sLock held; never waits for the host, which is retried with a backoff */
+static bool host_connect(void)
+{
+    if (sHostFd >= 0)
+        return true;
+    if (now_ns() < sHostRetryNs)
+        return false;
+
+    sHostFd = sfdroid_ipc_connect(SFDROID_POWER_SOCKET_NAME, 0);
+    if (sHostFd < 0) {
+        sHostRetryNs = now_ns() + sfdroid_ipc_backoff_next(&sHostBackoff) * 1000000LL;
+        return false;
+    }
+    // a host that does not keep up loses the connection instead of blocking hints
+    fcntl(sHostFd, F_SETFL, fcntl(sHostFd, F_GETFL) | O_NONBLOCK);
+    sfdroid_ipc_backoff_reset(&sHostBackoff);
+    ALOGI("connected to the host power service");
+
+    host_send_states();
+    return sHostFd >= 0;
+}
+
+static void host_send(uint32_t hint, int32_t value, uint32_t duration_ms)
+{
+    sfdroid_power_hint_t msg;
+    struct iovec iov;
+
+    if (!host_connect())
+        return;
+
+    msg.magic = SFDROID_POWER_MAGIC;
+    msg.hint = hint;
+    msg.value = value;
+    msg.duration_ms = duration_ms;
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    if (sfdroid_ipc_send(sHostFd, &iov, 1, NULL, 0) < 0) {
+        ALOGW("lost the host power service: %s", strerror(errno));
+        close(sHostFd);
+        sHostFd = -1;
+        sHostRetryNs = now_ns() + sfdroid_ipc_backoff_next(&sHostBackoff) * 1000000LL;
+    }
+}
+
+/* with sLock held */
+static bool boost_allowed(void)
+{
+    return sInteractive && !sLowPower;
+}
+
+/* with sLock held */
+static void interaction_boost(void)
+{
+    int64_t now = now_ns();
+
+    if (now - sLastPulseNs < INTERACTION_MIN_INTERVAL_NS)
+        return;
+    sLastPulseNs = now;
+
+    if (boost_allowed())
+        knob_write(&sPulseKnob, sPulseKnob.boost_value);
+    host_send(SFDROID_POWER_HINT_INTERACTION, 1, INTERACTION_BOOST_MS);
+}
+
+/* with sLock held */
+static void set_launch(bool launching)
+{
+    struct itimerspec its;
+    size_t i;
+
+    if (launching && !boost_allowed())
+        launching = false;
+    if (launching == sLaunching && !launching)
+        return;
+
+    for (i = 0; i < NUM_LAUNCH_KNOBS && launching != sLaunching; i++)
+        knob_write(&sLaunchKnobs[i], launching ? sLaunchKnobs[i].boost_value :
+                sLaunchKnobs[i].restore);
+    // a new launch during one restarts the timeout
+    if (sLaunchTimerCreated) {
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = launching ? LAUNCH_BOOST_MAX_MS / 1000 : 0;
+        its.it_value.tv_nsec = launching ? (LAUNCH_BOOST_MAX_MS % 1000) * 1000000L : 0;
+        timer_settime(sLaunchTimer, 0, &its, NULL);
+    }
+    if (launching != sLaunching)
+        host_send(SFDROID_POWER_HINT_LAUNCH, launching, launching ? LAUNCH_BOOST_MAX_MS : 0);
+    sLaunching = launching;
+}
+
+static void launch_timeout(union sigval value)
+{
+    pthread_mutex_lock(&sLock);
+    if (sLaunching)
+        ALOGW("launch boost never ended, ending it");
+    set_launch(false);
+    pthread_mutex_unlock(&sLock);
+}
+
+static void setup(void)
+{
+    struct sigevent sev;
+    size_t i;
+
+    pthread_mutex_lock(&sLock);
+    sfdroid_ipc_backoff_init(&sHostBackoff, HOST_RECONNECT_MIN_MS, HOST_RECONNECT_MAX_MS);
+    knob_open(&sPulseKnob);
+    for (i = 0; i < NUM_LAUNCH_KNOBS; i++)
+        knob_open(&sLaunchKnobs[i]);
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_notify_function = launch_timeout;
+    sLaunchTimerCreated = timer_create(CLOCK_MONOTONIC, &sev, &sLaunchTimer) == 0;
+    if (!sLaunchTimerCreated)
+        ALOGE("failed to create the launch timer: %s", strerror(errno));
+    pthread_mutex_unlock(&sLock);
+}
+
 static void power_init(struct power_module *module)
 {
+    pthread_once(&sInitOnce, setup);
 }
 
 static void power_set_interactive(struct power_module *module, int on)
 {
+    pthread_once(&sInitOnce, setup);
+
+    pthread_mutex_lock(&sLock);
+    if (sInteractive != !!on) {
+        sInteractive = !!on;
+        if (!sInteractive)
+            set_launch(false);
+        host_send(SFDROID_POWER_HINT_INTERACTIVE, sInteractive, 0);
+    }
+    pthread_mutex_unlock(&sLock);
 }
 
 static void power_hint(struct power_module *module, power_hint_t hint,
                        void *data) {
+    // the states come as an int in the pointer
+    bool on = data != NULL;
+
+    pthread_once(&sInitOnce, setup);
+
+    pthread_mutex_lock(&sLock);
     switch (hint) {
+    case POWER_HINT_INTERACTION:
+        interaction_boost();
+        break;
+    case POWER_HINT_VSYNC:
+        if (on != sVsync) {
+            sVsync = on;
+            host_send(SFDROID_POWER_HINT_VSYNC, on, 0);
+        }
+        // frames are about to be rendered
+        if (on)
+            interaction_boost();
+        break;
+    case POWER_HINT_LAUNCH:
+        set_launch(on);
+        break;
+    case POWER_HINT_LOW_POWER:
+        if (on != sLowPower) {
+            sLowPower = on;
+            if (on)
+                set_launch(false);
+            host_send(SFDROID_POWER_HINT_LOW_POWER, on, 0);
+        }
+        break;
     default:
         break;
     }
+    pthread_mutex_unlock(&sLock);
 }
 
 static struct hw_module_methods_t power_module_methods = {
@@ -60,3 +364,7 @@ struct power_module HAL_MODULE_INFO_SYM = {
     .setInteractive = power_set_interactive,
     .powerHint = power_hint,
 };
+
+#ifdef HAL_BUILTIN
+HAL_MODULE_BUILTIN("power")
+#endif
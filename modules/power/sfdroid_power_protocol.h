@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFDROID_POWER_PROTOCOL_H_
+#define SFDROID_POWER_PROTOCOL_H_
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * Protocol between the power HAL and the Sailfish host, on the socket
+ * SFDROID_POWER_SOCKET_NAME in /tmp/sfdroid. The host owns the CPU
+ * governors of the device, so the HAL forwards what Android knows is
+ * coming: every hint is a sfdroid_power_hint_t, sent one way and never
+ * answered, so that hints never wait for the host.
+ *
+ * SFDROID_POWER_HINT_INTERACTION asks for a boost of duration_ms. The
+ * other hints are states: SFDROID_POWER_HINT_LAUNCH and _VSYNC with value
+ * 1 while an app launches or an app wants vsync, _INTERACTIVE with value 1
+ * while the screen is on, _LOW_POWER with value 1 in battery saver mode.
+ * A state lasts until told otherwise or until the connection is lost,
+ * and every state that is set is sent again on a new connection; a
+ * launch also ends after duration_ms without word from the HAL.
+ */
+#define SFDROID_POWER_SOCKET_NAME   "power_handle"
+
+#define SFDROID_POWER_MAGIC         0x53465057  /* 'SFPW' */
+
+/* sfdroid_power_hint_t.hint */
+#define SFDROID_POWER_HINT_INTERACTION  1
+#define SFDROID_POWER_HINT_LAUNCH       2
+#define SFDROID_POWER_HINT_VSYNC        3
+#define SFDROID_POWER_HINT_INTERACTIVE  4
+#define SFDROID_POWER_HINT_LOW_POWER    5
+
+typedef struct sfdroid_power_hint_t {
+    uint32_t magic;
+    /* SFDROID_POWER_HINT_* */
+    uint32_t hint;
+    /* 0 or 1 for states */
+    int32_t value;
+    /* how long a boost lasts at most, 0 for a state without limit */
+    uint32_t duration_ms;
+} sfdroid_power_hint_t;
+
+__END_DECLS
+
+#endif /* SFDROID_POWER_PROTOCOL_H_ */
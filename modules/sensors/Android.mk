@@ -34,6 +34,7 @@ LOCAL_SRC_FILES := \
 LOCAL_SHARED_LIBRARIES := \
     libcutils \
     libdl \
+    libhardware_legacy \
     liblog \
     libstlport \
     libutils \
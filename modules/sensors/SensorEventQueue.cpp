@@ -17,75 +17,221 @@
 #include <hardware/sensors.h>
 #include <algorithm>
 #include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <cutils/atomic.h>
 #include <cutils/log.h>
 
 #include "SensorEventQueue.h"
 
-SensorEventQueue::SensorEventQueue(int capacity) {
+// Alignment of the keys, 4 to a line.
+static const size_t CACHE_LINE_SIZE = 64;
+
+SensorEventQueue::SensorEventQueue(int capacity, bool withKeys) {
     mCapacity = capacity;
 
-    mStart = 0;
-    mSize = 0;
+    mHead = 0;
+    mTail = 0;
+    mWriterWaiting = 0;
+    mClosed = 0;
+    mHighWaterMark = 0;
+    mFullWaits = 0;
     mData = new sensors_event_t[mCapacity];
+    mEnqueueTimes = new int64_t[mCapacity];
+    mKeys = NULL;
+    if (withKeys) {
+        void* keys = NULL;
+        int err = posix_memalign(&keys, CACHE_LINE_SIZE, mCapacity * sizeof(SensorEventKey));
+        LOG_ALWAYS_FATAL_IF(err != 0, "no memory for the keys of a queue of %d events",
+                mCapacity);
+        mKeys = (SensorEventKey*) keys;
+    }
     pthread_cond_init(&mSpaceAvailableCondition, NULL);
+    pthread_mutex_init(&mWaitMutex, NULL);
 }
 
 SensorEventQueue::~SensorEventQueue() {
     delete[] mData;
     mData = NULL;
+    delete[] mEnqueueTimes;
+    mEnqueueTimes = NULL;
+    free(mKeys);
+    mKeys = NULL;
     pthread_cond_destroy(&mSpaceAvailableCondition);
+    pthread_mutex_destroy(&mWaitMutex);
+}
+
+int SensorEventQueue::sizeOf(int32_t head, int32_t tail) {
+    int size = head - tail;
+    if (size < 0) {
+        size += 2 * mCapacity;
+    }
+    return size;
 }
 
 int SensorEventQueue::getWritableRegion(int requestedLength, sensors_event_t** out) {
-    if (mSize == mCapacity || requestedLength <= 0) {
+    int size = sizeOf(mHead, android_atomic_acquire_load(&mTail));
+    if (size == mCapacity || requestedLength <= 0) {
         *out = NULL;
         return 0;
     }
     // Start writing after the last readable record.
-    int firstWritable = (mStart + mSize) % mCapacity;
+    int firstWritable = mHead % mCapacity;
 
-    int lastWritable = firstWritable + requestedLength - 1;
+    // Don't go past the end of the data array, nor into the readable region.
+    int length = std::min(requestedLength, mCapacity - firstWritable);
+    length = std::min(length, mCapacity - size);
 
-    // Don't go past the end of the data array.
-    if (lastWritable > mCapacity - 1) {
-        lastWritable = mCapacity - 1;
-    }
-    // Don't go into the readable region.
-    if (firstWritable < mStart && lastWritable >= mStart) {
-        lastWritable = mStart - 1;
-    }
     *out = &mData[firstWritable];
-    return lastWritable - firstWritable + 1;
+    return length;
 }
 
 void SensorEventQueue::markAsWritten(int count) {
-    mSize += count;
+    // The records were written in the region returned by getWritableRegion(), which does not
+    // wrap around the end of the data array.
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t now_ns = (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+    int firstWritten = mHead % mCapacity;
+    for (int i = 0; i < count && firstWritten + i < mCapacity; i++) {
+        mEnqueueTimes[firstWritten + i] = now_ns;
+    }
+    if (mKeys != NULL) {
+        for (int i = firstWritten; i < firstWritten + count && i < mCapacity; i++) {
+            const sensors_event_t* event = &mData[i];
+            mKeys[i].timestamp = event->timestamp;
+            mKeys[i].type = event->type;
+            mKeys[i].sensor = event->type == SENSOR_TYPE_META_DATA ?
+                    event->meta_data.sensor : event->sensor;
+        }
+    }
+
+    int32_t head = mHead + count;
+    if (head >= 2 * mCapacity) {
+        head -= 2 * mCapacity;
+    }
+    // Publishes the records written before along with the index.
+    android_atomic_release_store(head, &mHead);
+
+    int size = sizeOf(head, android_atomic_acquire_load(&mTail));
+    if (size > mHighWaterMark) {
+        mHighWaterMark = size;
+    }
 }
 
 int SensorEventQueue::getSize() {
-    return mSize;
+    return sizeOf(android_atomic_acquire_load(&mHead), android_atomic_acquire_load(&mTail));
+}
+
+int SensorEventQueue::getCapacity() {
+    return mCapacity;
+}
+
+int SensorEventQueue::getHighWaterMark() {
+    return mHighWaterMark;
+}
+
+int SensorEventQueue::getFullWaits() {
+    return mFullWaits;
 }
 
 sensors_event_t* SensorEventQueue::peek() {
-    if (mSize == 0) return NULL;
-    return &mData[mStart];
+    if (android_atomic_acquire_load(&mHead) == mTail) return NULL;
+    return &mData[mTail % mCapacity];
+}
+
+const SensorEventKey* SensorEventQueue::peekKey() {
+    if (mKeys == NULL || android_atomic_acquire_load(&mHead) == mTail) return NULL;
+    return &mKeys[mTail % mCapacity];
+}
+
+const SensorEventKey* SensorEventQueue::getReadableKeys() {
+    return mKeys != NULL ? &mKeys[mTail % mCapacity] : NULL;
+}
+
+int SensorEventQueue::getReadableRegion(int maxLength, sensors_event_t** out) {
+    int size = sizeOf(android_atomic_acquire_load(&mHead), mTail);
+    int firstReadable = mTail % mCapacity;
+
+    // Don't go past the end of the data array.
+    int length = std::min(size, mCapacity - firstReadable);
+    length = std::min(length, maxLength);
+    if (length <= 0) {
+        *out = NULL;
+        return 0;
+    }
+    *out = &mData[firstReadable];
+    return length;
+}
+
+int64_t SensorEventQueue::getEnqueueTime(int offset) {
+    return mEnqueueTimes[(mTail + offset) % mCapacity];
 }
 
 void SensorEventQueue::dequeue() {
-    if (mSize == 0) return;
-    if (mSize == mCapacity) {
-        pthread_cond_broadcast(&mSpaceAvailableCondition);
+    dequeue(1);
+}
+
+void SensorEventQueue::dequeue(int count) {
+    int32_t head = android_atomic_acquire_load(&mHead);
+    int size = sizeOf(head, mTail);
+    if (count > size) count = size;
+    if (count <= 0) return;
+    bool wasFull = size == mCapacity;
+
+    int32_t tail = mTail + count;
+    if (tail >= 2 * mCapacity) {
+        tail -= 2 * mCapacity;
+    }
+    android_atomic_release_store(tail, &mTail);
+
+    if (wasFull) {
+        // Pairs with the barrier in waitForSpace(): either the writer sees the new tail, or we
+        // see it waiting.
+        android_memory_barrier();
+        if (mWriterWaiting) {
+            pthread_mutex_lock(&mWaitMutex);
+            pthread_cond_broadcast(&mSpaceAvailableCondition);
+            pthread_mutex_unlock(&mWaitMutex);
+        } else {
+            pthread_cond_broadcast(&mSpaceAvailableCondition);
+        }
     }
-    mSize--;
-    mStart = (mStart + 1) % mCapacity;
+}
+
+bool SensorEventQueue::waitForSpace() {
+    if (getSize() < mCapacity || mClosed) {
+        return false;
+    }
+    mFullWaits++;
+    pthread_mutex_lock(&mWaitMutex);
+    android_atomic_release_store(1, &mWriterWaiting);
+    android_memory_barrier();
+    while (getSize() == mCapacity && !mClosed) {
+        pthread_cond_wait(&mSpaceAvailableCondition, &mWaitMutex);
+    }
+    android_atomic_release_store(0, &mWriterWaiting);
+    pthread_mutex_unlock(&mWaitMutex);
+    return true;
 }
 
 // returns true if it waited, or false if it was a no-op.
 bool SensorEventQueue::waitForSpace(pthread_mutex_t* mutex) {
     bool waited = false;
-    while (mSize == mCapacity) {
+    while (getSize() == mCapacity) {
         waited = true;
         pthread_cond_wait(&mSpaceAvailableCondition, mutex);
     }
     return waited;
 }
+
+void SensorEventQueue::close() {
+    pthread_mutex_lock(&mWaitMutex);
+    android_atomic_release_store(1, &mClosed);
+    pthread_cond_broadcast(&mSpaceAvailableCondition);
+    pthread_mutex_unlock(&mWaitMutex);
+}
+
+bool SensorEventQueue::isClosed() {
+    return android_atomic_acquire_load(&mClosed) != 0;
+}
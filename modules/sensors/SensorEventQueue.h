@@ -27,50 +27,132 @@
  * write to, instead of using an intermediate buffer and a memcpy.
  *
  * Thread safety:
- * Reading can be done safely after grabbing the mutex lock, while poll() writing in a separate
- * thread without a mutex lock. But there can only be one writer at a time.
+ * The queue is a single-producer/single-consumer queue. One writer thread may call
+ * getWritableRegion(), markAsWritten() and waitForSpace() while one reader thread calls
+ * getSize(), peek() and dequeue(), without any lock. Each side owns one index, kept on its own
+ * cache line, and publishes it with release semantics, so the two threads never write the same
+ * cache line.
+ *
+ * waitForSpace(pthread_mutex_t*) is kept for callers serializing all access with one mutex;
+ * they must then also hold that mutex around dequeue().
+ *
+ * Keys:
+ * A queue constructed with keys also keeps the fields a reader schedules on in a packed array
+ * parallel to the records, filled in by markAsWritten(), so that looking at the heads of many
+ * queues touches 16 bytes per record instead of a whole sensors_event_t.
  */
+
+// The scheduling fields of a record. sensor is the nested handle of meta-data events.
+struct SensorEventKey {
+    int64_t timestamp;
+    int32_t sensor;
+    int32_t type;
+};
+
 class SensorEventQueue {
     int mCapacity;
-    int mStart; // start of readable region
-    int mSize; // number of readable items
     sensors_event_t* mData;
+    // Parallel to mData and cache line aligned, or NULL without keys.
+    SensorEventKey* mKeys;
+    // CLOCK_MONOTONIC time each record was marked as written, parallel to mData.
+    int64_t* mEnqueueTimes;
     pthread_cond_t mSpaceAvailableCondition;
 
+    // For the lock-free waitForSpace(): set by the writer before it sleeps.
+    pthread_mutex_t mWaitMutex;
+    volatile int32_t mWriterWaiting;
+    volatile int32_t mClosed;
+
+    // Statistics, written by the writer only.
+    volatile int32_t mHighWaterMark; // largest size() seen after markAsWritten()
+    volatile int32_t mFullWaits; // times waitForSpace() had to wait
+
+    // Both indices count from 0 to 2 * capacity - 1 and then wrap, so that a full queue can be
+    // told apart from an empty one. The record an index refers to is at index % capacity.
+    char mPad0[64];
+    volatile int32_t mHead; // end of readable region, written by the writer only
+    char mPad1[64];
+    volatile int32_t mTail; // start of readable region, written by the reader only
+    char mPad2[64];
+
+    int sizeOf(int32_t head, int32_t tail);
+
 public:
-    SensorEventQueue(int capacity);
+    SensorEventQueue(int capacity, bool withKeys = false);
     ~SensorEventQueue();
 
     // Returns length of region, between zero and min(capacity, requestedLength). If there is any
     // writable space, it will return a region of at least one. Because it must return
     // a pointer to a contiguous region, it may return smaller regions as we approach the end of
     // the data array.
-    // Only call while holding the lock.
+    // Only call from the writer.
     // The region is not marked internally in any way. Subsequent calls may return overlapping
     // regions. This class expects there to be exactly one writer at a time.
     int getWritableRegion(int requestedLength, sensors_event_t** out);
 
     // After writing to the region returned by getWritableRegion(), call this to indicate how
-    // many records were actually written.
+    // many records were actually written. The records are visible to the reader once it returns.
     // This increases size() by count.
-    // Only call while holding the lock.
+    // Only call from the writer.
     void markAsWritten(int count);
 
     // Gets the number of readable records.
-    // Only call while holding the lock.
     int getSize();
 
+    int getCapacity();
+
+    // The largest number of records ever readable at once; reaching getCapacity() means the
+    // writer may have been held up by the reader.
+    int getHighWaterMark();
+
+    // The number of times waitForSpace() found the queue full.
+    int getFullWaits();
+
     // Returns pointer to the first readable record, or NULL if size() is zero.
-    // Only call this while holding the lock.
+    // Only call from the reader.
     sensors_event_t* peek();
 
+    // Returns the key of the first readable record, or NULL if size() is zero or the queue was
+    // constructed without keys.
+    // Only call from the reader.
+    const SensorEventKey* peekKey();
+
+    // Returns length of the contiguous readable region at the start of the queue, between zero
+    // and min(size(), maxLength), and points out at its first record. It may be smaller than
+    // size() when the readable records wrap around the end of the data array.
+    // Only call from the reader.
+    int getReadableRegion(int maxLength, sensors_event_t** out);
+
+    // Returns the keys of the region getReadableRegion() returns, or NULL without keys.
+    // Only call from the reader.
+    const SensorEventKey* getReadableKeys();
+
     // This will decrease the size by one, freeing up the oldest readable event's slot for writing.
-    // Only call while holding the lock.
+    // Only call from the reader.
     void dequeue();
 
+    // As above, for count records, at most the length returned by getReadableRegion().
+    // Only call from the reader.
+    void dequeue(int count);
+
+    // Returns the CLOCK_MONOTONIC time in nanoseconds the readable record at offset from the
+    // start of the queue was marked as written.
+    // Only call from the reader.
+    int64_t getEnqueueTime(int offset);
+
     // Blocks until space is available. No-op if there is already space.
     // Returns true if it had to wait.
+    // Only call from the writer.
+    bool waitForSpace();
+
+    // As above, for callers holding mutex around every call on the queue.
     bool waitForSpace(pthread_mutex_t* mutex);
+
+    // Wakes up the writer waiting in waitForSpace() for good, so that it can notice it has to
+    // stop. The lock-free waitForSpace() returns right away from then on.
+    void close();
+
+    bool isClosed();
 };
 
 #endif // SENSOREVENTQUEUE_H_
@@ -21,15 +21,27 @@
 #include <math.h>
 #include <poll.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <cutils/atomic.h>
+#include <hardware_legacy/power.h>
 
 #define LOG_NDEBUG 1
 #include <cutils/log.h>
 
+#define ATRACE_TAG ATRACE_TAG_HAL
+#include <utils/Trace.h>
+
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <string>
 
+#include <stdint.h>
 #include <stdio.h>
 #include <dlfcn.h>
 #include <SensorEventQueue.h>
@@ -43,18 +55,72 @@ static const int MAX_CONF_LINE_LENGTH = 1024;
 static pthread_mutex_t init_modules_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t init_sensors_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-// This mutex is shared by all queues
+// The queues are single-producer/single-consumer and need no lock. This mutex only guards
+// going to sleep on data_available_cond.
 static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Used to pause the multihal poll(). Broadcasted by sub-polling tasks if waiting_for_data.
 static pthread_cond_t data_available_cond = PTHREAD_COND_INITIALIZER;
-bool waiting_for_data = false;
+volatile int32_t waiting_for_data = 0;
+
+/*
+ * Wake lock held while events of wake-up sensors are between a sub-HAL and the framework, so that
+ * the device does not suspend with them sitting in a queue. It is taken when such events are
+ * published and dropped on the next poll() after the one that returned the last of them, by which
+ * time SensorService holds its own. Events of other sensors never take it: they may stay queued,
+ * and their sub-HALs keep batching in their FIFOs, while the device sleeps.
+ */
+static const char* WAKE_LOCK_NAME = "sensors_multihal";
+static pthread_mutex_t wake_lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Wake-up events published and not yet returned by a poll() that was followed by another one.
+static int wake_up_events_pending = 0;
+static bool wake_lock_held = false;
+// Statistics, see dump().
+static uint32_t wake_lock_acquisitions = 0;
+static uint64_t wake_up_events_published = 0;
 
 /*
  * Vector of sub modules, whose indexes are referred to in this file as module_index.
  */
 static std::vector<hw_module_t *> *sub_hw_modules = NULL;
 
+/*
+ * Event queue capacity configured in hals.conf for each sub module, parallel to sub_hw_modules,
+ * or 0 to derive it from the sensor list.
+ */
+static std::vector<int> *sub_hw_module_queue_capacities = NULL;
+
+/*
+ * dlopen() handle of each sub module, parallel to sub_hw_modules.
+ */
+static std::vector<void*> *sub_hw_module_dsos = NULL;
+
+/*
+ * Library path of each sub module, parallel to sub_hw_modules.
+ */
+static std::vector<char*> *sub_hw_module_paths = NULL;
+
+/*
+ * Set when the sensor list was read from the cache, see load_sensors_list_cache(): the sub-HALs
+ * it was built from and their configured queue capacities, loaded by lazy_init_modules() in
+ * place of those of hals.conf.
+ */
+static bool sensors_list_from_cache = false;
+static std::vector<char*> *cached_so_paths = NULL;
+static std::vector<int> *cached_queue_capacities = NULL;
+
+/*
+ * Optional sub-HAL entry point. A sub-HAL library exporting
+ *
+ *     int sensors_multihal_get_poll_fd(struct sensors_poll_device_t* dev);
+ *
+ * returns a file descriptor of the opened device that becomes readable (level-triggered) when
+ * its poll() has events and then returns without blocking, or -1 if it has none. Such sub-HALs
+ * are served by one epoll reactor thread instead of a thread each blocking in poll().
+ */
+static const char* GET_POLL_FD_SYM = "sensors_multihal_get_poll_fd";
+typedef int (*get_poll_fd_func)(struct sensors_poll_device_t* dev);
+
 /*
  * Comparable class that globally identifies a sensor, by module index and local handle.
  * A module index is the module's index in sub_hw_modules.
@@ -79,61 +145,229 @@ struct FullHandle {
     }
 };
 
-std::map<int, FullHandle> global_to_full;
-std::map<FullHandle, int> full_to_global;
+/*
+ * Handle translation, built once by lazy_init_sensors_list() and only read afterwards, on every
+ * event. Global handles are assigned densely from 1, so global_to_full is indexed directly.
+ * Local handles are chosen by the sub-HALs: those below MAX_DENSE_LOCAL_HANDLE are looked up in
+ * a per-module vector, larger ones in sparse_full_to_global.
+ */
+static const int MAX_DENSE_LOCAL_HANDLE = 1024;
+
+std::vector<FullHandle> global_to_full;
+std::vector<std::vector<int> > local_to_global;
+std::map<FullHandle, int> sparse_full_to_global;
 int next_global_handle = 1;
 
+// Whether the sensor of a global handle is a wake-up sensor, indexed like global_to_full.
+std::vector<bool> global_is_wake_up;
+
 static int assign_global_handle(int module_index, int local_handle) {
     int global_handle = next_global_handle++;
     FullHandle full_handle;
     full_handle.moduleIndex = module_index;
     full_handle.localHandle = local_handle;
-    full_to_global[full_handle] = global_handle;
+
+    if (global_to_full.size() <= (size_t)global_handle) {
+        // Index 0 is never a valid global handle.
+        FullHandle invalid;
+        invalid.moduleIndex = -1;
+        invalid.localHandle = -1;
+        global_to_full.resize(global_handle + 1, invalid);
+    }
     global_to_full[global_handle] = full_handle;
+
+    if (local_handle >= 0 && local_handle < MAX_DENSE_LOCAL_HANDLE) {
+        if (local_to_global.size() <= (size_t)module_index) {
+            local_to_global.resize(module_index + 1);
+        }
+        std::vector<int>& module_handles = local_to_global[module_index];
+        if (module_handles.size() <= (size_t)local_handle) {
+            module_handles.resize(local_handle + 1, -1);
+        }
+        module_handles[local_handle] = global_handle;
+    } else {
+        sparse_full_to_global[full_handle] = global_handle;
+    }
     return global_handle;
 }
 
-// Returns the local handle, or -1 if it does not exist.
-static int get_local_handle(int global_handle) {
-    if (global_to_full.count(global_handle) == 0) {
+// Returns the FullHandle of the global handle, or NULL if it does not exist.
+static const FullHandle* get_full_handle(int global_handle) {
+    if (global_handle <= 0 || (size_t)global_handle >= global_to_full.size()) {
         ALOGW("Unknown global_handle %d", global_handle);
-        return -1;
+        return NULL;
     }
-    return global_to_full[global_handle].localHandle;
+    return &global_to_full[global_handle];
+}
+
+// Returns the local handle, or -1 if it does not exist.
+static int get_local_handle(int global_handle) {
+    const FullHandle* f = get_full_handle(global_handle);
+    return f ? f->localHandle : -1;
 }
 
 // Returns the sub_hw_modules index of the module that contains the sensor associates with this
 // global_handle, or -1 if that global_handle does not exist.
 static int get_module_index(int global_handle) {
-    if (global_to_full.count(global_handle) == 0) {
-        ALOGW("Unknown global_handle %d", global_handle);
+    const FullHandle* f = get_full_handle(global_handle);
+    if (f == NULL) {
         return -1;
     }
-    FullHandle f = global_to_full[global_handle];
     ALOGV("FullHandle for global_handle %d: moduleIndex %d, localHandle %d",
-            global_handle, f.moduleIndex, f.localHandle);
-    return f.moduleIndex;
+            global_handle, f->moduleIndex, f->localHandle);
+    return f->moduleIndex;
 }
 
 // Returns the global handle for this full_handle, or -1 if the full_handle is unknown.
 static int get_global_handle(FullHandle* full_handle) {
     int global_handle = -1;
-    if (full_to_global.count(*full_handle)) {
-        global_handle = full_to_global[*full_handle];
+    int module_index = full_handle->moduleIndex;
+    int local_handle = full_handle->localHandle;
+    if (local_handle >= 0 && local_handle < MAX_DENSE_LOCAL_HANDLE) {
+        if ((size_t)module_index < local_to_global.size() &&
+                (size_t)local_handle < local_to_global[module_index].size()) {
+            global_handle = local_to_global[module_index][local_handle];
+        }
     } else {
+        std::map<FullHandle, int>::const_iterator it = sparse_full_to_global.find(*full_handle);
+        if (it != sparse_full_to_global.end()) {
+            global_handle = it->second;
+        }
+    }
+    if (global_handle < 0) {
         ALOGW("Unknown FullHandle: moduleIndex %d, localHandle %d",
             full_handle->moduleIndex, full_handle->localHandle);
     }
     return global_handle;
 }
 
+// Default and bounds for the event queue of a sub-HAL, see get_queue_capacity().
 static const int SENSOR_EVENT_QUEUE_CAPACITY = 20;
+static const int MAX_SENSOR_EVENT_QUEUE_CAPACITY = 1024;
+
+/*
+ * Time events spend between a sub-HAL's poll() and the multihal's, per sensor. Bucket i counts
+ * latencies below 2^i microseconds, the last one everything larger.
+ */
+static const int LATENCY_BUCKETS = 21;
+
+struct LatencyStats {
+    uint32_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    int64_t total_ns;
+    int64_t max_ns;
+};
+
+static void record_latency(LatencyStats* stats, int64_t latency_ns) {
+    int64_t us = latency_ns / 1000;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && us >= (1LL << bucket)) {
+        bucket++;
+    }
+    stats->buckets[bucket]++;
+    stats->count++;
+    stats->total_ns += latency_ns;
+    if (latency_ns > stats->max_ns) {
+        stats->max_ns = latency_ns;
+    }
+}
+
+// Returns the upper bound in microseconds of the bucket holding the given fraction of events.
+static int64_t latency_percentile_us(const LatencyStats* stats, double fraction) {
+    uint64_t wanted = (uint64_t) (stats->count * fraction);
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        seen += stats->buckets[i];
+        if (seen > wanted) {
+            return 1LL << i;
+        }
+    }
+    return stats->max_ns / 1000;
+}
+
+static int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// How long close() waits for a writer thread blocked in a sub-HAL's poll() before giving up on it.
+static const int WRITER_STOP_TIMEOUT_MS = 1000;
 
 struct TaskContext {
   sensors_poll_device_t* device;
+  // Index of the sub-HAL in sub_hw_modules.
+  int index;
   SensorEventQueue* queue;
+  // Set by the writer thread as it exits, under threads_mutex.
+  bool finished;
+  pthread_mutex_t* threads_mutex;
+  pthread_cond_t* threads_cond;
+  // The full queue was already reported.
+  bool reportedFull;
 };
 
+static bool is_wake_up_event(const sensors_event_t* event, int module_index);
+
+// Takes the wake lock for count more pending wake-up events.
+static void hold_wake_up_events(int count) {
+    pthread_mutex_lock(&wake_lock_mutex);
+    wake_up_events_pending += count;
+    wake_up_events_published += count;
+    if (!wake_lock_held) {
+        acquire_wake_lock(PARTIAL_WAKE_LOCK, WAKE_LOCK_NAME);
+        wake_lock_held = true;
+        wake_lock_acquisitions++;
+    }
+    pthread_mutex_unlock(&wake_lock_mutex);
+}
+
+// Drops count wake-up events the framework took over, and the wake lock with the last of them.
+static void release_wake_up_events(int count) {
+    pthread_mutex_lock(&wake_lock_mutex);
+    wake_up_events_pending -= count;
+    if (wake_up_events_pending <= 0 && wake_lock_held) {
+        wake_up_events_pending = 0;
+        release_wake_lock(WAKE_LOCK_NAME);
+        wake_lock_held = false;
+    }
+    pthread_mutex_unlock(&wake_lock_mutex);
+}
+
+// Makes count events of the sub-HAL of module_index written at events visible, and wakes up
+// poll() if it waits for them.
+static void publish_events(SensorEventQueue* queue, int module_index,
+        const sensors_event_t* events, int count) {
+    // Before the events are visible, so that poll() cannot return them unaccounted.
+    int wake_up_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (is_wake_up_event(&events[i], module_index)) {
+            wake_up_count++;
+        }
+    }
+    if (wake_up_count > 0 && !queue->isClosed()) {
+        hold_wake_up_events(wake_up_count);
+    }
+    queue->markAsWritten(count);
+    // Pairs with the barrier in poll(): either it sees the events, or we see it waiting.
+    android_memory_barrier();
+    if (waiting_for_data) {
+        ALOGV("writerTask - broadcast data_available_cond");
+        pthread_mutex_lock(&queue_mutex);
+        pthread_cond_broadcast(&data_available_cond);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+}
+
+static void report_full(TaskContext* ctx) {
+    if (!ctx->reportedFull) {
+        ALOGW("Event queue of %d events filled up, the sub-HAL had to wait. "
+                "Consider a larger queue_capacity in %s.",
+                ctx->queue->getCapacity(), CONFIG_FILENAME);
+        ctx->reportedFull = true;
+    }
+}
+
 void *writerTask(void* ptr) {
     ALOGV("writerTask STARTS");
     TaskContext* ctx = (TaskContext*)ptr;
@@ -141,31 +375,29 @@ void *writerTask(void* ptr) {
     SensorEventQueue* queue = ctx->queue;
     sensors_event_t* buffer;
     int eventsPolled;
-    while (1) {
-        pthread_mutex_lock(&queue_mutex);
-        if (queue->waitForSpace(&queue_mutex)) {
+    // Runs until close() closes the queue.
+    while (!queue->isClosed()) {
+        if (queue->waitForSpace()) {
             ALOGV("writerTask waited for space");
+            report_full(ctx);
+            continue;
         }
-        int bufferSize = queue->getWritableRegion(SENSOR_EVENT_QUEUE_CAPACITY, &buffer);
-        // Do blocking poll outside of lock
-        pthread_mutex_unlock(&queue_mutex);
+        int bufferSize = queue->getWritableRegion(queue->getCapacity(), &buffer);
 
         ALOGV("writerTask before poll() - bufferSize = %d", bufferSize);
         eventsPolled = device->poll(device, buffer, bufferSize);
         ALOGV("writerTask poll() got %d events.", eventsPolled);
-        if (eventsPolled == 0) {
+        if (eventsPolled <= 0) {
             continue;
         }
-        pthread_mutex_lock(&queue_mutex);
-        queue->markAsWritten(eventsPolled);
+        publish_events(queue, ctx->index, buffer, eventsPolled);
         ALOGV("writerTask wrote %d events", eventsPolled);
-        if (waiting_for_data) {
-            ALOGV("writerTask - broadcast data_available_cond");
-            pthread_cond_broadcast(&data_available_cond);
-        }
-        pthread_mutex_unlock(&queue_mutex);
     }
-    // never actually returns
+    ALOGV("writerTask ENDS");
+    pthread_mutex_lock(ctx->threads_mutex);
+    ctx->finished = true;
+    pthread_cond_broadcast(ctx->threads_cond);
+    pthread_mutex_unlock(ctx->threads_mutex);
     return NULL;
 }
 
@@ -186,7 +418,7 @@ struct sensors_poll_context_t {
      */
     sensors_poll_device_1 proxy_device; // must be first
 
-    void addSubHwDevice(struct hw_device_t*);
+    void addSubHwDevice(struct hw_device_t*, int module_index, int queue_capacity, void* dso);
 
     int activate(int handle, int enabled);
     int setDelay(int handle, int64_t ns);
@@ -195,38 +427,266 @@ struct sensors_poll_context_t {
     int flush(int handle);
     int close();
 
+    /*
+     * The sub-HALs that opened, in the order of sub_hw_modules but without the modules that failed
+     * to load or open. Their tasks hold their module index; device_indices maps a module index
+     * back to the index in these, -1 for a module without a device.
+     */
     std::vector<hw_device_t*> sub_hw_devices;
     std::vector<SensorEventQueue*> queues;
     std::vector<pthread_t> threads;
+    std::vector<TaskContext*> tasks;
+    std::vector<int> device_indices;
     int nextReadIndex;
+    // Wake-up events the last poll() returned, released by the next one.
+    int wakeUpEventsReturned;
+
+    // Guards the finished flags of the writer threads.
+    pthread_mutex_t threads_mutex;
+    pthread_cond_t threads_cond;
 
+    /*
+     * Reactor serving the sub-HALs with a poll fd, see GET_POLL_FD_SYM. reactor_fds holds the
+     * poll fd per queue, -1 for a queue with its own writer thread. The reactor stops reading a
+     * full queue, flagging it in starved; poll() clears the flag once it made room and wakes up
+     * the reactor through reactor_wake_fd, which also tells it to stop.
+     */
+    int reactor_epoll_fd;
+    int reactor_wake_fd;
+    bool reactor_started;
+    pthread_t reactor_thread;
+    volatile int32_t reactor_stopping;
+    std::vector<int> reactor_fds;
+    std::vector<bool> reactor_armed;
+    volatile int32_t* starved;
+
+    /*
+     * Statistics, see dump(). Written by the poll() thread only, read racily by dump().
+     * latency is indexed by global handle.
+     */
+    std::vector<LatencyStats> latency;
+    std::vector<uint32_t> dropped_bad_handle;
+    // systrace counter names, per queue
+    std::vector<std::string> trace_queue_names;
+
+    void dump(int fd);
+
+    void init();
+    bool startReactor();
+    void reactorLoop();
+    bool readPollable(int sub_index);
+    void stopThreads();
+
+    bool hasEvents();
+
+    int get_device_index(int global_handle);
     sensors_poll_device_t* get_v0_device_by_handle(int global_handle);
     sensors_poll_device_1_t* get_v1_device_by_handle(int global_handle);
     int get_device_version_by_handle(int global_handle);
 
-    void copy_event_remap_handle(sensors_event_t* src, sensors_event_t* dest, int sub_index);
+    void remap_handle(sensors_event_t* event, int module_index);
+    int drain_queue(int sub_index, sensors_event_t* data, int maxReads, int64_t until,
+            int* wakeUps);
+    int pick_queue(int64_t* until);
 };
 
-void sensors_poll_context_t::addSubHwDevice(struct hw_device_t* sub_hw_device) {
-    ALOGV("addSubHwDevice");
+void sensors_poll_context_t::init() {
+    this->nextReadIndex = 0;
+    this->wakeUpEventsReturned = 0;
+    pthread_mutex_init(&this->threads_mutex, NULL);
+    pthread_cond_init(&this->threads_cond, NULL);
+    this->reactor_epoll_fd = -1;
+    this->reactor_wake_fd = -1;
+    this->reactor_started = false;
+    this->reactor_stopping = 0;
+    this->starved = NULL;
+    this->latency.resize(global_sensors_count > 0 ? global_sensors_count + 1 : 1);
+    memset(&this->latency[0], 0, this->latency.size() * sizeof(LatencyStats));
+}
+
+void sensors_poll_context_t::addSubHwDevice(struct hw_device_t* sub_hw_device,
+        int module_index, int queue_capacity, void* dso) {
+    ALOGV("addSubHwDevice, module %d, queue capacity %d", module_index, queue_capacity);
+    if ((size_t)module_index >= this->device_indices.size()) {
+        this->device_indices.resize(module_index + 1, -1);
+    }
+    this->device_indices[module_index] = this->sub_hw_devices.size();
     this->sub_hw_devices.push_back(sub_hw_device);
 
-    SensorEventQueue *queue = new SensorEventQueue(SENSOR_EVENT_QUEUE_CAPACITY);
+    // With keys, so that pick_queue() only touches the packed keys of the queue heads.
+    SensorEventQueue *queue = new SensorEventQueue(queue_capacity, true);
     this->queues.push_back(queue);
+    this->dropped_bad_handle.push_back(0);
+    char trace_name[32];
+    snprintf(trace_name, sizeof(trace_name), "multihal queue %zu", this->queues.size() - 1);
+    this->trace_queue_names.push_back(trace_name);
 
     TaskContext* taskContext = new TaskContext();
     taskContext->device = (sensors_poll_device_t*) sub_hw_device;
     taskContext->queue = queue;
+    taskContext->index = module_index;
+    taskContext->finished = false;
+    taskContext->threads_mutex = &this->threads_mutex;
+    taskContext->threads_cond = &this->threads_cond;
+    taskContext->reportedFull = false;
+    this->tasks.push_back(taskContext);
+
+    // Prefer the reactor if the sub-HAL can tell when it has events.
+    int poll_fd = -1;
+    get_poll_fd_func get_poll_fd = dso ? (get_poll_fd_func) dlsym(dso, GET_POLL_FD_SYM) : NULL;
+    if (get_poll_fd != NULL) {
+        poll_fd = get_poll_fd(taskContext->device);
+    }
+    if (poll_fd >= 0 && (this->reactor_epoll_fd >= 0 || this->startReactor())) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = this->queues.size() - 1;
+        if (epoll_ctl(this->reactor_epoll_fd, EPOLL_CTL_ADD, poll_fd, &ev) == 0) {
+            ALOGV("sub-HAL %zu is served by the reactor", this->queues.size() - 1);
+            this->reactor_fds.push_back(poll_fd);
+            this->reactor_armed.push_back(true);
+            this->threads.push_back(pthread_t());
+            return;
+        }
+        ALOGW("could not watch the poll fd of sub-HAL %zu: %s", this->queues.size() - 1,
+                strerror(errno));
+    }
+    this->reactor_fds.push_back(-1);
+    this->reactor_armed.push_back(false);
 
     pthread_t writerThread;
     pthread_create(&writerThread, NULL, writerTask, taskContext);
     this->threads.push_back(writerThread);
 }
 
+// The epoll wakeup token of reactor_wake_fd. Sub-HALs use their queue index.
+static const uint32_t REACTOR_WAKE_TOKEN = 0xffffffff;
+
+bool sensors_poll_context_t::startReactor() {
+    this->reactor_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    this->reactor_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (this->reactor_epoll_fd < 0 || this->reactor_wake_fd < 0) {
+        ALOGE("cannot create the sub-HAL reactor: %s", strerror(errno));
+        if (this->reactor_epoll_fd >= 0) ::close(this->reactor_epoll_fd);
+        if (this->reactor_wake_fd >= 0) ::close(this->reactor_wake_fd);
+        this->reactor_epoll_fd = this->reactor_wake_fd = -1;
+        return false;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = REACTOR_WAKE_TOKEN;
+    epoll_ctl(this->reactor_epoll_fd, EPOLL_CTL_ADD, this->reactor_wake_fd, &ev);
+    // Sized for the most sub-HALs hals.conf can name; the reactor only starts after all of them
+    // were added, see open_sensors().
+    this->starved = new int32_t[sub_hw_modules->size()]();
+    return true;
+}
+
+static void* reactorTask(void* ptr) {
+    ALOGV("reactorTask STARTS");
+    ((sensors_poll_context_t*) ptr)->reactorLoop();
+    ALOGV("reactorTask ENDS");
+    return NULL;
+}
+
+// Reads what the pollable sub-HAL of sub_index has. Returns false if the queue is full, in which
+// case the sub-HAL is not watched until poll() made room.
+bool sensors_poll_context_t::readPollable(int sub_index) {
+    SensorEventQueue* queue = this->queues[sub_index];
+    sensors_poll_device_t* device = this->tasks[sub_index]->device;
+    sensors_event_t* buffer;
+    int bufferSize = queue->getWritableRegion(queue->getCapacity(), &buffer);
+    if (bufferSize == 0) {
+        android_atomic_release_store(1, &this->starved[sub_index]);
+        // Pairs with the barrier in poll(): either it sees the flag, or we see the room it made.
+        android_memory_barrier();
+        bufferSize = queue->getWritableRegion(queue->getCapacity(), &buffer);
+        if (bufferSize == 0) {
+            report_full(this->tasks[sub_index]);
+            return false;
+        }
+        android_atomic_release_store(0, &this->starved[sub_index]);
+    }
+    int eventsPolled = device->poll(device, buffer, bufferSize);
+    ALOGV("reactor poll() of sub-HAL %d got %d events.", sub_index, eventsPolled);
+    if (eventsPolled > 0) {
+        publish_events(queue, this->tasks[sub_index]->index, buffer, eventsPolled);
+    }
+    return true;
+}
+
+void sensors_poll_context_t::reactorLoop() {
+    struct epoll_event events[16];
+    while (!this->reactor_stopping) {
+        int count = epoll_wait(this->reactor_epoll_fd, events, 16, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            ALOGE("reactor epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            uint32_t token = events[i].data.u32;
+            if (token == REACTOR_WAKE_TOKEN) {
+                uint64_t value;
+                read(this->reactor_wake_fd, &value, sizeof(value));
+                continue;
+            }
+            if (!this->readPollable(token)) {
+                // Level-triggered: stop watching the fd until there is room.
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.data.u32 = token;
+                epoll_ctl(this->reactor_epoll_fd, EPOLL_CTL_MOD, this->reactor_fds[token], &ev);
+                this->reactor_armed[token] = false;
+            }
+        }
+        // Watch again the sub-HALs poll() made room for.
+        for (size_t i = 0; i < this->reactor_fds.size(); i++) {
+            if (this->reactor_fds[i] >= 0 && !this->reactor_armed[i] && !this->starved[i]) {
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.u32 = i;
+                epoll_ctl(this->reactor_epoll_fd, EPOLL_CTL_MOD, this->reactor_fds[i], &ev);
+                this->reactor_armed[i] = true;
+            }
+        }
+    }
+}
+
+/*
+ * Tells the writer threads to stop once their sub-HAL's poll() returns, and stops and joins the
+ * reactor. See close() for the rest.
+ */
+void sensors_poll_context_t::stopThreads() {
+    for (size_t i = 0; i < this->queues.size(); i++) {
+        this->queues[i]->close();
+    }
+    if (this->reactor_started) {
+        uint64_t one = 1;
+        android_atomic_release_store(1, &this->reactor_stopping);
+        write(this->reactor_wake_fd, &one, sizeof(one));
+        pthread_join(this->reactor_thread, NULL);
+        this->reactor_started = false;
+    }
+}
+
+// Returns the index in sub_hw_devices of the sub-HAL of the sensor, or -1 if the global handle is
+// invalid or its module has no device.
+int sensors_poll_context_t::get_device_index(int global_handle) {
+    int module_index = get_module_index(global_handle);
+    if (module_index < 0 || (size_t)module_index >= this->device_indices.size()) {
+        return -1;
+    }
+    return this->device_indices[module_index];
+}
+
 // Returns the device pointer, or NULL if the global handle is invalid.
 sensors_poll_device_t* sensors_poll_context_t::get_v0_device_by_handle(int global_handle) {
-    int sub_index = get_module_index(global_handle);
-    if (sub_index < 0 || sub_index >= this->sub_hw_devices.size()) {
+    int sub_index = this->get_device_index(global_handle);
+    if (sub_index < 0) {
         return NULL;
     }
     return (sensors_poll_device_t*) this->sub_hw_devices[sub_index];
@@ -234,8 +694,8 @@ sensors_poll_device_t* sensors_poll_context_t::get_v0_device_by_handle(int globa
 
 // Returns the device pointer, or NULL if the global handle is invalid.
 sensors_poll_device_1_t* sensors_poll_context_t::get_v1_device_by_handle(int global_handle) {
-    int sub_index = get_module_index(global_handle);
-    if (sub_index < 0 || sub_index >= this->sub_hw_devices.size()) {
+    int sub_index = this->get_device_index(global_handle);
+    if (sub_index < 0) {
         return NULL;
     }
     return (sensors_poll_device_1_t*) this->sub_hw_devices[sub_index];
@@ -305,66 +765,214 @@ int sensors_poll_context_t::setDelay(int handle, int64_t ns) {
     return retval;
 }
 
-void sensors_poll_context_t::copy_event_remap_handle(sensors_event_t* dest, sensors_event_t* src,
-        int sub_index) {
-    memcpy(dest, src, sizeof(struct sensors_event_t));
+void sensors_poll_context_t::remap_handle(sensors_event_t* event, int module_index) {
     // A normal event's "sensor" field is a local handle. Convert it to a global handle.
     // A meta-data event must have its sensor set to 0, but it has a nested event
     // with a local handle that needs to be converted to a global handle.
     FullHandle full_handle;
-    full_handle.moduleIndex = sub_index;
+    full_handle.moduleIndex = module_index;
 
     // If it's a metadata event, rewrite the inner payload, not the sensor field.
     // If the event's sensor field is unregistered for any reason, rewrite the sensor field
     // with a -1, instead of writing an incorrect but plausible sensor number, because
     // get_global_handle() returns -1 for unknown FullHandles.
-    if (dest->type == SENSOR_TYPE_META_DATA) {
-        full_handle.localHandle = dest->meta_data.sensor;
-        dest->meta_data.sensor = get_global_handle(&full_handle);
+    if (event->type == SENSOR_TYPE_META_DATA) {
+        full_handle.localHandle = event->meta_data.sensor;
+        event->meta_data.sensor = get_global_handle(&full_handle);
     } else {
-        full_handle.localHandle = dest->sensor;
-        dest->sensor = get_global_handle(&full_handle);
+        full_handle.localHandle = event->sensor;
+        event->sensor = get_global_handle(&full_handle);
     }
 }
 
+static bool is_wake_up_sensor(int global_handle) {
+    return global_handle > 0 && (size_t)global_handle < global_is_wake_up.size() &&
+            global_is_wake_up[global_handle];
+}
+
+static bool is_wake_up_local_sensor(int local_handle, int module_index) {
+    FullHandle full_handle;
+    full_handle.moduleIndex = module_index;
+    full_handle.localHandle = local_handle;
+    return is_wake_up_sensor(get_global_handle(&full_handle));
+}
+
+// Returns true if the event, still with its local handle, is of a wake-up sensor, flush
+// completions included.
+static bool is_wake_up_event(const sensors_event_t* event, int module_index) {
+    return is_wake_up_local_sensor(event->type == SENSOR_TYPE_META_DATA ?
+            event->meta_data.sensor : event->sensor, module_index);
+}
+
+// Returns true if an event must not wait behind the samples of other sub-HALs: flush
+// completions and other meta-data events, and events of wake-up sensors, for which the
+// framework holds a wake lock. The key still has the local handle.
+static bool is_critical(const SensorEventKey* key, int module_index) {
+    return key->type == SENSOR_TYPE_META_DATA ||
+            is_wake_up_local_sensor(key->sensor, module_index);
+}
+
+// Moves up to maxReads events from the queue of sub_index to data, with global handles, in
+// contiguous chunks. After the first event, only events stamped no later than until are taken.
+// Returns the number of events written to data, and adds those of wake-up sensors to wakeUps.
+int sensors_poll_context_t::drain_queue(int sub_index, sensors_event_t* data, int maxReads,
+        int64_t until, int* wakeUps) {
+    SensorEventQueue* queue = this->queues[sub_index];
+    int module_index = this->tasks[sub_index]->index;
+    int eventsRead = 0;
+    bool first = true;
+    sensors_event_t* region;
+    int regionSize;
+
+    // Two rounds at most, when the readable records wrap around the end of the queue.
+    while (eventsRead < maxReads &&
+            (regionSize = queue->getReadableRegion(maxReads - eventsRead, &region)) > 0) {
+        // Find the end of the run of events that are due before the other queues' heads.
+        const SensorEventKey* keys = queue->getReadableKeys();
+        int runSize = first ? 1 : 0;
+        while (runSize < regionSize && keys[runSize].timestamp <= until) {
+            runSize++;
+        }
+        if (runSize == 0) {
+            break;
+        }
+        first = false;
+
+        memcpy(&data[eventsRead], region, runSize * sizeof(sensors_event_t));
+        int64_t now = monotonic_ns();
+        int written = eventsRead;
+        for (int i = eventsRead; i < eventsRead + runSize; i++) {
+            remap_handle(&data[i], module_index);
+            if (data[i].sensor == -1) {
+                // Bad handle, do not pass corrupted event upstream !
+                ALOGW("Dropping bad local handle event packet on the floor");
+                this->dropped_bad_handle[sub_index]++;
+                continue;
+            }
+            int global_handle = data[i].type == SENSOR_TYPE_META_DATA ?
+                    data[i].meta_data.sensor : data[i].sensor;
+            if (is_wake_up_sensor(global_handle)) {
+                (*wakeUps)++;
+            }
+            if ((size_t)global_handle < this->latency.size()) {
+                record_latency(&this->latency[global_handle],
+                        now - queue->getEnqueueTime(i - eventsRead));
+            }
+            if (written != i) {
+                data[written] = data[i];
+            }
+            written++;
+        }
+        queue->dequeue(runSize);
+        ATRACE_INT(this->trace_queue_names[sub_index].c_str(), queue->getSize());
+        eventsRead = written;
+        if (runSize < regionSize) {
+            break;
+        }
+    }
+    return eventsRead;
+}
+
+// Returns the index of the queue to read next, or -1 if all are empty. Queues whose first event
+// is critical come first, then the one with the oldest first event, ties going round-robin from
+// nextReadIndex. until is set to the timestamp up to which the chosen queue may be drained before
+// another queue has an event due.
+int sensors_poll_context_t::pick_queue(int64_t* until) {
+    int queueCount = (int)this->queues.size();
+    int best = -1;
+    bool bestCritical = false;
+    int64_t bestTimestamp = 0;
+    bool otherCritical = false;
+    int64_t otherTimestamp = INT64_MAX;
+
+    for (int n = 0; n < queueCount; n++) {
+        int i = (this->nextReadIndex + n) % queueCount;
+        const SensorEventKey* key = this->queues[i]->peekKey();
+        if (key == NULL) {
+            continue;
+        }
+        bool critical = is_critical(key, this->tasks[i]->index);
+        if (best < 0 || (critical && !bestCritical) ||
+                (critical == bestCritical && key->timestamp < bestTimestamp)) {
+            if (best >= 0) {
+                otherCritical = otherCritical || bestCritical;
+                otherTimestamp = std::min(otherTimestamp, bestTimestamp);
+            }
+            best = i;
+            bestCritical = critical;
+            bestTimestamp = key->timestamp;
+        } else {
+            otherCritical = otherCritical || critical;
+            otherTimestamp = std::min(otherTimestamp, key->timestamp);
+        }
+    }
+    // Another queue holding a critical event gets its turn right after this one's first event.
+    *until = otherCritical ? INT64_MIN : otherTimestamp;
+    return best;
+}
+
+// Returns true if any queue holds events. Only call from the poll() thread.
+bool sensors_poll_context_t::hasEvents() {
+    for (size_t i = 0; i < this->queues.size(); i++) {
+        if (this->queues[i]->getSize() > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 int sensors_poll_context_t::poll(sensors_event_t *data, int maxReads) {
     ALOGV("poll");
-    int empties = 0;
     int queueCount = 0;
     int eventsRead = 0;
+    int wakeUps = 0;
+
+    // Being called again, the framework has taken over the wake-up events returned last time.
+    if (this->wakeUpEventsReturned > 0) {
+        release_wake_up_events(this->wakeUpEventsReturned);
+        this->wakeUpEventsReturned = 0;
+    }
 
-    pthread_mutex_lock(&queue_mutex);
     queueCount = (int)this->queues.size();
     while (eventsRead == 0) {
-        while (empties < queueCount && eventsRead < maxReads) {
-            SensorEventQueue* queue = this->queues.at(this->nextReadIndex);
-            sensors_event_t* event = queue->peek();
-            if (event == NULL) {
-                empties++;
-            } else {
-                empties = 0;
-                this->copy_event_remap_handle(&data[eventsRead], event, nextReadIndex);
-                if (data[eventsRead].sensor == -1) {
-                    // Bad handle, do not pass corrupted event upstream !
-                    ALOGW("Dropping bad local handle event packet on the floor");
-                } else {
-                    eventsRead++;
+        // Merge the queues into one stream ordered by timestamp, with critical events first.
+        // Runs of events due before any other queue's are taken from a queue at once, so that a
+        // sub-HAL flushing its FIFO is still delivered in bulk.
+        while (eventsRead < maxReads) {
+            int64_t until;
+            int index = this->pick_queue(&until);
+            if (index < 0) {
+                break;
+            }
+            eventsRead += this->drain_queue(index, &data[eventsRead], maxReads - eventsRead,
+                    until, &wakeUps);
+            this->nextReadIndex = (index + 1) % queueCount;
+            if (this->reactor_fds[index] >= 0) {
+                // Pairs with the barrier in readPollable().
+                android_memory_barrier();
+                if (this->starved[index]) {
+                    uint64_t one = 1;
+                    android_atomic_release_store(0, &this->starved[index]);
+                    write(this->reactor_wake_fd, &one, sizeof(one));
                 }
-                queue->dequeue();
             }
-            this->nextReadIndex = (this->nextReadIndex + 1) % queueCount;
         }
         if (eventsRead == 0) {
-            // The queues have been scanned and none contain data, so wait.
-            ALOGV("poll stopping to wait for data");
-            waiting_for_data = true;
-            pthread_cond_wait(&data_available_cond, &queue_mutex);
-            waiting_for_data = false;
-            empties = 0;
+            // The queues have been scanned and none contain data, so wait, unless a writer
+            // published events before it could see waiting_for_data.
+            pthread_mutex_lock(&queue_mutex);
+            android_atomic_release_store(1, &waiting_for_data);
+            android_memory_barrier();
+            if (!this->hasEvents()) {
+                ALOGV("poll stopping to wait for data");
+                pthread_cond_wait(&data_available_cond, &queue_mutex);
+            }
+            android_atomic_release_store(0, &waiting_for_data);
+            pthread_mutex_unlock(&queue_mutex);
         }
     }
-    pthread_mutex_unlock(&queue_mutex);
-    ALOGV("poll returning %d events.", eventsRead);
+    this->wakeUpEventsReturned = wakeUps;
+    ALOGV("poll returning %d events, %d of wake-up sensors.", eventsRead, wakeUps);
 
     return eventsRead;
 }
@@ -397,23 +1005,159 @@ int sensors_poll_context_t::flush(int handle) {
     return retval;
 }
 
+/*
+ * Writes the queue statistics and the per-sensor latency histograms to fd, or to the log if fd is
+ * negative.
+ */
+void sensors_poll_context_t::dump(int fd) {
+    char line[256];
+    std::string out;
+    for (size_t i = 0; i < this->queues.size(); i++) {
+        SensorEventQueue* queue = this->queues[i];
+        snprintf(line, sizeof(line), "sub-HAL %d event queue: capacity %d, size %d, "
+                "high-water mark %d, %d waits for space, %u events with bad handles dropped\n",
+                this->tasks[i]->index, queue->getCapacity(), queue->getSize(), queue->getHighWaterMark(),
+                queue->getFullWaits(), this->dropped_bad_handle[i]);
+        out += line;
+    }
+    pthread_mutex_lock(&wake_lock_mutex);
+    snprintf(line, sizeof(line), "wake lock %s: %u acquisitions, %llu wake-up events, "
+            "%d pending\n", wake_lock_held ? "held" : "released", wake_lock_acquisitions,
+            (unsigned long long) wake_up_events_published, wake_up_events_pending);
+    pthread_mutex_unlock(&wake_lock_mutex);
+    out += line;
+    for (size_t handle = 1; handle < this->latency.size(); handle++) {
+        const LatencyStats* stats = &this->latency[handle];
+        if (stats->count == 0) {
+            continue;
+        }
+        snprintf(line, sizeof(line), "sensor %zu (%s): %llu events, latency mean %lld us, "
+                "p50 < %lld us, p99 < %lld us, max %lld us\n",
+                handle, (int)handle <= global_sensors_count ?
+                        global_sensors_list[handle - 1].name : "?",
+                (unsigned long long) stats->count,
+                (long long) (stats->total_ns / stats->count / 1000),
+                (long long) latency_percentile_us(stats, 0.5),
+                (long long) latency_percentile_us(stats, 0.99),
+                (long long) (stats->max_ns / 1000));
+        out += line;
+        snprintf(line, sizeof(line), "  histogram (< 2^i us):");
+        out += line;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            snprintf(line, sizeof(line), " %u", stats->buckets[i]);
+            out += line;
+        }
+        out += "\n";
+    }
+    if (fd >= 0) {
+        write(fd, out.c_str(), out.size());
+    } else {
+        ALOGI("%s", out.c_str());
+    }
+}
+
 int sensors_poll_context_t::close() {
     ALOGV("close");
+    this->dump(-1);
+    // Stop the reactor before closing its devices, nothing uses them afterwards.
+    this->stopThreads();
     for (std::vector<hw_device_t*>::iterator it = this->sub_hw_devices.begin();
             it != this->sub_hw_devices.end(); it++) {
         hw_device_t* dev = *it;
         int retval = dev->close(dev);
         ALOGV("retval %d", retval);
     }
-    return 0;
+
+    // Most sub-HALs return from a pending poll() once closed.
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += WRITER_STOP_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (WRITER_STOP_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    bool all_stopped = true;
+    pthread_mutex_lock(&this->threads_mutex);
+    for (size_t i = 0; i < this->tasks.size(); i++) {
+        if (this->reactor_fds[i] >= 0) {
+            continue;
+        }
+        while (!this->tasks[i]->finished &&
+                pthread_cond_timedwait(&this->threads_cond, &this->threads_mutex,
+                        &deadline) == 0) {
+        }
+        if (this->tasks[i]->finished) {
+            pthread_join(this->threads[i], NULL);
+        } else {
+            ALOGW("writer thread of sub-HAL %zu does not stop, leaving it behind", i);
+            pthread_detach(this->threads[i]);
+            all_stopped = false;
+        }
+    }
+    pthread_mutex_unlock(&this->threads_mutex);
+
+    if (this->reactor_epoll_fd >= 0) {
+        ::close(this->reactor_epoll_fd);
+        ::close(this->reactor_wake_fd);
+        this->reactor_epoll_fd = this->reactor_wake_fd = -1;
+    }
+    delete[] this->starved;
+    this->starved = NULL;
+    // Whatever is still queued is dropped with the device, and a thread left behind publishes to
+    // a closed queue, which takes no wake lock.
+    pthread_mutex_lock(&wake_lock_mutex);
+    if (wake_lock_held) {
+        release_wake_lock(WAKE_LOCK_NAME);
+        wake_lock_held = false;
+    }
+    wake_up_events_pending = 0;
+    pthread_mutex_unlock(&wake_lock_mutex);
+    this->wakeUpEventsReturned = 0;
+    // A thread left behind still uses its queue, its task and threads_mutex.
+    if (all_stopped) {
+        for (size_t i = 0; i < this->queues.size(); i++) {
+            delete this->tasks[i];
+            delete this->queues[i];
+        }
+        this->tasks.clear();
+        this->queues.clear();
+    }
+    return all_stopped ? 0 : -EBUSY;
 }
 
 
+// The device last opened, for sensors_multihal_dump().
+static pthread_mutex_t open_context_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sensors_poll_context_t* open_context = NULL;
+
+/*
+ * Diagnostics entry point for tools loading the multihal: writes queue and latency statistics of
+ * the open device to fd. Returns -ENODEV if no device is open.
+ */
+extern "C" int sensors_multihal_dump(int fd) {
+    int retval = -ENODEV;
+    pthread_mutex_lock(&open_context_mutex);
+    if (open_context != NULL) {
+        open_context->dump(fd);
+        retval = 0;
+    }
+    pthread_mutex_unlock(&open_context_mutex);
+    return retval;
+}
+
 static int device__close(struct hw_device_t *dev) {
     sensors_poll_context_t* ctx = (sensors_poll_context_t*) dev;
+    pthread_mutex_lock(&open_context_mutex);
+    if (open_context == ctx) {
+        open_context = NULL;
+    }
+    pthread_mutex_unlock(&open_context_mutex);
     if (ctx != NULL) {
         int retval = ctx->close();
-        delete ctx;
+        if (retval == 0) {
+            delete ctx;
+        }
     }
     return 0;
 }
@@ -460,10 +1204,33 @@ static bool starts_with(const char* s, const char* prefix) {
 }
 
 /*
- * Adds valid paths from the config file to the vector passed in.
- * The vector must not be null.
+ * Parses the options following the path on a hals.conf line, separated by whitespace. The only
+ * option is "queue_capacity=<events>", the size of the event queue of the sub-HAL.
+ * Returns the queue capacity, or 0 if not given.
  */
-static void get_so_paths(std::vector<char*> *so_paths) {
+static int parse_conf_options(char* options, int line_count) {
+    int queue_capacity = 0;
+    char* save = NULL;
+    for (char* option = strtok_r(options, " \t", &save); option != NULL;
+            option = strtok_r(NULL, " \t", &save)) {
+        int value;
+        if (sscanf(option, "queue_capacity=%d", &value) == 1 && value > 0) {
+            queue_capacity = value < MAX_SENSOR_EVENT_QUEUE_CAPACITY ?
+                    value : MAX_SENSOR_EVENT_QUEUE_CAPACITY;
+        } else {
+            ALOGW("ignoring unknown option '%s' on line #%d of %s", option, line_count,
+                    CONFIG_FILENAME);
+        }
+    }
+    return queue_capacity;
+}
+
+/*
+ * Adds valid paths from the config file to the vector passed in, and the queue capacity
+ * configured for each of them to queue_capacities.
+ * The vectors must not be null.
+ */
+static void get_so_paths(std::vector<char*> *so_paths, std::vector<int> *queue_capacities) {
     FILE *conf_file = fopen(CONFIG_FILENAME, "r");
     if (conf_file == NULL) {
         ALOGW("No multihal config file found at %s", CONFIG_FILENAME);
@@ -480,6 +1247,13 @@ static void get_so_paths(std::vector<char*> *so_paths) {
             *pch = '\0';
         }
         ALOGV("config file line #%d: '%s'", ++line_count, line);
+        // The path may be followed by options.
+        int queue_capacity = 0;
+        char* options = strpbrk(line, " \t");
+        if (options != NULL) {
+            *options++ = '\0';
+            queue_capacity = parse_conf_options(options, line_count);
+        }
         char *real_path = realpath(line, NULL);
         if (starts_with(real_path, LEGAL_SUBHAL_PATH_PREFIX) ||
 		starts_with(real_path, LEGAL_SUBHAL_ALTERNATE_PATH_PREFIX)) {
@@ -487,6 +1261,7 @@ static void get_so_paths(std::vector<char*> *so_paths) {
             char* compact_line = new char[strlen(real_path) + 1];
             strcpy(compact_line, real_path);
             so_paths->push_back(compact_line);
+            queue_capacities->push_back(queue_capacity);
         } else {
             ALOGW("rejecting path '%s' because it does not start with '%s' or '%s'",
                     real_path, LEGAL_SUBHAL_PATH_PREFIX, LEGAL_SUBHAL_ALTERNATE_PATH_PREFIX);
@@ -498,6 +1273,86 @@ static void get_so_paths(std::vector<char*> *so_paths) {
     ALOGV("hals.conf contained %d lines", line_count);
 }
 
+/*
+ * Runs task(index, arg) for every index below count, each on its own thread, and returns once all
+ * of them finished. Sub-HALs may spend a while in dlopen(), get_sensors_list() or open(); this
+ * overlaps them instead of adding them up.
+ */
+struct ParallelTask {
+    void (*task)(size_t index, void* arg);
+    void* arg;
+    size_t index;
+};
+
+static void* parallel_task_main(void* ptr) {
+    ParallelTask* task = (ParallelTask*) ptr;
+    task->task(task->index, task->arg);
+    return NULL;
+}
+
+static void run_in_parallel(size_t count, void (*task)(size_t index, void* arg), void* arg) {
+    std::vector<ParallelTask> tasks(count);
+    std::vector<pthread_t> threads(count);
+    std::vector<bool> started(count, false);
+
+    // The first task runs on the calling thread, which would only wait otherwise.
+    for (size_t i = 0; i < count; i++) {
+        tasks[i].task = task;
+        tasks[i].arg = arg;
+        tasks[i].index = i;
+        if (i > 0) {
+            started[i] = pthread_create(&threads[i], NULL, parallel_task_main, &tasks[i]) == 0;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!started[i]) {
+            // Also the fallback if no thread could be created.
+            parallel_task_main(&tasks[i]);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+/*
+ * dlopen()s so_paths[index] and stores its module symbol in modules[index], or NULL on failure.
+ */
+struct LoadModulesContext {
+    std::vector<char*>* so_paths;
+    std::vector<hw_module_t*> modules;
+    std::vector<void*> dsos;
+};
+
+static void load_module_task(size_t index, void* arg) {
+    LoadModulesContext* ctx = (LoadModulesContext*) arg;
+    char* path = (*ctx->so_paths)[index];
+    const char* sym = HAL_MODULE_INFO_SYM_AS_STR;
+    dlerror(); // clear any old errors
+    void* lib_handle = dlopen(path, RTLD_LAZY);
+    if (lib_handle == NULL) {
+        ALOGW("dlerror(): %s", dlerror());
+    } else {
+        ALOGI("Loaded library from %s", path);
+        ALOGV("Opening symbol \"%s\"", sym);
+        // clear old errors
+        dlerror();
+        struct hw_module_t* module = (hw_module_t*) dlsym(lib_handle, sym);
+        const char* error;
+        if ((error = dlerror()) != NULL) {
+            ALOGW("Error calling dlsym: %s", error);
+        } else if (module == NULL) {
+            ALOGW("module == NULL");
+        } else {
+            ALOGV("Loaded symbols from \"%s\"", sym);
+            ctx->modules[index] = module;
+            ctx->dsos[index] = lib_handle;
+        }
+    }
+}
+
 /*
  * Ensures that the sub-module array is initialized.
  * This can be first called from get_sensors_list or from open_sensors.
@@ -508,36 +1363,325 @@ static void lazy_init_modules() {
         pthread_mutex_unlock(&init_modules_mutex);
         return;
     }
-    std::vector<char*> *so_paths = new std::vector<char*>();
-    get_so_paths(so_paths);
+    // The sub-HALs of a cached sensor list, whose module indexes it refers to, else hals.conf's.
+    std::vector<char*> *so_paths = cached_so_paths;
+    std::vector<int> queue_capacities;
+    if (so_paths != NULL) {
+        queue_capacities = *cached_queue_capacities;
+    } else {
+        so_paths = new std::vector<char*>();
+        get_so_paths(so_paths, &queue_capacities);
+    }
 
-    // dlopen the module files and cache their module symbols in sub_hw_modules
-    sub_hw_modules = new std::vector<hw_module_t *>();
-    dlerror(); // clear any old errors
-    const char* sym = HAL_MODULE_INFO_SYM_AS_STR;
-    for (std::vector<char*>::iterator it = so_paths->begin(); it != so_paths->end(); it++) {
-        char* path = *it;
-        void* lib_handle = dlopen(path, RTLD_LAZY);
-        if (lib_handle == NULL) {
-            ALOGW("dlerror(): %s", dlerror());
-        } else {
-            ALOGI("Loaded library from %s", path);
-            ALOGV("Opening symbol \"%s\"", sym);
-            // clear old errors
-            dlerror();
-            struct hw_module_t* module = (hw_module_t*) dlsym(lib_handle, sym);
-            const char* error;
-            if ((error = dlerror()) != NULL) {
-                ALOGW("Error calling dlsym: %s", error);
-            } else if (module == NULL) {
-                ALOGW("module == NULL");
-            } else {
-                ALOGV("Loaded symbols from \"%s\"", sym);
-                sub_hw_modules->push_back(module);
-            }
+    // dlopen the module files in parallel, then cache their module symbols in sub_hw_modules
+    // in the order of the config file.
+    LoadModulesContext ctx;
+    ctx.so_paths = so_paths;
+    ctx.modules.resize(so_paths->size(), NULL);
+    ctx.dsos.resize(so_paths->size(), NULL);
+    run_in_parallel(so_paths->size(), load_module_task, &ctx);
+
+    // A module that failed to load keeps its NULL entry, so that the module indexes stay those
+    // of so_paths and of a cached sensor list.
+    sub_hw_modules = new std::vector<hw_module_t *>(ctx.modules);
+    sub_hw_module_queue_capacities = new std::vector<int>(queue_capacities);
+    sub_hw_module_dsos = new std::vector<void*>(ctx.dsos);
+    sub_hw_module_paths = so_paths;
+    pthread_mutex_unlock(&init_modules_mutex);
+}
+
+/*
+ * Reads the sensor list of sub module index into lists[index] and counts[index].
+ */
+struct SensorsListContext {
+    std::vector<const struct sensor_t*> lists;
+    std::vector<int> counts;
+};
+
+static void get_sensors_list_task(size_t index, void* arg) {
+    SensorsListContext* ctx = (SensorsListContext*) arg;
+    struct sensors_module_t *module = (struct sensors_module_t*) (*sub_hw_modules)[index];
+    if (module == NULL) {
+        return;
+    }
+    ctx->counts[index] = module->get_sensors_list(module, &ctx->lists[index]);
+    ALOGV("module %zu has %d sensors", index, ctx->counts[index]);
+}
+
+/*
+ * Cache of the sensor lists of the sub-HALs, so that a process that only lists the sensors, as
+ * the sensor service does at startup before the device is opened, neither parses hals.conf nor
+ * dlopen()s the sub-HALs. It is written by whoever may, after building the list from the
+ * sub-HALs, and is valid while hals.conf and every sub-HAL library keep the inode, size and
+ * modification time recorded. A 32 and a 64-bit multihal each have their own, as the records
+ * hold sensor_t structures as laid out in memory.
+ *
+ * The file is a SensorsListCacheHeader, then module_count SensorsListCacheModule and
+ * sensor_count SensorsListCacheSensor in module order, then strings_size bytes of
+ * NUL-terminated strings the records refer to by offset. It is mapped for good, the sensor list
+ * pointing at its strings.
+ */
+#if defined(__LP64__)
+static const char* SENSORS_LIST_CACHE_FILENAME = "/data/system/sensors_multihal64.cache";
+#else
+static const char* SENSORS_LIST_CACHE_FILENAME = "/data/system/sensors_multihal.cache";
+#endif
+static const uint32_t SENSORS_LIST_CACHE_MAGIC = 0x4c534d48; // "HMSL"
+static const uint32_t SENSORS_LIST_CACHE_VERSION = 1;
+static const uint32_t NO_STRING = 0xffffffff;
+
+struct FileStamp {
+    uint64_t inode;
+    int64_t size;
+    int64_t mtime;
+};
+
+struct SensorsListCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sensor_size;
+    uint32_t module_count;
+    uint32_t sensor_count;
+    uint32_t strings_size;
+    FileStamp conf;
+};
+
+struct SensorsListCacheModule {
+    FileStamp library;
+    uint32_t path;
+    int32_t queue_capacity;
+    uint32_t sensor_count;
+    uint32_t reserved;
+};
+
+struct SensorsListCacheSensor {
+    // With the local handle. The string pointers are not meaningful.
+    struct sensor_t sensor;
+    uint32_t name;
+    uint32_t vendor;
+    uint32_t string_type;
+    uint32_t required_permission;
+};
+
+static void get_file_stamp(const struct stat* st, FileStamp* stamp) {
+    memset(stamp, 0, sizeof(*stamp));
+    stamp->inode = st->st_ino;
+    stamp->size = st->st_size;
+    stamp->mtime = st->st_mtime;
+}
+
+static bool file_stamp_matches(const char* path, const FileStamp* stamp) {
+    struct stat st;
+    FileStamp current;
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+    get_file_stamp(&st, &current);
+    return current.inode == stamp->inode && current.size == stamp->size &&
+            current.mtime == stamp->mtime;
+}
+
+// Returns the string at offset of the strings of the cache, NULL for NO_STRING.
+static const char* cached_string(const char* strings, uint32_t offset) {
+    return offset == NO_STRING ? NULL : strings + offset;
+}
+
+/*
+ * Reads the sensor lists of the cache into ctx and sets cached_so_paths and
+ * cached_queue_capacities, if the cache matches hals.conf, of stamp conf_stat, and the sub-HAL
+ * libraries. Returns false, leaving ctx empty, otherwise.
+ */
+static bool load_sensors_list_cache(const struct stat* conf_stat, SensorsListContext* ctx) {
+    int fd = open(SENSORS_LIST_CACHE_FILENAME, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ALOGV("no sensor list cache: %s", strerror(errno));
+        return false;
+    }
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(SensorsListCacheHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    size_t size = st.st_size;
+    const SensorsListCacheHeader* header = (const SensorsListCacheHeader*) map;
+    FileStamp conf;
+    get_file_stamp(conf_stat, &conf);
+    bool valid = header->magic == SENSORS_LIST_CACHE_MAGIC &&
+            header->version == SENSORS_LIST_CACHE_VERSION &&
+            header->sensor_size == sizeof(struct sensor_t) &&
+            sizeof(*header) + (uint64_t) header->module_count * sizeof(SensorsListCacheModule) +
+                    (uint64_t) header->sensor_count * sizeof(SensorsListCacheSensor) +
+                    header->strings_size == size &&
+            header->strings_size > 0 && !memcmp(&header->conf, &conf, sizeof(conf));
+    const SensorsListCacheModule* modules = (const SensorsListCacheModule*) (header + 1);
+    const SensorsListCacheSensor* sensors =
+            (const SensorsListCacheSensor*) (modules + (valid ? header->module_count : 0));
+    const char* strings = (const char*) (sensors + (valid ? header->sensor_count : 0));
+    valid = valid && strings[header->strings_size - 1] == '\0';
+
+    // Every string offset must be in the strings, and the sensors must add up.
+    uint32_t sensor_count = 0;
+    for (uint32_t i = 0; valid && i < header->module_count; i++) {
+        valid = modules[i].path < header->strings_size &&
+                file_stamp_matches(strings + modules[i].path, &modules[i].library);
+        sensor_count += modules[i].sensor_count;
+    }
+    valid = valid && sensor_count == header->sensor_count;
+    for (uint32_t i = 0; valid && i < header->sensor_count; i++) {
+        const SensorsListCacheSensor* sensor = &sensors[i];
+        const uint32_t offsets[] = { sensor->name, sensor->vendor, sensor->string_type,
+                sensor->required_permission };
+        for (size_t j = 0; valid && j < sizeof(offsets) / sizeof(offsets[0]); j++) {
+            valid = offsets[j] == NO_STRING || offsets[j] < header->strings_size;
         }
     }
-    pthread_mutex_unlock(&init_modules_mutex);
+    if (!valid) {
+        ALOGI("sensor list cache %s is stale, rebuilding it", SENSORS_LIST_CACHE_FILENAME);
+        munmap(map, size);
+        return false;
+    }
+
+    struct sensor_t* list = new sensor_t[header->sensor_count];
+    cached_so_paths = new std::vector<char*>();
+    cached_queue_capacities = new std::vector<int>();
+    ctx->lists.resize(header->module_count, NULL);
+    ctx->counts.resize(header->module_count, 0);
+    const SensorsListCacheSensor* sensor = sensors;
+    struct sensor_t* next = list;
+    for (uint32_t i = 0; i < header->module_count; i++) {
+        cached_so_paths->push_back(const_cast<char*>(strings + modules[i].path));
+        cached_queue_capacities->push_back(modules[i].queue_capacity);
+        ctx->lists[i] = next;
+        ctx->counts[i] = modules[i].sensor_count;
+        for (uint32_t j = 0; j < modules[i].sensor_count; j++, sensor++, next++) {
+            *next = sensor->sensor;
+            next->name = cached_string(strings, sensor->name);
+            next->vendor = cached_string(strings, sensor->vendor);
+            next->stringType = cached_string(strings, sensor->string_type);
+            next->requiredPermission = cached_string(strings, sensor->required_permission);
+        }
+    }
+    ALOGV("read %u sensors of %u sub-HALs from %s", header->sensor_count, header->module_count,
+            SENSORS_LIST_CACHE_FILENAME);
+    return true;
+}
+
+// Appends s to strings, returning its offset.
+static uint32_t add_cache_string(std::string* strings, const char* s) {
+    if (s == NULL) {
+        return NO_STRING;
+    }
+    uint32_t offset = strings->size();
+    strings->append(s, strlen(s) + 1);
+    return offset;
+}
+
+/*
+ * Writes the sensor lists of ctx, those of the sub-HALs loaded from hals.conf of stamp
+ * conf_stat, to the cache. Any failure just leaves the cache to the next process.
+ */
+static void write_sensors_list_cache(const struct stat* conf_stat,
+        const SensorsListContext* ctx) {
+    std::vector<SensorsListCacheModule> modules(ctx->lists.size());
+    std::vector<SensorsListCacheSensor> sensors;
+    std::string strings;
+    for (size_t i = 0; i < ctx->lists.size(); i++) {
+        struct stat st;
+        // A sub-HAL that failed to load may do better next time.
+        if ((*sub_hw_modules)[i] == NULL || stat((*sub_hw_module_paths)[i], &st) != 0) {
+            return;
+        }
+        memset(&modules[i], 0, sizeof(modules[i]));
+        get_file_stamp(&st, &modules[i].library);
+        modules[i].path = add_cache_string(&strings, (*sub_hw_module_paths)[i]);
+        modules[i].queue_capacity = (*sub_hw_module_queue_capacities)[i];
+        modules[i].sensor_count = ctx->counts[i] > 0 ? ctx->counts[i] : 0;
+        for (int j = 0; j < ctx->counts[i]; j++) {
+            const struct sensor_t* local_sensor = &ctx->lists[i][j];
+            SensorsListCacheSensor sensor;
+            memset(&sensor, 0, sizeof(sensor));
+            sensor.sensor = *local_sensor;
+            sensor.sensor.name = NULL;
+            sensor.sensor.vendor = NULL;
+            sensor.sensor.stringType = NULL;
+            sensor.sensor.requiredPermission = NULL;
+            sensor.name = add_cache_string(&strings, local_sensor->name);
+            sensor.vendor = add_cache_string(&strings, local_sensor->vendor);
+            sensor.string_type = add_cache_string(&strings, local_sensor->stringType);
+            sensor.required_permission =
+                    add_cache_string(&strings, local_sensor->requiredPermission);
+            sensors.push_back(sensor);
+        }
+    }
+
+    SensorsListCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SENSORS_LIST_CACHE_MAGIC;
+    header.version = SENSORS_LIST_CACHE_VERSION;
+    header.sensor_size = sizeof(struct sensor_t);
+    header.module_count = modules.size();
+    header.sensor_count = sensors.size();
+    // The last string must end the strings, also without any.
+    strings.push_back('\0');
+    header.strings_size = strings.size();
+    get_file_stamp(conf_stat, &header.conf);
+
+    std::string data((const char*) &header, sizeof(header));
+    if (!modules.empty()) {
+        data.append((const char*) &modules[0], modules.size() * sizeof(modules[0]));
+    }
+    if (!sensors.empty()) {
+        data.append((const char*) &sensors[0], sensors.size() * sizeof(sensors[0]));
+    }
+    data += strings;
+
+    // Written aside and renamed, so that readers only ever see a complete file.
+    std::string tmp_path = std::string(SENSORS_LIST_CACHE_FILENAME) + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ALOGV("cannot write the sensor list cache: %s", strerror(errno));
+        return;
+    }
+    bool written = write(fd, data.data(), data.size()) == (ssize_t) data.size();
+    written = ::close(fd) == 0 && written;
+    if (!written || rename(tmp_path.c_str(), SENSORS_LIST_CACHE_FILENAME) != 0) {
+        ALOGW("cannot write the sensor list cache: %s", strerror(errno));
+        unlink(tmp_path.c_str());
+    }
+}
+
+/*
+ * Compares the sensor lists of the loaded sub-HALs with the cached one the handles were assigned
+ * from, for a sub-HAL whose list changed without its library changing. The cache is removed if
+ * they differ, for the next process to rebuild it; this one goes on with the cached handles.
+ */
+static void check_sensors_list_cache() {
+    int global_handle = 1;
+    bool matches = true;
+    for (size_t i = 0; matches && i < sub_hw_modules->size(); i++) {
+        sensors_module_t* module = (sensors_module_t*) (*sub_hw_modules)[i];
+        const struct sensor_t* list = NULL;
+        int count = module != NULL ? module->get_sensors_list(module, &list) : -1;
+        for (int j = 0; matches && j < count; j++, global_handle++) {
+            const FullHandle* full = global_handle < (int) global_to_full.size() ?
+                    &global_to_full[global_handle] : NULL;
+            matches = full != NULL && full->moduleIndex == (int) i &&
+                    full->localHandle == list[j].handle;
+        }
+        if (count < 0) {
+            matches = false;
+        }
+    }
+    if (!matches || global_handle != (int) global_to_full.size()) {
+        ALOGW("the sensors of the sub-HALs do not match %s, removing it",
+                SENSORS_LIST_CACHE_FILENAME);
+        unlink(SENSORS_LIST_CACHE_FILENAME);
+    }
 }
 
 /*
@@ -554,15 +1698,26 @@ static void lazy_init_sensors_list() {
     }
 
     ALOGV("lazy_init_sensors_list needs to do work");
-    lazy_init_modules();
+    struct stat conf_stat;
+    bool have_conf = stat(CONFIG_FILENAME, &conf_stat) == 0;
+    SensorsListContext ctx;
+    sensors_list_from_cache = have_conf && load_sensors_list_cache(&conf_stat, &ctx);
+    if (!sensors_list_from_cache) {
+        lazy_init_modules();
+
+        // Read all the sensor lists in parallel, then count the sensors and allocate an array of
+        // blanks. The merged list is only published once all of them are in.
+        ctx.lists.resize(sub_hw_modules->size(), NULL);
+        ctx.counts.resize(sub_hw_modules->size(), 0);
+        run_in_parallel(sub_hw_modules->size(), get_sensors_list_task, &ctx);
+        if (have_conf) {
+            write_sensors_list_cache(&conf_stat, &ctx);
+        }
+    }
 
-    // Count all the sensors, then allocate an array of blanks.
     global_sensors_count = 0;
-    const struct sensor_t *subhal_sensors_list;
-    for (std::vector<hw_module_t*>::iterator it = sub_hw_modules->begin();
-            it != sub_hw_modules->end(); it++) {
-        struct sensors_module_t *module = (struct sensors_module_t*) *it;
-        global_sensors_count += module->get_sensors_list(module, &subhal_sensors_list);
+    for (size_t i = 0; i < ctx.counts.size(); i++) {
+        global_sensors_count += ctx.counts[i];
         ALOGV("increased global_sensors_count to %d", global_sensors_count);
     }
 
@@ -570,17 +1725,19 @@ static void lazy_init_sensors_list() {
     // Manipulate this non-const list, and point the const one to it when we're done.
     sensor_t* mutable_sensor_list = new sensor_t[global_sensors_count];
 
+    // Size the handle tables once, assign_global_handle() then only fills them in.
+    global_to_full.reserve(global_sensors_count + 1);
+    local_to_global.resize(ctx.lists.size());
+
     // index of the next sensor to set in mutable_sensor_list
     int mutable_sensor_index = 0;
     int module_index = 0;
 
-    for (std::vector<hw_module_t*>::iterator it = sub_hw_modules->begin();
-            it != sub_hw_modules->end(); it++) {
-        hw_module_t *hw_module = *it;
+    for (; module_index < (int)ctx.lists.size(); module_index++) {
         ALOGV("examine one module");
-        // Read the sub-module's sensor list.
-        struct sensors_module_t *module = (struct sensors_module_t*) hw_module;
-        int module_sensor_count = module->get_sensors_list(module, &subhal_sensors_list);
+        // The sub-module's sensor list, as read above.
+        const struct sensor_t *subhal_sensors_list = ctx.lists[module_index];
+        int module_sensor_count = ctx.counts[module_index];
         ALOGV("the module has %d sensors", module_sensor_count);
 
         // Copy the HAL's sensor list into global_sensors_list,
@@ -596,12 +1753,15 @@ static void lazy_init_sensors_list() {
             int global_handle = assign_global_handle(module_index, local_handle);
 
             mutable_sensor_list[mutable_sensor_index].handle = global_handle;
+            if (global_is_wake_up.size() <= (size_t)global_handle) {
+                global_is_wake_up.resize(global_handle + 1, false);
+            }
+            global_is_wake_up[global_handle] = (local_sensor->flags & SENSOR_FLAG_WAKE_UP) != 0;
             ALOGV("module_index %d, local_handle %d, global_handle %d",
                     module_index, local_handle, global_handle);
 
             mutable_sensor_index++;
         }
-        module_index++;
     }
     // Set the const static global_sensors_list to the mutable one allocated by this function.
     global_sensors_list = mutable_sensor_list;
@@ -641,11 +1801,60 @@ struct sensors_module_t HAL_MODULE_INFO_SYM = {
     get_sensors_list : module__get_sensors_list
 };
 
+/*
+ * Returns the event queue capacity for a sub module: the one configured in hals.conf if any,
+ * else enough to hold the largest hardware FIFO of its sensors in one go.
+ */
+static int get_queue_capacity(int module_index) {
+    int capacity = (*sub_hw_module_queue_capacities)[module_index];
+    if (capacity > 0) {
+        return capacity;
+    }
+
+    capacity = SENSOR_EVENT_QUEUE_CAPACITY;
+    sensors_module_t *module = (sensors_module_t*) (*sub_hw_modules)[module_index];
+    const struct sensor_t *list;
+    int count = module->get_sensors_list(module, &list);
+    for (int i = 0; i < count; i++) {
+        if ((int)list[i].fifoMaxEventCount > capacity) {
+            capacity = list[i].fifoMaxEventCount;
+        }
+    }
+    if (capacity > MAX_SENSOR_EVENT_QUEUE_CAPACITY) {
+        capacity = MAX_SENSOR_EVENT_QUEUE_CAPACITY;
+    }
+    return capacity;
+}
+
+/*
+ * Opens the device of sub module index into devices[index], results[index] being the result.
+ */
+struct OpenDevicesContext {
+    const char* name;
+    std::vector<struct hw_device_t*> devices;
+    std::vector<int> results;
+};
+
+static void open_device_task(size_t index, void* arg) {
+    OpenDevicesContext* ctx = (OpenDevicesContext*) arg;
+    hw_module_t* module = (*sub_hw_modules)[index];
+    if (module == NULL) {
+        return;
+    }
+    ctx->results[index] = module->methods->open(module, ctx->name, &ctx->devices[index]);
+}
+
 static int open_sensors(const struct hw_module_t* hw_module, const char* name,
         struct hw_device_t** hw_device_out) {
     ALOGV("open_sensors begin...");
 
+    // The handle tables and the sensor list are needed to deliver events and keep statistics.
+    // The sub-HALs are not loaded yet if the list came from the cache.
+    lazy_init_sensors_list();
     lazy_init_modules();
+    if (sensors_list_from_cache) {
+        check_sensors_list_cache();
+    }
 
     // Create proxy device, to return later.
     sensors_poll_context_t *dev = new sensors_poll_context_t();
@@ -660,14 +1869,19 @@ static int open_sensors(const struct hw_module_t* hw_module, const char* name,
     dev->proxy_device.batch = device__batch;
     dev->proxy_device.flush = device__flush;
 
-    dev->nextReadIndex = 0;
+    dev->init();
 
-    // Open() the subhal modules. Remember their devices in a vector parallel to sub_hw_modules.
-    for (std::vector<hw_module_t*>::iterator it = sub_hw_modules->begin();
-            it != sub_hw_modules->end(); it++) {
-        sensors_module_t *sensors_module = (sensors_module_t*) *it;
-        struct hw_device_t* sub_hw_device;
-        int sub_open_result = sensors_module->common.methods->open(*it, name, &sub_hw_device);
+    // Open() the subhal modules in parallel. Remember their devices in a vector parallel to
+    // sub_hw_modules.
+    OpenDevicesContext ctx;
+    ctx.name = name;
+    ctx.devices.resize(sub_hw_modules->size(), NULL);
+    ctx.results.resize(sub_hw_modules->size(), -ENODEV);
+    run_in_parallel(sub_hw_modules->size(), open_device_task, &ctx);
+
+    for (size_t i = 0; i < sub_hw_modules->size(); i++) {
+        struct hw_device_t* sub_hw_device = ctx.devices[i];
+        int sub_open_result = ctx.results[i];
         if (!sub_open_result) {
             if (!HAL_VERSION_IS_COMPLIANT(sub_hw_device->version)) {
                 ALOGE("SENSORS_DEVICE_API_VERSION_1_3 is required for all sensor HALs");
@@ -675,10 +1889,23 @@ static int open_sensors(const struct hw_module_t* hw_module, const char* name,
                         apiNumToStr(sub_hw_device->version));
                 ALOGE("Sensors belonging to this HAL will get ignored !");
             }
-            dev->addSubHwDevice(sub_hw_device);
+            dev->addSubHwDevice(sub_hw_device, i, get_queue_capacity(i), (*sub_hw_module_dsos)[i]);
         }
     }
 
+    // All pollable sub-HALs are known now.
+    if (dev->reactor_epoll_fd >= 0) {
+        dev->reactor_started =
+                pthread_create(&dev->reactor_thread, NULL, reactorTask, dev) == 0;
+        if (!dev->reactor_started) {
+            ALOGE("cannot start the sub-HAL reactor thread");
+        }
+    }
+
+    pthread_mutex_lock(&open_context_mutex);
+    open_context = dev;
+    pthread_mutex_unlock(&open_context_mutex);
+
     // Prepare the output param and return
     *hw_device_out = &dev->proxy_device.common;
     ALOGV("...open_sensors end");
@@ -15,3 +15,56 @@ LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. bionic
 LOCAL_LDLIBS += -lpthread
 
 include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	multihal_test.cpp
+
+LOCAL_MODULE := multihaltests
+
+LOCAL_CFLAGS := -DLOG_TAG=\"MultiHalTest\"
+
+LOCAL_STATIC_LIBRARIES := libcutils libutils liblog
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. bionic
+
+LOCAL_LDLIBS += -lpthread -ldl -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	multihal_benchmark.cpp
+
+LOCAL_MODULE := sensorsbenchmark
+
+LOCAL_CFLAGS := -O2 -DLOG_TAG=\"MultiHalBenchmark\"
+
+LOCAL_STATIC_LIBRARIES := libcutils libutils liblog
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. $(LOCAL_PATH)/../../../tests/include bionic
+
+LOCAL_LDLIBS += -lpthread -ldl -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	sensors_replay.cpp
+
+LOCAL_MODULE := sensorsreplay
+
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_CFLAGS := -O2 -DLOG_TAG=\"SensorsReplay\"
+
+LOCAL_SHARED_LIBRARIES := libcutils libutils liblog libdl libstlport
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. $(LOCAL_PATH)/../../sfdroid_sensors \
+	$(LOCAL_PATH)/../../../tests/include \
+	external/stlport/stlport bionic
+
+include $(BUILD_EXECUTABLE)
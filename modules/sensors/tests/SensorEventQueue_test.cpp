@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <hardware/sensors.h>
 #include <pthread.h>
+#include <sched.h>
 #include <cutils/atomic.h>
 
 #include "SensorEventQueue.cpp"
@@ -88,7 +90,106 @@ bool testWrappingWriteSizeCounts() {
     return true;
 }
 
+bool checkReadableBufferSize(SensorEventQueue* queue, int requested, int expected) {
+    sensors_event_t* buffer;
+    int actual = queue->getReadableRegion(requested, &buffer);
+    if (actual != expected) {
+        printf("Expected readable size was %d; actual was %d\n", expected, actual);
+        return false;
+    }
+    return true;
+}
 
+bool testBulkReadSizeCounts() {
+    printf("testBulkReadSizeCounts\n");
+    SensorEventQueue* queue = new SensorEventQueue(10);
+    if (!checkReadableBufferSize(queue, 10, 0)) return false;
+
+    queue->markAsWritten(8);
+    if (!checkReadableBufferSize(queue, 100, 8)) return false;
+    if (!checkReadableBufferSize(queue, 5, 5)) return false;
+
+    queue->dequeue(6);
+    if (!checkSize(queue, 2)) return false;
+
+    // Write past the end of the array; the readable region stops there.
+    queue->markAsWritten(2);
+    queue->markAsWritten(3);
+    if (!checkSize(queue, 7)) return false;
+    if (!checkReadableBufferSize(queue, 100, 4)) return false;
+    queue->dequeue(4);
+    if (!checkReadableBufferSize(queue, 100, 3)) return false;
+
+    // Dequeuing more than is readable empties the queue.
+    queue->dequeue(100);
+    if (!checkSize(queue, 0)) return false;
+    if (!checkInt("high-water mark", 8, queue->getHighWaterMark())) return false;
+
+    printf("passed\n");
+    return true;
+}
+
+// Test that the keys follow the records written, meta-data events keeping their nested handle.
+bool testKeys() {
+    printf("testKeys\n");
+    SensorEventQueue* queue = new SensorEventQueue(4, true);
+    if (queue->peekKey() != NULL) {
+        printf("Expected no key in an empty queue\n");
+        return false;
+    }
+    if (((uintptr_t) queue->getReadableKeys()) % 64 != 0) {
+        printf("Expected the keys to be cache line aligned\n");
+        return false;
+    }
+
+    sensors_event_t* buffer;
+    int written = 0;
+    for (int round = 0; round < 3; round++) {
+        int size = queue->getWritableRegion(3, &buffer);
+        for (int i = 0; i < size; i++) {
+            memset(&buffer[i], 0, sizeof(buffer[i]));
+            buffer[i].timestamp = written + i;
+            if ((written + i) % 2) {
+                buffer[i].type = SENSOR_TYPE_META_DATA;
+                buffer[i].meta_data.sensor = 100 + written + i;
+            } else {
+                buffer[i].type = SENSOR_TYPE_ACCELEROMETER;
+                buffer[i].sensor = 100 + written + i;
+            }
+        }
+        queue->markAsWritten(size);
+        written += size;
+
+        // Read all but one, so that the next round wraps around.
+        while (queue->getSize() > 1) {
+            sensors_event_t* region;
+            int length = queue->getReadableRegion(queue->getSize() - 1, &region);
+            const SensorEventKey* keys = queue->getReadableKeys();
+            if (keys != queue->peekKey()) {
+                printf("Expected the readable keys to start at the head key\n");
+                return false;
+            }
+            for (int i = 0; i < length; i++) {
+                int n = (int) region[i].timestamp;
+                if (!checkInt("key timestamp", n, (int) keys[i].timestamp)) return false;
+                if (!checkInt("key type", region[i].type, keys[i].type)) return false;
+                if (!checkInt("key sensor", 100 + n, keys[i].sensor)) return false;
+            }
+            queue->dequeue(length);
+        }
+    }
+    delete queue;
+
+    SensorEventQueue* plain = new SensorEventQueue(4);
+    plain->markAsWritten(1);
+    if (plain->peekKey() != NULL || plain->getReadableKeys() != NULL) {
+        printf("Expected no keys without keys\n");
+        return false;
+    }
+    delete plain;
+    printf("passed\n");
+    return true;
+}
 
 struct TaskContext {
   bool success;
@@ -186,11 +287,84 @@ bool testFullQueueIo() {
     return true;
 }
 
+int SPSC_QUEUE_CAPACITY = 7;
+int SPSC_EVENT_COUNT = 100000;
+
+void *spscWriterTask(void* ptr) {
+    TaskContext* ctx = (TaskContext*)ptr;
+    SensorEventQueue* queue = ctx->queue;
+    int totalWrites = 0;
+    sensors_event_t* buffer;
+
+    while (totalWrites < SPSC_EVENT_COUNT) {
+        queue->waitForSpace();
+        int writableSize = queue->getWritableRegion(SPSC_EVENT_COUNT - totalWrites, &buffer);
+        for (int i = 0; i < writableSize; i++) {
+            buffer[i].timestamp = totalWrites + i;
+        }
+        queue->markAsWritten(writableSize);
+        totalWrites += writableSize;
+    }
+    ctx->success = checkInt("totalWrites", SPSC_EVENT_COUNT, totalWrites);
+    return NULL;
+}
+
+void *spscReaderTask(void* ptr) {
+    TaskContext* ctx = (TaskContext*)ptr;
+    SensorEventQueue* queue = ctx->queue;
+    int totalReads = 0;
+    ctx->success = true;
+
+    while (totalReads < SPSC_EVENT_COUNT) {
+        sensors_event_t* event = queue->peek();
+        if (event == NULL) {
+            sched_yield();
+            continue;
+        }
+        if (event->timestamp != totalReads) {
+            ctx->success = checkInt("timestamp", totalReads, (int)event->timestamp);
+            return NULL;
+        }
+        queue->dequeue();
+        totalReads++;
+    }
+    return NULL;
+}
+
+// Test that one writer and one reader can use the queue without any lock.
+bool testLockFreeIo() {
+    printf("testLockFreeIo\n");
+    SensorEventQueue* queue = new SensorEventQueue(SPSC_QUEUE_CAPACITY);
+
+    TaskContext readerCtx;
+    readerCtx.success = true;
+    readerCtx.queue = queue;
+
+    TaskContext writerCtx;
+    writerCtx.success = true;
+    writerCtx.queue = queue;
+
+    pthread_t writer, reader;
+    pthread_create(&reader, NULL, spscReaderTask, &readerCtx);
+    pthread_create(&writer, NULL, spscWriterTask, &writerCtx);
+
+    pthread_join(writer, NULL);
+    pthread_join(reader, NULL);
+
+    if (!readerCtx.success || !writerCtx.success) return false;
+    if (!checkSize(queue, 0)) return false;
+    printf("passed\n");
+    return true;
+}
+
 
 int main(int argc, char **argv) {
     if (testSimpleWriteSizeCounts() &&
             testWrappingWriteSizeCounts() &&
-            testFullQueueIo()) {
+            testBulkReadSizeCounts() &&
+            testKeys() &&
+            testFullQueueIo() &&
+            testLockFreeIo()) {
         printf("ALL PASSED\n");
     } else {
         printf("SOMETHING FAILED\n");
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <hardware/sensors.h>
+#include <pthread.h>
+#include <cutils/atomic.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "SensorEventQueue.cpp"
+#include "multihal.cpp"
+#include "BenchmarkStats.h"
+
+using benchmark::MonotonicNs;
+
+// The host has no wake locks, and the fake sensors are not wake-up ones anyway.
+extern "C" int acquire_wake_lock(int lock, const char* id) { return 0; }
+extern "C" int release_wake_lock(const char* id) { return 0; }
+
+// Throughput and latency benchmark for the SensorEventQueue and the multihal poll().
+
+// Run it like this:
+//
+// make sensorsbenchmark -j32 && \
+// out/host/linux-x86/obj/EXECUTABLES/sensorsbenchmark_intermediates/sensorsbenchmark \
+//         [sub-HALs] [events/s per sub-HAL] [events per sub-HAL poll()] [seconds]
+
+static void sleepUntil(int64_t deadline) {
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000LL;
+    ts.tv_nsec = deadline % 1000000000LL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/*
+ * Raw queue: one writer filling the queue as fast as it can, one reader draining it in bulk.
+ */
+static const int RAW_QUEUE_CAPACITY = 128;
+static const int RAW_EVENT_COUNT = 10000000;
+
+static void* rawWriterTask(void* ptr) {
+    SensorEventQueue* queue = (SensorEventQueue*) ptr;
+    sensors_event_t* buffer;
+    int written = 0;
+    while (written < RAW_EVENT_COUNT) {
+        queue->waitForSpace();
+        int size = queue->getWritableRegion(RAW_EVENT_COUNT - written, &buffer);
+        for (int i = 0; i < size; i++) {
+            buffer[i].timestamp = MonotonicNs();
+        }
+        queue->markAsWritten(size);
+        written += size;
+    }
+    return NULL;
+}
+
+static void benchmarkRawQueue() {
+    printf("SensorEventQueue, 1 writer, 1 reader, capacity %d\n", RAW_QUEUE_CAPACITY);
+    SensorEventQueue* queue = new SensorEventQueue(RAW_QUEUE_CAPACITY);
+    std::vector<int64_t> latencies;
+    latencies.reserve(RAW_EVENT_COUNT / 100 + 1);
+
+    int64_t start = MonotonicNs();
+    pthread_t writer;
+    pthread_create(&writer, NULL, rawWriterTask, queue);
+    int read = 0;
+    while (read < RAW_EVENT_COUNT) {
+        sensors_event_t* region;
+        int size = queue->getReadableRegion(RAW_EVENT_COUNT - read, &region);
+        if (size == 0) {
+            sched_yield();
+            continue;
+        }
+        // Sample the latency, reading the clock for every event would dominate.
+        if (read % 100 < size) {
+            latencies.push_back(MonotonicNs() - region[0].timestamp);
+        }
+        queue->dequeue(size);
+        read += size;
+    }
+    int64_t elapsed = MonotonicNs() - start;
+    pthread_join(writer, NULL);
+
+    printf("  %.0f events/s, %d waits for space\n",
+            read * 1e9 / elapsed, queue->getFullWaits());
+    benchmark::PrintLatencies("delivery", "events delivered", &latencies);
+    delete queue;
+}
+
+/*
+ * multihal poll(): fake sub-HALs each producing events at a fixed rate, in bursts as a sub-HAL
+ * flushing its FIFO would, delivered through sensors_poll_context_t with a writer thread each.
+ */
+struct FakeSubHal {
+    sensors_poll_device_1 device; // must be first
+    int64_t period_ns;
+    int burst;
+    int64_t next_ns;
+    volatile int32_t closed;
+};
+
+static int fakePoll(struct sensors_poll_device_t* dev, sensors_event_t* data, int count) {
+    FakeSubHal* hal = (FakeSubHal*) dev;
+    if (hal->closed) {
+        return 0;
+    }
+    sleepUntil(hal->next_ns);
+    hal->next_ns += hal->period_ns * hal->burst;
+    int n = std::min(count, hal->burst);
+    int64_t now = MonotonicNs();
+    for (int i = 0; i < n; i++) {
+        memset(&data[i], 0, sizeof(data[i]));
+        data[i].version = sizeof(sensors_event_t);
+        data[i].sensor = 1;
+        data[i].type = SENSOR_TYPE_ACCELEROMETER;
+        // Stamped with the time the poll() returned, so the latency measured is the multihal's.
+        data[i].timestamp = now;
+    }
+    return n;
+}
+
+static int fakeClose(struct hw_device_t* dev) {
+    android_atomic_release_store(1, &((FakeSubHal*) dev)->closed);
+    return 0;
+}
+
+static void benchmarkPoll(int subHals, int rate, int burst, int seconds) {
+    printf("multihal poll(), %d sub-HALs at %d events/s each, %d events per sub-HAL poll()\n",
+            subHals, rate, burst);
+
+    // Set up the handle tables as lazy_init_sensors_list() would, local handle 1 everywhere.
+    static std::vector<hw_module_t*> modules(subHals, (hw_module_t*) NULL);
+    sub_hw_modules = &modules;
+    sensor_t* list = new sensor_t[subHals];
+    memset(list, 0, subHals * sizeof(sensor_t));
+    global_to_full.reserve(subHals + 1);
+    local_to_global.resize(subHals);
+    global_is_wake_up.resize(subHals + 1, false);
+    for (int i = 0; i < subHals; i++) {
+        list[i].name = "fake accelerometer";
+        list[i].type = SENSOR_TYPE_ACCELEROMETER;
+        list[i].handle = assign_global_handle(i, 1);
+    }
+    global_sensors_list = list;
+    global_sensors_count = subHals;
+
+    sensors_poll_context_t* ctx = new sensors_poll_context_t();
+    ctx->init();
+    int64_t start = MonotonicNs();
+    for (int i = 0; i < subHals; i++) {
+        FakeSubHal* hal = new FakeSubHal();
+        memset(hal, 0, sizeof(*hal));
+        hal->device.common.version = SENSORS_DEVICE_API_VERSION_1_3;
+        hal->device.common.close = fakeClose;
+        hal->device.poll = fakePoll;
+        hal->period_ns = 1000000000LL / rate;
+        hal->burst = burst;
+        // Spread the sub-HALs over one period.
+        hal->next_ns = start + hal->period_ns * i / subHals;
+        ctx->addSubHwDevice(&hal->device.common, i, std::max(SENSOR_EVENT_QUEUE_CAPACITY, burst),
+                NULL);
+    }
+
+    std::vector<int64_t> latencies;
+    latencies.reserve((size_t) subHals * rate * seconds + 1);
+    sensors_event_t buffer[128];
+    int64_t end = start + seconds * 1000000000LL;
+    long long read = 0;
+    long long polls = 0;
+    while (MonotonicNs() < end) {
+        int n = ctx->poll(buffer, 128);
+        int64_t now = MonotonicNs();
+        for (int i = 0; i < n; i++) {
+            latencies.push_back(now - buffer[i].timestamp);
+        }
+        read += n;
+        polls++;
+    }
+    int64_t elapsed = MonotonicNs() - start;
+
+    int fullWaits = 0;
+    for (size_t i = 0; i < ctx->queues.size(); i++) {
+        fullWaits += ctx->queues[i]->getFullWaits();
+    }
+    printf("  %.0f events/s, %.1f events per poll(), %d waits for space\n",
+            read * 1e9 / elapsed, (double) read / polls, fullWaits);
+    benchmark::PrintLatencies("delivery", "events delivered", &latencies);
+
+    // The fake poll() returns within one burst once closed.
+    ctx->close();
+}
+
+int main(int argc, char **argv) {
+    int subHals = argc > 1 ? atoi(argv[1]) : 4;
+    int rate = argc > 2 ? atoi(argv[2]) : 1000;
+    int burst = argc > 3 ? atoi(argv[3]) : 1;
+    int seconds = argc > 4 ? atoi(argv[4]) : 2;
+    if (subHals <= 0 || rate <= 0 || burst <= 0 || seconds <= 0) {
+        printf("usage: %s [sub-HALs] [events/s per sub-HAL] [events per sub-HAL poll()] "
+                "[seconds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    benchmarkRawQueue();
+    benchmarkPoll(subHals, rate, burst, seconds);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <hardware/sensors.h>
+#include <pthread.h>
+#include <cutils/atomic.h>
+
+#include <vector>
+
+#include "SensorEventQueue.cpp"
+#include "multihal.cpp"
+
+// The host has no wake locks, and the fake sensors are not wake-up ones anyway.
+extern "C" int acquire_wake_lock(int lock, const char* id) { return 0; }
+extern "C" int release_wake_lock(const char* id) { return 0; }
+
+// Unit tests for the routing of the multihal between the global handles and the sub-HALs.
+
+// Run it like this:
+//
+// make multihaltests -j32
+// out/host/linux-x86/obj/EXECUTABLES/multihaltests_intermediates/multihaltests
+
+/*
+ * A sub-HAL with a single sensor of local handle 1, which reports one event tagged with the
+ * module index once activated.
+ */
+struct FakeSubHal {
+    sensors_poll_device_1 device; // must be first
+    int moduleIndex;
+    volatile int32_t pending;
+    volatile int32_t closed;
+};
+
+struct FakeModule {
+    sensors_module_t module; // must be first
+    int moduleIndex;
+    int openResult;
+};
+
+static const sensor_t fakeSensor = {
+    .name = "fake accelerometer",
+    .vendor = "AOSP",
+    .version = 1,
+    .handle = 1,
+    .type = SENSOR_TYPE_ACCELEROMETER,
+};
+
+static int fakeGetSensorsList(struct sensors_module_t* module, struct sensor_t const** list) {
+    *list = &fakeSensor;
+    return 1;
+}
+
+static int fakeActivate(struct sensors_poll_device_t* dev, int handle, int enabled) {
+    FakeSubHal* hal = (FakeSubHal*) dev;
+    if (handle != 1) {
+        return -EINVAL;
+    }
+    android_atomic_release_store(enabled, &hal->pending);
+    return 0;
+}
+
+static int fakeSetDelay(struct sensors_poll_device_t* dev, int handle, int64_t ns) {
+    return handle == 1 ? 0 : -EINVAL;
+}
+
+static int fakePoll(struct sensors_poll_device_t* dev, sensors_event_t* data, int count) {
+    FakeSubHal* hal = (FakeSubHal*) dev;
+    if (hal->closed || android_atomic_release_cas(1, 0, &hal->pending) != 0) {
+        usleep(1000);
+        return 0;
+    }
+    memset(&data[0], 0, sizeof(data[0]));
+    data[0].version = sizeof(sensors_event_t);
+    data[0].sensor = 1;
+    data[0].type = SENSOR_TYPE_ACCELEROMETER;
+    data[0].data[0] = hal->moduleIndex;
+    return 1;
+}
+
+static int fakeClose(struct hw_device_t* dev) {
+    android_atomic_release_store(1, &((FakeSubHal*) dev)->closed);
+    return 0;
+}
+
+static int fakeOpen(const struct hw_module_t* module, const char* name,
+        struct hw_device_t** device) {
+    const FakeModule* fake = (const FakeModule*) module;
+    if (fake->openResult != 0) {
+        return fake->openResult;
+    }
+    FakeSubHal* hal = new FakeSubHal();
+    memset(hal, 0, sizeof(*hal));
+    hal->device.common.tag = HARDWARE_DEVICE_TAG;
+    hal->device.common.version = SENSORS_DEVICE_API_VERSION_1_3;
+    hal->device.common.module = const_cast<hw_module_t*>(module);
+    hal->device.common.close = fakeClose;
+    hal->device.activate = fakeActivate;
+    hal->device.setDelay = fakeSetDelay;
+    hal->device.poll = fakePoll;
+    hal->moduleIndex = fake->moduleIndex;
+    *device = &hal->device.common;
+    return 0;
+}
+
+static hw_module_methods_t fakeMethods = { fakeOpen };
+
+// Test that the sensors of the sub-HALs after one that failed to load and one that failed to open
+// still get their calls and events.
+bool testRoutingAroundFailedModules() {
+    printf("testRoutingAroundFailedModules\n");
+    static const int MODULES = 4;
+    // Module 1 failed to dlopen(), module 2 fails to open its device.
+    static FakeModule fakes[MODULES];
+    static std::vector<hw_module_t*> modules(MODULES, (hw_module_t*) NULL);
+    for (int i = 0; i < MODULES; i++) {
+        fakes[i].module.common.tag = HARDWARE_MODULE_TAG;
+        fakes[i].module.common.methods = &fakeMethods;
+        fakes[i].module.get_sensors_list = fakeGetSensorsList;
+        fakes[i].moduleIndex = i;
+        fakes[i].openResult = i == 2 ? -ENODEV : 0;
+        if (i != 1) {
+            modules[i] = &fakes[i].module.common;
+        }
+    }
+    sub_hw_modules = &modules;
+    sub_hw_module_queue_capacities = new std::vector<int>(MODULES, 0);
+    sub_hw_module_dsos = new std::vector<void*>(MODULES, (void*) NULL);
+
+    // Set up the handle tables as lazy_init_sensors_list() would, for the modules that loaded.
+    sensor_t* list = new sensor_t[MODULES - 1];
+    memset(list, 0, (MODULES - 1) * sizeof(sensor_t));
+    local_to_global.resize(MODULES);
+    global_is_wake_up.resize(MODULES, false);
+    int handles[MODULES] = { -1, -1, -1, -1 };
+    int count = 0;
+    for (int i = 0; i < MODULES; i++) {
+        if (modules[i] == NULL) {
+            continue;
+        }
+        list[count] = fakeSensor;
+        list[count].handle = handles[i] = assign_global_handle(i, 1);
+        count++;
+    }
+    global_sensors_list = list;
+    global_sensors_count = count;
+
+    hw_device_t* device;
+    if (open_sensors(NULL, SENSORS_HARDWARE_POLL, &device) != 0) {
+        printf("open_sensors failed\n");
+        return false;
+    }
+    sensors_poll_device_1* multihal = (sensors_poll_device_1*) device;
+
+    bool success = true;
+    if (multihal->activate((sensors_poll_device_t*) multihal, handles[2], 1) == 0) {
+        printf("activate of the sensor of the module that failed to open succeeded\n");
+        success = false;
+    }
+    int expected[] = { 0, 3 };
+    for (size_t n = 0; n < sizeof(expected) / sizeof(expected[0]); n++) {
+        int i = expected[n];
+        if (multihal->setDelay((sensors_poll_device_t*) multihal, handles[i], 1000000) != 0 ||
+                multihal->activate((sensors_poll_device_t*) multihal, handles[i], 1) != 0) {
+            printf("sensor of module %d not routed to its sub-HAL\n", i);
+            success = false;
+            continue;
+        }
+        sensors_event_t event;
+        if (multihal->poll((sensors_poll_device_t*) multihal, &event, 1) != 1) {
+            printf("no event of module %d\n", i);
+            success = false;
+            continue;
+        }
+        if (event.sensor != handles[i] || event.data[0] != i) {
+            printf("event of module %.0f came with handle %d, expected %d of module %d\n",
+                    event.data[0], event.sensor, handles[i], i);
+            success = false;
+        }
+    }
+
+    device->close(device);
+    if (!success) return false;
+    printf("passed\n");
+    return true;
+}
+
+
+int main(int argc, char **argv) {
+    if (testRoutingAroundFailedModules()) {
+        printf("ALL PASSED\n");
+    } else {
+        printf("SOMETHING FAILED\n");
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,682 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <math.h>
+#include <hardware/sensors.h>
+#include <pthread.h>
+#include <cutils/atomic.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <stddef.h>
+#include <vector>
+
+#include "SensorEventQueue.cpp"
+#include "multihal.cpp"
+#include "sfdroid_sensors_protocol.h"
+#include "BenchmarkStats.h"
+
+// Replays a sensor trace through the sensors HAL paths and reports the delivered rate, the
+// latency and the CPU usage, so that they can be compared run to run:
+//
+// - multihal: a fake sub-HAL returns the events of the trace from its poll(), read through the
+//   multihal poll() as SensorService would.
+// - sfdroid: a fake sfdroid daemon listens on the socket sfdroid_sensors connects to and streams
+//   the events of the trace with the binary protocol, read through the poll() of the
+//   sfdroid_sensors module at the given path.
+//
+// A trace is a text file with one event per line, "<timestamp ns> <SENSOR_TYPE_*> <values>...",
+// lines starting with # being ignored. It is replayed in a loop, its timestamps giving the pace
+// divided by the speed factor. Without a trace, "-", a synthetic one of an accelerometer and a
+// gyroscope at 200 Hz, a magnetometer at 50 Hz and a light sensor at 5 Hz is used.
+// Every event is stamped with the time it is handed to the HAL, so the latency is the HAL's.
+
+// Run it like this:
+//
+// make sensorsreplay -j32 && adb sync && adb shell /system/bin/sensorsreplay \
+//         <multihal|sfdroid> [trace|-] [speed] [seconds] [sfdroid module]
+
+static const char* DEFAULT_SFDROID_MODULE = "/system/lib/hw/sfdroid_sensors.default.so";
+static const char* SFDROID_SOCKET = "/tmp/sfdroid/sensors_handle";
+
+static int64_t boottimeNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t threadCpuNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t processCpuNs() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000LL +
+            (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000LL;
+}
+
+static void sleepUntil(int64_t deadline) {
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000LL;
+    ts.tv_nsec = deadline % 1000000000LL;
+    clock_nanosleep(CLOCK_BOOTTIME, TIMER_ABSTIME, &ts, NULL);
+}
+
+/*
+ * Trace
+ */
+struct TraceEvent {
+    int64_t offsetNs; // from the first event
+    int sensor;       // index in Trace::types
+    int numValues;
+    float values[16];
+};
+
+struct Trace {
+    std::vector<TraceEvent> events;
+    std::vector<int> types;
+    // one pass, the loop restarts after it
+    int64_t durationNs;
+};
+
+static int sensorIndex(Trace* trace, int type) {
+    for (size_t i = 0; i < trace->types.size(); i++) {
+        if (trace->types[i] == type) {
+            return i;
+        }
+    }
+    trace->types.push_back(type);
+    return trace->types.size() - 1;
+}
+
+static bool earlier(const TraceEvent& a, const TraceEvent& b) {
+    return a.offsetNs < b.offsetNs;
+}
+
+static void finishTrace(Trace* trace) {
+    std::stable_sort(trace->events.begin(), trace->events.end(), earlier);
+    int64_t first = trace->events[0].offsetNs;
+    for (size_t i = 0; i < trace->events.size(); i++) {
+        trace->events[i].offsetNs -= first;
+    }
+    // Leave the mean gap between the last and the first event of the next pass.
+    int64_t last = trace->events.back().offsetNs;
+    trace->durationNs = last + std::max(last / (int64_t) trace->events.size(), (int64_t) 1);
+}
+
+static bool loadTrace(const char* path, Trace* trace) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        printf("cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '#') {
+            continue;
+        }
+        char* p = line;
+        char* end;
+        TraceEvent event;
+        memset(&event, 0, sizeof(event));
+        event.offsetNs = strtoll(p, &end, 10);
+        if (end == p) {
+            continue;
+        }
+        p = end;
+        int type = strtol(p, &end, 10);
+        if (end == p) {
+            continue;
+        }
+        p = end;
+        while (event.numValues < 16) {
+            float value = strtof(p, &end);
+            if (end == p) {
+                break;
+            }
+            event.values[event.numValues++] = value;
+            p = end;
+        }
+        event.sensor = sensorIndex(trace, type);
+        trace->events.push_back(event);
+    }
+    fclose(file);
+    if (trace->events.empty()) {
+        printf("no events in %s\n", path);
+        return false;
+    }
+    finishTrace(trace);
+    return true;
+}
+
+static void syntheticTrace(Trace* trace) {
+    static const struct {
+        int type;
+        int rate;
+        int numValues;
+    } SENSORS[] = {
+        { SENSOR_TYPE_ACCELEROMETER, 200, 3 },
+        { SENSOR_TYPE_GYROSCOPE, 200, 3 },
+        { SENSOR_TYPE_MAGNETIC_FIELD, 50, 3 },
+        { SENSOR_TYPE_LIGHT, 5, 1 },
+    };
+    for (size_t s = 0; s < sizeof(SENSORS) / sizeof(SENSORS[0]); s++) {
+        int sensor = sensorIndex(trace, SENSORS[s].type);
+        for (int i = 0; i < SENSORS[s].rate; i++) {
+            TraceEvent event;
+            memset(&event, 0, sizeof(event));
+            event.offsetNs = 1000000000LL * i / SENSORS[s].rate;
+            event.sensor = sensor;
+            event.numValues = SENSORS[s].numValues;
+            for (int v = 0; v < event.numValues; v++) {
+                event.values[v] = sinf(2 * M_PI * i / SENSORS[s].rate + v);
+            }
+            trace->events.push_back(event);
+        }
+    }
+    finishTrace(trace);
+    trace->durationNs = 1000000000LL;
+}
+
+/*
+ * Replay clock: event i of the endless loop over the trace is due at dueNs(i).
+ */
+struct Replay {
+    const Trace* trace;
+    double speed;
+    int64_t startNs;
+
+    const TraceEvent& event(uint64_t i) const {
+        return trace->events[i % trace->events.size()];
+    }
+
+    int64_t dueNs(uint64_t i) const {
+        uint64_t pass = i / trace->events.size();
+        return startNs + (int64_t) ((pass * trace->durationNs + event(i).offsetNs) / speed);
+    }
+
+    double eventsPerSecond() const {
+        return trace->events.size() * 1e9 * speed / trace->durationNs;
+    }
+};
+
+struct Result {
+    long long events;
+    long long polls;
+    int64_t elapsedNs;
+    int64_t pollCpuNs;
+    int64_t processCpuNs;
+    std::vector<int64_t> latencies;
+};
+
+static void printResult(const Replay& replay, Result* result) {
+    printf("  %.0f events/s delivered of %.0f replayed, %.1f events per poll()\n",
+            result->events * 1e9 / result->elapsedNs, replay.eventsPerSecond(),
+            result->polls ? (double) result->events / result->polls : 0.0);
+    printf("  poll() thread %.1f%% CPU, whole process %.1f%% CPU\n",
+            result->pollCpuNs * 100.0 / result->elapsedNs,
+            result->processCpuNs * 100.0 / result->elapsedNs);
+    benchmark::PrintLatencies("delivery", "events delivered", &result->latencies);
+}
+
+// Reads events from poll() until the end of the run and accounts for them.
+template <typename PollFunc>
+static void readEvents(PollFunc pollFunc, int seconds, Result* result) {
+    sensors_event_t buffer[128];
+    int64_t start = boottimeNs();
+    int64_t end = start + seconds * 1000000000LL;
+    int64_t cpuStart = threadCpuNs();
+    int64_t processStart = processCpuNs();
+    result->events = 0;
+    result->polls = 0;
+    while (boottimeNs() < end) {
+        int n = pollFunc(buffer, 128);
+        int64_t now = boottimeNs();
+        for (int i = 0; i < n; i++) {
+            if (buffer[i].type == SENSOR_TYPE_META_DATA) {
+                continue;
+            }
+            result->latencies.push_back(now - buffer[i].timestamp);
+            result->events++;
+        }
+        result->polls++;
+    }
+    result->elapsedNs = boottimeNs() - start;
+    result->pollCpuNs = threadCpuNs() - cpuStart;
+    result->processCpuNs = processCpuNs() - processStart;
+}
+
+/*
+ * multihal: one fake sub-HAL with a sensor per type of the trace, local handle index + 1.
+ */
+struct FakeSubHal {
+    sensors_poll_device_1 device; // must be first
+    Replay* replay;
+    uint64_t next;
+    volatile int32_t active; // bit per sensor index
+    volatile int32_t closed;
+};
+
+static int fakeActivate(struct sensors_poll_device_t* dev, int handle, int enabled) {
+    FakeSubHal* hal = (FakeSubHal*) dev;
+    int32_t bit = 1 << (handle - 1);
+    int32_t active;
+    do {
+        active = hal->active;
+    } while (android_atomic_release_cas(active, enabled ? active | bit : active & ~bit,
+            &hal->active) != 0);
+    return 0;
+}
+
+static int fakeSetDelay(struct sensors_poll_device_t*, int, int64_t) {
+    // The trace sets the pace.
+    return 0;
+}
+
+static int fakePoll(struct sensors_poll_device_t* dev, sensors_event_t* data, int count) {
+    FakeSubHal* hal = (FakeSubHal*) dev;
+    if (hal->closed) {
+        return 0;
+    }
+    sleepUntil(hal->replay->dueNs(hal->next));
+    int64_t now = boottimeNs();
+    int n = 0;
+    // Everything due, as a sub-HAL reading a hardware FIFO would.
+    while (n < count && hal->replay->dueNs(hal->next) <= now) {
+        const TraceEvent& event = hal->replay->event(hal->next++);
+        if (!(android_atomic_acquire_load(&hal->active) & (1 << event.sensor))) {
+            continue;
+        }
+        memset(&data[n], 0, sizeof(data[n]));
+        data[n].version = sizeof(sensors_event_t);
+        data[n].sensor = event.sensor + 1;
+        data[n].type = hal->replay->trace->types[event.sensor];
+        data[n].timestamp = now;
+        memcpy(data[n].data, event.values, event.numValues * sizeof(float));
+        n++;
+    }
+    return n;
+}
+
+static int fakeClose(struct hw_device_t* dev) {
+    android_atomic_release_store(1, &((FakeSubHal*) dev)->closed);
+    return 0;
+}
+
+struct MultihalPoll {
+    sensors_poll_context_t* ctx;
+    int operator()(sensors_event_t* data, int count) {
+        return ctx->poll(data, count);
+    }
+};
+
+static void replayMultihal(const Trace& trace, double speed, int seconds) {
+    printf("multihal, %zu sensors, %.1fx speed\n", trace.types.size(), speed);
+
+    // Set up the handle tables as lazy_init_sensors_list() would.
+    int numSensors = trace.types.size();
+    static std::vector<hw_module_t*> modules(1, (hw_module_t*) NULL);
+    sub_hw_modules = &modules;
+    sensor_t* list = new sensor_t[numSensors];
+    memset(list, 0, numSensors * sizeof(sensor_t));
+    global_to_full.reserve(numSensors + 1);
+    local_to_global.resize(1);
+    global_is_wake_up.resize(numSensors + 1, false);
+    for (int i = 0; i < numSensors; i++) {
+        list[i].name = "replayed sensor";
+        list[i].type = trace.types[i];
+        list[i].handle = assign_global_handle(0, i + 1);
+    }
+    global_sensors_list = list;
+    global_sensors_count = numSensors;
+
+    Replay replay = { &trace, speed, boottimeNs() };
+    FakeSubHal* hal = new FakeSubHal();
+    memset(hal, 0, sizeof(*hal));
+    hal->device.common.version = SENSORS_DEVICE_API_VERSION_1_3;
+    hal->device.common.close = fakeClose;
+    hal->device.activate = fakeActivate;
+    hal->device.setDelay = fakeSetDelay;
+    hal->device.poll = fakePoll;
+    hal->replay = &replay;
+
+    sensors_poll_context_t* ctx = new sensors_poll_context_t();
+    ctx->init();
+    ctx->addSubHwDevice(&hal->device.common, 0, MAX_SENSOR_EVENT_QUEUE_CAPACITY, NULL);
+    for (int i = 0; i < numSensors; i++) {
+        ctx->activate(list[i].handle, 1);
+    }
+
+    Result result;
+    MultihalPoll poll = { ctx };
+    readEvents(poll, seconds, &result);
+    printResult(replay, &result);
+
+    for (int i = 0; i < numSensors; i++) {
+        ctx->activate(list[i].handle, 0);
+    }
+    // The fake poll() returns within one event once closed.
+    ctx->close();
+}
+
+/*
+ * sfdroid: a fake daemon speaking the binary protocol of sfdroid_sensors_protocol.h, streaming
+ * the trace to the connection that asked for it.
+ */
+struct FakeDaemon {
+    const Trace* trace;
+    Replay* replay;
+    int listenFd;
+    // Guards everything below and writes to the connections.
+    pthread_mutex_t lock;
+    int streamFd;
+    uint32_t active; // bit per sensor index
+    volatile int32_t stopping;
+};
+
+struct Connection {
+    FakeDaemon* daemon;
+    int fd;
+};
+
+static bool sendAll(int fd, const void* buffer, size_t size) {
+    return send(fd, buffer, size, MSG_NOSIGNAL) == (ssize_t) size;
+}
+
+static bool sendMessage(FakeDaemon* daemon, int fd, int type, int sensor, const void* payload,
+        size_t size) {
+    char buffer[SFDROID_MSG_MAX_SIZE];
+    sfdroid_sensor_msg_header_t header;
+    header.size = sizeof(header) + size;
+    header.type = type;
+    header.sensor = sensor;
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), payload, size);
+    pthread_mutex_lock(&daemon->lock);
+    bool sent = sendAll(fd, buffer, header.size);
+    pthread_mutex_unlock(&daemon->lock);
+    return sent;
+}
+
+static bool sendReply(FakeDaemon* daemon, int fd, int64_t flags) {
+    return sendMessage(daemon, fd, SFDROID_MSG_REPLY, 0, &flags, sizeof(flags));
+}
+
+static bool sendSensorList(FakeDaemon* daemon, int fd) {
+    for (size_t i = 0; i < daemon->trace->types.size(); i++) {
+        sfdroid_sensor_info_t info;
+        memset(&info, 0, sizeof(info));
+        info.type = daemon->trace->types[i];
+        info.min_delay = 1000;
+        info.max_delay = 1000000;
+        snprintf(info.name, sizeof(info.name), "replayed sensor");
+        if (!sendMessage(daemon, fd, SFDROID_MSG_SENSOR, info.type, &info, sizeof(info))) {
+            return false;
+        }
+    }
+    return sendReply(daemon, fd, SFDROID_REPLY_OK);
+}
+
+// The ASCII handshake: only the switch to binary messages is accepted.
+static bool acceptBinary(int fd) {
+    unsigned char length;
+    char command[256];
+    if (recv(fd, &length, 1, MSG_WAITALL) != 1 ||
+            recv(fd, command, length, MSG_WAITALL) != length) {
+        return false;
+    }
+    command[length ? length - 1 : 0] = 0;
+    char binary[32];
+    snprintf(binary, sizeof(binary), "binary:%d", SFDROID_BINARY_VERSION);
+    if (strcmp(command, binary) != 0) {
+        printf("  unexpected ASCII message %s\n", command);
+        return false;
+    }
+    static const char OK[] = { 3, 'o', 'k', 0 };
+    return sendAll(fd, OK, sizeof(OK));
+}
+
+static void* connectionTask(void* ptr) {
+    Connection* connection = (Connection*) ptr;
+    FakeDaemon* daemon = connection->daemon;
+    int fd = connection->fd;
+    bool ok = acceptBinary(fd);
+    while (ok) {
+        sfdroid_sensor_msg_header_t header;
+        int64_t args[2] = { 0, 0 };
+        if (recv(fd, &header, sizeof(header), MSG_WAITALL) != sizeof(header) ||
+                header.size < sizeof(header) || header.size > sizeof(header) + sizeof(args)) {
+            break;
+        }
+        size_t size = header.size - sizeof(header);
+        if (size > 0 && recv(fd, args, size, MSG_WAITALL) != (ssize_t) size) {
+            break;
+        }
+        int sensor = -1;
+        for (size_t i = 0; i < daemon->trace->types.size(); i++) {
+            if (daemon->trace->types[i] == header.sensor) {
+                sensor = i;
+            }
+        }
+
+        switch (header.type) {
+        case SFDROID_MSG_LIST:
+            ok = sendSensorList(daemon, fd);
+            break;
+        case SFDROID_MSG_PING: {
+            int64_t pong[2] = { args[0], boottimeNs() };
+            ok = sendMessage(daemon, fd, SFDROID_MSG_PONG, 0, pong, sizeof(pong));
+            break;
+        }
+        case SFDROID_MSG_RING:
+            // Declined, sfdroid_sensors reconnects and asks for the stream instead.
+            sendReply(daemon, fd, 0);
+            ok = false;
+            break;
+        case SFDROID_MSG_STREAM:
+            pthread_mutex_lock(&daemon->lock);
+            daemon->streamFd = fd;
+            pthread_mutex_unlock(&daemon->lock);
+            ok = sendReply(daemon, fd, SFDROID_REPLY_OK);
+            break;
+        case SFDROID_MSG_ACTIVATE:
+            if (sensor >= 0) {
+                pthread_mutex_lock(&daemon->lock);
+                if (args[0]) {
+                    daemon->active |= 1 << sensor;
+                } else {
+                    daemon->active &= ~(1 << sensor);
+                }
+                pthread_mutex_unlock(&daemon->lock);
+            }
+            break;
+        default:
+            // setDelay: the trace sets the pace. No batch or flush, the stream setup didn't
+            // offer them.
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&daemon->lock);
+    if (daemon->streamFd == fd) {
+        daemon->streamFd = -1;
+    }
+    pthread_mutex_unlock(&daemon->lock);
+    close(fd);
+    delete connection;
+    return NULL;
+}
+
+static void* acceptTask(void* ptr) {
+    FakeDaemon* daemon = (FakeDaemon*) ptr;
+    while (!android_atomic_acquire_load(&daemon->stopping)) {
+        int fd = accept(daemon->listenFd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        Connection* connection = new Connection();
+        connection->daemon = daemon;
+        connection->fd = fd;
+        pthread_t thread;
+        pthread_create(&thread, NULL, connectionTask, connection);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+// Streams the events as they come due, those due together in one write.
+static void* streamTask(void* ptr) {
+    FakeDaemon* daemon = (FakeDaemon*) ptr;
+    const Replay* replay = daemon->replay;
+    std::vector<char> buffer;
+    uint64_t next = 0;
+    while (!android_atomic_acquire_load(&daemon->stopping)) {
+        sleepUntil(replay->dueNs(next));
+        int64_t now = boottimeNs();
+        pthread_mutex_lock(&daemon->lock);
+        buffer.clear();
+        while (replay->dueNs(next) <= now) {
+            const TraceEvent& event = replay->event(next++);
+            if (daemon->streamFd < 0 || !(daemon->active & (1 << event.sensor))) {
+                continue;
+            }
+            sfdroid_sensor_msg_header_t header;
+            sfdroid_sensor_event_t payload;
+            size_t size = offsetof(sfdroid_sensor_event_t, data) +
+                    event.numValues * sizeof(float);
+            memset(&payload, 0, sizeof(payload));
+            payload.type = replay->trace->types[event.sensor];
+            payload.timestamp = now;
+            memcpy(payload.data, event.values, event.numValues * sizeof(float));
+            header.size = sizeof(header) + size;
+            header.type = SFDROID_MSG_EVENT;
+            header.sensor = payload.type;
+            buffer.insert(buffer.end(), (char*) &header, (char*) &header + sizeof(header));
+            buffer.insert(buffer.end(), (char*) &payload, (char*) &payload + size);
+        }
+        if (!buffer.empty()) {
+            sendAll(daemon->streamFd, &buffer[0], buffer.size());
+        }
+        pthread_mutex_unlock(&daemon->lock);
+    }
+    return NULL;
+}
+
+static bool startDaemon(FakeDaemon* daemon) {
+    mkdir("/tmp", 0777);
+    mkdir("/tmp/sfdroid", 0777);
+    unlink(SFDROID_SOCKET);
+    daemon->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, SFDROID_SOCKET, sizeof(addr.sun_path) - 1);
+    if (daemon->listenFd < 0 || bind(daemon->listenFd, (struct sockaddr*) &addr,
+            sizeof(addr)) < 0 || listen(daemon->listenFd, 4) < 0) {
+        printf("  cannot listen on %s: %s\n", SFDROID_SOCKET, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+struct SfdroidPoll {
+    sensors_poll_device_1* device;
+    int operator()(sensors_event_t* data, int count) {
+        return device->poll(&device->v0, data, count);
+    }
+};
+
+static void replaySfdroid(const Trace& trace, double speed, int seconds, const char* path) {
+    printf("sfdroid, %zu sensors, %.1fx speed, %s\n", trace.types.size(), speed, path);
+
+    Replay replay = { &trace, speed, 0 };
+    FakeDaemon* daemon = new FakeDaemon();
+    memset(daemon, 0, sizeof(*daemon));
+    daemon->trace = &trace;
+    daemon->replay = &replay;
+    daemon->streamFd = -1;
+    pthread_mutex_init(&daemon->lock, NULL);
+    if (!startDaemon(daemon)) {
+        return;
+    }
+    pthread_t acceptor;
+    pthread_create(&acceptor, NULL, acceptTask, daemon);
+
+    void* dso = dlopen(path, RTLD_NOW);
+    sensors_module_t* module = dso ?
+            (sensors_module_t*) dlsym(dso, HAL_MODULE_INFO_SYM_AS_STR) : NULL;
+    sensors_poll_device_1* device = NULL;
+    if (module == NULL || module->common.methods->open(&module->common, SENSORS_HARDWARE_POLL,
+            (hw_device_t**) &device) != 0) {
+        printf("  cannot open %s: %s\n", path, dso ? "open() failed" : dlerror());
+        return;
+    }
+    sensor_t const* list;
+    int count = module->get_sensors_list(module, &list);
+    printf("  %d sensors listed\n", count);
+
+    replay.startNs = boottimeNs();
+    pthread_t streamer;
+    pthread_create(&streamer, NULL, streamTask, daemon);
+    for (int i = 0; i < count; i++) {
+        device->activate(&device->v0, list[i].handle, 1);
+    }
+
+    Result result;
+    SfdroidPoll poll = { device };
+    readEvents(poll, seconds, &result);
+    printResult(replay, &result);
+
+    for (int i = 0; i < count; i++) {
+        device->activate(&device->v0, list[i].handle, 0);
+    }
+    device->common.close(&device->common);
+    android_atomic_release_store(1, &daemon->stopping);
+    pthread_join(streamer, NULL);
+    shutdown(daemon->listenFd, SHUT_RDWR);
+    close(daemon->listenFd);
+    unlink(SFDROID_SOCKET);
+}
+
+int main(int argc, char **argv) {
+    const char* mode = argc > 1 ? argv[1] : "";
+    const char* path = argc > 2 ? argv[2] : "-";
+    double speed = argc > 3 ? atof(argv[3]) : 1.0;
+    int seconds = argc > 4 ? atoi(argv[4]) : 5;
+    const char* module = argc > 5 ? argv[5] : DEFAULT_SFDROID_MODULE;
+    bool multihal = !strcmp(mode, "multihal");
+    if ((!multihal && strcmp(mode, "sfdroid")) || speed <= 0 || seconds <= 0) {
+        printf("usage: %s <multihal|sfdroid> [trace|-] [speed] [seconds] [sfdroid module]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Trace trace;
+    if (!strcmp(path, "-")) {
+        syntheticTrace(&trace);
+    } else if (!loadTrace(path, &trace)) {
+        return EXIT_FAILURE;
+    }
+    // The fakes keep a bit per sensor.
+    if (trace.types.size() > 32) {
+        printf("at most 32 sensor types in a trace\n");
+        return EXIT_FAILURE;
+    }
+
+    if (multihal) {
+        replayMultihal(trace, speed, seconds);
+    } else {
+        replaySfdroid(trace, speed, seconds, module);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1109 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_sfdroid"
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+
+#include <hardware/hardware.h>
+#include <system/audio.h>
+#include <hardware/audio.h>
+
+#include "sfdroid_audio_protocol.h"
+#include "sfdroid_ipc.h"
+
+/*
+ * Audio HAL of Android running on top of Sailfish: every stream exchanges
+ * PCM with the Sailfish sound server through a ring in shared memory, see
+ * sfdroid_audio_protocol.h. While the server is not running, writes are
+ * paced in real time and dropped, reads return silence, and the stream
+ * reconnects with backoff.
+ */
+
+#define DEFAULT_SAMPLE_RATE     48000
+/* 5.3 ms at 48 kHz */
+#define PERIOD_FRAMES           256
+/* four periods, so that a late wakeup of either side doesn't glitch */
+#define RING_FRAMES             1024
+
+/* between reconnection attempts while the server is not up */
+#define RECONNECT_MIN_MS        100
+#define RECONNECT_MAX_MS        2000
+/* the server answers an open well within this */
+#define OPEN_TIMEOUT_MS         1000
+
+/* what the streams of a device moved, for its performance counters */
+struct sfdroid_audio_stats {
+    uint32_t outputs;
+    uint32_t inputs;
+    uint64_t writes;
+    uint64_t reads;
+    /* frames moved through the rings, and paced without a server */
+    uint64_t frames_written;
+    uint64_t frames_written_dropped;
+    uint64_t frames_read;
+    uint64_t frames_read_silenced;
+    /* time spent in write() and read(), waits for the ring included */
+    int64_t write_ns;
+    int64_t write_max_ns;
+    int64_t read_ns;
+    int64_t read_max_ns;
+};
+
+struct sfdroid_audio_device {
+    struct audio_hw_device device;
+    pthread_mutex_t lock;
+    bool mic_mute;
+    struct sfdroid_audio_stats stats;
+};
+
+/*
+ * State of one stream's connection, shared by playback and capture; the
+ * HAL is the producer of a playback ring and the consumer of a capture
+ * ring. Protected by the lock of the owning stream.
+ */
+struct sfdroid_stream {
+    uint32_t direction;
+    uint32_t sample_rate;
+    uint32_t channels;
+    size_t frame_size;
+
+    int fd;
+    sfdroid_audio_ring_t* ring;
+    size_t ring_size;
+    int ring_fd;
+    /* the HAL signals the server on to_server, the server us on to_hal */
+    int to_server_fd;
+    int to_hal_fd;
+    uint32_t host_latency_us;
+
+    bool started;
+    sfdroid_ipc_backoff_t backoff;
+    int64_t reconnect_at_ns;
+
+    /* frames moved by earlier connections, server positions restart on connect */
+    uint64_t frames_base;
+    /* frames moved since the stream was opened */
+    uint64_t frames;
+    /* while disconnected, when the frames dropped so far are due */
+    int64_t fallback_due_ns;
+};
+
+struct sfdroid_stream_out {
+    struct audio_stream_out stream;
+    pthread_mutex_t lock;
+    struct sfdroid_audio_device* dev;
+    struct sfdroid_stream st;
+};
+
+struct sfdroid_stream_in {
+    struct audio_stream_in stream;
+    pthread_mutex_t lock;
+    struct sfdroid_audio_device* dev;
+    struct sfdroid_stream st;
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** CONNECTION **/
+
+static void stream_init(struct sfdroid_stream* st, uint32_t direction, uint32_t sample_rate,
+        uint32_t channels)
+{
+    memset(st, 0, sizeof(*st));
+    st->direction = direction;
+    st->sample_rate = sample_rate;
+    st->channels = channels;
+    st->frame_size = channels * sizeof(int16_t);
+    st->fd = st->ring_fd = st->to_server_fd = st->to_hal_fd = -1;
+    sfdroid_ipc_backoff_init(&st->backoff, RECONNECT_MIN_MS, RECONNECT_MAX_MS);
+}
+
+static void stream_disconnect(struct sfdroid_stream* st)
+{
+    if (st->ring) {
+        /* what the server did not report yet is lost with the connection */
+        st->frames_base = st->frames;
+        munmap(st->ring, st->ring_size);
+        st->ring = NULL;
+    }
+    if (st->fd >= 0)
+        close(st->fd);
+    if (st->ring_fd >= 0)
+        close(st->ring_fd);
+    if (st->to_server_fd >= 0)
+        close(st->to_server_fd);
+    if (st->to_hal_fd >= 0)
+        close(st->to_hal_fd);
+    st->fd = st->ring_fd = st->to_server_fd = st->to_hal_fd = -1;
+    st->started = false;
+    st->reconnect_at_ns = now_ns() + sfdroid_ipc_backoff_next(&st->backoff) * 1000000LL;
+}
+
+static int stream_connect(struct sfdroid_stream* st)
+{
+    sfdroid_audio_open_t open_msg;
+    sfdroid_audio_reply_t reply;
+    struct iovec iov;
+    int fds[3];
+
+    st->fd = sfdroid_ipc_connect(SFDROID_AUDIO_SOCKET_NAME, OPEN_TIMEOUT_MS);
+    if (st->fd < 0)
+        goto exit_error;
+
+    st->ring_size = sizeof(sfdroid_audio_ring_t) + RING_FRAMES * st->frame_size;
+    st->ring = sfdroid_ipc_shm_create("sfdroid-audio", st->ring_size, &st->ring_fd);
+    st->to_server_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    st->to_hal_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (st->ring == NULL || st->to_server_fd < 0 || st->to_hal_fd < 0) {
+        ALOGE("failed to create audio ring: %s", strerror(errno));
+        goto exit_error;
+    }
+    st->ring->magic = SFDROID_AUDIO_MAGIC;
+    st->ring->version = SFDROID_AUDIO_VERSION;
+    st->ring->frame_size = st->frame_size;
+    st->ring->ring_frames = RING_FRAMES;
+
+    memset(&open_msg, 0, sizeof(open_msg));
+    open_msg.magic = SFDROID_AUDIO_MAGIC;
+    open_msg.version = SFDROID_AUDIO_VERSION;
+    open_msg.direction = st->direction;
+    open_msg.sample_rate = st->sample_rate;
+    open_msg.channels = st->channels;
+    open_msg.format = SFDROID_AUDIO_FORMAT_S16LE;
+    open_msg.period_frames = PERIOD_FRAMES;
+    open_msg.ring_frames = RING_FRAMES;
+
+    iov.iov_base = &open_msg;
+    iov.iov_len = sizeof(open_msg);
+    fds[0] = st->ring_fd;
+    fds[1] = st->to_server_fd;
+    fds[2] = st->to_hal_fd;
+    if (sfdroid_ipc_send(st->fd, &iov, 1, fds, 3) < 0 ||
+            recv(st->fd, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply)) {
+        ALOGE("failed to open %s stream: %s",
+                st->direction == SFDROID_AUDIO_PLAYBACK ? "playback" : "capture",
+                strerror(errno));
+        goto exit_error;
+    }
+    if (reply.magic != SFDROID_AUDIO_MAGIC || reply.status != 0) {
+        ALOGE("sound server refused %u Hz %u channel %s stream: %d", st->sample_rate,
+                st->channels, st->direction == SFDROID_AUDIO_PLAYBACK ? "playback" : "capture",
+                reply.status);
+        goto exit_error;
+    }
+
+    st->host_latency_us = reply.host_latency_us;
+    sfdroid_ipc_backoff_reset(&st->backoff);
+    ALOGI("connected %s stream, host latency %u us",
+            st->direction == SFDROID_AUDIO_PLAYBACK ? "playback" : "capture",
+            st->host_latency_us);
+    return 0;
+
+exit_error:
+    stream_disconnect(st);
+    return -1;
+}
+
+/* connect if not connected and the backoff allows, returns 0 if connected */
+static int stream_check_connection(struct sfdroid_stream* st)
+{
+    if (st->fd >= 0)
+        return 0;
+    if (now_ns() < st->reconnect_at_ns)
+        return -1;
+    return stream_connect(st);
+}
+
+static int stream_send_op(struct sfdroid_stream* st, uint8_t op)
+{
+    if (send(st->fd, &op, 1, MSG_NOSIGNAL) != 1) {
+        ALOGE("lost the sound server: %s", strerror(errno));
+        stream_disconnect(st);
+        return -1;
+    }
+    return 0;
+}
+
+static int stream_start(struct sfdroid_stream* st)
+{
+    if (st->started)
+        return 0;
+    if (stream_send_op(st, SFDROID_AUDIO_OP_START) < 0)
+        return -1;
+    st->started = true;
+    return 0;
+}
+
+static void stream_standby(struct sfdroid_stream* st)
+{
+    if (st->fd >= 0 && st->started && stream_send_op(st, SFDROID_AUDIO_OP_STOP) == 0)
+        st->started = false;
+}
+
+/** RING **/
+
+/* frames the HAL can write to a playback ring or read from a capture ring */
+static uint32_t ring_available(const struct sfdroid_stream* st)
+{
+    uint32_t filled = (uint32_t)android_atomic_acquire_load(&st->ring->write_pos) -
+            (uint32_t)android_atomic_acquire_load(&st->ring->read_pos);
+
+    return st->direction == SFDROID_AUDIO_PLAYBACK ? RING_FRAMES - filled : filled;
+}
+
+/* let the server know the ring changed, if it is waiting for that */
+static void ring_kick(struct sfdroid_stream* st)
+{
+    android_memory_barrier();
+    if (st->ring->server_waiting) {
+        uint64_t one = 1;
+        write(st->to_server_fd, &one, sizeof(one));
+    }
+}
+
+/*
+ * Wait until the server made room in, or filled, the ring. Returns the
+ * frames available, or 0 on timeout or if the server went away.
+ */
+static uint32_t ring_wait(struct sfdroid_stream* st, int timeout_ms)
+{
+    uint32_t available = ring_available(st);
+    struct pollfd pfd[2];
+    uint64_t count;
+
+    if (available > 0)
+        return available;
+
+    android_atomic_release_store(1, &st->ring->hal_waiting);
+    android_memory_barrier();
+    available = ring_available(st);
+    if (available == 0) {
+        pfd[0].fd = st->to_hal_fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        /* the server hangs up if it exits */
+        pfd[1].fd = st->fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        if (poll(pfd, 2, timeout_ms) > 0 && (pfd[0].revents & POLLIN))
+            read(st->to_hal_fd, &count, sizeof(count));
+        available = pfd[1].revents ? 0 : ring_available(st);
+    }
+    android_atomic_release_store(0, &st->ring->hal_waiting);
+
+    return available;
+}
+
+/*
+ * Copy frames to or from the ring at the HAL's position, which the
+ * caller made sure are available.
+ */
+static void ring_copy(struct sfdroid_stream* st, void* buffer, uint32_t frames)
+{
+    sfdroid_audio_ring_t* ring = st->ring;
+    volatile int32_t* pos = st->direction == SFDROID_AUDIO_PLAYBACK ?
+            &ring->write_pos : &ring->read_pos;
+    uint32_t offset = (uint32_t)*pos & (RING_FRAMES - 1);
+    uint32_t first = frames < RING_FRAMES - offset ? frames : RING_FRAMES - offset;
+    uint8_t* data = ring->data;
+
+    if (st->direction == SFDROID_AUDIO_PLAYBACK) {
+        memcpy(data + offset * st->frame_size, buffer, first * st->frame_size);
+        memcpy(data, (uint8_t*)buffer + first * st->frame_size, (frames - first) * st->frame_size);
+    } else {
+        memcpy(buffer, data + offset * st->frame_size, first * st->frame_size);
+        memcpy((uint8_t*)buffer + first * st->frame_size, data, (frames - first) * st->frame_size);
+    }
+    android_atomic_release_store((int32_t)((uint32_t)*pos + frames), pos);
+    st->frames += frames;
+}
+
+/*
+ * Move bytes of PCM through the ring, blocking for at most twice the ring
+ * duration at a time. Returns the bytes moved, less than asked for only
+ * if the server went away, in which case the stream is disconnected.
+ */
+static size_t stream_transfer(struct sfdroid_stream* st, void* buffer, size_t bytes)
+{
+    const int timeout_ms = 2 * RING_FRAMES * 1000 / st->sample_rate + 1;
+    uint32_t frames = bytes / st->frame_size;
+    uint32_t done = 0;
+
+    while (done < frames) {
+        uint32_t available = ring_wait(st, timeout_ms);
+        if (available == 0) {
+            ALOGE("sound server stopped %s", st->direction == SFDROID_AUDIO_PLAYBACK ?
+                    "playing" : "capturing");
+            stream_disconnect(st);
+            break;
+        }
+        if (available > frames - done)
+            available = frames - done;
+        ring_copy(st, (uint8_t*)buffer + done * st->frame_size, available);
+        ring_kick(st);
+        done += available;
+    }
+
+    return done * st->frame_size;
+}
+
+/*
+ * Without a server, keep the framework's timing by taking as long as the
+ * frames would take to play or record, against a deadline so that pacing
+ * doesn't drift.
+ */
+static void stream_fallback(struct sfdroid_stream* st, size_t bytes)
+{
+    int64_t now = now_ns();
+    uint32_t frames = bytes / st->frame_size;
+
+    if (st->fallback_due_ns < now - 1000000000LL)
+        st->fallback_due_ns = now;
+    st->fallback_due_ns += (int64_t)frames * 1000000000LL / st->sample_rate;
+    st->frames += frames;
+    st->frames_base = st->frames;
+
+    if (st->fallback_due_ns > now) {
+        struct timespec ts;
+        ts.tv_sec = st->fallback_due_ns / 1000000000LL;
+        ts.tv_nsec = st->fallback_due_ns % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+    }
+}
+
+/*
+ * The server's latest position report, in frames of the stream since it
+ * was opened. Returns -ENODATA if it did not report one on this
+ * connection yet.
+ */
+static int stream_get_position(const struct sfdroid_stream* st, uint64_t* frames,
+        struct timespec* timestamp)
+{
+    sfdroid_audio_ring_t* ring = st->ring;
+    int64_t position, ns;
+
+    if (!ring)
+        return -ENODATA;
+
+    for (;;) {
+        int32_t seq = android_atomic_acquire_load(&ring->position_seq);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        position = ring->position_frames;
+        ns = ring->position_ns;
+        android_memory_barrier();
+        if (android_atomic_acquire_load(&ring->position_seq) == seq)
+            break;
+    }
+    if (ns == 0)
+        return -ENODATA;
+
+    *frames = st->frames_base + position;
+    timestamp->tv_sec = ns / 1000000000LL;
+    timestamp->tv_nsec = ns % 1000000000LL;
+    return 0;
+}
+
+static int stream_dump(const struct sfdroid_stream* st, int fd)
+{
+    dprintf(fd, "      %s, %u Hz, %u channels, %s%s, frames %llu, xruns %d\n",
+            st->direction == SFDROID_AUDIO_PLAYBACK ? "playback" : "capture",
+            st->sample_rate, st->channels, st->fd >= 0 ? "connected" : "disconnected",
+            st->started ? ", started" : "", (unsigned long long)st->frames,
+            st->ring ? st->ring->xruns : 0);
+    return 0;
+}
+
+/** OUTPUT **/
+
+static uint32_t out_get_sample_rate(const struct audio_stream *stream)
+{
+    const struct sfdroid_stream_out *out = (const struct sfdroid_stream_out *)stream;
+    return out->st.sample_rate;
+}
+
+static int out_set_sample_rate(struct audio_stream *stream, uint32_t rate)
+{
+    return -ENOSYS;
+}
+
+static size_t out_get_buffer_size(const struct audio_stream *stream)
+{
+    const struct sfdroid_stream_out *out = (const struct sfdroid_stream_out *)stream;
+    return PERIOD_FRAMES * out->st.frame_size;
+}
+
+static audio_channel_mask_t out_get_channels(const struct audio_stream *stream)
+{
+    const struct sfdroid_stream_out *out = (const struct sfdroid_stream_out *)stream;
+    return audio_channel_out_mask_from_count(out->st.channels);
+}
+
+static audio_format_t out_get_format(const struct audio_stream *stream)
+{
+    return AUDIO_FORMAT_PCM_16_BIT;
+}
+
+static int out_set_format(struct audio_stream *stream, audio_format_t format)
+{
+    return -ENOSYS;
+}
+
+static int out_standby(struct audio_stream *stream)
+{
+    struct sfdroid_stream_out *out = (struct sfdroid_stream_out *)stream;
+
+    pthread_mutex_lock(&out->lock);
+    stream_standby(&out->st);
+    pthread_mutex_unlock(&out->lock);
+    return 0;
+}
+
+static int out_dump(const struct audio_stream *stream, int fd)
+{
+    const struct sfdroid_stream_out *out = (const struct sfdroid_stream_out *)stream;
+    return stream_dump(&out->st, fd);
+}
+
+static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
+{
+    /* routing is up to the Sailfish side */
+    return 0;
+}
+
+static char * out_get_parameters(const struct audio_stream *stream, const char *keys)
+{
+    return strdup("");
+}
+
+static uint32_t out_get_latency(const struct audio_stream_out *stream)
+{
+    const struct sfdroid_stream_out *out = (const struct sfdroid_stream_out *)stream;
+    return RING_FRAMES * 1000 / out->st.sample_rate + out->st.host_latency_us / 1000;
+}
+
+static int out_set_volume(struct audio_stream_out *stream, float left,
+                          float right)
+{
+    /* let AudioFlinger apply the volume in software */
+    return -ENOSYS;
+}
+
+static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
+                         size_t bytes)
+{
+    struct sfdroid_stream_out *out = (struct sfdroid_stream_out *)stream;
+    struct sfdroid_audio_stats* stats = &out->dev->stats;
+    int64_t start = now_ns();
+    size_t frame_size;
+    size_t done = 0;
+    int64_t elapsed;
+
+    pthread_mutex_lock(&out->lock);
+    if (stream_check_connection(&out->st) == 0 && stream_start(&out->st) == 0)
+        done = stream_transfer(&out->st, (void*)buffer, bytes);
+    if (done < bytes)
+        stream_fallback(&out->st, bytes - done);
+    frame_size = out->st.frame_size;
+    pthread_mutex_unlock(&out->lock);
+
+    elapsed = now_ns() - start;
+    pthread_mutex_lock(&out->dev->lock);
+    stats->writes++;
+    stats->frames_written += done / frame_size;
+    stats->frames_written_dropped += (bytes - done) / frame_size;
+    stats->write_ns += elapsed;
+    if (elapsed > stats->write_max_ns)
+        stats->write_max_ns = elapsed;
+    pthread_mutex_unlock(&out->dev->lock);
+
+    return bytes;
+}
+
+static int out_get_render_position(const struct audio_stream_out *stream,
+                                   uint32_t *dsp_frames)
+{
+    struct sfdroid_stream_out *out = (struct sfdroid_stream_out *)stream;
+    struct timespec timestamp;
+    uint64_t frames;
+
+    pthread_mutex_lock(&out->lock);
+    int ret = stream_get_position(&out->st, &frames, &timestamp);
+    pthread_mutex_unlock(&out->lock);
+
+    if (ret == 0)
+        *dsp_frames = (uint32_t)frames;
+    return ret;
+}
+
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames, struct timespec *timestamp)
+{
+    struct sfdroid_stream_out *out = (struct sfdroid_stream_out *)stream;
+
+    pthread_mutex_lock(&out->lock);
+    int ret = stream_get_position(&out->st, frames, timestamp);
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
+}
+
+static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
+{
+    return 0;
+}
+
+static int out_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
+{
+    return 0;
+}
+
+static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
+                                        int64_t *timestamp)
+{
+    return -EINVAL;
+}
+
+/** INPUT **/
+
+static uint32_t in_get_sample_rate(const struct audio_stream *stream)
+{
+    const struct sfdroid_stream_in *in = (const struct sfdroid_stream_in *)stream;
+    return in->st.sample_rate;
+}
+
+static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate)
+{
+    return -ENOSYS;
+}
+
+static size_t in_get_buffer_size(const struct audio_stream *stream)
+{
+    const struct sfdroid_stream_in *in = (const struct sfdroid_stream_in *)stream;
+    return PERIOD_FRAMES * in->st.frame_size;
+}
+
+static audio_channel_mask_t in_get_channels(const struct audio_stream *stream)
+{
+    const struct sfdroid_stream_in *in = (const struct sfdroid_stream_in *)stream;
+    return audio_channel_in_mask_from_count(in->st.channels);
+}
+
+static audio_format_t in_get_format(const struct audio_stream *stream)
+{
+    return AUDIO_FORMAT_PCM_16_BIT;
+}
+
+static int in_set_format(struct audio_stream *stream, audio_format_t format)
+{
+    return -ENOSYS;
+}
+
+static int in_standby(struct audio_stream *stream)
+{
+    struct sfdroid_stream_in *in = (struct sfdroid_stream_in *)stream;
+
+    pthread_mutex_lock(&in->lock);
+    stream_standby(&in->st);
+    pthread_mutex_unlock(&in->lock);
+    return 0;
+}
+
+static int in_dump(const struct audio_stream *stream, int fd)
+{
+    const struct sfdroid_stream_in *in = (const struct sfdroid_stream_in *)stream;
+    return stream_dump(&in->st, fd);
+}
+
+static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
+{
+    return 0;
+}
+
+static char * in_get_parameters(const struct audio_stream *stream,
+                                const char *keys)
+{
+    return strdup("");
+}
+
+static int in_set_gain(struct audio_stream_in *stream, float gain)
+{
+    return 0;
+}
+
+static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
+                       size_t bytes)
+{
+    struct sfdroid_stream_in *in = (struct sfdroid_stream_in *)stream;
+    struct sfdroid_audio_stats* stats = &in->dev->stats;
+    int64_t start = now_ns();
+    size_t frame_size;
+    size_t done = 0;
+    int64_t elapsed;
+    bool mute;
+
+    pthread_mutex_lock(&in->lock);
+    if (stream_check_connection(&in->st) == 0 && stream_start(&in->st) == 0)
+        done = stream_transfer(&in->st, buffer, bytes);
+    if (done < bytes) {
+        memset((uint8_t*)buffer + done, 0, bytes - done);
+        stream_fallback(&in->st, bytes - done);
+    }
+    frame_size = in->st.frame_size;
+    pthread_mutex_unlock(&in->lock);
+
+    elapsed = now_ns() - start;
+    pthread_mutex_lock(&in->dev->lock);
+    mute = in->dev->mic_mute;
+    stats->reads++;
+    stats->frames_read += done / frame_size;
+    stats->frames_read_silenced += (bytes - done) / frame_size;
+    stats->read_ns += elapsed;
+    if (elapsed > stats->read_max_ns)
+        stats->read_max_ns = elapsed;
+    pthread_mutex_unlock(&in->dev->lock);
+    if (mute)
+        memset(buffer, 0, bytes);
+
+    return bytes;
+}
+
+static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
+{
+    return 0;
+}
+
+static int in_get_capture_position(const struct audio_stream_in *stream,
+                                   int64_t *frames, int64_t *time)
+{
+    struct sfdroid_stream_in *in = (struct sfdroid_stream_in *)stream;
+    struct timespec timestamp;
+    uint64_t position;
+
+    pthread_mutex_lock(&in->lock);
+    int ret = stream_get_position(&in->st, &position, &timestamp);
+    pthread_mutex_unlock(&in->lock);
+
+    if (ret == 0) {
+        *frames = position;
+        *time = (int64_t)timestamp.tv_sec * 1000000000LL + timestamp.tv_nsec;
+    }
+    return ret;
+}
+
+static int in_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
+{
+    return 0;
+}
+
+static int in_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
+{
+    return 0;
+}
+
+/** DEVICE **/
+
+/*
+ * The sound server resamples and mixes, so any rate is taken as long as
+ * it is one Android commonly uses; PCM16 mono or stereo only.
+ */
+static int check_config(struct audio_config *config, bool input)
+{
+    int ret = 0;
+
+    switch (config->sample_rate) {
+    case 8000: case 11025: case 16000: case 22050: case 32000: case 44100: case 48000:
+        break;
+    case 0:
+        config->sample_rate = DEFAULT_SAMPLE_RATE;
+        break;
+    default:
+        config->sample_rate = DEFAULT_SAMPLE_RATE;
+        ret = -EINVAL;
+        break;
+    }
+
+    if (config->format == AUDIO_FORMAT_DEFAULT) {
+        config->format = AUDIO_FORMAT_PCM_16_BIT;
+    } else if (config->format != AUDIO_FORMAT_PCM_16_BIT) {
+        config->format = AUDIO_FORMAT_PCM_16_BIT;
+        ret = -EINVAL;
+    }
+
+    uint32_t channels = input ? audio_channel_count_from_in_mask(config->channel_mask) :
+            audio_channel_count_from_out_mask(config->channel_mask);
+    if (config->channel_mask == AUDIO_CHANNEL_NONE) {
+        config->channel_mask = input ? AUDIO_CHANNEL_IN_MONO : AUDIO_CHANNEL_OUT_STEREO;
+    } else if (channels != 1 && channels != 2) {
+        config->channel_mask = input ? AUDIO_CHANNEL_IN_MONO : AUDIO_CHANNEL_OUT_STEREO;
+        ret = -EINVAL;
+    }
+
+    return ret;
+}
+
+static int adev_open_output_stream(struct audio_hw_device *dev,
+                                   audio_io_handle_t handle,
+                                   audio_devices_t devices,
+                                   audio_output_flags_t flags,
+                                   struct audio_config *config,
+                                   struct audio_stream_out **stream_out,
+                                   const char *address __unused)
+{
+    struct sfdroid_stream_out *out;
+    int ret;
+
+    ret = check_config(config, false);
+    if (ret < 0) {
+        *stream_out = NULL;
+        return ret;
+    }
+
+    out = (struct sfdroid_stream_out *)calloc(1, sizeof(struct sfdroid_stream_out));
+    if (!out)
+        return -ENOMEM;
+
+    out->stream.common.get_sample_rate = out_get_sample_rate;
+    out->stream.common.set_sample_rate = out_set_sample_rate;
+    out->stream.common.get_buffer_size = out_get_buffer_size;
+    out->stream.common.get_channels = out_get_channels;
+    out->stream.common.get_format = out_get_format;
+    out->stream.common.set_format = out_set_format;
+    out->stream.common.standby = out_standby;
+    out->stream.common.dump = out_dump;
+    out->stream.common.set_parameters = out_set_parameters;
+    out->stream.common.get_parameters = out_get_parameters;
+    out->stream.common.add_audio_effect = out_add_audio_effect;
+    out->stream.common.remove_audio_effect = out_remove_audio_effect;
+    out->stream.get_latency = out_get_latency;
+    out->stream.set_volume = out_set_volume;
+    out->stream.write = out_write;
+    out->stream.get_render_position = out_get_render_position;
+    out->stream.get_presentation_position = out_get_presentation_position;
+    out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
+
+    pthread_mutex_init(&out->lock, NULL);
+    out->dev = (struct sfdroid_audio_device *)dev;
+    stream_init(&out->st, SFDROID_AUDIO_PLAYBACK, config->sample_rate,
+            audio_channel_count_from_out_mask(config->channel_mask));
+    /* connect right away so that the first write does not have to */
+    stream_connect(&out->st);
+
+    pthread_mutex_lock(&out->dev->lock);
+    out->dev->stats.outputs++;
+    pthread_mutex_unlock(&out->dev->lock);
+
+    *stream_out = &out->stream;
+    return 0;
+}
+
+static void adev_close_output_stream(struct audio_hw_device *dev,
+                                     struct audio_stream_out *stream)
+{
+    struct sfdroid_stream_out *out = (struct sfdroid_stream_out *)stream;
+
+    pthread_mutex_lock(&out->dev->lock);
+    out->dev->stats.outputs--;
+    pthread_mutex_unlock(&out->dev->lock);
+
+    stream_disconnect(&out->st);
+    pthread_mutex_destroy(&out->lock);
+    free(out);
+}
+
+static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
+{
+    return 0;
+}
+
+static char * adev_get_parameters(const struct audio_hw_device *dev,
+                                  const char *keys)
+{
+    return strdup("");
+}
+
+static int adev_init_check(const struct audio_hw_device *dev)
+{
+    return 0;
+}
+
+static int adev_set_voice_volume(struct audio_hw_device *dev, float volume)
+{
+    return -ENOSYS;
+}
+
+static int adev_set_master_volume(struct audio_hw_device *dev, float volume)
+{
+    return -ENOSYS;
+}
+
+static int adev_get_master_volume(struct audio_hw_device *dev, float *volume)
+{
+    return -ENOSYS;
+}
+
+static int adev_set_master_mute(struct audio_hw_device *dev, bool muted)
+{
+    return -ENOSYS;
+}
+
+static int adev_get_master_mute(struct audio_hw_device *dev, bool *muted)
+{
+    return -ENOSYS;
+}
+
+static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
+{
+    return 0;
+}
+
+static int adev_set_mic_mute(struct audio_hw_device *dev, bool state)
+{
+    struct sfdroid_audio_device *adev = (struct sfdroid_audio_device *)dev;
+
+    pthread_mutex_lock(&adev->lock);
+    adev->mic_mute = state;
+    pthread_mutex_unlock(&adev->lock);
+    return 0;
+}
+
+static int adev_get_mic_mute(const struct audio_hw_device *dev, bool *state)
+{
+    struct sfdroid_audio_device *adev = (struct sfdroid_audio_device *)dev;
+
+    pthread_mutex_lock(&adev->lock);
+    *state = adev->mic_mute;
+    pthread_mutex_unlock(&adev->lock);
+    return 0;
+}
+
+static size_t adev_get_input_buffer_size(const struct audio_hw_device *dev,
+                                         const struct audio_config *config)
+{
+    return PERIOD_FRAMES * audio_channel_count_from_in_mask(config->channel_mask) *
+            sizeof(int16_t);
+}
+
+static int adev_open_input_stream(struct audio_hw_device *dev,
+                                  audio_io_handle_t handle,
+                                  audio_devices_t devices,
+                                  struct audio_config *config,
+                                  struct audio_stream_in **stream_in,
+                                  audio_input_flags_t flags __unused,
+                                  const char *address __unused,
+                                  audio_source_t source __unused)
+{
+    struct sfdroid_stream_in *in;
+    int ret;
+
+    ret = check_config(config, true);
+    if (ret < 0) {
+        *stream_in = NULL;
+        return ret;
+    }
+
+    in = (struct sfdroid_stream_in *)calloc(1, sizeof(struct sfdroid_stream_in));
+    if (!in)
+        return -ENOMEM;
+
+    in->stream.common.get_sample_rate = in_get_sample_rate;
+    in->stream.common.set_sample_rate = in_set_sample_rate;
+    in->stream.common.get_buffer_size = in_get_buffer_size;
+    in->stream.common.get_channels = in_get_channels;
+    in->stream.common.get_format = in_get_format;
+    in->stream.common.set_format = in_set_format;
+    in->stream.common.standby = in_standby;
+    in->stream.common.dump = in_dump;
+    in->stream.common.set_parameters = in_set_parameters;
+    in->stream.common.get_parameters = in_get_parameters;
+    in->stream.common.add_audio_effect = in_add_audio_effect;
+    in->stream.common.remove_audio_effect = in_remove_audio_effect;
+    in->stream.set_gain = in_set_gain;
+    in->stream.read = in_read;
+    in->stream.get_input_frames_lost = in_get_input_frames_lost;
+    in->stream.get_capture_position = in_get_capture_position;
+
+    pthread_mutex_init(&in->lock, NULL);
+    in->dev = (struct sfdroid_audio_device *)dev;
+    stream_init(&in->st, SFDROID_AUDIO_CAPTURE, config->sample_rate,
+            audio_channel_count_from_in_mask(config->channel_mask));
+    stream_connect(&in->st);
+
+    pthread_mutex_lock(&in->dev->lock);
+    in->dev->stats.inputs++;
+    pthread_mutex_unlock(&in->dev->lock);
+
+    *stream_in = &in->stream;
+    return 0;
+}
+
+static void adev_close_input_stream(struct audio_hw_device *dev,
+                                   struct audio_stream_in *stream)
+{
+    struct sfdroid_stream_in *in = (struct sfdroid_stream_in *)stream;
+
+    pthread_mutex_lock(&in->dev->lock);
+    in->dev->stats.inputs--;
+    pthread_mutex_unlock(&in->dev->lock);
+
+    stream_disconnect(&in->st);
+    pthread_mutex_destroy(&in->lock);
+    free(in);
+}
+
+static int adev_dump(const audio_hw_device_t *device, int fd)
+{
+    return 0;
+}
+
+static int adev_get_perf_counters(const hw_device_t *device,
+                                  hw_perf_counter_t *counters, size_t count)
+{
+    struct sfdroid_audio_device *adev = (struct sfdroid_audio_device *)device;
+    struct sfdroid_audio_stats stats;
+    size_t n = 0;
+
+    pthread_mutex_lock(&adev->lock);
+    stats = adev->stats;
+    pthread_mutex_unlock(&adev->lock);
+
+    hw_perf_counter_put(counters, count, &n, "streams.output",
+            HW_PERF_COUNTER_TYPE_GAUGE, stats.outputs);
+    hw_perf_counter_put(counters, count, &n, "streams.input",
+            HW_PERF_COUNTER_TYPE_GAUGE, stats.inputs);
+    hw_perf_counter_put(counters, count, &n, "writes",
+            HW_PERF_COUNTER_TYPE_COUNT, stats.writes);
+    hw_perf_counter_put(counters, count, &n, "frames_written",
+            HW_PERF_COUNTER_TYPE_COUNT, stats.frames_written);
+    hw_perf_counter_put(counters, count, &n, "frames_written_dropped",
+            HW_PERF_COUNTER_TYPE_COUNT, stats.frames_written_dropped);
+    hw_perf_counter_put(counters, count, &n, "write.total_ns",
+            HW_PERF_COUNTER_TYPE_TIME_NS, stats.write_ns);
+    hw_perf_counter_put(counters, count, &n, "write.max_ns",
+            HW_PERF_COUNTER_TYPE_MAX_NS, stats.write_max_ns);
+    hw_perf_counter_put(counters, count, &n, "reads",
+            HW_PERF_COUNTER_TYPE_COUNT, stats.reads);
+    hw_perf_counter_put(counters, count, &n, "frames_read",
+            HW_PERF_COUNTER_TYPE_COUNT, stats.frames_read);
+    hw_perf_counter_put(counters, count, &n, "frames_read_silenced",
+            HW_PERF_COUNTER_TYPE_COUNT, stats.frames_read_silenced);
+    hw_perf_counter_put(counters, count, &n, "read.total_ns",
+            HW_PERF_COUNTER_TYPE_TIME_NS, stats.read_ns);
+    hw_perf_counter_put(counters, count, &n, "read.max_ns",
+            HW_PERF_COUNTER_TYPE_MAX_NS, stats.read_max_ns);
+
+    return n;
+}
+
+static const hw_device_ext_t adev_ext = {
+    .tag = HARDWARE_DEVICE_EXT_TAG,
+    .version = HARDWARE_DEVICE_EXT_VERSION_1,
+    .get_perf_counters = adev_get_perf_counters,
+};
+
+static int adev_close(hw_device_t *device)
+{
+    struct sfdroid_audio_device *adev = (struct sfdroid_audio_device *)device;
+
+    pthread_mutex_destroy(&adev->lock);
+    free(device);
+    return 0;
+}
+
+static int adev_open(const hw_module_t* module, const char* name,
+                     hw_device_t** device)
+{
+    struct sfdroid_audio_device *adev;
+
+    if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0)
+        return -EINVAL;
+
+    adev = calloc(1, sizeof(struct sfdroid_audio_device));
+    if (!adev)
+        return -ENOMEM;
+
+    pthread_mutex_init(&adev->lock, NULL);
+
+    adev->device.common.tag = HARDWARE_DEVICE_TAG;
+    adev->device.common.version = AUDIO_DEVICE_API_VERSION_2_0;
+    adev->device.common.module = (struct hw_module_t *) module;
+    adev->device.common.close = adev_close;
+    adev->device.common.ext = &adev_ext;
+
+    adev->device.init_check = adev_init_check;
+    adev->device.set_voice_volume = adev_set_voice_volume;
+    adev->device.set_master_volume = adev_set_master_volume;
+    adev->device.get_master_volume = adev_get_master_volume;
+    adev->device.set_master_mute = adev_set_master_mute;
+    adev->device.get_master_mute = adev_get_master_mute;
+    adev->device.set_mode = adev_set_mode;
+    adev->device.set_mic_mute = adev_set_mic_mute;
+    adev->device.get_mic_mute = adev_get_mic_mute;
+    adev->device.set_parameters = adev_set_parameters;
+    adev->device.get_parameters = adev_get_parameters;
+    adev->device.get_input_buffer_size = adev_get_input_buffer_size;
+    adev->device.open_output_stream = adev_open_output_stream;
+    adev->device.close_output_stream = adev_close_output_stream;
+    adev->device.open_input_stream = adev_open_input_stream;
+    adev->device.close_input_stream = adev_close_input_stream;
+    adev->device.dump = adev_dump;
+
+    *device = &adev->device.common;
+
+    return 0;
+}
+
+static struct hw_module_methods_t hal_module_methods = {
+    .open = adev_open,
+};
+
+struct audio_module HAL_MODULE_INFO_SYM = {
+    .common = {
+        .tag = HARDWARE_MODULE_TAG,
+        .module_api_version = AUDIO_MODULE_API_VERSION_0_1,
+        .hal_api_version = HARDWARE_HAL_API_VERSION_1_1,
+        .id = AUDIO_HARDWARE_MODULE_ID,
+        .name = "sfdroid audio HAL",
+        .author = "The Android Open Source Project",
+        .methods = &hal_module_methods,
+    },
+};
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFDROID_AUDIO_PROTOCOL_H_
+#define SFDROID_AUDIO_PROTOCOL_H_
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * Protocol between the sfdroid audio HAL and the audio bridge of the
+ * Sailfish sound server, on the socket SFDROID_AUDIO_SOCKET_NAME in
+ * /tmp/sfdroid.
+ *
+ * Every stream has a connection of its own. The HAL opens it with a
+ * sfdroid_audio_open_t and three fds attached via SCM_RIGHTS: the ring
+ * region, the eventfd the HAL signals the server on and the eventfd the
+ * server signals the HAL on. The server answers with a
+ * sfdroid_audio_reply_t; on success PCM flows through the ring only and
+ * the socket carries nothing but single byte SFDROID_AUDIO_OP_* requests,
+ * which are not answered. Closing the socket closes the stream.
+ */
+#define SFDROID_AUDIO_SOCKET_NAME   "audio_handle"
+
+#define SFDROID_AUDIO_MAGIC     0x53464155  /* 'SFAU' */
+#define SFDROID_AUDIO_VERSION   1
+
+#define SFDROID_AUDIO_PLAYBACK  0
+#define SFDROID_AUDIO_CAPTURE   1
+
+/* interleaved signed 16-bit little endian, the only format so far */
+#define SFDROID_AUDIO_FORMAT_S16LE  1
+
+/* start moving PCM, sent before the first write or read after standby */
+#define SFDROID_AUDIO_OP_START  1
+/* standby: the server plays out what is queued, then stops the stream */
+#define SFDROID_AUDIO_OP_STOP   2
+
+typedef struct sfdroid_audio_open_t {
+    uint32_t magic;
+    uint32_t version;
+    /* SFDROID_AUDIO_PLAYBACK or SFDROID_AUDIO_CAPTURE */
+    uint32_t direction;
+    uint32_t sample_rate;
+    uint32_t channels;
+    /* SFDROID_AUDIO_FORMAT_* */
+    uint32_t format;
+    /* frames the HAL writes or reads at a time */
+    uint32_t period_frames;
+    /* capacity of the ring in frames, a power of two */
+    uint32_t ring_frames;
+} sfdroid_audio_open_t;
+
+typedef struct sfdroid_audio_reply_t {
+    uint32_t magic;
+    /* 0, or -errno if the server can't open the stream */
+    int32_t status;
+    /* from leaving the ring to the speaker, or the microphone to the ring */
+    uint32_t host_latency_us;
+    uint32_t reserved;
+} sfdroid_audio_reply_t;
+
+/*
+ * PCM ring in shared memory, followed by ring_frames frames of data.
+ *
+ * Positions count frames ever written to and read from the ring and wrap
+ * around; the producer (the HAL for playback, the server for capture)
+ * only advances write_pos, the consumer only read_pos, both with release
+ * semantics once the frames in between were copied.
+ *
+ * Either side sets its *_waiting flag before it blocks on its eventfd,
+ * then checks the ring once more. The other side only signals the
+ * eventfd when the flag is set, so a stream where neither side sleeps
+ * costs no syscall per period.
+ *
+ * The server reports where the stream is in real time: position_frames
+ * frames of the stream were played at, or captured from, the CLOCK_MONOTONIC
+ * time position_ns. It updates both under the sequence lock position_seq,
+ * odd while an update is in progress. position_ns stays 0 until the first
+ * report.
+ */
+typedef struct sfdroid_audio_ring_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t frame_size;
+    uint32_t ring_frames;
+
+    volatile int32_t write_pos __attribute__((aligned(64)));
+    volatile int32_t read_pos __attribute__((aligned(64)));
+
+    volatile int32_t hal_waiting __attribute__((aligned(64)));
+    volatile int32_t server_waiting;
+
+    volatile int32_t position_seq;
+    /* underruns of playback, overruns of capture, counted by the server */
+    volatile int32_t xruns;
+    volatile int64_t position_frames;
+    volatile int64_t position_ns;
+
+    uint8_t data[0] __attribute__((aligned(64)));
+} sfdroid_audio_ring_t;
+
+__END_DECLS
+
+#endif /* SFDROID_AUDIO_PROTOCOL_H_ */
@@ -0,0 +1,44 @@
+# Copyright (C) 2009 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+LOCAL_PATH := $(call my-dir)
+
+# GPS HAL backed by the Sailfish location daemon, stored in
+# hw/<GPS_HARDWARE_MODULE_ID>.default.so
+include $(CLEAR_VARS)
+
+LOCAL_MODULE_RELATIVE_PATH := hw
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_STATIC_LIBRARIES := libsfdroid_ipc
+LOCAL_SRC_FILES := gps.c sfdroid_location.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../sfdroid_ipc
+LOCAL_CFLAGS := -Wno-unused-parameter
+LOCAL_MODULE := gps.default
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_SHARED_LIBRARY)
+
+# Fused location HAL batching in the Sailfish location daemon, stored in
+# hw/<FUSED_LOCATION_HARDWARE_MODULE_ID>.default.so
+include $(CLEAR_VARS)
+
+LOCAL_MODULE_RELATIVE_PATH := hw
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_STATIC_LIBRARIES := libsfdroid_ipc
+LOCAL_SRC_FILES := flp.c sfdroid_location.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../sfdroid_ipc
+LOCAL_CFLAGS := -Wno-unused-parameter
+LOCAL_MODULE := flp.default
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_SHARED_LIBRARY)
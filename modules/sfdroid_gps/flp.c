@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "sfdroid_flp"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cutils/log.h>
+#include <hardware/fused_location.h>
+#include <hardware/hardware.h>
+
+#include "sfdroid_location.h"
+
+/*
+ * Fused location HAL of Android running on top of Sailfish: batching is
+ * done by the Sailfish location daemon in its own FIFO, so that Android
+ * is only woken up when the FIFO is full, if asked for, instead of for
+ * every fix. The batching requests of the framework are merged into the
+ * single configuration of the daemon: the shortest period, and waking up
+ * or calling back on every fix if any request wants to.
+ */
+
+#define MAX_REQUESTS    8
+
+typedef struct batch_request_t {
+    bool active;
+    int id;
+    FlpBatchOptions options;
+} batch_request_t;
+
+static pthread_mutex_t sLock = PTHREAD_MUTEX_INITIALIZER;
+static FlpCallbacks sCallbacks;
+static bool sInitialized;
+static pthread_t sThread;
+static sfdroid_location_t sLocation;
+static batch_request_t sRequests[MAX_REQUESTS];
+
+/* run thread only: the locations of one callback */
+static FlpLocation sLocations[SFDROID_LOCATION_MAX_FIXES];
+static FlpLocation* sLocationPointers[SFDROID_LOCATION_MAX_FIXES];
+
+static FlpLocationFlags to_flp_flags(uint32_t flags)
+{
+    FlpLocationFlags out = 0;
+
+    if (flags & SFDROID_LOCATION_HAS_LAT_LONG)
+        out |= FLP_LOCATION_HAS_LAT_LONG;
+    if (flags & SFDROID_LOCATION_HAS_ALTITUDE)
+        out |= FLP_LOCATION_HAS_ALTITUDE;
+    if (flags & SFDROID_LOCATION_HAS_SPEED)
+        out |= FLP_LOCATION_HAS_SPEED;
+    if (flags & SFDROID_LOCATION_HAS_BEARING)
+        out |= FLP_LOCATION_HAS_BEARING;
+    if (flags & SFDROID_LOCATION_HAS_ACCURACY)
+        out |= FLP_LOCATION_HAS_ACCURACY;
+    return out;
+}
+
+static void location_fixes(void* cookie, uint32_t type, const sfdroid_location_fix_t* fixes,
+        uint32_t count)
+{
+    uint32_t i;
+
+    if (count == 0)
+        return;
+
+    for (i = 0; i < count; i++) {
+        FlpLocation* location = &sLocations[i];
+
+        memset(location, 0, sizeof(*location));
+        location->size = sizeof(*location);
+        location->flags = to_flp_flags(fixes[i].flags);
+        location->latitude = fixes[i].latitude;
+        location->longitude = fixes[i].longitude;
+        location->altitude = fixes[i].altitude;
+        location->speed = fixes[i].speed;
+        location->bearing = fixes[i].bearing;
+        location->accuracy = fixes[i].accuracy;
+        location->timestamp = fixes[i].timestamp_ms;
+        location->sources_used = fixes[i].sources;
+        sLocationPointers[i] = location;
+    }
+
+    sCallbacks.acquire_wakelock_cb();
+    sCallbacks.location_cb(count, sLocationPointers);
+    sCallbacks.release_wakelock_cb();
+}
+
+static void* location_thread(void* arg)
+{
+    if (sCallbacks.set_thread_event_cb(ASSOCIATE_JVM) != FLP_RESULT_SUCCESS) {
+        ALOGE("failed to associate the location thread with the JVM");
+        return NULL;
+    }
+    sfdroid_location_run(&sLocation);
+    sCallbacks.set_thread_event_cb(DISASSOCIATE_JVM);
+    return NULL;
+}
+
+/* Merge the active requests into the daemon's configuration, with sLock held */
+static void update_config(void)
+{
+    int64_t period_ns = 0;
+    uint32_t flags = 0;
+    uint32_t sources = 0;
+    bool any = false;
+    int i;
+
+    for (i = 0; i < MAX_REQUESTS; i++) {
+        const FlpBatchOptions* options = &sRequests[i].options;
+
+        if (!sRequests[i].active)
+            continue;
+        if (!any || options->period_ns < period_ns)
+            period_ns = options->period_ns;
+        if (options->flags & FLP_BATCH_WAKEUP_ON_FIFO_FULL)
+            flags |= SFDROID_LOCATION_BATCH_WAKEUP;
+        if (options->flags & FLP_BATCH_CALLBACK_ON_LOCATION_FIX)
+            flags |= SFDROID_LOCATION_BATCH_EVERY_FIX;
+        sources |= options->sources_to_use;
+        any = true;
+    }
+
+    if (any)
+        sfdroid_location_configure(&sLocation, SFDROID_LOCATION_MODE_BATCH, flags, period_ns,
+                sources);
+    else
+        sfdroid_location_configure(&sLocation, SFDROID_LOCATION_MODE_OFF, 0, 0, 0);
+}
+
+static batch_request_t* find_request(int id)
+{
+    int i;
+
+    for (i = 0; i < MAX_REQUESTS; i++) {
+        if (sRequests[i].active && sRequests[i].id == id)
+            return &sRequests[i];
+    }
+    return NULL;
+}
+
+static int sfdroid_flp_init(FlpCallbacks* callbacks)
+{
+    int ret = FLP_RESULT_SUCCESS;
+
+    pthread_mutex_lock(&sLock);
+    if (sInitialized)
+        goto out;
+
+    sCallbacks = *callbacks;
+    memset(sRequests, 0, sizeof(sRequests));
+    if (sfdroid_location_init(&sLocation, location_fixes, NULL, NULL) < 0) {
+        ret = FLP_RESULT_ERROR;
+        goto out;
+    }
+    if (pthread_create(&sThread, NULL, location_thread, NULL) != 0) {
+        ALOGE("failed to create the location thread");
+        sfdroid_location_destroy(&sLocation);
+        ret = FLP_RESULT_ERROR;
+        goto out;
+    }
+    sInitialized = true;
+
+out:
+    pthread_mutex_unlock(&sLock);
+    return ret;
+}
+
+static int sfdroid_flp_get_batch_size()
+{
+    return sInitialized ? (int)sfdroid_location_batch_capacity(&sLocation) : 0;
+}
+
+static int sfdroid_flp_start_batching(int id, FlpBatchOptions* options)
+{
+    batch_request_t* request = NULL;
+    int ret = FLP_RESULT_SUCCESS;
+    int i;
+
+    pthread_mutex_lock(&sLock);
+    if (!sInitialized) {
+        ret = FLP_RESULT_ERROR;
+    } else if (find_request(id)) {
+        ret = FLP_RESULT_ID_EXISTS;
+    } else {
+        for (i = 0; i < MAX_REQUESTS && !request; i++) {
+            if (!sRequests[i].active)
+                request = &sRequests[i];
+        }
+        if (!request) {
+            ret = FLP_RESULT_INSUFFICIENT_MEMORY;
+        } else {
+            request->active = true;
+            request->id = id;
+            request->options = *options;
+            update_config();
+        }
+    }
+    pthread_mutex_unlock(&sLock);
+    return ret;
+}
+
+static int sfdroid_flp_update_batching_options(int id, FlpBatchOptions* new_options)
+{
+    batch_request_t* request;
+    int ret = FLP_RESULT_SUCCESS;
+
+    pthread_mutex_lock(&sLock);
+    request = sInitialized ? find_request(id) : NULL;
+    if (!request) {
+        ret = FLP_RESULT_ID_UNKNOWN;
+    } else {
+        request->options = *new_options;
+        update_config();
+    }
+    pthread_mutex_unlock(&sLock);
+    return ret;
+}
+
+static int sfdroid_flp_stop_batching(int id)
+{
+    batch_request_t* request;
+    int ret = FLP_RESULT_SUCCESS;
+
+    pthread_mutex_lock(&sLock);
+    request = sInitialized ? find_request(id) : NULL;
+    if (!request) {
+        ret = FLP_RESULT_ID_UNKNOWN;
+    } else {
+        request->active = false;
+        update_config();
+    }
+    pthread_mutex_unlock(&sLock);
+    return ret;
+}
+
+static void sfdroid_flp_cleanup()
+{
+    pthread_mutex_lock(&sLock);
+    if (!sInitialized) {
+        pthread_mutex_unlock(&sLock);
+        return;
+    }
+    memset(sRequests, 0, sizeof(sRequests));
+    update_config();
+    sInitialized = false;
+    pthread_mutex_unlock(&sLock);
+
+    sfdroid_location_exit(&sLocation);
+    pthread_join(sThread, NULL);
+    sfdroid_location_destroy(&sLocation);
+}
+
+static void sfdroid_flp_get_batched_location(int last_n_locations)
+{
+    pthread_mutex_lock(&sLock);
+    if (sInitialized && last_n_locations > 0 &&
+            sfdroid_location_flush(&sLocation, last_n_locations) < 0)
+        ALOGW("no batched locations, the location daemon is not connected");
+    pthread_mutex_unlock(&sLock);
+}
+
+static int sfdroid_flp_inject_location(FlpLocation* location)
+{
+    /* the host fuses its own sources */
+    return FLP_RESULT_SUCCESS;
+}
+
+static const void* sfdroid_flp_get_extension(const char* name)
+{
+    return NULL;
+}
+
+static const FlpLocationInterface sFlpInterface = {
+    .size = sizeof(FlpLocationInterface),
+    .init = sfdroid_flp_init,
+    .get_batch_size = sfdroid_flp_get_batch_size,
+    .start_batching = sfdroid_flp_start_batching,
+    .update_batching_options = sfdroid_flp_update_batching_options,
+    .stop_batching = sfdroid_flp_stop_batching,
+    .cleanup = sfdroid_flp_cleanup,
+    .get_batched_location = sfdroid_flp_get_batched_location,
+    .inject_location = sfdroid_flp_inject_location,
+    .get_extension = sfdroid_flp_get_extension,
+};
+
+static const FlpLocationInterface* flp_get_interface(struct flp_device_t* dev)
+{
+    return &sFlpInterface;
+}
+
+static int close_flp(struct hw_device_t* dev)
+{
+    free(dev);
+    return 0;
+}
+
+static int open_flp(const struct hw_module_t* module, const char* name,
+        struct hw_device_t** device)
+{
+    struct flp_device_t* dev;
+
+    if (strcmp(name, FUSED_LOCATION_HARDWARE_MODULE_ID) != 0)
+        return -EINVAL;
+
+    dev = calloc(1, sizeof(struct flp_device_t));
+    if (!dev)
+        return -ENOMEM;
+
+    dev->common.tag = HARDWARE_DEVICE_TAG;
+    dev->common.version = FLP_DEVICE_API_VERSION_0_1;
+    dev->common.module = (struct hw_module_t*)module;
+    dev->common.close = close_flp;
+    dev->get_flp_interface = flp_get_interface;
+
+    *device = &dev->common;
+    return 0;
+}
+
+static struct hw_module_methods_t flp_module_methods = {
+    .open = open_flp,
+};
+
+struct hw_module_t HAL_MODULE_INFO_SYM = {
+    .tag = HARDWARE_MODULE_TAG,
+    .module_api_version = FLP_MODULE_API_VERSION_0_1,
+    .hal_api_version = HARDWARE_HAL_API_VERSION,
+    .id = FUSED_LOCATION_HARDWARE_MODULE_ID,
+    .name = "sfdroid Fused Location Module",
+    .author = "The Android Open Source Project",
+    .methods = &flp_module_methods,
+};
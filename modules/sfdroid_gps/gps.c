@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "sfdroid_gps"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cutils/log.h>
+#include <hardware/gps.h>
+#include <hardware/hardware.h>
+
+#include "sfdroid_location.h"
+
+/*
+ * GPS HAL of Android running on top of Sailfish: fixes come from the
+ * Sailfish location daemon, which schedules them itself at the interval
+ * of set_position_mode(). Batching is offered by the flp module next to
+ * this one.
+ */
+
+/* when set_position_mode() was not called */
+#define DEFAULT_INTERVAL_MS     1000
+
+static pthread_mutex_t sLock = PTHREAD_MUTEX_INITIALIZER;
+static GpsCallbacks sCallbacks;
+static bool sInitialized;
+static pthread_t sThread;
+static sfdroid_location_t sLocation;
+static uint32_t sIntervalMs = DEFAULT_INTERVAL_MS;
+static bool sSingleShot;
+static bool sNavigating;
+
+static void location_fixes(void* cookie, uint32_t type, const sfdroid_location_fix_t* fixes,
+        uint32_t count)
+{
+    GpsLocation location;
+    uint32_t i;
+
+    if (type != SFDROID_LOCATION_MSG_FIX)
+        return;
+
+    for (i = 0; i < count; i++) {
+        memset(&location, 0, sizeof(location));
+        location.size = sizeof(location);
+        location.flags = fixes[i].flags;
+        location.latitude = fixes[i].latitude;
+        location.longitude = fixes[i].longitude;
+        location.altitude = fixes[i].altitude;
+        location.speed = fixes[i].speed;
+        location.bearing = fixes[i].bearing;
+        location.accuracy = fixes[i].accuracy;
+        location.timestamp = fixes[i].timestamp_ms;
+        sCallbacks.location_cb(&location);
+    }
+
+    pthread_mutex_lock(&sLock);
+    if (sSingleShot && sNavigating) {
+        sNavigating = false;
+        sfdroid_location_configure(&sLocation, SFDROID_LOCATION_MODE_OFF, 0, 0, 0);
+    }
+    pthread_mutex_unlock(&sLock);
+}
+
+static void location_status(void* cookie, int32_t engine)
+{
+    GpsStatus status;
+
+    memset(&status, 0, sizeof(status));
+    status.size = sizeof(status);
+    status.status = engine == SFDROID_LOCATION_ENGINE_ON ? GPS_STATUS_ENGINE_ON :
+            GPS_STATUS_ENGINE_OFF;
+    sCallbacks.status_cb(&status);
+}
+
+static void location_thread(void* arg)
+{
+    sfdroid_location_run(&sLocation);
+}
+
+static void report_session(GpsStatusValue value)
+{
+    GpsStatus status;
+
+    memset(&status, 0, sizeof(status));
+    status.size = sizeof(status);
+    status.status = value;
+    sCallbacks.status_cb(&status);
+}
+
+static int sfdroid_gps_init(GpsCallbacks* callbacks)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&sLock);
+    if (sInitialized)
+        goto out;
+
+    sCallbacks = *callbacks;
+    ret = sfdroid_location_init(&sLocation, location_fixes, location_status, NULL);
+    if (ret < 0) {
+        ALOGE("failed to set up the location connection: %s", strerror(-ret));
+        goto out;
+    }
+    /* the daemon delivers fixes at the requested interval itself */
+    sCallbacks.set_capabilities_cb(GPS_CAPABILITY_SCHEDULING | GPS_CAPABILITY_SINGLE_SHOT);
+    sThread = sCallbacks.create_thread_cb("sfdroid_gps", location_thread, NULL);
+    if (!sThread) {
+        ALOGE("failed to create the location thread");
+        sfdroid_location_destroy(&sLocation);
+        ret = -1;
+        goto out;
+    }
+    sInitialized = true;
+
+out:
+    pthread_mutex_unlock(&sLock);
+    return ret;
+}
+
+static int sfdroid_gps_start(void)
+{
+    pthread_mutex_lock(&sLock);
+    if (!sInitialized) {
+        pthread_mutex_unlock(&sLock);
+        return -1;
+    }
+    sNavigating = true;
+    sfdroid_location_configure(&sLocation, SFDROID_LOCATION_MODE_TRACK, 0,
+            (int64_t)sIntervalMs * 1000000LL, 0);
+    pthread_mutex_unlock(&sLock);
+
+    report_session(GPS_STATUS_SESSION_BEGIN);
+    return 0;
+}
+
+static int sfdroid_gps_stop(void)
+{
+    pthread_mutex_lock(&sLock);
+    if (!sInitialized) {
+        pthread_mutex_unlock(&sLock);
+        return -1;
+    }
+    sNavigating = false;
+    sfdroid_location_configure(&sLocation, SFDROID_LOCATION_MODE_OFF, 0, 0, 0);
+    pthread_mutex_unlock(&sLock);
+
+    report_session(GPS_STATUS_SESSION_END);
+    return 0;
+}
+
+static void sfdroid_gps_cleanup(void)
+{
+    pthread_mutex_lock(&sLock);
+    if (!sInitialized) {
+        pthread_mutex_unlock(&sLock);
+        return;
+    }
+    sInitialized = false;
+    sNavigating = false;
+    pthread_mutex_unlock(&sLock);
+
+    sfdroid_location_exit(&sLocation);
+    pthread_join(sThread, NULL);
+    sfdroid_location_destroy(&sLocation);
+}
+
+static int sfdroid_gps_inject_time(GpsUtcTime time, int64_t timeReference, int uncertainty)
+{
+    /* the host keeps its own time */
+    return 0;
+}
+
+static int sfdroid_gps_inject_location(double latitude, double longitude, float accuracy)
+{
+    /* the host has its own network positioning */
+    return 0;
+}
+
+static void sfdroid_gps_delete_aiding_data(GpsAidingData flags)
+{
+}
+
+static int sfdroid_gps_set_position_mode(GpsPositionMode mode, GpsPositionRecurrence recurrence,
+        uint32_t min_interval, uint32_t preferred_accuracy, uint32_t preferred_time)
+{
+    pthread_mutex_lock(&sLock);
+    sIntervalMs = min_interval > 0 ? min_interval : DEFAULT_INTERVAL_MS;
+    sSingleShot = recurrence == GPS_POSITION_RECURRENCE_SINGLE;
+    if (sInitialized && sNavigating)
+        sfdroid_location_configure(&sLocation, SFDROID_LOCATION_MODE_TRACK, 0,
+                (int64_t)sIntervalMs * 1000000LL, 0);
+    pthread_mutex_unlock(&sLock);
+    return 0;
+}
+
+static const void* sfdroid_gps_get_extension(const char* name)
+{
+    return NULL;
+}
+
+static const GpsInterface sGpsInterface = {
+    .size = sizeof(GpsInterface),
+    .init = sfdroid_gps_init,
+    .start = sfdroid_gps_start,
+    .stop = sfdroid_gps_stop,
+    .cleanup = sfdroid_gps_cleanup,
+    .inject_time = sfdroid_gps_inject_time,
+    .inject_location = sfdroid_gps_inject_location,
+    .delete_aiding_data = sfdroid_gps_delete_aiding_data,
+    .set_position_mode = sfdroid_gps_set_position_mode,
+    .get_extension = sfdroid_gps_get_extension,
+};
+
+static const GpsInterface* gps_get_interface(struct gps_device_t* dev)
+{
+    return &sGpsInterface;
+}
+
+static int close_gps(struct hw_device_t* dev)
+{
+    free(dev);
+    return 0;
+}
+
+static int open_gps(const struct hw_module_t* module, const char* name,
+        struct hw_device_t** device)
+{
+    struct gps_device_t* dev;
+
+    if (strcmp(name, GPS_HARDWARE_MODULE_ID) != 0)
+        return -EINVAL;
+
+    dev = calloc(1, sizeof(struct gps_device_t));
+    if (!dev)
+        return -ENOMEM;
+
+    dev->common.tag = HARDWARE_DEVICE_TAG;
+    dev->common.version = 0;
+    dev->common.module = (struct hw_module_t*)module;
+    dev->common.close = close_gps;
+    dev->get_gps_interface = gps_get_interface;
+
+    *device = &dev->common;
+    return 0;
+}
+
+static struct hw_module_methods_t gps_module_methods = {
+    .open = open_gps,
+};
+
+struct hw_module_t HAL_MODULE_INFO_SYM = {
+    .tag = HARDWARE_MODULE_TAG,
+    .module_api_version = 1,
+    .hal_api_version = 0,
+    .id = GPS_HARDWARE_MODULE_ID,
+    .name = "sfdroid GPS Module",
+    .author = "The Android Open Source Project",
+    .methods = &gps_module_methods,
+};
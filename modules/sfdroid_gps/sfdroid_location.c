@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "sfdroid_location"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <cutils/log.h>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "sfdroid_location.h"
+
+/* between reconnection attempts while the daemon is not up */
+#define RECONNECT_MIN_MS    1000
+#define RECONNECT_MAX_MS    60000
+/* the rest of a message follows its header at once */
+#define RECV_TIMEOUT_MS     1000
+
+int sfdroid_location_init(sfdroid_location_t* loc, sfdroid_location_fixes_cb fixes_cb,
+        sfdroid_location_status_cb status_cb, void* cookie)
+{
+    memset(loc, 0, sizeof(*loc));
+    loc->fixes_cb = fixes_cb;
+    loc->status_cb = status_cb;
+    loc->cookie = cookie;
+    loc->fd = -1;
+    loc->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (loc->wake_fd < 0)
+        return -errno;
+    pthread_mutex_init(&loc->lock, NULL);
+    loc->config.magic = SFDROID_LOCATION_MAGIC;
+    loc->config.op = SFDROID_LOCATION_OP_CONFIGURE;
+    loc->config.mode = SFDROID_LOCATION_MODE_OFF;
+    sfdroid_ipc_backoff_init(&loc->backoff, RECONNECT_MIN_MS, RECONNECT_MAX_MS);
+    return 0;
+}
+
+void sfdroid_location_destroy(sfdroid_location_t* loc)
+{
+    if (loc->fd >= 0)
+        close(loc->fd);
+    close(loc->wake_fd);
+    pthread_mutex_destroy(&loc->lock);
+}
+
+static void wake(sfdroid_location_t* loc)
+{
+    uint64_t one = 1;
+    write(loc->wake_fd, &one, sizeof(one));
+}
+
+/* with loc->lock held */
+static int send_request(sfdroid_location_t* loc, const sfdroid_location_request_t* req)
+{
+    struct iovec iov;
+
+    if (loc->fd < 0)
+        return -1;
+    iov.iov_base = (void*)req;
+    iov.iov_len = sizeof(*req);
+    if (sfdroid_ipc_send(loc->fd, &iov, 1, NULL, 0) < 0) {
+        ALOGE("failed to send request: %s", strerror(errno));
+        /* the run thread sees the hang up and reconnects */
+        shutdown(loc->fd, SHUT_RDWR);
+        return -1;
+    }
+    return 0;
+}
+
+void sfdroid_location_configure(sfdroid_location_t* loc, uint32_t mode, uint32_t flags,
+        int64_t interval_ns, uint32_t sources)
+{
+    pthread_mutex_lock(&loc->lock);
+    if (loc->config.mode != mode || loc->config.flags != flags ||
+            loc->config.interval_ns != interval_ns || loc->config.sources != sources) {
+        loc->config.mode = mode;
+        loc->config.flags = flags;
+        loc->config.interval_ns = interval_ns;
+        loc->config.sources = sources;
+        if (loc->fd >= 0)
+            send_request(loc, &loc->config);
+        else
+            wake(loc);
+    }
+    pthread_mutex_unlock(&loc->lock);
+}
+
+int sfdroid_location_flush(sfdroid_location_t* loc, uint32_t count)
+{
+    sfdroid_location_request_t req;
+    int ret;
+
+    memset(&req, 0, sizeof(req));
+    req.magic = SFDROID_LOCATION_MAGIC;
+    req.op = SFDROID_LOCATION_OP_FLUSH;
+    req.count = count;
+
+    pthread_mutex_lock(&loc->lock);
+    ret = send_request(loc, &req);
+    pthread_mutex_unlock(&loc->lock);
+    return ret;
+}
+
+uint32_t sfdroid_location_batch_capacity(sfdroid_location_t* loc)
+{
+    uint32_t capacity;
+
+    pthread_mutex_lock(&loc->lock);
+    capacity = loc->batch_capacity;
+    pthread_mutex_unlock(&loc->lock);
+    return capacity;
+}
+
+void sfdroid_location_exit(sfdroid_location_t* loc)
+{
+    pthread_mutex_lock(&loc->lock);
+    loc->exiting = true;
+    wake(loc);
+    pthread_mutex_unlock(&loc->lock);
+}
+
+static void disconnect(sfdroid_location_t* loc)
+{
+    pthread_mutex_lock(&loc->lock);
+    if (loc->fd >= 0)
+        close(loc->fd);
+    loc->fd = -1;
+    pthread_mutex_unlock(&loc->lock);
+}
+
+/* Returns 0 once connected and configured */
+static int connect_daemon(sfdroid_location_t* loc)
+{
+    int fd = sfdroid_ipc_connect(SFDROID_LOCATION_SOCKET_NAME, RECV_TIMEOUT_MS);
+    int ret;
+
+    if (fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&loc->lock);
+    loc->fd = fd;
+    ret = send_request(loc, &loc->config);
+    pthread_mutex_unlock(&loc->lock);
+    if (ret < 0) {
+        disconnect(loc);
+        return -1;
+    }
+
+    sfdroid_ipc_backoff_reset(&loc->backoff);
+    ALOGI("connected to the location daemon");
+    return 0;
+}
+
+/* Receive and deliver one message. Returns 0, or -1 if the connection is lost. */
+static int handle_message(sfdroid_location_t* loc)
+{
+    sfdroid_location_msg_t msg;
+    int num_fds;
+
+    if (sfdroid_ipc_recv(loc->fd, &msg, sizeof(msg), NULL, 0, &num_fds) < 0) {
+        ALOGE("lost the location daemon: %s", strerror(errno));
+        return -1;
+    }
+    if (msg.magic != SFDROID_LOCATION_MAGIC || msg.count > SFDROID_LOCATION_MAX_FIXES) {
+        ALOGE("bad message from the location daemon");
+        return -1;
+    }
+    if (msg.count > 0 && sfdroid_ipc_recv(loc->fd, loc->fixes,
+                msg.count * sizeof(loc->fixes[0]), NULL, 0, &num_fds) < 0) {
+        ALOGE("lost the location daemon: %s", strerror(errno));
+        return -1;
+    }
+
+    switch (msg.type) {
+    case SFDROID_LOCATION_MSG_REPLY:
+        if (msg.status != 0)
+            ALOGE("location daemon refused the configuration: %d", msg.status);
+        pthread_mutex_lock(&loc->lock);
+        loc->batch_capacity = msg.batch_capacity;
+        pthread_mutex_unlock(&loc->lock);
+        break;
+    case SFDROID_LOCATION_MSG_FIX:
+    case SFDROID_LOCATION_MSG_BATCH:
+        loc->fixes_cb(loc->cookie, msg.type, loc->fixes, msg.count);
+        break;
+    case SFDROID_LOCATION_MSG_STATUS:
+        if (loc->status_cb)
+            loc->status_cb(loc->cookie, msg.status);
+        break;
+    default:
+        /* from a later version, skipped */
+        break;
+    }
+    return 0;
+}
+
+void sfdroid_location_run(sfdroid_location_t* loc)
+{
+    struct pollfd pfd[2];
+    int timeout_ms;
+
+    for (;;) {
+        uint64_t count;
+        bool exiting, wanted;
+
+        pthread_mutex_lock(&loc->lock);
+        exiting = loc->exiting;
+        wanted = loc->config.mode != SFDROID_LOCATION_MODE_OFF;
+        pthread_mutex_unlock(&loc->lock);
+        if (exiting)
+            break;
+
+        /*
+         * Only connect while the module wants fixes, so that an idle HAL
+         * never wakes up to retry; once connected, stay so and block until
+         * the daemon has something to say.
+         */
+        timeout_ms = -1;
+        if (loc->fd < 0 && wanted && connect_daemon(loc) < 0)
+            timeout_ms = sfdroid_ipc_backoff_next(&loc->backoff);
+
+        pfd[0].fd = loc->wake_fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = loc->fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        if (poll(pfd, loc->fd >= 0 ? 2 : 1, timeout_ms) <= 0)
+            continue;
+
+        if (pfd[0].revents & POLLIN)
+            read(loc->wake_fd, &count, sizeof(count));
+        if (pfd[1].revents && handle_message(loc) < 0)
+            disconnect(loc);
+    }
+
+    disconnect(loc);
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFDROID_LOCATION_H_
+#define SFDROID_LOCATION_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include "sfdroid_ipc.h"
+#include "sfdroid_location_protocol.h"
+
+__BEGIN_DECLS
+
+/*
+ * Connection to the location daemon shared by the gps and flp modules,
+ * see sfdroid_location_protocol.h. The module runs sfdroid_location_run()
+ * on a thread of its own, created the way its framework wants, and
+ * changes the configuration from any thread.
+ */
+
+/* fixes of a SFDROID_LOCATION_MSG_FIX or _BATCH, called on the run thread */
+typedef void (*sfdroid_location_fixes_cb)(void* cookie, uint32_t type,
+        const sfdroid_location_fix_t* fixes, uint32_t count);
+/* SFDROID_LOCATION_ENGINE_* from the daemon, called on the run thread */
+typedef void (*sfdroid_location_status_cb)(void* cookie, int32_t status);
+
+typedef struct sfdroid_location_t {
+    sfdroid_location_fixes_cb fixes_cb;
+    sfdroid_location_status_cb status_cb;
+    void* cookie;
+
+    /* protects everything below but fixes */
+    pthread_mutex_t lock;
+    /* the socket, -1 while disconnected */
+    int fd;
+    /* wakes up the run thread, for a new configuration or to exit */
+    int wake_fd;
+    bool exiting;
+    /* what the module wants, sent on every connection */
+    sfdroid_location_request_t config;
+    /* of the daemon, 0 until the first reply */
+    uint32_t batch_capacity;
+    sfdroid_ipc_backoff_t backoff;
+
+    /* run thread only */
+    sfdroid_location_fix_t fixes[SFDROID_LOCATION_MAX_FIXES];
+} sfdroid_location_t;
+
+/* Returns 0, or -errno */
+int sfdroid_location_init(sfdroid_location_t* loc, sfdroid_location_fixes_cb fixes_cb,
+        sfdroid_location_status_cb status_cb, void* cookie);
+void sfdroid_location_destroy(sfdroid_location_t* loc);
+
+/*
+ * Thread body: while the configured mode is not off, stay connected and
+ * deliver what the daemon sends. Returns after sfdroid_location_exit().
+ */
+void sfdroid_location_run(sfdroid_location_t* loc);
+void sfdroid_location_exit(sfdroid_location_t* loc);
+
+/* Set the configuration, mode SFDROID_LOCATION_MODE_* */
+void sfdroid_location_configure(sfdroid_location_t* loc, uint32_t mode, uint32_t flags,
+        int64_t interval_ns, uint32_t sources);
+/* Ask for the latest count batched fixes. Returns 0, or -1 if not connected. */
+int sfdroid_location_flush(sfdroid_location_t* loc, uint32_t count);
+/* Size of the daemon's batching FIFO, 0 if never connected */
+uint32_t sfdroid_location_batch_capacity(sfdroid_location_t* loc);
+
+__END_DECLS
+
+#endif /* SFDROID_LOCATION_H_ */
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFDROID_LOCATION_PROTOCOL_H_
+#define SFDROID_LOCATION_PROTOCOL_H_
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * Protocol between the sfdroid location HALs (gps, flp) and the location
+ * bridge of the Sailfish location daemon, on the socket
+ * SFDROID_LOCATION_SOCKET_NAME in /tmp/sfdroid.
+ *
+ * Every HAL has a connection of its own and sends the whole state it
+ * wants in a sfdroid_location_request_t with SFDROID_LOCATION_OP_CONFIGURE,
+ * again after every change and on every new connection; the daemon
+ * answers with a SFDROID_LOCATION_MSG_REPLY. Everything the daemon sends
+ * is a sfdroid_location_msg_t followed by count sfdroid_location_fix_t.
+ *
+ * In SFDROID_LOCATION_MODE_TRACK every fix is sent as it comes, in a
+ * SFDROID_LOCATION_MSG_FIX. In SFDROID_LOCATION_MODE_BATCH the daemon
+ * keeps the fixes in a FIFO of batch_capacity fixes, dropping the oldest
+ * when full, and sends nothing until asked: the point of batching is that
+ * the Android side sleeps through it. With SFDROID_LOCATION_BATCH_WAKEUP
+ * it sends the whole FIFO in a SFDROID_LOCATION_MSG_BATCH once full, with
+ * SFDROID_LOCATION_BATCH_EVERY_FIX it also sends every fix as in TRACK.
+ * SFDROID_LOCATION_OP_FLUSH is answered with a SFDROID_LOCATION_MSG_BATCH
+ * of the latest request.count fixes, which stay in the FIFO.
+ */
+#define SFDROID_LOCATION_SOCKET_NAME    "location_handle"
+
+#define SFDROID_LOCATION_MAGIC      0x53464c4f  /* 'SFLO' */
+#define SFDROID_LOCATION_VERSION    1
+
+/* most fixes in one message */
+#define SFDROID_LOCATION_MAX_FIXES  1024
+
+/* sfdroid_location_request_t.op */
+#define SFDROID_LOCATION_OP_CONFIGURE   1
+#define SFDROID_LOCATION_OP_FLUSH       2
+
+/* sfdroid_location_request_t.mode */
+#define SFDROID_LOCATION_MODE_OFF       0
+#define SFDROID_LOCATION_MODE_TRACK     1
+#define SFDROID_LOCATION_MODE_BATCH     2
+
+/* sfdroid_location_request_t.flags, in SFDROID_LOCATION_MODE_BATCH */
+#define SFDROID_LOCATION_BATCH_WAKEUP       0x01
+#define SFDROID_LOCATION_BATCH_EVERY_FIX    0x02
+
+/* sfdroid_location_msg_t.type */
+#define SFDROID_LOCATION_MSG_REPLY      0
+#define SFDROID_LOCATION_MSG_FIX        1
+#define SFDROID_LOCATION_MSG_BATCH      2
+/* status is SFDROID_LOCATION_ENGINE_*, count 0 */
+#define SFDROID_LOCATION_MSG_STATUS     3
+
+#define SFDROID_LOCATION_ENGINE_OFF     0
+#define SFDROID_LOCATION_ENGINE_ON      1
+
+/* sfdroid_location_fix_t.flags, the values of GPS_LOCATION_HAS_* */
+#define SFDROID_LOCATION_HAS_LAT_LONG   0x0001
+#define SFDROID_LOCATION_HAS_ALTITUDE   0x0002
+#define SFDROID_LOCATION_HAS_SPEED      0x0004
+#define SFDROID_LOCATION_HAS_BEARING    0x0008
+#define SFDROID_LOCATION_HAS_ACCURACY   0x0010
+
+typedef struct sfdroid_location_request_t {
+    uint32_t magic;
+    /* SFDROID_LOCATION_OP_* */
+    uint32_t op;
+    /* SFDROID_LOCATION_MODE_*, with OP_CONFIGURE */
+    uint32_t mode;
+    /* SFDROID_LOCATION_BATCH_*, with OP_CONFIGURE */
+    uint32_t flags;
+    /* between fixes, with OP_CONFIGURE */
+    int64_t interval_ns;
+    /* FLP_TECH_MASK_* bits the fixes may come from, 0 for any */
+    uint32_t sources;
+    /* fixes to send, with OP_FLUSH */
+    uint32_t count;
+} sfdroid_location_request_t;
+
+typedef struct sfdroid_location_msg_t {
+    uint32_t magic;
+    /* SFDROID_LOCATION_MSG_* */
+    uint32_t type;
+    /* sfdroid_location_fix_t following */
+    uint32_t count;
+    /* 0 or -errno in a reply, SFDROID_LOCATION_ENGINE_* in a status */
+    int32_t status;
+    /* size of the FIFO of SFDROID_LOCATION_MODE_BATCH, in a reply */
+    uint32_t batch_capacity;
+    uint32_t reserved;
+} sfdroid_location_msg_t;
+
+typedef struct sfdroid_location_fix_t {
+    /* SFDROID_LOCATION_HAS_* */
+    uint32_t flags;
+    /* FLP_TECH_MASK_* bits of the sources used */
+    uint32_t sources;
+    /* degrees */
+    double latitude;
+    double longitude;
+    /* meters above the WGS 84 ellipsoid */
+    double altitude;
+    /* meters per second, degrees and meters */
+    float speed;
+    float bearing;
+    float accuracy;
+    uint32_t reserved;
+    /* milliseconds since the epoch */
+    int64_t timestamp_ms;
+} sfdroid_location_fix_t;
+
+__END_DECLS
+
+#endif /* SFDROID_LOCATION_PROTOCOL_H_ */
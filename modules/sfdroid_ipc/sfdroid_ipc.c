@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "sfdroid_ipc"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <cutils/ashmem.h>
+#include <cutils/log.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "sfdroid_ipc.h"
+
+/* more than any bridge sends in one message, see SB_BATCH_MAX_FDS */
+#define MAX_FDS     253
+#define MAX_IOV     16
+
+int sfdroid_ipc_connect(const char* name, int recv_timeout_ms)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", SFDROID_IPC_ROOT, name) >=
+            (int)sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        ALOGE("error creating socket stream: %s", strerror(errno));
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    if (recv_timeout_ms > 0) {
+        struct timeval timeout;
+
+        timeout.tv_sec = recv_timeout_ms / 1000;
+        timeout.tv_usec = (recv_timeout_ms % 1000) * 1000;
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+            ALOGE("failed to set timeout on %s: %s", addr.sun_path, strerror(errno));
+    }
+
+    return fd;
+}
+
+int sfdroid_ipc_send(int fd, const struct iovec* iov, int iovcnt,
+        const int* fds, int num_fds)
+{
+    struct iovec rest[MAX_IOV];
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    struct msghdr msg;
+    int first = 0;
+
+    if (iovcnt > MAX_IOV || num_fds > MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(rest, iov, sizeof(rest[0]) * iovcnt);
+
+    memset(&msg, 0, sizeof(msg));
+    if (num_fds > 0) {
+        struct cmsghdr* cmsg;
+
+        memset(control, 0, CMSG_SPACE(sizeof(int) * num_fds));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+    }
+
+    while (first < iovcnt) {
+        ssize_t sent;
+
+        msg.msg_iov = rest + first;
+        msg.msg_iovlen = iovcnt - first;
+        sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        /* the fds went with the first byte */
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+
+        while (first < iovcnt && (size_t)sent >= rest[first].iov_len) {
+            sent -= rest[first].iov_len;
+            first++;
+        }
+        if (first < iovcnt) {
+            rest[first].iov_base = (char*)rest[first].iov_base + sent;
+            rest[first].iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
+
+int sfdroid_ipc_recv(int fd, void* buf, size_t len, int* fds, int max_fds, int* num_fds)
+{
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    size_t done = 0;
+
+    *num_fds = 0;
+    while (done < len) {
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr* cmsg;
+        ssize_t received;
+
+        iov.iov_base = (char*)buf + done;
+        iov.iov_len = len - done;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        received = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (received < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (received == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            int* received_fds = (int*)CMSG_DATA(cmsg);
+            int i, count;
+
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (i = 0; i < count; i++) {
+                if (*num_fds < max_fds)
+                    fds[(*num_fds)++] = received_fds[i];
+                else
+                    close(received_fds[i]);
+            }
+        }
+        done += received;
+    }
+
+    return 0;
+}
+
+void* sfdroid_ipc_shm_create(const char* name, size_t size, int* fd)
+{
+    void* base;
+    int err;
+
+    *fd = ashmem_create_region(name, size);
+    if (*fd < 0)
+        return NULL;
+
+    base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (base == MAP_FAILED) {
+        err = errno;
+        close(*fd);
+        *fd = -1;
+        errno = err;
+        return NULL;
+    }
+
+    memset(base, 0, size);
+    return base;
+}
+
+void sfdroid_ipc_backoff_init(sfdroid_ipc_backoff_t* backoff, int32_t min_ms, int32_t max_ms)
+{
+    backoff->min_ms = min_ms;
+    backoff->max_ms = max_ms;
+    backoff->delay_ms = 0;
+}
+
+int32_t sfdroid_ipc_backoff_next(sfdroid_ipc_backoff_t* backoff)
+{
+    if (backoff->delay_ms == 0)
+        backoff->delay_ms = backoff->min_ms;
+    else if (backoff->delay_ms < backoff->max_ms)
+        backoff->delay_ms *= 2;
+    if (backoff->delay_ms > backoff->max_ms)
+        backoff->delay_ms = backoff->max_ms;
+
+    return backoff->delay_ms;
+}
+
+void sfdroid_ipc_backoff_reset(sfdroid_ipc_backoff_t* backoff)
+{
+    backoff->delay_ms = 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFDROID_IPC_H_
+#define SFDROID_IPC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+#include <sys/uio.h>
+
+__BEGIN_DECLS
+
+/*
+ * Transport shared by the sfdroid bridges (sharebuffer, sfdroid_sensors, the cameras):
+ * the unix sockets the Sailfish side listens on, fd passing, shared
+ * memory regions and the reconnection policy. Everything here is safe to
+ * call from any thread and never raises SIGPIPE.
+ */
+
+/* where the Sailfish side creates its sockets */
+#define SFDROID_IPC_ROOT    "/tmp/sfdroid"
+
+/*
+ * Connect to the socket <name> in SFDROID_IPC_ROOT. Receives time out
+ * after recv_timeout_ms, 0 for never. Returns the close-on-exec socket,
+ * or -1 with errno set.
+ */
+int sfdroid_ipc_connect(const char* name, int recv_timeout_ms);
+
+/*
+ * Send the iovcnt buffers of iov as a single message, with the num_fds
+ * fds attached to its first byte. Partial writes and EINTR are handled,
+ * the fds are only sent once. Returns 0 once everything was sent, -1
+ * with errno set otherwise, in which case the stream is out of sync.
+ */
+int sfdroid_ipc_send(int fd, const struct iovec* iov, int iovcnt,
+        const int* fds, int num_fds);
+
+/*
+ * Receive exactly len bytes into buf, and the fds attached to them: up to
+ * max_fds are stored in fds and their number in *num_fds, any more are
+ * closed. Returns 0 once len bytes were received, -1 with errno set
+ * otherwise, ECONNRESET if the peer hung up.
+ */
+int sfdroid_ipc_recv(int fd, void* buf, size_t len, int* fds, int max_fds, int* num_fds);
+
+/*
+ * Create a zeroed shared memory region of size bytes named <name> and map
+ * it in. Returns the mapping and the ashmem fd to pass to the peer in
+ * *fd, or NULL with errno set.
+ */
+void* sfdroid_ipc_shm_create(const char* name, size_t size, int* fd);
+
+/*
+ * Exponential backoff between reconnection attempts while the peer is
+ * not up, from min_ms doubling up to max_ms.
+ */
+typedef struct sfdroid_ipc_backoff_t {
+    int32_t min_ms;
+    int32_t max_ms;
+    /* 0 until the first failed attempt */
+    int32_t delay_ms;
+} sfdroid_ipc_backoff_t;
+
+void sfdroid_ipc_backoff_init(sfdroid_ipc_backoff_t* backoff, int32_t min_ms, int32_t max_ms);
+
+/* the delay before the next attempt, after one more failed */
+int32_t sfdroid_ipc_backoff_next(sfdroid_ipc_backoff_t* backoff);
+
+/* after a successful connection */
+void sfdroid_ipc_backoff_reset(sfdroid_ipc_backoff_t* backoff);
+
+__END_DECLS
+
+#endif /* SFDROID_IPC_H_ */
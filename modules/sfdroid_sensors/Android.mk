@@ -20,8 +20,10 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
-LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_SHARED_LIBRARIES := liblog libcutils libhardware
+LOCAL_STATIC_LIBRARIES := libsfdroid_ipc
 LOCAL_SRC_FILES := sfdroid_sensors.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../sfdroid_ipc
 ifeq ($(TARGET_PRODUCT),vbox_x86)
 LOCAL_MODULE := sfdroid_sensors.vbox_x86
 else
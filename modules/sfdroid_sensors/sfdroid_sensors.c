@@ -19,58 +19,36 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <cutils/atomic.h>
 #include <cutils/log.h>
 #include <cutils/native_handle.h>
+#include <cutils/properties.h>
 #include <cutils/sockets.h>
+#include <hardware/hal_trace.h>
 #include <hardware/sensors.h>
 
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/un.h>
 
-#define SFDROID_ROOT "/tmp/sfdroid"
-#define SENSORS_HANDLE_FILE (SFDROID_ROOT "/sensors_handle")
+#include "sfdroid_ipc.h"
+#include "sfdroid_sensors_protocol.h"
 
-int connect_to_sfdroid()
-{
-    struct sockaddr_un addr;
-    int fd;
-
-    fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if(fd < 0)
-    {
-        ALOGE("error creating socket stream");
-        return -1;
-    }
-
-    // don't crash if we disconnect
-    //int set = 1;
-    //setsockopt(sd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(int));
-    signal(SIGPIPE, SIG_IGN);
+#define SENSORS_SOCKET_NAME "sensors_handle"
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SENSORS_HANDLE_FILE, sizeof(addr.sun_path)-1);
+/* the daemon answers every request well within this */
+#define SENSORS_RECV_TIMEOUT_MS 1000
 
-    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
-    {
-        //ALOGE("error connecting to sfdroidsensors: %s", strerror(errno));
-        usleep(2000000);
-        close(fd);
-        return -1;
-    }
-
-    struct timeval timeout;
-    memset(&timeout, 0, sizeof(timeout));
-
-    timeout.tv_sec = 1;
-
-    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout)) < 0)
-    {
-        ALOGE("failed to set timeout on sensor socket: %s", strerror(errno));
-    }
-
-    return fd;
+int connect_to_sfdroid()
+{
+    return sfdroid_ipc_connect(SENSORS_SOCKET_NAME, SENSORS_RECV_TIMEOUT_MS);
 }
 
 #if 0
@@ -84,37 +62,47 @@ int connect_to_sfdroid()
 /** SENSOR IDS AND NAMES
  **/
 
-#define MAX_NUM_SENSORS 5
+#define MAX_NUM_SENSORS 7
 
 #define SUPPORTED_SENSORS  ((1<<MAX_NUM_SENSORS)-1)
 
-#define  ID_BASE           SENSORS_HANDLE_BASE
-#define  ID_ACCELERATION   (ID_BASE+0)
-#define  ID_MAGNETIC_FIELD (ID_BASE+1)
-#define  ID_ORIENTATION    (ID_BASE+2)
-#define  ID_TEMPERATURE    (ID_BASE+3)
-#define  ID_PROXIMITY      (ID_BASE+4)
-
-#define  SENSORS_ACCELERATION   (1 << ID_ACCELERATION)
-#define  SENSORS_MAGNETIC_FIELD  (1 << ID_MAGNETIC_FIELD)
-#define  SENSORS_ORIENTATION     (1 << ID_ORIENTATION)
-#define  SENSORS_TEMPERATURE     (1 << ID_TEMPERATURE)
-#define  SENSORS_PROXIMITY       (1 << ID_PROXIMITY)
+#define  ID_BASE             SENSORS_HANDLE_BASE
+#define  ID_ACCELERATION     (ID_BASE+0)
+#define  ID_MAGNETIC_FIELD   (ID_BASE+1)
+#define  ID_ORIENTATION      (ID_BASE+2)
+#define  ID_GYROSCOPE        (ID_BASE+3)
+#define  ID_LIGHT            (ID_BASE+4)
+#define  ID_PROXIMITY        (ID_BASE+5)
+#define  ID_ROTATION_VECTOR  (ID_BASE+6)
 
 #define  ID_CHECK(x)  ((unsigned)((x)-ID_BASE) < MAX_NUM_SENSORS)
 
+/* SENSORS_* bit per handle the daemon has, see load_sensor_list() */
+static uint32_t sSensorsPresent = SUPPORTED_SENSORS;
+
+#define  ID_PRESENT(x)  (ID_CHECK(x) && (sSensorsPresent & (1 << ((x)-ID_BASE))))
+
+/*
+ * handle, name used in commands and events, name of the legacy "get:"
+ * request, SENSOR_TYPE_*, number of values in an event
+ */
 #define  SENSORS_LIST  \
-    SENSOR_(ACCELERATION,"acceleration") \
-    SENSOR_(MAGNETIC_FIELD,"magnetic-field") \
-    SENSOR_(ORIENTATION,"orientation") \
-    SENSOR_(TEMPERATURE,"temperature") \
-    SENSOR_(PROXIMITY,"proximity") \
+    SENSOR_(ACCELERATION,"acceleration","accelerometer",ACCELEROMETER,3) \
+    SENSOR_(MAGNETIC_FIELD,"magnetic-field","magnetic-field",MAGNETIC_FIELD,3) \
+    SENSOR_(ORIENTATION,"orientation","orientation",ORIENTATION,3) \
+    SENSOR_(GYROSCOPE,"gyroscope","gyroscope",GYROSCOPE,3) \
+    SENSOR_(LIGHT,"light","light",LIGHT,1) \
+    SENSOR_(PROXIMITY,"proximity","proximity",PROXIMITY,1) \
+    SENSOR_(ROTATION_VECTOR,"rotation-vector","rotation-vector",ROTATION_VECTOR,5) \
 
 static const struct {
     const char*  name;
-    int          id; } _sensorIds[MAX_NUM_SENSORS] =
+    const char*  query;
+    int          id;
+    int          type;
+    int          num_values; } _sensorIds[MAX_NUM_SENSORS] =
 {
-#define SENSOR_(x,y)  { y, ID_##x },
+#define SENSOR_(x,y,q,t,n)  { y, q, ID_##x, SENSOR_TYPE_##t, n },
     SENSORS_LIST
 #undef  SENSOR_
 };
@@ -144,209 +132,1525 @@ _sensorIdFromName( const char*  name )
     return -1;
 }
 
+static int
+_sensorIdFromType( int  type )
+{
+    int  nn;
+
+    for (nn = 0; nn < MAX_NUM_SENSORS; nn++)
+        if (type == _sensorIds[nn].type)
+            return _sensorIds[nn].id;
+
+    return -1;
+}
+
 /** SENSORS POLL DEVICE
  **/
 
+#define COMMAND_QUEUE_SIZE      32
+
+/* a control request, see sfdroid_sensors_protocol.h */
+typedef struct SensorCommand {
+    /* SFDROID_MSG_* */
+    int                           type;
+    /* handle, -1 for requests that aren't about a sensor */
+    int                           id;
+    int64_t                       arg[2];
+} SensorCommand;
+
+/* a decoded message from the daemon, whichever the framing */
+typedef struct SensorMessage {
+    /* SFDROID_MSG_*, 0 for anything not understood */
+    int                           type;
+    int64_t                       arg[2];
+    /* for SFDROID_MSG_EVENT, the timestamp still on the daemon's clock */
+    sfdroid_sensor_event_t        event;
+    /* for SFDROID_MSG_SENSOR */
+    sfdroid_sensor_info_t         info;
+} SensorMessage;
+
+/* between reconnection attempts while the daemon is not up */
+#define RECONNECT_MIN_MS        100
+#define RECONNECT_MAX_MS        2000
+
 typedef struct SensorPoll {
-    struct sensors_poll_device_t  device;
+    struct sensors_poll_device_1  device;
     int                           fd;
-    int64_t                       delay;
-    int                           accelerometer_active;
+    /* per handle, indexed by id - ID_BASE */
+    int64_t                       delay[MAX_NUM_SENSORS];
+    /* SENSORS_* bit per active handle */
+    uint32_t                      active;
+    /* next sensor to request from a daemon that doesn't stream */
+    int                           next_query;
+
+    /* shared memory event ring, NULL if the daemon doesn't support it */
+    sfdroid_sensor_ring_t*        ring;
+    int                           ring_fd;
+    int                           event_fd;
+    int32_t                       ring_dropped;
+    /* events the daemon dropped since the last poll() took note */
+    int32_t                       ring_dropped_new;
+    /* the daemon didn't answer the ring setup, don't offer it again */
+    int                           ring_unsupported;
+
+    /* messages are binary frames instead of ASCII, see binary_setup() */
+    int                           binary;
+    int                           binary_unsupported;
+
+    /* the daemon pushes events on the socket, see stream_setup() */
+    int                           streaming;
+    int                           stream_unsupported;
+    char                          rx[4096];
+    int                           rx_len;
+
+    /* the daemon FIFOs events and reports flushes, see batch() */
+    int                           batch_supported;
+    /* flush completions poll() still has to report, per handle */
+    int                           pending_flushes[MAX_NUM_SENSORS];
+
+    /* written by activate() to wake up poll() */
+    int                           wake_fd;
+
+    /*
+     * daemon clock to CLOCK_BOOTTIME, see clock_setup(). Set up by the
+     * manager before the connection is published, then updated by poll()
+     * as the answers to later pings come in. Written with lock held;
+     * poll() reads them without, as nobody else writes them while it has
+     * a connection to read.
+     */
+    int                           clock_supported;
+    int                           clock_unsupported;
+    /* add to a daemon timestamp to get CLOCK_BOOTTIME */
+    int64_t                       clock_offset;
+    /* half the round trip of the ping the offset comes from */
+    int64_t                       clock_error;
+    /* mean deviation of the measured offsets from clock_offset */
+    int64_t                       clock_jitter;
+    struct {
+        int64_t offset;
+        int64_t rtt;
+    }                             clock_samples[SFDROID_CLOCK_SAMPLES];
+    int                           clock_num_samples;
+    int                           clock_next_sample;
+    /* timestamps reported last, per handle, kept increasing */
+    int64_t                       last_timestamp[MAX_NUM_SENSORS];
+
+    /*
+     * Decimation of what the daemon sends to the rate asked for, see
+     * rate_limit(). Owned by poll(), which takes the periods from delay
+     * and the handles to start over for from rate_reset before reading.
+     * Like the periods, poll_active is its copy of active: poll() never
+     * reads what the control calls write without holding lock.
+     */
+    uint32_t                      poll_active;
+    int64_t                       rate_period[MAX_NUM_SENSORS];
+    /* daemon timestamp and values of the event delivered last, 0 if none */
+    int64_t                       rate_last[MAX_NUM_SENSORS];
+    float                         rate_values[MAX_NUM_SENSORS][5];
+    /* events dropped since the last poll() took note */
+    int                           rate_dropped_new;
+
+    /*
+     * The connection is owned by the manager thread, which connects,
+     * reconnects with backoff and sends the queued control commands.
+     * poll() only reads while connected, flagging it in reading so that
+     * the manager retires a broken connection only once poll() let go.
+     * Everything below and the fields above except rx are protected by
+     * lock.
+     */
+    pthread_mutex_t               lock;
+    /* connected, reading or active changed */
+    pthread_cond_t                state_cond;
+    /* a command was queued, or the connection broke */
+    pthread_cond_t                cmd_cond;
+    pthread_t                     manager;
+    int                           exiting;
+    int                           connected;
+    int                           reading;
+    SensorCommand                 commands[COMMAND_QUEUE_SIZE];
+    int                           command_head;
+    int                           command_count;
+    /* the queue overflowed, resend the whole state instead */
+    int                           resync;
+    /* CLOCK_MONOTONIC time of the next clock ping, in ms */
+    int64_t                       next_ping_ms;
+    /* SENSORS_* bit per handle activated or reconnected since poll() */
+    uint32_t                      rate_reset;
+
+    /* performance counters, see poll__get_perf_counters() */
+    uint64_t                      stat_polls;
+    uint64_t                      stat_events;
+    uint64_t                      stat_events_dropped;
+    uint64_t                      stat_events_decimated;
+    uint64_t                      stat_connects;
+    uint64_t                      stat_resyncs;
 } SensorPoll;
 
-/** SENSORS POLL DEVICE FUNCTIONS **/
+/** CONNECTION **/
 
-static int poll__close(struct hw_device_t* dev)
+static void ring_teardown(SensorPoll* ctl)
 {
-    SensorPoll*  ctl = (void*)dev;
-    if (ctl->fd >= 0) {
+    if (ctl->ring) {
+        munmap(ctl->ring, sizeof(sfdroid_sensor_ring_t));
+        ctl->ring = NULL;
+    }
+    if (ctl->ring_fd >= 0)
+        close(ctl->ring_fd);
+    if (ctl->event_fd >= 0)
+        close(ctl->event_fd);
+    ctl->ring_fd = ctl->event_fd = -1;
+}
+
+static void disconnect_from_sfdroid(SensorPoll* ctl)
+{
+    if (ctl->fd >= 0)
         close(ctl->fd);
+    ctl->fd = -1;
+    ctl->binary = 0;
+    ctl->streaming = 0;
+    ctl->batch_supported = 0;
+    ctl->rx_len = 0;
+    ring_teardown(ctl);
+}
+
+/** MESSAGES **/
+
+/* length prefix and NUL terminated ASCII, returns the size of the frame */
+static int ascii_frame(char* buff, const char* command)
+{
+    size_t len = strlen(command) + 1;
+
+    if (len > 255)
+        len = 255;
+    buff[0] = len;
+    memcpy(buff + 1, command, len);
+    buff[len] = 0;
+
+    return 1 + len;
+}
+
+static int command_args(int type)
+{
+    switch (type) {
+    case SFDROID_MSG_BATCH:
+        return 2;
+    case SFDROID_MSG_ACTIVATE:
+    case SFDROID_MSG_SET_DELAY:
+    case SFDROID_MSG_STREAM:
+    case SFDROID_MSG_RING:
+    case SFDROID_MSG_PING:
+        return 1;
+    default:
+        return 0;
     }
-    free(ctl);
+}
+
+/*
+ * Encode a request into buff, at least SFDROID_MSG_MAX_SIZE bytes, in the
+ * framing of the connection. Returns the size of the frame.
+ */
+static int encode_command(SensorPoll* ctl, const SensorCommand* cmd, char* buff)
+{
+    const char* name = cmd->id >= 0 ? _sensorIdToName(cmd->id) : NULL;
+    char command[128];
+
+    if (ctl->binary) {
+        sfdroid_sensor_msg_header_t header;
+        int args = command_args(cmd->type);
+
+        header.size = sizeof(header) + args * sizeof(int64_t);
+        header.type = cmd->type;
+        header.sensor = cmd->id >= 0 ? _sensorIds[cmd->id - ID_BASE].type : 0;
+        memcpy(buff, &header, sizeof(header));
+        memcpy(buff + sizeof(header), cmd->arg, args * sizeof(int64_t));
+        return header.size;
+    }
+
+    switch (cmd->type) {
+    case SFDROID_MSG_GET:
+        snprintf(command, sizeof command, "get:%s", _sensorIds[cmd->id - ID_BASE].query);
+        break;
+    case SFDROID_MSG_ACTIVATE:
+        snprintf(command, sizeof command, "set:%s:%d", name, cmd->arg[0] != 0);
+        break;
+    case SFDROID_MSG_SET_DELAY:
+        snprintf(command, sizeof command, "setDelay:%s:%lld", name, cmd->arg[0]);
+        break;
+    case SFDROID_MSG_BATCH:
+        snprintf(command, sizeof command, "batch:%s:%lld:%lld", name,
+                cmd->arg[0], cmd->arg[1]);
+        break;
+    case SFDROID_MSG_FLUSH:
+        snprintf(command, sizeof command, "flush:%s", name);
+        break;
+    case SFDROID_MSG_STREAM:
+        snprintf(command, sizeof command, "stream:%lld", cmd->arg[0]);
+        break;
+    case SFDROID_MSG_RING:
+        snprintf(command, sizeof command, "ring:%lld", cmd->arg[0]);
+        break;
+    case SFDROID_MSG_PING:
+        snprintf(command, sizeof command, "ping:%lld", cmd->arg[0]);
+        break;
+    default:
+        command[0] = 0;
+        break;
+    }
+    return ascii_frame(buff, command);
+}
+
+static int send_buffer(SensorPoll* ctl, const char* buff, int len)
+{
+    if (send(ctl->fd, buff, len, MSG_NOSIGNAL) < 0) {
+        E("%s: when sending command errno=%d: %s", __FUNCTION__, errno, strerror(errno));
+        return -1;
+    }
+
     return 0;
 }
 
-static int poll__poll(struct sensors_poll_device_t *dev,
-            sensors_event_t* data, int count)
+/*
+ * send up to COMMAND_QUEUE_SIZE requests in a single send(), so that
+ * requests from different threads don't interleave and a burst of them
+ * costs the daemon a single wakeup
+ */
+static int send_commands(SensorPoll* ctl, const SensorCommand* cmds, int count)
 {
-    SensorPoll*  ctl = (void*)dev;
-    char buff[256];
-    char            command[128];
-    int ret;
-    int i;
-    D("%s: dev=%p data=%p count=%d ", __FUNCTION__, dev, data, count);
-    if (ctl->fd < 0) {
-        D("%s: OPEN CONNECTION", __FUNCTION__);
+    char buff[COMMAND_QUEUE_SIZE * SFDROID_MSG_MAX_SIZE];
+    int len = 0;
+    int nn;
+
+    for (nn = 0; nn < count; nn++)
+        len += encode_command(ctl, &cmds[nn], buff + len);
+
+    return send_buffer(ctl, buff, len);
+}
+
+static int send_command(SensorPoll* ctl, int type, int id, int64_t arg0, int64_t arg1)
+{
+    SensorCommand cmd;
+
+    cmd.type = type;
+    cmd.id = id;
+    cmd.arg[0] = arg0;
+    cmd.arg[1] = arg1;
+    return send_commands(ctl, &cmd, 1);
+}
+
+static int header_size(SensorPoll* ctl)
+{
+    return ctl->binary ? (int)sizeof(sfdroid_sensor_msg_header_t) : 1;
+}
+
+/*
+ * size of the frame starting with the header in buff, -1 if it can't be
+ * one: the daemon then doesn't speak the protocol we agreed on
+ */
+static int frame_size(SensorPoll* ctl, const char* buff)
+{
+    sfdroid_sensor_msg_header_t header;
+
+    if (!ctl->binary)
+        return 1 + (unsigned char)buff[0];
+
+    memcpy(&header, buff, sizeof(header));
+    if (header.size < sizeof(header) || header.size > SFDROID_MSG_MAX_SIZE)
+        return -1;
+    return header.size;
+}
+
+/*
+ * Parse an ASCII message: "<sensor>:<value>:...:<timestamp>" events,
+ * "flush:<sensor>", "pong:<t0>:<now>" and the "ok" answers to setups.
+ */
+static void parse_ascii(const char* buff, SensorMessage* msg)
+{
+    char copy[256];
+    char* save = NULL;
+    char* tok;
+    long long t0, remote;
+    int id;
+    int nn;
+
+    if (!strcmp(buff, "ok") || !strcmp(buff, "ok:batch")) {
+        msg->type = SFDROID_MSG_REPLY;
+        msg->arg[0] = SFDROID_REPLY_OK | (buff[2] ? SFDROID_REPLY_BATCH : 0);
+        return;
+    }
+
+    if (!strncmp(buff, "pong:", 5)) {
+        if (sscanf(buff + 5, "%lld:%lld", &t0, &remote) == 2) {
+            msg->type = SFDROID_MSG_PONG;
+            msg->arg[0] = t0;
+            msg->arg[1] = remote;
+        }
+        return;
+    }
+
+    strlcpy(copy, buff, sizeof(copy));
+    tok = strtok_r(copy, ":", &save);
+
+    /* "flush:<sensor>" once the daemon delivered what it had queued */
+    if (tok && !strcmp(tok, "flush")) {
+        id = _sensorIdFromName(strtok_r(NULL, ":", &save));
+        if (id < 0)
+            return;
+        msg->type = SFDROID_MSG_EVENT;
+        msg->event.type = SENSOR_TYPE_META_DATA;
+        msg->event.meta_type = _sensorIds[id - ID_BASE].type;
+        return;
+    }
+
+    id = _sensorIdFromName(tok);
+    if (id < 0)
+        return;
+
+    msg->event.type = _sensorIds[id - ID_BASE].type;
+    for (nn = 0; nn < _sensorIds[id - ID_BASE].num_values; nn++) {
+        tok = strtok_r(NULL, ":", &save);
+        if (tok == NULL)
+            return;
+        msg->event.data[nn] = strtof(tok, NULL);
+    }
+
+    tok = strtok_r(NULL, ":", &save);
+    if (tok == NULL)
+        return;
+    msg->event.timestamp = strtoll(tok, NULL, 10);
+    msg->type = SFDROID_MSG_EVENT;
+}
+
+/* decode one complete frame of size bytes */
+static void decode_message(SensorPoll* ctl, const char* frame, int size, SensorMessage* msg)
+{
+    sfdroid_sensor_msg_header_t header;
+    size_t len;
+
+    memset(msg, 0, sizeof(*msg));
+
+    if (!ctl->binary) {
+        char buff[256];
+
+        memcpy(buff, frame + 1, size - 1);
+        buff[size - 1] = 0;
+        parse_ascii(buff, msg);
+        return;
+    }
+
+    memcpy(&header, frame, sizeof(header));
+    frame += sizeof(header);
+    len = size - sizeof(header);
+
+    if (header.type == SFDROID_MSG_EVENT) {
+        /* the values the sensor doesn't have may be left out */
+        if (len < offsetof(sfdroid_sensor_event_t, data))
+            return;
+        memcpy(&msg->event, frame, len < sizeof(msg->event) ? len : sizeof(msg->event));
+    } else if (header.type == SFDROID_MSG_SENSOR) {
+        memcpy(&msg->info, frame, len < sizeof(msg->info) ? len : sizeof(msg->info));
+        msg->info.name[sizeof(msg->info.name) - 1] = 0;
+        msg->info.vendor[sizeof(msg->info.vendor) - 1] = 0;
+    } else {
+        memcpy(msg->arg, frame, len < sizeof(msg->arg) ? len : sizeof(msg->arg));
+    }
+    msg->type = header.type;
+}
+
+/* receive one message, blocking up to the socket timeout */
+static int recv_reply(SensorPoll* ctl, SensorMessage* msg)
+{
+    char frame[SFDROID_MSG_MAX_SIZE];
+    int header = header_size(ctl);
+    int size;
+    int len;
+
+    len = recv(ctl->fd, frame, header, MSG_WAITALL);
+    if (len != header) {
+        ALOGE("%s recv failed", __FUNCTION__);
+        return -1;
+    }
+
+    size = frame_size(ctl, frame);
+    if (size < 0) {
+        ALOGE("%s malformed message", __FUNCTION__);
+        return -1;
+    }
+
+    if (size > header) {
+        len = recv(ctl->fd, frame + header, size - header, MSG_WAITALL);
+        if (len < 0) {
+            ALOGE("%s recv failed", __FUNCTION__);
+            return -1;
+        }
+        size = header + len;
+    }
+
+    decode_message(ctl, frame, size, msg);
+    return 0;
+}
+
+/*
+ * Whether the daemon accepted the ring or the stream, and whether it also
+ * implements batching.
+ */
+static int setup_accepted(SensorPoll* ctl, const SensorMessage* msg)
+{
+    if (msg->type != SFDROID_MSG_REPLY || !(msg->arg[0] & SFDROID_REPLY_OK))
+        return 0;
+    ctl->batch_supported = (msg->arg[0] & SFDROID_REPLY_BATCH) != 0;
+    return 1;
+}
+
+/*
+ * Switch the connection to binary messages. An old daemon doesn't know the
+ * request; then everything stays ASCII. The return value only tells
+ * whether the socket is still usable.
+ */
+static int binary_setup(SensorPoll* ctl)
+{
+    SensorMessage msg;
+    char buff[64];
+    char command[32];
+
+    snprintf(command, sizeof command, "binary:%d", SFDROID_BINARY_VERSION);
+    if (send_buffer(ctl, buff, ascii_frame(buff, command)) < 0) {
+        disconnect_from_sfdroid(ctl);
+        return -1;
+    }
+
+    if (recv_reply(ctl, &msg) < 0 || msg.type != SFDROID_MSG_REPLY ||
+            !(msg.arg[0] & SFDROID_REPLY_OK)) {
+        /* the stream may be out of sync now, start over in ASCII */
+        ALOGI("sfdroid doesn't support binary messages");
+        ctl->binary_unsupported = 1;
+        disconnect_from_sfdroid(ctl);
         ctl->fd = connect_to_sfdroid();
+        return ctl->fd >= 0 ? 0 : -1;
     }
 
-    if(!ctl->accelerometer_active)
-    {
-        usleep(2000000);
+    ALOGI("using binary messages");
+    ctl->binary = 1;
+    return 0;
+}
+
+/** CLOCK **/
+
+static int64_t boottime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void clock_reset(SensorPoll* ctl)
+{
+    pthread_mutex_lock(&ctl->lock);
+    ctl->clock_supported = 0;
+    ctl->clock_offset = 0;
+    ctl->clock_error = 0;
+    ctl->clock_jitter = 0;
+    ctl->clock_num_samples = 0;
+    ctl->clock_next_sample = 0;
+    pthread_mutex_unlock(&ctl->lock);
+}
+
+/*
+ * Publish the estimate, for dumpsys-less debugging on the device. Only
+ * done when the offset changes, property_set() is a round trip to init.
+ */
+static void clock_publish(SensorPoll* ctl)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    pthread_mutex_lock(&ctl->lock);
+    snprintf(value, sizeof value, "%lld %lld %lld",
+            ctl->clock_offset, ctl->clock_error, ctl->clock_jitter);
+    pthread_mutex_unlock(&ctl->lock);
+    property_set("debug.sfdroid.sensors.clock", value);
+}
+
+/*
+ * Take the answer to a ping sent at t0 and answered at remote on the
+ * daemon's clock, received at t1. Like NTP the ping with the shortest
+ * round trip tells the most about the offset. Returns whether the offset
+ * or its error changed.
+ */
+static int clock_add_sample(SensorPoll* ctl, int64_t t0, int64_t remote, int64_t t1)
+{
+    int64_t rtt = t1 - t0;
+    int64_t offset = t0 + rtt / 2 - remote;
+    int64_t deviation;
+    int changed;
+    int best = -1;
+    int nn;
+
+    if (rtt < 0)
         return 0;
+
+    pthread_mutex_lock(&ctl->lock);
+    ctl->clock_samples[ctl->clock_next_sample].offset = offset;
+    ctl->clock_samples[ctl->clock_next_sample].rtt = rtt;
+    ctl->clock_next_sample = (ctl->clock_next_sample + 1) % SFDROID_CLOCK_SAMPLES;
+    if (ctl->clock_num_samples < SFDROID_CLOCK_SAMPLES)
+        ctl->clock_num_samples++;
+
+    for (nn = 0; nn < ctl->clock_num_samples; nn++) {
+        if (best < 0 || ctl->clock_samples[nn].rtt < ctl->clock_samples[best].rtt)
+            best = nn;
     }
 
-    if(ctl->fd >= 0)
-    {
-        for (i = 0; i < count; i++)  {
-            int64_t timestamp;
-            float params[3];
-            int len;
-            char syncbuf[1];
+    changed = !ctl->clock_supported ||
+            ctl->clock_samples[best].offset != ctl->clock_offset ||
+            ctl->clock_samples[best].rtt / 2 != ctl->clock_error;
+    if (changed)
+        D("clock offset %lld +- %lld ns", ctl->clock_samples[best].offset,
+                ctl->clock_samples[best].rtt / 2);
+    ctl->clock_supported = 1;
+    ctl->clock_offset = ctl->clock_samples[best].offset;
+    ctl->clock_error = ctl->clock_samples[best].rtt / 2;
+
+    /* running mean as for RTP interarrival jitter, with a gain of 1/8 */
+    deviation = offset - ctl->clock_offset;
+    if (deviation < 0)
+        deviation = -deviation;
+    ctl->clock_jitter += (deviation - ctl->clock_jitter) / 8;
+    pthread_mutex_unlock(&ctl->lock);
+
+    return changed;
+}
 
-            usleep(ctl->delay / 1000);
+static int send_ping(SensorPoll* ctl)
+{
+    return send_command(ctl, SFDROID_MSG_PING, -1, boottime_ns(), 0);
+}
 
-            snprintf(command, sizeof command, "get:accelerometer");
+/*
+ * Turn a daemon timestamp of a sensor into CLOCK_BOOTTIME. A new offset
+ * may move time back by up to the error; the framework wants increasing
+ * timestamps per sensor so those are held at the last one.
+ */
+static int64_t to_android_time(SensorPoll* ctl, int id, int64_t timestamp)
+{
+    int64_t* last = &ctl->last_timestamp[id - ID_BASE];
 
-            syncbuf[0] = strlen(command) + 1;
-            ret = send(ctl->fd, syncbuf, 1, MSG_NOSIGNAL);
-            if (ret < 0) {
-                E("%s: when sending sync byte errno=%d: %s", __FUNCTION__, errno, strerror(errno));
-                close(ctl->fd);
-                ctl->fd = -1;
-                return i;
-            }
+    if (!ctl->clock_supported)
+        return timestamp;
+
+    timestamp += ctl->clock_offset;
+    if (timestamp <= *last)
+        timestamp = *last + 1;
+    *last = timestamp;
+    return timestamp;
+}
+
+/*
+ * Measure the daemon's clock before anything else is sent. The return
+ * value only tells whether the socket is still usable.
+ */
+static int clock_setup(SensorPoll* ctl)
+{
+    SensorMessage msg;
+    int nn;
+
+    clock_reset(ctl);
+
+    for (nn = 0; nn < SFDROID_CLOCK_HANDSHAKE_PINGS; nn++) {
+        if (send_ping(ctl) < 0) {
+            disconnect_from_sfdroid(ctl);
+            return -1;
+        }
+
+        if (recv_reply(ctl, &msg) < 0 || msg.type != SFDROID_MSG_PONG) {
+            /* same as for the ring, restart the stream of an old daemon */
+            ALOGI("sfdroid doesn't support clock pings, using its timestamps as they are");
+            clock_reset(ctl);
+            ctl->clock_unsupported = 1;
+            disconnect_from_sfdroid(ctl);
+            ctl->fd = connect_to_sfdroid();
+            return ctl->fd >= 0 ? 0 : -1;
+        }
+        clock_add_sample(ctl, msg.arg[0], msg.arg[1], boottime_ns());
+    }
+
+    ALOGI("sfdroid clock offset %lld ns, error %lld ns",
+            ctl->clock_offset, ctl->clock_error);
+    clock_publish(ctl);
+    return 0;
+}
+
+/*
+ * Offer the shared memory event ring to the daemon. On failure samples are
+ * simply requested over the socket, the return value only tells whether
+ * the socket itself is still usable.
+ */
+static int ring_setup(SensorPoll* ctl)
+{
+    struct iovec iov;
+    int fds[2];
+    SensorMessage reply;
+    char dummy = 0;
+
+    ctl->ring = sfdroid_ipc_shm_create("sfdroid-sensors", sizeof(sfdroid_sensor_ring_t),
+            &ctl->ring_fd);
+    ctl->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ctl->ring == NULL || ctl->event_fd < 0) {
+        E("%s: failed to create event ring: %s", __FUNCTION__, strerror(errno));
+        ring_teardown(ctl);
+        return 0;
+    }
+    ctl->ring->magic = SFDROID_RING_MAGIC;
+    ctl->ring->version = SFDROID_RING_VERSION;
+    ctl->ring->capacity = SFDROID_RING_CAPACITY;
+    ctl->ring->event_size = sizeof(sfdroid_sensor_event_t);
+    ctl->ring_dropped = 0;
+
+    if (send_command(ctl, SFDROID_MSG_RING, -1, SFDROID_RING_VERSION, 0) < 0) {
+        disconnect_from_sfdroid(ctl);
+        return -1;
+    }
+
+    iov.iov_base = &dummy;
+    iov.iov_len = 1;
+    fds[0] = ctl->ring_fd;
+    fds[1] = ctl->event_fd;
+
+    if (sfdroid_ipc_send(ctl->fd, &iov, 1, fds, 2) < 0) {
+        E("%s: failed to send event ring: %s", __FUNCTION__, strerror(errno));
+        disconnect_from_sfdroid(ctl);
+        return -1;
+    }
+
+    if (recv_reply(ctl, &reply) < 0 || !setup_accepted(ctl, &reply)) {
+        /*
+         * An old daemon answers with an error or not at all; either way
+         * the stream may be out of sync now, so start over without ring.
+         */
+        ALOGI("sfdroid doesn't support the event ring");
+        ctl->ring_unsupported = 1;
+        disconnect_from_sfdroid(ctl);
+        ctl->fd = connect_to_sfdroid();
+        return ctl->fd >= 0 ? 0 : -1;
+    }
+
+    ALOGI("using shared memory event ring");
+    return 0;
+}
+
+/*
+ * Without the ring, ask the daemon to push events for active sensors at
+ * their configured rate instead of waiting for a "get:" each.
+ */
+static int stream_setup(SensorPoll* ctl)
+{
+    SensorMessage reply;
+
+    if (send_command(ctl, SFDROID_MSG_STREAM, -1, 1, 0) < 0) {
+        disconnect_from_sfdroid(ctl);
+        return -1;
+    }
+
+    if (recv_reply(ctl, &reply) < 0 || !setup_accepted(ctl, &reply)) {
+        /* same as for the ring, restart the stream of an old daemon */
+        ALOGI("sfdroid doesn't support streaming");
+        ctl->stream_unsupported = 1;
+        disconnect_from_sfdroid(ctl);
+        ctl->fd = connect_to_sfdroid();
+        return ctl->fd >= 0 ? 0 : -1;
+    }
+
+    ALOGI("sfdroid streams sensor events");
+    ctl->streaming = 1;
+    return 0;
+}
+
+/*
+ * tell a new connection what the framework asked for so far, called with
+ * lock held before the connection is published
+ */
+static int restore_state(SensorPoll* ctl)
+{
+    SensorCommand cmds[MAX_NUM_SENSORS * 2];
+    int count = 0;
+    int nn;
+
+    for (nn = 0; nn < MAX_NUM_SENSORS; nn++) {
+        if (!(ctl->active & (1 << nn)))
+            continue;
+
+        cmds[count].type = SFDROID_MSG_SET_DELAY;
+        cmds[count].id = ID_BASE + nn;
+        cmds[count].arg[0] = ctl->delay[nn];
+        cmds[count].arg[1] = 0;
+        count++;
+
+        cmds[count].type = SFDROID_MSG_ACTIVATE;
+        cmds[count].id = ID_BASE + nn;
+        cmds[count].arg[0] = 1;
+        cmds[count].arg[1] = 0;
+        count++;
+    }
+
+    return count > 0 ? send_commands(ctl, cmds, count) : 0;
+}
+
+/* connect and negotiate, without publishing the connection yet */
+static int connect_ctl(SensorPoll* ctl)
+{
+    D("%s: OPEN CONNECTION", __FUNCTION__);
+    ctl->fd = connect_to_sfdroid();
+    if (ctl->fd >= 0 && !ctl->binary_unsupported)
+        binary_setup(ctl);
+    if (ctl->fd >= 0 && !ctl->clock_unsupported)
+        clock_setup(ctl);
+    if (ctl->fd >= 0 && !ctl->ring_unsupported)
+        ring_setup(ctl);
+    if (ctl->fd >= 0 && !ctl->ring && !ctl->stream_unsupported)
+        stream_setup(ctl);
+    return ctl->fd >= 0 ? 0 : -1;
+}
+
+static void wake_poll(SensorPoll* ctl)
+{
+    uint64_t one = 1;
+
+    if (ctl->wake_fd >= 0)
+        write(ctl->wake_fd, &one, sizeof(one));
+}
+
+/*
+ * Flag the connection as broken, called with lock held. shutdown() kicks
+ * a poll() blocked on the socket; the manager closes it once poll() let go.
+ */
+static void connection_lost_l(SensorPoll* ctl)
+{
+    if (!ctl->connected)
+        return;
+
+    ALOGE("connection to sfdroid lost");
+    ctl->connected = 0;
+    shutdown(ctl->fd, SHUT_RDWR);
+    pthread_cond_signal(&ctl->cmd_cond);
+    pthread_cond_broadcast(&ctl->state_cond);
+}
+
+static void connection_lost(SensorPoll* ctl)
+{
+    pthread_mutex_lock(&ctl->lock);
+    connection_lost_l(ctl);
+    pthread_mutex_unlock(&ctl->lock);
+}
+
+/* drop the queued commands, completing their flushes locally */
+static void clear_commands_l(SensorPoll* ctl)
+{
+    while (ctl->command_count > 0) {
+        const SensorCommand* cmd = &ctl->commands[ctl->command_head];
+        if (cmd->type == SFDROID_MSG_FLUSH)
+            ctl->pending_flushes[cmd->id - ID_BASE]++;
+        ctl->command_head = (ctl->command_head + 1) % COMMAND_QUEUE_SIZE;
+        ctl->command_count--;
+    }
+    ctl->resync = 0;
+    pthread_cond_broadcast(&ctl->state_cond);
+    wake_poll(ctl);
+}
+
+/*
+ * Queue a control command for the manager thread, called with lock held.
+ * Returns -1 if not connected, in which case the state is sent on connect.
+ */
+static int queue_command_l(SensorPoll* ctl, int type, int id, int64_t arg0, int64_t arg1)
+{
+    if (!ctl->connected)
+        return -1;
+
+    if (ctl->command_count == COMMAND_QUEUE_SIZE) {
+        if (!ctl->resync)
+            ctl->stat_resyncs++;
+        ctl->resync = 1;
+    } else {
+        int tail = (ctl->command_head + ctl->command_count) % COMMAND_QUEUE_SIZE;
+        ctl->commands[tail].type = type;
+        ctl->commands[tail].id = id;
+        ctl->commands[tail].arg[0] = arg0;
+        ctl->commands[tail].arg[1] = arg1;
+        ctl->command_count++;
+    }
+    pthread_cond_signal(&ctl->cmd_cond);
+    return 0;
+}
 
-            ret = send(ctl->fd, command, strlen(command) + 1, MSG_NOSIGNAL);
-            if (ret < 0) {
-                E("%s: when sending command errno=%d: %s", __FUNCTION__, errno, strerror(errno));
-                close(ctl->fd);
-                ctl->fd = -1;
-                return i;
+static void* manager_thread(void* arg)
+{
+    SensorPoll* ctl = arg;
+    sfdroid_ipc_backoff_t backoff;
+
+    sfdroid_ipc_backoff_init(&backoff, RECONNECT_MIN_MS, RECONNECT_MAX_MS);
+
+    pthread_mutex_lock(&ctl->lock);
+    while (!ctl->exiting) {
+        if (!ctl->connected) {
+            struct timespec ts;
+            int32_t backoff_ms;
+
+            /* retire the broken connection once poll() let go of it */
+            while (ctl->reading && !ctl->exiting)
+                pthread_cond_wait(&ctl->state_cond, &ctl->lock);
+            if (ctl->exiting)
+                break;
+            if (ctl->fd >= 0)
+                disconnect_from_sfdroid(ctl);
+            clear_commands_l(ctl);
+
+            pthread_mutex_unlock(&ctl->lock);
+            connect_ctl(ctl);
+            pthread_mutex_lock(&ctl->lock);
+
+            if (ctl->fd >= 0 && restore_state(ctl) == 0) {
+                ALOGI("connected to sfdroid");
+                sfdroid_ipc_backoff_reset(&backoff);
+                ctl->connected = 1;
+                ctl->stat_connects++;
+                /* the daemon's timestamps may have started over */
+                ctl->rate_reset = SUPPORTED_SENSORS;
+                ctl->next_ping_ms = monotonic_ms() + SFDROID_CLOCK_PING_MS;
+                pthread_cond_broadcast(&ctl->state_cond);
+                continue;
+            }
+            if (ctl->fd >= 0)
+                disconnect_from_sfdroid(ctl);
+
+            backoff_ms = sfdroid_ipc_backoff_next(&backoff);
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += backoff_ms / 1000;
+            ts.tv_nsec += (backoff_ms % 1000) * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
             }
+            pthread_cond_timedwait(&ctl->cmd_cond, &ctl->lock, &ts);
+            continue;
+        }
+
+        if (ctl->resync) {
+            clear_commands_l(ctl);
+            if (restore_state(ctl) < 0)
+                connection_lost_l(ctl);
+            continue;
+        }
 
-            len = recv(ctl->fd, syncbuf, 1, 0);
-            if(len < 0)
-            {
-                ALOGE("%s recv failed", __FUNCTION__);
-                close(ctl->fd);
-                ctl->fd = -1;
-                return i;
+        /*
+         * Send everything queued in one go. The commands stay queued until
+         * sent, so that a broken connection still completes their flushes.
+         */
+        if (ctl->command_count > 0) {
+            SensorCommand cmds[COMMAND_QUEUE_SIZE];
+            int nn;
+
+            for (nn = 0; nn < ctl->command_count; nn++)
+                cmds[nn] = ctl->commands[(ctl->command_head + nn) % COMMAND_QUEUE_SIZE];
+            if (send_commands(ctl, cmds, ctl->command_count) < 0) {
+                connection_lost_l(ctl);
+                continue;
             }
+            ctl->command_head = (ctl->command_head + ctl->command_count) % COMMAND_QUEUE_SIZE;
+            ctl->command_count = 0;
+            continue;
+        }
 
-            len = recv(ctl->fd, buff, syncbuf[0], 0);
-            if(len < 0)
-            {
-                ALOGE("%s recv failed", __FUNCTION__);
-                close(ctl->fd);
-                ctl->fd = -1;
-                return i;
+        /* poll() only reads the answers while sensors are active */
+        if (ctl->clock_supported && ctl->active) {
+            int64_t now = monotonic_ms();
+            struct timespec ts;
+
+            if (now >= ctl->next_ping_ms) {
+                if (send_ping(ctl) < 0)
+                    connection_lost_l(ctl);
+                ctl->next_ping_ms = now + SFDROID_CLOCK_PING_MS;
+                continue;
             }
-            buff[len] = 0;
-
-            /* "acceleration:<x>:<y>:<z>" corresponds to an acceleration event */
-            if (sscanf(buff, "acceleration:%g:%g:%g:%lld", params+0, params+1, params+2, &timestamp) == 4) {
-                data->sensor = ID_ACCELERATION;
-                data->version = sizeof(*data);
-                data->acceleration.x = params[0];
-                data->acceleration.y = params[1];
-                data->acceleration.z = params[2];
-                data->timestamp = timestamp;
-                data->type = SENSOR_TYPE_ACCELEROMETER;
-                data++;
-                return i+1;
+
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += (ctl->next_ping_ms - now) / 1000;
+            ts.tv_nsec += ((ctl->next_ping_ms - now) % 1000) * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
             }
+            pthread_cond_timedwait(&ctl->cmd_cond, &ctl->lock, &ts);
+            continue;
+        }
+
+        pthread_cond_wait(&ctl->cmd_cond, &ctl->lock);
+    }
+    pthread_mutex_unlock(&ctl->lock);
+
+    return NULL;
+}
+
+/** SENSORS POLL DEVICE FUNCTIONS **/
 
-            ALOGE("unsupported command: %s", buff);
-            return i;
+static int poll__close(struct hw_device_t* dev)
+{
+    SensorPoll*  ctl = (void*)dev;
+
+    pthread_mutex_lock(&ctl->lock);
+    ctl->exiting = 1;
+    pthread_cond_broadcast(&ctl->cmd_cond);
+    pthread_cond_broadcast(&ctl->state_cond);
+    pthread_mutex_unlock(&ctl->lock);
+    pthread_join(ctl->manager, NULL);
+
+    disconnect_from_sfdroid(ctl);
+    if (ctl->wake_fd >= 0)
+        close(ctl->wake_fd);
+    pthread_cond_destroy(&ctl->cmd_cond);
+    pthread_cond_destroy(&ctl->state_cond);
+    pthread_mutex_destroy(&ctl->lock);
+    free(ctl);
+    return 0;
+}
+
+static void make_flush_complete(sensors_event_t* data, int handle)
+{
+    memset(data, 0, sizeof(*data));
+    data->version = META_DATA_VERSION;
+    data->type = SENSOR_TYPE_META_DATA;
+    data->meta_data.what = META_DATA_FLUSH_COMPLETE;
+    data->meta_data.sensor = handle;
+}
+
+/*
+ * Report the flushes completed locally, for daemons that don't batch.
+ * The framework expects one completion per flush() call.
+ */
+static int report_pending_flushes(SensorPoll* ctl, sensors_event_t* data, int count)
+{
+    int n = 0;
+    int nn;
+
+    for (nn = 0; nn < MAX_NUM_SENSORS && n < count; nn++) {
+        while (ctl->pending_flushes[nn] > 0 && n < count) {
+            make_flush_complete(data + n, ID_BASE + nn);
+            ctl->pending_flushes[nn]--;
+            n++;
         }
+    }
+    return n;
+}
+
+/* poll() taking the periods and activations, called with lock held */
+static void rate_sync_l(SensorPoll* ctl)
+{
+    int nn;
 
-        return count;
+    for (nn = 0; nn < MAX_NUM_SENSORS; nn++) {
+        ctl->rate_period[nn] = ctl->delay[nn];
+        if (ctl->rate_reset & (1 << nn))
+            ctl->rate_last[nn] = 0;
     }
+    ctl->rate_reset = 0;
+    ctl->poll_active = ctl->active;
+}
 
-    // sfdroid not up
+/* poll() taking activations while it waits */
+static uint32_t rate_sync(SensorPoll* ctl)
+{
+    pthread_mutex_lock(&ctl->lock);
+    rate_sync_l(ctl);
+    pthread_mutex_unlock(&ctl->lock);
+    return ctl->poll_active;
+}
+
+/*
+ * Whether to deliver an event of a sensor: daemons often sample at a rate
+ * of their own, faster than apps ask for, which the framework would only
+ * throw away after a trip through binder. A continuous sensor delivers at
+ * most one event per period, with some slack for jitter, and an on-change
+ * one only when its values change. Events resent with the timestamp of
+ * the last one delivered are dropped either way; going back by more than
+ * a second is taken as a restart of the daemon's clock.
+ */
+static int rate_limit(SensorPoll* ctl, int id, const sfdroid_sensor_event_t* ev)
+{
+    int k = id - ID_BASE;
+    int num_values = _sensorIds[k].num_values;
+    int64_t last = ctl->rate_last[k];
+    int64_t period = ctl->rate_period[k];
+    int on_change = ev->type == SENSOR_TYPE_LIGHT || ev->type == SENSOR_TYPE_PROXIMITY;
+
+    if (last != 0 && ev->timestamp <= last && last - ev->timestamp < 1000000000LL)
+        goto drop;
+    if (last != 0 && ev->timestamp > last) {
+        if (on_change &&
+                !memcmp(ctl->rate_values[k], ev->data, num_values * sizeof(float)))
+            goto drop;
+        if (!on_change && ev->timestamp - last < period - period / 8)
+            goto drop;
+    }
+
+    ctl->rate_last[k] = ev->timestamp;
+    memcpy(ctl->rate_values[k], ev->data, num_values * sizeof(float));
+    return 1;
+
+drop:
+    ctl->rate_dropped_new++;
     return 0;
 }
 
-static int poll__activate(struct sensors_poll_device_t *dev,
-            int handle, int enabled)
+/* translate a ring event, returns 0 for sensors we don't expose */
+static int convert_event(SensorPoll* ctl, const sfdroid_sensor_event_t* ev, sensors_event_t* data)
 {
-    int ret;
-    char            command[128];
-    native_handle_t* hdl;
-    SensorPoll*  ctl = (void*)dev;
-    D("%s: dev=%p handle=%x enable=%d ", __FUNCTION__, dev, handle, enabled);
-    if (ctl->fd < 0) {
-        D("%s: OPEN CONNECTION", __FUNCTION__);
-        ctl->fd = connect_to_sfdroid();
+    int id = _sensorIdFromType(ev->type);
+    int nn;
+
+    if (ev->type == SENSOR_TYPE_META_DATA) {
+        id = _sensorIdFromType(ev->meta_type);
+        if (id < 0)
+            return 0;
+        make_flush_complete(data, id);
+        return 1;
     }
-    if(handle == ID_ACCELERATION)
-    {
-        if(ctl->fd >= 0)
-        {
-            char syncbuf[1];
-            snprintf(command, sizeof command, "set:%s:%d",
-                        _sensorIdToName(handle), enabled != 0);
-
-            syncbuf[0] = strlen(command) + 1;
-            ret = send(ctl->fd, syncbuf, 1, MSG_NOSIGNAL);
-            if (ret < 0) {
-                E("%s: when sending sync byte errno=%d: %s", __FUNCTION__, errno, strerror(errno));
-                close(ctl->fd);
-                ctl->fd = -1;
-                return -1;
-            }
 
-            ret = send(ctl->fd, command, strlen(command) + 1, MSG_NOSIGNAL);
-            if (ret < 0) {
-                close(ctl->fd);
-                ctl->fd = -1;
-                E("%s: when sending command errno=%d: %s", __FUNCTION__, errno, strerror(errno));
-                return -1;
+    /* the daemon may still send a while after deactivation */
+    if (id < 0 || !(ctl->poll_active & (1 << (id - ID_BASE))))
+        return 0;
+    if (!rate_limit(ctl, id, ev))
+        return 0;
+
+    memset(data, 0, sizeof(*data));
+    data->version = sizeof(*data);
+    data->sensor = id;
+    data->type = ev->type;
+    data->timestamp = to_android_time(ctl, id, ev->timestamp);
+    for (nn = 0; nn < _sensorIds[id - ID_BASE].num_values; nn++)
+        data->data[nn] = ev->data[nn];
+    return 1;
+}
+
+/*
+ * Act on a message the daemon sent on its own, returns the number of
+ * events it makes for poll()
+ */
+static int handle_message(SensorPoll* ctl, const SensorMessage* msg, sensors_event_t* data)
+{
+    switch (msg->type) {
+    case SFDROID_MSG_EVENT:
+        return convert_event(ctl, &msg->event, data);
+    case SFDROID_MSG_PONG:
+        /* the answer to a clock ping, sent between events */
+        if (clock_add_sample(ctl, msg->arg[0], msg->arg[1], boottime_ns()))
+            clock_publish(ctl);
+        return 0;
+    default:
+        ALOGE("unsupported message %d from sfdroid", msg->type);
+        return 0;
+    }
+}
+
+/* parse the complete messages buffered in rx into up to count events */
+static int rx_parse(SensorPoll* ctl, sensors_event_t* data, int count)
+{
+    int header = header_size(ctl);
+    int pos = 0;
+    int n = 0;
+
+    while (n < count && pos + header <= ctl->rx_len) {
+        SensorMessage msg;
+        int size = frame_size(ctl, ctl->rx + pos);
+
+        if (size < 0) {
+            ALOGE("%s: malformed message from sfdroid", __FUNCTION__);
+            pos = ctl->rx_len;
+            connection_lost(ctl);
+            break;
+        }
+        if (pos + size > ctl->rx_len)
+            break;
+
+        decode_message(ctl, ctl->rx + pos, size, &msg);
+        pos += size;
+        n += handle_message(ctl, &msg, data + n);
+    }
+    memmove(ctl->rx, ctl->rx + pos, ctl->rx_len - pos);
+    ctl->rx_len -= pos;
+
+    return n;
+}
+
+/* append what the socket has to rx, -1 once the daemon went away */
+static int rx_fill(SensorPoll* ctl)
+{
+    int len;
+
+    len = recv(ctl->fd, ctl->rx + ctl->rx_len, sizeof(ctl->rx) - ctl->rx_len, MSG_DONTWAIT);
+    if (len <= 0) {
+        if (len < 0 && (errno == EAGAIN || errno == EINTR))
+            return 0;
+        connection_lost(ctl);
+        return -1;
+    }
+    ctl->rx_len += len;
+    return 0;
+}
+
+/* copy up to count events out of the ring */
+static int ring_drain(SensorPoll* ctl, sensors_event_t* data, int count)
+{
+    sfdroid_sensor_ring_t* ring = ctl->ring;
+    int32_t head = android_atomic_acquire_load(&ring->head);
+    int32_t tail = ring->tail;
+    int32_t dropped;
+    int n = 0;
+
+    while (tail != head && n < count) {
+        const sfdroid_sensor_event_t* ev =
+                &ring->events[tail & (SFDROID_RING_CAPACITY - 1)];
+        n += convert_event(ctl, ev, data + n);
+        tail = (int32_t)((uint32_t)tail + 1);
+    }
+    android_atomic_release_store(tail, &ring->tail);
+
+    dropped = ring->dropped;
+    if (dropped != ctl->ring_dropped) {
+        ALOGW("sfdroid dropped %d sensor events", dropped - ctl->ring_dropped);
+        ctl->ring_dropped_new += dropped - ctl->ring_dropped;
+        ctl->ring_dropped = dropped;
+    }
+
+    return n;
+}
+
+/*
+ * Wait for events in the ring and return them in bulk: no syscall per
+ * event as long as the daemon keeps the ring busy.
+ */
+static int ring_poll(SensorPoll* ctl, sensors_event_t* data, int count)
+{
+    struct pollfd pfd[2];
+    uint64_t value;
+    int n;
+
+    n = ring_drain(ctl, data, count);
+    if (n > 0)
+        return n;
+
+    android_atomic_release_store(1, &ctl->ring->reader_waiting);
+    android_memory_barrier();
+    n = ring_drain(ctl, data, count);
+    if (n == 0) {
+        pfd[0].fd = ctl->event_fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        /* for hangups and the answers to clock pings */
+        pfd[1].fd = ctl->fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        /* wake up now and then to notice deactivation */
+        if (poll(pfd, 2, 1000) > 0) {
+            if ((pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) && rx_fill(ctl) < 0) {
+                ALOGE("%s: sfdroid went away", __FUNCTION__);
+                android_atomic_release_store(0, &ctl->ring->reader_waiting);
+                return 0;
             }
+            if (pfd[0].revents & POLLIN)
+                read(ctl->event_fd, &value, sizeof(value));
         }
+        n = ring_drain(ctl, data, count);
+        n += rx_parse(ctl, data + n, count - n);
+    }
+    android_atomic_release_store(0, &ctl->ring->reader_waiting);
 
-        ctl->accelerometer_active = (enabled != 0) ? 1 : 0;
-        // sfdroid not up yet
-        return 0;
+    return n;
+}
+
+/*
+ * Return the events the daemon pushed, blocking until at least one
+ * arrived. Everything received in one recv() is parsed at once.
+ */
+static int stream_poll(SensorPoll* ctl, sensors_event_t* data, int count)
+{
+    struct pollfd pfd[2];
+    int n = 0;
+
+    while (n == 0) {
+        /* parse whatever complete messages are buffered */
+        n = rx_parse(ctl, data, count);
+        if (n > 0 || !rate_sync(ctl))
+            break;
+
+        pfd[0].fd = ctl->fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = ctl->wake_fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        if (poll(pfd, 2, 1000) <= 0)
+            break;
+        if (pfd[1].revents & POLLIN) {
+            uint64_t value;
+            read(ctl->wake_fd, &value, sizeof(value));
+        }
+        if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        if (rx_fill(ctl) < 0) {
+            ALOGE("%s: sfdroid went away", __FUNCTION__);
+            break;
+        }
     }
-    return -1;
+
+    /* and whatever else already arrived, without waiting for more */
+    while (n > 0 && n < count && ctl->rx_len < (int)sizeof(ctl->rx) && ctl->fd >= 0) {
+        int rx_len = ctl->rx_len;
+
+        if (rx_fill(ctl) < 0 || ctl->rx_len == rx_len)
+            break;
+        n += rx_parse(ctl, data + n, count - n);
+    }
+
+    return n;
 }
 
-static int poll__setDelay(struct sensors_poll_device_t *dev,
-            int handle, int64_t ns)
+/*
+ * Ask a daemon that only answers requests for the events of all active
+ * sensors, up to count of them, in a single send() and return all the
+ * answers at once.
+ */
+static int query_poll(SensorPoll* ctl, sensors_event_t* data, int count)
 {
+    SensorCommand cmds[MAX_NUM_SENSORS];
+    SensorMessage msg;
+    int64_t delay = 0;
+    uint32_t active = ctl->poll_active;
+    int queries = 0;
+    int n = 0;
+    int nn;
     int ret;
-    char            command[128];
-    native_handle_t* hdl;
+
+    if (!active)
+        return 0;
+
+    /* pace them ourselves, at the fastest rate asked for */
+    for (int k = 0; k < MAX_NUM_SENSORS; k++) {
+        if ((active & (1 << k)) && (delay == 0 || ctl->rate_period[k] < delay))
+            delay = ctl->rate_period[k];
+    }
+    usleep(delay / 1000);
+
+    /* starting with the one left out last time if count is small */
+    for (int k = 0; k < MAX_NUM_SENSORS && queries < count; k++) {
+        nn = (ctl->next_query + k) % MAX_NUM_SENSORS;
+        if (!(active & (1 << nn)))
+            continue;
+        cmds[queries].type = SFDROID_MSG_GET;
+        cmds[queries].id = ID_BASE + nn;
+        cmds[queries].arg[0] = cmds[queries].arg[1] = 0;
+        queries++;
+        ctl->next_query = (nn + 1) % MAX_NUM_SENSORS;
+    }
+
+    pthread_mutex_lock(&ctl->lock);
+    ret = send_commands(ctl, cmds, queries);
+    pthread_mutex_unlock(&ctl->lock);
+    /* answers to clock pings may come between the events */
+    while (queries > 0) {
+        if (ret < 0 || recv_reply(ctl, &msg) < 0) {
+            connection_lost(ctl);
+            return n;
+        }
+        if (msg.type != SFDROID_MSG_PONG)
+            queries--;
+        n += handle_message(ctl, &msg, data + n);
+    }
+    return n;
+}
+
+static int poll__poll(struct sensors_poll_device_t *dev,
+            sensors_event_t* data, int count)
+{
+    SensorPoll*  ctl = (void*)dev;
+    int n;
+    D("%s: dev=%p data=%p count=%d ", __FUNCTION__, dev, data, count);
+
+    /* wait for the manager thread and activate() instead of sleeping */
+    pthread_mutex_lock(&ctl->lock);
+    for (;;) {
+        n = report_pending_flushes(ctl, data, count);
+        if (n > 0) {
+            pthread_mutex_unlock(&ctl->lock);
+            return n;
+        }
+        if (ctl->exiting) {
+            pthread_mutex_unlock(&ctl->lock);
+            return 0;
+        }
+        if (ctl->connected && ctl->active)
+            break;
+        pthread_cond_wait(&ctl->state_cond, &ctl->lock);
+    }
+    ctl->reading = 1;
+    rate_sync_l(ctl);
+    pthread_mutex_unlock(&ctl->lock);
+
+    if (ctl->ring)
+        n = ring_poll(ctl, data, count);
+    else if (ctl->streaming)
+        n = stream_poll(ctl, data, count);
+    else
+        n = query_poll(ctl, data, count);
+    HAL_TRACE_COUNTER("sensors poll events", n);
+
+    pthread_mutex_lock(&ctl->lock);
+    ctl->reading = 0;
+    ctl->stat_polls++;
+    if (n > 0)
+        ctl->stat_events += n;
+    ctl->stat_events_dropped += ctl->ring_dropped_new;
+    ctl->ring_dropped_new = 0;
+    ctl->stat_events_decimated += ctl->rate_dropped_new;
+    ctl->rate_dropped_new = 0;
+    pthread_cond_broadcast(&ctl->state_cond);
+    pthread_mutex_unlock(&ctl->lock);
+
+    return n;
+}
+
+static int poll__get_perf_counters(const struct hw_device_t *dev,
+            hw_perf_counter_t* counters, size_t count)
+{
+    SensorPoll*  ctl = (void*)dev;
+    size_t n = 0;
+
+    pthread_mutex_lock(&ctl->lock);
+    hw_perf_counter_put(counters, count, &n, "polls",
+            HW_PERF_COUNTER_TYPE_COUNT, ctl->stat_polls);
+    hw_perf_counter_put(counters, count, &n, "events",
+            HW_PERF_COUNTER_TYPE_COUNT, ctl->stat_events);
+    hw_perf_counter_put(counters, count, &n, "events_dropped",
+            HW_PERF_COUNTER_TYPE_COUNT, ctl->stat_events_dropped);
+    hw_perf_counter_put(counters, count, &n, "events_decimated",
+            HW_PERF_COUNTER_TYPE_COUNT, ctl->stat_events_decimated);
+    hw_perf_counter_put(counters, count, &n, "connects",
+            HW_PERF_COUNTER_TYPE_COUNT, ctl->stat_connects);
+    hw_perf_counter_put(counters, count, &n, "command_resyncs",
+            HW_PERF_COUNTER_TYPE_COUNT, ctl->stat_resyncs);
+    hw_perf_counter_put(counters, count, &n, "connected",
+            HW_PERF_COUNTER_TYPE_GAUGE, ctl->connected);
+    hw_perf_counter_put(counters, count, &n, "active_sensors",
+            HW_PERF_COUNTER_TYPE_GAUGE, __builtin_popcount(ctl->active));
+    hw_perf_counter_put(counters, count, &n, "clock.error_ns",
+            HW_PERF_COUNTER_TYPE_GAUGE, ctl->clock_error);
+    hw_perf_counter_put(counters, count, &n, "clock.jitter_ns",
+            HW_PERF_COUNTER_TYPE_GAUGE, ctl->clock_jitter);
+    pthread_mutex_unlock(&ctl->lock);
+
+    return n;
+}
+
+static const hw_device_ext_t poll_device_ext = {
+    .tag               = HARDWARE_DEVICE_EXT_TAG,
+    .version           = HARDWARE_DEVICE_EXT_VERSION_1,
+    .get_perf_counters = poll__get_perf_counters,
+};
+
+/*
+ * The control calls below never touch the socket: they record the state
+ * and queue the matching command for the manager thread, so they return
+ * right away even while the daemon is down.
+ */
+static int poll__activate(struct sensors_poll_device_t *dev,
+            int handle, int enabled)
+{
     SensorPoll*  ctl = (void*)dev;
     D("%s: dev=%p handle=%x enable=%d ", __FUNCTION__, dev, handle, enabled);
-    if (ctl->fd < 0) {
-        D("%s: OPEN CONNECTION", __FUNCTION__);
-        ctl->fd = connect_to_sfdroid();
+    if (!ID_PRESENT(handle))
+        return -EINVAL;
+
+    pthread_mutex_lock(&ctl->lock);
+    if (enabled) {
+        ctl->active |= 1 << (handle - ID_BASE);
+        /* on-change sensors report their first value again */
+        ctl->rate_reset |= 1 << (handle - ID_BASE);
+    } else {
+        ctl->active &= ~(1 << (handle - ID_BASE));
     }
-    ctl->delay = ns;
-    if(handle == ID_ACCELERATION)
-    {
-        if(ctl->fd >= 0)
-        {
-            char syncbuf[1];
-
-            snprintf(command, sizeof command, "setDelay:%s:%lld",
-                        _sensorIdToName(handle), ns);
-
-            syncbuf[0] = strlen(command) + 1;
-            ret = send(ctl->fd, syncbuf, 1, MSG_NOSIGNAL);
-            if (ret < 0) {
-                E("%s: when sending sync byte errno=%d: %s", __FUNCTION__, errno, strerror(errno));
-                close(ctl->fd);
-                ctl->fd = -1;
-                return -1;
-            }
+    queue_command_l(ctl, SFDROID_MSG_ACTIVATE, handle, enabled != 0, 0);
+    pthread_cond_broadcast(&ctl->state_cond);
+    pthread_mutex_unlock(&ctl->lock);
 
-            ret = send(ctl->fd, command, strlen(command) + 1, MSG_NOSIGNAL);
-            if (ret < 0) {
-                close(ctl->fd);
-                ctl->fd = -1;
-                E("%s: when sending command errno=%d: %s", __FUNCTION__, errno, strerror(errno));
-                return -1;
-            }
-        }
+    wake_poll(ctl);
+    return 0;
+}
 
-        // sfdroid not up yet
-        return 0;
+static int poll__setDelay(struct sensors_poll_device_t *dev,
+            int handle, int64_t ns)
+{
+    SensorPoll*  ctl = (void*)dev;
+    D("%s: dev=%p handle=%x ns=%lld ", __FUNCTION__, dev, handle, ns);
+    if (!ID_PRESENT(handle))
+        return -EINVAL;
+
+    pthread_mutex_lock(&ctl->lock);
+    ctl->delay[handle - ID_BASE] = ns;
+    queue_command_l(ctl, SFDROID_MSG_SET_DELAY, handle, ns, 0);
+    pthread_mutex_unlock(&ctl->lock);
+
+    return 0;
+}
+
+static int poll__batch(struct sensors_poll_device_1 *dev,
+            int handle, int flags, int64_t period_ns, int64_t timeout)
+{
+    SensorPoll*  ctl = (void*)dev;
+    D("%s: dev=%p handle=%x period=%lld timeout=%lld", __FUNCTION__, dev, handle, period_ns, timeout);
+    if (!ID_PRESENT(handle))
+        return -EINVAL;
+
+    if (poll__setDelay(&dev->v0, handle, period_ns) < 0)
+        return -1;
+
+    /*
+     * Without a daemon FIFO events are delivered as they come, which is
+     * always within the requested latency.
+     */
+    pthread_mutex_lock(&ctl->lock);
+    if (ctl->batch_supported)
+        queue_command_l(ctl, SFDROID_MSG_BATCH, handle, period_ns, timeout);
+    pthread_mutex_unlock(&ctl->lock);
+
+    return 0;
+}
+
+static int poll__flush(struct sensors_poll_device_1 *dev, int handle)
+{
+    SensorPoll*  ctl = (void*)dev;
+    D("%s: dev=%p handle=%x", __FUNCTION__, dev, handle);
+    if (!ID_PRESENT(handle))
+        return -EINVAL;
+
+    pthread_mutex_lock(&ctl->lock);
+    if (!(ctl->active & (1 << (handle - ID_BASE)))) {
+        pthread_mutex_unlock(&ctl->lock);
+        return -EINVAL;
     }
-    return -1;
+    if (!ctl->batch_supported || queue_command_l(ctl, SFDROID_MSG_FLUSH, handle, 0, 0) < 0) {
+        /* nothing is queued anywhere, complete the flush right away */
+        ctl->pending_flushes[handle - ID_BASE]++;
+        pthread_cond_broadcast(&ctl->state_cond);
+    }
+    pthread_mutex_unlock(&ctl->lock);
+
+    wake_poll(ctl);
+    return 0;
 }
 
 /** MODULE REGISTRATION SUPPORT
@@ -356,11 +1660,9 @@ static int poll__setDelay(struct sensors_poll_device_t *dev,
  **/
 
 /*
- * the following is the list of all supported sensors.
- * this table is used to build sSensorList declared below
- * according to which hardware sensors are reported as
- * available from the emulator (see get_sensors_list below)
- *
+ * the following is the list of all supported sensors, in the
+ * order of _sensorIds. all of them are multiplexed over the one
+ * connection to the sfdroid daemon.
  */
 static const struct sensor_t sSensorListInit[] = {
         { .name       = "sfdroid 3-axis Accelerometer",
@@ -371,64 +1673,243 @@ static const struct sensor_t sSensorListInit[] = {
           .maxRange   = 500.f, // dummy
           .resolution = 1.f/2000.f, // dummy
           .power      = 3.0f,
+          .minDelay   = 10000,
+          .fifoReservedEventCount = 0,
+          .fifoMaxEventCount = SFDROID_FIFO_EVENTS,
+          .stringType = SENSOR_STRING_TYPE_ACCELEROMETER,
+          .requiredPermission = "",
+          .maxDelay   = 1000000,
+          .flags      = SENSOR_FLAG_CONTINUOUS_MODE,
           .reserved   = {}
         },
-#if 0
-        { .name       = "Goldfish 3-axis Magnetic field sensor",
-          .vendor     = "The Android Open Source Project",
+
+        { .name       = "sfdroid 3-axis Magnetic field sensor",
+          .vendor     = "sfdroid",
           .version    = 1,
           .handle     = ID_MAGNETIC_FIELD,
           .type       = SENSOR_TYPE_MAGNETIC_FIELD,
           .maxRange   = 2000.0f,
           .resolution = 1.0f,
           .power      = 6.7f,
+          .minDelay   = 10000,
+          .fifoReservedEventCount = 0,
+          .fifoMaxEventCount = SFDROID_FIFO_EVENTS,
+          .stringType = SENSOR_STRING_TYPE_MAGNETIC_FIELD,
+          .requiredPermission = "",
+          .maxDelay   = 1000000,
+          .flags      = SENSOR_FLAG_CONTINUOUS_MODE,
           .reserved   = {}
         },
 
-        { .name       = "Goldfish Orientation sensor",
-          .vendor     = "The Android Open Source Project",
+        { .name       = "sfdroid Orientation sensor",
+          .vendor     = "sfdroid",
           .version    = 1,
           .handle     = ID_ORIENTATION,
           .type       = SENSOR_TYPE_ORIENTATION,
           .maxRange   = 360.0f,
           .resolution = 1.0f,
           .power      = 9.7f,
+          .minDelay   = 10000,
+          .fifoReservedEventCount = 0,
+          .fifoMaxEventCount = SFDROID_FIFO_EVENTS,
+          .stringType = SENSOR_STRING_TYPE_ORIENTATION,
+          .requiredPermission = "",
+          .maxDelay   = 1000000,
+          .flags      = SENSOR_FLAG_CONTINUOUS_MODE,
+          .reserved   = {}
+        },
+
+        { .name       = "sfdroid 3-axis Gyroscope",
+          .vendor     = "sfdroid",
+          .version    = 1,
+          .handle     = ID_GYROSCOPE,
+          .type       = SENSOR_TYPE_GYROSCOPE,
+          .maxRange   = 35.0f, // dummy, rad/s
+          .resolution = 1.f/1000.f, // dummy
+          .power      = 6.1f,
+          .minDelay   = 5000,
+          .fifoReservedEventCount = 0,
+          .fifoMaxEventCount = SFDROID_FIFO_EVENTS,
+          .stringType = SENSOR_STRING_TYPE_GYROSCOPE,
+          .requiredPermission = "",
+          .maxDelay   = 1000000,
+          .flags      = SENSOR_FLAG_CONTINUOUS_MODE,
           .reserved   = {}
         },
 
-        { .name       = "Goldfish Temperature sensor",
-          .vendor     = "The Android Open Source Project",
+        { .name       = "sfdroid Light sensor",
+          .vendor     = "sfdroid",
           .version    = 1,
-          .handle     = ID_TEMPERATURE,
-          .type       = SENSOR_TYPE_TEMPERATURE,
-          .maxRange   = 80.0f,
+          .handle     = ID_LIGHT,
+          .type       = SENSOR_TYPE_LIGHT,
+          .maxRange   = 40000.0f,
           .resolution = 1.0f,
-          .power      = 0.0f,
+          .power      = 0.75f,
+          .minDelay   = 0,
+          .fifoReservedEventCount = 0,
+          .fifoMaxEventCount = 0,
+          .stringType = SENSOR_STRING_TYPE_LIGHT,
+          .requiredPermission = "",
+          .maxDelay   = 1000000,
+          .flags      = SENSOR_FLAG_ON_CHANGE_MODE,
           .reserved   = {}
         },
 
-        { .name       = "Goldfish Proximity sensor",
-          .vendor     = "The Android Open Source Project",
+        { .name       = "sfdroid Proximity sensor",
+          .vendor     = "sfdroid",
           .version    = 1,
           .handle     = ID_PROXIMITY,
           .type       = SENSOR_TYPE_PROXIMITY,
           .maxRange   = 1.0f,
           .resolution = 1.0f,
           .power      = 20.0f,
+          .minDelay   = 0,
+          .fifoReservedEventCount = 0,
+          .fifoMaxEventCount = 0,
+          .stringType = SENSOR_STRING_TYPE_PROXIMITY,
+          .requiredPermission = "",
+          .maxDelay   = 1000000,
+          .flags      = SENSOR_FLAG_ON_CHANGE_MODE | SENSOR_FLAG_WAKE_UP,
+          .reserved   = {}
+        },
+
+        { .name       = "sfdroid Rotation vector sensor",
+          .vendor     = "sfdroid",
+          .version    = 1,
+          .handle     = ID_ROTATION_VECTOR,
+          .type       = SENSOR_TYPE_ROTATION_VECTOR,
+          .maxRange   = 1.0f,
+          .resolution = 1.f/1000.f,
+          .power      = 9.7f,
+          .minDelay   = 10000,
+          .fifoReservedEventCount = 0,
+          .fifoMaxEventCount = SFDROID_FIFO_EVENTS,
+          .stringType = SENSOR_STRING_TYPE_ROTATION_VECTOR,
+          .requiredPermission = "",
+          .maxDelay   = 1000000,
+          .flags      = SENSOR_FLAG_CONTINUOUS_MODE,
           .reserved   = {}
         },
-#endif
 };
 
-static struct sensor_t  sSensorList[MAX_NUM_SENSORS];
+/* the sensors the daemon has, in the order of sSensorListInit */
+static pthread_mutex_t sSensorListLock = PTHREAD_MUTEX_INITIALIZER;
+static struct sensor_t sSensorList[MAX_NUM_SENSORS];
+static char sSensorNames[MAX_NUM_SENSORS][64];
+static char sSensorVendors[MAX_NUM_SENSORS][64];
+static int sNumSensors = -1;
+
+/*
+ * Ask the daemon which sensors it has on a connection of its own, see
+ * sfdroid_sensors_protocol.h. Returns the number of sensors put in infos,
+ * or -1 if the daemon can't tell.
+ */
+static int discover_sensors(sfdroid_sensor_info_t* infos, int max)
+{
+    SensorPoll* ctl = calloc(1, sizeof(*ctl));
+    SensorMessage msg;
+    int count = -1;
+
+    if (ctl == NULL)
+        return -1;
+    ctl->ring_fd = -1;
+    ctl->event_fd = -1;
+    ctl->wake_fd = -1;
+
+    ctl->fd = connect_to_sfdroid();
+    if (ctl->fd >= 0)
+        binary_setup(ctl);
+    if (ctl->fd >= 0 && ctl->binary &&
+            send_command(ctl, SFDROID_MSG_LIST, -1, 0, 0) == 0) {
+        int n = 0;
+
+        while (recv_reply(ctl, &msg) == 0) {
+            if (msg.type == SFDROID_MSG_REPLY) {
+                count = n;
+                break;
+            }
+            if (msg.type == SFDROID_MSG_SENSOR && n < max)
+                infos[n++] = msg.info;
+        }
+    }
+
+    disconnect_from_sfdroid(ctl);
+    free(ctl);
+    return count;
+}
+
+/*
+ * Build the sensor list once, from what the daemon reports if it can,
+ * else from sSensorListInit as it is. The framework reads it once, so it
+ * is kept even if the daemon comes and goes.
+ */
+static void load_sensor_list(void)
+{
+    sfdroid_sensor_info_t infos[MAX_NUM_SENSORS * 2];
+    int count;
+    int nn, k;
+
+    pthread_mutex_lock(&sSensorListLock);
+    if (sNumSensors >= 0) {
+        pthread_mutex_unlock(&sSensorListLock);
+        return;
+    }
+
+    count = discover_sensors(infos, sizeof(infos) / sizeof(infos[0]));
+    if (count < 0) {
+        ALOGI("sfdroid didn't list its sensors, exposing all of them");
+        memcpy(sSensorList, sSensorListInit, sizeof(sSensorListInit));
+        sNumSensors = MAX_NUM_SENSORS;
+        pthread_mutex_unlock(&sSensorListLock);
+        return;
+    }
+
+    sNumSensors = 0;
+    sSensorsPresent = 0;
+    for (nn = 0; nn < MAX_NUM_SENSORS; nn++) {
+        const sfdroid_sensor_info_t* info = NULL;
+        struct sensor_t* sensor = &sSensorList[sNumSensors];
+
+        for (k = 0; k < count && info == NULL; k++) {
+            if (infos[k].type == sSensorListInit[nn].type)
+                info = &infos[k];
+        }
+        if (info == NULL)
+            continue;
+
+        *sensor = sSensorListInit[nn];
+        sensor->minDelay = info->min_delay;
+        sensor->maxDelay = info->max_delay;
+        sensor->fifoReservedEventCount = info->fifo_reserved_event_count;
+        sensor->fifoMaxEventCount = info->fifo_max_event_count;
+        if (info->max_range > 0)
+            sensor->maxRange = info->max_range;
+        if (info->resolution > 0)
+            sensor->resolution = info->resolution;
+        if (info->power > 0)
+            sensor->power = info->power;
+        if (info->name[0]) {
+            strlcpy(sSensorNames[sNumSensors], info->name, sizeof(sSensorNames[0]));
+            sensor->name = sSensorNames[sNumSensors];
+        }
+        if (info->vendor[0]) {
+            strlcpy(sSensorVendors[sNumSensors], info->vendor, sizeof(sSensorVendors[0]));
+            sensor->vendor = sSensorVendors[sNumSensors];
+        }
+
+        sSensorsPresent |= 1 << nn;
+        sNumSensors++;
+    }
+    ALOGI("sfdroid has %d of the %d sensors", sNumSensors, MAX_NUM_SENSORS);
+    pthread_mutex_unlock(&sSensorListLock);
+}
 
 static int sensors__get_sensors_list(struct sensors_module_t* module,
         struct sensor_t const** list)
 {
-    // only accelerometer for now
-    sSensorList[0] = sSensorListInit[0];
+    load_sensor_list();
     *list = sSensorList;
-    return 1;
+    return sNumSensors;
 }
 
 
@@ -442,20 +1923,51 @@ open_sensors(const struct hw_module_t* module,
     D("%s: name=%s", __FUNCTION__, name);
 
     if (!strcmp(name, SENSORS_HARDWARE_POLL)) {
-        SensorPoll *dev = malloc(sizeof(*dev));
+        SensorPoll *dev;
+
+        /* before anything may be activated, so only present sensors are */
+        load_sensor_list();
+
+        dev = malloc(sizeof(*dev));
 
         memset(dev, 0, sizeof(*dev));
 
         dev->device.common.tag     = HARDWARE_DEVICE_TAG;
-        dev->device.common.version = 0;
+        dev->device.common.version = SENSORS_DEVICE_API_VERSION_1_3;
         dev->device.common.module  = (struct hw_module_t*) module;
         dev->device.common.close   = poll__close;
+        dev->device.common.ext     = &poll_device_ext;
         dev->device.poll           = poll__poll;
         dev->device.activate       = poll__activate;
         dev->device.setDelay       = poll__setDelay;
+        dev->device.batch          = poll__batch;
+        dev->device.flush          = poll__flush;
         dev->fd                    = -1;
-        dev->delay                 = 250000000;
-        dev->accelerometer_active  = 0;
+        for (int nn = 0; nn < MAX_NUM_SENSORS; nn++)
+            dev->delay[nn]         = 250000000;
+        dev->active                = 0;
+        dev->next_query            = 0;
+        dev->ring                  = NULL;
+        dev->ring_fd               = -1;
+        dev->event_fd              = -1;
+        dev->ring_unsupported      = 0;
+        dev->binary                = 0;
+        dev->binary_unsupported    = 0;
+        dev->batch_supported       = 0;
+        dev->streaming             = 0;
+        dev->stream_unsupported    = 0;
+        dev->rx_len                = 0;
+        dev->wake_fd               = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        pthread_mutex_init(&dev->lock, NULL);
+        pthread_cond_init(&dev->state_cond, NULL);
+        pthread_cond_init(&dev->cmd_cond, NULL);
+
+        if (pthread_create(&dev->manager, NULL, manager_thread, dev) != 0) {
+            E("%s: failed to start the connection thread", __FUNCTION__);
+            close(dev->wake_fd);
+            free(dev);
+            return -ENOMEM;
+        }
 
         *device = &dev->device.common;
         status  = 0;
@@ -472,7 +1984,7 @@ struct sensors_module_t HAL_MODULE_INFO_SYM = {
     .common = {
         .tag = HARDWARE_MODULE_TAG,
         .version_major = 1,
-        .version_minor = 0,
+        .hal_api_version = HARDWARE_HAL_API_VERSION_1_1,
         .id = SFDROID_SENSORS_HARDWARE_MODULE_ID,
         .name = "sfdroid SENSORS Module",
         .author = "The Android Open Source Project",
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SFDROID_SENSORS_PROTOCOL_H_
+#define SFDROID_SENSORS_PROTOCOL_H_
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * Protocol between sfdroid_sensors and the sfdroid sensor daemon.
+ *
+ * Every message on the socket is a length byte followed by that many bytes
+ * of NUL terminated ASCII. Requests are "get:<sensor>", answered with one
+ * event message "<sensor>:<value>:...:<timestamp>" such as
+ * "acceleration:<x>:<y>:<z>:<timestamp>", "set:<sensor>:<0|1>" and
+ * "setDelay:<sensor>:<ns>", which are not answered. All sensors share the
+ * connection; events carry as many values as the sensor type has in
+ * sensors_event_t.
+ *
+ * Streaming: without the ring below, sfdroid_sensors sends "stream:1"
+ * right after connecting. A daemon answering "ok" then sends the event
+ * messages of every active sensor on its own at the rate set with
+ * "setDelay:", stamped with the time the sample was taken, and no longer
+ * expects "get:". Any other answer, or none, means it only answers
+ * requests.
+ *
+ * Batching: a daemon that answers the ring or stream setup with "ok:batch"
+ * instead of "ok" also takes "batch:<sensor>:<period ns>:<latency ns>",
+ * queueing up to SFDROID_FIFO_EVENTS events of the sensor for at most the
+ * latency before delivering them in one burst, and "flush:<sensor>", after
+ * which it delivers the queued events followed by a flush completion:
+ * the message "flush:<sensor>" or a SENSOR_TYPE_META_DATA ring event.
+ * Neither request is answered.
+ */
+#define SFDROID_FIFO_EVENTS     1000
+
+/*
+ * Binary messages: the ASCII messages above cost a snprintf() and a
+ * strtok()/sscanf() on each side per command and event. Before anything
+ * else sfdroid_sensors sends "binary:<version>"; a daemon answering "ok"
+ * switches the connection to binary messages in both directions right
+ * after its answer. Any other answer, or none, means the daemon only
+ * speaks ASCII and sfdroid_sensors reconnects to start over with it.
+ *
+ * A binary message is a sfdroid_sensor_msg_header_t in host byte order
+ * followed by its payload: for SFDROID_MSG_EVENT a sfdroid_sensor_event_t,
+ * which may end after the last value the sensor has, for the others the
+ * int64_t arguments listed below. The sensor is named by its SENSOR_TYPE_*
+ * in the header. Each binary message replaces the ASCII one of the same
+ * name and has the same meaning; several may be sent in one write.
+ * Messages from the daemon are at most SFDROID_MSG_MAX_SIZE bytes.
+ */
+#define SFDROID_BINARY_VERSION  1
+#define SFDROID_MSG_MAX_SIZE    256
+
+enum {
+    SFDROID_MSG_GET         = 1,    /* "get:", answered with an event */
+    SFDROID_MSG_ACTIVATE    = 2,    /* "set:", 0 or 1 */
+    SFDROID_MSG_SET_DELAY   = 3,    /* "setDelay:", period in ns */
+    SFDROID_MSG_BATCH       = 4,    /* "batch:", period and latency in ns */
+    SFDROID_MSG_FLUSH       = 5,    /* "flush:" */
+    SFDROID_MSG_STREAM      = 6,    /* "stream:", 1 */
+    SFDROID_MSG_RING        = 7,    /* "ring:", SFDROID_RING_VERSION */
+    SFDROID_MSG_PING        = 8,    /* "ping:", t */
+    SFDROID_MSG_PONG        = 9,    /* "pong:", t and now */
+    SFDROID_MSG_REPLY       = 10,   /* "ok" answers, SFDROID_REPLY_* bits */
+    SFDROID_MSG_EVENT       = 11,   /* events and flush completions */
+    SFDROID_MSG_LIST        = 12,   /* binary only, see below */
+    SFDROID_MSG_SENSOR      = 13,   /* binary only, see below */
+};
+
+#define SFDROID_REPLY_OK        0x1
+#define SFDROID_REPLY_BATCH     0x2 /* "ok:batch" */
+
+typedef struct sfdroid_sensor_msg_header_t {
+    /* of the whole message, header included */
+    uint16_t size;
+    /* SFDROID_MSG_* */
+    uint16_t type;
+    /* SENSOR_TYPE_*, 0 for messages that aren't about a sensor */
+    int32_t sensor;
+} sfdroid_sensor_msg_header_t;
+
+/*
+ * Sensor discovery: when the HAL is opened sfdroid_sensors connects,
+ * switches to binary messages and sends SFDROID_MSG_LIST. The daemon
+ * answers with one SFDROID_MSG_SENSOR per sensor it has, carrying a
+ * sfdroid_sensor_info_t, then a SFDROID_MSG_REPLY. Only those sensors are
+ * exposed to the framework, with the characteristics the daemon gave.
+ * A daemon not answering within the socket timeout, or only speaking
+ * ASCII, is assumed to have every sensor sfdroid_sensors knows about.
+ */
+typedef struct sfdroid_sensor_info_t {
+    /* SENSOR_TYPE_* */
+    int32_t type;
+    /* as in sensor_t, in microseconds */
+    int32_t min_delay;
+    int32_t max_delay;
+    /* events of the daemon's FIFO, 0 if it doesn't batch the sensor */
+    uint32_t fifo_reserved_event_count;
+    uint32_t fifo_max_event_count;
+    /* as in sensor_t, 0 to keep the defaults of sfdroid_sensors */
+    float max_range;
+    float resolution;
+    float power;
+    /* NUL terminated, empty to keep the defaults of sfdroid_sensors */
+    char name[64];
+    char vendor[64];
+} sfdroid_sensor_info_t;
+
+/*
+ * Clock: Android expects event timestamps in CLOCK_BOOTTIME, which the
+ * daemon's clock need not match. Right after connecting sfdroid_sensors
+ * sends SFDROID_CLOCK_HANDSHAKE_PINGS times "ping:<t>", each once the
+ * previous one was answered, t being its CLOCK_BOOTTIME in nanoseconds.
+ * The daemon answers "pong:<t>:<now>", now being the time in nanoseconds
+ * on the clock it stamps events with. Any other answer, or none, means it
+ * does not know the request and its timestamps are used as they are.
+ *
+ * While sensors are active sfdroid_sensors sends another ping every
+ * SFDROID_CLOCK_PING_MS; the daemon answers it between event messages.
+ * Timestamps are translated with the offset measured by the ping with the
+ * shortest round trip among the last SFDROID_CLOCK_SAMPLES, so the error
+ * stays below half that round trip.
+ */
+#define SFDROID_CLOCK_HANDSHAKE_PINGS   4
+#define SFDROID_CLOCK_PING_MS           5000
+#define SFDROID_CLOCK_SAMPLES           8
+
+/*
+ * Shared memory event ring.
+ *
+ * Requesting every sample costs a full round trip on the socket. When the
+ * daemon supports it, it instead writes binary events into a ring living
+ * in an ashmem region created by sfdroid_sensors, which drains it in bulk.
+ *
+ * Setup: sfdroid_sensors sends "ring:<version>" and right after that the
+ * ring region and an eventfd (daemon -> sfdroid_sensors) attached via
+ * SCM_RIGHTS to a single byte message. The daemon answers "ok" once it has
+ * mapped the ring; any other answer, or none within the socket timeout,
+ * means the ring is not used and samples are requested as before.
+ *
+ * The daemon is the only writer of head and the events, sfdroid_sensors
+ * the only writer of tail. The daemon writes an event at head, then
+ * advances head with release semantics; when the ring is full it drops the
+ * event and counts it in dropped. It writes the eventfd after advancing
+ * head only while reader_waiting is set, so draining a busy ring costs no
+ * syscall per event.
+ */
+#define SFDROID_RING_MAGIC      0x53465352  /* 'SFSR' */
+#define SFDROID_RING_VERSION    1
+#define SFDROID_RING_CAPACITY   256         /* must be a power of two */
+
+typedef struct sfdroid_sensor_event_t {
+    /* SENSOR_TYPE_*, SENSOR_TYPE_META_DATA for a flush completion */
+    int32_t type;
+    /* SENSOR_TYPE_* of the flushed sensor for SENSOR_TYPE_META_DATA, else 0 */
+    int32_t meta_type;
+    /* nanoseconds */
+    int64_t timestamp;
+    /* as in sensors_event_t */
+    float data[16];
+} sfdroid_sensor_event_t;
+
+typedef struct sfdroid_sensor_ring_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t event_size;
+
+    /* number of events ever written, written by the daemon only */
+    volatile int32_t head __attribute__((aligned(64)));
+    /* events the daemon could not write because the ring was full */
+    volatile int32_t dropped;
+    /* number of events ever read, written by sfdroid_sensors only */
+    volatile int32_t tail __attribute__((aligned(64)));
+    /* set by sfdroid_sensors before it blocks on the eventfd */
+    volatile int32_t reader_waiting;
+
+    sfdroid_sensor_event_t events[SFDROID_RING_CAPACITY] __attribute__((aligned(64)));
+} sfdroid_sensor_ring_t;
+
+__END_DECLS
+
+#endif /* SFDROID_SENSORS_PROTOCOL_H_ */
@@ -20,15 +20,22 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
-LOCAL_SHARED_LIBRARIES := liblog libcutils libhardware libstlport
+LOCAL_SHARED_LIBRARIES := liblog libcutils libhardware libstlport libsync
+LOCAL_STATIC_LIBRARIES := libsfdroid_ipc
 
 LOCAL_SRC_FILES := 	\
-	sharebuffer.cpp
+	sharebuffer.cpp \
+	sb_registry.cpp
 
 LOCAL_C_INCLUDES := bionic \
+	system/core/libsync \
+	$(LOCAL_PATH)/../gralloc \
+	$(LOCAL_PATH)/../sfdroid_ipc \
 	external/stlport/stlport
 
 LOCAL_MODULE := sharebuffer.default
 LOCAL_CFLAGS:= -DLOG_TAG=\"sharebuffer\"
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(call all-makefiles-under, $(LOCAL_PATH))
@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SHAREBUFFER_PROTOCOL_H_
+#define SHAREBUFFER_PROTOCOL_H_
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * Wire protocol between sharebuffer and the sfdroid renderer.
+ *
+ * Every request starts with a one byte opcode sent on the renderer socket.
+ * A byte below SB_MAX_BYTE_SLOT (0xF7) is the slot id of a buffer
+ * registered earlier and asks the renderer to show it; larger slot ids are
+ * sent with SB_OP_POST_SLOT. Each request is answered with a 3 byte, NUL
+ * terminated status string, "OK" or "FA".
+ *
+ * Slot ids: a buffer registered with SB_OP_NEW_BUFFER takes the lowest
+ * slot id not in use on the connection. SB_OP_FREE_BUFFER releases a slot
+ * id for reuse; a renderer that answers it with "FA" is assumed to number
+ * buffers in registration order and ids are then never reused.
+ */
+#define SB_OP_NEW_BUFFER    0xFF    /* followed by buffer_info_t + handle */
+#define SB_OP_LAYER_NAME    0xFE    /* followed by length byte + name */
+#define SB_OP_CLOSE_LAYER   0xFD    /* followed by length byte + name, framed from version 9 */
+#define SB_OP_RING          0xFC    /* shared memory ring setup, see below */
+#define SB_OP_POST_SLOT     0xFB    /* followed by int32_t slot id */
+#define SB_OP_FREE_BUFFER   0xFA    /* followed by int32_t slot id */
+#define SB_OP_RESUME        0xF9    /* session resumption, see below */
+#define SB_OP_NEW_BUFFERS   0xF8    /* batched registration, see below */
+#define SB_OP_HELLO         0xF7    /* protocol version, see below */
+/* only on framed connections, see below */
+#define SB_OP_LAYER_HINTS   0xF6
+#define SB_OP_FORMATS       0xF5
+#define SB_OP_DISPLAY_INFO  0xF4
+#define SB_OP_ACQUIRE_FENCE 0xF3
+#define SB_OP_LAYER_POSITION 0xF2
+
+#define SB_MAX_BYTE_SLOT    0xF7
+
+/* rectangle in buffer coordinates, right and bottom exclusive */
+typedef struct sb_ring_rect_t {
+    int32_t left;
+    int32_t top;
+    int32_t right;
+    int32_t bottom;
+} sb_ring_rect_t;
+
+/*
+ * Protocol version.
+ *
+ * Right after the layer name sharebuffer sends SB_OP_HELLO alone; a
+ * renderer that does not know it answers "FA" and speaks version 1, the
+ * byte opcodes above. Otherwise it answers "OK", sharebuffer sends a
+ * sb_hello_t with the highest version it implements and the renderer
+ * replies with a sb_hello_t holding the version used on this connection,
+ * never higher than the offered one, and the id it gave the layer.
+ *
+ * From version 2 on, posts and frees are sent as a sb_frame_header_t with
+ * opcode SB_OP_POST_SLOT or SB_OP_FREE_BUFFER, followed by num_rects
+ * sb_ring_rect_t damage rectangles, in a single write; single byte slot
+ * posts are not used. The status reply and all setup requests are the
+ * same as in version 1.
+ *
+ * From version 3 on, the status answering a post is followed by a
+ * sb_frame_times_t.
+ *
+ * From version 4 on, posts carry SB_FRAME_FLAG_* in their flags and
+ * sharebuffer sends the composition hints of its layer whenever they
+ * change, as a sb_frame_header_t with opcode SB_OP_LAYER_HINTS followed
+ * by a sb_layer_hints_wire_t, answered with a status. The hints apply to
+ * all following posts, so the renderer can scan out or skip blending a
+ * buffer that covers the whole output opaquely.
+ *
+ * From version 5 on, sharebuffer asks for the pixel formats the renderer
+ * can import right after the handshake with a sb_frame_header_t with
+ * opcode SB_OP_FORMATS. The renderer answers with a status followed by a
+ * sb_formats_t and that many int32_t HAL_PIXEL_FORMAT_* values, at most
+ * SB_MAX_FORMATS. sharebuffer then no longer sends buffers of other
+ * formats; a version 1 to 4 renderer is assumed to take every format.
+ *
+ * From version 6 on, sharebuffer may ask for the geometry of the output
+ * with a sb_frame_header_t with opcode SB_OP_DISPLAY_INFO, on a connection
+ * of its own without a layer name that it closes right after. The
+ * renderer answers with a status followed, if "OK", by a
+ * sb_display_info_t. sharebuffer then does not probe the framebuffer
+ * device, which the host compositor usually owns.
+ *
+ * From version 7 on, layer hints may carry SB_FRAME_FLAG_UNDERLAY: the
+ * renderer shows the layer below all other layers of the same client,
+ * which it blends on top. Earlier renderers would show it on top, so
+ * sharebuffer refuses the hint with them.
+ *
+ * From version 8 on, a post may come with the acquire fence of its
+ * buffer, a sync fence fd that signals once the producer is done writing
+ * it. The renderer waits for it on its GPU before reading the buffer
+ * instead of sharebuffer waiting on the CPU before posting. A framed post
+ * on the socket then has SB_FRAME_FLAG_ACQUIRE_FENCE set and the fence
+ * attached via SCM_RIGHTS. A ring slot has the flag set in its flags and
+ * its fence is sent on the socket before the slot is published, as a
+ * sb_frame_header_t with opcode SB_OP_ACQUIRE_FENCE and the number of
+ * the slot (the head it was posted at) in slot, with the fence attached.
+ * That message is not answered. Since every other request on the socket
+ * is answered before sharebuffer goes on, a renderer draining a slot
+ * with the flag set finds its fence as the next message of the socket.
+ * Buffers are still registered without a fence, sharebuffer waits for
+ * it first.
+ *
+ * From version 9 on, a layer is closed with a sb_frame_header_t with
+ * opcode SB_OP_CLOSE_LAYER and the layer id of the connection instead of
+ * its name, not answered. The name is only ever sent once per connection,
+ * ahead of the handshake.
+ *
+ * From version 10 on, layer hints may carry SB_FRAME_FLAG_OVERLAY: the
+ * layer is a small buffer, e.g. a cursor, that the renderer shows above
+ * all other layers of the same client, at the frame of its hints. It is
+ * moved with a sb_frame_header_t with opcode SB_OP_LAYER_POSITION followed
+ * by a sb_layer_position_t, not answered: the frame keeps its size and its
+ * top left corner goes to the new position, for the next composition and
+ * all following posts, without the buffer being posted again. Earlier
+ * renderers show the layer as any other; sharebuffer sends them the moved
+ * frame with the hints of the next post.
+ */
+#define SB_PROTOCOL_VERSION_LEGACY  1
+#define SB_PROTOCOL_VERSION_FRAMED  2
+#define SB_PROTOCOL_VERSION_TIMING  3
+#define SB_PROTOCOL_VERSION_HINTS   4
+#define SB_PROTOCOL_VERSION_FORMATS 5
+#define SB_PROTOCOL_VERSION_DISPLAY 6
+#define SB_PROTOCOL_VERSION_UNDERLAY 7
+#define SB_PROTOCOL_VERSION_FENCES  8
+#define SB_PROTOCOL_VERSION_LAYER_IDS 9
+#define SB_PROTOCOL_VERSION_OVERLAY 10
+#define SB_PROTOCOL_VERSION         SB_PROTOCOL_VERSION_OVERLAY
+
+#define SB_MAX_FORMATS      32
+
+typedef struct sb_formats_t {
+    uint32_t count;
+} sb_formats_t;
+
+typedef struct sb_display_info_t {
+    /* in pixels */
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    /* HAL_PIXEL_FORMAT_* of the output */
+    int32_t format;
+    /* dots per 1000 inches */
+    uint32_t xdpi_milli;
+    uint32_t ydpi_milli;
+    /* refresh rate in mHz */
+    uint32_t refresh_mhz;
+    uint32_t reserved;
+} sb_display_info_t;
+
+/* the buffer has no meaningful alpha */
+#define SB_FRAME_FLAG_OPAQUE        0x01
+/* the buffer covers the whole output */
+#define SB_FRAME_FLAG_FULLSCREEN    0x02
+/* a later post may replace this one before it is shown, ring version 5 */
+#define SB_FRAME_FLAG_MAILBOX       0x04
+/* layer hints only: shown below the other layers of the client, version 7 */
+#define SB_FRAME_FLAG_UNDERLAY      0x08
+/* posts only: an acquire fence comes with the buffer, version 8 */
+#define SB_FRAME_FLAG_ACQUIRE_FENCE 0x10
+/* layer hints only: shown above the other layers of the client, version 10 */
+#define SB_FRAME_FLAG_OVERLAY       0x20
+
+#define SB_HELLO_MAGIC      0x53424845  /* 'SBHE' */
+
+typedef struct sb_hello_t {
+    uint32_t magic;
+    uint32_t version;
+    /* assigned by the renderer, 0 when offering */
+    uint32_t layer_id;
+    uint32_t reserved;
+} sb_hello_t;
+
+/* CLOCK_MONOTONIC nanoseconds, 0 if not known (yet) */
+typedef struct sb_frame_times_t {
+    int64_t latch_ns;
+    int64_t present_ns;
+} sb_frame_times_t;
+
+typedef struct sb_layer_hints_wire_t {
+    /* SB_FRAME_FLAG_* */
+    uint32_t flags;
+    /* HAL_TRANSFORM_* to apply to the buffer */
+    int32_t transform;
+    /* part of the buffer to show, empty for all of it */
+    sb_ring_rect_t crop;
+    /* where to show it on the output, empty for the whole output */
+    sb_ring_rect_t frame;
+    /* 0 (transparent) to 255 (opaque), applied on top of per pixel alpha */
+    uint32_t plane_alpha;
+    uint32_t reserved;
+} sb_layer_hints_wire_t;
+
+/* output coordinates of the top left corner of the frame, version 10 */
+typedef struct sb_layer_position_t {
+    int32_t x;
+    int32_t y;
+} sb_layer_position_t;
+
+typedef struct sb_frame_header_t {
+    uint8_t opcode;
+    /* SB_FRAME_FLAG_* from version 4 on, 0 before */
+    uint8_t flags;
+    /* damage rectangles following the header, 0 means all of the buffer */
+    uint16_t num_rects;
+    /* as returned in sb_hello_t */
+    uint32_t layer_id;
+    int32_t slot;
+    uint32_t reserved;
+    /* CLOCK_MONOTONIC time of the request in nanoseconds */
+    int64_t timestamp_ns;
+} sb_frame_header_t;
+
+/*
+ * Session resumption.
+ *
+ * After the version handshake sharebuffer sends SB_OP_RESUME alone; a
+ * renderer that does not know it answers "FA". If it answers "OK", sharebuffer sends the uint64_t token of its session. The
+ * renderer answers "OK" if it still holds the buffers registered on an
+ * earlier connection that used the same token, with their slot ids, and
+ * "FA" if it does not. Either way the token now identifies this
+ * connection, and the renderer should keep the buffers of a token for a
+ * while after its connection dropped so that a transient disconnect does
+ * not require sending every buffer again.
+ */
+
+/*
+ * Batched registration.
+ *
+ * After resumption sharebuffer sends SB_OP_NEW_BUFFERS alone; a renderer
+ * that answers "OK" accepts batches on this connection. A batch is a
+ * single message: the opcode, a sb_batch_header_t and for every buffer its
+ * buffer_info_t followed by its native_handle_t (header, fds and ints),
+ * with the fds of all buffers attached in order in one SCM_RIGHTS control
+ * message. The renderer imports the buffers without showing them and
+ * answers once: "OK" if all of them now hold the lowest free slot ids in
+ * batch order, "FA" if none was registered.
+ */
+#define SB_BATCH_MAX_BUFFERS    16
+#define SB_BATCH_MAX_FDS        253     /* SCM_MAX_FD */
+
+typedef struct sb_batch_header_t {
+    uint32_t count;
+} sb_batch_header_t;
+
+#define SB_STATUS_OK        "OK"
+#define SB_STATUS_FAILED    "FA"
+
+/*
+ * Shared memory post ring.
+ *
+ * Posting a buffer that is already registered costs a send() and a full
+ * round trip for the status on the socket. When the renderer supports it,
+ * sharebuffer instead enqueues the buffer index in a ring living in an
+ * ashmem region and signals an eventfd; the renderer reports the status
+ * of each post in the slot and advances tail once it no longer reads the
+ * buffer of that slot, i.e. when a later post replaced it on screen or it
+ * was dropped, then signals a second eventfd. sharebuffer turns every
+ * released slot into a signalled release fence.
+ *
+ * Setup: sharebuffer sends SB_OP_RING alone. A renderer that does not
+ * know the opcode answers "FA" and the socket protocol is used as before.
+ * Otherwise it answers "OK" and sharebuffer sends a sb_ring_setup_t with
+ * three fds attached via SCM_RIGHTS: the ring region, the post eventfd
+ * (sharebuffer -> renderer) and the release eventfd (renderer ->
+ * sharebuffer). The renderer answers "OK" once it has mapped the ring, or
+ * "FA" if it does not implement the ring version in sb_ring_setup_t, in
+ * which case sharebuffer may offer an earlier version again.
+ *
+ * Version 4 adds the timing array after the slots, which the renderer
+ * fills in for a slot before it advances tail past it. The rest of the
+ * layout is that of version 3.
+ *
+ * Version 5 adds mailbox posts, same layout as version 4. When the slot
+ * the renderer is about to show has SB_FRAME_FLAG_MAILBOX set and newer
+ * slots are already pending, it shows the newest one instead and releases
+ * the ones in between without showing them, with status
+ * SB_RING_STATUS_REPLACED. sharebuffer then no longer waits for the post
+ * depth before posting a mailbox slot, only for a free slot, so a slow
+ * renderer always shows the latest frame instead of queueing them.
+ *
+ * Ordering: buffers are still registered on the socket, which also shows
+ * them. The renderer must drain the ring before it handles any message
+ * received on the socket so that posts are shown in order.
+ */
+#define SB_RING_MAGIC       0x53425247  /* 'SBRG' */
+#define SB_RING_VERSION     5
+/* the first version with the timing array */
+#define SB_RING_VERSION_TIMING      4
+/* the last version without the timing array */
+#define SB_RING_VERSION_NO_TIMING   3
+#define SB_RING_SLOTS       8           /* must be a power of two */
+#define SB_RING_MAX_RECTS   4
+
+#define SB_RING_STATUS_PENDING  0
+#define SB_RING_STATUS_OK       1
+#define SB_RING_STATUS_FAILED   2
+/* a newer mailbox post was shown instead, ring version 5 */
+#define SB_RING_STATUS_REPLACED 3
+
+typedef struct sb_ring_slot_t {
+    /* slot id of the buffer to show */
+    int32_t index;
+    /* SB_RING_STATUS_*, written by the renderer before it advances tail */
+    int32_t status;
+    /*
+     * Areas of the buffer that changed since the previous post of the
+     * layer. 0 means the whole buffer must be considered damaged.
+     */
+    int32_t num_rects;
+    /* SB_FRAME_FLAG_* of the post from ring version 4 on, 0 before */
+    int32_t flags;
+    sb_ring_rect_t rects[SB_RING_MAX_RECTS];
+} sb_ring_slot_t;
+
+typedef struct sb_ring_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t reserved;
+
+    /* number of slots ever posted, written by sharebuffer only */
+    volatile int32_t head __attribute__((aligned(64)));
+    /* number of slots ever released, written by the renderer only */
+    volatile int32_t tail __attribute__((aligned(64)));
+    /*
+     * Set by the renderer before it blocks on the post eventfd. sharebuffer
+     * only writes the eventfd when this is set, so a busy renderer draining
+     * the ring costs no syscall per post.
+     */
+    volatile int32_t renderer_waiting;
+
+    /*
+     * Last vsync of the output the layer is shown on, CLOCK_MONOTONIC,
+     * and the refresh period, both in nanoseconds. Written by the renderer
+     * under a sequence lock: vsync_seq is odd while an update is in
+     * progress. sharebuffer paces posts for swap intervals > 0 on them.
+     */
+    volatile int32_t vsync_seq;
+    volatile int32_t vsync_period_ns;
+    volatile int64_t vsync_timestamp_ns;
+    /*
+     * Set by the renderer while nothing of the layer can be seen, e.g.
+     * behind a fullscreen window or on a hidden output, and cleared once
+     * it can. sharebuffer skips posts meanwhile. Any ring version may set
+     * it, it stays 0 with renderers that do not know it.
+     */
+    volatile int32_t occluded;
+
+    sb_ring_slot_t slots[SB_RING_SLOTS] __attribute__((aligned(64)));
+
+    /* version 4 */
+    sb_frame_times_t timing[SB_RING_SLOTS];
+} sb_ring_t;
+
+typedef struct sb_ring_setup_t {
+    uint32_t version;
+    uint32_t size;      /* size of the shared region in bytes */
+} sb_ring_setup_t;
+
+__END_DECLS
+
+#endif /* SHAREBUFFER_PROTOCOL_H_ */
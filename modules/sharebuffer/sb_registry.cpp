@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sb_registry.h"
+
+#define INITIAL_CAPACITY 16
+
+BufferRegistry::BufferRegistry()
+    : mTable(INITIAL_CAPACITY),
+      mCount(0),
+      mUsed(0),
+      mReuseIds(true)
+{
+}
+
+size_t BufferRegistry::bucket(buffer_handle_t handle) const
+{
+    // handles are heap pointers, drop the alignment bits before mixing
+    uintptr_t key = reinterpret_cast<uintptr_t>(handle) >> 4;
+    key *= 0x9E3779B1u;
+    return key & (mTable.size() - 1);
+}
+
+const BufferRegistry::Entry* BufferRegistry::lookup(buffer_handle_t handle) const
+{
+    size_t mask = mTable.size() - 1;
+
+    for (size_t i = bucket(handle); mTable[i].handle; i = (i + 1) & mask) {
+        if (mTable[i].handle == handle)
+            return &mTable[i];
+    }
+    return NULL;
+}
+
+bool BufferRegistry::matches(const Entry& e, buffer_handle_t handle)
+{
+    const gralloc_buffer_identity_t *identity = gralloc_buffer_identity(handle);
+
+    if (!identity)
+        return !e.buffer_id;
+    return identity->id == e.buffer_id && identity->generation == e.generation;
+}
+
+int32_t BufferRegistry::find(buffer_handle_t handle) const
+{
+    const gralloc_buffer_identity_t *identity = gralloc_buffer_identity(handle);
+
+    // never sent to a renderer, no need to look
+    if (identity && !(identity->flags & GRALLOC_BUFFER_EXPORTED))
+        return -1;
+
+    const Entry *e = lookup(handle);
+    return e && matches(*e, handle) ? e->id : -1;
+}
+
+bool BufferRegistry::isStale(buffer_handle_t handle) const
+{
+    const Entry *e = lookup(handle);
+    return e && !matches(*e, handle);
+}
+
+void BufferRegistry::insert(const Entry& entry)
+{
+    size_t mask = mTable.size() - 1;
+    size_t i = bucket(entry.handle);
+
+    while (mTable[i].handle && mTable[i].handle != tombstone())
+        i = (i + 1) & mask;
+    if (!mTable[i].handle)
+        mUsed++;
+    mTable[i] = entry;
+}
+
+void BufferRegistry::rehash(size_t capacity)
+{
+    std::vector<Entry> old(capacity);
+    old.swap(mTable);
+    mUsed = 0;
+
+    for (size_t i = 0; i < old.size(); i++) {
+        if (old[i].handle && old[i].handle != tombstone())
+            insert(old[i]);
+    }
+}
+
+int32_t BufferRegistry::add(buffer_handle_t handle)
+{
+    int32_t id = mSlots.size();
+
+    if (mReuseIds) {
+        for (size_t i = 0; i < mSlots.size(); i++) {
+            if (!mSlots[i]) {
+                id = i;
+                break;
+            }
+        }
+    }
+    if (id == (int32_t)mSlots.size())
+        mSlots.push_back(handle);
+    else
+        mSlots[id] = handle;
+
+    // keep the table at most half full, counting tombstones
+    if ((mUsed + 1) * 2 > mTable.size())
+        rehash(mCount * 2 >= mTable.size() / 2 ? mTable.size() * 2 : mTable.size());
+
+    Entry entry;
+    entry.handle = handle;
+    entry.id = id;
+    entry.buffer_id = 0;
+    entry.generation = 0;
+    gralloc_buffer_identity_t *identity = gralloc_buffer_identity(handle);
+    if (identity) {
+        entry.buffer_id = identity->id;
+        entry.generation = identity->generation;
+        identity->flags |= GRALLOC_BUFFER_EXPORTED;
+    }
+    insert(entry);
+    mCount++;
+
+    return id;
+}
+
+int32_t BufferRegistry::remove(buffer_handle_t handle)
+{
+    return remove(handle, NULL);
+}
+
+int32_t BufferRegistry::detach(buffer_handle_t handle)
+{
+    return remove(handle, tombstone());
+}
+
+void BufferRegistry::releaseId(int32_t id)
+{
+    if (id >= 0 && id < (int32_t)mSlots.size() && mSlots[id] == tombstone())
+        mSlots[id] = NULL;
+}
+
+int32_t BufferRegistry::remove(buffer_handle_t handle, buffer_handle_t slot)
+{
+    size_t mask = mTable.size() - 1;
+
+    for (size_t i = bucket(handle); mTable[i].handle; i = (i + 1) & mask) {
+        if (mTable[i].handle == handle) {
+            int32_t id = mTable[i].id;
+            mTable[i].handle = tombstone();
+            mSlots[id] = slot;
+            mCount--;
+            return id;
+        }
+    }
+    return -1;
+}
+
+void BufferRegistry::clear()
+{
+    std::vector<Entry>(INITIAL_CAPACITY).swap(mTable);
+    mSlots.clear();
+    mCount = 0;
+    mUsed = 0;
+    mReuseIds = true;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SHAREBUFFER_REGISTRY_H_
+#define SHAREBUFFER_REGISTRY_H_
+
+#include <stdint.h>
+
+#include <hardware/gralloc.h>
+
+#include <vector>
+
+#include "gralloc_buffer_id.h"
+
+/*
+ * Buffers known to the renderer, mapping each handle to the slot id it
+ * was registered under. Lookups by handle go through an open addressing
+ * hash table so posting costs the same with 3 or 300 buffers.
+ *
+ * Slot ids are assigned by the same rule on both ends of the connection:
+ * a new buffer takes the lowest free id. Ids of evicted buffers are only
+ * reused while the renderer acknowledges evictions (setReuseIds()).
+ *
+ * Handles of the default gralloc also carry a gralloc_buffer_identity_t,
+ * recorded on registration, so that a freed handle's address reused by
+ * another buffer is not mistaken for the registered one (isStale()).
+ */
+class BufferRegistry {
+public:
+    BufferRegistry();
+
+    // slot id of handle, or -1 if it is not registered
+    int32_t find(buffer_handle_t handle) const;
+
+    /*
+     * True if a handle registered at the address of handle was freed
+     * without remove() and handle is a different one; remove() it before
+     * registering handle.
+     */
+    bool isStale(buffer_handle_t handle) const;
+
+    // register handle and return its new slot id
+    int32_t add(buffer_handle_t handle);
+
+    // forget handle, returns its slot id or -1 if it was not registered
+    int32_t remove(buffer_handle_t handle);
+
+    /*
+     * Forget handle but keep its slot id out of use until releaseId(),
+     * for evictions the renderer has not been told about yet.
+     */
+    int32_t detach(buffer_handle_t handle);
+    void releaseId(int32_t id);
+
+    void clear();
+
+    size_t size() const { return mCount; }
+
+    void setReuseIds(bool reuse) { mReuseIds = reuse; }
+
+private:
+    struct Entry {
+        buffer_handle_t handle;
+        int32_t id;
+        // identity of handle when it was registered, 0 if it has none
+        uint64_t buffer_id;
+        uint32_t generation;
+    };
+
+    static buffer_handle_t tombstone() {
+        return reinterpret_cast<buffer_handle_t>(-1);
+    }
+
+    int32_t remove(buffer_handle_t handle, buffer_handle_t slot);
+    const Entry* lookup(buffer_handle_t handle) const;
+    static bool matches(const Entry& e, buffer_handle_t handle);
+    size_t bucket(buffer_handle_t handle) const;
+    void rehash(size_t capacity);
+    void insert(const Entry& entry);
+
+    std::vector<Entry> mTable;
+    std::vector<buffer_handle_t> mSlots;
+    size_t mCount;
+    size_t mUsed;       // live entries plus tombstones in mTable
+    bool mReuseIds;
+};
+
+#endif /* SHAREBUFFER_REGISTRY_H_ */
@@ -19,32 +19,67 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <poll.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 
 #include <sys/socket.h>
-#include <sys/un.h>
+#include <sys/uio.h>
 
-#include <cutils/ashmem.h>
 #include <cutils/log.h>
 #include <cutils/atomic.h>
+#include <cutils/properties.h>
+
+#include <sw_sync.h>
+#include <sync/sync.h>
 
 #include <hardware/hardware.h>
 #include <hardware/gralloc.h>
+#include <hardware/hal_trace.h>
 #include <hardware/sb.h>
 
 #include <linux/fb.h>
 
+#include <map>
+#include <string>
 #include <vector>
 
+#include "sb_protocol.h"
+#include "sb_registry.h"
+#include "sfdroid_ipc.h"
+
 #define NUM_BUFFERS 2
 
-#define SFDROID_ROOT "/tmp/sfdroid/"
-#define SHM_BUFFER_HANDLE_FILE (SFDROID_ROOT "/gralloc_buffer_handle")
+#define RENDERER_SOCKET_NAME "gralloc_buffer_handle"
+
+// how long sb_post waits for the renderer to release a buffer
+#define RING_FULL_TIMEOUT_MS 1000
+
+// how long a post waits for an acquire fence the renderer can't take
+#define ACQUIRE_FENCE_TIMEOUT_MS 1000
+
+// frames in flight (shown or queued) when posting through the ring
+#define DEFAULT_POST_DEPTH 2
+
+// backoff between reconnection attempts while the renderer is away
+#define RECONNECT_MIN_MS 50
+#define RECONNECT_MAX_MS 2000
+
+// how long device open waits for the renderer to describe its output
+#define DISPLAY_INFO_TIMEOUT_MS 500
+
+// reads of the ring vsync before falling back to the refresh rate, a
+// renderer that died halfway through an update leaves it odd for good
+#define VSYNC_READ_RETRIES 64
 
 struct buffer_info_t
 {
@@ -56,29 +91,10 @@ struct buffer_info_t
 
 int connect_to_renderer()
 {
-    struct sockaddr_un addr;
-    int fd;
-
-    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    int fd = sfdroid_ipc_connect(RENDERER_SOCKET_NAME, 0);
     if(fd < 0)
-    {
-        ALOGE("error creating socket stream");
-        return -1;
-    }
-
-    // don't crash if we disconnect
-    //int set = 1;
-    //setsockopt(sd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(int));
-    signal(SIGPIPE, SIG_IGN);
-
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SHM_BUFFER_HANDLE_FILE, sizeof(addr.sun_path)-1);
-
-    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
     {
         ALOGE("error connecting to renderer: %s", strerror(errno));
-        close(fd);
         return -1;
     }
 
@@ -87,13 +103,7 @@ int connect_to_renderer()
 
 int send_native_handle(int fd, const native_handle_t *handle, uint32_t width, uint32_t height, uint32_t stride, int32_t pixel_format)
 {
-    struct msghdr socket_message;
-    struct iovec io_vector[1];
-    struct cmsghdr *control_message = NULL;
-    unsigned int buffer_size = sizeof(struct buffer_info_t) + sizeof(native_handle_t) + sizeof(int)*(handle->numFds + handle->numInts);
-    unsigned int handle_size = sizeof(native_handle_t) + sizeof(int)*(handle->numFds + handle->numInts);
-    char message_buffer[buffer_size];
-    char ancillary_buffer[CMSG_SPACE(sizeof(int) * handle->numFds)];
+    struct iovec io_vector[2];
     struct buffer_info_t info;
 
     info.width = width;
@@ -101,32 +111,69 @@ int send_native_handle(int fd, const native_handle_t *handle, uint32_t width, ui
     info.stride = stride;
     info.pixel_format = pixel_format;
 
-    memcpy(message_buffer, &info, sizeof(struct buffer_info_t));
-    memcpy(message_buffer + sizeof(struct buffer_info_t), handle, handle_size);
+    io_vector[0].iov_base = &info;
+    io_vector[0].iov_len = sizeof(struct buffer_info_t);
+    io_vector[1].iov_base = const_cast<native_handle_t*>(handle);
+    io_vector[1].iov_len = sizeof(native_handle_t) + sizeof(int)*(handle->numFds + handle->numInts);
 
-    io_vector[0].iov_base = message_buffer;
-    io_vector[0].iov_len = buffer_size;
+    return sfdroid_ipc_send(fd, io_vector, 2, handle->data, handle->numFds);
+}
 
-    memset(&socket_message, 0, sizeof(struct msghdr));
-    socket_message.msg_iov = io_vector;
-    socket_message.msg_iovlen = 1;
+/*
+ * Send a batch of buffers to register as a single SB_OP_NEW_BUFFERS
+ * message. The caller keeps the batch within SB_BATCH_MAX_BUFFERS buffers
+ * and SB_BATCH_MAX_FDS fds.
+ */
+int send_native_handles(int fd, const buffer_handle_t *handles, const sb_buffer_info_t *infos, size_t count)
+{
+    struct iovec io_vector[1];
+    unsigned int buffer_size = 1 + sizeof(sb_batch_header_t);
+    unsigned int num_fds = 0;
 
-    memset(ancillary_buffer, 0, CMSG_SPACE(sizeof(int) * handle->numFds));
+    for(size_t i = 0; i < count; i++)
+    {
+        buffer_size += sizeof(struct buffer_info_t) + sizeof(native_handle_t) +
+                sizeof(int)*(handles[i]->numFds + handles[i]->numInts);
+        num_fds += handles[i]->numFds;
+    }
 
-    socket_message.msg_control = ancillary_buffer;
-    socket_message.msg_controllen = CMSG_SPACE(sizeof(int) * handle->numFds);
+    char message_buffer[buffer_size];
+    int fds[num_fds + 1];
+    sb_batch_header_t header;
+    char *pos = message_buffer;
+    int *fd_pos = fds;
 
-    control_message = CMSG_FIRSTHDR(&socket_message);
-    control_message->cmsg_len = socket_message.msg_controllen;
-    control_message->cmsg_level = SOL_SOCKET;
-    control_message->cmsg_type = SCM_RIGHTS;
+    *pos++ = SB_OP_NEW_BUFFERS;
+    header.count = count;
+    memcpy(pos, &header, sizeof(header));
+    pos += sizeof(header);
 
-    for(int i=0;i<handle->numFds;i++)
+    for(size_t i = 0; i < count; i++)
     {
-        ((int*)CMSG_DATA(control_message))[i] = handle->data[i];
+        const native_handle_t *handle = handles[i];
+        unsigned int handle_size = sizeof(native_handle_t) + sizeof(int)*(handle->numFds + handle->numInts);
+        struct buffer_info_t info;
+
+        info.width = infos[i].width;
+        info.height = infos[i].height;
+        info.stride = infos[i].stride;
+        info.pixel_format = infos[i].pixel_format;
+
+        memcpy(pos, &info, sizeof(struct buffer_info_t));
+        pos += sizeof(struct buffer_info_t);
+        memcpy(pos, handle, handle_size);
+        pos += handle_size;
+
+        for(int j = 0; j < handle->numFds; j++)
+        {
+            *fd_pos++ = handle->data[j];
+        }
     }
 
-    return sendmsg(fd, &socket_message, MSG_WAITALL);
+    io_vector[0].iov_base = message_buffer;
+    io_vector[0].iov_len = buffer_size;
+
+    return sfdroid_ipc_send(fd, io_vector, 1, fds, num_fds);
 }
 
 int recv_status(int fd, int *failed)
@@ -139,312 +186,2290 @@ int recv_status(int fd, int *failed)
         return -1;
     }
 
-    if(message_buffer[2] != 0)
-    {
-        ALOGE("message_buffer is not a 0 terminated string");
-        return -1;
-    }
+    if(message_buffer[2] != 0)
+    {
+        ALOGE("message_buffer is not a 0 terminated string");
+        return -1;
+    }
+
+    if(strcmp(message_buffer, SB_STATUS_OK) == 0)
+    {
+        *failed = 0;
+        return 0;
+    }
+    else
+    {
+        if(strcmp(message_buffer, SB_STATUS_FAILED) != 0)
+        {
+            ALOGE("unknown status: %s", message_buffer);
+        }
+        *failed = 1;
+        return 0;
+    }
+
+    return -1;
+}
+
+enum {
+    PAGE_FLIP = 0x00000001,
+    LOCKED = 0x00000002
+};
+
+/*
+ * One connection to the renderer per layer. Each session has its own
+ * socket, buffer namespace and post ring, so layers posted from different
+ * threads neither share a lock step protocol nor resend their name when
+ * they alternate. The unnamed session (empty name) is used by callers that
+ * never set a layer name.
+ *
+ * Sessions are reference counted: the sessions map holds one reference
+ * and so does every thread whose current layer it is.
+ */
+struct private_module_t;
+
+struct sb_session_t {
+    struct private_module_t *module;
+    std::string name;
+    volatile int32_t refs;
+    // serialises requests on this session
+    pthread_mutex_t lock;
+    // set once the layer was closed, the session is no longer in the map
+    bool closed;
+    // see registerLayer(), 0 until the layer was registered
+    int32_t id;
+
+    int fd_renderer;
+    // false until the first, synchronous connection attempt
+    bool connect_attempted;
+
+    // background reconnection, protected by the module's sessions_lock
+    bool reconnect_pending;
+    int64_t reconnect_at_ns;
+    sfdroid_ipc_backoff_t reconnect_backoff;
+
+    // identifies the session to the renderer across connections
+    uint64_t token;
+    // the renderer accepts SB_OP_NEW_BUFFERS on this connection
+    bool batch_supported;
+    // SB_PROTOCOL_VERSION_* and layer id negotiated on this connection
+    uint32_t protocol_version;
+    uint32_t layer_id;
+
+    BufferRegistry buffers;
+    // slot ids evicted while disconnected, sent on resumption
+    std::vector<int32_t> pending_frees;
+
+    // vsync the previous post was paced to, CLOCK_MONOTONIC ns
+    int64_t last_post_ns;
+
+    // damage of the next post, none means the whole buffer
+    sb_ring_rect_t damage[SB_RING_MAX_RECTS];
+    int32_t num_damage;
+    // see setAcquireFence(), -1 if none; like damage only for the next post
+    int acquire_fence;
+
+    // pixel formats the renderer imports, empty if it did not tell
+    std::vector<int32_t> formats;
+
+    // composition hints, resent on change and after every reconnect
+    sb_layer_hints_wire_t hints;
+    bool hints_dirty;
+
+    // see setMailbox(), only takes effect on a ring of SB_RING_VERSION 5
+    bool mailbox;
+    // posts were skipped while the layer could not be seen
+    bool skipped_posts;
+
+    // shared memory post ring, NULL if the renderer doesn't support it
+    sb_ring_t *ring;
+    int ring_fd;
+    int ring_post_fd;
+    int ring_release_fd;
+    int32_t post_depth;
+    // SB_RING_VERSION* the renderer accepted
+    uint32_t ring_version;
+
+    // what was posted in each ring slot, for latency and frame timing
+    int64_t ring_post_ns[SB_RING_SLOTS];
+    buffer_handle_t ring_post_buffer[SB_RING_SLOTS];
+    uint64_t ring_post_frame[SB_RING_SLOTS];
+
+    // counters are protected by lock, latencies by stats_lock
+    pthread_mutex_t stats_lock;
+    sharebuffer_layer_stats_t stats;
+
+    // release side, owned by release_thread while the ring is up
+    pthread_mutex_t ring_lock;
+    pthread_cond_t ring_cond;
+    pthread_t release_thread;
+    volatile int32_t release_thread_exit;
+    int32_t ring_reaped;
+    int32_t ring_failures;
+    int32_t ring_replaced;
+    int release_timeline;
+};
+
+typedef std::map<std::string, sb_session_t*> session_map_t;
+typedef std::map<int32_t, sb_session_t*> session_id_map_t;
+
+struct private_module_t {
+    gralloc_module_t base;
+
+    uint32_t flags;
+    uint32_t numBuffers;
+    uint32_t bufferMask;
+    pthread_mutex_t lock;
+    buffer_handle_t currentBuffer;
+    int pmem_master;
+    void* pmem_master_base;
+
+    struct fb_var_screeninfo info;
+    struct fb_fix_screeninfo finfo;
+    float xdpi;
+    float ydpi;
+    float fps;
+
+    // layer name -> session, protected by sessions_lock
+    pthread_mutex_t sessions_lock;
+    session_map_t sessions;
+    // registered layer id -> session, also protected by sessions_lock
+    session_id_map_t session_ids;
+    int32_t next_session_id;
+
+    // reconnects sessions in the background, see schedule_reconnect()
+    pthread_cond_t reconnect_cond;
+    pthread_t reconnect_thread;
+    bool reconnect_thread_started;
+
+    // see setFrameTimingCallback(), protected by timing_lock
+    pthread_mutex_t timing_lock;
+    sb_frame_timing_callback_t timing_callback;
+    void *timing_callback_data;
+
+    // set by enableScreen(0), posts of every layer are skipped meanwhile
+    volatile int32_t screen_blanked;
+
+    // info, finfo, xdpi, ydpi and fps are set, protected by lock
+    bool geometry_known;
+};
+
+struct sb_context_t {
+    sharebuffer_device_t device;
+    volatile int32_t swap_interval;
+};
+
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void stats_add_latency(sb_session_t *s, int64_t latency)
+{
+    int bucket = 0;
+    int64_t us = latency / 1000;
+
+    while(bucket < SB_LATENCY_BUCKETS - 1 && us >= (32LL << bucket))
+        bucket++;
+
+    pthread_mutex_lock(&s->stats_lock);
+    s->stats.latency_count++;
+    s->stats.latency_total_ns += latency;
+    if(latency > s->stats.latency_max_ns)
+        s->stats.latency_max_ns = latency;
+    s->stats.latency_histogram[bucket]++;
+    pthread_mutex_unlock(&s->stats_lock);
+}
+
+static void report_frame_timing(sb_session_t *s, buffer_handle_t buffer, uint64_t frame, int64_t post_ns, int64_t latch_ns, int64_t present_ns, int failed)
+{
+    private_module_t *m = s->module;
+    sb_frame_timing_callback_t callback;
+    void *data;
+
+    pthread_mutex_lock(&m->timing_lock);
+    callback = m->timing_callback;
+    data = m->timing_callback_data;
+    pthread_mutex_unlock(&m->timing_lock);
+
+    if(!callback)
+        return;
+
+    sb_frame_timing_t timing;
+    timing.buffer = buffer;
+    timing.frame_number = frame;
+    timing.post_ns = post_ns;
+    timing.latch_ns = latch_ns;
+    timing.present_ns = present_ns;
+    timing.failed = failed;
+    callback(data, s->name.c_str(), &timing);
+}
+
+static void *ring_release_thread(void *arg);
+
+static void ring_teardown(sb_session_t *s)
+{
+    if(s->release_timeline >= 0)
+    {
+        android_atomic_release_store(1, &s->release_thread_exit);
+        pthread_join(s->release_thread, NULL);
+        // signal whatever fences are still pending
+        sw_sync_timeline_inc(s->release_timeline, SB_RING_SLOTS);
+        close(s->release_timeline);
+        s->release_timeline = -1;
+    }
+    if(s->ring)
+    {
+        munmap(s->ring, sizeof(sb_ring_t));
+        s->ring = NULL;
+    }
+    if(s->ring_fd >= 0) close(s->ring_fd);
+    if(s->ring_post_fd >= 0) close(s->ring_post_fd);
+    if(s->ring_release_fd >= 0) close(s->ring_release_fd);
+    s->ring_fd = s->ring_post_fd = s->ring_release_fd = -1;
+    s->ring_reaped = 0;
+}
+
+static int32_t ring_post_depth()
+{
+    char value[PROPERTY_VALUE_MAX];
+    int depth = DEFAULT_POST_DEPTH;
+
+    if(property_get("ro.sharebuffer.post_depth", value, NULL) > 0)
+    {
+        depth = atoi(value);
+    }
+    if(depth < 1) depth = 1;
+    if(depth > SB_RING_SLOTS) depth = SB_RING_SLOTS;
+
+    return depth;
+}
+
+/*
+ * Offer the shared memory post ring to the renderer. On any failure the
+ * ring is simply not used and posts go over the socket as before, the
+ * return value only tells whether the socket itself is still usable.
+ */
+static int ring_setup(sb_session_t *s)
+{
+    char buf[1];
+    int failed;
+    sb_ring_setup_t setup;
+    struct iovec iov;
+    int fds[3];
+
+    s->ring = (sb_ring_t*)sfdroid_ipc_shm_create("sharebuffer-ring", sizeof(sb_ring_t),
+            &s->ring_fd);
+    s->ring_post_fd = eventfd(0, EFD_CLOEXEC);
+    s->ring_release_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(!s->ring || s->ring_post_fd < 0 || s->ring_release_fd < 0)
+    {
+        ALOGW("failed to create post ring: %s", strerror(errno));
+        ring_teardown(s);
+        return 0;
+    }
+    s->ring->magic = SB_RING_MAGIC;
+    s->ring->num_slots = SB_RING_SLOTS;
+
+    for(s->ring_version = SB_RING_VERSION; ; s->ring_version--)
+    {
+        s->ring->version = s->ring_version;
+
+        buf[0] = SB_OP_RING;
+        if(send(s->fd_renderer, buf, 1, MSG_NOSIGNAL) < 0)
+            goto exit_error;
+        if(recv_status(s->fd_renderer, &failed) < 0)
+            goto exit_error;
+        if(failed)
+        {
+            ALOGI("renderer doesn't support the post ring");
+            ring_teardown(s);
+            return 0;
+        }
+
+        setup.version = s->ring_version;
+        setup.size = sizeof(sb_ring_t);
+        fds[0] = s->ring_fd;
+        fds[1] = s->ring_post_fd;
+        fds[2] = s->ring_release_fd;
+        iov.iov_base = &setup;
+        iov.iov_len = sizeof(setup);
+        if(sfdroid_ipc_send(s->fd_renderer, &iov, 1, fds, 3) < 0)
+            goto exit_error;
+        if(recv_status(s->fd_renderer, &failed) < 0)
+            goto exit_error;
+        if(!failed)
+            break;
+        if(s->ring_version == SB_RING_VERSION_NO_TIMING)
+        {
+            ALOGW("renderer rejected the post ring");
+            ring_teardown(s);
+            return 0;
+        }
+    }
+
+    s->post_depth = ring_post_depth();
+    s->release_thread_exit = 0;
+    s->release_timeline = sw_sync_timeline_create();
+    if(s->release_timeline < 0)
+    {
+        /*
+         * Without sw_sync the release thread still runs, callers just
+         * get no fence and must rely on the post depth limit.
+         */
+        ALOGW("no sw_sync timeline, release fences disabled");
+        s->release_timeline = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    if(s->release_timeline < 0 ||
+            pthread_create(&s->release_thread, NULL, ring_release_thread, s) != 0)
+    {
+        ALOGW("failed to start the release thread");
+        if(s->release_timeline >= 0) close(s->release_timeline);
+        s->release_timeline = -1;
+        ring_teardown(s);
+        return 0;
+    }
+
+    ALOGI("using shared memory post ring version %u, depth %d", s->ring_version, s->post_depth);
+    return 0;
+
+exit_error:
+    ALOGW("failed to set up post ring: %s", strerror(errno));
+    ring_teardown(s);
+    return -1;
+}
+
+/*
+ * Collect the posts the renderer has released so far and signal their
+ * release fences. Called with ring_lock held.
+ */
+static void ring_reap_l(sb_session_t *s)
+{
+    int32_t tail = android_atomic_acquire_load(&s->ring->tail);
+    int released = 0;
+
+    while(s->ring_reaped != tail)
+    {
+        int i = s->ring_reaped & (SB_RING_SLOTS - 1);
+        sb_ring_slot_t *slot = &s->ring->slots[i];
+        int failed = slot->status == SB_RING_STATUS_FAILED;
+        if(failed)
+        {
+            ALOGW("renderer failed to show buffer %d", slot->index);
+            android_atomic_inc((volatile int32_t*)&s->ring_failures);
+        }
+        if(slot->status == SB_RING_STATUS_REPLACED)
+        {
+            // a newer mailbox post was shown instead, never on screen
+            android_atomic_inc((volatile int32_t*)&s->ring_replaced);
+            report_frame_timing(s, s->ring_post_buffer[i], s->ring_post_frame[i],
+                    s->ring_post_ns[i], 0, 0, 0);
+        }
+        else if(s->ring_version >= SB_RING_VERSION_TIMING)
+        {
+            stats_add_latency(s, now_ns() - s->ring_post_ns[i]);
+            report_frame_timing(s, s->ring_post_buffer[i], s->ring_post_frame[i],
+                    s->ring_post_ns[i], s->ring->timing[i].latch_ns,
+                    s->ring->timing[i].present_ns, failed);
+        }
+        else
+        {
+            stats_add_latency(s, now_ns() - s->ring_post_ns[i]);
+            report_frame_timing(s, s->ring_post_buffer[i], s->ring_post_frame[i],
+                    s->ring_post_ns[i], 0, 0, failed);
+        }
+        s->ring_reaped = (int32_t)((uint32_t)s->ring_reaped + 1);
+        released++;
+    }
+
+    if(released > 0)
+    {
+        sw_sync_timeline_inc(s->release_timeline, released);
+        pthread_cond_broadcast(&s->ring_cond);
+    }
+}
+
+static void *ring_release_thread(void *arg)
+{
+    sb_session_t *s = (sb_session_t*)arg;
+
+    while(!android_atomic_acquire_load(&s->release_thread_exit))
+    {
+        struct pollfd pfd;
+        uint64_t count;
+
+        pfd.fd = s->ring_release_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        // wake up now and then to notice teardown
+        if(poll(&pfd, 1, 100) <= 0)
+            continue;
+
+        read(s->ring_release_fd, &count, sizeof(count));
+
+        pthread_mutex_lock(&s->ring_lock);
+        ring_reap_l(s);
+        pthread_mutex_unlock(&s->ring_lock);
+    }
+
+    return NULL;
+}
+
+static void session_drop_acquire_fence(sb_session_t *s)
+{
+    if(s->acquire_fence >= 0)
+    {
+        close(s->acquire_fence);
+        s->acquire_fence = -1;
+    }
+}
+
+/* For posts the renderer can't wait for the acquire fence of itself. */
+static void session_wait_acquire_fence(sb_session_t *s)
+{
+    if(s->acquire_fence < 0)
+        return;
+
+    if(sync_wait(s->acquire_fence, ACQUIRE_FENCE_TIMEOUT_MS) < 0)
+        ALOGW("buffer of layer '%s' not ready: %s", s->name.c_str(), strerror(errno));
+    session_drop_acquire_fence(s);
+}
+
+/* Whether the pending acquire fence can go to the renderer with the post. */
+static bool session_sends_acquire_fence(sb_session_t *s)
+{
+    if(s->acquire_fence < 0 || s->protocol_version < SB_PROTOCOL_VERSION_FENCES)
+        return false;
+    // ring slots older than the timing version have no flags
+    return !s->ring || s->ring_version >= SB_RING_VERSION_TIMING;
+}
+
+/*
+ * Send the acquire fence of the ring slot posted at head ahead of it, see
+ * sb_protocol.h. Not answered.
+ */
+static int ring_send_acquire_fence(sb_session_t *s, int32_t head)
+{
+    sb_frame_header_t header;
+    struct iovec iov;
+
+    memset(&header, 0, sizeof(header));
+    header.opcode = SB_OP_ACQUIRE_FENCE;
+    header.layer_id = s->layer_id;
+    header.slot = head;
+    header.timestamp_ns = now_ns();
+
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    int ret = sfdroid_ipc_send(s->fd_renderer, &iov, 1, &s->acquire_fence, 1);
+    session_drop_acquire_fence(s);
+    return ret;
+}
+
+/*
+ * Enqueue an already registered buffer in the post ring. Only blocks while
+ * post_depth frames are still held by the renderer, or all slots for a
+ * mailbox post since the renderer replaces those. If releaseFenceFd is
+ * not NULL it receives a fence that signals once the renderer released
+ * this post, or -1 if fences are not available.
+ */
+static int ring_post(sb_session_t *s, buffer_handle_t buffer, int index, int *releaseFenceFd)
+{
+    sb_ring_t *ring = s->ring;
+    int32_t head = ring->head;
+    bool mailbox = s->mailbox && s->ring_version >= SB_RING_VERSION;
+    uint32_t depth = mailbox ? SB_RING_SLOTS : s->post_depth;
+    HAL_TRACE_SCOPE("sb ring_post");
+
+    pthread_mutex_lock(&s->ring_lock);
+    ring_reap_l(s);
+    HAL_TRACE_COUNTER("sb posts in flight", (uint32_t)head - (uint32_t)s->ring_reaped);
+    while((uint32_t)head - (uint32_t)s->ring_reaped >= depth)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += RING_FULL_TIMEOUT_MS / 1000;
+
+        if(pthread_cond_timedwait(&s->ring_cond, &s->ring_lock, &ts) == ETIMEDOUT)
+        {
+            pthread_mutex_unlock(&s->ring_lock);
+            ALOGW("renderer stopped releasing buffers");
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&s->ring_lock);
+
+    sb_ring_slot_t *slot = &ring->slots[head & (SB_RING_SLOTS - 1)];
+    slot->index = index;
+    slot->status = SB_RING_STATUS_PENDING;
+    slot->num_rects = s->num_damage;
+    slot->flags = s->ring_version >= SB_RING_VERSION_TIMING ? s->hints.flags : 0;
+    if(mailbox)
+        slot->flags |= SB_FRAME_FLAG_MAILBOX;
+    if(session_sends_acquire_fence(s))
+    {
+        // the renderer reads the fence before it can see the slot
+        if(ring_send_acquire_fence(s, head) < 0)
+        {
+            ALOGW("failed to send acquire fence: %s", strerror(errno));
+            return -1;
+        }
+        slot->flags |= SB_FRAME_FLAG_ACQUIRE_FENCE;
+    }
+    else
+    {
+        session_wait_acquire_fence(s);
+    }
+    s->ring_post_ns[head & (SB_RING_SLOTS - 1)] = now_ns();
+    s->ring_post_buffer[head & (SB_RING_SLOTS - 1)] = buffer;
+    s->ring_post_frame[head & (SB_RING_SLOTS - 1)] = s->stats.frames_posted;
+    memcpy(slot->rects, s->damage, sizeof(s->damage[0]) * s->num_damage);
+    android_atomic_release_store((int32_t)((uint32_t)head + 1), &ring->head);
+
+    if(releaseFenceFd)
+    {
+        // the timeline counts released posts, this one is number head + 1
+        *releaseFenceFd = sw_sync_fence_create(s->release_timeline,
+                "sharebuffer-release", (uint32_t)head + 1);
+        if(*releaseFenceFd < 0)
+            *releaseFenceFd = -1;
+    }
+
+    android_memory_barrier();
+    if(ring->renderer_waiting)
+    {
+        uint64_t one = 1;
+        if(write(s->ring_post_fd, &one, sizeof(one)) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Send a slot id, as a single byte when it fits below the opcodes or
+ * prefixed by op otherwise.
+ */
+static int send_slot(int fd, uint8_t op, int32_t slot)
+{
+    char buf[1 + sizeof(int32_t)];
+
+    if(op == SB_OP_POST_SLOT && slot < SB_MAX_BYTE_SLOT)
+    {
+        buf[0] = slot;
+        return send(fd, buf, 1, MSG_NOSIGNAL);
+    }
+
+    buf[0] = op;
+    memcpy(buf + 1, &slot, sizeof(slot));
+    return send(fd, buf, sizeof(buf), MSG_NOSIGNAL);
+}
+
+/*
+ * Send a post or free of a slot in the format negotiated on the session's
+ * connection. Framed requests carry the pending damage of the session,
+ * posts its acquire fence, which is waited for here if the renderer can't
+ * take it.
+ */
+static int session_send_slot(sb_session_t *s, uint8_t op, int32_t slot)
+{
+    sb_frame_header_t header;
+    struct iovec iov[2];
+    int iovcnt = 1;
+    bool fence = op == SB_OP_POST_SLOT && session_sends_acquire_fence(s);
+
+    if(op == SB_OP_POST_SLOT && !fence)
+        session_wait_acquire_fence(s);
+
+    if(s->protocol_version < SB_PROTOCOL_VERSION_FRAMED)
+        return send_slot(s->fd_renderer, op, slot);
+
+    memset(&header, 0, sizeof(header));
+    header.opcode = op;
+    if(op == SB_OP_POST_SLOT && s->protocol_version >= SB_PROTOCOL_VERSION_HINTS)
+        header.flags = s->hints.flags;
+    if(fence)
+        header.flags |= SB_FRAME_FLAG_ACQUIRE_FENCE;
+    header.layer_id = s->layer_id;
+    header.slot = slot;
+    header.timestamp_ns = now_ns();
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    if(op == SB_OP_POST_SLOT && s->num_damage > 0)
+    {
+        header.num_rects = s->num_damage;
+        iov[1].iov_base = s->damage;
+        iov[1].iov_len = sizeof(s->damage[0]) * s->num_damage;
+        iovcnt = 2;
+    }
+
+    if(!fence)
+        return sfdroid_ipc_send(s->fd_renderer, iov, iovcnt, NULL, 0);
+
+    int ret = sfdroid_ipc_send(s->fd_renderer, iov, iovcnt, &s->acquire_fence, 1);
+    session_drop_acquire_fence(s);
+    return ret;
+}
+
+/*
+ * Send changed composition hints ahead of the next post. Returns -1 only
+ * if the socket failed.
+ */
+static int session_send_hints(sb_session_t *s)
+{
+    sb_frame_header_t header;
+    struct iovec iov[2];
+    int failed;
+
+    if(!s->hints_dirty || s->protocol_version < SB_PROTOCOL_VERSION_HINTS)
+        return 0;
+
+    memset(&header, 0, sizeof(header));
+    header.opcode = SB_OP_LAYER_HINTS;
+    header.layer_id = s->layer_id;
+    header.slot = -1;
+    header.timestamp_ns = now_ns();
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = &s->hints;
+    iov[1].iov_len = sizeof(s->hints);
+
+    if(sfdroid_ipc_send(s->fd_renderer, iov, 2, NULL, 0) < 0 ||
+            recv_status(s->fd_renderer, &failed) < 0)
+        return -1;
+    if(failed)
+        ALOGW("renderer rejected the hints of layer '%s'", s->name.c_str());
+
+    s->hints_dirty = false;
+    return 0;
+}
+
+// ask the renderer which pixel formats it imports
+static int formats_setup(sb_session_t *s)
+{
+    sb_frame_header_t header;
+    sb_formats_t formats;
+    int32_t list[SB_MAX_FORMATS];
+    int failed;
+
+    s->formats.clear();
+    if(s->protocol_version < SB_PROTOCOL_VERSION_FORMATS)
+        return 0;
+
+    memset(&header, 0, sizeof(header));
+    header.opcode = SB_OP_FORMATS;
+    header.layer_id = s->layer_id;
+    header.slot = -1;
+    header.timestamp_ns = now_ns();
+
+    if(send(s->fd_renderer, &header, sizeof(header), MSG_NOSIGNAL) < 0 ||
+            recv_status(s->fd_renderer, &failed) < 0 ||
+            recv(s->fd_renderer, &formats, sizeof(formats), MSG_WAITALL) != sizeof(formats))
+        return -1;
+
+    if(formats.count > SB_MAX_FORMATS)
+    {
+        ALOGE("renderer reported %u formats", formats.count);
+        errno = EPROTO;
+        return -1;
+    }
+
+    if(formats.count > 0 &&
+            recv(s->fd_renderer, list, sizeof(list[0]) * formats.count, MSG_WAITALL) !=
+            (ssize_t)(sizeof(list[0]) * formats.count))
+        return -1;
+
+    if(!failed)
+        s->formats.assign(list, list + formats.count);
+
+    return 0;
+}
+
+// formats every renderer takes, those gralloc allocates for the framebuffer
+static bool format_is_default(int32_t format)
+{
+    switch(format)
+    {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+        case HAL_PIXEL_FORMAT_RGB_565:
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Whether buffers of the format may be sent to the renderer: anything for
+ * renderers that do not report their formats.
+ */
+static bool session_format_supported(sb_session_t *s, int32_t format)
+{
+    if(s->protocol_version < SB_PROTOCOL_VERSION_FORMATS)
+        return true;
+
+    for(size_t i = 0; i < s->formats.size(); i++)
+    {
+        if(s->formats[i] == format)
+            return true;
+    }
+    return false;
+}
+
+// negotiate the protocol version of a new connection
+static int protocol_setup(sb_session_t *s)
+{
+    char buf[1];
+    sb_hello_t hello;
+    int failed;
+
+    s->protocol_version = SB_PROTOCOL_VERSION_LEGACY;
+    s->layer_id = 0;
+
+    buf[0] = SB_OP_HELLO;
+    if(send(s->fd_renderer, buf, 1, MSG_NOSIGNAL) < 0 ||
+            recv_status(s->fd_renderer, &failed) < 0)
+        return -1;
+    if(failed)
+        return 0;
+
+    memset(&hello, 0, sizeof(hello));
+    hello.magic = SB_HELLO_MAGIC;
+    hello.version = SB_PROTOCOL_VERSION;
+    if(send(s->fd_renderer, &hello, sizeof(hello), MSG_NOSIGNAL) < 0 ||
+            recv(s->fd_renderer, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello))
+        return -1;
+
+    if(hello.magic != SB_HELLO_MAGIC || hello.version < SB_PROTOCOL_VERSION_LEGACY ||
+            hello.version > SB_PROTOCOL_VERSION)
+    {
+        ALOGE("bad hello from renderer: magic %08x version %u", hello.magic, hello.version);
+        errno = EPROTO;
+        return -1;
+    }
+
+    s->protocol_version = hello.version;
+    s->layer_id = hello.layer_id;
+    // a new connection starts out with default hints
+    s->hints_dirty = true;
+    ALOGI("renderer protocol version %u, layer id %u", s->protocol_version, s->layer_id);
+    return 0;
+}
+
+static int send_layer_name(int fd, uint8_t op, const char *name)
+{
+    char buf[2 + UINT8_MAX];
+    size_t len = strlen(name);
+
+    if(len > UINT8_MAX)
+    {
+        ALOGW("layer name too long, truncating: %s", name);
+        len = UINT8_MAX;
+    }
+
+    buf[0] = op;
+    buf[1] = len;
+    memcpy(buf + 2, name, len);
+
+    return send(fd, buf, 2 + len, MSG_NOSIGNAL);
+}
+
+/*
+ * Ask the renderer to resume the session's previous connection.
+ * Returns 1 if it still holds our buffers, 0 if not and -1 on error.
+ */
+static int session_resume(sb_session_t *s)
+{
+    char buf[1];
+    int failed;
+
+    if(s->token == 0)
+    {
+        s->token = ((uint64_t)getpid() << 32) ^ (uint64_t)now_ns() ^
+                (uint64_t)(uintptr_t)s;
+    }
+
+    buf[0] = SB_OP_RESUME;
+    if(send(s->fd_renderer, buf, 1, MSG_NOSIGNAL) < 0 ||
+            recv_status(s->fd_renderer, &failed) < 0)
+        return -1;
+    if(failed)
+        return 0;
+
+    if(send(s->fd_renderer, &s->token, sizeof(s->token), MSG_NOSIGNAL) < 0 ||
+            recv_status(s->fd_renderer, &failed) < 0)
+        return -1;
+
+    return failed ? 0 : 1;
+}
+
+// find out whether the renderer takes batched registrations
+static int batch_setup(sb_session_t *s)
+{
+    char buf[1];
+    int failed;
+
+    s->batch_supported = false;
+
+    buf[0] = SB_OP_NEW_BUFFERS;
+    if(send(s->fd_renderer, buf, 1, MSG_NOSIGNAL) < 0 ||
+            recv_status(s->fd_renderer, &failed) < 0)
+    {
+        ALOGW("failed to negotiate batched registration: %s", strerror(errno));
+        return -1;
+    }
+
+    s->batch_supported = !failed;
+    return 0;
+}
+
+/*
+ * Connect a session to the renderer, announce its layer, negotiate the
+ * protocol version, resume or reset its buffers and offer the post ring.
+ * The layer name is sent once per connection; every later request on the
+ * session implicitly refers to that layer. Returns 0 once connected.
+ */
+static int renderer_connect(sb_session_t *s)
+{
+    int resumed;
+
+    s->connect_attempted = true;
+    s->fd_renderer = connect_to_renderer();
+    if(s->fd_renderer < 0)
+        return -1;
+    ALOGI("connected to renderer for layer '%s'", s->name.c_str());
+    s->stats.reconnects++;
+
+    if(!s->name.empty())
+    {
+        // the renderer does not answer the layer name
+        if(send_layer_name(s->fd_renderer, SB_OP_LAYER_NAME, s->name.c_str()) < 0)
+        {
+            ALOGW("failed to send layer name: %s", strerror(errno));
+            goto exit_error;
+        }
+    }
+
+    if(protocol_setup(s) < 0)
+    {
+        ALOGW("failed to negotiate protocol version: %s", strerror(errno));
+        goto exit_error;
+    }
+
+    if(formats_setup(s) < 0)
+    {
+        ALOGW("failed to query pixel formats: %s", strerror(errno));
+        goto exit_error;
+    }
+
+    resumed = session_resume(s);
+    if(resumed < 0)
+    {
+        ALOGW("failed to resume session: %s", strerror(errno));
+        goto exit_error;
+    }
+    if(resumed)
+    {
+        std::vector<int32_t> frees;
+        frees.swap(s->pending_frees);
+        for(size_t i = 0; i < frees.size() && s->fd_renderer >= 0; i++)
+        {
+            int failed;
+            if(session_send_slot(s, SB_OP_FREE_BUFFER, frees[i]) < 0 ||
+                    recv_status(s->fd_renderer, &failed) < 0)
+                goto exit_error;
+            if(failed)
+                s->buffers.setReuseIds(false);
+            s->buffers.releaseId(frees[i]);
+        }
+    }
+    else
+    {
+        if(s->buffers.size() > 0)
+            ALOGW("renderer lost our buffers, clearing them");
+        s->buffers.clear();
+        s->pending_frees.clear();
+    }
+
+    if(batch_setup(s) < 0)
+        goto exit_error;
+
+    if(ring_setup(s) < 0)
+        goto exit_error;
+
+    return 0;
+
+exit_error:
+    close(s->fd_renderer);
+    s->fd_renderer = -1;
+    return -1;
+}
+
+/*
+ * Drop the connection but keep the buffer registry, so that a resumed
+ * connection does not need to send every buffer again.
+ */
+static void renderer_disconnect(sb_session_t *s)
+{
+    if(s->fd_renderer >= 0)
+        close(s->fd_renderer);
+    s->fd_renderer = -1;
+    ring_teardown(s);
+}
+
+static void *reconnect_thread(void *arg);
+
+/*
+ * Have the reconnect thread retry the connection of a session after an
+ * exponentially growing delay, instead of reconnecting synchronously on
+ * the posting thread.
+ */
+static void schedule_reconnect(sb_session_t *s)
+{
+    private_module_t *m = s->module;
+
+    pthread_mutex_lock(&m->sessions_lock);
+    if(!s->reconnect_pending && !s->closed)
+    {
+        int32_t delay_ms = sfdroid_ipc_backoff_next(&s->reconnect_backoff);
+
+        s->reconnect_pending = true;
+        s->reconnect_at_ns = now_ns() + delay_ms * 1000000LL;
+
+        if(!m->reconnect_thread_started)
+        {
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            m->reconnect_thread_started =
+                pthread_create(&m->reconnect_thread, &attr, reconnect_thread, m) == 0;
+            pthread_attr_destroy(&attr);
+        }
+        pthread_cond_signal(&m->reconnect_cond);
+    }
+    pthread_mutex_unlock(&m->sessions_lock);
+}
+
+static void session_get(sb_session_t *s);
+static void session_put(sb_session_t *s);
+
+static void *reconnect_thread(void *arg)
+{
+    private_module_t *m = (private_module_t*)arg;
+    std::vector<sb_session_t*> due;
+
+    pthread_mutex_lock(&m->sessions_lock);
+    for(;;)
+    {
+        int64_t now = now_ns();
+        int64_t next = 0;
+
+        for(session_map_t::iterator it = m->sessions.begin(); it != m->sessions.end(); ++it)
+        {
+            sb_session_t *s = it->second;
+            if(!s->reconnect_pending)
+                continue;
+            if(s->reconnect_at_ns <= now)
+            {
+                s->reconnect_pending = false;
+                session_get(s);
+                due.push_back(s);
+            }
+            else if(next == 0 || s->reconnect_at_ns < next)
+            {
+                next = s->reconnect_at_ns;
+            }
+        }
+
+        if(due.empty())
+        {
+            if(next == 0)
+            {
+                pthread_cond_wait(&m->reconnect_cond, &m->sessions_lock);
+            }
+            else
+            {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                int64_t abs = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec + (next - now);
+                ts.tv_sec = abs / 1000000000LL;
+                ts.tv_nsec = abs % 1000000000LL;
+                pthread_cond_timedwait(&m->reconnect_cond, &m->sessions_lock, &ts);
+            }
+            continue;
+        }
+
+        pthread_mutex_unlock(&m->sessions_lock);
+        for(size_t i = 0; i < due.size(); i++)
+        {
+            sb_session_t *s = due[i];
+
+            pthread_mutex_lock(&s->lock);
+            if(!s->closed && s->fd_renderer < 0)
+            {
+                if(renderer_connect(s) == 0)
+                    sfdroid_ipc_backoff_reset(&s->reconnect_backoff);
+                else
+                    schedule_reconnect(s);
+            }
+            pthread_mutex_unlock(&s->lock);
+            session_put(s);
+        }
+        due.clear();
+        pthread_mutex_lock(&m->sessions_lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Make sure a session is connected or being reconnected. Only the very
+ * first attempt is made synchronously, so that a new layer's first frame
+ * is not dropped; later ones happen on the reconnect thread while posts
+ * are dropped cheaply. Called with the session lock held.
+ */
+static void session_connect(sb_session_t *s)
+{
+    if(s->fd_renderer >= 0)
+        return;
+
+    if(!s->connect_attempted && renderer_connect(s) == 0)
+        return;
+
+    schedule_reconnect(s);
+}
+
+static sb_session_t *session_create(private_module_t *m, const std::string &name)
+{
+    sb_session_t *s = new sb_session_t;
+
+    s->module = m;
+    s->name = name;
+    s->refs = 1;
+    pthread_mutex_init(&s->lock, NULL);
+    s->closed = false;
+    s->id = 0;
+    s->fd_renderer = -1;
+    s->connect_attempted = false;
+    s->reconnect_pending = false;
+    s->reconnect_at_ns = 0;
+    sfdroid_ipc_backoff_init(&s->reconnect_backoff, RECONNECT_MIN_MS, RECONNECT_MAX_MS);
+    s->token = 0;
+    s->batch_supported = false;
+    s->protocol_version = SB_PROTOCOL_VERSION_LEGACY;
+    s->layer_id = 0;
+    s->num_damage = 0;
+    s->acquire_fence = -1;
+    memset(&s->hints, 0, sizeof(s->hints));
+    s->hints.plane_alpha = 255;
+    s->hints_dirty = false;
+    s->mailbox = false;
+    s->skipped_posts = false;
+    s->last_post_ns = 0;
+    pthread_mutex_init(&s->stats_lock, NULL);
+    memset(&s->stats, 0, sizeof(s->stats));
+    strlcpy(s->stats.name, name.c_str(), sizeof(s->stats.name));
+    s->ring = NULL;
+    s->ring_fd = -1;
+    s->ring_post_fd = -1;
+    s->ring_release_fd = -1;
+    s->post_depth = DEFAULT_POST_DEPTH;
+    s->ring_version = 0;
+    pthread_mutex_init(&s->ring_lock, NULL);
+    pthread_cond_init(&s->ring_cond, NULL);
+    s->release_thread_exit = 0;
+    s->ring_reaped = 0;
+    s->ring_failures = 0;
+    s->ring_replaced = 0;
+    s->release_timeline = -1;
+
+    return s;
+}
+
+static void session_get(sb_session_t *s)
+{
+    android_atomic_inc(&s->refs);
+}
+
+static void session_put(sb_session_t *s)
+{
+    if(android_atomic_dec(&s->refs) != 1)
+        return;
+
+    renderer_disconnect(s);
+    if(s->acquire_fence >= 0)
+        close(s->acquire_fence);
+    pthread_cond_destroy(&s->ring_cond);
+    pthread_mutex_destroy(&s->ring_lock);
+    pthread_mutex_destroy(&s->stats_lock);
+    pthread_mutex_destroy(&s->lock);
+    delete s;
+}
+
+/*
+ * The current session of the calling thread, as selected by the last
+ * set_layer_name() on that thread.
+ */
+static pthread_once_t current_session_once = PTHREAD_ONCE_INIT;
+static pthread_key_t current_session_key;
+
+static void current_session_destructor(void *arg)
+{
+    session_put((sb_session_t*)arg);
+}
+
+static void current_session_init()
+{
+    pthread_key_create(&current_session_key, current_session_destructor);
+}
+
+// look up the session of a layer, creating it if needed; returns a reference
+static sb_session_t *session_lookup(private_module_t *m, const std::string &name)
+{
+    sb_session_t *s;
+
+    pthread_mutex_lock(&m->sessions_lock);
+    session_map_t::iterator it = m->sessions.find(name);
+    if(it != m->sessions.end())
+    {
+        s = it->second;
+    }
+    else
+    {
+        s = session_create(m, name);
+        m->sessions[name] = s;
+    }
+    session_get(s);
+    pthread_mutex_unlock(&m->sessions_lock);
+
+    return s;
+}
+
+static void set_current_session(sb_session_t *s)
+{
+    pthread_once(&current_session_once, current_session_init);
+
+    sb_session_t *old = (sb_session_t*)pthread_getspecific(current_session_key);
+    pthread_setspecific(current_session_key, s);
+    if(old)
+        session_put(old);
+}
+
+/*
+ * The session posts of the calling thread go to; returns a reference. A
+ * thread whose layer was closed meanwhile gets a fresh session for it.
+ */
+static sb_session_t *current_session(private_module_t *m)
+{
+    pthread_once(&current_session_once, current_session_init);
+
+    sb_session_t *s = (sb_session_t*)pthread_getspecific(current_session_key);
+    if(!s || s->closed)
+    {
+        s = session_lookup(m, s ? s->name : std::string());
+        set_current_session(s);
+    }
+    session_get(s);
+
+    return s;
+}
+
+static int sb_setSwapInterval(struct sharebuffer_device_t* dev,
+            int interval)
+{
+    sb_context_t* ctx = (sb_context_t*)dev;
+    if (interval < dev->minSwapInterval || interval > dev->maxSwapInterval)
+        return -EINVAL;
+    android_atomic_release_store(interval, &ctx->swap_interval);
+    return 0;
+}
+
+
+/*
+ * Latest vsync reported by the renderer. Without a ring, before the
+ * renderer reported anything, or while it doesn't finish updating it, the
+ * period comes from the device refresh rate and the timestamp is 0.
+ */
+static void session_vsync(sb_session_t *s, float fps, int64_t *timestamp, int64_t *period)
+{
+    *timestamp = 0;
+    *period = 1000000000LL / (fps > 0 ? fps : 60);
+
+    if(!s->ring)
+        return;
+
+    for(int retries = 0; retries < VSYNC_READ_RETRIES; retries++)
+    {
+        int32_t seq = android_atomic_acquire_load(&s->ring->vsync_seq);
+        if(seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        int64_t ts = s->ring->vsync_timestamp_ns;
+        int32_t p = s->ring->vsync_period_ns;
+        android_memory_barrier();
+        if(android_atomic_acquire_load(&s->ring->vsync_seq) != seq)
+            continue;
+
+        if(p > 0)
+        {
+            *timestamp = ts;
+            *period = p;
+        }
+        return;
+    }
+}
+
+/*
+ * Honour the swap interval: wait until <interval> vsyncs have passed since
+ * the previous post of the layer. Frames posted faster than that would
+ * never reach the screen anyway.
+ */
+static void session_pace(sb_session_t *s, int interval, float fps)
+{
+    int64_t vsync, period;
+    int64_t now = now_ns();
+
+    if(interval <= 0 || s->last_post_ns == 0)
+    {
+        s->last_post_ns = now;
+        return;
+    }
+
+    session_vsync(s, fps, &vsync, &period);
+
+    // allow for half a period of jitter before waiting for the next vsync
+    int64_t target = s->last_post_ns + interval * period - period / 2;
+    if(vsync != 0 && target > vsync)
+    {
+        // snap to the renderer's vsync grid
+        target = vsync + ((target - vsync + period - 1) / period) * period;
+    }
+
+    if(target > now)
+    {
+        struct timespec ts;
+        ts.tv_sec = target / 1000000000LL;
+        ts.tv_nsec = target % 1000000000LL;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+        now = target;
+    }
+    s->last_post_ns = now;
+}
+
+static int session_set_damage(sb_session_t *s, const sb_rect_t *rects, size_t num_rects)
+{
+    if(num_rects <= SB_RING_MAX_RECTS)
+    {
+        for(size_t i = 0; i < num_rects; i++)
+        {
+            s->damage[i].left = rects[i].left;
+            s->damage[i].top = rects[i].top;
+            s->damage[i].right = rects[i].right;
+            s->damage[i].bottom = rects[i].bottom;
+        }
+        s->num_damage = num_rects;
+        return 0;
+    }
+
+    // too many rectangles for a ring slot, send their bounds instead
+    sb_ring_rect_t bounds = { rects[0].left, rects[0].top, rects[0].right, rects[0].bottom };
+    for(size_t i = 1; i < num_rects; i++)
+    {
+        if(rects[i].left < bounds.left) bounds.left = rects[i].left;
+        if(rects[i].top < bounds.top) bounds.top = rects[i].top;
+        if(rects[i].right > bounds.right) bounds.right = rects[i].right;
+        if(rects[i].bottom > bounds.bottom) bounds.bottom = rects[i].bottom;
+    }
+    s->damage[0] = bounds;
+    s->num_damage = 1;
+    return 0;
+}
+
+static int sb_set_damage(struct sharebuffer_device_t* dev,
+        const sb_rect_t *rects, size_t num_rects)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+
+    if(num_rects > 0 && !rects)
+        return -EINVAL;
+    for(size_t i = 0; i < num_rects; i++)
+    {
+        if(rects[i].left < 0 || rects[i].top < 0 ||
+                rects[i].right <= rects[i].left || rects[i].bottom <= rects[i].top)
+            return -EINVAL;
+    }
+
+    sb_session_t *s = current_session(m);
+    pthread_mutex_lock(&s->lock);
+    int ret = session_set_damage(s, rects, num_rects);
+    pthread_mutex_unlock(&s->lock);
+    session_put(s);
+
+    return ret;
+}
+
+static int sb_setUpdateRect(struct sharebuffer_device_t* dev,
+        int l, int t, int w, int h)
+{
+    if (((w|h) <= 0) || ((l|t)<0))
+        return -EINVAL;
+
+    sb_rect_t rect = { l, t, l + w, t + h };
+    return sb_set_damage(dev, &rect, 1);
+}
+
+/*
+ * Make s the current session of the calling thread and connect it,
+ * consuming the reference passed in.
+ */
+static void select_session(sb_session_t *s)
+{
+    set_current_session(s);
+
+    pthread_mutex_lock(&s->lock);
+    session_connect(s);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void sb_set_layer_name(struct sharebuffer_device_t *dev, const char *name)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+
+    select_session(session_lookup(m, name));
+}
+
+static int sb_register_layer(struct sharebuffer_device_t *dev, const char *name)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+    sb_session_t *s = session_lookup(m, name);
+    int32_t id;
+
+    pthread_mutex_lock(&m->sessions_lock);
+    session_map_t::iterator it = m->sessions.find(s->name);
+    if(it == m->sessions.end() || it->second != s)
+    {
+        // closed by another thread in between
+        id = -ENOENT;
+    }
+    else
+    {
+        if(s->id == 0)
+        {
+            s->id = m->next_session_id++;
+            m->session_ids[s->id] = s;
+        }
+        id = s->id;
+    }
+    pthread_mutex_unlock(&m->sessions_lock);
+
+    session_put(s);
+    return id;
+}
+
+static int sb_select_layer(struct sharebuffer_device_t *dev, int layer)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+    sb_session_t *s = NULL;
+
+    pthread_once(&current_session_once, current_session_init);
+
+    // only the calling thread changes its current session
+    sb_session_t *cur = (sb_session_t*)pthread_getspecific(current_session_key);
+    if(cur && cur->id == layer && layer > 0 && !cur->closed)
+        return 0;
+
+    pthread_mutex_lock(&m->sessions_lock);
+    session_id_map_t::iterator it = m->session_ids.find(layer);
+    if(it != m->session_ids.end())
+    {
+        s = it->second;
+        session_get(s);
+    }
+    pthread_mutex_unlock(&m->sessions_lock);
+
+    if(!s)
+        return -ENOENT;
+
+    select_session(s);
+    return 0;
+}
+
+/*
+ * Tell the renderer the layer of s is gone and disconnect it, consuming
+ * the reference of the maps, which s was removed from already.
+ */
+static void session_close(sb_session_t *s)
+{
+    ALOGI("closing layer: %s", s->name.c_str());
+
+    pthread_mutex_lock(&s->lock);
+    s->closed = true;
+    if(s->fd_renderer >= 0)
+    {
+        int ret;
+
+        if(s->protocol_version >= SB_PROTOCOL_VERSION_LAYER_IDS)
+        {
+            sb_frame_header_t header;
+            struct iovec iov;
+
+            memset(&header, 0, sizeof(header));
+            header.opcode = SB_OP_CLOSE_LAYER;
+            header.layer_id = s->layer_id;
+            header.slot = -1;
+            header.timestamp_ns = now_ns();
+
+            iov.iov_base = &header;
+            iov.iov_len = sizeof(header);
+            ret = sfdroid_ipc_send(s->fd_renderer, &iov, 1, NULL, 0);
+        }
+        else
+        {
+            ret = send_layer_name(s->fd_renderer, SB_OP_CLOSE_LAYER, s->name.c_str());
+        }
+
+        if(ret < 0)
+        {
+            ALOGW("failed to send layer close: %s", strerror(errno));
+        }
+    }
+    renderer_disconnect(s);
+    pthread_mutex_unlock(&s->lock);
+
+    session_put(s);
+}
+
+// remove s from the maps of m, with sessions_lock held
+static void session_unmap_l(private_module_t *m, sb_session_t *s)
+{
+    m->sessions.erase(s->name);
+    if(s->id != 0)
+        m->session_ids.erase(s->id);
+}
+
+static void sb_close_layer(struct sharebuffer_device_t *dev, const char *name)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+    sb_session_t *s = NULL;
+
+    pthread_mutex_lock(&m->sessions_lock);
+    session_map_t::iterator it = m->sessions.find(name);
+    if(it != m->sessions.end())
+    {
+        s = it->second;
+        session_unmap_l(m, s);
+    }
+    pthread_mutex_unlock(&m->sessions_lock);
+
+    if(!s)
+    {
+        // never posted from this process, so nothing to close
+        ALOGI("closing layer: %s", name);
+        return;
+    }
+
+    session_close(s);
+}
+
+static int sb_close_layer_id(struct sharebuffer_device_t *dev, int layer)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+    sb_session_t *s = NULL;
+
+    pthread_mutex_lock(&m->sessions_lock);
+    session_id_map_t::iterator it = m->session_ids.find(layer);
+    if(it != m->session_ids.end())
+    {
+        s = it->second;
+        session_unmap_l(m, s);
+    }
+    pthread_mutex_unlock(&m->sessions_lock);
+
+    if(!s)
+        return -ENOENT;
+
+    session_close(s);
+    return 0;
+}
+
+static int sb_is_connected(struct sharebuffer_device_t *dev)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+
+    sb_session_t *s = current_session(m);
+    int connected = s->fd_renderer >= 0;
+    session_put(s);
+
+    return connected;
+}
+
+static void session_free_buffer(sb_session_t *s, buffer_handle_t buffer);
+
+static int session_post(sb_session_t *s, buffer_handle_t buffer, uint32_t width, uint32_t height, uint32_t stride, int32_t pixel_format, int *releaseFenceFd)
+{
+    session_connect(s);
+
+    if(releaseFenceFd)
+    {
+        *releaseFenceFd = -1;
+    }
+
+    s->stats.frames_posted++;
+
+    if(s->fd_renderer >= 0)
+    {
+        int failed;
+        int32_t index = s->buffers.find(buffer);
+        int64_t start = now_ns();
+
+        if(index < 0 && s->buffers.isStale(buffer))
+        {
+            // the handle of a buffer freed without freeBuffer() had this address
+            session_free_buffer(s, buffer);
+            if(s->fd_renderer < 0)
+            {
+                s->stats.frames_dropped++;
+                return 0;
+            }
+        }
+
+        if(!session_format_supported(s, pixel_format))
+        {
+            ALOGW("renderer can't import pixel format %d", pixel_format);
+            s->stats.frames_failed++;
+            return -EINVAL;
+        }
+
+        if(session_send_hints(s) < 0)
+        {
+            ALOGW("failed to send layer hints: %s", strerror(errno));
+            goto exit_error;
+        }
+
+        if(index < 0)
+        {
+            char buf[1];
+            buf[0] = SB_OP_NEW_BUFFER;
+
+            // registering shows the buffer, without a fence
+            session_wait_acquire_fence(s);
+
+            if(send(s->fd_renderer, buf, 1, MSG_NOSIGNAL) < 0)
+            {
+                ALOGW("failed to send buffer notification: %s", strerror(errno));
+                goto exit_error;
+            }
+
+            if(send_native_handle(s->fd_renderer, buffer, width, height, stride, pixel_format) < 0)
+            {
+                ALOGW("sending buffer failed: %s", strerror(errno));
+                goto exit_error;
+            }
+
+            if(recv_status(s->fd_renderer, &failed) < 0)
+            {
+                ALOGW("recv_status failed: %s", strerror(errno));
+                goto exit_error;
+            }
+
+            if(failed)
+            {
+                goto exit_error;
+            }
+
+            index = s->buffers.add(buffer);
+            s->stats.registrations++;
+            stats_add_latency(s, now_ns() - start);
+            ALOGW("adding buffer %d", index);
+        }
+        else if(s->ring)
+        {
+            if(ring_post(s, buffer, index, releaseFenceFd) < 0)
+            {
+                goto exit_error;
+            }
+        }
+        else
+        {
+            if(session_send_slot(s, SB_OP_POST_SLOT, index) < 0)
+            {
+                ALOGW("failed to send old buffer notification: %s", strerror(errno));
+                goto exit_error;
+            }
+
+            if(recv_status(s->fd_renderer, &failed) < 0)
+            {
+                ALOGW("recv_status failed: %s", strerror(errno));
+                goto exit_error;
+            }
+
+            sb_frame_times_t times;
+            memset(&times, 0, sizeof(times));
+            if(s->protocol_version >= SB_PROTOCOL_VERSION_TIMING &&
+                    recv(s->fd_renderer, &times, sizeof(times), MSG_WAITALL) != sizeof(times))
+            {
+                ALOGW("failed to receive frame times: %s", strerror(errno));
+                goto exit_error;
+            }
+
+            stats_add_latency(s, now_ns() - start);
+            if(failed)
+            {
+                s->stats.frames_failed++;
+            }
+            report_frame_timing(s, buffer, s->stats.frames_posted, start,
+                    times.latch_ns, times.present_ns, failed);
+        }
+    }
+    else
+    {
+        s->stats.frames_dropped++;
+    }
+
+    return 0;
+
+exit_error:
+    s->stats.frames_dropped++;
+    renderer_disconnect(s);
+    schedule_reconnect(s);
+
+    // just ignore the buffer
+    return 0;
+}
+
+/*
+ * Whether posts of the layer can currently be seen: the screen is not
+ * blank and the renderer did not report the layer as occluded.
+ */
+static bool session_visible(sb_session_t *s)
+{
+    if(android_atomic_acquire_load(&s->module->screen_blanked))
+        return false;
+
+    return !s->ring || !android_atomic_acquire_load(&s->ring->occluded);
+}
+
+/*
+ * Account for a post that is not sent because nobody would see it. The
+ * buffer never leaves the caller, so it is released right away.
+ */
+static int session_skip_post(sb_session_t *s, int *releaseFenceFd)
+{
+    if(releaseFenceFd)
+    {
+        *releaseFenceFd = -1;
+    }
+
+    s->stats.frames_posted++;
+    s->stats.frames_skipped++;
+    s->skipped_posts = true;
+
+    return 0;
+}
+
+static int sb_post_internal(struct sharebuffer_device_t* dev, buffer_handle_t buffer, uint32_t width, uint32_t height, uint32_t stride, int32_t pixel_format, int *releaseFenceFd)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+
+    sb_context_t* ctx = (sb_context_t*)dev;
+    int ret;
 
-    if(strcmp(message_buffer, "OK") == 0)
+    sb_session_t *s = current_session(m);
+    pthread_mutex_lock(&s->lock);
+    int interval = android_atomic_acquire_load(&ctx->swap_interval);
+    if(!session_visible(s))
     {
-        *failed = 0;
-        return 0;
+        // keep producers of invisible layers from spinning at swap interval 0
+        session_pace(s, interval > 1 ? interval : 1, m->fps);
+        ret = session_skip_post(s, releaseFenceFd);
     }
     else
     {
-        if(strcmp(message_buffer, "FA") != 0)
+        session_pace(s, interval, m->fps);
+        if(s->skipped_posts)
         {
-            ALOGE("unknown status: %s", message_buffer);
+            // the renderer missed the damage of the skipped posts
+            s->num_damage = 0;
+            s->skipped_posts = false;
         }
-        *failed = 1;
-        return 0;
+        ret = session_post(s, buffer, width, height, stride, pixel_format, releaseFenceFd);
     }
+    // damage and the acquire fence only ever apply to a single post
+    s->num_damage = 0;
+    session_drop_acquire_fence(s);
+    pthread_mutex_unlock(&s->lock);
+    session_put(s);
 
-    return -1;
+    return ret;
 }
 
-enum {
-    PAGE_FLIP = 0x00000001,
-    LOCKED = 0x00000002
-};
-
-struct private_module_t {
-    gralloc_module_t base;
-
-    uint32_t flags;
-    uint32_t numBuffers;
-    uint32_t bufferMask;
-    pthread_mutex_t lock;
-    buffer_handle_t currentBuffer;
-    int pmem_master;
-    void* pmem_master_base;
-
-    struct fb_var_screeninfo info;
-    struct fb_fix_screeninfo finfo;
-    float xdpi;
-    float ydpi;
-    float fps;
+static void session_free_buffer(sb_session_t *s, buffer_handle_t buffer)
+{
+    int failed;
 
-    int fd_renderer;
-    char layer_name[512];
+    // the id stays reserved until the renderer has released it
+    int32_t index = s->buffers.detach(buffer);
+    if(index < 0)
+    {
+        return;
+    }
 
-    std::vector<buffer_handle_t> buffers;
-};
+    if(s->fd_renderer < 0)
+    {
+        // tell the renderer once the session is resumed
+        s->pending_frees.push_back(index);
+        return;
+    }
 
-struct sb_context_t {
-    sharebuffer_device_t device;
-};
+    if(session_send_slot(s, SB_OP_FREE_BUFFER, index) < 0 ||
+            recv_status(s->fd_renderer, &failed) < 0)
+    {
+        ALOGW("failed to free buffer %d: %s", index, strerror(errno));
+        s->pending_frees.push_back(index);
+        renderer_disconnect(s);
+        schedule_reconnect(s);
+        return;
+    }
 
-static int sb_setSwapInterval(struct sharebuffer_device_t* dev,
-            int interval)
-{
-    sb_context_t* ctx = (sb_context_t*)dev;
-    if (interval < dev->minSwapInterval || interval > dev->maxSwapInterval)
-        return -EINVAL;
-    // FIXME: implement sb_setSwapInterval
-    return 0;
+    if(failed)
+    {
+        // the renderer keeps its own numbering, never hand this id out again
+        s->buffers.setReuseIds(false);
+    }
+    s->buffers.releaseId(index);
 }
 
-static int fb_setUpdateRect(struct sharebuffer_device_t* dev,
-        int l, int t, int w, int h)
+static void sb_free_buffer(struct sharebuffer_device_t* dev, buffer_handle_t buffer)
 {
-    if (((w|h) <= 0) || ((l|t)<0))
-        return -EINVAL;
-        
-    sb_context_t* ctx = (sb_context_t*)dev;
     private_module_t* m = reinterpret_cast<private_module_t*>(
             dev->common.module);
-    m->info.reserved[0] = 0x54445055; // "UPDT";
-    m->info.reserved[1] = (uint16_t)l | ((uint32_t)t << 16);
-    m->info.reserved[2] = (uint16_t)(l+w) | ((uint32_t)(t+h) << 16);
-    return 0;
-}
-
-static void sb_set_layer_name(struct sharebuffer_device_t *dev, const char *name)
-{
-    sb_context_t* ctx = (sb_context_t*)dev;
+    std::vector<sb_session_t*> sessions;
 
-    private_module_t* m = reinterpret_cast<private_module_t*>(
-            dev->common.module);
+    // a buffer may have been posted to several layers
+    pthread_mutex_lock(&m->sessions_lock);
+    for(session_map_t::iterator it = m->sessions.begin(); it != m->sessions.end(); ++it)
+    {
+        session_get(it->second);
+        sessions.push_back(it->second);
+    }
+    pthread_mutex_unlock(&m->sessions_lock);
 
-    if(m->fd_renderer < 0)
+    for(size_t i = 0; i < sessions.size(); i++)
     {
-        ALOGW("connecting to renderer");
-        memset(m->layer_name, 0, 512);
-        m->fd_renderer = connect_to_renderer();
+        pthread_mutex_lock(&sessions[i]->lock);
+        session_free_buffer(sessions[i], buffer);
+        pthread_mutex_unlock(&sessions[i]->lock);
+        session_put(sessions[i]);
     }
+}
+
+/*
+ * Register the buffers the renderer does not know yet in as few batches
+ * as the fd and size limits allow. Called with the session lock held.
+ */
+static int session_register_buffers(sb_session_t *s, const buffer_handle_t *buffers, const sb_buffer_info_t *info, size_t count)
+{
+    buffer_handle_t batch[SB_BATCH_MAX_BUFFERS];
+    sb_buffer_info_t batch_info[SB_BATCH_MAX_BUFFERS];
+    size_t i = 0;
+
+    session_connect(s);
 
-    if(m->fd_renderer >= 0)
+    while(i < count && s->fd_renderer >= 0 && s->batch_supported)
     {
-        char buf[1];
-        buf[0] = 0xFE;
+        size_t n = 0;
+        int num_fds = 0;
+        int failed;
 
-        if(strcmp(m->layer_name, name) == 0)
+        for(; i < count && n < SB_BATCH_MAX_BUFFERS; i++)
         {
-            return;
+            if(s->buffers.isStale(buffers[i]))
+            {
+                session_free_buffer(s, buffers[i]);
+            }
+            bool duplicate = s->buffers.find(buffers[i]) >= 0;
+            for(size_t k = 0; k < n && !duplicate; k++)
+            {
+                duplicate = batch[k] == buffers[i];
+            }
+            if(duplicate || !session_format_supported(s, info[i].pixel_format))
+            {
+                continue;
+            }
+            if(n > 0 && num_fds + buffers[i]->numFds > SB_BATCH_MAX_FDS)
+            {
+                break;
+            }
+            num_fds += buffers[i]->numFds;
+            batch[n] = buffers[i];
+            batch_info[n] = info[i];
+            n++;
         }
 
-        if(send(m->fd_renderer, buf, 1, 0) < 0)
+        if(n == 0)
         {
-            ALOGW("failed to send layer name notification: %s", strerror(errno));
-            goto exit_error;
+            break;
         }
 
-        buf[0] = strlen(name);
-        if(send(m->fd_renderer, buf, 1, 0) < 0)
+        int64_t start = now_ns();
+        if(send_native_handles(s->fd_renderer, batch, batch_info, n) < 0 ||
+                recv_status(s->fd_renderer, &failed) < 0)
         {
-            ALOGW("failed to send layer name length: %s", strerror(errno));
-            goto exit_error;
+            ALOGW("failed to register buffers: %s", strerror(errno));
+            renderer_disconnect(s);
+            schedule_reconnect(s);
+            return -EPIPE;
         }
 
-        if(send(m->fd_renderer, name, buf[0], 0) < 0)
+        if(failed)
         {
-            ALOGW("failed to send: layer name: %s", strerror(errno));
-            goto exit_error;
+            // those are registered by their first post instead
+            ALOGW("renderer refused %zu buffers", n);
+            return -EINVAL;
         }
 
-        strcpy(m->layer_name, name);
+        for(size_t k = 0; k < n; k++)
+        {
+            s->buffers.add(batch[k]);
+        }
+        s->stats.registrations += n;
+        stats_add_latency(s, now_ns() - start);
     }
 
-    return;
+    return 0;
+}
 
-exit_error:
-    close(m->fd_renderer);
-    m->fd_renderer = -1;
-    ALOGW("clearing buffers");
-    m->buffers.resize(0);
+static void sb_set_frame_timing_callback(struct sharebuffer_device_t* dev, sb_frame_timing_callback_t callback, void *data)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
 
-    return;
+    pthread_mutex_lock(&m->timing_lock);
+    m->timing_callback = callback;
+    m->timing_callback_data = data;
+    pthread_mutex_unlock(&m->timing_lock);
 }
 
-static void sb_close_layer(struct sharebuffer_device_t *dev, const char *name)
+static int sb_set_layer_hints(struct sharebuffer_device_t* dev, const sb_layer_hints_t *hints)
 {
-    sb_context_t* ctx = (sb_context_t*)dev;
-
     private_module_t* m = reinterpret_cast<private_module_t*>(
             dev->common.module);
+    sb_layer_hints_wire_t wire;
 
-    if(m->fd_renderer < 0)
+    memset(&wire, 0, sizeof(wire));
+    wire.plane_alpha = 255;
+    if(hints)
     {
-        ALOGW("connecting to renderer");
-        memset(m->layer_name, 0, 512);
-        m->fd_renderer = connect_to_renderer();
+        if((hints->flags & ~(SB_HINT_OPAQUE | SB_HINT_FULLSCREEN | SB_HINT_UNDERLAY |
+                SB_HINT_OVERLAY)) ||
+                (hints->flags & (SB_HINT_UNDERLAY | SB_HINT_OVERLAY)) ==
+                (SB_HINT_UNDERLAY | SB_HINT_OVERLAY))
+        {
+            return -EINVAL;
+        }
+        wire.flags = (hints->flags & SB_HINT_OPAQUE ? SB_FRAME_FLAG_OPAQUE : 0) |
+                (hints->flags & SB_HINT_FULLSCREEN ? SB_FRAME_FLAG_FULLSCREEN : 0) |
+                (hints->flags & SB_HINT_UNDERLAY ? SB_FRAME_FLAG_UNDERLAY : 0) |
+                (hints->flags & SB_HINT_OVERLAY ? SB_FRAME_FLAG_OVERLAY : 0);
+        wire.transform = hints->transform;
+        wire.crop.left = hints->crop.left;
+        wire.crop.top = hints->crop.top;
+        wire.crop.right = hints->crop.right;
+        wire.crop.bottom = hints->crop.bottom;
+        wire.frame.left = hints->frame.left;
+        wire.frame.top = hints->frame.top;
+        wire.frame.right = hints->frame.right;
+        wire.frame.bottom = hints->frame.bottom;
+        wire.plane_alpha = hints->plane_alpha;
     }
 
-ALOGE("closing layer: %s", name);
-
-    if(m->fd_renderer >= 0)
+    sb_session_t *s = current_session(m);
+    pthread_mutex_lock(&s->lock);
+    // an older renderer would show the layer above the others
+    if((wire.flags & SB_FRAME_FLAG_UNDERLAY) && s->fd_renderer >= 0 &&
+            s->protocol_version < SB_PROTOCOL_VERSION_UNDERLAY)
+    {
+        pthread_mutex_unlock(&s->lock);
+        session_put(s);
+        return -ENOTSUP;
+    }
+    if(memcmp(&wire, &s->hints, sizeof(wire)) != 0)
     {
-        char buf[1];
-        buf[0] = 0xFD;
+        s->hints = wire;
+        s->hints_dirty = true;
+    }
+    pthread_mutex_unlock(&s->lock);
+    session_put(s);
+
+    return 0;
+}
 
-ALOGE("closing layer2: %s", name);
 /*
-        if(strcmp(m->layer_name, name) == 0)
-        {
-            return;
-        }
-*/
+ * Move the frame of an overlay layer. Renderers that know overlays get a
+ * position message right away, unless the hints changed since they were
+ * last sent, then those are sent at once instead; the others see the new
+ * frame in the hints of the next post.
+ */
+static int sb_set_layer_position(struct sharebuffer_device_t* dev, int x, int y)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+    int ret = 0;
 
-        if(send(m->fd_renderer, buf, 1, 0) < 0)
-        {
-            ALOGW("failed to send layer close name notification: %s", strerror(errno));
-            goto exit_error;
-        }
+    sb_session_t *s = current_session(m);
+    pthread_mutex_lock(&s->lock);
+    sb_ring_rect_t *frame = &s->hints.frame;
+    if(!(s->hints.flags & SB_FRAME_FLAG_OVERLAY) ||
+            frame->right <= frame->left || frame->bottom <= frame->top)
+    {
+        ret = -EINVAL;
+        goto exit;
+    }
+    if(frame->left == x && frame->top == y)
+        goto exit;
+
+    frame->right += x - frame->left;
+    frame->bottom += y - frame->top;
+    frame->left = x;
+    frame->top = y;
 
-        buf[0] = strlen(name);
-        if(send(m->fd_renderer, buf, 1, 0) < 0)
+    if(s->fd_renderer < 0 || s->protocol_version < SB_PROTOCOL_VERSION_OVERLAY)
+    {
+        s->hints_dirty = true;
+    }
+    else if(s->hints_dirty)
+    {
+        if(session_send_hints(s) < 0)
         {
-            ALOGW("failed to send layer close name length: %s", strerror(errno));
-            goto exit_error;
+            ALOGW("failed to send layer hints: %s", strerror(errno));
+            renderer_disconnect(s);
+            schedule_reconnect(s);
         }
-
-        if(send(m->fd_renderer, name, buf[0], 0) < 0)
+    }
+    else
+    {
+        sb_frame_header_t header;
+        sb_layer_position_t position;
+        struct iovec iov[2];
+
+        memset(&header, 0, sizeof(header));
+        header.opcode = SB_OP_LAYER_POSITION;
+        header.layer_id = s->layer_id;
+        header.slot = -1;
+        header.timestamp_ns = now_ns();
+        position.x = x;
+        position.y = y;
+
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = &position;
+        iov[1].iov_len = sizeof(position);
+        if(sfdroid_ipc_send(s->fd_renderer, iov, 2, NULL, 0) < 0)
         {
-            ALOGW("failed to send: layer close name: %s", strerror(errno));
-            goto exit_error;
+            // a new connection starts out sending the moved hints
+            ALOGW("failed to send layer position: %s", strerror(errno));
+            renderer_disconnect(s);
+            schedule_reconnect(s);
         }
-
-        strcpy(m->layer_name, name);
     }
 
-    return;
+exit:
+    pthread_mutex_unlock(&s->lock);
+    session_put(s);
+    return ret;
+}
 
-exit_error:
-    close(m->fd_renderer);
-    m->fd_renderer = -1;
-    ALOGW("clearing buffers");
-    m->buffers.resize(0);
+static int sb_enable_screen(struct sharebuffer_device_t* dev, int enable)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+
+    ALOGI("screen %s", enable ? "unblanked" : "blanked");
+    android_atomic_release_store(enable ? 0 : 1, &m->screen_blanked);
 
-    return;
+    return 0;
 }
 
-static int sb_is_connected(struct sharebuffer_device_t *dev)
+static int sb_set_mailbox(struct sharebuffer_device_t* dev, int enable)
 {
-    // TODO: helpers for the sizeofs
-    sb_context_t* ctx = (sb_context_t*)dev;
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+
+    sb_session_t *s = current_session(m);
+    pthread_mutex_lock(&s->lock);
+    s->mailbox = enable != 0;
+    pthread_mutex_unlock(&s->lock);
+    session_put(s);
+
+    return 0;
+}
 
+static int sb_set_acquire_fence(struct sharebuffer_device_t* dev, int fenceFd)
+{
     private_module_t* m = reinterpret_cast<private_module_t*>(
             dev->common.module);
 
-    if(m->fd_renderer < 0)
-    {
-        return 0;
-    }
+    sb_session_t *s = current_session(m);
+    pthread_mutex_lock(&s->lock);
+    session_drop_acquire_fence(s);
+    s->acquire_fence = fenceFd;
+    pthread_mutex_unlock(&s->lock);
+    session_put(s);
 
-    return 1;
+    return 0;
 }
 
-static int sb_post(struct sharebuffer_device_t* dev, buffer_handle_t buffer, uint32_t width, uint32_t height, uint32_t stride, int32_t pixel_format)
+static int sb_is_format_supported(struct sharebuffer_device_t* dev, int32_t format)
 {
-    // TODO: helpers for the sizeofs
-    sb_context_t* ctx = (sb_context_t*)dev;
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+    bool supported;
+
+    sb_session_t *s = current_session(m);
+    pthread_mutex_lock(&s->lock);
+    session_connect(s);
+    if(s->fd_renderer >= 0 && s->protocol_version >= SB_PROTOCOL_VERSION_FORMATS)
+        supported = session_format_supported(s, format);
+    else
+        supported = format_is_default(format);
+    pthread_mutex_unlock(&s->lock);
+    session_put(s);
 
+    return supported;
+}
+
+static int sb_get_vsync(struct sharebuffer_device_t* dev, int64_t *timestamp, int64_t *period)
+{
     private_module_t* m = reinterpret_cast<private_module_t*>(
             dev->common.module);
+    std::vector<sb_session_t*> sessions;
 
-    if(m->fd_renderer < 0)
+    // all layers are shown on the same output, any ring will do
+    pthread_mutex_lock(&m->sessions_lock);
+    for(session_map_t::iterator it = m->sessions.begin(); it != m->sessions.end(); ++it)
     {
-        ALOGW("connecting to renderer");
-        memset(m->layer_name, 0, 512);
-        m->fd_renderer = connect_to_renderer();
+        session_get(it->second);
+        sessions.push_back(it->second);
     }
+    pthread_mutex_unlock(&m->sessions_lock);
 
-    if(m->fd_renderer >= 0)
+    *timestamp = 0;
+    *period = 1000000000LL / (m->fps > 0 ? m->fps : 60);
+    for(size_t i = 0; i < sessions.size(); i++)
     {
-        int failed;
-        bool already_sent = false;
-        int index = -1;
-
-        for(std::vector<buffer_handle_t>::size_type i=0;i<m->buffers.size();i++)
+        // the lock is held across posts, skip the busy sessions rather than block
+        if(pthread_mutex_trylock(&sessions[i]->lock) == 0)
         {
-            if(m->buffers[i] == buffer)
+            int64_t ts, p;
+            session_vsync(sessions[i], m->fps, &ts, &p);
+            if(ts > *timestamp)
             {
-                already_sent = true;
-                index = i;
+                *timestamp = ts;
+                *period = p;
             }
+            pthread_mutex_unlock(&sessions[i]->lock);
         }
+        session_put(sessions[i]);
+    }
 
-        if(!already_sent)
-        {
-            char buf[1];
-            buf[0] = 0xFF;
+    return *timestamp ? 0 : -ENODEV;
+}
 
-            if(send(m->fd_renderer, buf, 1, 0) < 0)
-            {
-                ALOGW("failed to send buffer notification: %s", strerror(errno));
-                goto exit_error;
-            }
+static int sb_register_buffers(struct sharebuffer_device_t* dev, const buffer_handle_t *buffers, const sb_buffer_info_t *info, size_t count)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
 
-            if(send_native_handle(m->fd_renderer, buffer, width, height, stride, pixel_format) < 0)
-            {
-                ALOGW("sending buffer failed: %s", strerror(errno));
-                goto exit_error;
-            }
+    if(count > 0 && (!buffers || !info))
+    {
+        return -EINVAL;
+    }
 
-            if(recv_status(m->fd_renderer, &failed) < 0)
-            {
-                ALOGW("recv_status failed: %s", strerror(errno));
-                goto exit_error;
-            }
+    sb_session_t *s = current_session(m);
+    pthread_mutex_lock(&s->lock);
+    int ret = session_register_buffers(s, buffers, info, count);
+    pthread_mutex_unlock(&s->lock);
+    session_put(s);
 
-            if(failed)
-            {
-                goto exit_error;
-            }
+    return ret;
+}
+
+static void session_get_stats(sb_session_t *s, sharebuffer_layer_stats_t *stats)
+{
+    pthread_mutex_lock(&s->lock);
+    pthread_mutex_lock(&s->stats_lock);
+    *stats = s->stats;
+    pthread_mutex_unlock(&s->stats_lock);
+    stats->connected = s->fd_renderer >= 0;
+    stats->frames_failed += android_atomic_acquire_load(&s->ring_failures);
+    stats->frames_replaced += android_atomic_acquire_load(&s->ring_replaced);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static size_t sb_get_stats(struct sharebuffer_device_t* dev,
+        sharebuffer_layer_stats_t *stats, size_t count)
+{
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+    std::vector<sb_session_t*> sessions;
+
+    pthread_mutex_lock(&m->sessions_lock);
+    for(session_map_t::iterator it = m->sessions.begin(); it != m->sessions.end(); ++it)
+    {
+        session_get(it->second);
+        sessions.push_back(it->second);
+    }
+    pthread_mutex_unlock(&m->sessions_lock);
+
+    for(size_t i = 0; i < sessions.size(); i++)
+    {
+        if(stats && i < count)
+            session_get_stats(sessions[i], &stats[i]);
+        session_put(sessions[i]);
+    }
+
+    return sessions.size();
+}
+
+static void sb_dump(struct sharebuffer_device_t* dev, char *buff, int buff_len)
+{
+    std::vector<sharebuffer_layer_stats_t> stats(sb_get_stats(dev, NULL, 0));
+    size_t count = stats.empty() ? 0 : sb_get_stats(dev, &stats[0], stats.size());
+    int len = 0;
+
+    // layers may have come and gone in between
+    if(count > stats.size())
+        count = stats.size();
 
-            ALOGW("adding buffer");
-            m->buffers.push_back(buffer);
+    for(size_t i = 0; i < count && len < buff_len; i++)
+    {
+        const sharebuffer_layer_stats_t &st = stats[i];
+
+        len += snprintf(buff + len, buff_len - len,
+                "  layer '%s'%s: posted=%llu dropped=%llu failed=%llu replaced=%llu "
+                "skipped=%llu reconnects=%llu registrations=%llu\n",
+                st.name, st.connected ? "" : " (disconnected)",
+                (unsigned long long)st.frames_posted,
+                (unsigned long long)st.frames_dropped,
+                (unsigned long long)st.frames_failed,
+                (unsigned long long)st.frames_replaced,
+                (unsigned long long)st.frames_skipped,
+                (unsigned long long)st.reconnects,
+                (unsigned long long)st.registrations);
+        if(len >= buff_len)
+            break;
+
+        len += snprintf(buff + len, buff_len - len,
+                "    latency: avg=%lldus max=%lldus histogram(us):",
+                (long long)(st.latency_count ? st.latency_total_ns / st.latency_count / 1000 : 0),
+                (long long)(st.latency_max_ns / 1000));
+        for(int b = 0; b < SB_LATENCY_BUCKETS - 1 && len < buff_len; b++)
+        {
+            len += snprintf(buff + len, buff_len - len, " <%lld:%u",
+                    32LL << b, st.latency_histogram[b]);
         }
-        else
+        if(len < buff_len)
         {
-            char buf[1];
-            buf[0] = index;
+            len += snprintf(buff + len, buff_len - len, " more:%u",
+                    st.latency_histogram[SB_LATENCY_BUCKETS - 1]);
+        }
+        if(len < buff_len)
+            len += snprintf(buff + len, buff_len - len, "\n");
+    }
+}
 
-            if(send(m->fd_renderer, buf, 1, 0) < 0)
-            {
-                ALOGW("failed to send old buffer notification: %s", strerror(errno));
-                goto exit_error;
-            }
+/* the stats of all layers added up */
+static int sb_get_perf_counters(const struct hw_device_t* device,
+        hw_perf_counter_t *counters, size_t count)
+{
+    struct sharebuffer_device_t* dev = (struct sharebuffer_device_t*)device;
+    std::vector<sharebuffer_layer_stats_t> stats(sb_get_stats(dev, NULL, 0));
+    size_t layers = stats.empty() ? 0 : sb_get_stats(dev, &stats[0], stats.size());
+    sharebuffer_layer_stats_t total;
+    uint64_t connected = 0;
 
-            if(recv_status(m->fd_renderer, &failed) < 0)
-            {
-                ALOGW("recv_status failed: %s", strerror(errno));
-                goto exit_error;
-            }
-        }
+    if(layers > stats.size())
+        layers = stats.size();
+
+    memset(&total, 0, sizeof(total));
+    for(size_t i = 0; i < layers; i++)
+    {
+        const sharebuffer_layer_stats_t &st = stats[i];
+
+        connected += st.connected ? 1 : 0;
+        total.frames_posted += st.frames_posted;
+        total.frames_dropped += st.frames_dropped;
+        total.frames_failed += st.frames_failed;
+        total.frames_replaced += st.frames_replaced;
+        total.frames_skipped += st.frames_skipped;
+        total.reconnects += st.reconnects;
+        total.registrations += st.registrations;
+        total.latency_count += st.latency_count;
+        total.latency_total_ns += st.latency_total_ns;
+        if(st.latency_max_ns > total.latency_max_ns)
+            total.latency_max_ns = st.latency_max_ns;
     }
 
-    return 0;
+    size_t n = 0;
+    hw_perf_counter_put(counters, count, &n, "layers",
+            HW_PERF_COUNTER_TYPE_GAUGE, layers);
+    hw_perf_counter_put(counters, count, &n, "layers_connected",
+            HW_PERF_COUNTER_TYPE_GAUGE, connected);
+    hw_perf_counter_put(counters, count, &n, "frames_posted",
+            HW_PERF_COUNTER_TYPE_COUNT, total.frames_posted);
+    hw_perf_counter_put(counters, count, &n, "frames_dropped",
+            HW_PERF_COUNTER_TYPE_COUNT, total.frames_dropped);
+    hw_perf_counter_put(counters, count, &n, "frames_failed",
+            HW_PERF_COUNTER_TYPE_COUNT, total.frames_failed);
+    hw_perf_counter_put(counters, count, &n, "frames_replaced",
+            HW_PERF_COUNTER_TYPE_COUNT, total.frames_replaced);
+    hw_perf_counter_put(counters, count, &n, "frames_skipped",
+            HW_PERF_COUNTER_TYPE_COUNT, total.frames_skipped);
+    hw_perf_counter_put(counters, count, &n, "reconnects",
+            HW_PERF_COUNTER_TYPE_COUNT, total.reconnects);
+    hw_perf_counter_put(counters, count, &n, "registrations",
+            HW_PERF_COUNTER_TYPE_COUNT, total.registrations);
+    hw_perf_counter_put(counters, count, &n, "latency.count",
+            HW_PERF_COUNTER_TYPE_COUNT, total.latency_count);
+    hw_perf_counter_put(counters, count, &n, "latency.total_ns",
+            HW_PERF_COUNTER_TYPE_TIME_NS, total.latency_total_ns);
+    hw_perf_counter_put(counters, count, &n, "latency.max_ns",
+            HW_PERF_COUNTER_TYPE_MAX_NS, total.latency_max_ns);
+    return n;
+}
 
-exit_error:
-    close(m->fd_renderer);
-    m->fd_renderer = -1;
-    ALOGW("clearing buffers");
-    m->buffers.resize(0);
+static const hw_device_ext_t sb_device_ext = {
+    .tag = HARDWARE_DEVICE_EXT_TAG,
+    .version = HARDWARE_DEVICE_EXT_VERSION_1,
+    .get_perf_counters = sb_get_perf_counters,
+};
 
-    // just ignore the buffer
-    return 0;
+static int sb_post(struct sharebuffer_device_t* dev, buffer_handle_t buffer, uint32_t width, uint32_t height, uint32_t stride, int32_t pixel_format)
+{
+    return sb_post_internal(dev, buffer, width, height, stride, pixel_format, NULL);
+}
+
+static int sb_post_async(struct sharebuffer_device_t* dev, buffer_handle_t buffer, uint32_t width, uint32_t height, uint32_t stride, int32_t pixel_format, int *releaseFenceFd)
+{
+    if(!releaseFenceFd)
+        return -EINVAL;
+
+    return sb_post_internal(dev, buffer, width, height, stride, pixel_format, releaseFenceFd);
 }
 
 int mapFrameBufferLocked(struct private_module_t* module)
@@ -569,6 +2594,8 @@ int mapFrameBufferLocked(struct private_module_t* module)
     if (finfo.smem_len <= 0)
         return -errno;
 
+    // nothing is ever shown through fbdev, only the geometry was needed
+    close(fd);
 
     module->flags = flags;
     module->info = info;
@@ -577,18 +2604,86 @@ int mapFrameBufferLocked(struct private_module_t* module)
     module->ydpi = ydpi;
     module->fps = fps;
 
-    module->buffers.resize(0);
-
-    // sb_post will this. but only if set like this.
-    module->fd_renderer = -1;
 
     return 0;
 }
 
+/*
+ * Ask the renderer for the geometry of its output instead of probing the
+ * framebuffer device. Returns 0 once module holds it, -1 if the renderer
+ * is not running or too old to tell.
+ */
+static int renderer_display_info(struct private_module_t* module)
+{
+    sb_session_t probe;
+    sb_frame_header_t header;
+    sb_display_info_t display;
+    int failed;
+    int ret = -1;
+
+    probe.fd_renderer = connect_to_renderer();
+    if(probe.fd_renderer < 0)
+        return -1;
+
+    // a renderer stuck at startup must not block the device open
+    struct timeval tv;
+    tv.tv_sec = DISPLAY_INFO_TIMEOUT_MS / 1000;
+    tv.tv_usec = (DISPLAY_INFO_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(probe.fd_renderer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if(protocol_setup(&probe) < 0 || probe.protocol_version < SB_PROTOCOL_VERSION_DISPLAY)
+        goto exit;
+
+    memset(&header, 0, sizeof(header));
+    header.opcode = SB_OP_DISPLAY_INFO;
+    header.layer_id = probe.layer_id;
+    header.slot = -1;
+    header.timestamp_ns = now_ns();
+
+    if(send(probe.fd_renderer, &header, sizeof(header), MSG_NOSIGNAL) < 0 ||
+            recv_status(probe.fd_renderer, &failed) < 0 || failed ||
+            recv(probe.fd_renderer, &display, sizeof(display), MSG_WAITALL) != sizeof(display))
+        goto exit;
+
+    if(display.width == 0 || display.height == 0 || display.stride < display.width)
+    {
+        ALOGW("bad display info from renderer: %ux%u stride %u",
+                display.width, display.height, display.stride);
+        goto exit;
+    }
+
+    memset(&module->info, 0, sizeof(module->info));
+    memset(&module->finfo, 0, sizeof(module->finfo));
+    module->info.xres = module->info.xres_virtual = display.width;
+    module->info.yres = module->info.yres_virtual = display.height;
+    module->info.bits_per_pixel = display.format == HAL_PIXEL_FORMAT_RGB_565 ? 16 : 32;
+    module->finfo.line_length = display.stride * (module->info.bits_per_pixel >> 3);
+    module->flags = 0;
+    module->xdpi = display.xdpi_milli > 0 ? display.xdpi_milli / 1000.0f : 160.0f;
+    module->ydpi = display.ydpi_milli > 0 ? display.ydpi_milli / 1000.0f : 160.0f;
+    module->fps = display.refresh_mhz > 0 ? display.refresh_mhz / 1000.0f : 60.0f;
+
+    ALOGI("renderer output %ux%u, %.1f x %.1f dpi, %.2f Hz",
+            display.width, display.height, module->xdpi, module->ydpi, module->fps);
+    ret = 0;
+
+exit:
+    close(probe.fd_renderer);
+    return ret;
+}
+
 static int mapFrameBuffer(struct private_module_t* module)
 {
+    int err = 0;
+
     pthread_mutex_lock(&module->lock);
-    int err = mapFrameBufferLocked(module);
+    if(!module->geometry_known)
+    {
+        // fbdev is only the fallback for renderers that can't describe their output
+        if(renderer_display_info(module) < 0)
+            err = mapFrameBufferLocked(module);
+        module->geometry_known = err >= 0;
+    }
     pthread_mutex_unlock(&module->lock);
     return err;
 }
@@ -628,7 +2723,7 @@ struct private_module_t HAL_MODULE_INFO_SYM = {
         common: {
             tag: HARDWARE_MODULE_TAG,
             version_major: 1,
-            version_minor: 0,
+            hal_api_version: HARDWARE_HAL_API_VERSION_1_1,
             id: SHAREBUFFER_HARDWARE_MODULE_ID,
             name: "sharebuffer",
             author: "krnlyng",
@@ -644,6 +2739,25 @@ struct private_module_t HAL_MODULE_INFO_SYM = {
     bufferMask: 0,
     lock: PTHREAD_MUTEX_INITIALIZER,
     currentBuffer: 0,
+    pmem_master: 0,
+    pmem_master_base: 0,
+    info: {},
+    finfo: {},
+    xdpi: 0,
+    ydpi: 0,
+    fps: 0,
+    sessions_lock: PTHREAD_MUTEX_INITIALIZER,
+    sessions: session_map_t(),
+    session_ids: session_id_map_t(),
+    next_session_id: 1,
+    reconnect_cond: PTHREAD_COND_INITIALIZER,
+    reconnect_thread: 0,
+    reconnect_thread_started: false,
+    timing_lock: PTHREAD_MUTEX_INITIALIZER,
+    timing_callback: NULL,
+    timing_callback_data: NULL,
+    screen_blanked: 0,
+    geometry_known: false,
 };
 
 static int sharebuffer_alloc(alloc_device_t* dev,
@@ -704,15 +2818,33 @@ int sharebuffer_device_open(const hw_module_t* module, const char* name,
 
         /* initialize the procs */
         dev->device.common.tag = HARDWARE_DEVICE_TAG;
-        dev->device.common.version = 0;
+        dev->device.common.version = SHAREBUFFER_DEVICE_API_VERSION_1_7;
         dev->device.common.module = const_cast<hw_module_t*>(module);
         dev->device.common.close = sb_close;
+        dev->device.common.ext = &sb_device_ext;
         dev->device.setSwapInterval = sb_setSwapInterval;
         dev->device.post            = sb_post;
+        dev->device.postAsync       = sb_post_async;
+        dev->device.freeBuffer      = sb_free_buffer;
         dev->device.set_layer_name  = sb_set_layer_name;
         dev->device.is_connected    = sb_is_connected;
         dev->device.close_layer     = sb_close_layer;
-        dev->device.setUpdateRect = 0;
+        dev->device.setUpdateRect   = sb_setUpdateRect;
+        dev->device.setDamage       = sb_set_damage;
+        dev->device.getStats        = sb_get_stats;
+        dev->device.registerBuffers = sb_register_buffers;
+        dev->device.setFrameTimingCallback = sb_set_frame_timing_callback;
+        dev->device.setLayerHints   = sb_set_layer_hints;
+        dev->device.isFormatSupported = sb_is_format_supported;
+        dev->device.getVsync        = sb_get_vsync;
+        dev->device.setMailbox      = sb_set_mailbox;
+        dev->device.setAcquireFence = sb_set_acquire_fence;
+        dev->device.registerLayer   = sb_register_layer;
+        dev->device.selectLayer     = sb_select_layer;
+        dev->device.closeLayerId    = sb_close_layer_id;
+        dev->device.setLayerPosition = sb_set_layer_position;
+        dev->device.dump            = sb_dump;
+        dev->device.enableScreen    = sb_enable_screen;
 
         private_module_t* m = (private_module_t*)module;
         status = mapFrameBuffer(m);
@@ -729,8 +2861,9 @@ int sharebuffer_device_open(const hw_module_t* module, const char* name,
             const_cast<float&>(dev->device.xdpi) = m->xdpi;
             const_cast<float&>(dev->device.ydpi) = m->ydpi;
             const_cast<float&>(dev->device.fps) = m->fps;
-            const_cast<int&>(dev->device.minSwapInterval) = 1;
-            const_cast<int&>(dev->device.maxSwapInterval) = 1;
+            const_cast<int&>(dev->device.minSwapInterval) = 0;
+            const_cast<int&>(dev->device.maxSwapInterval) = 2;
+            dev->swap_interval = 1;
             *device = &dev->device.common;
         }
     }
@@ -0,0 +1,20 @@
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	sharebuffer_benchmark.cpp
+
+LOCAL_MODULE := sharebufferbenchmark
+
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_CFLAGS := -O2 -DLOG_TAG=\"SharebufferBenchmark\"
+
+LOCAL_SHARED_LIBRARIES := libhardware libcutils liblog libsync libstlport
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/.. system/core/libsync \
+	$(LOCAL_PATH)/../../../tests/include \
+	external/stlport/stlport bionic
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,658 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <cutils/ashmem.h>
+#include <cutils/atomic.h>
+#include <cutils/native_handle.h>
+#include <hardware/gralloc.h>
+#include <hardware/sb.h>
+#include <sync/sync.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "sb_protocol.h"
+#include "BenchmarkStats.h"
+
+using benchmark::MonotonicNs;
+
+// Transport benchmark for sharebuffer: a mock renderer on the socket sharebuffer connects to,
+// implementing the whole protocol of sb_protocol.h without showing anything, and producer
+// threads posting a layer each through the sharebuffer module as hwcomposer would.
+//
+// The renderer takes the given time to show each post before answering it over the socket or
+// releasing it from the ring. Layer churn closes a producer's layer after that many frames and
+// opens a new one, which costs a new connection and registering its buffers again.
+//
+// Exact syscall counts need strace; what is reported instead are the renderer requests per frame,
+// each a send() and a recv() of the producer, and the post ring wakeups, each a write() of the
+// producer, along with the context switches of the producer threads.
+
+// Run it like this:
+//
+// make sharebufferbenchmark -j32 && adb sync && adb shell /system/bin/sharebufferbenchmark
+//         [producers] [buffers per layer] [frames per layer, 0 for no churn]
+//         [renderer delay us] [seconds] [ring 0|1] [postAsync 0|1] [protocol version]
+//         [mailbox 0|1]
+
+#ifndef RUSAGE_THREAD
+#define RUSAGE_THREAD 1
+#endif
+
+static const char* RENDERER_SOCKET = "/tmp/sfdroid/gralloc_buffer_handle";
+
+/*
+ * Mock renderer: one thread per connection.
+ */
+struct Renderer {
+    int listenFd;
+    int delayUs;
+    bool ring;
+    uint32_t maxVersion;
+    volatile int32_t nextLayerId;
+    volatile int32_t requests;
+    volatile int32_t ringPosts;
+    volatile int32_t ringReplaced;
+    volatile int32_t ringWakeups;
+    volatile int32_t stopping;
+};
+
+struct Connection {
+    Renderer* renderer;
+    int fd;
+    uint32_t version;
+    bool batchProbed;
+    sb_ring_t* ring;
+    int ringFd;
+    int postFd;
+    int releaseFd;
+    int32_t shownTail;
+};
+
+// Receives exactly size bytes, collecting the fds that came with them.
+static bool recvAll(int fd, void* buffer, size_t size, std::vector<int>* fds) {
+    char* pos = (char*) buffer;
+    while (size > 0) {
+        char control[CMSG_SPACE(sizeof(int) * SB_BATCH_MAX_FDS)];
+        struct iovec iov = { pos, size };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(fd, &msg, 0);
+        if (n <= 0) {
+            return false;
+        }
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+                cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                fds->insert(fds->end(), (int*) CMSG_DATA(cmsg), (int*) CMSG_DATA(cmsg) + count);
+            }
+        }
+        pos += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool sendAll(int fd, const void* buffer, size_t size) {
+    return send(fd, buffer, size, MSG_NOSIGNAL) == (ssize_t) size;
+}
+
+static bool sendStatus(int fd, bool ok) {
+    return sendAll(fd, ok ? SB_STATUS_OK : SB_STATUS_FAILED, 3);
+}
+
+static void closeFds(std::vector<int>* fds) {
+    for (size_t i = 0; i < fds->size(); i++) {
+        close((*fds)[i]);
+    }
+    fds->clear();
+}
+
+static bool skipName(int fd, std::vector<int>* fds) {
+    uint8_t length;
+    char name[UINT8_MAX];
+    return recvAll(fd, &length, 1, fds) && (length == 0 || recvAll(fd, name, length, fds));
+}
+
+// A buffer_info_t followed by its native_handle_t, whose fds are in fds.
+static bool recvBuffer(int fd, std::vector<int>* fds) {
+    struct {
+        uint32_t width;
+        uint32_t height;
+        uint32_t stride;
+        int32_t pixel_format;
+        native_handle_t handle;
+    } header;
+    if (!recvAll(fd, &header, sizeof(header), fds)) {
+        return false;
+    }
+    int count = header.handle.numFds + header.handle.numInts;
+    if (count < 0 || count > 1024) {
+        return false;
+    }
+    std::vector<int> data(count + 1);
+    return count == 0 || recvAll(fd, &data[0], count * sizeof(int), fds);
+}
+
+// Pretends to show a frame.
+static void show(Renderer* renderer) {
+    if (renderer->delayUs > 0) {
+        usleep(renderer->delayUs);
+    }
+}
+
+static bool answerPost(Connection* c) {
+    show(c->renderer);
+    if (!sendStatus(c->fd, true)) {
+        return false;
+    }
+    if (c->version >= SB_PROTOCOL_VERSION_TIMING) {
+        sb_frame_times_t times;
+        times.latch_ns = times.present_ns = MonotonicNs();
+        return sendAll(c->fd, &times, sizeof(times));
+    }
+    return true;
+}
+
+static bool setUpRing(Connection* c, std::vector<int>* fds) {
+    sb_ring_setup_t setup;
+    if (!sendStatus(c->fd, c->renderer->ring)) {
+        return false;
+    }
+    if (!c->renderer->ring) {
+        return true;
+    }
+    if (!recvAll(c->fd, &setup, sizeof(setup), fds) || fds->size() != 3) {
+        return false;
+    }
+    bool supported = setup.version >= SB_RING_VERSION_NO_TIMING &&
+            setup.version <= SB_RING_VERSION && setup.size >= sizeof(sb_ring_t);
+    void* base = supported ? mmap(0, sizeof(sb_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+            (*fds)[0], 0) : MAP_FAILED;
+    if (base == MAP_FAILED) {
+        closeFds(fds);
+        return sendStatus(c->fd, false);
+    }
+    c->ring = (sb_ring_t*) base;
+    c->ringFd = (*fds)[0];
+    c->postFd = (*fds)[1];
+    c->releaseFd = (*fds)[2];
+    c->shownTail = c->ring->tail;
+    fds->clear();
+    return sendStatus(c->fd, true);
+}
+
+// Shows and releases everything posted to the ring so far, only the newest of mailbox posts.
+static void drainRing(Connection* c) {
+    sb_ring_t* ring = c->ring;
+    int32_t head = android_atomic_acquire_load(&ring->head);
+    int released = 0;
+    while (c->shownTail != head) {
+        int i = c->shownTail & (SB_RING_SLOTS - 1);
+        if (ring->version >= SB_RING_VERSION && (ring->slots[i].flags & SB_FRAME_FLAG_MAILBOX) &&
+                (uint32_t) head - (uint32_t) c->shownTail > 1) {
+            ring->slots[i].status = SB_RING_STATUS_REPLACED;
+            android_atomic_inc(&c->renderer->ringReplaced);
+        } else {
+            show(c->renderer);
+            ring->slots[i].status = SB_RING_STATUS_OK;
+            if (ring->version >= SB_RING_VERSION_TIMING) {
+                ring->timing[i].latch_ns = ring->timing[i].present_ns = MonotonicNs();
+            }
+        }
+        c->shownTail = (int32_t) ((uint32_t) c->shownTail + 1);
+        android_atomic_release_store(c->shownTail, &ring->tail);
+        android_atomic_inc(&c->renderer->ringPosts);
+        released++;
+    }
+    if (released > 0) {
+        uint64_t one = 1;
+        write(c->releaseFd, &one, sizeof(one));
+    }
+}
+
+// Handles one request, the opcode of which was just read.
+static bool handleRequest(Connection* c, uint8_t op, std::vector<int>* fds) {
+    if (c->version >= SB_PROTOCOL_VERSION_FRAMED && (op == SB_OP_POST_SLOT ||
+            op == SB_OP_FREE_BUFFER || op == SB_OP_LAYER_HINTS || op == SB_OP_FORMATS ||
+            op == SB_OP_DISPLAY_INFO || op == SB_OP_ACQUIRE_FENCE ||
+            (op == SB_OP_CLOSE_LAYER && c->version >= SB_PROTOCOL_VERSION_LAYER_IDS) ||
+            (op == SB_OP_LAYER_POSITION && c->version >= SB_PROTOCOL_VERSION_OVERLAY))) {
+        sb_frame_header_t header;
+        header.opcode = op;
+        if (!recvAll(c->fd, (char*) &header + 1, sizeof(header) - 1, fds)) {
+            return false;
+        }
+        switch (op) {
+        case SB_OP_POST_SLOT: {
+            std::vector<sb_ring_rect_t> rects(header.num_rects + 1);
+            return (header.num_rects == 0 || recvAll(c->fd, &rects[0],
+                    header.num_rects * sizeof(sb_ring_rect_t), fds)) && answerPost(c);
+        }
+        case SB_OP_LAYER_HINTS: {
+            sb_layer_hints_wire_t hints;
+            return recvAll(c->fd, &hints, sizeof(hints), fds) && sendStatus(c->fd, true);
+        }
+        case SB_OP_FORMATS: {
+            static const int32_t FORMATS[] = { HAL_PIXEL_FORMAT_RGBA_8888,
+                    HAL_PIXEL_FORMAT_RGBX_8888, HAL_PIXEL_FORMAT_BGRA_8888,
+                    HAL_PIXEL_FORMAT_RGB_565 };
+            sb_formats_t formats;
+            formats.count = sizeof(FORMATS) / sizeof(FORMATS[0]);
+            return sendStatus(c->fd, true) && sendAll(c->fd, &formats, sizeof(formats)) &&
+                    sendAll(c->fd, FORMATS, sizeof(FORMATS));
+        }
+        case SB_OP_ACQUIRE_FENCE:
+            // Of a ring slot, not answered; the mock reads no buffer to wait for.
+            return true;
+        case SB_OP_CLOSE_LAYER:
+            // Not answered, sharebuffer hangs up right after.
+            return false;
+        case SB_OP_LAYER_POSITION: {
+            // Not answered either.
+            sb_layer_position_t position;
+            return recvAll(c->fd, &position, sizeof(position), fds);
+        }
+        case SB_OP_DISPLAY_INFO: {
+            // so that sharebuffer does not need a framebuffer device either
+            sb_display_info_t display;
+            memset(&display, 0, sizeof(display));
+            display.width = display.stride = 1080;
+            display.height = 1920;
+            display.format = HAL_PIXEL_FORMAT_RGBX_8888;
+            display.xdpi_milli = display.ydpi_milli = 440000;
+            display.refresh_mhz = 60000;
+            return sendStatus(c->fd, true) && sendAll(c->fd, &display, sizeof(display));
+        }
+        default:
+            return sendStatus(c->fd, true);
+        }
+    }
+
+    switch (op) {
+    case SB_OP_LAYER_NAME:
+        return skipName(c->fd, fds);
+    case SB_OP_CLOSE_LAYER:
+        // Not answered, sharebuffer hangs up right after.
+        skipName(c->fd, fds);
+        return false;
+    case SB_OP_HELLO: {
+        sb_hello_t hello;
+        if (c->renderer->maxVersion < SB_PROTOCOL_VERSION_FRAMED) {
+            return sendStatus(c->fd, false);
+        }
+        if (!sendStatus(c->fd, true) || !recvAll(c->fd, &hello, sizeof(hello), fds) ||
+                hello.magic != SB_HELLO_MAGIC) {
+            return false;
+        }
+        c->version = std::min(hello.version, c->renderer->maxVersion);
+        hello.version = c->version;
+        hello.layer_id = android_atomic_inc(&c->renderer->nextLayerId) + 1;
+        return sendAll(c->fd, &hello, sizeof(hello));
+    }
+    case SB_OP_RESUME:
+        // Every connection starts over, as with a renderer that restarted.
+        return sendStatus(c->fd, false);
+    case SB_OP_NEW_BUFFERS: {
+        if (!c->batchProbed) {
+            c->batchProbed = true;
+            return sendStatus(c->fd, true);
+        }
+        sb_batch_header_t header;
+        if (!recvAll(c->fd, &header, sizeof(header), fds) || header.count > SB_BATCH_MAX_BUFFERS) {
+            return false;
+        }
+        for (uint32_t i = 0; i < header.count; i++) {
+            if (!recvBuffer(c->fd, fds)) {
+                return false;
+            }
+        }
+        return sendStatus(c->fd, true);
+    }
+    case SB_OP_RING:
+        return setUpRing(c, fds);
+    case SB_OP_NEW_BUFFER:
+        // Registering shows the buffer too, answered with the status alone.
+        if (!recvBuffer(c->fd, fds)) {
+            return false;
+        }
+        show(c->renderer);
+        return sendStatus(c->fd, true);
+    case SB_OP_POST_SLOT:
+    case SB_OP_FREE_BUFFER: {
+        int32_t slot;
+        if (!recvAll(c->fd, &slot, sizeof(slot), fds)) {
+            return false;
+        }
+        return op == SB_OP_POST_SLOT ? answerPost(c) : sendStatus(c->fd, true);
+    }
+    default:
+        if (op >= SB_MAX_BYTE_SLOT) {
+            printf("  renderer: unknown opcode %#x\n", op);
+            return false;
+        }
+        // A version 1 post of a slot below SB_MAX_BYTE_SLOT.
+        return answerPost(c);
+    }
+}
+
+static void* connectionTask(void* ptr) {
+    Connection* c = (Connection*) ptr;
+    std::vector<int> fds;
+    bool ok = true;
+    while (ok && !android_atomic_acquire_load(&c->renderer->stopping)) {
+        struct pollfd pfd[2];
+        pfd[0].fd = c->fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = c->postFd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        if (c->ring) {
+            android_atomic_release_store(1, &c->ring->renderer_waiting);
+            android_memory_barrier();
+            drainRing(c);
+        }
+        int n = poll(pfd, c->ring ? 2 : 1, 100);
+        if (c->ring) {
+            android_atomic_release_store(0, &c->ring->renderer_waiting);
+            if (n > 0 && (pfd[1].revents & POLLIN)) {
+                uint64_t count;
+                read(c->postFd, &count, sizeof(count));
+                android_atomic_inc(&c->renderer->ringWakeups);
+            }
+            // Posts in the ring come before anything sent on the socket after them.
+            drainRing(c);
+        }
+        if (n <= 0 || !(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        uint8_t op;
+        ok = recvAll(c->fd, &op, 1, &fds) && handleRequest(c, op, &fds);
+        android_atomic_inc(&c->renderer->requests);
+        // Nothing is imported, the mock only reads the messages.
+        closeFds(&fds);
+    }
+    if (c->ring) {
+        munmap(c->ring, sizeof(sb_ring_t));
+        close(c->ringFd);
+        close(c->postFd);
+        close(c->releaseFd);
+    }
+    close(c->fd);
+    delete c;
+    return NULL;
+}
+
+static void* acceptTask(void* ptr) {
+    Renderer* renderer = (Renderer*) ptr;
+    while (!android_atomic_acquire_load(&renderer->stopping)) {
+        int fd = accept(renderer->listenFd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        Connection* c = new Connection();
+        memset(c, 0, sizeof(*c));
+        c->renderer = renderer;
+        c->fd = fd;
+        c->version = SB_PROTOCOL_VERSION_LEGACY;
+        c->ringFd = c->postFd = c->releaseFd = -1;
+        pthread_t thread;
+        pthread_create(&thread, NULL, connectionTask, c);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+static bool startRenderer(Renderer* renderer) {
+    mkdir("/tmp", 0777);
+    mkdir("/tmp/sfdroid", 0777);
+    unlink(RENDERER_SOCKET);
+    renderer->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, RENDERER_SOCKET, sizeof(addr.sun_path) - 1);
+    if (renderer->listenFd < 0 || bind(renderer->listenFd, (struct sockaddr*) &addr,
+            sizeof(addr)) < 0 || listen(renderer->listenFd, 16) < 0) {
+        printf("cannot listen on %s: %s\n", RENDERER_SOCKET, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Producers: one layer each, posting its buffers in turn.
+ */
+struct Producer {
+    sharebuffer_device_t* dev;
+    int index;
+    int numBuffers;
+    int framesPerLayer;
+    bool async;
+    bool mailbox;
+    volatile int32_t* stop;
+
+    long long frames;
+    int layers;
+    long contextSwitches;
+    std::vector<int64_t> latencies;
+};
+
+static void closeLayer(sharebuffer_device_t* dev, int layer, const char* name) {
+    if (layer >= 0) {
+        dev->closeLayerId(dev, layer);
+    } else {
+        dev->close_layer(dev, name);
+    }
+}
+
+static void* producerTask(void* ptr) {
+    Producer* p = (Producer*) ptr;
+    sharebuffer_device_t* dev = p->dev;
+    const uint32_t width = dev->width;
+    const uint32_t height = dev->height;
+
+    // Fake buffers, the mock renderer never maps them.
+    std::vector<buffer_handle_t> buffers(p->numBuffers);
+    std::vector<sb_buffer_info_t> infos(p->numBuffers);
+    std::vector<int> fences(p->numBuffers, -1);
+    for (int i = 0; i < p->numBuffers; i++) {
+        native_handle_t* handle = native_handle_create(1, 2);
+        handle->data[0] = ashmem_create_region("sharebufferbenchmark", 4096);
+        handle->data[1] = p->index;
+        handle->data[2] = i;
+        buffers[i] = handle;
+        infos[i].width = width;
+        infos[i].height = height;
+        infos[i].stride = dev->stride;
+        infos[i].pixel_format = dev->format;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    long startSwitches = usage.ru_nvcsw + usage.ru_nivcsw;
+
+    char name[64];
+    int layer = -1;
+    int framesInLayer = 0;
+    p->layers = 0;
+    p->frames = 0;
+    while (!android_atomic_acquire_load(p->stop)) {
+        if (framesInLayer == 0) {
+            snprintf(name, sizeof(name), "benchmark-%d-%d", p->index, p->layers++);
+            layer = (dev->common.version >= SHAREBUFFER_DEVICE_API_VERSION_1_6 &&
+                    dev->registerLayer) ? dev->registerLayer(dev, name) : -1;
+            if (layer < 0 || dev->selectLayer(dev, layer) != 0) {
+                layer = -1;
+                dev->set_layer_name(dev, name);
+            }
+            if (p->mailbox && dev->common.version >= SHAREBUFFER_DEVICE_API_VERSION_1_4 &&
+                    dev->setMailbox) {
+                dev->setMailbox(dev, 1);
+            }
+            if (dev->registerBuffers) {
+                dev->registerBuffers(dev, &buffers[0], &infos[0], p->numBuffers);
+            }
+        }
+
+        if (layer >= 0) {
+            // As a compositor would before every post, free for the current layer.
+            dev->selectLayer(dev, layer);
+        }
+
+        int i = p->frames % p->numBuffers;
+        if (fences[i] >= 0) {
+            // The producer would render into the buffer now.
+            sync_wait(fences[i], 1000);
+            close(fences[i]);
+            fences[i] = -1;
+        }
+        int64_t start = MonotonicNs();
+        if (p->async && dev->postAsync) {
+            dev->postAsync(dev, buffers[i], width, height, dev->stride, dev->format, &fences[i]);
+        } else {
+            dev->post(dev, buffers[i], width, height, dev->stride, dev->format);
+        }
+        p->latencies.push_back(MonotonicNs() - start);
+        p->frames++;
+
+        if (p->framesPerLayer > 0 && ++framesInLayer == p->framesPerLayer) {
+            closeLayer(dev, layer, name);
+            framesInLayer = 0;
+        }
+    }
+
+    getrusage(RUSAGE_THREAD, &usage);
+    p->contextSwitches = usage.ru_nvcsw + usage.ru_nivcsw - startSwitches;
+
+    if (framesInLayer > 0) {
+        closeLayer(dev, layer, name);
+    }
+    for (int i = 0; i < p->numBuffers; i++) {
+        if (fences[i] >= 0) {
+            close(fences[i]);
+        }
+        if (dev->freeBuffer) {
+            dev->freeBuffer(dev, buffers[i]);
+        }
+        native_handle_close(buffers[i]);
+        native_handle_delete((native_handle_t*) buffers[i]);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int producers = argc > 1 ? atoi(argv[1]) : 2;
+    int numBuffers = argc > 2 ? atoi(argv[2]) : 3;
+    int framesPerLayer = argc > 3 ? atoi(argv[3]) : 0;
+    int delayUs = argc > 4 ? atoi(argv[4]) : 0;
+    int seconds = argc > 5 ? atoi(argv[5]) : 5;
+    bool ring = argc > 6 ? atoi(argv[6]) != 0 : true;
+    bool async = argc > 7 ? atoi(argv[7]) != 0 : true;
+    int version = argc > 8 ? atoi(argv[8]) : SB_PROTOCOL_VERSION;
+    bool mailbox = argc > 9 ? atoi(argv[9]) != 0 : false;
+    if (producers <= 0 || numBuffers <= 0 || framesPerLayer < 0 || delayUs < 0 ||
+            seconds <= 0 || version < SB_PROTOCOL_VERSION_LEGACY ||
+            version > SB_PROTOCOL_VERSION) {
+        printf("usage: %s [producers] [buffers per layer] [frames per layer, 0 for no churn] "
+                "[renderer delay us] [seconds] [ring 0|1] [postAsync 0|1] "
+                "[protocol version 1-%d] [mailbox 0|1]\n", argv[0], SB_PROTOCOL_VERSION);
+        return EXIT_FAILURE;
+    }
+
+    Renderer* renderer = new Renderer();
+    memset(renderer, 0, sizeof(*renderer));
+    renderer->delayUs = delayUs;
+    renderer->ring = ring;
+    renderer->maxVersion = version;
+    if (!startRenderer(renderer)) {
+        return EXIT_FAILURE;
+    }
+    pthread_t acceptor;
+    pthread_create(&acceptor, NULL, acceptTask, renderer);
+
+    hw_module_t const* module;
+    sharebuffer_device_t* dev;
+    if (hw_get_module(SHAREBUFFER_HARDWARE_MODULE_ID, &module) != 0 ||
+            sharebuffer_open(module, &dev) != 0) {
+        printf("cannot open the sharebuffer module\n");
+        return EXIT_FAILURE;
+    }
+    // Measure the transport, not vsync pacing.
+    dev->setSwapInterval(dev, 0);
+
+    printf("%d producers, %d buffers per layer, %s, renderer delay %d us, ring %s, %s%s, "
+            "protocol version %d\n", producers, numBuffers,
+            framesPerLayer ? "churning layers" : "no layer churn", delayUs, ring ? "on" : "off",
+            async ? "postAsync" : "post", mailbox ? " in mailbox mode" : "", version);
+    if (framesPerLayer) {
+        printf("  a new layer every %d frames\n", framesPerLayer);
+    }
+
+    volatile int32_t stop = 0;
+    std::vector<Producer> tasks(producers);
+    std::vector<pthread_t> threads(producers);
+    int64_t start = MonotonicNs();
+    for (int i = 0; i < producers; i++) {
+        tasks[i].dev = dev;
+        tasks[i].index = i;
+        tasks[i].numBuffers = numBuffers;
+        tasks[i].framesPerLayer = framesPerLayer;
+        tasks[i].async = async;
+        tasks[i].mailbox = mailbox;
+        tasks[i].stop = &stop;
+        pthread_create(&threads[i], NULL, producerTask, &tasks[i]);
+    }
+    struct timespec duration = { seconds, 0 };
+    nanosleep(&duration, NULL);
+    android_atomic_release_store(1, &stop);
+    for (int i = 0; i < producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    int64_t elapsed = MonotonicNs() - start;
+
+    long long frames = 0;
+    long contextSwitches = 0;
+    int layers = 0;
+    std::vector<int64_t> latencies;
+    for (int i = 0; i < producers; i++) {
+        frames += tasks[i].frames;
+        contextSwitches += tasks[i].contextSwitches;
+        layers += tasks[i].layers;
+        latencies.insert(latencies.end(), tasks[i].latencies.begin(), tasks[i].latencies.end());
+    }
+    double perFrame = frames > 0 ? 1.0 / frames : 0;
+    printf("  %.0f frames/s, %d layers opened\n", frames * 1e9 / elapsed, layers);
+    benchmark::PrintLatencies("post", "frames posted", &latencies);
+    printf("  per frame: %.2f renderer requests, %.2f ring posts, %.2f replaced, "
+            "%.2f ring wakeups, %.2f producer context switches\n", renderer->requests * perFrame,
+            renderer->ringPosts * perFrame, renderer->ringReplaced * perFrame,
+            renderer->ringWakeups * perFrame, contextSwitches * perFrame);
+    printf("  ~%.2f producer socket and eventfd syscalls per frame\n",
+            (2.0 * renderer->requests + renderer->ringWakeups) * perFrame);
+
+    sharebuffer_close(dev);
+    android_atomic_release_store(1, &renderer->stopping);
+    shutdown(renderer->listenFd, SHUT_RDWR);
+    close(renderer->listenFd);
+    unlink(RENDERER_SOCKET);
+    return EXIT_SUCCESS;
+}
@@ -14,13 +14,15 @@
 
 LOCAL_PATH := $(call my-dir)
 
-# Stub sound_trigger HAL module, used for tests
+# sound_trigger HAL module listening through the Sailfish sound server
 include $(CLEAR_VARS)
 
 LOCAL_MODULE := sound_trigger.stub.default
 LOCAL_MODULE_RELATIVE_PATH := hw
 LOCAL_SRC_FILES := sound_trigger_hw.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../sfdroid_ipc $(LOCAL_PATH)/../sfdroid_audio
 LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_STATIC_LIBRARIES := libsfdroid_ipc
 LOCAL_MODULE_TAGS := optional
 LOCAL_32_BIT_ONLY := true
 
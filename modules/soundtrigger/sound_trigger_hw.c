@@ -18,17 +18,66 @@
 /*#define LOG_NDEBUG 0*/
 
 #include <errno.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <cutils/atomic.h>
 #include <cutils/log.h>
 
 #include <hardware/hardware.h>
 #include <system/sound_trigger.h>
+#include <system/thread_defs.h>
 #include <hardware/sound_trigger.h>
 
+#include "sfdroid_audio_protocol.h"
+#include "sfdroid_ipc.h"
+
+/*
+ * Recognition listens through a capture stream of the Sailfish sound
+ * server of its own, at a low rate and on a background priority thread,
+ * instead of a full AudioRecord pipeline. The last PREROLL_MS of audio are
+ * kept in a ring and handed over with the recognition event, so the
+ * keyword itself is not lost to the time it takes to open a capture.
+ *
+ * The detector is deliberately cheap: it tracks the noise floor of 20 ms
+ * frames and triggers on an utterance of keyword length, between
+ * KEYWORD_MIN_MS and KEYWORD_MAX_MS of speech followed by KEYWORD_END_MS
+ * of silence, whose loudness above the floor gives the confidence. The
+ * sound model data is opaque to it.
+ */
+#define SAMPLE_RATE         16000
+#define FRAME_MS            20
+#define FRAME_SAMPLES       (SAMPLE_RATE * FRAME_MS / 1000)
+#define PREROLL_MS          2000
+#define PREROLL_SAMPLES     (SAMPLE_RATE * PREROLL_MS / 1000)
+
+/* frames of speech and of the silence ending an utterance */
+#define KEYWORD_MIN_MS      300
+#define KEYWORD_MAX_MS      1500
+#define KEYWORD_END_MS      200
+/* a frame is speech 10 dB above the noise floor, 100% is 30 dB */
+#define SPEECH_RATIO        10
+#define FULL_CONFIDENCE_RATIO   1000
+
+/* the ring the server captures into, a power of two */
+#define RING_FRAMES         4096
+#define PERIOD_FRAMES       FRAME_SAMPLES
+#define OPEN_TIMEOUT_MS     1000
+#define RECONNECT_MIN_MS    500
+#define RECONNECT_MAX_MS    10000
+
 static const struct sound_trigger_properties hw_properties = {
         "The Android Open Source Project", // implementor
-        "Sound Trigger stub HAL", // description
+        "Sound Trigger sfdroid HAL", // description
         1, // version
         { 0xed7a7d60, 0xc65e, 0x11e3, 0x9be4, { 0x00, 0x02, 0xa5, 0xd5, 0xc5, 0x1b } }, // uuid
         1, // max_sound_models
@@ -36,12 +85,31 @@ static const struct sound_trigger_properties hw_properties = {
         1, // max_users
         RECOGNITION_MODE_VOICE_TRIGGER, // recognition_modes
         false, // capture_transition
-        0, // max_buffer_ms
-        false, // concurrent_capture
-        false, // trigger_in_event
+        PREROLL_MS, // max_buffer_ms
+        true, // concurrent_capture
+        true, // trigger_in_event
         0 // power_consumption_mw
 };
 
+/* the capture connection, callback thread only */
+struct capture {
+    int fd;
+    sfdroid_audio_ring_t *ring;
+    size_t ring_size;
+    int ring_fd;
+    int to_server_fd;
+    int to_hal_fd;
+    sfdroid_ipc_backoff_t backoff;
+};
+
+struct detector {
+    /* mean power of a frame of silence */
+    int64_t floor;
+    int speech_frames;
+    int silence_frames;
+    int64_t peak;
+};
+
 struct stub_sound_trigger_device {
     struct sound_trigger_hw_device device;
     sound_model_handle_t model_handle;
@@ -51,56 +119,329 @@ struct stub_sound_trigger_device {
     void *sound_model_cookie;
     pthread_t callback_thread;
     pthread_mutex_t lock;
-    pthread_cond_t  cond;
+
+    /* of the recognition being started */
+    unsigned int confidence_level;
+    bool capture_requested;
+    /* wakes the callback thread up to stop */
+    int wake_fd;
+    /* until joined, the thread may have ended itself with an event */
+    bool thread_started;
+
+    /* callback thread only */
+    struct capture capture;
+    struct detector detector;
+    int16_t *preroll;
+    uint32_t preroll_pos;
+    uint32_t preroll_filled;
 };
 
+static void capture_disconnect(struct capture *c)
+{
+    if (c->ring != NULL)
+        munmap(c->ring, c->ring_size);
+    if (c->fd >= 0)
+        close(c->fd);
+    if (c->ring_fd >= 0)
+        close(c->ring_fd);
+    if (c->to_server_fd >= 0)
+        close(c->to_server_fd);
+    if (c->to_hal_fd >= 0)
+        close(c->to_hal_fd);
+    c->ring = NULL;
+    c->fd = c->ring_fd = c->to_server_fd = c->to_hal_fd = -1;
+}
+
+/* a mono 16 bit capture stream at SAMPLE_RATE, started; 0 on success */
+static int capture_connect(struct capture *c)
+{
+    sfdroid_audio_open_t open_msg;
+    sfdroid_audio_reply_t reply;
+    struct iovec iov;
+    uint8_t op = SFDROID_AUDIO_OP_START;
+    int fds[3];
+
+    c->fd = sfdroid_ipc_connect(SFDROID_AUDIO_SOCKET_NAME, OPEN_TIMEOUT_MS);
+    if (c->fd < 0)
+        goto exit_error;
+
+    c->ring_size = sizeof(sfdroid_audio_ring_t) + RING_FRAMES * sizeof(int16_t);
+    c->ring = sfdroid_ipc_shm_create("sfdroid-soundtrigger", c->ring_size, &c->ring_fd);
+    c->to_server_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    c->to_hal_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (c->ring == NULL || c->to_server_fd < 0 || c->to_hal_fd < 0) {
+        ALOGE("failed to create capture ring: %s", strerror(errno));
+        goto exit_error;
+    }
+    c->ring->magic = SFDROID_AUDIO_MAGIC;
+    c->ring->version = SFDROID_AUDIO_VERSION;
+    c->ring->frame_size = sizeof(int16_t);
+    c->ring->ring_frames = RING_FRAMES;
+
+    memset(&open_msg, 0, sizeof(open_msg));
+    open_msg.magic = SFDROID_AUDIO_MAGIC;
+    open_msg.version = SFDROID_AUDIO_VERSION;
+    open_msg.direction = SFDROID_AUDIO_CAPTURE;
+    open_msg.sample_rate = SAMPLE_RATE;
+    open_msg.channels = 1;
+    open_msg.format = SFDROID_AUDIO_FORMAT_S16LE;
+    open_msg.period_frames = PERIOD_FRAMES;
+    open_msg.ring_frames = RING_FRAMES;
+
+    iov.iov_base = &open_msg;
+    iov.iov_len = sizeof(open_msg);
+    fds[0] = c->ring_fd;
+    fds[1] = c->to_server_fd;
+    fds[2] = c->to_hal_fd;
+    if (sfdroid_ipc_send(c->fd, &iov, 1, fds, 3) < 0 ||
+            recv(c->fd, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply)) {
+        ALOGE("failed to open capture stream: %s", strerror(errno));
+        goto exit_error;
+    }
+    if (reply.magic != SFDROID_AUDIO_MAGIC || reply.status != 0) {
+        ALOGE("sound server refused the capture stream: %d", reply.status);
+        goto exit_error;
+    }
+    if (send(c->fd, &op, 1, MSG_NOSIGNAL) != 1)
+        goto exit_error;
+
+    sfdroid_ipc_backoff_reset(&c->backoff);
+    ALOGI("%s listening", __func__);
+    return 0;
+
+exit_error:
+    capture_disconnect(c);
+    return -1;
+}
+
+/* samples captured and not read yet */
+static uint32_t capture_available(const struct capture *c)
+{
+    return (uint32_t)android_atomic_acquire_load(&c->ring->write_pos) -
+            (uint32_t)android_atomic_acquire_load(&c->ring->read_pos);
+}
+
+/*
+ * Read a frame, blocking until it is captured or wake_fd is signalled.
+ * Returns 1 with a frame, 0 to check whether to stop, -1 if the server
+ * went away.
+ */
+static int capture_read(struct capture *c, int wake_fd, int16_t *frame)
+{
+    struct pollfd pfd[3];
+    uint64_t count;
+
+    if (capture_available(c) < FRAME_SAMPLES) {
+        android_atomic_release_store(1, &c->ring->hal_waiting);
+        android_memory_barrier();
+        if (capture_available(c) < FRAME_SAMPLES) {
+            pfd[0].fd = c->to_hal_fd;
+            pfd[1].fd = wake_fd;
+            pfd[2].fd = c->fd;
+            pfd[0].events = pfd[1].events = pfd[2].events = POLLIN;
+            pfd[0].revents = pfd[1].revents = pfd[2].revents = 0;
+            poll(pfd, 3, -1);
+            if (pfd[0].revents & POLLIN)
+                read(c->to_hal_fd, &count, sizeof(count));
+            if (pfd[2].revents) {
+                android_atomic_release_store(0, &c->ring->hal_waiting);
+                return -1;
+            }
+        }
+        android_atomic_release_store(0, &c->ring->hal_waiting);
+        if (capture_available(c) < FRAME_SAMPLES)
+            return 0;
+    }
+
+    uint32_t offset = (uint32_t)c->ring->read_pos & (RING_FRAMES - 1);
+    uint32_t first = FRAME_SAMPLES < RING_FRAMES - offset ? FRAME_SAMPLES : RING_FRAMES - offset;
+    const int16_t *data = (const int16_t *)c->ring->data;
+    memcpy(frame, data + offset, first * sizeof(int16_t));
+    memcpy(frame + first, data, (FRAME_SAMPLES - first) * sizeof(int16_t));
+    android_atomic_release_store((int32_t)((uint32_t)c->ring->read_pos + FRAME_SAMPLES),
+            &c->ring->read_pos);
+
+    android_memory_barrier();
+    if (c->ring->server_waiting) {
+        uint64_t one = 1;
+        write(c->to_server_fd, &one, sizeof(one));
+    }
+    return 1;
+}
+
+static void preroll_add(struct stub_sound_trigger_device *stdev, const int16_t *frame)
+{
+    /* PREROLL_SAMPLES is a multiple of FRAME_SAMPLES, frames never wrap */
+    memcpy(stdev->preroll + stdev->preroll_pos, frame, FRAME_SAMPLES * sizeof(int16_t));
+    stdev->preroll_pos = (stdev->preroll_pos + FRAME_SAMPLES) % PREROLL_SAMPLES;
+    if (stdev->preroll_filled < PREROLL_SAMPLES)
+        stdev->preroll_filled += FRAME_SAMPLES;
+}
+
+/* the pre-roll, oldest sample first, into out */
+static void preroll_copy(const struct stub_sound_trigger_device *stdev, int16_t *out)
+{
+    uint32_t start = (stdev->preroll_pos + PREROLL_SAMPLES - stdev->preroll_filled) %
+            PREROLL_SAMPLES;
+    uint32_t first = PREROLL_SAMPLES - start < stdev->preroll_filled ?
+            PREROLL_SAMPLES - start : stdev->preroll_filled;
+
+    memcpy(out, stdev->preroll + start, first * sizeof(int16_t));
+    memcpy(out + first, stdev->preroll, (stdev->preroll_filled - first) * sizeof(int16_t));
+}
+
+/*
+ * Feed a frame to the detector. Returns the confidence, 0 to 100, once
+ * it ends an utterance of keyword length, -1 otherwise.
+ */
+static int detector_feed(struct detector *d, const int16_t *frame)
+{
+    int64_t power = 0;
+    int confidence = -1;
+    int i;
+
+    for (i = 0; i < FRAME_SAMPLES; i++)
+        power += (int32_t)frame[i] * frame[i];
+    power /= FRAME_SAMPLES;
+    if (power < 1)
+        power = 1;
+
+    if (d->floor == 0)
+        d->floor = power;
+
+    if (power > d->floor * SPEECH_RATIO) {
+        d->speech_frames++;
+        d->silence_frames = 0;
+        if (power > d->peak)
+            d->peak = power;
+        /* too long for a keyword: the noise got louder, follow it */
+        if (d->speech_frames * FRAME_MS > KEYWORD_MAX_MS)
+            d->floor += (power - d->floor) / 16;
+        return -1;
+    }
+
+    if (d->speech_frames > 0 && ++d->silence_frames * FRAME_MS >= KEYWORD_END_MS) {
+        int speech_ms = d->speech_frames * FRAME_MS;
+        if (speech_ms >= KEYWORD_MIN_MS && speech_ms <= KEYWORD_MAX_MS) {
+            int64_t ratio = d->peak / d->floor;
+            confidence = ratio >= FULL_CONFIDENCE_RATIO ? 100 :
+                    (int)(ratio * 100 / FULL_CONFIDENCE_RATIO);
+        }
+        d->speech_frames = d->silence_frames = 0;
+        d->peak = 0;
+    }
+    /* the floor follows quiet frames quickly and noise slowly */
+    if (power < d->floor)
+        d->floor = (d->floor + power) / 2;
+    else if (d->speech_frames == 0)
+        d->floor += (power - d->floor) / 64;
+
+    return confidence;
+}
+
+/* with stdev->lock held */
+static void send_recognition(struct stub_sound_trigger_device *stdev, int confidence)
+{
+    size_t data_size = stdev->preroll_filled * sizeof(int16_t);
+    char *data = (char *)calloc(1, sizeof(struct sound_trigger_phrase_recognition_event) +
+            data_size);
+    if (data == NULL)
+        return;
+
+    struct sound_trigger_phrase_recognition_event *event =
+            (struct sound_trigger_phrase_recognition_event *)data;
+    event->common.status = RECOGNITION_STATUS_SUCCESS;
+    event->common.type = SOUND_MODEL_TYPE_KEYPHRASE;
+    event->common.model = stdev->model_handle;
+    /* the framework goes on capturing where the pre-roll ends */
+    event->common.capture_available = stdev->capture_requested;
+    event->common.capture_delay_ms = 0;
+    event->common.capture_preamble_ms = stdev->preroll_filled * 1000 / SAMPLE_RATE;
+    event->common.trigger_in_data = true;
+    event->common.audio_config.sample_rate = SAMPLE_RATE;
+    event->common.audio_config.channel_mask = AUDIO_CHANNEL_IN_MONO;
+    event->common.audio_config.format = AUDIO_FORMAT_PCM_16_BIT;
+    event->num_phrases = 1;
+    event->phrase_extras[0].recognition_modes = RECOGNITION_MODE_VOICE_TRIGGER;
+    event->phrase_extras[0].confidence_level = confidence;
+    event->phrase_extras[0].num_levels = 1;
+    event->phrase_extras[0].levels[0].level = confidence;
+    event->phrase_extras[0].levels[0].user_id = 0;
+    event->common.data_offset = sizeof(struct sound_trigger_phrase_recognition_event);
+    event->common.data_size = data_size;
+    preroll_copy(stdev, (int16_t *)(data + event->common.data_offset));
+    ALOGI("%s send callback model %d, confidence %d", __func__, stdev->model_handle,
+            confidence);
+    stdev->recognition_callback(&event->common, stdev->recognition_cookie);
+    free(data);
+}
 
 static void *callback_thread_loop(void *context)
 {
     struct stub_sound_trigger_device *stdev = (struct stub_sound_trigger_device *)context;
+    int16_t frame[FRAME_SAMPLES];
+    uint64_t count;
     ALOGI("%s", __func__);
 
     prctl(PR_SET_NAME, (unsigned long)"sound trigger callback", 0, 0, 0);
+    /* listening must never get in the way of what the user is doing */
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_BACKGROUND);
+
+    memset(&stdev->detector, 0, sizeof(stdev->detector));
+    stdev->preroll_pos = stdev->preroll_filled = 0;
 
     pthread_mutex_lock(&stdev->lock);
-    if (stdev->recognition_callback == NULL) {
-        goto exit;
+    while (stdev->recognition_callback != NULL) {
+        pthread_mutex_unlock(&stdev->lock);
+
+        int ret = 0;
+        if (stdev->capture.fd < 0 && capture_connect(&stdev->capture) < 0) {
+            struct pollfd pfd = { stdev->wake_fd, POLLIN, 0 };
+            poll(&pfd, 1, sfdroid_ipc_backoff_next(&stdev->capture.backoff));
+        } else {
+            ret = capture_read(&stdev->capture, stdev->wake_fd, frame);
+            if (ret < 0) {
+                ALOGW("%s lost the sound server", __func__);
+                capture_disconnect(&stdev->capture);
+            }
+        }
+        read(stdev->wake_fd, &count, sizeof(count));
+
+        pthread_mutex_lock(&stdev->lock);
+        if (ret > 0 && stdev->recognition_callback != NULL) {
+            preroll_add(stdev, frame);
+            int confidence = detector_feed(&stdev->detector, frame);
+            if (confidence >= 0 && (unsigned int)confidence >= stdev->confidence_level) {
+                send_recognition(stdev, confidence);
+                /* a recognition ends with its event */
+                stdev->recognition_callback = NULL;
+            }
+        }
     }
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    ts.tv_sec += 3;
-    ALOGI("%s wait 3 sec", __func__);
-    int rc = pthread_cond_timedwait(&stdev->cond, &stdev->lock, &ts);
-    if (rc == ETIMEDOUT && stdev->recognition_callback != NULL) {
-        char *data = (char *)calloc(1, sizeof(struct sound_trigger_phrase_recognition_event) + 1);
-        struct sound_trigger_phrase_recognition_event *event =
-                (struct sound_trigger_phrase_recognition_event *)data;
-        event->common.status = RECOGNITION_STATUS_SUCCESS;
-        event->common.type = SOUND_MODEL_TYPE_KEYPHRASE;
-        event->common.model = stdev->model_handle;
-        event->num_phrases = 1;
-        event->phrase_extras[0].recognition_modes = RECOGNITION_MODE_VOICE_TRIGGER;
-        event->phrase_extras[0].confidence_level = 100;
-        event->phrase_extras[0].num_levels = 1;
-        event->phrase_extras[0].levels[0].level = 100;
-        event->phrase_extras[0].levels[0].user_id = 0;
-        event->common.data_offset = sizeof(struct sound_trigger_phrase_recognition_event);
-        event->common.data_size = 1;
-        data[event->common.data_offset] = 8;
-        ALOGI("%s send callback model %d", __func__, stdev->model_handle);
-        stdev->recognition_callback(&event->common, stdev->recognition_cookie);
-        free(data);
-    } else {
+    if (stdev->capture.fd >= 0)
         ALOGI("%s abort recognition model %d", __func__, stdev->model_handle);
-    }
-    stdev->recognition_callback = NULL;
-
-exit:
     pthread_mutex_unlock(&stdev->lock);
 
+    capture_disconnect(&stdev->capture);
+
     return NULL;
 }
 
+/* with stdev->lock held, unlocks it while the callback thread exits */
+static void stop_callback_thread(struct stub_sound_trigger_device *stdev)
+{
+    uint64_t one = 1;
+
+    if (!stdev->thread_started)
+        return;
+    stdev->recognition_callback = NULL;
+    write(stdev->wake_fd, &one, sizeof(one));
+    pthread_mutex_unlock(&stdev->lock);
+    pthread_join(stdev->callback_thread, (void **) NULL);
+    pthread_mutex_lock(&stdev->lock);
+    stdev->thread_started = false;
+}
+
 static int stdev_get_properties(const struct sound_trigger_hw_device *dev,
                                 struct sound_trigger_properties *properties)
 {
@@ -169,13 +510,7 @@ static int stdev_unload_sound_model(const struct sound_trigger_hw_device *dev,
         goto exit;
     }
     stdev->model_handle = 0;
-    if (stdev->recognition_callback != NULL) {
-        stdev->recognition_callback = NULL;
-        pthread_cond_signal(&stdev->cond);
-        pthread_mutex_unlock(&stdev->lock);
-        pthread_join(stdev->callback_thread, (void **) NULL);
-        pthread_mutex_lock(&stdev->lock);
-    }
+    stop_callback_thread(stdev);
 
 exit:
     pthread_mutex_unlock(&stdev->lock);
@@ -206,10 +541,21 @@ static int stdev_start_recognition(const struct sound_trigger_hw_device *dev,
               config->data_size, data[0], data[config->data_size - 1]);
     }
 
+    /* the thread of a recognition that ended with its event */
+    stop_callback_thread(stdev);
+
     stdev->recognition_callback = callback;
     stdev->recognition_cookie = cookie;
-    pthread_create(&stdev->callback_thread, (const pthread_attr_t *) NULL,
-                        callback_thread_loop, stdev);
+    stdev->confidence_level = config->num_phrases > 0 ?
+            config->phrases[0].confidence_level : 0;
+    stdev->capture_requested = config->capture_requested;
+    if (pthread_create(&stdev->callback_thread, (const pthread_attr_t *) NULL,
+                        callback_thread_loop, stdev) != 0) {
+        stdev->recognition_callback = NULL;
+        status = -ENOMEM;
+        goto exit;
+    }
+    stdev->thread_started = true;
 exit:
     pthread_mutex_unlock(&stdev->lock);
     return status;
@@ -230,11 +576,7 @@ static int stdev_stop_recognition(const struct sound_trigger_hw_device *dev,
         status = -ENOSYS;
         goto exit;
     }
-    stdev->recognition_callback = NULL;
-    pthread_cond_signal(&stdev->cond);
-    pthread_mutex_unlock(&stdev->lock);
-    pthread_join(stdev->callback_thread, (void **) NULL);
-    pthread_mutex_lock(&stdev->lock);
+    stop_callback_thread(stdev);
 
 exit:
     pthread_mutex_unlock(&stdev->lock);
@@ -244,6 +586,13 @@ exit:
 
 static int stdev_close(hw_device_t *device)
 {
+    struct stub_sound_trigger_device *stdev = (struct stub_sound_trigger_device *)device;
+
+    pthread_mutex_lock(&stdev->lock);
+    stop_callback_thread(stdev);
+    pthread_mutex_unlock(&stdev->lock);
+    close(stdev->wake_fd);
+    free(stdev->preroll);
     free(device);
     return 0;
 }
@@ -260,6 +609,18 @@ static int stdev_open(const hw_module_t* module, const char* name,
     stdev = calloc(1, sizeof(struct stub_sound_trigger_device));
     if (!stdev)
         return -ENOMEM;
+    stdev->preroll = malloc(PREROLL_SAMPLES * sizeof(int16_t));
+    stdev->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stdev->preroll == NULL || stdev->wake_fd < 0) {
+        if (stdev->wake_fd >= 0)
+            close(stdev->wake_fd);
+        free(stdev->preroll);
+        free(stdev);
+        return -ENOMEM;
+    }
+    stdev->capture.fd = stdev->capture.ring_fd = -1;
+    stdev->capture.to_server_fd = stdev->capture.to_hal_fd = -1;
+    sfdroid_ipc_backoff_init(&stdev->capture.backoff, RECONNECT_MIN_MS, RECONNECT_MAX_MS);
 
     stdev->device.common.tag = HARDWARE_DEVICE_TAG;
     stdev->device.common.version = SOUND_TRIGGER_DEVICE_API_VERSION_1_0;
@@ -272,7 +633,6 @@ static int stdev_open(const hw_module_t* module, const char* name,
     stdev->device.stop_recognition = stdev_stop_recognition;
 
     pthread_mutex_init(&stdev->lock, (const pthread_mutexattr_t *) NULL);
-    pthread_cond_init(&stdev->cond, (const pthread_condattr_t *) NULL);
 
     *device = &stdev->device.common;
 
@@ -289,7 +649,7 @@ struct sound_trigger_module HAL_MODULE_INFO_SYM = {
         .module_api_version = SOUND_TRIGGER_MODULE_API_VERSION_1_0,
         .hal_api_version = HARDWARE_HAL_API_VERSION,
         .id = SOUND_TRIGGER_HARDWARE_MODULE_ID,
-        .name = "Default sound trigger HAL",
+        .name = "sfdroid sound trigger HAL",
         .author = "The Android Open Source Project",
         .methods = &hal_module_methods,
     },
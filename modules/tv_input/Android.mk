@@ -17,7 +17,7 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE_RELATIVE_PATH := hw
-LOCAL_SHARED_LIBRARIES := libcutils liblog
+LOCAL_SHARED_LIBRARIES := libcutils libhardware liblog
 LOCAL_SRC_FILES := tv_input.cpp
 LOCAL_MODULE := tv_input.default
 LOCAL_MODULE_TAGS := optional
@@ -14,22 +14,139 @@
  * limitations under the License.
  */
 
+#define LOG_TAG "tv_input"
+
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <linux/videodev2.h>
 
+#include <cutils/ashmem.h>
+#include <cutils/atomic.h>
 #include <cutils/log.h>
 #include <cutils/native_handle.h>
+#include <cutils/properties.h>
+#include <system/graphics.h>
+#include <system/thread_defs.h>
 
+#include <hardware/gralloc.h>
 #include <hardware/tv_input.h>
 
+#include "tv_input_sideband.h"
+
+/*
+ * TV inputs backed by Video4Linux2 capture nodes, such as an HDMI receiver
+ * or a tuner, listed in ro.tv_input.devices as
+ *
+ *   <node>[:<type>[:<port>]],...    e.g. /dev/video1:hdmi:1,/dev/video2:tuner
+ *
+ * with type one of hdmi, tuner, composite, svideo, component, vga, dvi,
+ * dp or other. Every input has a buffer producer stream, filling the
+ * buffers of request_capture(), and a sideband stream whose frames go
+ * straight to a consumer, see tv_input_sideband.h. Only one of them can
+ * be open at a time.
+ *
+ * Frames are captured into the gralloc buffers themselves when the node
+ * delivers NV21 at the stride of the buffers and can import their dma-buf;
+ * otherwise they are captured into driver buffers and copied.
+ */
+
+#define MAX_PORTS           4
+#define NUM_STREAMS         2
+#define STREAM_BUFFER_PRODUCER  0
+#define STREAM_SIDEBAND         1
+// Driver buffers streamed, and requests taken before -EWOULDBLOCK
+#define MAX_DRIVER_BUFFERS  4
+#define MAX_REQUESTS        MAX_DRIVER_BUFFERS
+#define SIDEBAND_BUFFERS    TV_INPUT_SIDEBAND_MAX_BUFFERS
+// Longest wait for a frame before warning about a missing signal
+#define FRAME_TIMEOUT_MS    2000
+// Size streamed when the node doesn't report the size of its signal
+#define DEFAULT_WIDTH       1920
+#define DEFAULT_HEIGHT      1080
+#define OUTPUT_FORMAT       HAL_PIXEL_FORMAT_YCrCb_420_SP
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
 /*****************************************************************************/
 
+typedef struct capture_request {
+    buffer_handle_t buffer;
+    uint32_t seq;
+    // the driver buffer it is queued in by dma-buf, -1 before
+    int slot;
+    bool cancelled;
+} capture_request_t;
+
+struct tv_input_private;
+
+typedef struct tv_stream_private {
+    struct tv_input_private* priv;
+    int device_id;
+    int stream_id;
+    bool open;
+    bool exiting;
+    pthread_t thread;
+    // wakes the capture thread up for new requests or to exit
+    int wake_fd;
+
+    // the node and its format while open
+    int fd;
+    uint32_t width;
+    uint32_t height;
+    uint32_t fourcc;
+    uint32_t bytes_per_line;
+    // V4L2_MEMORY_*, 0 while not streaming
+    uint32_t memory;
+    uint32_t num_slots;
+    void* mappings[MAX_DRIVER_BUFFERS];
+    size_t mapping_sizes[MAX_DRIVER_BUFFERS];
+    // V4L2_MEMORY_DMABUF: the buffer in each driver buffer, NULL if free
+    buffer_handle_t slot_buffers[MAX_DRIVER_BUFFERS];
+
+    // buffer producer: pending requests, in seq order
+    capture_request_t requests[MAX_REQUESTS];
+    int num_requests;
+
+    // sideband: the pool, its control block and the handle of the source
+    buffer_handle_t pool[SIDEBAND_BUFFERS];
+    int pool_stride;
+    tv_input_sideband_shared_t* shared;
+    int shared_fd;
+    native_handle_t* sideband_handle;
+} tv_stream_private_t;
+
+typedef struct tv_input_port {
+    char path[PROPERTY_VALUE_MAX];
+    tv_input_device_info_t info;
+    int num_configs;
+    tv_stream_config_t configs[NUM_STREAMS];
+    tv_stream_private_t streams[NUM_STREAMS];
+} tv_input_port_t;
+
 typedef struct tv_input_private {
     tv_input_device_t device;
 
     // Callback related data
     const tv_input_callback_ops_t* callback;
     void* callback_data;
+
+    // protects the streams and their requests
+    pthread_mutex_t lock;
+    const gralloc_module_t* gralloc;
+    alloc_device_t* alloc;
+    int num_ports;
+    tv_input_port_t ports[MAX_PORTS];
 } tv_input_private_t;
 
 static int tv_input_device_open(const struct hw_module_t* module,
@@ -45,7 +162,7 @@ tv_input_module_t HAL_MODULE_INFO_SYM = {
         version_major: 0,
         version_minor: 1,
         id: TV_INPUT_HARDWARE_MODULE_ID,
-        name: "Sample TV input module",
+        name: "V4L2 TV input module",
         author: "The Android Open Source Project",
         methods: &tv_input_module_methods,
     }
@@ -53,6 +170,738 @@ tv_input_module_t HAL_MODULE_INFO_SYM = {
 
 /*****************************************************************************/
 
+// Retry ioctls interrupted by signals, returns -errno on failure
+static int xioctl(int fd, unsigned long request, void* arg)
+{
+    int res;
+
+    do {
+        res = ioctl(fd, request, arg);
+    } while (res == -1 && errno == EINTR);
+    return res == -1 ? -errno : res;
+}
+
+static tv_input_type_t parse_type(const char* type)
+{
+    static const struct {
+        const char* name;
+        tv_input_type_t type;
+    } types[] = {
+        { "hdmi", TV_INPUT_TYPE_HDMI },
+        { "tuner", TV_INPUT_TYPE_TUNER },
+        { "composite", TV_INPUT_TYPE_COMPOSITE },
+        { "svideo", TV_INPUT_TYPE_SVIDEO },
+        { "scart", TV_INPUT_TYPE_SCART },
+        { "component", TV_INPUT_TYPE_COMPONENT },
+        { "vga", TV_INPUT_TYPE_VGA },
+        { "dvi", TV_INPUT_TYPE_DVI },
+        { "dp", TV_INPUT_TYPE_DISPLAY_PORT },
+    };
+
+    for (size_t i = 0; i < ARRAY_SIZE(types); i++) {
+        if (!strcmp(type, types[i].name))
+            return types[i].type;
+    }
+    return TV_INPUT_TYPE_OTHER_HARDWARE;
+}
+
+// The size of the signal of an input, 0 if it can't stream
+static int probe_port(tv_input_port_t* port, uint32_t* width, uint32_t* height)
+{
+    struct v4l2_capability cap;
+    struct v4l2_format fmt;
+    int res = -ENODEV;
+
+    int fd = open(port->path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        ALOGE("%s: Failed to open %s: %s", __func__, port->path, strerror(errno));
+        return -errno;
+    }
+    memset(&cap, 0, sizeof(cap));
+    if (xioctl(fd, VIDIOC_QUERYCAP, &cap) == 0) {
+        uint32_t caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ?
+                cap.device_caps : cap.capabilities;
+        if ((caps & V4L2_CAP_VIDEO_CAPTURE) && (caps & V4L2_CAP_STREAMING))
+            res = 0;
+    }
+    *width = DEFAULT_WIDTH;
+    *height = DEFAULT_HEIGHT;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (res == 0 && xioctl(fd, VIDIOC_G_FMT, &fmt) == 0 && fmt.fmt.pix.width > 0) {
+        *width = fmt.fmt.pix.width;
+        *height = fmt.fmt.pix.height;
+    }
+    ALOGE_IF(res, "%s: %s is no streaming capture node", __func__, port->path);
+    close(fd);
+    return res;
+}
+
+static void probe_ports(tv_input_private_t* priv)
+{
+    char value[PROPERTY_VALUE_MAX];
+    char* saveptr = NULL;
+
+    property_get("ro.tv_input.devices", value, "");
+    for (char* entry = strtok_r(value, ",", &saveptr);
+            entry != NULL && priv->num_ports < MAX_PORTS;
+            entry = strtok_r(NULL, ",", &saveptr)) {
+        tv_input_port_t* port = &priv->ports[priv->num_ports];
+        char* type = strchr(entry, ':');
+        char* port_id = NULL;
+        uint32_t width, height;
+
+        if (type != NULL) {
+            *type++ = '\0';
+            port_id = strchr(type, ':');
+            if (port_id != NULL)
+                *port_id++ = '\0';
+        }
+        memset(port, 0, sizeof(*port));
+        strlcpy(port->path, entry, sizeof(port->path));
+        if (probe_port(port, &width, &height))
+            continue;
+
+        port->info.device_id = priv->num_ports;
+        port->info.type = type != NULL ? parse_type(type) : TV_INPUT_TYPE_OTHER_HARDWARE;
+        port->info.hdmi.port_id = port_id != NULL ? strtoul(port_id, NULL, 0) : 0;
+        port->info.audio_type = AUDIO_DEVICE_NONE;
+        port->info.audio_address = "";
+
+        port->configs[0].stream_id = STREAM_BUFFER_PRODUCER;
+        port->configs[0].type = TV_STREAM_TYPE_BUFFER_PRODUCER;
+        port->configs[0].max_video_width = width;
+        port->configs[0].max_video_height = height;
+        port->num_configs = 1;
+        // Sideband buffers are allocated by the HAL
+        if (priv->alloc != NULL) {
+            port->configs[1] = port->configs[0];
+            port->configs[1].stream_id = STREAM_SIDEBAND;
+            port->configs[1].type = TV_STREAM_TYPE_INDEPENDENT_VIDEO_SOURCE;
+            port->num_configs = 2;
+        }
+        for (int i = 0; i < NUM_STREAMS; i++) {
+            port->streams[i].priv = priv;
+            port->streams[i].device_id = priv->num_ports;
+            port->streams[i].stream_id = i;
+            port->streams[i].fd = -1;
+            port->streams[i].wake_fd = -1;
+            port->streams[i].shared_fd = -1;
+        }
+        ALOGI("%s: input %d on %s, %ux%u", __func__, priv->num_ports, port->path,
+                width, height);
+        priv->num_ports++;
+    }
+}
+
+static tv_stream_private_t* find_stream(tv_input_private_t* priv, int device_id,
+        int stream_id)
+{
+    if (device_id < 0 || device_id >= priv->num_ports)
+        return NULL;
+    tv_input_port_t* port = &priv->ports[device_id];
+    if (stream_id < 0 || stream_id >= port->num_configs)
+        return NULL;
+    return &port->streams[stream_id];
+}
+
+static void wake(tv_stream_private_t* s)
+{
+    uint64_t one = 1;
+    write(s->wake_fd, &one, sizeof(one));
+}
+
+static void notify_capture(tv_stream_private_t* s, buffer_handle_t buffer, uint32_t seq,
+        int error)
+{
+    tv_input_private_t* priv = s->priv;
+    tv_input_event_t event;
+
+    memset(&event, 0, sizeof(event));
+    event.type = error ? TV_INPUT_EVENT_CAPTURE_FAILED : TV_INPUT_EVENT_CAPTURE_SUCCEEDED;
+    event.capture_result.device_id = s->device_id;
+    event.capture_result.stream_id = s->stream_id;
+    event.capture_result.seq = seq;
+    event.capture_result.buffer = buffer;
+    event.capture_result.error_code = error;
+    priv->callback->notify(&priv->device, &event, priv->callback_data);
+}
+
+/*****************************************************************************/
+
+// The best format of the node for NV21 output, 0 if none
+static uint32_t choose_fourcc(int fd)
+{
+    static const uint32_t preferred[] = {
+        V4L2_PIX_FMT_NV21,
+        V4L2_PIX_FMT_NV12,
+        V4L2_PIX_FMT_YUYV,
+    };
+    struct v4l2_fmtdesc desc;
+    uint32_t best = ARRAY_SIZE(preferred);
+
+    memset(&desc, 0, sizeof(desc));
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for (desc.index = 0; xioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++) {
+        for (uint32_t i = 0; i < best; i++) {
+            if (desc.pixelformat == preferred[i])
+                best = i;
+        }
+    }
+    return best < ARRAY_SIZE(preferred) ? preferred[best] : 0;
+}
+
+static int set_format(tv_stream_private_t* s, uint32_t width, uint32_t height)
+{
+    struct v4l2_format fmt;
+    uint32_t fourcc = choose_fourcc(s->fd);
+    int res;
+
+    if (fourcc == 0) {
+        ALOGE("%s:%d: No YUV format to capture in", __func__, s->device_id);
+        return -EINVAL;
+    }
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = fourcc;
+    fmt.fmt.pix.field = V4L2_FIELD_ANY;
+    res = xioctl(s->fd, VIDIOC_S_FMT, &fmt);
+    if (res) {
+        ALOGE("%s:%d: Failed to set format %ux%u: %s(%d)", __func__, s->device_id,
+                width, height, strerror(-res), res);
+        return res;
+    }
+    if (fmt.fmt.pix.pixelformat != fourcc)
+        return -EINVAL;
+
+    s->fourcc = fourcc;
+    // NV21 output of even size, the chroma of the odd line or column is lost
+    s->width = fmt.fmt.pix.width & ~1u;
+    s->height = fmt.fmt.pix.height & ~1u;
+    s->bytes_per_line = fmt.fmt.pix.bytesperline;
+    if (s->bytes_per_line == 0)
+        s->bytes_per_line = fourcc == V4L2_PIX_FMT_YUYV ? s->width * 2 : s->width;
+    return 0;
+}
+
+static void stop_streaming(tv_stream_private_t* s)
+{
+    struct v4l2_requestbuffers req;
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (s->memory == 0)
+        return;
+
+    xioctl(s->fd, VIDIOC_STREAMOFF, &type);
+    for (uint32_t i = 0; i < MAX_DRIVER_BUFFERS; i++) {
+        if (s->mappings[i] != NULL)
+            munmap(s->mappings[i], s->mapping_sizes[i]);
+        s->mappings[i] = NULL;
+        s->mapping_sizes[i] = 0;
+        s->slot_buffers[i] = NULL;
+    }
+    memset(&req, 0, sizeof(req));
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = s->memory;
+    xioctl(s->fd, VIDIOC_REQBUFS, &req);
+    s->memory = 0;
+    s->num_slots = 0;
+}
+
+static int queue_slot(tv_stream_private_t* s, uint32_t slot, buffer_handle_t buffer)
+{
+    struct v4l2_buffer buf;
+
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = s->memory;
+    buf.index = slot;
+    if (s->memory == V4L2_MEMORY_DMABUF) {
+        // Gralloc buffers carry their dma-buf as first fd
+        if (buffer->numFds < 1)
+            return -EINVAL;
+        buf.m.fd = buffer->data[0];
+    }
+    int res = xioctl(s->fd, VIDIOC_QBUF, &buf);
+    if (res == 0 && s->memory == V4L2_MEMORY_DMABUF)
+        s->slot_buffers[slot] = buffer;
+    return res;
+}
+
+static int start_streaming(tv_stream_private_t* s, uint32_t memory)
+{
+    struct v4l2_requestbuffers req;
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int res;
+
+    memset(&req, 0, sizeof(req));
+    req.count = MAX_DRIVER_BUFFERS;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = memory;
+    res = xioctl(s->fd, VIDIOC_REQBUFS, &req);
+    if (res)
+        return res;
+    if (req.count == 0)
+        return -ENOMEM;
+    s->memory = memory;
+    s->num_slots = req.count < MAX_DRIVER_BUFFERS ? req.count : MAX_DRIVER_BUFFERS;
+
+    if (memory == V4L2_MEMORY_MMAP) {
+        for (uint32_t i = 0; i < s->num_slots; i++) {
+            struct v4l2_buffer buf;
+            memset(&buf, 0, sizeof(buf));
+            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buf.memory = V4L2_MEMORY_MMAP;
+            buf.index = i;
+            res = xioctl(s->fd, VIDIOC_QUERYBUF, &buf);
+            if (res)
+                goto err_out;
+            void* mapping = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, s->fd,
+                    buf.m.offset);
+            if (mapping == MAP_FAILED) {
+                res = -errno;
+                goto err_out;
+            }
+            s->mappings[i] = mapping;
+            s->mapping_sizes[i] = buf.length;
+            res = queue_slot(s, i, NULL);
+            if (res)
+                goto err_out;
+        }
+    }
+
+    res = xioctl(s->fd, VIDIOC_STREAMON, &type);
+    if (res)
+        goto err_out;
+    return 0;
+
+err_out:
+    ALOGE("%s:%d: Failed to start streaming: %s(%d)", __func__, s->device_id,
+            strerror(-res), res);
+    stop_streaming(s);
+    return res;
+}
+
+// The dma-buf import failed, capture into driver buffers and copy from now on
+static int fall_back_to_copy(tv_stream_private_t* s)
+{
+    ALOGW("%s:%d: Driver refused a gralloc buffer, copying frames", __func__,
+            s->device_id);
+    stop_streaming(s);
+    return start_streaming(s, V4L2_MEMORY_MMAP);
+}
+
+/*
+ * Wait for and dequeue a frame. Returns 0 with its driver buffer in slot,
+ * -EAGAIN when woken up through wake_fd or on a timeout, -EIO with slot
+ * for a corrupted frame in a gralloc buffer, -errno if the node failed.
+ */
+static int dequeue_slot(tv_stream_private_t* s, uint32_t* slot)
+{
+    struct pollfd pfd[2];
+    struct v4l2_buffer buf;
+    uint64_t count;
+    int res;
+
+    pfd[0].fd = s->fd;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd = s->wake_fd;
+    pfd[1].events = POLLIN;
+    pfd[1].revents = 0;
+    res = poll(pfd, 2, FRAME_TIMEOUT_MS);
+    if (res == 0) {
+        ALOGW("%s:%d: No frame in %d ms, no signal?", __func__, s->device_id,
+                FRAME_TIMEOUT_MS);
+        return -EAGAIN;
+    } else if (res < 0) {
+        return errno == EINTR ? -EAGAIN : -errno;
+    }
+    if (pfd[1].revents & POLLIN) {
+        read(s->wake_fd, &count, sizeof(count));
+        return -EAGAIN;
+    }
+    if (!(pfd[0].revents & POLLIN))
+        return -ENODEV;
+
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = s->memory;
+    res = xioctl(s->fd, VIDIOC_DQBUF, &buf);
+    if (res)
+        return res;
+    *slot = buf.index;
+    if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+        ALOGW("%s:%d: Driver returned a corrupted frame", __func__, s->device_id);
+        if (s->memory == V4L2_MEMORY_MMAP) {
+            queue_slot(s, buf.index, NULL);
+            return -EAGAIN;
+        }
+        return -EIO;
+    }
+    return 0;
+}
+
+// Copy the frame of an MMAP driver buffer into an NV21 gralloc buffer
+static int copy_frame(tv_stream_private_t* s, uint32_t slot, buffer_handle_t buffer)
+{
+    const gralloc_module_t* gralloc = s->priv->gralloc;
+    struct android_ycbcr ycbcr;
+    const uint8_t* src = (const uint8_t*)s->mappings[slot];
+    uint32_t bpl = s->bytes_per_line;
+    int res;
+
+    if (gralloc == NULL || gralloc->lock_ycbcr == NULL)
+        return -ENOSYS;
+    res = gralloc->lock_ycbcr(gralloc, buffer, GRALLOC_USAGE_SW_WRITE_OFTEN, 0, 0,
+            s->width, s->height, &ycbcr);
+    if (res)
+        return res;
+
+    uint8_t* y = (uint8_t*)ycbcr.y;
+    uint8_t* cb = (uint8_t*)ycbcr.cb;
+    uint8_t* cr = (uint8_t*)ycbcr.cr;
+    for (uint32_t row = 0; row < s->height; row++) {
+        const uint8_t* line = src + row * bpl;
+        uint8_t* out = y + row * ycbcr.ystride;
+        if (s->fourcc == V4L2_PIX_FMT_YUYV) {
+            for (uint32_t x = 0; x < s->width; x++)
+                out[x] = line[2 * x];
+        } else {
+            memcpy(out, line, s->width);
+        }
+    }
+    for (uint32_t row = 0; row < s->height / 2; row++) {
+        size_t out = row * ycbcr.cstride;
+        if (s->fourcc == V4L2_PIX_FMT_YUYV) {
+            const uint8_t* line = src + 2 * row * bpl;
+            for (uint32_t x = 0; x < s->width / 2; x++, out += ycbcr.chroma_step) {
+                cb[out] = line[4 * x + 1];
+                cr[out] = line[4 * x + 3];
+            }
+        } else {
+            const uint8_t* line = src + (s->height + row) * bpl;
+            int u = s->fourcc == V4L2_PIX_FMT_NV12 ? 0 : 1;
+            for (uint32_t x = 0; x < s->width / 2; x++, out += ycbcr.chroma_step) {
+                cb[out] = line[2 * x + u];
+                cr[out] = line[2 * x + 1 - u];
+            }
+        }
+    }
+    gralloc->unlock(gralloc, buffer);
+    return 0;
+}
+
+/*****************************************************************************/
+
+// Take every request of a buffer producer stream, with priv->lock held
+static int take_requests(tv_stream_private_t* s, capture_request_t* out)
+{
+    int count = s->num_requests;
+
+    memcpy(out, s->requests, count * sizeof(*out));
+    s->num_requests = 0;
+    return count;
+}
+
+static void remove_request(tv_stream_private_t* s, int i)
+{
+    s->num_requests--;
+    memmove(&s->requests[i], &s->requests[i + 1],
+            (s->num_requests - i) * sizeof(s->requests[0]));
+}
+
+/*
+ * Capture thread of a buffer producer stream. Requests are captured in
+ * seq order: into their own buffer, queued to the driver all at once so
+ * that it never runs dry, or into driver buffers and copied for the
+ * oldest request.
+ */
+static void* producer_thread(void* arg)
+{
+    tv_stream_private_t* s = (tv_stream_private_t*)arg;
+    tv_input_private_t* priv = s->priv;
+    capture_request_t failed[MAX_REQUESTS];
+
+    prctl(PR_SET_NAME, (unsigned long)"tv_input capture", 0, 0, 0);
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_DISPLAY);
+
+    for (;;) {
+        int num_failed = 0;
+        bool waiting = false;
+
+        pthread_mutex_lock(&priv->lock);
+        if (s->exiting) {
+            pthread_mutex_unlock(&priv->lock);
+            break;
+        }
+        for (int i = 0; i < s->num_requests && s->memory == V4L2_MEMORY_DMABUF; i++) {
+            capture_request_t* req = &s->requests[i];
+            if (req->slot >= 0)
+                continue;
+            uint32_t slot = 0;
+            while (slot < s->num_slots && s->slot_buffers[slot] != NULL)
+                slot++;
+            if (slot == s->num_slots)
+                break;
+            if (queue_slot(s, slot, req->buffer) == 0) {
+                req->slot = slot;
+                continue;
+            }
+            // The frames of the buffers already queued are lost
+            fall_back_to_copy(s);
+            for (int j = 0; j < s->num_requests; j++)
+                s->requests[j].slot = -1;
+        }
+        if (s->memory == 0)
+            num_failed = take_requests(s, failed);
+        waiting = s->num_requests > 0;
+        pthread_mutex_unlock(&priv->lock);
+
+        for (int i = 0; i < num_failed; i++)
+            notify_capture(s, failed[i].buffer, failed[i].seq, -EIO);
+
+        uint32_t slot;
+        int res;
+        if (!waiting) {
+            struct pollfd pfd = { s->wake_fd, POLLIN, 0 };
+            uint64_t count;
+            poll(&pfd, 1, -1);
+            read(s->wake_fd, &count, sizeof(count));
+            continue;
+        }
+        res = dequeue_slot(s, &slot);
+        if (res == -EAGAIN)
+            continue;
+
+        capture_request_t req;
+        bool have_req = false;
+        pthread_mutex_lock(&priv->lock);
+        if (res == 0 || (res == -EIO && s->memory == V4L2_MEMORY_DMABUF)) {
+            int i = 0;
+            if (s->memory == V4L2_MEMORY_DMABUF) {
+                // The driver returns its buffers in the order they were queued
+                while (i < s->num_requests && s->requests[i].slot != (int)slot)
+                    i++;
+                s->slot_buffers[slot] = NULL;
+            }
+            if (i < s->num_requests) {
+                req = s->requests[i];
+                have_req = true;
+                remove_request(s, i);
+            }
+        } else {
+            ALOGE("%s:%d: Capture failed: %s(%d)", __func__, s->device_id,
+                    strerror(-res), res);
+            stop_streaming(s);
+        }
+        pthread_mutex_unlock(&priv->lock);
+
+        if (!have_req) {
+            if (res == 0 && s->memory == V4L2_MEMORY_MMAP)
+                queue_slot(s, slot, NULL);
+            continue;
+        }
+        if (req.cancelled)
+            res = -ECANCELED;
+        else if (res == 0 && s->memory == V4L2_MEMORY_MMAP)
+            res = copy_frame(s, slot, req.buffer);
+        if (s->memory == V4L2_MEMORY_MMAP)
+            queue_slot(s, slot, NULL);
+        notify_capture(s, req.buffer, req.seq, res);
+    }
+    return NULL;
+}
+
+/*****************************************************************************/
+
+static void sideband_publish(tv_stream_private_t* s, int index)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    s->shared->timestamp_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    android_atomic_release_store(index, &s->shared->latest);
+    android_atomic_inc(&s->shared->seq);
+}
+
+// A pool buffer the consumer doesn't show nor the driver fills, -1 if none
+static int sideband_free_buffer(tv_stream_private_t* s)
+{
+    int32_t latest = android_atomic_acquire_load(&s->shared->latest);
+    int32_t busy = android_atomic_acquire_load(&s->shared->busy);
+
+    for (int i = 0; i < SIDEBAND_BUFFERS; i++) {
+        bool queued = false;
+        if (i == latest || (busy & (1 << i)))
+            continue;
+        for (uint32_t slot = 0; slot < s->num_slots; slot++)
+            queued |= s->slot_buffers[slot] == s->pool[i];
+        if (!queued)
+            return i;
+    }
+    return -1;
+}
+
+static int sideband_index(tv_stream_private_t* s, buffer_handle_t buffer)
+{
+    for (int i = 0; i < SIDEBAND_BUFFERS; i++) {
+        if (s->pool[i] == buffer)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Capture thread of a sideband stream: keeps the driver filling free
+ * buffers of the pool and publishes every frame to the consumer, until
+ * the stream is closed. A frame with no free buffer to copy it to is
+ * dropped.
+ */
+static void* sideband_thread(void* arg)
+{
+    tv_stream_private_t* s = (tv_stream_private_t*)arg;
+    tv_input_private_t* priv = s->priv;
+
+    prctl(PR_SET_NAME, (unsigned long)"tv_input sideband", 0, 0, 0);
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_DISPLAY);
+
+    for (;;) {
+        pthread_mutex_lock(&priv->lock);
+        bool exiting = s->exiting;
+        pthread_mutex_unlock(&priv->lock);
+        if (exiting || s->memory == 0)
+            break;
+
+        uint32_t queued = 0;
+        while (s->memory == V4L2_MEMORY_DMABUF) {
+            uint32_t slot = 0;
+            while (slot < s->num_slots && s->slot_buffers[slot] != NULL)
+                slot++;
+            int index = slot < s->num_slots ? sideband_free_buffer(s) : -1;
+            if (index < 0)
+                break;
+            if (queue_slot(s, slot, s->pool[index]) && fall_back_to_copy(s))
+                break;
+        }
+        for (uint32_t slot = 0; slot < s->num_slots; slot++)
+            queued += s->slot_buffers[slot] != NULL;
+        // The consumer holds every buffer, try again a frame later
+        if (s->memory == V4L2_MEMORY_DMABUF && queued == 0) {
+            struct pollfd pfd = { s->wake_fd, POLLIN, 0 };
+            poll(&pfd, 1, 16);
+            continue;
+        }
+
+        uint32_t slot;
+        int res = dequeue_slot(s, &slot);
+        if (res == -EAGAIN)
+            continue;
+        if (res && res != -EIO) {
+            ALOGE("%s:%d: Capture failed: %s(%d)", __func__, s->device_id,
+                    strerror(-res), res);
+            break;
+        }
+
+        if (s->memory == V4L2_MEMORY_DMABUF) {
+            int index = sideband_index(s, s->slot_buffers[slot]);
+            s->slot_buffers[slot] = NULL;
+            if (res == 0 && index >= 0)
+                sideband_publish(s, index);
+        } else {
+            int index = sideband_free_buffer(s);
+            if (res == 0 && index >= 0 && copy_frame(s, slot, s->pool[index]) == 0)
+                sideband_publish(s, index);
+            queue_slot(s, slot, NULL);
+        }
+    }
+
+    stop_streaming(s);
+    return NULL;
+}
+
+static void sideband_free(tv_stream_private_t* s)
+{
+    tv_input_private_t* priv = s->priv;
+
+    if (s->sideband_handle != NULL) {
+        native_handle_close(s->sideband_handle);
+        native_handle_delete(s->sideband_handle);
+        s->sideband_handle = NULL;
+    }
+    for (int i = 0; i < SIDEBAND_BUFFERS; i++) {
+        if (s->pool[i] != NULL)
+            priv->alloc->free(priv->alloc, s->pool[i]);
+        s->pool[i] = NULL;
+    }
+    if (s->shared != NULL)
+        munmap(s->shared, sizeof(*s->shared));
+    s->shared = NULL;
+    if (s->shared_fd >= 0)
+        close(s->shared_fd);
+    s->shared_fd = -1;
+}
+
+static int sideband_alloc(tv_stream_private_t* s)
+{
+    tv_input_private_t* priv = s->priv;
+    int usage = GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_COMPOSER |
+            GRALLOC_USAGE_SW_WRITE_OFTEN;
+    int res;
+
+    for (int i = 0; i < SIDEBAND_BUFFERS; i++) {
+        res = priv->alloc->alloc(priv->alloc, s->width, s->height, OUTPUT_FORMAT, usage,
+                &s->pool[i], &s->pool_stride);
+        if (res || s->pool[i]->numFds < 1) {
+            ALOGE("%s:%d: Failed to allocate %ux%u buffers: %d", __func__, s->device_id,
+                    s->width, s->height, res);
+            goto err_out;
+        }
+    }
+
+    s->shared_fd = ashmem_create_region("tv_input-sideband", sizeof(*s->shared));
+    if (s->shared_fd < 0)
+        goto err_out;
+    s->shared = (tv_input_sideband_shared_t*)mmap(NULL, sizeof(*s->shared),
+            PROT_READ | PROT_WRITE, MAP_SHARED, s->shared_fd, 0);
+    if (s->shared == MAP_FAILED) {
+        s->shared = NULL;
+        goto err_out;
+    }
+    memset(s->shared, 0, sizeof(*s->shared));
+    s->shared->magic = TV_INPUT_SIDEBAND_MAGIC;
+    s->shared->num_buffers = SIDEBAND_BUFFERS;
+    s->shared->width = s->width;
+    s->shared->height = s->height;
+    s->shared->format = OUTPUT_FORMAT;
+    s->shared->stride = s->pool_stride;
+    s->shared->latest = -1;
+
+    s->sideband_handle = native_handle_create(1 + SIDEBAND_BUFFERS, 2);
+    if (s->sideband_handle == NULL)
+        goto err_out;
+    for (int i = 0; i < 1 + SIDEBAND_BUFFERS; i++)
+        s->sideband_handle->data[i] = -1;
+    s->sideband_handle->data[0] = dup(s->shared_fd);
+    for (int i = 0; i < SIDEBAND_BUFFERS; i++)
+        s->sideband_handle->data[1 + i] = dup(s->pool[i]->data[0]);
+    s->sideband_handle->data[1 + SIDEBAND_BUFFERS] = TV_INPUT_SIDEBAND_MAGIC;
+    s->sideband_handle->data[2 + SIDEBAND_BUFFERS] = SIDEBAND_BUFFERS;
+    for (int i = 0; i < 1 + SIDEBAND_BUFFERS; i++) {
+        if (s->sideband_handle->data[i] < 0)
+            goto err_out;
+    }
+    return 0;
+
+err_out:
+    sideband_free(s);
+    return -ENOMEM;
+}
+
+/*****************************************************************************/
+
 static int tv_input_initialize(struct tv_input_device* dev,
         const tv_input_callback_ops_t* callback, void* data)
 {
@@ -67,34 +916,234 @@ static int tv_input_initialize(struct tv_input_device* dev,
     priv->callback = callback;
     priv->callback_data = data;
 
+    probe_ports(priv);
+    for (int i = 0; i < priv->num_ports; i++) {
+        tv_input_event_t event;
+        memset(&event, 0, sizeof(event));
+        event.type = TV_INPUT_EVENT_DEVICE_AVAILABLE;
+        event.device_info = priv->ports[i].info;
+        callback->notify(dev, &event, data);
+    }
+
     return 0;
 }
 
 static int tv_input_get_stream_configurations(
-        const struct tv_input_device*, int, int*, const tv_stream_config_t**)
+        const struct tv_input_device* dev, int device_id, int* num_configurations,
+        const tv_stream_config_t** configs)
 {
-    return -EINVAL;
+    tv_input_private_t* priv = (tv_input_private_t*)dev;
+
+    if (device_id < 0 || device_id >= priv->num_ports)
+        return -EINVAL;
+    *num_configurations = priv->ports[device_id].num_configs;
+    *configs = priv->ports[device_id].configs;
+    return 0;
 }
 
-static int tv_input_open_stream(struct tv_input_device*, int, tv_stream_t*)
+static void close_node(tv_stream_private_t* s)
 {
-    return -EINVAL;
+    stop_streaming(s);
+    if (s->fd >= 0)
+        close(s->fd);
+    s->fd = -1;
+    if (s->wake_fd >= 0)
+        close(s->wake_fd);
+    s->wake_fd = -1;
+}
+
+static int tv_input_open_stream(struct tv_input_device* dev, int device_id,
+        tv_stream_t* stream)
+{
+    tv_input_private_t* priv = (tv_input_private_t*)dev;
+    int res;
+
+    pthread_mutex_lock(&priv->lock);
+    tv_stream_private_t* s = find_stream(priv, device_id, stream->stream_id);
+    if (s == NULL) {
+        res = -EINVAL;
+        goto out;
+    }
+    if (s->open) {
+        res = -EEXIST;
+        goto out;
+    }
+    // Both streams capture from the same node
+    if (priv->ports[device_id].streams[1 - s->stream_id].open) {
+        res = -EBUSY;
+        goto out;
+    }
+
+    {
+        const tv_stream_config_t* config = &priv->ports[device_id].configs[s->stream_id];
+        uint32_t width = config->max_video_width;
+        uint32_t height = config->max_video_height;
+        // A buffer producer may ask for a smaller size
+        if (s->stream_id == STREAM_BUFFER_PRODUCER &&
+                stream->buffer_producer.width > 0 && stream->buffer_producer.height > 0) {
+            width = stream->buffer_producer.width;
+            height = stream->buffer_producer.height;
+        }
+
+        s->fd = open(priv->ports[device_id].path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        s->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (s->fd < 0 || s->wake_fd < 0) {
+            res = -errno;
+            goto err_close;
+        }
+        res = set_format(s, width, height);
+        if (res)
+            goto err_close;
+        if (s->stream_id == STREAM_SIDEBAND) {
+            res = sideband_alloc(s);
+            if (res)
+                goto err_close;
+        }
+
+        // Capture into the gralloc buffers when they match the frames exactly
+        bool zero_copy = s->fourcc == V4L2_PIX_FMT_NV21 && (s->stream_id == STREAM_SIDEBAND ?
+                s->bytes_per_line == (uint32_t)s->pool_stride : s->bytes_per_line == s->width);
+        res = zero_copy ? start_streaming(s, V4L2_MEMORY_DMABUF) : -EINVAL;
+        if (res)
+            res = start_streaming(s, V4L2_MEMORY_MMAP);
+        if (res)
+            goto err_close;
+    }
+
+    s->exiting = false;
+    s->num_requests = 0;
+    res = pthread_create(&s->thread, NULL,
+            s->stream_id == STREAM_SIDEBAND ? sideband_thread : producer_thread, s);
+    if (res) {
+        res = -res;
+        goto err_close;
+    }
+    s->open = true;
+
+    stream->type = priv->ports[device_id].configs[s->stream_id].type;
+    if (s->stream_id == STREAM_SIDEBAND) {
+        stream->sideband_stream_source_handle = s->sideband_handle;
+    } else {
+        stream->buffer_producer.width = s->width;
+        stream->buffer_producer.height = s->height;
+        stream->buffer_producer.usage = GRALLOC_USAGE_SW_WRITE_OFTEN |
+                GRALLOC_USAGE_HW_TEXTURE;
+        stream->buffer_producer.format = OUTPUT_FORMAT;
+    }
+    ALOGI("%s:%d: Stream %d %ux%u in %08x, %s", __func__, device_id, s->stream_id,
+            s->width, s->height, s->fourcc,
+            s->memory == V4L2_MEMORY_DMABUF ? "zero-copy" : "copying");
+    res = 0;
+    goto out;
+
+err_close:
+    ALOGE("%s:%d: Failed to open stream %d: %s(%d)", __func__, device_id, s->stream_id,
+            strerror(-res), res);
+    if (s->stream_id == STREAM_SIDEBAND)
+        sideband_free(s);
+    close_node(s);
+out:
+    pthread_mutex_unlock(&priv->lock);
+    return res;
 }
 
-static int tv_input_close_stream(struct tv_input_device*, int, int)
+static int tv_input_close_stream(struct tv_input_device* dev, int device_id,
+        int stream_id)
 {
-    return -EINVAL;
+    tv_input_private_t* priv = (tv_input_private_t*)dev;
+    capture_request_t pending[MAX_REQUESTS];
+    int num_pending;
+
+    pthread_mutex_lock(&priv->lock);
+    tv_stream_private_t* s = find_stream(priv, device_id, stream_id);
+    if (s == NULL) {
+        pthread_mutex_unlock(&priv->lock);
+        return -EINVAL;
+    }
+    if (!s->open) {
+        pthread_mutex_unlock(&priv->lock);
+        return -ENOENT;
+    }
+    s->open = false;
+    s->exiting = true;
+    wake(s);
+    pthread_mutex_unlock(&priv->lock);
+
+    pthread_join(s->thread, NULL);
+
+    pthread_mutex_lock(&priv->lock);
+    // Stopping the stream gives back the buffers queued to the driver
+    close_node(s);
+    num_pending = take_requests(s, pending);
+    if (stream_id == STREAM_SIDEBAND)
+        sideband_free(s);
+    pthread_mutex_unlock(&priv->lock);
+
+    for (int i = 0; i < num_pending; i++)
+        notify_capture(s, pending[i].buffer, pending[i].seq, -ECANCELED);
+    return 0;
 }
 
 static int tv_input_request_capture(
-        struct tv_input_device*, int, int, buffer_handle_t, uint32_t)
+        struct tv_input_device* dev, int device_id, int stream_id,
+        buffer_handle_t buffer, uint32_t seq)
 {
-    return -EINVAL;
+    tv_input_private_t* priv = (tv_input_private_t*)dev;
+    int res = 0;
+
+    pthread_mutex_lock(&priv->lock);
+    tv_stream_private_t* s = find_stream(priv, device_id, stream_id);
+    if (s == NULL || stream_id != STREAM_BUFFER_PRODUCER || buffer == NULL) {
+        res = -EINVAL;
+    } else if (!s->open) {
+        res = -ENOENT;
+    } else if (s->num_requests == MAX_REQUESTS) {
+        res = -EWOULDBLOCK;
+    } else {
+        capture_request_t* req = &s->requests[s->num_requests++];
+        req->buffer = buffer;
+        req->seq = seq;
+        req->slot = -1;
+        req->cancelled = false;
+        wake(s);
+    }
+    pthread_mutex_unlock(&priv->lock);
+    return res;
 }
 
-static int tv_input_cancel_capture(struct tv_input_device*, int, int, uint32_t)
+static int tv_input_cancel_capture(struct tv_input_device* dev, int device_id,
+        int stream_id, uint32_t seq)
 {
-    return -EINVAL;
+    tv_input_private_t* priv = (tv_input_private_t*)dev;
+    capture_request_t req;
+    int res = -EINVAL;
+    bool release = false;
+
+    pthread_mutex_lock(&priv->lock);
+    tv_stream_private_t* s = find_stream(priv, device_id, stream_id);
+    if (s != NULL && !s->open) {
+        res = -ENOENT;
+    } else if (s != NULL) {
+        for (int i = 0; i < s->num_requests; i++) {
+            if (s->requests[i].seq != seq)
+                continue;
+            // A buffer in the driver comes back with the next frame
+            if (s->requests[i].slot >= 0) {
+                s->requests[i].cancelled = true;
+            } else {
+                req = s->requests[i];
+                remove_request(s, i);
+                release = true;
+            }
+            res = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&priv->lock);
+
+    if (release)
+        notify_capture(s, req.buffer, req.seq, -ECANCELED);
+    return res;
 }
 
 /*****************************************************************************/
@@ -103,6 +1152,15 @@ static int tv_input_device_close(struct hw_device_t *dev)
 {
     tv_input_private_t* priv = (tv_input_private_t*)dev;
     if (priv) {
+        for (int i = 0; i < priv->num_ports; i++) {
+            for (int j = 0; j < NUM_STREAMS; j++) {
+                if (priv->ports[i].streams[j].open)
+                    tv_input_close_stream(&priv->device, i, j);
+            }
+        }
+        if (priv->alloc != NULL)
+            gralloc_close(priv->alloc);
+        pthread_mutex_destroy(&priv->lock);
         free(priv);
     }
     return 0;
@@ -116,9 +1174,19 @@ static int tv_input_device_open(const struct hw_module_t* module,
     int status = -EINVAL;
     if (!strcmp(name, TV_INPUT_DEFAULT_DEVICE)) {
         tv_input_private_t* dev = (tv_input_private_t*)malloc(sizeof(*dev));
+        if (dev == NULL)
+            return -ENOMEM;
 
         /* initialize our state here */
         memset(dev, 0, sizeof(*dev));
+        pthread_mutex_init(&dev->lock, NULL);
+        const hw_module_t* gralloc;
+        if (hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &gralloc) == 0) {
+            dev->gralloc = (const gralloc_module_t*)gralloc;
+            if (gralloc_open(gralloc, &dev->alloc))
+                dev->alloc = NULL;
+        }
+        ALOGW_IF(dev->alloc == NULL, "No gralloc allocator, sideband streams disabled");
 
         /* initialize the procs */
         dev->device.common.tag = HARDWARE_DEVICE_TAG;
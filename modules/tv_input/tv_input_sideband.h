@@ -0,0 +1,63 @@
+/*
+ * Copyright 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TV_INPUT_SIDEBAND_H_
+#define TV_INPUT_SIDEBAND_H_
+
+#include <stdint.h>
+
+/*
+ * Sideband stream sources of the tv_input module. The capture thread of
+ * the HAL fills a small pool of gralloc buffers of its own and publishes
+ * the newest complete frame in a shared control block, which a consumer
+ * such as the composer reads to show the frame without it ever going
+ * through the application.
+ *
+ * The native handle of the source carries:
+ *
+ *   data[0]                  the control block, tv_input_sideband_shared_t
+ *   data[1 .. num_buffers]   the dma-buf of each buffer of the pool
+ *   ints                     TV_INPUT_SIDEBAND_MAGIC, num_buffers
+ *
+ * A consumer sets its bit in busy for the buffer it is about to read or
+ * scan out, then checks latest again; the HAL never captures into latest
+ * or into a busy buffer.
+ */
+
+#define TV_INPUT_SIDEBAND_MAGIC         0x53465456  /* 'SFTV' */
+#define TV_INPUT_SIDEBAND_MAX_BUFFERS   4
+
+typedef struct tv_input_sideband_shared {
+    uint32_t magic;
+    uint32_t num_buffers;
+    /* of every buffer of the pool, format a HAL_PIXEL_FORMAT_*, stride in pixels */
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint32_t stride;
+
+    /* bumped by the HAL after latest changes */
+    volatile int32_t seq;
+    /* the buffer of the newest frame, -1 before the first one */
+    volatile int32_t latest;
+    /* bit i set by consumers while they use buffer i */
+    volatile int32_t busy;
+    int32_t reserved;
+    /* CLOCK_MONOTONIC capture time of latest */
+    volatile int64_t timestamp_ns;
+} tv_input_sideband_shared_t;
+
+#endif /* TV_INPUT_SIDEBAND_H_ */
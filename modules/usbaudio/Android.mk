@@ -23,13 +23,18 @@ LOCAL_SRC_FILES := \
 	alsa_device_profile.c \
 	alsa_device_proxy.c \
 	logging.c \
-	format.c
+	format.c \
+	conversion.c \
+	profile_cache.c
 LOCAL_C_INCLUDES += \
 	external/tinyalsa/include \
-	$(call include-path-for, audio-utils)
+	$(call include-path-for, audio-utils) \
+	$(LOCAL_PATH)/../audio_effect_chain
 LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa libaudioutils
+LOCAL_STATIC_LIBRARIES := libaudio_effect_chain
 LOCAL_MODULE_TAGS := optional
 LOCAL_CFLAGS := -Wno-unused-parameter
 
 include $(BUILD_SHARED_LIBRARY)
 
+include $(call all-makefiles-under, $(LOCAL_PATH))
@@ -28,6 +28,7 @@
 #include "alsa_device_profile.h"
 #include "format.h"
 #include "logging.h"
+#include "profile_cache.h"
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
@@ -36,6 +37,9 @@
 
 #define DEFAULT_PERIOD_SIZE 1024
 
+/* the fewest periods which keep the device busy while the next one is written */
+#define LOW_LATENCY_PERIOD_COUNT 2
+
 static const char * const format_string_map[] = {
     "AUDIO_FORMAT_PCM_16_BIT",      /* "PCM_FORMAT_S16_LE", */
     "AUDIO_FORMAT_PCM_32_BIT",      /* "PCM_FORMAT_S32_LE", */
@@ -77,6 +81,7 @@ static void profile_reset(alsa_device_profile* profile)
     }
 
     profile->min_period_size = profile->max_period_size = 0;
+    profile->min_period_count = profile->max_period_count = 0;
     profile->min_channel_count = profile->max_channel_count = DEFAULT_CHANNEL_COUNT;
 
     profile->is_valid = false;
@@ -138,6 +143,42 @@ unsigned int profile_get_period_size(alsa_device_profile* profile, unsigned samp
     return period_size;
 }
 
+/*
+ * Negotiates the periods of a stream from the latency it requests, within the limits read from
+ * the device. A latency_ms of 0 returns the default (BUFF_DURATION_MS based) configuration.
+ */
+void profile_calc_period_config(alsa_device_profile* profile, unsigned sample_rate,
+                                unsigned latency_ms, unsigned* period_size,
+                                unsigned* period_count)
+{
+    if (latency_ms == 0) {
+        *period_size = profile_get_period_size(profile, sample_rate);
+        *period_count = profile->default_config.period_count;
+        return;
+    }
+
+    unsigned count = LOW_LATENCY_PERIOD_COUNT;
+    if (count < profile->min_period_count) {
+        count = profile->min_period_count;
+    }
+    if (profile->max_period_count != 0 && count > profile->max_period_count) {
+        count = profile->max_period_count;
+    }
+
+    unsigned size = round_to_16_mult(sample_rate * latency_ms / 1000 / count);
+    if (size < profile->min_period_size) {
+        size = profile->min_period_size;
+    }
+    if (profile->max_period_size != 0 && size > profile->max_period_size) {
+        size = profile->max_period_size;
+    }
+
+    ALOGV("profile_calc_period_config(rate:%d latency:%d) = %d x %d",
+          sample_rate, latency_ms, count, size);
+    *period_size = size;
+    *period_count = count;
+}
+
 /*
  * Sample Rate
  */
@@ -320,6 +361,9 @@ static int read_alsa_device_config(alsa_device_profile * profile, struct pcm_con
     profile->min_period_size = pcm_params_get_min(alsa_hw_params, PCM_PARAM_PERIOD_SIZE);
     profile->max_period_size = pcm_params_get_max(alsa_hw_params, PCM_PARAM_PERIOD_SIZE);
 
+    profile->min_period_count = pcm_params_get_min(alsa_hw_params, PCM_PARAM_PERIODS);
+    profile->max_period_count = pcm_params_get_max(alsa_hw_params, PCM_PARAM_PERIODS);
+
     profile->min_channel_count = pcm_params_get_min(alsa_hw_params, PCM_PARAM_CHANNELS);
     profile->max_channel_count = pcm_params_get_max(alsa_hw_params, PCM_PARAM_CHANNELS);
 
@@ -355,6 +399,11 @@ bool profile_read_device_info(alsa_device_profile* profile)
         return false;
     }
 
+    /* a device connected before doesn't need probing again */
+    if (profile_cache_load(profile)) {
+        return true;
+    }
+
     /* let's get some defaults */
     read_alsa_device_config(profile, &profile->default_config);
     ALOGV("default_config chans:%d rate:%d format:%d count:%d size:%d",
@@ -385,6 +434,10 @@ bool profile_read_device_info(alsa_device_profile* profile)
 
     profile->is_valid = true;
 
+    pcm_params_free(alsa_hw_params);
+
+    profile_cache_store(profile);
+
     return true;
 }
 
@@ -411,18 +464,23 @@ char * profile_get_sample_rate_strs(alsa_device_profile* profile)
 
 char * profile_get_format_strs(alsa_device_profile* profile)
 {
-    /* TODO remove this hack when we have support for input in non PCM16 formats */
-    if (profile->direction == PCM_IN) {
-        return strdup("AUDIO_FORMAT_PCM_16_BIT");
-    }
-
     char buffer[128];
     buffer[0] = '\0';
     int buffSize = ARRAY_SIZE(buffer);
 
     int numEntries = 0;
     unsigned index = 0;
+
+    /* input streams can always be read as PCM16, in_read() converts the native formats */
+    if (profile->direction == PCM_IN) {
+        strncat(buffer, format_string_map[PCM_FORMAT_S16_LE], buffSize);
+        numEntries++;
+    }
+
     for (index = 0; profile->formats[index] != PCM_FORMAT_INVALID; index++) {
+        if (profile->direction == PCM_IN && profile->formats[index] == PCM_FORMAT_S16_LE) {
+            continue;
+        }
         if (numEntries++ != 0) {
             strncat(buffer, "|", buffSize);
         }
@@ -54,6 +54,9 @@ typedef struct  {
     unsigned min_period_size;
     unsigned max_period_size;
 
+    unsigned min_period_count;
+    unsigned max_period_count;
+
     unsigned min_channel_count;
     unsigned max_channel_count;
 } alsa_device_profile;
@@ -86,5 +89,8 @@ bool profile_is_channel_count_valid(alsa_device_profile* profile, unsigned count
 /* Utility */
 unsigned profile_calc_min_period_size(alsa_device_profile* profile, unsigned sample_rate);
 unsigned int profile_get_period_size(alsa_device_profile* profile, unsigned sample_rate);
+void profile_calc_period_config(alsa_device_profile* profile, unsigned sample_rate,
+                                unsigned latency_ms, unsigned* period_size,
+                                unsigned* period_count);
 
 #endif /* ANDROID_HARDWARE_LIBHARDWARE_MODULES_USBAUDIO_ALSA_DEVICE_PROFILE_H */
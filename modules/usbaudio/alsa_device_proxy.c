@@ -18,6 +18,8 @@
 /*#define LOG_NDEBUG 0*/
 /*#define LOG_PCM_PARAMS 0*/
 
+#include <errno.h>
+
 #include <log/log.h>
 
 #include "alsa_device_proxy.h"
@@ -27,6 +29,9 @@
 #define DEFAULT_PERIOD_SIZE     1024
 #define DEFAULT_PERIOD_COUNT    2
 
+/* a period lasts much less, waiting longer than this means the device stopped */
+#define MMAP_WAIT_TIMEOUT_MS    500
+
 void proxy_prepare(alsa_device_proxy * proxy, alsa_device_profile* profile,
                    struct pcm_config * config)
 {
@@ -48,9 +53,15 @@ void proxy_prepare(alsa_device_proxy * proxy, alsa_device_profile* profile,
         config->channels != 0 && profile_is_channel_count_valid(profile, config->channels)
             ? config->channels : profile->default_config.channels;
 
-    proxy->alsa_config.period_count = profile->default_config.period_count;
-    proxy->alsa_config.period_size =
-            profile_get_period_size(proxy->profile, proxy->alsa_config.rate);
+    /* periods negotiated by the stream (see profile_calc_period_config()), or the defaults */
+    if (config->period_size != 0 && config->period_count != 0) {
+        proxy->alsa_config.period_count = config->period_count;
+        proxy->alsa_config.period_size = config->period_size;
+    } else {
+        proxy->alsa_config.period_count = profile->default_config.period_count;
+        proxy->alsa_config.period_size =
+                profile_get_period_size(proxy->profile, proxy->alsa_config.rate);
+    }
 
     // Hack for USB accessory audio.
     // Here we set the correct value for period_count if tinyalsa fails to get it from the
@@ -60,15 +71,58 @@ void proxy_prepare(alsa_device_proxy * proxy, alsa_device_profile* profile,
     }
 
     proxy->pcm = NULL;
+    proxy->mmap_requested = proxy->mmap = false;
+    proxy->transferred = 0;
+    proxy->xruns = 0;
+}
+
+void proxy_set_profile(alsa_device_proxy * proxy, alsa_device_profile * profile)
+{
+    ALOGV("proxy_set_profile(card:%d device:%d)", profile->card, profile->device);
+    ALOG_ASSERT(proxy->pcm == NULL);
+    proxy->profile = profile;
+}
+
+void proxy_set_mmap(alsa_device_proxy * proxy, bool mmap)
+{
+    proxy->mmap_requested = mmap;
+}
+
+bool proxy_is_mmap(const alsa_device_proxy * proxy)
+{
+    return proxy->mmap;
 }
 
 int proxy_open(alsa_device_proxy * proxy)
 {
     alsa_device_profile* profile = proxy->profile;
-    ALOGV("proxy_open(card:%d device:%d %s)", profile->card, profile->device,
-          profile->direction == PCM_OUT ? "PCM_OUT" : "PCM_IN");
+    ALOGV("proxy_open(card:%d device:%d %s%s)", profile->card, profile->device,
+          profile->direction == PCM_OUT ? "PCM_OUT" : "PCM_IN",
+          proxy->mmap_requested ? " PCM_MMAP" : "");
+
+    proxy->mmap = false;
+    proxy->mmap_running = false;
+    proxy->mmap_queued_frames = 0;
 
-    proxy->pcm = pcm_open(profile->card, profile->device, profile->direction, &proxy->alsa_config);
+    if (proxy->mmap_requested) {
+        proxy->pcm = pcm_open(profile->card, profile->device, profile->direction | PCM_MMAP,
+                              &proxy->alsa_config);
+        if (proxy->pcm != NULL && pcm_is_ready(proxy->pcm)) {
+            proxy->mmap = true;
+            return 0;
+        }
+        /* not every USB driver can be mapped, fall back to read/write */
+        ALOGW("[%s] proxy_open() mmap failed: %s", LOG_TAG,
+              proxy->pcm != NULL ? pcm_get_error(proxy->pcm) : "");
+        if (proxy->pcm != NULL) {
+            pcm_close(proxy->pcm);
+        }
+    }
+
+    /* underruns are returned by pcm_write() to be counted, it restarts the stream on the next write
+     * (pcm_read() restarts on overruns whatever the flags) */
+    proxy->pcm = pcm_open(profile->card, profile->device, profile->direction | PCM_NORESTART,
+                          &proxy->alsa_config);
     if (proxy->pcm == NULL) {
         return -ENOMEM;
     }
@@ -139,15 +193,167 @@ unsigned proxy_get_latency(const alsa_device_proxy * proxy)
                / proxy_get_sample_rate(proxy);
 }
 
+uint64_t proxy_get_frames_transferred(const alsa_device_proxy * proxy)
+{
+    return proxy->transferred;
+}
+
+unsigned proxy_get_xruns(const alsa_device_proxy * proxy)
+{
+    return proxy->xruns;
+}
+
+/*
+ * Positions, from the frames in the kernel buffer at the time of its last update.
+ */
+static unsigned proxy_get_buffer_frames(const alsa_device_proxy * proxy)
+{
+    return proxy_get_period_size(proxy) * proxy_get_period_count(proxy);
+}
+
+int proxy_get_presentation_position(const alsa_device_proxy * proxy,
+                                    uint64_t * frames, struct timespec * timestamp)
+{
+    if (proxy->pcm == NULL) {
+        /* in standby: everything written has been played */
+        *frames = proxy->transferred;
+        clock_gettime(CLOCK_MONOTONIC, timestamp);
+        return 0;
+    }
+
+    unsigned avail;
+    if (pcm_get_htimestamp(proxy->pcm, &avail, timestamp) != 0) {
+        return -EINVAL;
+    }
+    /* avail is the free space of the buffer, the rest is still to be played */
+    const unsigned buffer_frames = proxy_get_buffer_frames(proxy);
+    if (avail > buffer_frames || proxy->transferred < buffer_frames - avail) {
+        return -EINVAL;
+    }
+    *frames = proxy->transferred - (buffer_frames - avail);
+    return 0;
+}
+
+int proxy_get_capture_position(const alsa_device_proxy * proxy,
+                               int64_t * frames, int64_t * time)
+{
+    if (proxy->pcm == NULL) {
+        return -ENOSYS;
+    }
+
+    unsigned avail;
+    struct timespec timestamp;
+    if (pcm_get_htimestamp(proxy->pcm, &avail, &timestamp) != 0) {
+        return -ENOSYS;
+    }
+    /* avail is captured and not read yet */
+    *frames = proxy->transferred + avail;
+    *time = timestamp.tv_sec * 1000000000LL + timestamp.tv_nsec;
+    return 0;
+}
+
 /*
  * I/O
  */
-int proxy_write(const alsa_device_proxy * proxy, const void *data, unsigned int count)
+int proxy_write(alsa_device_proxy * proxy, const void *data, unsigned int count)
+{
+    int ret = pcm_write(proxy->pcm, data, count);
+    if (ret == -EPIPE) {
+        /* underrun: the stream is restarted with this buffer */
+        proxy->xruns++;
+        ret = pcm_write(proxy->pcm, data, count);
+    }
+    if (ret == 0) {
+        proxy->transferred += pcm_bytes_to_frames(proxy->pcm, count);
+    }
+    return ret;
+}
+
+int proxy_read(alsa_device_proxy * proxy, void *data, unsigned int count)
+{
+    /* pcm_read() recovers from overruns silently, a full buffer before reading is one */
+    unsigned avail;
+    struct timespec timestamp;
+    if (pcm_get_htimestamp(proxy->pcm, &avail, &timestamp) == 0 &&
+            avail >= proxy_get_buffer_frames(proxy)) {
+        proxy->xruns++;
+    }
+
+    int ret = pcm_read(proxy->pcm, data, count);
+    if (ret == 0) {
+        proxy->transferred += pcm_bytes_to_frames(proxy->pcm, count);
+    }
+    return ret;
+}
+
+/* after an xrun, the stream is prepared again and restarted like a new one */
+static int proxy_mmap_recover(alsa_device_proxy * proxy, int error)
 {
-    return pcm_write(proxy->pcm, data, count);
+    ALOGW("[%s] mmap xrun: %d", LOG_TAG, error);
+    proxy->xruns++;
+    proxy->mmap_running = false;
+    proxy->mmap_queued_frames = 0;
+    pcm_prepare(proxy->pcm);
+    return error;
 }
 
-int proxy_read(const alsa_device_proxy * proxy, void *data, unsigned int count)
+int proxy_mmap_begin(alsa_device_proxy * proxy, void ** buffer, unsigned int * frames)
 {
-    return pcm_read(proxy->pcm, data, count);
+    const bool input = proxy->profile->direction == PCM_IN;
+
+    /* capture runs as soon as it is read, playback once a period is queued */
+    if (input && !proxy->mmap_running) {
+        int ret = pcm_start(proxy->pcm);
+        if (ret < 0) {
+            return ret;
+        }
+        proxy->mmap_running = true;
+    }
+
+    for (;;) {
+        int avail = pcm_mmap_avail(proxy->pcm);
+        if (avail < 0) {
+            return proxy_mmap_recover(proxy, avail);
+        }
+        if (avail > 0) {
+            break;
+        }
+        int ret = pcm_wait(proxy->pcm, MMAP_WAIT_TIMEOUT_MS);
+        if (ret == 0) {
+            return -ETIMEDOUT;
+        } else if (ret < 0) {
+            return proxy_mmap_recover(proxy, ret);
+        }
+    }
+
+    void * areas;
+    unsigned offset;
+    int ret = pcm_mmap_begin(proxy->pcm, &areas, &offset, frames);
+    if (ret < 0) {
+        return ret;
+    }
+    proxy->mmap_offset = offset;
+    *buffer = (char *)areas + pcm_frames_to_bytes(proxy->pcm, offset);
+    return 0;
+}
+
+int proxy_mmap_commit(alsa_device_proxy * proxy, unsigned int frames)
+{
+    int ret = pcm_mmap_commit(proxy->pcm, proxy->mmap_offset, frames);
+    if (ret < 0) {
+        return proxy_mmap_recover(proxy, ret);
+    }
+    proxy->transferred += frames;
+
+    if (proxy->profile->direction == PCM_OUT && !proxy->mmap_running) {
+        proxy->mmap_queued_frames += frames;
+        if (proxy->mmap_queued_frames >= proxy->alsa_config.period_size) {
+            ret = pcm_start(proxy->pcm);
+            if (ret < 0) {
+                return ret;
+            }
+            proxy->mmap_running = true;
+        }
+    }
+    return 0;
 }
@@ -17,6 +17,10 @@
 #ifndef ANDROID_HARDWARE_LIBHARDWARE_MODULES_USBAUDIO_ALSA_DEVICE_PROXY_H
 #define ANDROID_HARDWARE_LIBHARDWARE_MODULES_USBAUDIO_ALSA_DEVICE_PROXY_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
 #include <tinyalsa/asoundlib.h>
 
 #include "alsa_device_profile.h"
@@ -27,6 +31,17 @@ typedef struct {
     struct pcm_config alsa_config;
 
     struct pcm * pcm;
+
+    /* mmap mode: the stream is converted straight into/from the DMA ring of the device */
+    bool mmap_requested;                /* set with proxy_set_mmap() before proxy_open() */
+    bool mmap;                          /* the open pcm is mapped */
+    bool mmap_running;
+    unsigned mmap_offset;               /* of the region returned by proxy_mmap_begin() */
+    unsigned mmap_queued_frames;        /* written before playback started */
+
+    /* since proxy_prepare(), across standby */
+    uint64_t transferred;               /* frames written to or read from the device */
+    unsigned xruns;
 } alsa_device_proxy;
 
 void proxy_prepare(alsa_device_proxy * proxy, alsa_device_profile * profile,
@@ -37,13 +52,37 @@ enum pcm_format proxy_get_format(const alsa_device_proxy * proxy);
 unsigned proxy_get_channel_count(const alsa_device_proxy * proxy);
 
 unsigned int proxy_get_period_size(const alsa_device_proxy * proxy);
+unsigned int proxy_get_period_count(const alsa_device_proxy * proxy);
 
 unsigned proxy_get_latency(const alsa_device_proxy * proxy);
 
+uint64_t proxy_get_frames_transferred(const alsa_device_proxy * proxy);
+unsigned proxy_get_xruns(const alsa_device_proxy * proxy);
+int proxy_get_presentation_position(const alsa_device_proxy * proxy,
+                                    uint64_t * frames, struct timespec * timestamp);
+int proxy_get_capture_position(const alsa_device_proxy * proxy,
+                               int64_t * frames, int64_t * time);
+
+/* Moves a closed proxy to the card of profile, keeping its config and frame counts */
+void proxy_set_profile(alsa_device_proxy * proxy, alsa_device_profile * profile);
+
+void proxy_set_mmap(alsa_device_proxy * proxy, bool mmap);
+bool proxy_is_mmap(const alsa_device_proxy * proxy);
+
 int proxy_open(alsa_device_proxy * proxy);
 void proxy_close(alsa_device_proxy * proxy);
 
-int proxy_write(const alsa_device_proxy * proxy, const void *data, unsigned int count);
-int proxy_read(const alsa_device_proxy * proxy, void *data, unsigned int count);
+int proxy_write(alsa_device_proxy * proxy, const void *data, unsigned int count);
+int proxy_read(alsa_device_proxy * proxy, void *data, unsigned int count);
+
+/*
+ * mmap I/O, only when proxy_is_mmap(). proxy_mmap_begin() waits for the device and returns the
+ * contiguous region of the ring that can be written (PCM_OUT) or read (PCM_IN) now, at most
+ * *frames frames, which proxy_mmap_commit() hands over once converted.
+ * Both return 0 or a negative errno, after an xrun the stream is prepared again and the next
+ * proxy_mmap_begin() restarts it.
+ */
+int proxy_mmap_begin(alsa_device_proxy * proxy, void ** buffer, unsigned int * frames);
+int proxy_mmap_commit(alsa_device_proxy * proxy, unsigned int frames);
 
 #endif /* ANDROID_HARDWARE_LIBHARDWARE_MODULES_USBAUDIO_ALSA_DEVICE_PROXY_H */
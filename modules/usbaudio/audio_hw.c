@@ -21,7 +21,10 @@
 #include <inttypes.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 
 #include <log/log.h>
@@ -33,6 +36,7 @@
 #include <hardware/hardware.h>
 
 #include <system/audio.h>
+#include <system/thread_defs.h>
 
 #include <tinyalsa/asoundlib.h>
 
@@ -51,20 +55,44 @@ static const unsigned k_force_channels = 0;
 
 #include "alsa_device_profile.h"
 #include "alsa_device_proxy.h"
+#include "audio_effect_chain.h"
+#include "conversion.h"
+#include "format.h"
 #include "logging.h"
 
 #define DEFAULT_INPUT_BUFFER_SIZE_MS 20
 
+/* latency requested from the device by outputs of the fast mixer (AUDIO_OUTPUT_FLAG_FAST) */
+#define LOW_LATENCY_OUTPUT_MS 4
+
+/* latency requested from the device by deep buffer outputs (AUDIO_OUTPUT_FLAG_DEEP_BUFFER),
+ * whose writer thread also queues as much again, see struct stream_out */
+#define DEEP_BUFFER_OUTPUT_MS 100
+
+/* number of USB cards (card and device pairs) whose profiles are kept, per direction */
+#define MAX_CARD_PROFILES 8
+
+/* a profile of the tables of the device, with the number of streams using it */
+typedef struct {
+    alsa_device_profile profile;        /* first, see card_profile_of() */
+    unsigned num_streams;
+} card_profile;
+
 struct audio_device {
     struct audio_hw_device hw_device;
 
     pthread_mutex_t lock; /* see note below on mutex acquisition order */
 
+    /* Profiles of the cards attached, probed when first routed to and kept until they are
+     * disconnected, so that streams move between cards without probing them again. The
+     * current profile is the one streams are opened on, the card routed to last. */
     /* output */
-    alsa_device_profile out_profile;
+    card_profile out_profiles[MAX_CARD_PROFILES];
+    alsa_device_profile * out_profile;
 
     /* input */
-    alsa_device_profile in_profile;
+    card_profile in_profiles[MAX_CARD_PROFILES];
+    alsa_device_profile * in_profile;
 
     bool mic_muted;
 
@@ -75,7 +103,8 @@ struct stream_out {
     struct audio_stream_out stream;
 
     pthread_mutex_t lock;               /* see note below on mutex acquisition order */
-    bool standby;
+    bool standby;                       /* changed with both the device and stream locks held,
+                                         * so either one is enough to read it */
 
     struct audio_device *dev;           /* hardware information - only using this for the lock */
 
@@ -89,15 +118,42 @@ struct stream_out {
                                          * too few channels. */
     void * conversion_buffer;           /* any conversions are put into here
                                          * they could come from here too if
-                                         * there was a previous conversion */
+                                         * there was a previous conversion.
+                                         * Allocated at open for a period of device frames,
+                                         * the write path never allocates. */
     size_t conversion_buffer_size;      /* in bytes */
+
+    uint64_t standby_exit_frames;       /* frames written before leaving standby last */
+
+    /* Deep buffer outputs (AUDIO_OUTPUT_FLAG_DEEP_BUFFER): out_write() only queues the buffer
+     * of the framework in fifo, the writer thread writes it to the device a period at a time.
+     * With long periods, neither the framework nor the writer wake up often. */
+    bool deep_buffer;
+    pthread_t writer_thread;
+    pthread_mutex_t fifo_lock;          /* protects what follows, taken after the stream lock */
+    pthread_cond_t fifo_cond;           /* signaled when fifo is written to or read from */
+    uint8_t * fifo;                     /* fifo_size bytes of HAL frames */
+    size_t fifo_size;
+    size_t fifo_front;                  /* offset of the oldest byte */
+    size_t fifo_bytes;                  /* queued */
+    bool writer_exiting;
+    void * writer_buffer;               /* a period of HAL frames, writer thread only */
+    size_t writer_buffer_size;          /* in bytes */
+
+    /* Effects the framework attached to the stream, run on the HAL frames as they are
+     * written to the device, into effect_buffer. */
+    struct audio_effect_chain effects;
+    void * effect_buffer;               /* a period of HAL frames, allocated with the first
+                                         * effect of a PCM16 stream, NULL for other formats */
+    size_t effect_buffer_size;          /* in bytes */
 };
 
 struct stream_in {
     struct audio_stream_in stream;
 
     pthread_mutex_t lock; /* see note below on mutex acquisition order */
-    bool standby;
+    bool standby;                       /* changed with both the device and stream locks held,
+                                         * so either one is enough to read it */
 
     struct audio_device *dev;           /* hardware information - only using this for the lock */
 
@@ -109,79 +165,87 @@ struct stream_in {
                                          * the device is not compatible with AudioFlinger
                                          * capabilities, e.g. exposes too many channels or
                                          * too few channels. */
+    audio_format_t hal_format;          /* format exposed to AudioFlinger: either the native
+                                         * format of the device, read as is, or PCM16 which
+                                         * in_read() converts the device format to. */
     /* We may need to read more data from the device in order to data reduce to 16bit, 4chan */
-    void * conversion_buffer;           /* any conversions are put into here
-                                         * they could come from here too if
-                                         * there was a previous conversion */
+    void * conversion_buffer;           /* device data is read into here and converted
+                                         * to the buffer of AudioFlinger.
+                                         * Allocated at open for a period of device frames,
+                                         * the read path never allocates. */
     size_t conversion_buffer_size;      /* in bytes */
+
+    unsigned xruns_reported;            /* by in_get_input_frames_lost() */
+
+    conversion_dither dither;           /* state of the dither reducing samples to 16 bits */
+    bool dither_enabled;
+
+    /* Effects the framework attached to the stream, run in place on the buffer of AudioFlinger
+     * as each chunk is converted into it. Only PCM16 streams run them. */
+    struct audio_effect_chain effects;
 };
 
+static card_profile * card_profile_of(alsa_device_profile * profile)
+{
+    return (card_profile *)profile;
+}
+
 /*
- * Data Conversions
- */
-/*
- * Convert a buffer of packed (3-byte) PCM24LE samples to PCM16LE samples.
- *   in_buff points to the buffer of PCM24LE samples
- *   num_in_samples size of input buffer in SAMPLES
- *   out_buff points to the buffer to receive converted PCM16LE LE samples.
- * returns
- *   the number of BYTES of output data.
- * We are doing this since we *always* present to The Framework as A PCM16LE device, but need to
- * support PCM24_3LE (24-bit, packed).
- * NOTE:
- *   This conversion is safe to do in-place (in_buff == out_buff).
- * TODO Move this to a utilities module.
+ * Returns the profile of card and device in profiles, read from the device, or the profile
+ * cache, if it isn't kept yet, in an unused slot or else in place of a card no stream uses.
+ * Returns NULL if the device can't be read or all the slots are in use.
+ * Must be called with the hw device mutex locked.
  */
-static size_t convert_24_3_to_16(const unsigned char * in_buff, size_t num_in_samples,
-                                 short * out_buff)
+static alsa_device_profile * adev_get_card_profile_l(card_profile * profiles, int direction,
+                                                     int card, int device)
 {
-    /*
-     * Move from front to back so that the conversion can be done in-place
-     * i.e. in_buff == out_buff
-     */
-    /* we need 2 bytes in the output for every 3 bytes in the input */
-    unsigned char* dst_ptr = (unsigned char*)out_buff;
-    const unsigned char* src_ptr = in_buff;
-    size_t src_smpl_index;
-    for (src_smpl_index = 0; src_smpl_index < num_in_samples; src_smpl_index++) {
-        src_ptr++;               /* lowest-(skip)-byte */
-        *dst_ptr++ = *src_ptr++; /* low-byte */
-        *dst_ptr++ = *src_ptr++; /* high-byte */
+    card_profile * slot = NULL;
+    size_t i;
+
+    for (i = 0; i < MAX_CARD_PROFILES; i++) {
+        if (profile_is_cached_for(&profiles[i].profile, card, device) &&
+                profile_is_valid(&profiles[i].profile)) {
+            return &profiles[i].profile;
+        }
+        if (profiles[i].num_streams == 0 &&
+                (slot == NULL || !profile_is_initialized(&profiles[i].profile))) {
+            slot = &profiles[i];
+        }
+    }
+    if (slot == NULL) {
+        ALOGE("usb:audio_hw no room for the profile of card %d device %d", card, device);
+        return NULL;
     }
 
-    /* return number of *bytes* generated: */
-    return num_in_samples * 2;
+    profile_init(&slot->profile, direction);
+    slot->profile.card = card;
+    slot->profile.device = device;
+    if (!profile_read_device_info(&slot->profile)) {
+        profile_decache(&slot->profile);
+        return NULL;
+    }
+    return &slot->profile;
 }
 
 /*
- * Convert a buffer of packed (3-byte) PCM32 samples to PCM16LE samples.
- *   in_buff points to the buffer of PCM32 samples
- *   num_in_samples size of input buffer in SAMPLES
- *   out_buff points to the buffer to receive converted PCM16LE LE samples.
- * returns
- *   the number of BYTES of output data.
- * We are doing this since we *always* present to The Framework as A PCM16LE device, but need to
- * support PCM_FORMAT_S32_LE (32-bit).
- * NOTE:
- *   This conversion is safe to do in-place (in_buff == out_buff).
- * TODO Move this to a utilities module.
+ * Moves a stream using *stream_profile to profile.
+ * Must be called with the hw device mutex locked, and the proxy of the stream closed.
  */
-static size_t convert_32_to_16(const int32_t * in_buff, size_t num_in_samples, short * out_buff)
+static void adev_move_stream_l(alsa_device_profile ** stream_profile, alsa_device_proxy * proxy,
+                               alsa_device_profile * profile)
 {
-    /*
-     * Move from front to back so that the conversion can be done in-place
-     * i.e. in_buff == out_buff
-     */
-
-    short * dst_ptr = out_buff;
-    const int32_t* src_ptr = in_buff;
-    size_t src_smpl_index;
-    for (src_smpl_index = 0; src_smpl_index < num_in_samples; src_smpl_index++) {
-        *dst_ptr++ = *src_ptr++ >> 16;
-    }
+    card_profile_of(*stream_profile)->num_streams--;
+    card_profile_of(profile)->num_streams++;
+    *stream_profile = profile;
+    proxy_set_profile(proxy, profile);
+}
 
-    /* return number of *bytes* generated: */
-    return num_in_samples * 2;
+/* Releases the profile of a stream being closed. */
+static void adev_release_profile(struct audio_device * adev, alsa_device_profile * profile)
+{
+    pthread_mutex_lock(&adev->lock);
+    card_profile_of(profile)->num_streams--;
+    pthread_mutex_unlock(&adev->lock);
 }
 
 static char * device_get_parameters(alsa_device_profile * profile, const char * keys)
@@ -235,6 +299,9 @@ static char * device_get_parameters(alsa_device_profile * profile, const char *
 /**
  * NOTE: when multiple mutexes have to be acquired, always respect the
  * following order: hw device > out stream
+ * The write and read paths only hold the stream lock while streaming, the
+ * device lock is taken to leave standby (see out_write()). The fifo lock of
+ * deep buffer outputs comes last.
  */
 
 /*
@@ -268,9 +335,8 @@ static uint32_t out_get_channels(const struct audio_stream *stream)
 
 static audio_format_t out_get_format(const struct audio_stream *stream)
 {
-    /* Note: The HAL doesn't do any FORMAT conversion at this time. It
-     * Relies on the framework to provide data in the specified format.
-     * This could change in the future.
+    /* Note: The HAL doesn't do any FORMAT conversion on output. The framework provides data in
+     * the native format of the device (e.g. 24-bit packed) which is written to it as is.
      */
     alsa_device_proxy * proxy = &((struct stream_out*)stream)->proxy;
     audio_format_t format = audio_format_from_pcm_format(proxy_get_format(proxy));
@@ -282,6 +348,23 @@ static int out_set_format(struct audio_stream *stream, audio_format_t format)
     return 0;
 }
 
+/* must be called with hw device and output stream mutexes locked */
+static void out_standby_l(struct stream_out *out)
+{
+    if (!out->standby) {
+        proxy_close(&out->proxy);
+        out->standby = true;
+        if (out->deep_buffer) {
+            /* the framework only goes to standby once what it wrote was played, what is left
+             * is stale */
+            pthread_mutex_lock(&out->fifo_lock);
+            out->fifo_bytes = 0;
+            pthread_cond_broadcast(&out->fifo_cond);
+            pthread_mutex_unlock(&out->fifo_lock);
+        }
+    }
+}
+
 static int out_standby(struct audio_stream *stream)
 {
     struct stream_out *out = (struct stream_out *)stream;
@@ -289,10 +372,7 @@ static int out_standby(struct audio_stream *stream)
     pthread_mutex_lock(&out->dev->lock);
     pthread_mutex_lock(&out->lock);
 
-    if (!out->standby) {
-        proxy_close(&out->proxy);
-        out->standby = true;
-    }
+    out_standby_l(out);
 
     pthread_mutex_unlock(&out->lock);
     pthread_mutex_unlock(&out->dev->lock);
@@ -302,6 +382,21 @@ static int out_standby(struct audio_stream *stream)
 
 static int out_dump(const struct audio_stream *stream, int fd)
 {
+    /* not locked, a blocked write must not block dumpsys */
+    const struct stream_out *out = (const struct stream_out *)stream;
+    const alsa_device_proxy * proxy = &out->proxy;
+    dprintf(fd, "  USB output: card %d device %d%s%s\n", out->profile->card,
+            out->profile->device, out->standby ? ", standby" : "",
+            proxy_is_mmap(proxy) ? ", mmap" : "");
+    dprintf(fd, "    %u Hz, %u channels (%u to the framework), pcm format %d, periods %u x %u\n",
+            proxy_get_sample_rate(proxy), proxy_get_channel_count(proxy),
+            out->hal_channel_count, proxy_get_format(proxy), proxy_get_period_count(proxy),
+            proxy_get_period_size(proxy));
+    dprintf(fd, "    frames written: %" PRIu64 ", underruns: %u\n",
+            proxy_get_frames_transferred(proxy), proxy_get_xruns(proxy));
+    if (out->deep_buffer) {
+        dprintf(fd, "    deep buffer: %zu of %zu bytes queued\n", out->fifo_bytes, out->fifo_size);
+    }
     return 0;
 }
 
@@ -331,19 +426,15 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
         device = atoi(value);
 
     if (card >= 0 && device >= 0 && !profile_is_cached_for(out->profile, card, device)) {
-        /* cannot read pcm device info if playback is active */
-        if (!out->standby)
-            ret_value = -ENOSYS;
-        else {
-            int saved_card = out->profile->card;
-            int saved_device = out->profile->device;
-            out->profile->card = card;
-            out->profile->device = device;
-            ret_value = profile_read_device_info(out->profile) ? 0 : -EINVAL;
-            if (ret_value != 0) {
-                out->profile->card = saved_card;
-                out->profile->device = saved_device;
-            }
+        alsa_device_profile * profile =
+                adev_get_card_profile_l(out->dev->out_profiles, PCM_OUT, card, device);
+        if (profile == NULL) {
+            ret_value = -EINVAL;
+        } else {
+            /* playback resumes on the new card with the next write */
+            out_standby_l(out);
+            adev_move_stream_l(&out->profile, &out->proxy, profile);
+            out->dev->out_profile = profile;
         }
     }
 
@@ -370,8 +461,13 @@ static char * out_get_parameters(const struct audio_stream *stream, const char *
 
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
-    alsa_device_proxy * proxy = &((struct stream_out*)stream)->proxy;
-    return proxy_get_latency(proxy);
+    const struct stream_out *out = (const struct stream_out *)stream;
+    uint32_t latency = proxy_get_latency(&out->proxy);
+    if (out->deep_buffer) {
+        latency += out->fifo_size / audio_stream_out_frame_size(stream) * 1000 /
+                proxy_get_sample_rate(&out->proxy);
+    }
+    return latency;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left, float right)
@@ -388,51 +484,247 @@ static int start_output_stream(struct stream_out *out)
     return proxy_open(&out->proxy);
 }
 
-static ssize_t out_write(struct audio_stream_out *stream, const void* buffer, size_t bytes)
+/*
+ * Writes in mmap mode: any channel conversion is done straight into the DMA ring of the device.
+ * Must be called with the output stream mutex locked.
+ */
+static void out_write_mmap(struct stream_out *out, const void * buffer, size_t bytes)
 {
-    int ret;
-    struct stream_out *out = (struct stream_out *)stream;
+    const unsigned num_device_channels = proxy_get_channel_count(&out->proxy);
+    const unsigned num_req_channels = out->hal_channel_count;
+    const unsigned sample_size_in_bytes =
+            audio_bytes_per_sample(out_get_format(&(out->stream.common)));
+    const size_t hal_frame_size = num_req_channels * sample_size_in_bytes;
+    const uint8_t * write_buff = (const uint8_t *)buffer;
+    size_t remaining_frames = bytes / hal_frame_size;
+    while (remaining_frames != 0) {
+        void * ring_buff;
+        unsigned int frames = remaining_frames;
+        if (proxy_mmap_begin(&out->proxy, &ring_buff, &frames) != 0) {
+            break;
+        }
+        if (num_device_channels == num_req_channels) {
+            memcpy(ring_buff, write_buff, frames * hal_frame_size);
+        } else {
+            adjust_channels(write_buff, num_req_channels, ring_buff, num_device_channels,
+                            sample_size_in_bytes, frames * hal_frame_size);
+        }
+        if (proxy_mmap_commit(&out->proxy, frames) != 0) {
+            break;
+        }
+        write_buff += frames * hal_frame_size;
+        remaining_frames -= frames;
+    }
+}
+
+/*
+ * Writes HAL frames to the device, converted. Returns 0 or a negative errno.
+ * Must be called with the output stream mutex locked, out of standby.
+ */
+static int out_write_converted(struct stream_out *out, const void * buffer, size_t bytes)
+{
+    if (proxy_is_mmap(&out->proxy)) {
+        out_write_mmap(out, buffer, bytes);
+        return 0;
+    }
+    if (out->conversion_buffer == NULL) {
+        return proxy_write(&out->proxy, buffer, bytes);
+    }
+
+    /* the conversion buffer holds a period of device frames, larger writes are converted
+     * a period at a time */
+    const unsigned num_device_channels = proxy_get_channel_count(&out->proxy);
+    const unsigned num_req_channels = out->hal_channel_count;
+    const unsigned sample_size_in_bytes =
+            audio_bytes_per_sample(out_get_format(&(out->stream.common)));
+    const size_t hal_frame_size = num_req_channels * sample_size_in_bytes;
+    const size_t max_chunk_bytes = out->conversion_buffer_size /
+            (num_device_channels * sample_size_in_bytes) * hal_frame_size;
+    const uint8_t * write_buff = (const uint8_t *)buffer;
+    size_t remaining = bytes - bytes % hal_frame_size;
+    while (remaining != 0) {
+        const size_t chunk_bytes = remaining < max_chunk_bytes ? remaining : max_chunk_bytes;
+        const size_t num_write_buff_bytes =
+                adjust_channels(write_buff, num_req_channels,
+                                out->conversion_buffer, num_device_channels,
+                                sample_size_in_bytes, chunk_bytes);
+        int ret = proxy_write(&out->proxy, out->conversion_buffer, num_write_buff_bytes);
+        if (ret != 0) {
+            return ret;
+        }
+        write_buff += chunk_bytes;
+        remaining -= chunk_bytes;
+    }
+    return 0;
+}
+
+/*
+ * Writes HAL frames to the device through the effects of the stream, if any. A period at a time
+ * is processed from buffer into the effect buffer and converted from there, so the effects don't
+ * cost a pass of their own. Returns 0 or a negative errno.
+ * Must be called with the output stream mutex locked, out of standby.
+ */
+static int out_write_device(struct stream_out *out, const void * buffer, size_t bytes)
+{
+    if (out->effect_buffer == NULL || audio_effect_chain_is_empty(&out->effects)) {
+        return out_write_converted(out, buffer, bytes);
+    }
+
+    const size_t hal_frame_size = audio_stream_out_frame_size(&out->stream);
+    const size_t max_chunk_frames = out->effect_buffer_size / hal_frame_size;
+    const int16_t * write_buff = (const int16_t *)buffer;
+    size_t remaining_frames = bytes / hal_frame_size;
+    while (remaining_frames != 0) {
+        const size_t frames =
+                remaining_frames < max_chunk_frames ? remaining_frames : max_chunk_frames;
+        const void * processed =
+                audio_effect_chain_process(&out->effects, write_buff,
+                                           (int16_t *)out->effect_buffer, frames) ?
+                out->effect_buffer : (const void *)write_buff;
+        int ret = out_write_converted(out, processed, frames * hal_frame_size);
+        if (ret != 0) {
+            return ret;
+        }
+        write_buff += frames * out->hal_channel_count;
+        remaining_frames -= frames;
+    }
+    return 0;
+}
+
+/*
+ * Queues bytes of HAL frames for the writer thread of a deep buffer output, waiting for room
+ * as needed. Must be called without the output stream mutex locked.
+ */
+static void out_queue(struct stream_out *out, const void * buffer, size_t bytes)
+{
+    const uint8_t * data = (const uint8_t *)buffer;
+
+    pthread_mutex_lock(&out->fifo_lock);
+    while (bytes != 0 && !out->writer_exiting) {
+        if (out->fifo_bytes == out->fifo_size) {
+            pthread_cond_wait(&out->fifo_cond, &out->fifo_lock);
+            continue;
+        }
+        const size_t rear = (out->fifo_front + out->fifo_bytes) % out->fifo_size;
+        size_t chunk = out->fifo_size - out->fifo_bytes;
+        if (chunk > out->fifo_size - rear) {
+            chunk = out->fifo_size - rear;
+        }
+        if (chunk > bytes) {
+            chunk = bytes;
+        }
+        memcpy(out->fifo + rear, data, chunk);
+        out->fifo_bytes += chunk;
+        data += chunk;
+        bytes -= chunk;
+        pthread_cond_broadcast(&out->fifo_cond);
+    }
+    pthread_mutex_unlock(&out->fifo_lock);
+}
+
+/* Writer thread of deep buffer outputs: writes what out_queue() queued to the device. */
+static void * out_writer_thread(void * context)
+{
+    struct stream_out *out = (struct stream_out *)context;
+
+    prctl(PR_SET_NAME, (unsigned long)"usb deep writer", 0, 0, 0);
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_AUDIO);
+
+    pthread_mutex_lock(&out->fifo_lock);
+    for (;;) {
+        while (out->fifo_bytes == 0 && !out->writer_exiting) {
+            pthread_cond_wait(&out->fifo_cond, &out->fifo_lock);
+        }
+        if (out->writer_exiting) {
+            break;
+        }
+        size_t bytes = out->fifo_bytes;
+        if (bytes > out->writer_buffer_size) {
+            bytes = out->writer_buffer_size;
+        }
+        const size_t first = bytes < out->fifo_size - out->fifo_front ?
+                bytes : out->fifo_size - out->fifo_front;
+        memcpy(out->writer_buffer, out->fifo + out->fifo_front, first);
+        memcpy((uint8_t *)out->writer_buffer + first, out->fifo, bytes - first);
+        out->fifo_front = (out->fifo_front + bytes) % out->fifo_size;
+        out->fifo_bytes -= bytes;
+        pthread_cond_broadcast(&out->fifo_cond);
+        pthread_mutex_unlock(&out->fifo_lock);
+
+        /* out_standby() may have closed the device meanwhile */
+        pthread_mutex_lock(&out->lock);
+        if (!out->standby) {
+            out_write_device(out, out->writer_buffer, bytes);
+        }
+        pthread_mutex_unlock(&out->lock);
+
+        pthread_mutex_lock(&out->fifo_lock);
+    }
+    pthread_mutex_unlock(&out->fifo_lock);
+
+    return NULL;
+}
+
+/*
+ * out_write() of deep buffer outputs. The writer thread holds the stream lock while it writes
+ * to the device, so standby is checked with the device lock instead, and the stream lock only
+ * taken to leave it, when the writer is idle.
+ */
+static ssize_t out_write_deep_buffer(struct stream_out *out, const void * buffer, size_t bytes)
+{
+    int ret = 0;
 
     pthread_mutex_lock(&out->dev->lock);
-    pthread_mutex_lock(&out->lock);
     if (out->standby) {
+        pthread_mutex_lock(&out->lock);
         ret = start_output_stream(out);
-        if (ret != 0) {
-            pthread_mutex_unlock(&out->dev->lock);
-            goto err;
+        if (ret == 0) {
+            out->standby = false;
+            out->standby_exit_frames = proxy_get_frames_transferred(&out->proxy);
         }
-        out->standby = false;
+        pthread_mutex_unlock(&out->lock);
     }
     pthread_mutex_unlock(&out->dev->lock);
 
-    alsa_device_proxy* proxy = &out->proxy;
-    const void * write_buff = buffer;
-    int num_write_buff_bytes = bytes;
-    const int num_device_channels = proxy_get_channel_count(proxy); /* what we told alsa */
-    const int num_req_channels = out->hal_channel_count; /* what we told AudioFlinger */
-    if (num_device_channels != num_req_channels) {
-        /* allocate buffer */
-        const size_t required_conversion_buffer_size =
-                 bytes * num_device_channels / num_req_channels;
-        if (required_conversion_buffer_size > out->conversion_buffer_size) {
-            out->conversion_buffer_size = required_conversion_buffer_size;
-            out->conversion_buffer = realloc(out->conversion_buffer,
-                                             out->conversion_buffer_size);
-        }
-        /* convert data */
-        const audio_format_t audio_format = out_get_format(&(out->stream.common));
-        const unsigned sample_size_in_bytes = audio_bytes_per_sample(audio_format);
-        num_write_buff_bytes =
-                adjust_channels(write_buff, num_req_channels,
-                                out->conversion_buffer, num_device_channels,
-                                sample_size_in_bytes, num_write_buff_bytes);
-        write_buff = out->conversion_buffer;
+    if (ret != 0) {
+        usleep(bytes * 1000000 / audio_stream_out_frame_size(&out->stream) /
+               out_get_sample_rate(&out->stream.common));
+    } else {
+        out_queue(out, buffer, bytes);
     }
+    return bytes;
+}
 
-    if (write_buff != NULL && num_write_buff_bytes != 0) {
-        proxy_write(&out->proxy, write_buff, num_write_buff_bytes);
+static ssize_t out_write(struct audio_stream_out *stream, const void* buffer, size_t bytes)
+{
+    int ret;
+    struct stream_out *out = (struct stream_out *)stream;
+
+    if (out->deep_buffer) {
+        return out_write_deep_buffer(out, buffer, bytes);
     }
 
+    /* The device lock is only needed to leave standby. It comes before the stream lock, so
+     * that lock is released and standby checked again once both are held. */
+    pthread_mutex_lock(&out->lock);
+    if (out->standby) {
+        pthread_mutex_unlock(&out->lock);
+        pthread_mutex_lock(&out->dev->lock);
+        pthread_mutex_lock(&out->lock);
+        if (out->standby) {
+            ret = start_output_stream(out);
+            if (ret != 0) {
+                pthread_mutex_unlock(&out->dev->lock);
+                goto err;
+            }
+            out->standby = false;
+            out->standby_exit_frames = proxy_get_frames_transferred(&out->proxy);
+        }
+        pthread_mutex_unlock(&out->dev->lock);
+    }
+
+    out_write_device(out, buffer, bytes);
+
     pthread_mutex_unlock(&out->lock);
 
     return bytes;
@@ -449,24 +741,67 @@ err:
 
 static int out_get_render_position(const struct audio_stream_out *stream, uint32_t *dsp_frames)
 {
-    return -EINVAL;
+    struct stream_out *out = (struct stream_out *)stream;
+    uint64_t frames;
+    struct timespec timestamp;
+
+    pthread_mutex_lock(&out->lock);
+    int ret = proxy_get_presentation_position(&out->proxy, &frames, &timestamp);
+    if (ret == 0) {
+        /* since the last exit from standby, as the framework expects */
+        *dsp_frames = frames > out->standby_exit_frames
+                ? (uint32_t)(frames - out->standby_exit_frames) : 0;
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
 }
 
 static int out_get_presentation_position(const struct audio_stream_out *stream,
                                          uint64_t *frames, struct timespec *timestamp)
 {
-    /* FIXME - This needs to be implemented */
-    return -EINVAL;
+    struct stream_out *out = (struct stream_out *)stream;
+
+    pthread_mutex_lock(&out->lock);
+    int ret = proxy_get_presentation_position(&out->proxy, frames, timestamp);
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
 }
 
+/*
+ * Effects are only run on PCM16 streams, the framework keeps running them itself on others.
+ * The effect buffer is allocated here so that the write path never allocates.
+ */
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-    return 0;
+    struct stream_out *out = (struct stream_out *)stream;
+
+    if (out_get_format(stream) != AUDIO_FORMAT_PCM_16_BIT) {
+        return -ENOSYS;
+    }
+
+    pthread_mutex_lock(&out->lock);
+    if (out->effect_buffer == NULL) {
+        out->effect_buffer_size =
+                proxy_get_period_size(&out->proxy) * audio_stream_out_frame_size(&out->stream);
+        out->effect_buffer = malloc(out->effect_buffer_size);
+        if (out->effect_buffer == NULL) {
+            out->effect_buffer_size = 0;
+            pthread_mutex_unlock(&out->lock);
+            return -ENOMEM;
+        }
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return audio_effect_chain_add(&out->effects, effect);
 }
 
 static int out_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-    return 0;
+    struct stream_out *out = (struct stream_out *)stream;
+
+    return audio_effect_chain_remove(&out->effects, effect);
 }
 
 static int out_get_next_write_timestamp(const struct audio_stream_out *stream, int64_t *timestamp)
@@ -515,7 +850,10 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 
     out->dev = adev;
 
-    out->profile = &adev->out_profile;
+    pthread_mutex_lock(&adev->lock);
+    out->profile = adev->out_profile;
+    card_profile_of(out->profile)->num_streams++;
+    pthread_mutex_unlock(&adev->lock);
 
     // build this to hand to the alsa_device_proxy
     struct pcm_config proxy_config;
@@ -538,8 +876,9 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
         proxy_config.format = profile_get_default_format(out->profile);
         config->format = audio_format_from_pcm_format(proxy_config.format);
     } else {
-        enum pcm_format fmt = pcm_format_from_audio_format(config->format);
-        if (profile_is_format_valid(out->profile, fmt)) {
+        /* formats ALSA can't represent (AUDIO_FORMAT_PCM_FLOAT) are refused like invalid ones */
+        enum pcm_format fmt = get_pcm_format_for_audio_format(config->format);
+        if (fmt != PCM_FORMAT_INVALID && profile_is_format_valid(out->profile, fmt)) {
             proxy_config.format = fmt;
         } else {
             proxy_config.format = profile_get_default_format(out->profile);
@@ -562,21 +901,75 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
      * and we emulate any channel count discrepancies in out_write(). */
     proxy_config.channels = proposed_channel_count;
 
+    /* Periods */
+    if ((flags & AUDIO_OUTPUT_FLAG_FAST) != 0) {
+        profile_calc_period_config(out->profile, proxy_config.rate, LOW_LATENCY_OUTPUT_MS,
+                                   &proxy_config.period_size, &proxy_config.period_count);
+    } else if ((flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) != 0) {
+        profile_calc_period_config(out->profile, proxy_config.rate, DEEP_BUFFER_OUTPUT_MS,
+                                   &proxy_config.period_size, &proxy_config.period_count);
+        out->deep_buffer = true;
+    }
+
     proxy_prepare(&out->proxy, out->profile, &proxy_config);
 
+    /* write straight into the DMA ring of the device, where its driver allows mapping it */
+    char value[PROPERTY_VALUE_MAX];
+    property_get("persist.audio.usb.mmap", value, "0");
+    proxy_set_mmap(&out->proxy, atoi(value) != 0);
+
     /* TODO The retry mechanism isn't implemented in AudioPolicyManager/AudioFlinger. */
     ret = 0;
 
+    /* only channel count differences are converted on output */
     out->conversion_buffer = NULL;
     out->conversion_buffer_size = 0;
+    if (proxy_get_channel_count(&out->proxy) != out->hal_channel_count) {
+        out->conversion_buffer_size = proxy_get_period_size(&out->proxy) *
+                proxy_get_channel_count(&out->proxy) *
+                audio_bytes_per_sample(audio_format_from_pcm_format(proxy_get_format(&out->proxy)));
+        out->conversion_buffer = malloc(out->conversion_buffer_size);
+        if (out->conversion_buffer == NULL) {
+            adev_release_profile(adev, out->profile);
+            free(out);
+            *stream_out = NULL;
+            return -ENOMEM;
+        }
+    }
+
+    /* the fifo holds as many HAL frames as the device buffer */
+    if (out->deep_buffer) {
+        const size_t hal_frame_size = audio_stream_out_frame_size(&out->stream);
+        out->writer_buffer_size = proxy_get_period_size(&out->proxy) * hal_frame_size;
+        out->fifo_size = out->writer_buffer_size * proxy_get_period_count(&out->proxy);
+        out->writer_buffer = malloc(out->writer_buffer_size);
+        out->fifo = malloc(out->fifo_size);
+        pthread_mutex_init(&out->fifo_lock, NULL);
+        pthread_cond_init(&out->fifo_cond, NULL);
+        if (out->writer_buffer == NULL || out->fifo == NULL ||
+                pthread_create(&out->writer_thread, NULL, out_writer_thread, out) != 0) {
+            ALOGE("usb:audio_hw::out can't start the deep buffer writer");
+            pthread_cond_destroy(&out->fifo_cond);
+            pthread_mutex_destroy(&out->fifo_lock);
+            free(out->fifo);
+            free(out->writer_buffer);
+            free(out->conversion_buffer);
+            adev_release_profile(adev, out->profile);
+            free(out);
+            *stream_out = NULL;
+            return -ENOMEM;
+        }
+    }
 
     out->standby = true;
+    audio_effect_chain_init(&out->effects);
 
     *stream_out = &out->stream;
 
     return ret;
 
 err_open:
+    adev_release_profile(adev, out->profile);
     free(out);
     *stream_out = NULL;
     return -ENOSYS;
@@ -591,7 +984,22 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
     /* Close the pcm device */
     out_standby(&stream->common);
 
+    if (out->deep_buffer) {
+        pthread_mutex_lock(&out->fifo_lock);
+        out->writer_exiting = true;
+        pthread_cond_broadcast(&out->fifo_cond);
+        pthread_mutex_unlock(&out->fifo_lock);
+        pthread_join(out->writer_thread, NULL);
+        pthread_cond_destroy(&out->fifo_cond);
+        pthread_mutex_destroy(&out->fifo_lock);
+        free(out->fifo);
+        free(out->writer_buffer);
+    }
+
     free(out->conversion_buffer);
+    free(out->effect_buffer);
+    audio_effect_chain_destroy(&out->effects);
+    adev_release_profile(out->dev, out->profile);
 
     out->conversion_buffer = NULL;
     out->conversion_buffer_size = 0;
@@ -636,16 +1044,9 @@ static uint32_t in_get_channels(const struct audio_stream *stream)
 
 static audio_format_t in_get_format(const struct audio_stream *stream)
 {
-    /* TODO Here is the code we need when we support arbitrary input formats
-     * alsa_device_proxy * proxy = ((struct stream_in*)stream)->proxy;
-     * audio_format_t format = audio_format_from_pcm_format(proxy_get_format(proxy));
-     * ALOGV("in_get_format() = %d", format);
-     * return format;
-     */
-    /* Input only supports PCM16 */
-    /* TODO When AudioPolicyManager & AudioFlinger supports arbitrary input formats
-       rewrite this to return the ACTUAL channel format (above) */
-    return AUDIO_FORMAT_PCM_16_BIT;
+    const struct stream_in *in = (const struct stream_in*)stream;
+    ALOGV("in_get_format() = %d", in->hal_format);
+    return in->hal_format;
 }
 
 static int in_set_format(struct audio_stream *stream, audio_format_t format)
@@ -675,6 +1076,18 @@ static int in_standby(struct audio_stream *stream)
 
 static int in_dump(const struct audio_stream *stream, int fd)
 {
+    /* not locked, as out_dump() */
+    const struct stream_in *in = (const struct stream_in *)stream;
+    const alsa_device_proxy * proxy = &in->proxy;
+    dprintf(fd, "  USB input: card %d device %d%s%s\n", in->profile->card,
+            in->profile->device, in->standby ? ", standby" : "",
+            proxy_is_mmap(proxy) ? ", mmap" : "");
+    dprintf(fd, "    %u Hz, %u channels (%u to the framework), pcm format %d, periods %u x %u\n",
+            proxy_get_sample_rate(proxy), proxy_get_channel_count(proxy),
+            in->hal_channel_count, proxy_get_format(proxy), proxy_get_period_count(proxy),
+            proxy_get_period_size(proxy));
+    dprintf(fd, "    frames read: %" PRIu64 ", overruns: %u\n",
+            proxy_get_frames_transferred(proxy), proxy_get_xruns(proxy));
     return 0;
 }
 
@@ -706,19 +1119,18 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
         device = atoi(value);
 
     if (card >= 0 && device >= 0 && !profile_is_cached_for(in->profile, card, device)) {
-        /* cannot read pcm device info if playback is active */
-        if (!in->standby)
-            ret_value = -ENOSYS;
-        else {
-            int saved_card = in->profile->card;
-            int saved_device = in->profile->device;
-            in->profile->card = card;
-            in->profile->device = device;
-            ret_value = profile_read_device_info(in->profile) ? 0 : -EINVAL;
-            if (ret_value != 0) {
-                in->profile->card = saved_card;
-                in->profile->device = saved_device;
+        alsa_device_profile * profile =
+                adev_get_card_profile_l(in->dev->in_profiles, PCM_IN, card, device);
+        if (profile == NULL) {
+            ret_value = -EINVAL;
+        } else {
+            /* capture resumes on the new card with the next read */
+            if (!in->standby) {
+                proxy_close(&in->proxy);
+                in->standby = true;
             }
+            adev_move_stream_l(&in->profile, &in->proxy, profile);
+            in->dev->in_profile = profile;
         }
     }
 
@@ -745,14 +1157,22 @@ static char * in_get_parameters(const struct audio_stream *stream, const char *k
     return params_str;
 }
 
+/* as on output, only PCM16 streams run effects */
 static int in_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-    return 0;
+    struct stream_in *in = (struct stream_in *)stream;
+
+    if (in->hal_format != AUDIO_FORMAT_PCM_16_BIT) {
+        return -ENOSYS;
+    }
+    return audio_effect_chain_add(&in->effects, effect);
 }
 
 static int in_remove_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
-    return 0;
+    struct stream_in *in = (struct stream_in *)stream;
+
+    return audio_effect_chain_remove(&in->effects, effect);
 }
 
 static int in_set_gain(struct audio_stream_in *stream, float gain)
@@ -769,99 +1189,143 @@ static int start_input_stream(struct stream_in *in)
     return proxy_open(&in->proxy);
 }
 
-/* TODO mutex stuff here (see out_write) */
+/*
+ * Reads in mmap mode: the conversions of in_read() are done straight from the DMA ring of the
+ * device. Returns 0 or a negative errno, and in frames_read the number of frames in buffer.
+ * Must be called with the input stream mutex locked.
+ */
+static int in_read_mmap(struct stream_in *in, void * buffer, size_t num_frames,
+                        size_t * frames_read)
+{
+    const unsigned num_device_channels = proxy_get_channel_count(&in->proxy);
+    const unsigned num_req_channels = in->hal_channel_count;
+    const enum pcm_format format = proxy_get_format(&in->proxy);
+    const unsigned sample_size_in_bytes =
+            audio_bytes_per_sample(audio_format_from_pcm_format(format));
+    const size_t device_frame_size = num_device_channels * sample_size_in_bytes;
+    const size_t hal_frame_size = num_req_channels * audio_bytes_per_sample(in->hal_format);
+    uint8_t * out_buff = (uint8_t *)buffer;
+    int ret = 0;
+
+    *frames_read = 0;
+    while (*frames_read < num_frames) {
+        void * ring_buff;
+        unsigned int frames = num_frames - *frames_read;
+        ret = proxy_mmap_begin(&in->proxy, &ring_buff, &frames);
+        if (ret != 0) {
+            break;
+        }
+        /* the conversion buffer is only allocated when there is something to convert */
+        if (in->conversion_buffer == NULL) {
+            memcpy(out_buff, ring_buff, frames * hal_frame_size);
+        } else if (in->hal_format != AUDIO_FORMAT_PCM_16_BIT) {
+            adjust_channels(ring_buff, num_device_channels, out_buff, num_req_channels,
+                            sample_size_in_bytes, frames * device_frame_size);
+        } else if (convert_to_16(ring_buff, format, num_device_channels,
+                                 (int16_t *)out_buff, num_req_channels, frames,
+                                 in->dither_enabled ? &in->dither : NULL) == 0) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = proxy_mmap_commit(&in->proxy, frames);
+        if (ret != 0) {
+            break;
+        }
+        out_buff += frames * hal_frame_size;
+        *frames_read += frames;
+    }
+    return ret;
+}
+
 static ssize_t in_read(struct audio_stream_in *stream, void* buffer, size_t bytes)
 {
     size_t num_read_buff_bytes = 0;
-    void * read_buff = buffer;
-    void * out_buff = buffer;
     int ret = 0;
 
     struct stream_in * in = (struct stream_in *)stream;
 
-    pthread_mutex_lock(&in->dev->lock);
+    /* as in out_write(), the device lock is only taken to leave standby */
     pthread_mutex_lock(&in->lock);
     if (in->standby) {
-        if (start_input_stream(in) != 0) {
-            pthread_mutex_unlock(&in->dev->lock);
-            goto err;
+        pthread_mutex_unlock(&in->lock);
+        pthread_mutex_lock(&in->dev->lock);
+        pthread_mutex_lock(&in->lock);
+        if (in->standby) {
+            if (start_input_stream(in) != 0) {
+                pthread_mutex_unlock(&in->dev->lock);
+                goto err;
+            }
+            in->standby = false;
         }
-        in->standby = false;
+        pthread_mutex_unlock(&in->dev->lock);
     }
-    pthread_mutex_unlock(&in->dev->lock);
-
-
-    alsa_device_profile * profile = in->profile;
 
     /*
      * OK, we need to figure out how much data to read to be able to output the requested
-     * number of bytes in the HAL format (16-bit, stereo).
+     * number of bytes in the HAL format (hal_format, hal_channel_count channels).
      */
-    num_read_buff_bytes = bytes;
-    int num_device_channels = proxy_get_channel_count(&in->proxy);
-    int num_req_channels = in->hal_channel_count;
-
-    if (num_device_channels != num_req_channels) {
-        num_read_buff_bytes = (num_device_channels * num_read_buff_bytes) / num_req_channels;
-    }
-
-    enum pcm_format format = proxy_get_format(&in->proxy);
-    if (format == PCM_FORMAT_S24_3LE) {
-        /* 24-bit USB device */
-        num_read_buff_bytes = (3 * num_read_buff_bytes) / 2;
-    } else if (format == PCM_FORMAT_S32_LE) {
-        /* 32-bit USB device */
-        num_read_buff_bytes = num_read_buff_bytes * 2;
-    }
-
-    /* Setup/Realloc the conversion buffer (if necessary). */
-    if (num_read_buff_bytes != bytes) {
-        if (num_read_buff_bytes > in->conversion_buffer_size) {
-            /*TODO Remove this when AudioPolicyManger/AudioFlinger support arbitrary formats
-              (and do these conversions themselves) */
-            in->conversion_buffer_size = num_read_buff_bytes;
-            in->conversion_buffer = realloc(in->conversion_buffer, in->conversion_buffer_size);
-        }
-        read_buff = in->conversion_buffer;
-    }
-
-    ret = proxy_read(&in->proxy, read_buff, num_read_buff_bytes);
-    if (ret == 0) {
+    const unsigned num_device_channels = proxy_get_channel_count(&in->proxy);
+    const unsigned num_req_channels = in->hal_channel_count;
+    const enum pcm_format format = proxy_get_format(&in->proxy);
+    const unsigned sample_size_in_bytes =
+            audio_bytes_per_sample(audio_format_from_pcm_format(format));
+    /* a native hal_format is the device format, only PCM16 is ever converted to */
+    const bool native = in->hal_format != AUDIO_FORMAT_PCM_16_BIT;
+    const size_t num_frames =
+            bytes / (num_req_channels * audio_bytes_per_sample(in->hal_format));
+    num_read_buff_bytes = num_frames * num_device_channels * sample_size_in_bytes;
+
+    if (proxy_is_mmap(&in->proxy)) {
+        size_t frames_read;
+        ret = in_read_mmap(in, buffer, num_frames, &frames_read);
+        num_read_buff_bytes =
+                frames_read * num_req_channels * audio_bytes_per_sample(in->hal_format);
+    } else if (in->conversion_buffer == NULL) {
+        ret = proxy_read(&in->proxy, buffer, num_read_buff_bytes);
+    } else {
         /*
          * Do any conversions necessary to send the data in the format specified to/by the HAL
-         * (but different from the ALSA format), such as 24bit ->16bit, or 4chan -> 2chan.
+         * (but different from the ALSA format), such as 24bit ->16bit, or 4chan -> 2chan, in a
+         * single pass. The conversion buffer holds a period of device frames, larger reads are
+         * converted a period at a time.
          */
-        if (format != PCM_FORMAT_S16_LE) {
-            /* we need to convert */
-            if (num_device_channels != num_req_channels) {
-                out_buff = read_buff;
+        const size_t device_frame_size = num_device_channels * sample_size_in_bytes;
+        const size_t hal_frame_size = num_req_channels * audio_bytes_per_sample(in->hal_format);
+        const size_t max_chunk_frames = in->conversion_buffer_size / device_frame_size;
+        uint8_t * out_buff = (uint8_t *)buffer;
+        size_t frames_done = 0;
+        while (frames_done < num_frames) {
+            const size_t chunk_frames = num_frames - frames_done < max_chunk_frames
+                    ? num_frames - frames_done : max_chunk_frames;
+            ret = proxy_read(&in->proxy, in->conversion_buffer, chunk_frames * device_frame_size);
+            if (ret != 0) {
+                break;
             }
-
-            if (format == PCM_FORMAT_S24_3LE) {
-                num_read_buff_bytes =
-                    convert_24_3_to_16(read_buff, num_read_buff_bytes / 3, out_buff);
-            } else if (format == PCM_FORMAT_S32_LE) {
-                num_read_buff_bytes =
-                    convert_32_to_16(read_buff, num_read_buff_bytes / 4, out_buff);
-            } else {
+            if (native) {
+                adjust_channels(in->conversion_buffer, num_device_channels,
+                                out_buff, num_req_channels,
+                                sample_size_in_bytes, chunk_frames * device_frame_size);
+            } else if (convert_to_16(in->conversion_buffer, format, num_device_channels,
+                                     (int16_t *)out_buff, num_req_channels, chunk_frames,
+                                     in->dither_enabled ? &in->dither : NULL) == 0) {
+                num_read_buff_bytes = 0;
                 goto err;
+            } else {
+                /* while the chunk just converted is still in the cache */
+                audio_effect_chain_process(&in->effects, (const int16_t *)out_buff,
+                                           (int16_t *)out_buff, chunk_frames);
             }
+            out_buff += chunk_frames * hal_frame_size;
+            frames_done += chunk_frames;
         }
+        num_read_buff_bytes = frames_done * hal_frame_size;
+    }
 
-        if (num_device_channels != num_req_channels) {
-            // ALOGV("chans dev:%d req:%d", num_device_channels, num_req_channels);
-
-            out_buff = buffer;
-            /* Num Channels conversion */
-            if (num_device_channels != num_req_channels) {
-                audio_format_t audio_format = in_get_format(&(in->stream.common));
-                unsigned sample_size_in_bytes = audio_bytes_per_sample(audio_format);
-
-                num_read_buff_bytes =
-                    adjust_channels(read_buff, num_device_channels,
-                                    out_buff, num_req_channels,
-                                    sample_size_in_bytes, num_read_buff_bytes);
-            }
+    if (ret == 0) {
+        /* what was read as is goes through the effects on its own */
+        if ((proxy_is_mmap(&in->proxy) || in->conversion_buffer == NULL) && !native) {
+            audio_effect_chain_process(&in->effects, (const int16_t *)buffer, (int16_t *)buffer,
+                                       num_read_buff_bytes / (num_req_channels * sizeof(int16_t)));
         }
 
         /* no need to acquire in->dev->lock to read mic_muted here as we don't change its state */
@@ -877,9 +1341,34 @@ err:
     return num_read_buff_bytes;
 }
 
+/*
+ * The frames lost in an overrun aren't known: the kernel buffer which is dropped to restart the
+ * stream is counted, for a lower bound.
+ */
 static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
 {
-    return 0;
+    struct stream_in *in = (struct stream_in *)stream;
+
+    pthread_mutex_lock(&in->lock);
+    const unsigned xruns = proxy_get_xruns(&in->proxy);
+    const uint32_t frames_lost = (xruns - in->xruns_reported) *
+            proxy_get_period_size(&in->proxy) * proxy_get_period_count(&in->proxy);
+    in->xruns_reported = xruns;
+    pthread_mutex_unlock(&in->lock);
+
+    return frames_lost;
+}
+
+static int in_get_capture_position(const struct audio_stream_in *stream,
+                                   int64_t *frames, int64_t *time)
+{
+    struct stream_in *in = (struct stream_in *)stream;
+
+    pthread_mutex_lock(&in->lock);
+    int ret = proxy_get_capture_position(&in->proxy, frames, time);
+    pthread_mutex_unlock(&in->lock);
+
+    return ret;
 }
 
 static int adev_open_input_stream(struct audio_hw_device *dev,
@@ -917,10 +1406,14 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->stream.set_gain = in_set_gain;
     in->stream.read = in_read;
     in->stream.get_input_frames_lost = in_get_input_frames_lost;
+    in->stream.get_capture_position = in_get_capture_position;
 
     in->dev = (struct audio_device *)dev;
 
-    in->profile = &in->dev->in_profile;
+    pthread_mutex_lock(&in->dev->lock);
+    in->profile = in->dev->in_profile;
+    card_profile_of(in->profile)->num_streams++;
+    pthread_mutex_unlock(&in->dev->lock);
 
     struct pcm_config proxy_config;
     memset(&proxy_config, 0, sizeof(proxy_config));
@@ -936,23 +1429,21 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     }
 
     /* Format */
-    /* until the framework supports format conversion, just take what it asks for
-     * i.e. AUDIO_FORMAT_PCM_16_BIT */
-    if (config->format == AUDIO_FORMAT_DEFAULT) {
-        /* just return AUDIO_FORMAT_PCM_16_BIT until the framework supports other input
-         * formats */
+    /* PCM16 is the default and is always accepted: if the device doesn't support it,
+     * proxy_prepare() picks the device default format and in_read() converts from it.
+     * Any other format is read natively and must be supported by the device. */
+    enum pcm_format fmt = get_pcm_format_for_audio_format(config->format);
+    if (config->format == AUDIO_FORMAT_DEFAULT || config->format == AUDIO_FORMAT_PCM_16_BIT) {
         config->format = AUDIO_FORMAT_PCM_16_BIT;
         proxy_config.format = PCM_FORMAT_S16_LE;
-    } else if (config->format == AUDIO_FORMAT_PCM_16_BIT) {
-        /* Always accept AUDIO_FORMAT_PCM_16_BIT until the framework supports other input
-         * formats */
-        proxy_config.format = PCM_FORMAT_S16_LE;
+    } else if (fmt != PCM_FORMAT_INVALID && profile_is_format_valid(in->profile, fmt)) {
+        proxy_config.format = fmt;
     } else {
-        /* When the framework support other formats, validate here */
         config->format = AUDIO_FORMAT_PCM_16_BIT;
         proxy_config.format = PCM_FORMAT_S16_LE;
         ret = -EINVAL;
     }
+    in->hal_format = config->format;
 
     /* Channels */
     unsigned proposed_channel_count = profile_get_default_channel_count(in->profile);
@@ -968,10 +1459,38 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     proxy_config.channels = profile_get_default_channel_count(in->profile);
     proxy_prepare(&in->proxy, in->profile, &proxy_config);
 
+    /* as on output, read straight from the DMA ring of the device */
+    char value[PROPERTY_VALUE_MAX];
+    property_get("persist.audio.usb.mmap", value, "0");
+    proxy_set_mmap(&in->proxy, atoi(value) != 0);
+
     in->standby = true;
+    audio_effect_chain_init(&in->effects);
 
+    /* dither 24 and 32-bit devices when reducing them to 16 bits, e.g. for recording music */
+    property_get("persist.audio.usb.dither", value, "0");
+    in->dither_enabled = atoi(value) != 0;
+    conversion_dither_init(&in->dither);
+
+    /* sized for a period of device frames, see in_read() */
+    const enum pcm_format device_format = proxy_get_format(&in->proxy);
     in->conversion_buffer = NULL;
     in->conversion_buffer_size = 0;
+    if (proxy_get_channel_count(&in->proxy) != in->hal_channel_count ||
+            (in->hal_format == AUDIO_FORMAT_PCM_16_BIT &&
+             (device_format != PCM_FORMAT_S16_LE || in->dither_enabled))) {
+        in->conversion_buffer_size = proxy_get_period_size(&in->proxy) *
+                proxy_get_channel_count(&in->proxy) *
+                audio_bytes_per_sample(audio_format_from_pcm_format(device_format));
+        in->conversion_buffer = malloc(in->conversion_buffer_size);
+        if (in->conversion_buffer == NULL) {
+            audio_effect_chain_destroy(&in->effects);
+            adev_release_profile(in->dev, in->profile);
+            free(in);
+            *stream_in = NULL;
+            return -ENOMEM;
+        }
+    }
 
     *stream_in = &in->stream;
 
@@ -986,6 +1505,8 @@ static void adev_close_input_stream(struct audio_hw_device *dev, struct audio_st
     in_standby(&stream->common);
 
     free(in->conversion_buffer);
+    audio_effect_chain_destroy(&in->effects);
+    adev_release_profile(in->dev, in->profile);
 
     free(stream);
 }
@@ -1016,15 +1537,16 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
         int alsa_device = param_val >= 0 ? atoi(value) : -1;
 
         if (alsa_card >= 0 && alsa_device >= 0) {
-            /* "decache" the profile */
+            /* "decache" the profile, the card may come back with other capabilities. Streams
+             * still using it are rerouted or closed by the framework. */
             pthread_mutex_lock(&adev->lock);
-            if (device == AUDIO_DEVICE_OUT_USB_DEVICE &&
-                profile_is_cached_for(&adev->out_profile, alsa_card, alsa_device)) {
-                profile_decache(&adev->out_profile);
-            }
-            if (device == AUDIO_DEVICE_IN_USB_DEVICE &&
-                profile_is_cached_for(&adev->in_profile, alsa_card, alsa_device)) {
-                profile_decache(&adev->in_profile);
+            card_profile * profiles = device == AUDIO_DEVICE_OUT_USB_DEVICE ? adev->out_profiles :
+                    device == AUDIO_DEVICE_IN_USB_DEVICE ? adev->in_profiles : NULL;
+            size_t i;
+            for (i = 0; profiles != NULL && i < MAX_CARD_PROFILES; i++) {
+                if (profile_is_cached_for(&profiles[i].profile, alsa_card, alsa_device)) {
+                    profile_decache(&profiles[i].profile);
+                }
             }
             pthread_mutex_unlock(&adev->lock);
         }
@@ -1074,8 +1596,27 @@ static int adev_get_mic_mute(const struct audio_hw_device *dev, bool *state)
     return -ENOSYS;
 }
 
+static void dump_card_profiles(int fd, const char * direction, card_profile * profiles,
+                               alsa_device_profile * current)
+{
+    size_t i;
+    for (i = 0; i < MAX_CARD_PROFILES; i++) {
+        alsa_device_profile * profile = &profiles[i].profile;
+        if (profile_is_initialized(profile)) {
+            dprintf(fd, "  USB %s: card %d device %d, %u streams%s%s\n", direction,
+                    profile->card, profile->device, profiles[i].num_streams,
+                    profile_is_valid(profile) ? "" : ", invalid",
+                    profile == current ? ", current" : "");
+        }
+    }
+}
+
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
+    /* not locked, as out_dump() */
+    struct audio_device * adev = (struct audio_device *)device;
+    dump_card_profiles(fd, "output", adev->out_profiles, adev->out_profile);
+    dump_card_profiles(fd, "input", adev->in_profiles, adev->in_profile);
     return 0;
 }
 
@@ -1096,8 +1637,14 @@ static int adev_open(const hw_module_t* module, const char* name, hw_device_t**
     if (!adev)
         return -ENOMEM;
 
-    profile_init(&adev->out_profile, PCM_OUT);
-    profile_init(&adev->in_profile, PCM_IN);
+    size_t i;
+    for (i = 0; i < MAX_CARD_PROFILES; i++) {
+        profile_init(&adev->out_profiles[i].profile, PCM_OUT);
+        profile_init(&adev->in_profiles[i].profile, PCM_IN);
+    }
+    /* until a card is routed to */
+    adev->out_profile = &adev->out_profiles[0].profile;
+    adev->in_profile = &adev->in_profiles[0].profile;
 
     adev->hw_device.common.tag = HARDWARE_DEVICE_TAG;
     adev->hw_device.common.version = AUDIO_DEVICE_API_VERSION_2_0;
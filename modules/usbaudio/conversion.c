@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "usb_conversion"
+/*#define LOG_NDEBUG 0*/
+
+#include "conversion.h"
+
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define USE_NEON 1
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define USE_SSE 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SSE 1
+#endif
+
+/*
+ * Sample readers: return the sample at p as a signed 24-bit value, the resolution dithering
+ * works at.
+ */
+static inline int32_t read_s8(const uint8_t * p)
+{
+    return (int32_t)(int8_t)p[0] << 16;
+}
+
+static inline int32_t read_s16_le(const uint8_t * p)
+{
+    return (int32_t)(int16_t)(p[0] | (p[1] << 8)) << 8;
+}
+
+static inline int32_t read_s24_3le(const uint8_t * p)
+{
+    return (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) >> 8;
+}
+
+/* 24 bits in the low bytes of a 32-bit container */
+static inline int32_t read_s24_le(const uint8_t * p)
+{
+    return read_s24_3le(p);
+}
+
+static inline int32_t read_s32_le(const uint8_t * p)
+{
+    return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+                     (uint32_t)p[3] << 24) >> 8;
+}
+
+static inline int16_t to_16(int32_t sample24)
+{
+    return (int16_t)(sample24 >> 8);
+}
+
+/*
+ * TPDF dither: the sum of two uniform random values of +/- 1/2 LSB of the 16-bit result,
+ * added before truncating.
+ */
+static inline int16_t to_16_dithered(int32_t sample24, conversion_dither * dither)
+{
+    dither->seed = dither->seed * 1664525 + 1013904223;
+    const int32_t noise = (int32_t)((dither->seed >> 8) & 0xff) +
+                          (int32_t)((dither->seed >> 16) & 0xff) - 255;
+    const int32_t sample = (sample24 + noise + 128) >> 8;
+    return sample > INT16_MAX ? INT16_MAX : sample < INT16_MIN ? INT16_MIN : (int16_t)sample;
+}
+
+void conversion_dither_init(conversion_dither * dither)
+{
+    dither->seed = 0x2545f491;
+}
+
+bool conversion_is_format_supported(enum pcm_format format)
+{
+    switch (format) {
+    case PCM_FORMAT_S8:
+    case PCM_FORMAT_S16_LE:
+    case PCM_FORMAT_S24_LE:
+    case PCM_FORMAT_S24_3LE:
+    case PCM_FORMAT_S32_LE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Vector kernels for the common case of a device with as many channels as the stream, without
+ * dither. They convert as many samples as they can in whole vectors and return that count, the
+ * rest is left to the scalar loops.
+ */
+static size_t convert_24_3_to_16_vector(const uint8_t * src, int16_t * dst, size_t num_samples)
+{
+    size_t done = 0;
+#if defined(USE_NEON)
+    /* deinterleave the 3 bytes of 16 samples and keep the top two */
+    for (; done + 16 <= num_samples; done += 16) {
+        const uint8x16x3_t in = vld3q_u8(src + done * 3);
+        uint8x16x2_t out;
+        out.val[0] = in.val[1];
+        out.val[1] = in.val[2];
+        vst2q_u8((uint8_t *)(dst + done), out);
+    }
+#elif defined(USE_SSE) && defined(__SSSE3__)
+    /* the top two bytes of samples 0-4 are in the first 16 bytes, those of 5-7 in bytes 8-23 */
+    const __m128i low_shuffle = _mm_setr_epi8(1, 2, 4, 5, 7, 8, 10, 11, 13, 14,
+                                              -1, -1, -1, -1, -1, -1);
+    const __m128i high_shuffle = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                               8, 9, 11, 12, 14, 15);
+    for (; done + 8 <= num_samples; done += 8) {
+        const __m128i low = _mm_loadu_si128((const __m128i *)(src + done * 3));
+        const __m128i high = _mm_loadu_si128((const __m128i *)(src + done * 3 + 8));
+        _mm_storeu_si128((__m128i *)(dst + done),
+                         _mm_or_si128(_mm_shuffle_epi8(low, low_shuffle),
+                                      _mm_shuffle_epi8(high, high_shuffle)));
+    }
+#endif
+    return done;
+}
+
+static size_t convert_32_to_16_vector(const int32_t * src, int16_t * dst, size_t num_samples)
+{
+    size_t done = 0;
+#if defined(USE_NEON)
+    for (; done + 8 <= num_samples; done += 8) {
+        const int32x4_t low = vld1q_s32(src + done);
+        const int32x4_t high = vld1q_s32(src + done + 4);
+        vst1q_s16(dst + done, vcombine_s16(vshrn_n_s32(low, 16), vshrn_n_s32(high, 16)));
+    }
+#elif defined(USE_SSE)
+    for (; done + 8 <= num_samples; done += 8) {
+        const __m128i low = _mm_loadu_si128((const __m128i *)(src + done));
+        const __m128i high = _mm_loadu_si128((const __m128i *)(src + done + 4));
+        /* the shifted values fit in 16 bits, packs never saturates */
+        _mm_storeu_si128((__m128i *)(dst + done),
+                         _mm_packs_epi32(_mm_srai_epi32(low, 16), _mm_srai_epi32(high, 16)));
+    }
+#endif
+    return done;
+}
+
+/*
+ * Fused format and channel conversion of the frames from first_frame on, one frame at a time.
+ */
+#define CONVERT_FRAMES(read_sample, src_sample_size)                                        \
+    for (frame = first_frame; frame < num_frames; frame++) {                               \
+        const uint8_t * src_frame = src_bytes + frame * src_channels * (src_sample_size);  \
+        int16_t * dst_frame = dst + frame * dst_channels;                                  \
+        unsigned channel;                                                                  \
+        for (channel = 0; channel < copied_channels; channel++) {                          \
+            const int32_t sample = read_sample(src_frame + channel * (src_sample_size));   \
+            dst_frame[channel] = dither ? to_16_dithered(sample, dither) : to_16(sample);  \
+        }                                                                                  \
+        for (; channel < dst_channels; channel++) {                                        \
+            dst_frame[channel] = 0;                                                        \
+        }                                                                                  \
+    }
+
+size_t convert_to_16(const void * src, enum pcm_format format, unsigned src_channels,
+                     int16_t * dst, unsigned dst_channels, size_t num_frames,
+                     conversion_dither * dither)
+{
+    const uint8_t * src_bytes = (const uint8_t *)src;
+    const unsigned copied_channels = src_channels < dst_channels ? src_channels : dst_channels;
+    size_t first_frame = 0;
+    size_t frame;
+
+    if (format == PCM_FORMAT_S8 || format == PCM_FORMAT_S16_LE) {
+        /* nothing is lost */
+        dither = NULL;
+    }
+
+    if (src_channels == dst_channels && dither == NULL) {
+        const size_t num_samples = num_frames * src_channels;
+        size_t done = 0;
+        if (format == PCM_FORMAT_S16_LE) {
+            memcpy(dst, src, num_samples * sizeof(int16_t));
+            return num_samples * sizeof(int16_t);
+        } else if (format == PCM_FORMAT_S24_3LE) {
+            done = convert_24_3_to_16_vector(src_bytes, dst, num_samples);
+        } else if (format == PCM_FORMAT_S32_LE) {
+            done = convert_32_to_16_vector((const int32_t *)src, dst, num_samples);
+        }
+        /* the frame the vectors ended in, if they did not end on a frame, is converted again */
+        first_frame = done / src_channels;
+    }
+
+    switch (format) {
+    case PCM_FORMAT_S8:
+        CONVERT_FRAMES(read_s8, 1);
+        break;
+    case PCM_FORMAT_S16_LE:
+        CONVERT_FRAMES(read_s16_le, 2);
+        break;
+    case PCM_FORMAT_S24_3LE:
+        CONVERT_FRAMES(read_s24_3le, 3);
+        break;
+    case PCM_FORMAT_S24_LE:
+        CONVERT_FRAMES(read_s24_le, 4);
+        break;
+    case PCM_FORMAT_S32_LE:
+        CONVERT_FRAMES(read_s32_le, 4);
+        break;
+    default:
+        return 0;
+    }
+
+    return num_frames * dst_channels * sizeof(int16_t);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_LIBHARDWARE_MODULES_USBAUDIO_CONVERSION_H
+#define ANDROID_HARDWARE_LIBHARDWARE_MODULES_USBAUDIO_CONVERSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <tinyalsa/asoundlib.h>
+
+__BEGIN_DECLS
+
+/*
+ * State of the TPDF dither applied when reducing samples to 16 bits, one per stream.
+ * Dithering trades the truncation distortion of quiet signals for a constant noise floor.
+ */
+typedef struct {
+    uint32_t seed;
+} conversion_dither;
+
+void conversion_dither_init(conversion_dither * dither);
+
+/*
+ * Returns true if convert_to_16() can convert from format.
+ */
+bool conversion_is_format_supported(enum pcm_format format);
+
+/*
+ * Convert num_frames frames of src_channels interleaved samples in format to PCM16 frames of
+ * dst_channels samples, in a single pass. As with adjust_channels(), channels missing in src are
+ * filled with zeros and channels missing in dst are dropped.
+ *   dither is NULL to truncate.
+ * returns
+ *   the number of BYTES written to dst.
+ * NOTE:
+ *   src and dst must not overlap.
+ */
+size_t convert_to_16(const void * src, enum pcm_format format, unsigned src_channels,
+                     int16_t * dst, unsigned dst_channels, size_t num_frames,
+                     conversion_dither * dither);
+
+__END_DECLS
+
+#endif /* ANDROID_HARDWARE_LIBHARDWARE_MODULES_USBAUDIO_CONVERSION_H */
@@ -19,6 +19,9 @@
 
 #include "format.h"
 
+#include <log/log.h>
+
+#include <hardware/audio_alsaops.h>
 #include <tinyalsa/asoundlib.h>
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
@@ -33,7 +36,7 @@ static audio_format_t const format_value_map[] = {
     AUDIO_FORMAT_INVALID,             /* 03 - SNDRV_PCM_FORMAT_S16_BE */
     AUDIO_FORMAT_INVALID,             /* 04 - SNDRV_PCM_FORMAT_U16_LE */
     AUDIO_FORMAT_INVALID,             /* 05 - SNDRV_PCM_FORMAT_U16_BE */
-    AUDIO_FORMAT_INVALID,             /* 06 - SNDRV_PCM_FORMAT_S24_LE */
+    AUDIO_FORMAT_PCM_8_24_BIT,        /* 06 - SNDRV_PCM_FORMAT_S24_LE */
     AUDIO_FORMAT_INVALID,             /* 07 - SNDRV_PCM_FORMAT_S24_BE */
     AUDIO_FORMAT_INVALID,             /* 08 - SNDRV_PCM_FORMAT_U24_LE */
     AUDIO_FORMAT_INVALID,             /* 09 - SNDRV_PCM_FORMAT_U24_BE */
@@ -117,7 +120,7 @@ int8_t const pcm_format_value_map[50] = {
     PCM_FORMAT_INVALID,     /* 03 - SNDRV_PCM_FORMAT_S16_BE */
     PCM_FORMAT_INVALID,     /* 04 - SNDRV_PCM_FORMAT_U16_LE */
     PCM_FORMAT_INVALID,     /* 05 - SNDRV_PCM_FORMAT_U16_BE */
-    PCM_FORMAT_S24_3LE,     /* 06 - SNDRV_PCM_FORMAT_S24_LE */
+    PCM_FORMAT_S24_LE,      /* 06 - SNDRV_PCM_FORMAT_S24_LE */
     PCM_FORMAT_INVALID,     /* 07 - SNDRV_PCM_FORMAT_S24_BE */
     PCM_FORMAT_INVALID,     /* 08 - SNDRV_PCM_FORMAT_U24_LE */
     PCM_FORMAT_INVALID,     /* 09 - SNDRV_PCM_FORMAT_U24_BE */
@@ -143,7 +146,7 @@ int8_t const pcm_format_value_map[50] = {
     PCM_FORMAT_INVALID,
     PCM_FORMAT_INVALID,
     PCM_FORMAT_INVALID,     /* 31 - SNDRV_PCM_FORMAT_SPECIAL */
-    PCM_FORMAT_S24_3LE,     /* 32 - SNDRV_PCM_FORMAT_S24_3LE */ /* ??? */
+    PCM_FORMAT_S24_3LE,     /* 32 - SNDRV_PCM_FORMAT_S24_3LE */
     PCM_FORMAT_INVALID,     /* 33 - SNDRV_PCM_FORMAT_S24_3BE */
     PCM_FORMAT_INVALID,     /* 34 - SNDRV_PCM_FORMAT_U24_3LE */
     PCM_FORMAT_INVALID,     /* 35 - SNDRV_PCM_FORMAT_U24_3BE */
@@ -192,3 +195,21 @@ enum pcm_format get_pcm_format_for_mask(struct pcm_mask* mask)
 
     return PCM_FORMAT_INVALID;
 }
+
+/*
+ * Returns the PCM_ format of the samples of an AUDIO_ format, or PCM_FORMAT_INVALID if ALSA has
+ * no equivalent (e.g. AUDIO_FORMAT_PCM_FLOAT, which tinyalsa does not support). Unlike
+ * pcm_format_from_audio_format() this can be called on any format requested by the framework.
+ */
+enum pcm_format get_pcm_format_for_audio_format(audio_format_t format)
+{
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED:
+    case AUDIO_FORMAT_PCM_32_BIT:
+    case AUDIO_FORMAT_PCM_8_24_BIT:
+        return pcm_format_from_audio_format(format);
+    default:
+        return PCM_FORMAT_INVALID;
+    }
+}
@@ -23,5 +23,6 @@
 
 audio_format_t get_format_for_mask(struct pcm_mask* mask);
 enum pcm_format get_pcm_format_for_mask(struct pcm_mask* mask);
+enum pcm_format get_pcm_format_for_audio_format(audio_format_t format);
 
 #endif /* ANDROID_HARDWARE_LIBHARDWARE_MODULES_USBAUDIO_FORMAT_H */
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "usb_profile_cache"
+/*#define LOG_NDEBUG 0*/
+
+#include "profile_cache.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <log/log.h>
+
+#define PROFILE_CACHE_DIR       "/data/misc/audio"
+#define PROFILE_CACHE_MAGIC     0x55534250  /* "USBP" */
+#define PROFILE_CACHE_VERSION   1
+
+/*
+ * The cached part of alsa_device_profile. Cache files are written and read by the same build of
+ * the HAL: a different layout gets a different PROFILE_CACHE_VERSION.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;          /* of this struct */
+
+    enum pcm_format formats[MAX_PROFILE_FORMATS];
+    unsigned sample_rates[MAX_PROFILE_SAMPLE_RATES];
+    unsigned channel_counts[MAX_PROFILE_CHANNEL_COUNTS];
+
+    struct pcm_config default_config;
+
+    unsigned min_period_size;
+    unsigned max_period_size;
+    unsigned min_period_count;
+    unsigned max_period_count;
+    unsigned min_channel_count;
+    unsigned max_channel_count;
+} profile_cache_entry;
+
+/*
+ * Reads the first line of a sysfs or procfs file of the card, without its line feed.
+ */
+static bool read_card_attribute(const char * path, char * value, size_t size)
+{
+    FILE * file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    bool ok = fgets(value, size, file) != NULL;
+    fclose(file);
+    if (ok) {
+        value[strcspn(value, "\r\n")] = '\0';
+    }
+    return ok;
+}
+
+/* Keeps the characters of value that may appear in a file name, drops the others. */
+static void sanitize(char * value)
+{
+    const char * src;
+    char * dst = value;
+    for (src = value; *src != '\0'; src++) {
+        if (isalnum((unsigned char)*src) || *src == '-' || *src == '.') {
+            *dst++ = *src;
+        }
+    }
+    *dst = '\0';
+}
+
+/*
+ * Builds the path of the cache file of profile. Returns false for cards that can't be
+ * identified, e.g. the USB accessory (f_audio_source) card, which are never cached.
+ */
+static bool get_cache_path(alsa_device_profile* profile, char * path, size_t size)
+{
+    char attribute_path[128];
+    char usb_id[32];        /* "vvvv:pppp" */
+    char release[16];
+    char serial[128];
+
+    snprintf(attribute_path, sizeof(attribute_path), "/proc/asound/card%d/usbid", profile->card);
+    if (!read_card_attribute(attribute_path, usb_id, sizeof(usb_id))) {
+        return false;
+    }
+
+    /* the sound card is an interface of the USB device, which holds the descriptor strings */
+    snprintf(attribute_path, sizeof(attribute_path),
+             "/sys/class/sound/card%d/device/../bcdDevice", profile->card);
+    if (!read_card_attribute(attribute_path, release, sizeof(release))) {
+        release[0] = '\0';
+    }
+    snprintf(attribute_path, sizeof(attribute_path),
+             "/sys/class/sound/card%d/device/../serial", profile->card);
+    if (!read_card_attribute(attribute_path, serial, sizeof(serial))) {
+        /* devices of the same model without serial number share their entry */
+        serial[0] = '\0';
+    }
+
+    sanitize(usb_id);
+    sanitize(release);
+    sanitize(serial);
+    snprintf(path, size, PROFILE_CACHE_DIR "/usb_profile_%s_%s_%s_%d_%s", usb_id, release,
+             serial, profile->device, profile->direction == PCM_OUT ? "out" : "in");
+    return true;
+}
+
+bool profile_cache_load(alsa_device_profile* profile)
+{
+    char path[256];
+    if (!get_cache_path(profile, path, sizeof(path))) {
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    profile_cache_entry entry;
+    ssize_t size = read(fd, &entry, sizeof(entry));
+    close(fd);
+
+    if (size != sizeof(entry) || entry.magic != PROFILE_CACHE_MAGIC ||
+            entry.version != PROFILE_CACHE_VERSION || entry.size != sizeof(entry)) {
+        ALOGW("profile_cache_load() ignoring invalid %s", path);
+        unlink(path);
+        return false;
+    }
+
+    memcpy(profile->formats, entry.formats, sizeof(profile->formats));
+    memcpy(profile->sample_rates, entry.sample_rates, sizeof(profile->sample_rates));
+    memcpy(profile->channel_counts, entry.channel_counts, sizeof(profile->channel_counts));
+    profile->default_config = entry.default_config;
+    profile->min_period_size = entry.min_period_size;
+    profile->max_period_size = entry.max_period_size;
+    profile->min_period_count = entry.min_period_count;
+    profile->max_period_count = entry.max_period_count;
+    profile->min_channel_count = entry.min_channel_count;
+    profile->max_channel_count = entry.max_channel_count;
+    profile->is_valid = true;
+
+    ALOGV("profile_cache_load() %s", path);
+    return true;
+}
+
+void profile_cache_store(alsa_device_profile* profile)
+{
+    char path[256];
+    if (!profile_is_valid(profile) || !get_cache_path(profile, path, sizeof(path))) {
+        return;
+    }
+
+    profile_cache_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.magic = PROFILE_CACHE_MAGIC;
+    entry.version = PROFILE_CACHE_VERSION;
+    entry.size = sizeof(entry);
+    memcpy(entry.formats, profile->formats, sizeof(entry.formats));
+    memcpy(entry.sample_rates, profile->sample_rates, sizeof(entry.sample_rates));
+    memcpy(entry.channel_counts, profile->channel_counts, sizeof(entry.channel_counts));
+    entry.default_config = profile->default_config;
+    entry.min_period_size = profile->min_period_size;
+    entry.max_period_size = profile->max_period_size;
+    entry.min_period_count = profile->min_period_count;
+    entry.max_period_count = profile->max_period_count;
+    entry.min_channel_count = profile->min_channel_count;
+    entry.max_channel_count = profile->max_channel_count;
+
+    /* written aside and renamed, a reader never sees a partial entry */
+    char temp_path[sizeof(path) + 4];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        ALOGW("profile_cache_store() can't create %s: %s", temp_path, strerror(errno));
+        return;
+    }
+    bool ok = write(fd, &entry, sizeof(entry)) == sizeof(entry);
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(temp_path, path) != 0) {
+        ALOGW("profile_cache_store() can't write %s", path);
+        unlink(temp_path);
+        return;
+    }
+    ALOGV("profile_cache_store() %s", path);
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_LIBHARDWARE_MODULES_USBAUDIO_PROFILE_CACHE_H
+#define ANDROID_HARDWARE_LIBHARDWARE_MODULES_USBAUDIO_PROFILE_CACHE_H
+
+#include <stdbool.h>
+
+#include "alsa_device_profile.h"
+
+/*
+ * On-disk cache of the capabilities probed by profile_read_device_info(), keyed by the USB
+ * vendor, product, release and serial number of the card, so a reconnected device doesn't
+ * need probing again.
+ */
+
+/* Fills the capabilities of profile (whose card, device and direction are set) from the cache.
+ * Returns false if the device isn't cached, or isn't a USB device. */
+bool profile_cache_load(alsa_device_profile* profile);
+
+/* Stores the capabilities of a valid profile in the cache. */
+void profile_cache_store(alsa_device_profile* profile);
+
+#endif /* ANDROID_HARDWARE_LIBHARDWARE_MODULES_USBAUDIO_PROFILE_CACHE_H */
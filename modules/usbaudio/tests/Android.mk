@@ -0,0 +1,47 @@
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	conversion_benchmark.cpp \
+	../conversion.c
+
+LOCAL_MODULE := usbaudioconversionbenchmark
+
+LOCAL_CFLAGS := -O2
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/.. \
+	external/tinyalsa/include
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	stream_benchmark.cpp \
+	fake_tinyalsa.c \
+	../audio_hw.c \
+	../alsa_device_profile.c \
+	../alsa_device_proxy.c \
+	../logging.c \
+	../format.c \
+	../conversion.c \
+	../profile_cache.c \
+	../../audio_effect_chain/audio_effect_chain.c
+
+LOCAL_MODULE := usbaudiostreambenchmark
+
+LOCAL_CFLAGS := -O2 -Wno-unused-parameter -D__unused=
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/.. \
+	external/tinyalsa/include \
+	$(call include-path-for, audio-utils) \
+	$(LOCAL_PATH)/../../audio_effect_chain
+
+LOCAL_STATIC_LIBRARIES := libaudioutils libcutils liblog
+
+LOCAL_LDLIBS := -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "conversion.h"
+
+// Benchmark of the usbaudio capture conversions: PCM16 at the stream's channel count from what
+// the USB device delivers. The result of every conversion is checked against a plain per sample
+// reference first.
+
+// Run it like this:
+//
+// make usbaudioconversionbenchmark -j32 && \
+// out/host/linux-x86/obj/EXECUTABLES/usbaudioconversionbenchmark_intermediates/usbaudioconversionbenchmark \
+//         [sample rate] [seconds of audio per case]
+
+static int64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct Case {
+    enum pcm_format format;
+    const char* formatName;
+    size_t sampleSize;
+    unsigned deviceChannels;
+    unsigned streamChannels;
+};
+
+static const Case CASES[] = {
+    { PCM_FORMAT_S16_LE, "16-bit", 2, 2, 2 },
+    { PCM_FORMAT_S16_LE, "16-bit", 2, 4, 2 },
+    { PCM_FORMAT_S24_3LE, "24-bit packed", 3, 2, 2 },
+    { PCM_FORMAT_S24_3LE, "24-bit packed", 3, 1, 2 },
+    { PCM_FORMAT_S24_3LE, "24-bit packed", 3, 8, 2 },
+    { PCM_FORMAT_S32_LE, "32-bit", 4, 2, 2 },
+    { PCM_FORMAT_S32_LE, "32-bit", 4, 6, 6 },
+    { PCM_FORMAT_S32_LE, "32-bit", 4, 4, 2 },
+};
+
+// One period of audio, as in_read() converts it.
+static const size_t PERIOD_FRAMES = 1024;
+
+// The 16 most significant bits of the sample at p, as truncating conversions keep them.
+static int16_t referenceSample(const uint8_t* p, const Case& c) {
+    switch (c.format) {
+    case PCM_FORMAT_S24_3LE:
+        return (int16_t) (p[1] | (p[2] << 8));
+    case PCM_FORMAT_S32_LE:
+        return (int16_t) (p[2] | (p[3] << 8));
+    default:
+        return (int16_t) (p[0] | (p[1] << 8));
+    }
+}
+
+static bool check(const Case& c, const std::vector<uint8_t>& src, const std::vector<int16_t>& dst) {
+    for (size_t frame = 0; frame < PERIOD_FRAMES; frame++) {
+        for (unsigned channel = 0; channel < c.streamChannels; channel++) {
+            int16_t expected = channel < c.deviceChannels ? referenceSample(
+                    &src[(frame * c.deviceChannels + channel) * c.sampleSize], c) : 0;
+            if (dst[frame * c.streamChannels + channel] != expected) {
+                printf("  mismatch at frame %zu channel %u: %d instead of %d\n", frame, channel,
+                        dst[frame * c.streamChannels + channel], expected);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void benchmarkCase(const Case& c, unsigned rate, int seconds) {
+    std::vector<uint8_t> src(PERIOD_FRAMES * c.deviceChannels * c.sampleSize);
+    for (size_t i = 0; i < src.size(); i++) {
+        src[i] = (uint8_t) rand();
+    }
+    std::vector<int16_t> dst(PERIOD_FRAMES * c.streamChannels);
+
+    convert_to_16(&src[0], c.format, c.deviceChannels, &dst[0], c.streamChannels,
+            PERIOD_FRAMES, NULL);
+    bool correct = check(c, src, dst);
+
+    size_t periods = (size_t) rate * seconds / PERIOD_FRAMES;
+    for (int dithered = 0; dithered < 2; dithered++) {
+        conversion_dither dither;
+        conversion_dither_init(&dither);
+        int64_t start = nowNs();
+        for (size_t i = 0; i < periods; i++) {
+            convert_to_16(&src[0], c.format, c.deviceChannels, &dst[0], c.streamChannels,
+                    PERIOD_FRAMES, dithered ? &dither : NULL);
+        }
+        int64_t elapsed = nowNs() - start;
+        double audioSeconds = (double) periods * PERIOD_FRAMES / rate;
+        printf("%s %u to %u channels%s: %.2f ns per frame, %.0f us CPU per s of audio%s\n",
+                c.formatName, c.deviceChannels, c.streamChannels,
+                dithered ? ", dithered" : "", (double) elapsed / (periods * PERIOD_FRAMES),
+                elapsed / 1e3 / audioSeconds, correct || dithered ? "" : " (WRONG)");
+    }
+}
+
+int main(int argc, char **argv) {
+    int rate = argc > 1 ? atoi(argv[1]) : 192000;
+    int seconds = argc > 2 ? atoi(argv[2]) : 60;
+    if (rate <= 0 || seconds <= 0) {
+        printf("usage: %s [sample rate] [seconds of audio per case]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]); i++) {
+        benchmarkCase(CASES[i], rate, seconds);
+    }
+    return EXIT_SUCCESS;
+}
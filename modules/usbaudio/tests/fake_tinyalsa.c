@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fake_tinyalsa.h"
+
+/* the ring of every pcm, whatever period config was asked for */
+#define RING_FRAMES 8192
+
+typedef struct {
+    bool set;
+    enum pcm_format format;
+    unsigned channels;
+    unsigned rate;
+} fake_card;
+
+static fake_card cards[FAKE_ALSA_MAX_CARDS];
+
+struct pcm {
+    unsigned flags;
+    struct pcm_config config;
+    bool ready;
+    unsigned frame_size;
+    unsigned buffer_frames;
+    uint8_t * ring;
+    unsigned offset;                    /* of the next frame of the ring to transfer */
+};
+
+struct pcm_params {
+    fake_card card;
+    struct pcm_mask format_mask;
+};
+
+static struct pcm bad_pcm;
+
+void fake_alsa_set_card(unsigned card, enum pcm_format format, unsigned channels, unsigned rate)
+{
+    if (card < FAKE_ALSA_MAX_CARDS) {
+        cards[card].set = true;
+        cards[card].format = format;
+        cards[card].channels = channels;
+        cards[card].rate = rate;
+    }
+}
+
+/* the SNDRV_PCM_FORMAT_* bit of format in the masks of hw params */
+static int sndrv_format_bit(enum pcm_format format)
+{
+    switch (format) {
+    case PCM_FORMAT_S8:
+        return 0;
+    case PCM_FORMAT_S16_LE:
+        return 2;
+    case PCM_FORMAT_S24_LE:
+        return 6;
+    case PCM_FORMAT_S32_LE:
+        return 10;
+    case PCM_FORMAT_S24_3LE:
+        return 32;
+    default:
+        return -1;
+    }
+}
+
+unsigned int pcm_format_to_bits(enum pcm_format format)
+{
+    switch (format) {
+    case PCM_FORMAT_S32_LE:
+    case PCM_FORMAT_S24_LE:
+        return 32;
+    case PCM_FORMAT_S24_3LE:
+        return 24;
+    case PCM_FORMAT_S8:
+        return 8;
+    default:
+        return 16;
+    }
+}
+
+struct pcm * pcm_open(unsigned int card, unsigned int device, unsigned int flags,
+                      struct pcm_config * config)
+{
+    if (card >= FAKE_ALSA_MAX_CARDS || !cards[card].set || device != 0) {
+        return &bad_pcm;
+    }
+
+    struct pcm * pcm = calloc(1, sizeof(struct pcm));
+    if (pcm == NULL) {
+        return &bad_pcm;
+    }
+    pcm->flags = flags;
+    pcm->config = *config;
+    pcm->ready = config->format == cards[card].format &&
+            config->channels == cards[card].channels && config->rate == cards[card].rate;
+    pcm->frame_size = config->channels * pcm_format_to_bits(config->format) / 8;
+    pcm->buffer_frames = config->period_size * config->period_count;
+    if (pcm->ready) {
+        pcm->ring = malloc((size_t)RING_FRAMES * pcm->frame_size);
+        if (pcm->ring == NULL) {
+            pcm->ready = false;
+        } else {
+            /* noise to capture */
+            size_t i;
+            for (i = 0; i < (size_t)RING_FRAMES * pcm->frame_size; i++) {
+                pcm->ring[i] = (uint8_t)rand();
+            }
+        }
+    }
+    return pcm;
+}
+
+int pcm_close(struct pcm * pcm)
+{
+    if (pcm == &bad_pcm) {
+        return 0;
+    }
+    free(pcm->ring);
+    free(pcm);
+    return 0;
+}
+
+int pcm_is_ready(struct pcm * pcm)
+{
+    return pcm->ready;
+}
+
+const char * pcm_get_error(struct pcm * pcm)
+{
+    return pcm->ready ? "" : "no such configuration of the fake card";
+}
+
+struct pcm_params * pcm_params_get(unsigned int card, unsigned int device, unsigned int flags)
+{
+    if (card >= FAKE_ALSA_MAX_CARDS || !cards[card].set || device != 0) {
+        return NULL;
+    }
+
+    struct pcm_params * params = calloc(1, sizeof(struct pcm_params));
+    if (params == NULL) {
+        return NULL;
+    }
+    params->card = cards[card];
+    int bit = sndrv_format_bit(cards[card].format);
+    if (bit >= 0) {
+        const int bits_per_slot = sizeof(params->format_mask.bits[0]) * 8;
+        params->format_mask.bits[bit / bits_per_slot] |= 1u << (bit % bits_per_slot);
+    }
+    return params;
+}
+
+void pcm_params_free(struct pcm_params * pcm_params)
+{
+    free(pcm_params);
+}
+
+struct pcm_mask * pcm_params_get_mask(struct pcm_params * pcm_params, enum pcm_param param)
+{
+    return param == PCM_PARAM_FORMAT ? &pcm_params->format_mask : NULL;
+}
+
+static unsigned int params_get(struct pcm_params * pcm_params, enum pcm_param param, bool max)
+{
+    switch (param) {
+    case PCM_PARAM_CHANNELS:
+        return pcm_params->card.channels;
+    case PCM_PARAM_RATE:
+        return pcm_params->card.rate;
+    case PCM_PARAM_PERIOD_SIZE:
+        return max ? RING_FRAMES / 2 : 16;
+    case PCM_PARAM_PERIODS:
+        return max ? 16 : 2;
+    case PCM_PARAM_SAMPLE_BITS:
+        return pcm_format_to_bits(pcm_params->card.format);
+    default:
+        return 0;
+    }
+}
+
+unsigned int pcm_params_get_min(struct pcm_params * pcm_params, enum pcm_param param)
+{
+    return params_get(pcm_params, param, false);
+}
+
+unsigned int pcm_params_get_max(struct pcm_params * pcm_params, enum pcm_param param)
+{
+    return params_get(pcm_params, param, true);
+}
+
+unsigned int pcm_get_buffer_size(struct pcm * pcm)
+{
+    return pcm->buffer_frames;
+}
+
+unsigned int pcm_frames_to_bytes(struct pcm * pcm, unsigned int frames)
+{
+    return frames * pcm->frame_size;
+}
+
+unsigned int pcm_bytes_to_frames(struct pcm * pcm, unsigned int bytes)
+{
+    return bytes / pcm->frame_size;
+}
+
+int pcm_get_htimestamp(struct pcm * pcm, unsigned int * avail, struct timespec * tstamp)
+{
+    if (!pcm->ready) {
+        return -1;
+    }
+    /* played at once, or a period captured and waiting */
+    *avail = (pcm->flags & PCM_IN) ? pcm->config.period_size : pcm->buffer_frames;
+    clock_gettime(CLOCK_MONOTONIC, tstamp);
+    return 0;
+}
+
+/* copies count bytes between data and the ring, as the kernel does */
+static void transfer(struct pcm * pcm, void * data, unsigned int count, bool in)
+{
+    uint8_t * p = data;
+    unsigned frames = count / pcm->frame_size;
+    while (frames > 0) {
+        unsigned chunk = RING_FRAMES - pcm->offset;
+        if (chunk > frames) {
+            chunk = frames;
+        }
+        uint8_t * ring = pcm->ring + (size_t)pcm->offset * pcm->frame_size;
+        if (in) {
+            memcpy(p, ring, (size_t)chunk * pcm->frame_size);
+        } else {
+            memcpy(ring, p, (size_t)chunk * pcm->frame_size);
+        }
+        p += (size_t)chunk * pcm->frame_size;
+        frames -= chunk;
+        pcm->offset = (pcm->offset + chunk) % RING_FRAMES;
+    }
+}
+
+int pcm_write(struct pcm * pcm, const void * data, unsigned int count)
+{
+    if (!pcm->ready || (pcm->flags & PCM_IN)) {
+        return -EINVAL;
+    }
+    transfer(pcm, (void *)data, count, false);
+    return 0;
+}
+
+int pcm_read(struct pcm * pcm, void * data, unsigned int count)
+{
+    if (!pcm->ready || !(pcm->flags & PCM_IN)) {
+        return -EINVAL;
+    }
+    transfer(pcm, data, count, true);
+    return 0;
+}
+
+int pcm_prepare(struct pcm * pcm)
+{
+    return pcm->ready ? 0 : -EINVAL;
+}
+
+int pcm_start(struct pcm * pcm)
+{
+    return pcm->ready ? 0 : -EINVAL;
+}
+
+int pcm_stop(struct pcm * pcm)
+{
+    return 0;
+}
+
+int pcm_wait(struct pcm * pcm, int timeout)
+{
+    return 1;
+}
+
+int pcm_mmap_avail(struct pcm * pcm)
+{
+    return pcm->ready ? (int)pcm->buffer_frames : -EBADFD;
+}
+
+int pcm_mmap_begin(struct pcm * pcm, void ** areas, unsigned int * offset, unsigned int * frames)
+{
+    if (!pcm->ready || !(pcm->flags & PCM_MMAP)) {
+        return -EINVAL;
+    }
+    unsigned contiguous = RING_FRAMES - pcm->offset;
+    if (*frames > contiguous) {
+        *frames = contiguous;
+    }
+    if (*frames > pcm->buffer_frames) {
+        *frames = pcm->buffer_frames;
+    }
+    *areas = pcm->ring;
+    *offset = pcm->offset;
+    return 0;
+}
+
+int pcm_mmap_commit(struct pcm * pcm, unsigned int offset, unsigned int frames)
+{
+    pcm->offset = (offset + frames) % RING_FRAMES;
+    return frames;
+}
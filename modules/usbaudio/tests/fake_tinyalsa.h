@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_LIBHARDWARE_MODULES_USBAUDIO_TESTS_FAKE_TINYALSA_H
+#define ANDROID_HARDWARE_LIBHARDWARE_MODULES_USBAUDIO_TESTS_FAKE_TINYALSA_H
+
+#include <sys/cdefs.h>
+
+#include <tinyalsa/asoundlib.h>
+
+__BEGIN_DECLS
+
+/*
+ * The tinyalsa pcm API over USB cards simulated in memory, for the HAL to be run on the host.
+ * A card supports exactly one format, channel count and rate, in both directions. Playback is
+ * copied into the ring buffer of the pcm and consumed at once, capture copied out of a ring of
+ * noise that is always full, so no call ever waits: what is measured is the HAL alone.
+ */
+#define FAKE_ALSA_MAX_CARDS 16
+
+void fake_alsa_set_card(unsigned card, enum pcm_format format, unsigned channels, unsigned rate);
+
+__END_DECLS
+
+#endif /* ANDROID_HARDWARE_LIBHARDWARE_MODULES_USBAUDIO_TESTS_FAKE_TINYALSA_H */
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include <hardware/audio.h>
+#include <hardware/hardware.h>
+
+#include "fake_tinyalsa.h"
+
+// Benchmark of the usbaudio I/O paths: out_write() and in_read() of the HAL itself, through
+// the ALSA device proxy, on cards simulated by fake_tinyalsa.c which transfer without waiting.
+// What a buffer costs on top of copying it shows for each format and channel combination the
+// streams convert between, in ns per frame.
+
+// Run it like this:
+//
+// make usbaudiostreambenchmark -j32 && \
+// out/host/linux-x86/obj/EXECUTABLES/usbaudiostreambenchmark_intermediates/usbaudiostreambenchmark \
+//         [sample rate] [seconds of audio per case]
+
+extern "C" struct audio_module HAL_MODULE_INFO_SYM;
+
+static int64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct Case {
+    bool input;
+    enum pcm_format deviceFormat;
+    const char* formatName;
+    unsigned deviceChannels;
+    audio_format_t streamFormat;
+    unsigned streamChannels;
+};
+
+static const Case CASES[] = {
+    // playback only ever adjusts channels
+    { false, PCM_FORMAT_S16_LE, "16-bit", 2, AUDIO_FORMAT_PCM_16_BIT, 2 },
+    { false, PCM_FORMAT_S16_LE, "16-bit", 4, AUDIO_FORMAT_PCM_16_BIT, 2 },
+    { false, PCM_FORMAT_S24_3LE, "24-bit packed", 2, AUDIO_FORMAT_PCM_24_BIT_PACKED, 2 },
+    { false, PCM_FORMAT_S32_LE, "32-bit", 8, AUDIO_FORMAT_PCM_32_BIT, 2 },
+    // capture reads as is, adjusts channels of the native format or converts to 16 bits
+    { true, PCM_FORMAT_S16_LE, "16-bit", 2, AUDIO_FORMAT_PCM_16_BIT, 2 },
+    { true, PCM_FORMAT_S16_LE, "16-bit", 4, AUDIO_FORMAT_PCM_16_BIT, 2 },
+    { true, PCM_FORMAT_S24_3LE, "24-bit packed", 2, AUDIO_FORMAT_PCM_24_BIT_PACKED, 2 },
+    { true, PCM_FORMAT_S24_3LE, "24-bit packed", 4, AUDIO_FORMAT_PCM_24_BIT_PACKED, 2 },
+    { true, PCM_FORMAT_S24_3LE, "24-bit packed", 2, AUDIO_FORMAT_PCM_16_BIT, 2 },
+    { true, PCM_FORMAT_S24_3LE, "24-bit packed", 1, AUDIO_FORMAT_PCM_16_BIT, 2 },
+    { true, PCM_FORMAT_S32_LE, "32-bit", 2, AUDIO_FORMAT_PCM_16_BIT, 2 },
+    { true, PCM_FORMAT_S32_LE, "32-bit", 6, AUDIO_FORMAT_PCM_16_BIT, 2 },
+};
+
+static const char* streamFormatName(audio_format_t format) {
+    switch (format) {
+    case AUDIO_FORMAT_PCM_16_BIT:
+        return "16-bit";
+    case AUDIO_FORMAT_PCM_24_BIT_PACKED:
+        return "24-bit packed";
+    case AUDIO_FORMAT_PCM_32_BIT:
+        return "32-bit";
+    default:
+        return "?";
+    }
+}
+
+// Routes the streams opened next to card, as the framework does when the card is attached:
+// through a stream opened before, on the card routed to last.
+static bool route(audio_hw_device_t* dev, const Case& c, unsigned card) {
+    char kvpairs[32];
+    snprintf(kvpairs, sizeof(kvpairs), "card=%u;device=0", card);
+
+    struct audio_config config;
+    memset(&config, 0, sizeof(config));
+    int ret;
+    if (c.input) {
+        audio_stream_in_t* in;
+        if (dev->open_input_stream(dev, 0, AUDIO_DEVICE_IN_USB_DEVICE, &config, &in,
+                AUDIO_INPUT_FLAG_NONE, NULL, AUDIO_SOURCE_DEFAULT) != 0) {
+            return false;
+        }
+        ret = in->common.set_parameters(&in->common, kvpairs);
+        dev->close_input_stream(dev, in);
+    } else {
+        audio_stream_out_t* out;
+        if (dev->open_output_stream(dev, 0, AUDIO_DEVICE_OUT_USB_DEVICE, AUDIO_OUTPUT_FLAG_NONE,
+                &config, &out, NULL) != 0) {
+            return false;
+        }
+        ret = out->common.set_parameters(&out->common, kvpairs);
+        dev->close_output_stream(dev, out);
+    }
+    return ret == 0;
+}
+
+static void benchmarkCase(audio_hw_device_t* dev, const Case& c, unsigned card, unsigned rate,
+                          int seconds) {
+    fake_alsa_set_card(card, c.deviceFormat, c.deviceChannels, rate);
+    const char* name = c.input ? "in_read" : "out_write";
+    if (!route(dev, c, card)) {
+        printf("%s %s %u channels: can't route to the fake card\n", name, c.formatName,
+                c.deviceChannels);
+        return;
+    }
+
+    struct audio_config config;
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = rate;
+    config.format = c.streamFormat;
+    config.channel_mask = c.input ? audio_channel_in_mask_from_count(c.streamChannels) :
+            audio_channel_out_mask_from_count(c.streamChannels);
+
+    audio_stream_in_t* in = NULL;
+    audio_stream_out_t* out = NULL;
+    audio_stream_t* stream;
+    if (c.input) {
+        if (dev->open_input_stream(dev, 0, AUDIO_DEVICE_IN_USB_DEVICE, &config, &in,
+                AUDIO_INPUT_FLAG_NONE, NULL, AUDIO_SOURCE_DEFAULT) != 0) {
+            printf("%s: can't open the stream\n", name);
+            return;
+        }
+        stream = &in->common;
+    } else {
+        if (dev->open_output_stream(dev, 0, AUDIO_DEVICE_OUT_USB_DEVICE, AUDIO_OUTPUT_FLAG_NONE,
+                &config, &out, NULL) != 0) {
+            printf("%s: can't open the stream\n", name);
+            return;
+        }
+        stream = &out->common;
+    }
+
+    // A period of HAL frames, as the framework transfers them
+    const size_t bytes = stream->get_buffer_size(stream);
+    const size_t frameSize = c.streamChannels * audio_bytes_per_sample(c.streamFormat);
+    const size_t frames = bytes / frameSize;
+    std::vector<uint8_t> buffer(bytes);
+    for (size_t i = 0; i < buffer.size(); i++) {
+        buffer[i] = (uint8_t) rand();
+    }
+
+    // the first transfer leaves standby, opening the pcm
+    size_t buffers = frames > 0 ? (size_t) rate * seconds / frames : 0;
+    ssize_t done = c.input ? in->read(in, &buffer[0], bytes) : out->write(out, &buffer[0], bytes);
+    bool failed = done != (ssize_t) bytes;
+    int64_t start = nowNs();
+    for (size_t i = 0; i < buffers && !failed; i++) {
+        done = c.input ? in->read(in, &buffer[0], bytes) : out->write(out, &buffer[0], bytes);
+        failed = done != (ssize_t) bytes;
+    }
+    int64_t elapsed = nowNs() - start;
+
+    if (failed || buffers == 0) {
+        printf("%s %s %u to %s %u channels: FAILED\n", name, c.formatName, c.deviceChannels,
+                streamFormatName(c.streamFormat), c.streamChannels);
+    } else {
+        double audioSeconds = (double) buffers * frames / rate;
+        printf("%s %s %u to %s %u channels, %zu frames: %.2f ns per frame, "
+                "%.0f us CPU per s of audio\n", name, c.formatName, c.deviceChannels,
+                streamFormatName(c.streamFormat), c.streamChannels, frames,
+                (double) elapsed / (buffers * frames), elapsed / 1e3 / audioSeconds);
+    }
+
+    if (c.input) {
+        dev->close_input_stream(dev, in);
+    } else {
+        dev->close_output_stream(dev, out);
+    }
+}
+
+int main(int argc, char **argv) {
+    int rate = argc > 1 ? atoi(argv[1]) : 48000;
+    int seconds = argc > 2 ? atoi(argv[2]) : 60;
+    if (rate <= 0 || seconds <= 0) {
+        printf("usage: %s [sample rate] [seconds of audio per case]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    hw_device_t* device;
+    const hw_module_t* module = &HAL_MODULE_INFO_SYM.common;
+    if (module->methods->open(module, AUDIO_HARDWARE_INTERFACE, &device) != 0) {
+        printf("can't open the usbaudio HAL\n");
+        return EXIT_FAILURE;
+    }
+    audio_hw_device_t* dev = (audio_hw_device_t*) device;
+
+    // a card of its own per case, the HAL keeps the profiles of the cards it has seen
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]) && i < FAKE_ALSA_MAX_CARDS; i++) {
+        benchmarkCase(dev, CASES[i], i, rate, seconds);
+    }
+
+    device->close(device);
+    return EXIT_SUCCESS;
+}
@@ -19,7 +19,12 @@
 
 #include <cutils/log.h>
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -27,32 +32,71 @@
 
 static const char THE_DEVICE[] = "/sys/class/timed_output/vibrator/enable";
 
-static int vibra_exists() {
+/*
+ * An on step running out within this of an off step is left to the
+ * driver's timer, which ends it about as early as a write would.
+ */
+#define OFF_SLACK_NS 2000000LL
+
+/*
+ * The device is kept open while the HAL is, so turning the vibrator on or
+ * off is a single write(). Patterns are played by a thread of the device:
+ * the timed_output driver turns the vibrator off by itself once the
+ * duration written has passed, so an on step costs one write and an off
+ * step none unless it interrupts an on step.
+ */
+struct vibra_device {
+    vibrator_device_t device;
     int fd;
 
-    fd = TEMP_FAILURE_RETRY(open(THE_DEVICE, O_RDWR));
-    if(fd < 0) {
-        ALOGE("Vibrator file does not exist : %d", fd);
-        return 0;
-    }
+    pthread_mutex_t lock;
+    /* everything below is protected by lock */
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool thread_started;
+    bool exiting;
+    /* bumped by every request, the playing pattern stops when it changes */
+    uint32_t generation;
+    unsigned int pattern[VIBRATOR_MAX_PATTERN];
+    /* 0 while no pattern is to be played */
+    size_t pattern_count;
+    int pattern_repeat;
+    /* CLOCK_MONOTONIC time the driver stops vibrating at, 0 if it does not */
+    int64_t on_until_ns;
+};
 
-    close(fd);
-    return 1;
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-static int sendit(unsigned int timeout_ms)
+/* "%u\n" into buf, which holds at least 12 bytes; returns the length */
+static int format_ms(char* buf, unsigned int ms)
 {
-    int to_write, written, ret, fd;
+    char digits[10];
+    int n = 0, len = 0;
+
+    do {
+        digits[n++] = '0' + ms % 10;
+        ms /= 10;
+    } while (ms);
+    while (n)
+        buf[len++] = digits[--n];
+    buf[len++] = '\n';
+    return len;
+}
 
-    char value[20]; /* large enough for millions of years */
+/* with dev->lock held */
+static int sendit(struct vibra_device* dev, unsigned int timeout_ms)
+{
+    int to_write, written, ret;
 
-    fd = TEMP_FAILURE_RETRY(open(THE_DEVICE, O_RDWR));
-    if(fd < 0) {
-        return -errno;
-    }
+    char value[12];
 
-    to_write = snprintf(value, sizeof(value), "%u\n", timeout_ms);
-    written = TEMP_FAILURE_RETRY(write(fd, value, to_write));
+    to_write = format_ms(value, timeout_ms);
+    written = TEMP_FAILURE_RETRY(write(dev->fd, value, to_write));
 
     if (written == -1) {
         ret = -errno;
@@ -66,52 +110,189 @@ static int sendit(unsigned int timeout_ms)
         ret = 0;
     }
 
+    if (ret == 0)
+        dev->on_until_ns = timeout_ms ? now_ns() + timeout_ms * 1000000LL : 0;
     errno = 0;
-    close(fd);
 
     return ret;
 }
 
-static int vibra_on(vibrator_device_t* vibradev __unused, unsigned int timeout_ms)
+/* with dev->lock held, no write if the driver stops by itself anyway */
+static int turn_off(struct vibra_device* dev)
 {
+    if (dev->on_until_ns == 0 || dev->on_until_ns <= now_ns() + OFF_SLACK_NS) {
+        dev->on_until_ns = 0;
+        return 0;
+    }
+    return sendit(dev, 0);
+}
+
+/* with dev->lock held */
+static void stop_pattern(struct vibra_device* dev)
+{
+    dev->generation++;
+    dev->pattern_count = 0;
+    pthread_cond_signal(&dev->cond);
+}
+
+static void* pattern_thread(void* arg)
+{
+    struct vibra_device* dev = arg;
+
+    pthread_mutex_lock(&dev->lock);
+    for (;;) {
+        while (!dev->exiting && dev->pattern_count == 0)
+            pthread_cond_wait(&dev->cond, &dev->lock);
+        if (dev->exiting)
+            break;
+
+        uint32_t generation = dev->generation;
+        int64_t deadline = now_ns();
+        size_t i = 0;
+        while (!dev->exiting && dev->generation == generation) {
+            unsigned int ms = dev->pattern[i];
+            int ret = (i & 1) ? (ms ? sendit(dev, ms) : 0) : turn_off(dev);
+            if (ret < 0)
+                ALOGE("vibrator pattern step failed: %s", strerror(-ret));
+
+            deadline += ms * 1000000LL;
+            if (++i == dev->pattern_count) {
+                if (dev->pattern_repeat < 0) {
+                    dev->pattern_count = 0;
+                    break;
+                }
+                i = dev->pattern_repeat;
+            }
+
+            struct timespec ts;
+            ts.tv_sec = deadline / 1000000000LL;
+            ts.tv_nsec = deadline % 1000000000LL;
+            while (!dev->exiting && dev->generation == generation &&
+                    pthread_cond_timedwait(&dev->cond, &dev->lock, &ts) != ETIMEDOUT)
+                ;
+        }
+    }
+    pthread_mutex_unlock(&dev->lock);
+
+    return NULL;
+}
+
+static int vibra_on(vibrator_device_t* vibradev, unsigned int timeout_ms)
+{
+    struct vibra_device* dev = (struct vibra_device*)vibradev;
+    int ret;
+
     /* constant on, up to maximum allowed time */
-    return sendit(timeout_ms);
+    pthread_mutex_lock(&dev->lock);
+    stop_pattern(dev);
+    ret = sendit(dev, timeout_ms);
+    pthread_mutex_unlock(&dev->lock);
+
+    return ret;
+}
+
+static int vibra_off(vibrator_device_t* vibradev)
+{
+    struct vibra_device* dev = (struct vibra_device*)vibradev;
+    int ret;
+
+    pthread_mutex_lock(&dev->lock);
+    stop_pattern(dev);
+    ret = turn_off(dev);
+    pthread_mutex_unlock(&dev->lock);
+
+    return ret;
 }
 
-static int vibra_off(vibrator_device_t* vibradev __unused)
+static int vibra_pattern(vibrator_device_t* vibradev, const unsigned int* timings_ms,
+        size_t count, int repeat)
 {
-    return sendit(0);
+    struct vibra_device* dev = (struct vibra_device*)vibradev;
+    uint64_t cycle_ms = 0;
+    size_t i;
+
+    if (!timings_ms || count == 0 || count > VIBRATOR_MAX_PATTERN ||
+            repeat < -1 || repeat >= (int)count)
+        return -EINVAL;
+    /* a repeated part taking no time would spin */
+    for (i = repeat < 0 ? count : (size_t)repeat; i < count; i++)
+        cycle_ms += timings_ms[i];
+    if (repeat >= 0 && cycle_ms == 0)
+        return -EINVAL;
+
+    pthread_mutex_lock(&dev->lock);
+    if (!dev->thread_started) {
+        if (pthread_create(&dev->thread, NULL, pattern_thread, dev) != 0) {
+            pthread_mutex_unlock(&dev->lock);
+            ALOGE("Can not start the vibrator pattern thread");
+            return -EAGAIN;
+        }
+        dev->thread_started = true;
+    }
+    stop_pattern(dev);
+    memcpy(dev->pattern, timings_ms, count * sizeof(timings_ms[0]));
+    dev->pattern_count = count;
+    dev->pattern_repeat = repeat;
+    pthread_mutex_unlock(&dev->lock);
+
+    return 0;
 }
 
 static int vibra_close(hw_device_t *device)
 {
-    free(device);
+    struct vibra_device* dev = (struct vibra_device*)device;
+
+    pthread_mutex_lock(&dev->lock);
+    dev->exiting = true;
+    stop_pattern(dev);
+    pthread_mutex_unlock(&dev->lock);
+    if (dev->thread_started)
+        pthread_join(dev->thread, NULL);
+
+    pthread_cond_destroy(&dev->cond);
+    pthread_mutex_destroy(&dev->lock);
+    close(dev->fd);
+    free(dev);
     return 0;
 }
 
 static int vibra_open(const hw_module_t* module, const char* id __unused,
                       hw_device_t** device __unused) {
-    if (!vibra_exists()) {
+    pthread_condattr_t attr;
+    int fd;
+
+    fd = TEMP_FAILURE_RETRY(open(THE_DEVICE, O_RDWR | O_CLOEXEC));
+    if (fd < 0) {
         ALOGE("Vibrator device does not exist. Cannot start vibrator");
         return -ENODEV;
     }
 
-    vibrator_device_t *vibradev = calloc(1, sizeof(vibrator_device_t));
+    struct vibra_device *dev = calloc(1, sizeof(struct vibra_device));
 
-    if (!vibradev) {
+    if (!dev) {
         ALOGE("Can not allocate memory for the vibrator device");
+        close(fd);
         return -ENOMEM;
     }
 
-    vibradev->common.tag = HARDWARE_DEVICE_TAG;
-    vibradev->common.module = (hw_module_t *) module;
-    vibradev->common.version = HARDWARE_DEVICE_API_VERSION(1,0);
-    vibradev->common.close = vibra_close;
+    dev->device.common.tag = HARDWARE_DEVICE_TAG;
+    dev->device.common.module = (hw_module_t *) module;
+    dev->device.common.version = VIBRATOR_DEVICE_API_VERSION_1_1;
+    dev->device.common.close = vibra_close;
+
+    dev->device.vibrator_on = vibra_on;
+    dev->device.vibrator_off = vibra_off;
+    dev->device.vibrator_pattern = vibra_pattern;
 
-    vibradev->vibrator_on = vibra_on;
-    vibradev->vibrator_off = vibra_off;
+    dev->fd = fd;
+    pthread_mutex_init(&dev->lock, NULL);
+    /* pattern steps are timed against CLOCK_MONOTONIC */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&dev->cond, &attr);
+    pthread_condattr_destroy(&attr);
 
-    *device = (hw_device_t *) vibradev;
+    *device = (hw_device_t *) dev;
 
     return 0;
 }
@@ -11,6 +11,7 @@ LOCAL_SRC_FILES:= \
 	CameraFrameTests.cpp \
 	CameraBurstTests.cpp \
 	CameraMultiStreamTests.cpp\
+	CameraBenchmarkTests.cpp \
 	ForkedTests.cpp \
 	TestForkerEventListener.cpp \
 	TestSettings.cpp \
@@ -41,6 +42,7 @@ LOCAL_C_INCLUDES += \
 	frameworks/av/include/ \
 	frameworks/av/services/camera/libcameraservice \
 	frameworks/native/include \
+	$(LOCAL_PATH)/../include \
 
 LOCAL_CFLAGS += -Wall -Wextra
 
@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <gtest/gtest.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/resource.h>
+
+#define LOG_TAG "CameraBenchmarkTest"
+//#define LOG_NDEBUG 0
+#include <utils/Log.h>
+#include <utils/Timers.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "CameraStreamFixture.h"
+#include "TestExtensions.h"
+#include "BenchmarkStats.h"
+
+#define CAMERA_FRAME_TIMEOUT    1000000000LL //nsecs (1 secs)
+#define CAMERA_HEAP_COUNT       2 //HALBUG: 1 means registerBuffers fails
+
+#define USEC 1000LL        // in ns
+#define SEC  1000000000LL  // in ns
+
+using namespace android;
+using namespace android::camera2;
+
+namespace android {
+namespace camera2 {
+namespace tests {
+
+static CameraStreamParams STREAM_PARAMETERS = {
+    /*mFormat*/     CAMERA_STREAM_AUTO_CPU_FORMAT,
+    /*mHeapCount*/  CAMERA_HEAP_COUNT
+};
+
+// User and system CPU time of the whole process, which includes the HAL
+static int64_t ProcessCpuTime() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * SEC +
+            (int64_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * USEC;
+}
+
+using benchmark::Percentile;
+
+/**
+ * This test streams a repeating preview request at every CPU readable output
+ * size of the camera and measures the sustained frame rate, the distribution
+ * of the intervals between frames, as delivered to the consumer and as
+ * timestamped by the sensor, and the process CPU time per frame.
+ *
+ * It is skipped unless a duration is given for each size, with
+ *   --benchmark-seconds=N or CAMERA2_TEST_BENCHMARK_SECONDS=N
+ * Results are printed as one "camera2_benchmark" line of key=value pairs per
+ * size, and recorded as test properties for --gtest_output=xml.
+ *
+ * For example:
+ *   $ /data/nativetest/camera2_test/camera2_test --benchmark-seconds=10 \
+ *       --gtest_filter="*Benchmark*" --gtest_output=xml:/data/camera2.xml
+ */
+class CameraBenchmarkTest
+    : public ::testing::Test,
+      public CameraStreamFixture {
+
+public:
+    CameraBenchmarkTest() : CameraStreamFixture(STREAM_PARAMETERS) {
+        TEST_EXTENSION_FORKING_CONSTRUCTOR;
+    }
+
+    ~CameraBenchmarkTest() {
+        TEST_EXTENSION_FORKING_DESTRUCTOR;
+    }
+
+    virtual void SetUp() {
+        TEST_EXTENSION_FORKING_SET_UP;
+    }
+    virtual void TearDown() {
+        TEST_EXTENSION_FORKING_TEAR_DOWN;
+    }
+
+protected:
+
+    // Output sizes of the CPU readable format, as width, height pairs
+    void GetSizes(std::vector<int32_t> *sizes) {
+        if (getDeviceVersion() < CAMERA_DEVICE_API_VERSION_3_2) {
+            camera_metadata_ro_entry entry =
+                GetStaticEntry(ANDROID_SCALER_AVAILABLE_PROCESSED_SIZES);
+            ASSERT_LE(2u, entry.count)
+                << "Missing tag android.scaler.availableProcessedSizes";
+            sizes->assign(entry.data.i32, entry.data.i32 + entry.count);
+        } else {
+            const int32_t *list;
+            size_t count;
+            buildOutputResolutions();
+            ASSERT_NO_FATAL_FAILURE(getResolutionList(
+                    MapAutoFormat(CAMERA_STREAM_AUTO_CPU_FORMAT), &list, &count));
+            sizes->assign(list, list + count);
+        }
+    }
+
+    // Stream the current stream for the given time and report its results
+    void Benchmark(int seconds) {
+        CameraMetadata previewRequest;
+        ASSERT_EQ(OK, mDevice->createDefaultRequest(CAMERA2_TEMPLATE_PREVIEW,
+                                                    &previewRequest));
+        Vector<int32_t> outputStreamIds;
+        outputStreamIds.push(mStreamId);
+        ASSERT_EQ(OK, previewRequest.update(ANDROID_REQUEST_OUTPUT_STREAMS,
+                                            outputStreamIds));
+
+        std::vector<int64_t> deliveryIntervals;
+        std::vector<int64_t> sensorIntervals;
+        int64_t lastDelivery = 0;
+        int64_t lastTimestamp = 0;
+        int frames = 0;
+
+        ASSERT_EQ(OK, mDevice->setStreamingRequest(previewRequest));
+
+        nsecs_t start = systemTime();
+        int64_t startCpu = ProcessCpuTime();
+        nsecs_t end = start + seconds * SEC;
+        nsecs_t now = start;
+        while (now < end) {
+            ASSERT_EQ(OK, mDevice->waitForNextFrame(CAMERA_FRAME_TIMEOUT));
+            CaptureResult result;
+            ASSERT_EQ(OK, mDevice->getNextResult(&result));
+            camera_metadata_entry_t timestamp =
+                result.mMetadata.find(ANDROID_SENSOR_TIMESTAMP);
+
+            ASSERT_EQ(OK, mFrameListener->waitForFrame(CAMERA_FRAME_TIMEOUT));
+            CpuConsumer::LockedBuffer imgBuffer;
+            ASSERT_EQ(OK, mCpuConsumer->lockNextBuffer(&imgBuffer));
+            ASSERT_EQ(OK, mCpuConsumer->unlockBuffer(imgBuffer));
+            now = systemTime();
+
+            // The first frame only starts the intervals
+            if (frames > 0) {
+                deliveryIntervals.push_back(now - lastDelivery);
+                if (timestamp.count == 1 && lastTimestamp != 0) {
+                    sensorIntervals.push_back(timestamp.data.i64[0] -
+                                              lastTimestamp);
+                }
+            }
+            lastDelivery = now;
+            lastTimestamp = timestamp.count == 1 ? timestamp.data.i64[0] : 0;
+            frames++;
+        }
+        int64_t cpu = ProcessCpuTime() - startCpu;
+        nsecs_t elapsed = now - start;
+
+        ASSERT_EQ(OK, mDevice->clearStreamingRequest());
+        ASSERT_EQ(OK, mDevice->waitUntilDrained());
+
+        std::sort(deliveryIntervals.begin(), deliveryIntervals.end());
+        std::sort(sensorIntervals.begin(), sensorIntervals.end());
+        Report(frames, elapsed, cpu, deliveryIntervals, sensorIntervals);
+    }
+
+    void Report(int frames, nsecs_t elapsed, int64_t cpu,
+                const std::vector<int64_t>& deliveryIntervals,
+                const std::vector<int64_t>& sensorIntervals) {
+        double fps = frames * (double)SEC / elapsed;
+        double cpuPercent = cpu * 100.0 / elapsed;
+        int64_t p50 = Percentile(deliveryIntervals, 0.5);
+        int64_t p90 = Percentile(deliveryIntervals, 0.9);
+        int64_t p99 = Percentile(deliveryIntervals, 0.99);
+        int64_t max = Percentile(deliveryIntervals, 1.0);
+        int64_t sensorP50 = Percentile(sensorIntervals, 0.5);
+        int64_t sensorMax = Percentile(sensorIntervals, 1.0);
+
+        printf("camera2_benchmark camera=%d format=0x%x size=%dx%d frames=%d "
+               "fps=%.2f interval_p50_us=%" PRId64 " interval_p90_us=%" PRId64
+               " interval_p99_us=%" PRId64 " interval_max_us=%" PRId64
+               " sensor_interval_p50_us=%" PRId64
+               " sensor_interval_max_us=%" PRId64 " cpu_percent=%.1f"
+               " cpu_us_per_frame=%" PRId64 "\n",
+               TestSettings::DeviceId(),
+               MapAutoFormat(CAMERA_STREAM_AUTO_CPU_FORMAT), mWidth, mHeight,
+               frames, fps, p50 / USEC, p90 / USEC, p99 / USEC, max / USEC,
+               sensorP50 / USEC, sensorMax / USEC, cpuPercent,
+               frames > 0 ? cpu / frames / USEC : 0);
+
+        String8 prefix = String8::format("%dx%d_", mWidth, mHeight);
+        RecordProperty((prefix + "frames").string(), frames);
+        RecordProperty((prefix + "fps").string(),
+                       String8::format("%.2f", fps).string());
+        RecordProperty((prefix + "interval_p50_us").string(),
+                       (int)(p50 / USEC));
+        RecordProperty((prefix + "interval_p99_us").string(),
+                       (int)(p99 / USEC));
+        RecordProperty((prefix + "interval_max_us").string(),
+                       (int)(max / USEC));
+        RecordProperty((prefix + "cpu_percent").string(),
+                       String8::format("%.1f", cpuPercent).string());
+    }
+
+};
+
+TEST_F(CameraBenchmarkTest, SustainedStreaming) {
+
+    TEST_EXTENSION_FORKING_INIT;
+
+    int seconds = TestSettings::BenchmarkSeconds();
+    if (seconds <= 0) {
+        std::cout << "Skipping benchmark, no --benchmark-seconds given"
+                  << std::endl;
+        return;
+    }
+
+    std::vector<int32_t> sizes;
+    ASSERT_NO_FATAL_FAILURE(GetSizes(&sizes));
+
+    for (size_t i = 0; i + 1 < sizes.size(); i += 2) {
+        mWidth = sizes[i];
+        mHeight = sizes[i + 1];
+        ALOGV("Benchmarking %dx%d for %d s", mWidth, mHeight, seconds);
+
+        ASSERT_NO_FATAL_FAILURE(CreateStream());
+        ASSERT_NO_FATAL_FAILURE(Benchmark(seconds));
+        ASSERT_NO_FATAL_FAILURE(DeleteStream());
+    }
+}
+
+}
+}
+}
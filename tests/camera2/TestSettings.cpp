@@ -29,6 +29,7 @@ namespace tests {
 
 bool TestSettings::mForkingDisabled     = false;
 int  TestSettings::mDeviceId            = 0;
+int  TestSettings::mBenchmarkSeconds    = 0;
 char* const* TestSettings::mArgv;
 
 // --forking-disabled, false by default
@@ -46,6 +47,11 @@ int TestSettings::DeviceId() {
     return mDeviceId;
 }
 
+// --benchmark-seconds, 0 (benchmarks skipped) by default
+int TestSettings::BenchmarkSeconds() {
+    return mBenchmarkSeconds;
+}
+
 // returns false if usage should be printed and we should exit early
 bool TestSettings::ParseArgs(int argc, char* const argv[])
 {
@@ -59,6 +65,11 @@ bool TestSettings::ParseArgs(int argc, char* const argv[])
         if (env) {
             mDeviceId = atoi(env);
         }
+
+        env = getenv("CAMERA2_TEST_BENCHMARK_SECONDS");
+        if (env) {
+            mBenchmarkSeconds = atoi(env);
+        }
     }
 
     bool printHelp = false;
@@ -73,6 +84,7 @@ bool TestSettings::ParseArgs(int argc, char* const argv[])
             /* name              has_arg          flag val */
             {"forking-disabled", optional_argument, 0,  0  },
             {"device-id",        required_argument, 0,  0  },
+            {"benchmark-seconds", required_argument, 0, 0  },
             {"help",             no_argument,       0, 'h' },
             {0,                  0,                 0,  0  }
         };
@@ -105,6 +117,10 @@ bool TestSettings::ParseArgs(int argc, char* const argv[])
                 mDeviceId = atoi(optarg);
                 break;
             }
+            case 2: {
+                mBenchmarkSeconds = atoi(optarg);
+                break;
+            }
             default:
                 std::cerr << "Unknown long option: " << option_index << std::endl;
                 break;
@@ -133,6 +149,11 @@ bool TestSettings::ParseArgs(int argc, char* const argv[])
 
     std::cerr << "Device ID: " << mDeviceId << std::endl;
 
+    if (mBenchmarkSeconds > 0) {
+        std::cerr << "Benchmark seconds per configuration: "
+                  << mBenchmarkSeconds << std::endl;
+    }
+
     return true;
 }
 
@@ -153,6 +174,12 @@ void TestSettings::PrintUsage() {
               << std::endl
               << "                           (default 0)"
               << std::endl;
+    std::cerr << "   --benchmark-seconds=N   stream each configuration for N"
+              << std::endl
+              << "                           seconds in the benchmark tests."
+              << std::endl
+              << "                           (default 0, benchmarks skipped)"
+              << std::endl;
 
     std::cerr << "   -h, --help              print this help listing"
               << std::endl;
@@ -34,6 +34,9 @@ public:
     // --device-id, 0 by default
     static int DeviceId();
 
+    // --benchmark-seconds, 0 (benchmarks skipped) by default
+    static int BenchmarkSeconds();
+
     // returns false if usage should be printed and we should exit early
     static bool ParseArgs(int argc, char* const argv[]);
 
@@ -46,6 +49,7 @@ private:
 
     static bool mForkingDisabled;
     static int  mDeviceId;
+    static int  mBenchmarkSeconds;
     static char* const* mArgv;
 };
 
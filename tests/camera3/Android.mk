@@ -2,15 +2,18 @@ LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
+    camera3benchmark.cpp \
     camera3tests.cpp \
 
 LOCAL_SHARED_LIBRARIES := \
     liblog \
     libhardware \
     libcamera_metadata \
+    libsync \
 
 LOCAL_C_INCLUDES += \
     system/media/camera/include \
+    $(LOCAL_PATH)/../include \
 
 LOCAL_CFLAGS += -Wall -Wextra
 
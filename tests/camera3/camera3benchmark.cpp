@@ -0,0 +1,433 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <hardware/gralloc.h>
+#include <sync/sync.h>
+#include <system/camera_metadata.h>
+#include "camera3test_fixtures.h"
+#include "BenchmarkTest.h"
+
+namespace tests {
+
+// How long a buffer or the last results may take to come back
+static const int64_t kResultTimeoutNs = 1000000000LL;
+static const int kFenceTimeoutMs = 1000;
+
+// Seconds each stream configuration is benchmarked for, from the
+// CAMERA3_TEST_BENCHMARK_SECONDS environment variable. 0 skips the benchmark.
+static int BenchmarkSeconds() {
+    return benchmark::Seconds("CAMERA3");
+}
+
+using benchmark::MonotonicNs;
+using benchmark::Percentile;
+
+// User and system CPU time of the process, HAL threads included
+static int64_t ProcessCpuNs() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+            1000000000LL +
+            (int64_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+struct StreamConfig {
+    int format;
+    uint32_t width;
+    uint32_t height;
+};
+
+// Camera3Benchmark streams back to back requests at each output configuration
+// of camera 0, with as many requests in flight as the HAL has buffers for,
+// and measures the frame rate, the process_capture_request() to
+// process_capture_result latency of every buffer and the process CPU use.
+//
+// Run it like this:
+//   $ export CAMERA3_TEST_BENCHMARK_SECONDS=10
+//   $ cd /data/nativetest/camera3_tests
+//   $ ./camera3_tests --gtest_filter="Camera3Benchmark.*" --gtest_output=xml
+//
+// Each configuration prints one "camera3_benchmark" line of key=value pairs,
+// and records the same values as test properties in the XML output.
+class Camera3Benchmark : public Camera3Device {
+ public:
+    Camera3Benchmark() :
+        gralloc_(NULL),
+        jpeg_max_size_(0),
+        submitted_(0),
+        returned_(0),
+        errors_(0) {
+        memset(&callbacks_, 0, sizeof(callbacks_));
+        callbacks_.process_capture_result = ProcessCaptureResult;
+        callbacks_.notify = Notify;
+        callbacks_.benchmark = this;
+        pthread_mutex_init(&lock_, NULL);
+        pthread_cond_init(&returned_cond_, NULL);
+    }
+    ~Camera3Benchmark() {
+        pthread_cond_destroy(&returned_cond_);
+        pthread_mutex_destroy(&lock_);
+    }
+
+ protected:
+    virtual void SetUp() {
+        Camera3Device::SetUp();
+        if (HasFatalFailure())
+            return;
+        ASSERT_EQ(0, cam_device()->ops->initialize(cam_device(), &callbacks_))
+                << "Can't initialize camera device";
+
+        const hw_module_t *module = NULL;
+        ASSERT_EQ(0, hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &module))
+                << "Can't get gralloc module";
+        ASSERT_EQ(0, gralloc_open(module, &gralloc_))
+                << "Can't open gralloc device";
+    }
+    virtual void TearDown() {
+        if (gralloc_ != NULL)
+            gralloc_close(gralloc_);
+        if (cam_device() != NULL)
+            cam_device()->common.close(&cam_device()->common);
+    }
+
+    // Output configurations the benchmark can allocate buffers for
+    void GetStreamConfigs(std::vector<StreamConfig> *configs) {
+        camera_info info;
+        ASSERT_EQ(0, cam_module()->get_camera_info(0, &info));
+        camera_metadata_t *static_info = const_cast<camera_metadata_t*>(
+                info.static_camera_characteristics);
+        camera_metadata_entry entry;
+
+        if (find_camera_metadata_entry(static_info, ANDROID_JPEG_MAX_SIZE,
+                &entry) == 0)
+            jpeg_max_size_ = entry.data.i32[0];
+
+        if (info.device_version < CAMERA_DEVICE_API_VERSION_3_2) {
+            if (find_camera_metadata_entry(static_info,
+                    ANDROID_SCALER_AVAILABLE_PROCESSED_SIZES, &entry) == 0) {
+                for (size_t i = 0; i + 1 < entry.count; i += 2)
+                    AddConfig(configs, HAL_PIXEL_FORMAT_YCbCr_420_888,
+                              entry.data.i32[i], entry.data.i32[i + 1]);
+            }
+            if (find_camera_metadata_entry(static_info,
+                    ANDROID_SCALER_AVAILABLE_JPEG_SIZES, &entry) == 0) {
+                for (size_t i = 0; i + 1 < entry.count; i += 2)
+                    AddConfig(configs, HAL_PIXEL_FORMAT_BLOB,
+                              entry.data.i32[i], entry.data.i32[i + 1]);
+            }
+        } else if (find_camera_metadata_entry(static_info,
+                ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS, &entry) == 0) {
+            for (size_t i = 0; i + 3 < entry.count; i += 4) {
+                if (entry.data.i32[i + 3] !=
+                        ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS_OUTPUT)
+                    continue;
+                AddConfig(configs, entry.data.i32[i], entry.data.i32[i + 1],
+                          entry.data.i32[i + 2]);
+            }
+        }
+        ASSERT_FALSE(configs->empty()) << "No output configuration to benchmark";
+    }
+
+    // Stream the configuration for the given time and report the results
+    void Benchmark(const StreamConfig &config, int seconds) {
+        camera3_stream_t stream;
+        memset(&stream, 0, sizeof(stream));
+        stream.stream_type = CAMERA3_STREAM_OUTPUT;
+        stream.width = config.width;
+        stream.height = config.height;
+        stream.format = config.format;
+        stream.usage = GRALLOC_USAGE_SW_READ_OFTEN;
+        camera3_stream_t *streams[] = { &stream };
+        camera3_stream_configuration_t stream_config = { 1, streams };
+        ASSERT_EQ(0, cam_device()->ops->configure_streams(cam_device(),
+                &stream_config)) << "Can't configure " << config.width << "x"
+                << config.height << " format " << config.format;
+        ASSERT_LT(0u, stream.max_buffers);
+
+        ASSERT_NO_FATAL_FAILURE(AllocateBuffers(&stream));
+        const camera_metadata_t *settings =
+                cam_device()->ops->construct_default_request_settings(
+                    cam_device(), CAMERA3_TEMPLATE_PREVIEW);
+        ASSERT_TRUE(NULL != settings) << "Camera default settings are NULL";
+
+        latencies_.clear();
+        submitted_ = returned_ = errors_ = 0;
+        int64_t start = MonotonicNs();
+        int64_t start_cpu = ProcessCpuNs();
+        int64_t end = start + seconds * 1000000000LL;
+        bool ok = true;
+        while (ok && MonotonicNs() < end)
+            ok = SubmitRequest(&stream, settings);
+        ok = WaitForResults(submitted_) && ok;
+        int64_t elapsed = MonotonicNs() - start;
+        int64_t cpu = ProcessCpuNs() - start_cpu;
+        FreeBuffers();
+        ASSERT_TRUE(ok) << "Requests timed out after " << returned_ << " of "
+                << submitted_ << " results";
+
+        std::sort(latencies_.begin(), latencies_.end());
+        Report(config, stream.max_buffers, elapsed, cpu);
+    }
+
+ private:
+    struct Callbacks : public camera3_callback_ops_t {
+        Camera3Benchmark *benchmark;
+    };
+
+    static void AddConfig(std::vector<StreamConfig> *configs, int format,
+                          int32_t width, int32_t height) {
+        // gralloc can only allocate CPU readable formats without a consumer
+        if (format != HAL_PIXEL_FORMAT_YCbCr_420_888 &&
+                format != HAL_PIXEL_FORMAT_BLOB)
+            return;
+        StreamConfig config = { format, (uint32_t)width, (uint32_t)height };
+        configs->push_back(config);
+    }
+
+    void AllocateBuffers(camera3_stream_t *stream) {
+        buffers_.resize(stream->max_buffers);
+        release_fences_.assign(stream->max_buffers, -1);
+        submit_times_.assign(stream->max_buffers, 0);
+        free_.clear();
+        for (uint32_t i = 0; i < stream->max_buffers; i++) {
+            // JPEG buffers are blobs of the maximum JPEG size
+            bool blob = stream->format == HAL_PIXEL_FORMAT_BLOB;
+            int stride;
+            ASSERT_EQ(0, gralloc_->alloc(gralloc_,
+                    blob ? jpeg_max_size_ : stream->width,
+                    blob ? 1 : stream->height, stream->format,
+                    stream->usage | GRALLOC_USAGE_SW_READ_OFTEN, &buffers_[i],
+                    &stride)) << "Can't allocate buffer " << i;
+            free_.push_back(i);
+        }
+
+        camera_info info;
+        ASSERT_EQ(0, cam_module()->get_camera_info(0, &info));
+        if (info.device_version < CAMERA_DEVICE_API_VERSION_3_2) {
+            std::vector<buffer_handle_t*> handles;
+            for (size_t i = 0; i < buffers_.size(); i++)
+                handles.push_back(&buffers_[i]);
+            camera3_stream_buffer_set_t buffer_set = {
+                stream, (uint32_t)handles.size(), &handles[0]
+            };
+            ASSERT_EQ(0, cam_device()->ops->register_stream_buffers(
+                    cam_device(), &buffer_set));
+        }
+    }
+
+    void FreeBuffers() {
+        for (size_t i = 0; i < buffers_.size(); i++) {
+            if (release_fences_[i] != -1) {
+                sync_wait(release_fences_[i], kFenceTimeoutMs);
+                close(release_fences_[i]);
+            }
+            gralloc_->free(gralloc_, buffers_[i]);
+        }
+        buffers_.clear();
+    }
+
+    // Wait for a free buffer and submit a request filling it
+    bool SubmitRequest(camera3_stream_t *stream,
+                       const camera_metadata_t *settings) {
+        int index;
+        int fence;
+
+        pthread_mutex_lock(&lock_);
+        while (free_.empty()) {
+            if (!WaitReturned_l()) {
+                pthread_mutex_unlock(&lock_);
+                return false;
+            }
+        }
+        index = free_.back();
+        free_.pop_back();
+        fence = release_fences_[index];
+        release_fences_[index] = -1;
+        pthread_mutex_unlock(&lock_);
+
+        // The HAL could wait on it as acquire fence, waiting here keeps the
+        // request latency to the HAL's own
+        if (fence != -1) {
+            sync_wait(fence, kFenceTimeoutMs);
+            close(fence);
+        }
+
+        camera3_stream_buffer_t buffer;
+        buffer.stream = stream;
+        buffer.buffer = &buffers_[index];
+        buffer.status = CAMERA3_BUFFER_STATUS_OK;
+        buffer.acquire_fence = -1;
+        buffer.release_fence = -1;
+        camera3_capture_request_t request;
+        memset(&request, 0, sizeof(request));
+        request.frame_number = submitted_;
+        request.settings = submitted_ == 0 ? settings : NULL;
+        request.num_output_buffers = 1;
+        request.output_buffers = &buffer;
+
+        pthread_mutex_lock(&lock_);
+        submit_times_[index] = MonotonicNs();
+        submitted_++;
+        pthread_mutex_unlock(&lock_);
+        int res = cam_device()->ops->process_capture_request(cam_device(),
+                                                             &request);
+        if (res != 0) {
+            ADD_FAILURE() << "process_capture_request failed: " << res;
+            return false;
+        }
+        return true;
+    }
+
+    // Wait for the results of the first count requests
+    bool WaitForResults(int count) {
+        bool ok = true;
+        pthread_mutex_lock(&lock_);
+        while (ok && returned_ < count)
+            ok = WaitReturned_l();
+        pthread_mutex_unlock(&lock_);
+        return ok;
+    }
+
+    // Wait for a buffer to be returned, lock_ held. False on timeout.
+    bool WaitReturned_l() {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        int64_t ns = deadline.tv_nsec + kResultTimeoutNs;
+        deadline.tv_sec += ns / 1000000000LL;
+        deadline.tv_nsec = ns % 1000000000LL;
+        return pthread_cond_timedwait(&returned_cond_, &lock_, &deadline) !=
+                ETIMEDOUT;
+    }
+
+    void OnResult(const camera3_capture_result_t *result) {
+        int64_t now = MonotonicNs();
+        pthread_mutex_lock(&lock_);
+        for (uint32_t i = 0; i < result->num_output_buffers; i++) {
+            const camera3_stream_buffer_t *b = &result->output_buffers[i];
+            int index = b->buffer - &buffers_[0];
+            latencies_.push_back(now - submit_times_[index]);
+            if (b->status != CAMERA3_BUFFER_STATUS_OK)
+                errors_++;
+            release_fences_[index] = b->release_fence;
+            free_.push_back(index);
+            returned_++;
+        }
+        pthread_cond_broadcast(&returned_cond_);
+        pthread_mutex_unlock(&lock_);
+    }
+
+    void Report(const StreamConfig &config, uint32_t max_buffers,
+                int64_t elapsed, int64_t cpu) {
+        int frames = returned_ - errors_;
+        double fps = frames * 1e9 / elapsed;
+        double cpu_percent = cpu * 100.0 / elapsed;
+        int64_t p50 = Percentile(latencies_, 0.5) / 1000;
+        int64_t p90 = Percentile(latencies_, 0.9) / 1000;
+        int64_t p99 = Percentile(latencies_, 0.99) / 1000;
+        int64_t max = Percentile(latencies_, 1.0) / 1000;
+
+        printf("camera3_benchmark camera=0 format=0x%x size=%ux%u "
+               "max_buffers=%u frames=%d errors=%d fps=%.2f "
+               "latency_p50_us=%" PRId64 " latency_p90_us=%" PRId64
+               " latency_p99_us=%" PRId64 " latency_max_us=%" PRId64
+               " cpu_percent=%.1f cpu_us_per_frame=%" PRId64 "\n",
+               config.format, config.width, config.height, max_buffers,
+               frames, errors_, fps, p50, p90, p99, max, cpu_percent,
+               frames > 0 ? cpu / frames / 1000 : 0);
+
+        char key[64];
+        char value[32];
+        int prefix = snprintf(key, sizeof(key), "0x%x_%ux%u_", config.format,
+                              config.width, config.height);
+        snprintf(key + prefix, sizeof(key) - prefix, "frames");
+        RecordProperty(key, frames);
+        snprintf(key + prefix, sizeof(key) - prefix, "errors");
+        RecordProperty(key, errors_);
+        snprintf(key + prefix, sizeof(key) - prefix, "fps");
+        snprintf(value, sizeof(value), "%.2f", fps);
+        RecordProperty(key, value);
+        snprintf(key + prefix, sizeof(key) - prefix, "latency_p50_us");
+        RecordProperty(key, (int)p50);
+        snprintf(key + prefix, sizeof(key) - prefix, "latency_p99_us");
+        RecordProperty(key, (int)p99);
+        snprintf(key + prefix, sizeof(key) - prefix, "latency_max_us");
+        RecordProperty(key, (int)max);
+        snprintf(key + prefix, sizeof(key) - prefix, "cpu_percent");
+        snprintf(value, sizeof(value), "%.1f", cpu_percent);
+        RecordProperty(key, value);
+    }
+
+    static void ProcessCaptureResult(const camera3_callback_ops *ops,
+                                     const camera3_capture_result_t *result) {
+        static_cast<const Callbacks*>(ops)->benchmark->OnResult(result);
+    }
+
+    static void Notify(const camera3_callback_ops * /*ops*/,
+                       const camera3_notify_msg_t * /*msg*/) {
+        // Failed buffers are counted from their status
+    }
+
+    Callbacks callbacks_;
+    alloc_device_t *gralloc_;
+    int32_t jpeg_max_size_;
+    // Buffers of the stream being benchmarked, and for each of them the
+    // release fence it was returned with and the time it was submitted
+    std::vector<buffer_handle_t> buffers_;
+    std::vector<int> release_fences_;
+    std::vector<int64_t> submit_times_;
+    // Indices of the buffers not in flight
+    std::vector<int> free_;
+    // Requests submitted, buffers returned and returned in error
+    int submitted_;
+    int returned_;
+    int errors_;
+    // Request to result latency of every returned buffer
+    std::vector<int64_t> latencies_;
+    // Lock protecting the buffer state and counters, and signalled when a
+    // buffer is returned
+    pthread_mutex_t lock_;
+    pthread_cond_t returned_cond_;
+};
+
+TEST_F(Camera3Benchmark, SustainedRepeatingRequests) {
+    int seconds = BenchmarkSeconds();
+    if (seconds <= 0) {
+        printf("Skipping benchmark, CAMERA3_TEST_BENCHMARK_SECONDS not set\n");
+        return;
+    }
+
+    std::vector<StreamConfig> configs;
+    ASSERT_NO_FATAL_FAILURE(GetStreamConfigs(&configs));
+    for (size_t i = 0; i < configs.size(); i++)
+        ASSERT_NO_FATAL_FAILURE(Benchmark(configs[i], seconds));
+}
+
+}  // namespace tests
@@ -0,0 +1,378 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <cutils/native_handle.h>
+#include <hardware/gralloc.h>
+
+#include "BenchmarkTest.h"
+
+namespace android {
+
+using benchmark::MonotonicNs;
+
+static int BenchmarkSeconds() {
+    return benchmark::Seconds("GRALLOC");
+}
+
+static int BenchmarkThreads() {
+    return benchmark::Threads("GRALLOC");
+}
+
+// A copy of handle with its own fds, as a handle received over binder is
+static native_handle_t* CloneHandle(buffer_handle_t handle) {
+    native_handle_t* clone = native_handle_create(handle->numFds, handle->numInts);
+    if (clone == NULL)
+        return NULL;
+    for (int i = 0; i < handle->numFds; i++) {
+        clone->data[i] = dup(handle->data[i]);
+        if (clone->data[i] < 0) {
+            clone->numFds = i;
+            native_handle_close(clone);
+            native_handle_delete(clone);
+            return NULL;
+        }
+    }
+    memcpy(&clone->data[handle->numFds], &handle->data[handle->numFds],
+            sizeof(int) * handle->numInts);
+    return clone;
+}
+
+struct BufferConfig {
+    const char* name;
+    int format;
+    int width;
+    int height;
+    int usage;
+};
+
+static void PrintTo(const BufferConfig& config, std::ostream* os) {
+    *os << config.name << "_" << config.width << "x" << config.height;
+}
+
+// Every benchmark times two operations, the second undoing the first
+enum Benchmark {
+    BENCH_ALLOC_FREE,
+    BENCH_REGISTER_UNREGISTER,
+    BENCH_LOCK_UNLOCK,
+    BENCH_FIRST_TOUCH,
+};
+
+static const char* OperationName(Benchmark bench, int second) {
+    switch (bench) {
+    case BENCH_ALLOC_FREE: return second ? "free" : "alloc";
+    case BENCH_REGISTER_UNREGISTER: return second ? "unregister" : "register";
+    case BENCH_LOCK_UNLOCK: return second ? "unlock" : "lock";
+    default: return second ? "touch" : "first_lock";
+    }
+}
+
+// GrallocBenchmark measures the latency of the gralloc operations a buffer
+// goes through, for buffers of several formats and sizes, on one thread and
+// then on several at once:
+//
+//   alloc, free            a buffer allocated and freed right away
+//   register, unregister   a handle received from another process
+//   lock, unlock           a buffer already mapped, locked for the CPU
+//   first_lock, touch      a new buffer locked, mapping it, then written
+//                          once per page, which takes the page faults
+//
+// The pooling of freed buffers shows in alloc and in touch, lazy mapping in
+// first_lock, and the heap buffers come from in all of them.
+//
+// It runs as BenchmarkTest.h describes, with the GRALLOC variables, and
+// prints "gralloc_benchmark" lines.
+class GrallocBenchmark : public ::testing::TestWithParam<BufferConfig> {
+public:
+    static void SetUpTestCase() {
+        const hw_module_t* mod;
+        if (BenchmarkSeconds() <= 0)
+            return;
+        ASSERT_EQ(0, hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &mod))
+                << "Should be able to find a gralloc hardware module";
+        sModule = reinterpret_cast<const gralloc_module_t*>(mod);
+        ASSERT_EQ(0, gralloc_open(mod, &sDevice))
+                << "Should be able to open the gralloc device";
+    }
+
+    static void TearDownTestCase() {
+        if (sDevice != NULL)
+            gralloc_close(sDevice);
+        sDevice = NULL;
+        sModule = NULL;
+    }
+
+protected:
+    virtual void SetUp() {
+        if (BenchmarkSeconds() <= 0)
+            return;
+        ASSERT_TRUE(sDevice != NULL);
+
+        // A buffer nobody can allocate is no regression of this gralloc
+        buffer_handle_t handle;
+        int stride;
+        const BufferConfig& config = GetParam();
+        ASSERT_EQ(0, sDevice->alloc(sDevice, config.width, config.height,
+                config.format, config.usage, &handle, &stride))
+                << "Should allocate a " << config.name << " buffer";
+        sDevice->free(sDevice, handle);
+    }
+
+    int Lock(buffer_handle_t handle, void** vaddr) {
+        const BufferConfig& config = GetParam();
+        const int usage = GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN;
+
+        if (config.format == HAL_PIXEL_FORMAT_YCbCr_420_888) {
+            struct android_ycbcr ycbcr;
+            if (sModule->lock_ycbcr == NULL)
+                return -ENOSYS;
+            int res = sModule->lock_ycbcr(sModule, handle, usage, 0, 0,
+                    config.width, config.height, &ycbcr);
+            *vaddr = ycbcr.y;
+            return res;
+        }
+        return sModule->lock(sModule, handle, usage, 0, 0,
+                config.width, config.height, vaddr);
+    }
+
+    // Bytes of a buffer of stride pixels certainly written by its producer
+    size_t ContentBytes(int stride) {
+        const BufferConfig& config = GetParam();
+
+        switch (config.format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+            return (size_t)stride * config.height * 4;
+        case HAL_PIXEL_FORMAT_RGB_888:
+            return (size_t)stride * config.height * 3;
+        case HAL_PIXEL_FORMAT_RGB_565:
+            return (size_t)stride * config.height * 2;
+        case HAL_PIXEL_FORMAT_BLOB:
+            return (size_t)config.width * config.height;
+        default:
+            // YUV 4:2:0
+            return (size_t)stride * config.height * 3 / 2;
+        }
+    }
+
+    // One iteration timing both operations into latencies, 0 on success
+    int RunOnce(Benchmark bench, buffer_handle_t handle, int stride,
+            std::vector<int64_t>* latencies) {
+        const BufferConfig& config = GetParam();
+        int64_t start, mid;
+        int res = 0;
+
+        switch (bench) {
+        case BENCH_ALLOC_FREE: {
+            buffer_handle_t buffer;
+            int bufferStride;
+            start = MonotonicNs();
+            res = sDevice->alloc(sDevice, config.width, config.height,
+                    config.format, config.usage, &buffer, &bufferStride);
+            mid = MonotonicNs();
+            if (res == 0)
+                res = sDevice->free(sDevice, buffer);
+            break;
+        }
+        case BENCH_REGISTER_UNREGISTER: {
+            // what a consumer does with a handle it received over binder
+            native_handle_t* clone = CloneHandle(handle);
+            if (clone == NULL)
+                return -ENOMEM;
+            start = MonotonicNs();
+            res = sModule->registerBuffer(sModule, clone);
+            mid = MonotonicNs();
+            if (res == 0)
+                res = sModule->unregisterBuffer(sModule, clone);
+            native_handle_close(clone);
+            native_handle_delete(clone);
+            break;
+        }
+        case BENCH_LOCK_UNLOCK: {
+            void* vaddr;
+            start = MonotonicNs();
+            res = Lock(handle, &vaddr);
+            mid = MonotonicNs();
+            if (res == 0)
+                res = sModule->unlock(sModule, handle);
+            break;
+        }
+        default: {
+            buffer_handle_t buffer;
+            int bufferStride;
+            void* vaddr;
+            res = sDevice->alloc(sDevice, config.width, config.height,
+                    config.format, config.usage, &buffer, &bufferStride);
+            if (res != 0)
+                return res;
+            start = MonotonicNs();
+            res = Lock(buffer, &vaddr);
+            mid = MonotonicNs();
+            if (res == 0) {
+                const size_t bytes = ContentBytes(bufferStride);
+                const size_t page = sysconf(_SC_PAGESIZE);
+                volatile uint8_t* p = static_cast<uint8_t*>(vaddr);
+                for (size_t offset = 0; offset < bytes; offset += page)
+                    p[offset] = 0;
+                latencies[0].push_back(mid - start);
+                latencies[1].push_back(MonotonicNs() - mid);
+                sModule->unlock(sModule, buffer);
+            }
+            sDevice->free(sDevice, buffer);
+            return res;
+        }
+        }
+
+        latencies[0].push_back(mid - start);
+        latencies[1].push_back(MonotonicNs() - mid);
+        return res;
+    }
+
+    static void* WorkerLoop(void* arg) {
+        benchmark::Worker* worker = static_cast<benchmark::Worker*>(arg);
+        GrallocBenchmark* benchmark = static_cast<GrallocBenchmark*>(worker->context);
+        const Benchmark bench = static_cast<Benchmark>(worker->op);
+        const BufferConfig& config = benchmark->GetParam();
+        buffer_handle_t handle = NULL;
+        int stride = 0;
+
+        // the buffer of the benchmarks on an existing one, mapped for lock
+        if (bench == BENCH_REGISTER_UNREGISTER || bench == BENCH_LOCK_UNLOCK) {
+            void* vaddr;
+            if (sDevice->alloc(sDevice, config.width, config.height,
+                    config.format, config.usage, &handle, &stride) != 0) {
+                worker->errors++;
+                return NULL;
+            }
+            if (bench == BENCH_LOCK_UNLOCK) {
+                if (benchmark->Lock(handle, &vaddr) == 0)
+                    sModule->unlock(sModule, handle);
+                else
+                    worker->errors++;
+            }
+        }
+
+        // Every worker does at least one iteration, however slow
+        do {
+            if (benchmark->RunOnce(bench, handle, stride, worker->latencies) != 0)
+                worker->errors++;
+        } while (MonotonicNs() < worker->deadline);
+
+        if (handle != NULL)
+            sDevice->free(sDevice, handle);
+        return NULL;
+    }
+
+    void Report(Benchmark bench, int second, int threads, int64_t elapsed,
+            std::vector<int64_t>& latencies, int errors) {
+        const BufferConfig& config = GetParam();
+        char labels[64];
+        snprintf(labels, sizeof(labels), "format=%s width=%d height=%d",
+                config.name, config.width, config.height);
+        benchmark::ReportLatencies("gralloc_benchmark", OperationName(bench, second),
+                labels, threads, elapsed, latencies, errors);
+    }
+
+    void Run(Benchmark bench, int threads) {
+        std::vector<int64_t> latencies[2];
+        int errors = 0;
+
+        int64_t elapsed = benchmark::RunWorkers(this, bench, threads, BenchmarkSeconds(),
+                WorkerLoop, latencies, &errors);
+        ASSERT_GE(elapsed, 0) << "Should start " << threads << " threads";
+
+        Report(bench, 0, threads, elapsed, latencies[0], errors);
+        Report(bench, 1, threads, elapsed, latencies[1], errors);
+
+        EXPECT_EQ(0, errors) << "Every " << OperationName(bench, 0) << " and "
+                << OperationName(bench, 1) << " should succeed";
+    }
+
+    void RunAll(Benchmark bench) {
+        Run(bench, 1);
+        if (BenchmarkThreads() > 1)
+            Run(bench, BenchmarkThreads());
+    }
+
+    static const gralloc_module_t* sModule;
+    static alloc_device_t* sDevice;
+};
+
+const gralloc_module_t* GrallocBenchmark::sModule = NULL;
+alloc_device_t* GrallocBenchmark::sDevice = NULL;
+
+TEST_P(GrallocBenchmark, AllocFree) {
+    if (BenchmarkSeconds() <= 0)
+        return;
+    RunAll(BENCH_ALLOC_FREE);
+}
+
+TEST_P(GrallocBenchmark, RegisterUnregister) {
+    if (BenchmarkSeconds() <= 0)
+        return;
+    RunAll(BENCH_REGISTER_UNREGISTER);
+}
+
+TEST_P(GrallocBenchmark, LockUnlock) {
+    if (BenchmarkSeconds() <= 0)
+        return;
+    RunAll(BENCH_LOCK_UNLOCK);
+}
+
+TEST_P(GrallocBenchmark, FirstTouch) {
+    if (BenchmarkSeconds() <= 0)
+        return;
+    RunAll(BENCH_FIRST_TOUCH);
+}
+
+#define SW_USAGE (GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN)
+
+static const BufferConfig kBufferConfigs[] = {
+    // icons, UI layers and windows, wallpapers
+    { "RGBA_8888", HAL_PIXEL_FORMAT_RGBA_8888, 256, 256,
+            GRALLOC_USAGE_HW_TEXTURE | SW_USAGE },
+    { "RGBA_8888", HAL_PIXEL_FORMAT_RGBA_8888, 1920, 1080,
+            GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_RENDER | SW_USAGE },
+    { "RGBA_8888", HAL_PIXEL_FORMAT_RGBA_8888, 3840, 2160,
+            GRALLOC_USAGE_HW_TEXTURE | SW_USAGE },
+    { "RGB_565", HAL_PIXEL_FORMAT_RGB_565, 1280, 720,
+            GRALLOC_USAGE_HW_TEXTURE | SW_USAGE },
+    // camera preview, callbacks and video
+    { "YV12", HAL_PIXEL_FORMAT_YV12, 1920, 1080,
+            GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_VIDEO_ENCODER | SW_USAGE },
+    { "NV21", HAL_PIXEL_FORMAT_YCrCb_420_SP, 1920, 1080,
+            GRALLOC_USAGE_HW_CAMERA_WRITE | SW_USAGE },
+    { "YCbCr_420_888", HAL_PIXEL_FORMAT_YCbCr_420_888, 1920, 1080,
+            GRALLOC_USAGE_HW_CAMERA_WRITE | SW_USAGE },
+    // JPEG of an 8 megapixel picture
+    { "BLOB", HAL_PIXEL_FORMAT_BLOB, 4 * 1024 * 1024, 1,
+            GRALLOC_USAGE_HW_CAMERA_WRITE | SW_USAGE },
+};
+
+INSTANTIATE_TEST_CASE_P(Buffers,
+                        GrallocBenchmark,
+                        ::testing::ValuesIn(kBufferConfigs));
+
+}
@@ -2,11 +2,15 @@ LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE := static-hal-check
-LOCAL_SRC_FILES := struct-size.cpp struct-offset.cpp struct-last.cpp
+LOCAL_SRC_FILES := struct-size.cpp struct-offset.cpp struct-last.cpp struct-layout.cpp
 LOCAL_SHARED_LIBRARIES := libhardware
 LOCAL_CFLAGS := -std=gnu++11 -O0
 
 LOCAL_C_INCLUDES += \
-    system/media/camera/include
+    system/media/camera/include \
+    $(LOCAL_PATH)/../../modules/gralloc \
+    $(LOCAL_PATH)/../../modules/sharebuffer \
+    $(LOCAL_PATH)/../../modules/sfdroid_audio \
+    $(LOCAL_PATH)/../../modules/sfdroid_sensors
 
 include $(BUILD_STATIC_LIBRARY)
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstddef>
+#include <cutils/log.h>
+#include <hardware/hardware.h>
+#include <hardware/sensors.h>
+
+#include "gralloc_priv.h"
+#include "sb_protocol.h"
+#include "sfdroid_audio_protocol.h"
+#include "sfdroid_sensors_protocol.h"
+
+// Layout of the structs on hot paths: what one cache line holds and which members written by
+// different threads or processes must never share one. Unlike struct-offset.cpp these are not
+// ABI constraints, a failure here means a change made some path slower.
+
+#define CACHE_LINE_SIZE 64
+
+#define LINE_OF(type, member) (offsetof(type, member) / CACHE_LINE_SIZE)
+
+// member lies within a single cache line of a cache line aligned type
+#define CHECK_IN_ONE_LINE(type, member) \
+    static_assert(LINE_OF(type, member) == \
+            (offsetof(type, member) + sizeof(((type *)0)->member) - 1) / CACHE_LINE_SIZE, \
+            "" #member " of " #type " spans two cache lines")
+
+// first to last, both included, lie within the first cache line of type
+#define CHECK_IN_FIRST_LINE(type, first, last) \
+    static_assert(offsetof(type, first) < offsetof(type, last) && \
+            offsetof(type, last) + sizeof(((type *)0)->last) <= CACHE_LINE_SIZE, \
+            "" #first " to " #last " of " #type " are not in its first cache line")
+
+// a and b, written by different sides, are on different cache lines
+#define CHECK_APART(type, a, b) \
+    static_assert(LINE_OF(type, a) != LINE_OF(type, b), \
+            "" #a " and " #b " of " #type " share a cache line")
+
+#define CHECK_LINE_ALIGNED(type) \
+    static_assert(alignof(type) == CACHE_LINE_SIZE && sizeof(type) % CACHE_LINE_SIZE == 0, \
+            "" #type " is not cache line aligned")
+
+void CheckLayouts(void) {
+    // Events are copied around in arrays by every poll(): timestamps stay 8 byte aligned from
+    // one event to the next, and the fields sensor services sort on and the values of all but
+    // the largest types are in the first cache line of an event.
+    static_assert(sizeof(sensors_event_t) % 8 == 0 && offsetof(sensors_event_t, timestamp) % 8 == 0,
+            "timestamps of sensors_event_t arrays are misaligned");
+    CHECK_IN_FIRST_LINE(sensors_event_t, version, timestamp);
+    CHECK_IN_FIRST_LINE(sensors_event_t, sensor, uncalibrated_gyro);
+
+    // Every lock, unlock and post reads the handle: everything up to base in the first cache
+    // line, the identity of the last member in the one after. It derives from native_handle,
+    // GCC and clang lay it out as the C struct.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+    static_assert(alignof(private_handle_t) == 8, "private_handle_t is not 8 byte aligned");
+    CHECK_IN_FIRST_LINE(private_handle_t, fd, base);
+    static_assert(offsetof(private_handle_t, identity) + sizeof(gralloc_buffer_identity_t) ==
+            sizeof(private_handle_t), "identity is not the last member of private_handle_t");
+    static_assert(sizeof(private_handle_t) <= 2 * CACHE_LINE_SIZE,
+            "private_handle_t spans more than two cache lines");
+#pragma GCC diagnostic pop
+
+    // Shared memory rings: the index each side writes on its own cache line, so producer and
+    // consumer never write the same line, and the payload starting on a line of its own.
+    CHECK_LINE_ALIGNED(sb_ring_t);
+    CHECK_APART(sb_ring_t, magic, head);
+    CHECK_APART(sb_ring_t, head, tail);
+    CHECK_APART(sb_ring_t, tail, slots);
+    static_assert(offsetof(sb_ring_t, slots) % CACHE_LINE_SIZE == 0,
+            "slots of sb_ring_t are not cache line aligned");
+
+    CHECK_LINE_ALIGNED(sfdroid_sensor_ring_t);
+    CHECK_APART(sfdroid_sensor_ring_t, magic, head);
+    CHECK_APART(sfdroid_sensor_ring_t, head, tail);
+    CHECK_APART(sfdroid_sensor_ring_t, tail, events);
+    static_assert(offsetof(sfdroid_sensor_ring_t, events) % CACHE_LINE_SIZE == 0,
+            "events of sfdroid_sensor_ring_t are not cache line aligned");
+    static_assert(sizeof(sfdroid_sensor_event_t) % 8 == 0,
+            "timestamps of sfdroid_sensor_event_t are misaligned in the ring");
+
+    CHECK_LINE_ALIGNED(sfdroid_audio_ring_t);
+    CHECK_APART(sfdroid_audio_ring_t, magic, write_pos);
+    CHECK_APART(sfdroid_audio_ring_t, write_pos, read_pos);
+    CHECK_APART(sfdroid_audio_ring_t, read_pos, hal_waiting);
+    CHECK_APART(sfdroid_audio_ring_t, position_ns, data);
+    static_assert(offsetof(sfdroid_audio_ring_t, data) % CACHE_LINE_SIZE == 0,
+            "data of sfdroid_audio_ring_t is not cache line aligned");
+    // The position sequence lock is read in one go
+    CHECK_IN_ONE_LINE(sfdroid_audio_ring_t, position_seq);
+    static_assert(LINE_OF(sfdroid_audio_ring_t, position_seq) ==
+            LINE_OF(sfdroid_audio_ring_t, position_ns),
+            "the position of sfdroid_audio_ring_t spans two cache lines");
+}
@@ -53,7 +53,8 @@ void CheckOffsets(void) {
     CHECK_MEMBER_AT(hw_device_t, tag, 0, 0);
     CHECK_MEMBER_AT(hw_device_t, version, 4, 4);
     CHECK_MEMBER_AT(hw_device_t, module, 8, 8);
-    CHECK_MEMBER_AT(hw_device_t, reserved, 12, 16);
+    CHECK_MEMBER_AT(hw_device_t, ext, 12, 16);
+    CHECK_MEMBER_AT(hw_device_t, reserved, 16, 24);
     CHECK_MEMBER_AT(hw_device_t, close, 60, 112);
 
     //Types defined in sensors.h
@@ -196,7 +197,8 @@ void CheckOffsets(void) {
     CHECK_MEMBER_AT(consumerir_device_t, transmit, 64, 120);
     CHECK_MEMBER_AT(consumerir_device_t, get_num_carrier_freqs, 68, 128);
     CHECK_MEMBER_AT(consumerir_device_t, get_carrier_freqs, 72, 136);
-    CHECK_MEMBER_AT(consumerir_device_t, reserved, 76, 144);
+    CHECK_MEMBER_AT(consumerir_device_t, transmit_async, 76, 144);
+    CHECK_MEMBER_AT(consumerir_device_t, reserved, 80, 152);
 
     //Types defined in camera_common.h
     CHECK_MEMBER_AT(vendor_tag_ops_t, get_tag_count, 0, 0);
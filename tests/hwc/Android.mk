@@ -12,3 +12,11 @@ LOCAL_STATIC_LIBRARIES := libcnativewindow
 LOCAL_SHARED_LIBRARIES := libEGL libGLESv2 libdl libhardware
 LOCAL_CFLAGS := -DGL_GLEXT_PROTOTYPES
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := hwc-benchmark
+LOCAL_SRC_FILES := hwc-benchmark.c
+LOCAL_STATIC_LIBRARIES := libcnativewindow
+LOCAL_SHARED_LIBRARIES := libEGL libGLESv2 libdl libhardware
+LOCAL_CFLAGS := -DGL_GLEXT_PROTOTYPES
+include $(BUILD_EXECUTABLE)
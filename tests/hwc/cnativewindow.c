@@ -29,6 +29,11 @@
 #include <system/window.h>
 #include <cutils/native_handle.h>
 
+#include <EGL/egl.h>
+#include <GLES2/gl2.h>
+
+#include "util.h"
+
 // normalize and shorten type names
 typedef struct android_native_base_t aBase;
 typedef struct ANativeWindowBuffer aBuffer;
@@ -53,11 +58,18 @@ typedef struct CNativeBuffer {
 	int ffd;
 } CNativeBuffer;
 
+typedef struct CNativeStaticLayer {
+	aBuffer *buf;
+	hwc_rect_t frame;
+	int above;
+} CNativeStaticLayer;
+
 typedef struct CNativeWindow {
 	aWindow base;
 
 	hwc_composer_device_1_t *hwc;
 	framebuffer_device_t *fb;
+	const gralloc_module_t *grmod;
 	alloc_device_t *gr;
 
 	pthread_mutex_t lock;
@@ -73,11 +85,18 @@ typedef struct CNativeWindow {
 	unsigned xdpi;
 	unsigned ydpi;
 	unsigned format;
+	int64_t vsync_period;
+
+	// where the window buffer is shown, the whole display if empty
+	hwc_rect_t frame;
+	CNativeStaticLayer statics[CNW_MAX_STATIC_LAYERS];
+	unsigned num_statics;
+	int geometry_changed;
 
 	hwc_display_contents_1_t *dclist[HWC_NUM_PHYSICAL_DISPLAY_TYPES];
 
 	hwc_display_contents_1_t dc;
-	hwc_layer_1_t layer[4];
+	hwc_layer_1_t layer[CNW_MAX_STATIC_LAYERS + 2];
 } CNativeWindow;
 
 static inline CNativeBuffer *from_abuffer(aBuffer *buf) {
@@ -177,26 +196,51 @@ static void set_layer(hwc_layer_1_t *dl, aBuffer *buf, int ffd) {
 	dl->releaseFenceFd = -1;
 }
 
+static void set_frame(hwc_layer_1_t *dl, hwc_rect_t const *frame) {
+	dl->sourceCrop = *frame;
+	dl->displayFrame = *frame;
+}
+
+static void set_static_layer(hwc_layer_1_t *dl, CNativeStaticLayer *sl) {
+	set_layer(dl, sl->buf, -1);
+	set_frame(dl, &sl->frame);
+	if (sl->above)
+		dl->blending = HWC_BLENDING_PREMULT;
+}
+
 static void hwc_post(CNativeWindow *win, aBuffer *buf, int ffd) {
 	hwc_composer_device_1_t *hwc = win->hwc;
 	hwc_display_contents_1_t *dc = &(win->dc);
 	hwc_layer_1_t *dl = win->dc.hwLayers;
+	unsigned window = 0;
 	int r, i;
 
 	dc->retireFenceFd = -1;
 	dc->outbufAcquireFenceFd = -1;
-	dc->flags = HWC_GEOMETRY_CHANGED;
-	dc->numHwLayers = 1;
+	dc->flags = win->geometry_changed ? HWC_GEOMETRY_CHANGED : 0;
+	dc->numHwLayers = 0;
+	win->geometry_changed = 0;
 
 	// some hwcomposers fail if these are NULL
 	dc->dpy = (void*) 0xdeadbeef;
 	dc->sur = (void*) 0xdeadbeef;
 
-	set_layer(&dl[0], buf, ffd);
+	for (i = 0; i < (int) win->num_statics; i++)
+		if (!win->statics[i].above)
+			set_static_layer(&dl[dc->numHwLayers++], &win->statics[i]);
+
+	window = dc->numHwLayers++;
+	set_layer(&dl[window], buf, ffd);
+	if (win->frame.right > win->frame.left)
+		set_frame(&dl[window], &win->frame);
+
+	for (i = 0; i < (int) win->num_statics; i++)
+		if (win->statics[i].above)
+			set_static_layer(&dl[dc->numHwLayers++], &win->statics[i]);
 
 	if (QCT_WORKAROUND) {
-		set_layer(&dl[1], win->spare, -1);
-		dl[1].compositionType = HWC_FRAMEBUFFER_TARGET;
+		set_layer(&dl[dc->numHwLayers], win->spare, -1);
+		dl[dc->numHwLayers].compositionType = HWC_FRAMEBUFFER_TARGET;
 		dc->numHwLayers++;
 	}
 
@@ -218,13 +262,13 @@ static void hwc_post(CNativeWindow *win, aBuffer *buf, int ffd) {
 
 	if (dc->retireFenceFd != -1)
 		close(dc->retireFenceFd);
-	if (dl->releaseFenceFd != -1) {
+	if (dl[window].releaseFenceFd != -1) {
 		CNativeBuffer *cnb = from_abuffer(buf);
-		cnb->ffd = dl->releaseFenceFd;
+		cnb->ffd = dl[window].releaseFenceFd;
 	}
-	if (QCT_WORKAROUND)
-		if (dl[1].releaseFenceFd != -1)
-			close(dl[1].releaseFenceFd);
+	for (i = 0; i < (int) dc->numHwLayers; i++)
+		if (i != (int) window && dl[i].releaseFenceFd != -1)
+			close(dl[i].releaseFenceFd);
 }
 
 static int cnw_queue_buffer1(aWindow *base, aBuffer *buffer, int ffd) {
@@ -415,6 +459,7 @@ static int hwc_init(CNativeWindow *win) {
 
 	win->width = values[0];
 	win->height = values[1];
+	win->vsync_period = values[2];
 	win->xdpi = values[3];
 	win->ydpi = values[4];
 	win->format = HAL_PIXEL_FORMAT_RGBA_8888;
@@ -487,12 +532,16 @@ static int cnw_init(CNativeWindow *win) {
 		win->format = fb->format;
 		win->xdpi = fb->xdpi;
 		win->ydpi = fb->ydpi;
+		win->vsync_period = fb->fps > 0 ? 1000000000LL / fb->fps : 0;
 		win->fb = fb;
 	}
 
 	INFO("display %d x %d fmt=%d\n",
 		win->width, win->height, win->format);
 
+	win->grmod = (const gralloc_module_t*) module;
+	win->geometry_changed = 1;
+
 	err = gralloc_open(module, &gr);
 	if (err) {
 		ERROR("couldn't open gralloc HAL (%s)", strerror(-err));
@@ -547,6 +596,7 @@ static int cnw_init(CNativeWindow *win) {
 }
 
 void cnw_destroy(CNativeWindow *win) {
+	cnw_clear_static_layers(win);
 	if (win->fb)
 		framebuffer_close(win->fb);
 	if (win->hwc)
@@ -576,3 +626,67 @@ void cnw_info(CNativeWindow *win, unsigned *w, unsigned *h, unsigned *fmt) {
 	*fmt = win->format;
 }
 
+
+int64_t cnw_vsync_period(CNativeWindow *win) {
+	return win->vsync_period;
+}
+
+int cnw_has_hwc(CNativeWindow *win) {
+	return win->hwc != NULL;
+}
+
+void cnw_set_frame(CNativeWindow *win, int left, int top, int right, int bottom) {
+	win->frame.left = left;
+	win->frame.top = top;
+	win->frame.right = right;
+	win->frame.bottom = bottom;
+	win->geometry_changed = 1;
+}
+
+int cnw_add_static_layer(CNativeWindow *win, int left, int top,
+		int right, int bottom, uint32_t color, int above) {
+	CNativeStaticLayer *sl;
+	void *vaddr;
+	unsigned x, y;
+	unsigned usage = GRALLOC_USAGE_HW_COMPOSER |
+		GRALLOC_USAGE_HW_TEXTURE |
+		GRALLOC_USAGE_SW_WRITE_RARELY;
+
+	if (!win->hwc || win->num_statics == CNW_MAX_STATIC_LAYERS)
+		return -ENOSPC;
+
+	sl = &win->statics[win->num_statics];
+	if (!(sl->buf = cnw_alloc(win, HAL_PIXEL_FORMAT_RGBA_8888, usage)))
+		return -ENOMEM;
+	if (win->grmod->lock(win->grmod, sl->buf->handle,
+			GRALLOC_USAGE_SW_WRITE_RARELY, 0, 0,
+			win->width, win->height, &vaddr)) {
+		ERROR("cannot lock static layer\n");
+	} else {
+		for (y = 0; y < win->height; y++) {
+			uint32_t *line = (uint32_t*) vaddr + y * sl->buf->stride;
+			for (x = 0; x < win->width; x++)
+				line[x] = color;
+		}
+		win->grmod->unlock(win->grmod, sl->buf->handle);
+	}
+	sl->frame.left = left;
+	sl->frame.top = top;
+	sl->frame.right = right;
+	sl->frame.bottom = bottom;
+	sl->above = above;
+	win->num_statics++;
+	win->geometry_changed = 1;
+	return 0;
+}
+
+void cnw_clear_static_layers(CNativeWindow *win) {
+	unsigned i;
+
+	for (i = 0; i < win->num_statics; i++) {
+		win->gr->free(win->gr, win->statics[i].buf->handle);
+		free(win->statics[i].buf);
+	}
+	win->num_statics = 0;
+	win->geometry_changed = 1;
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <EGL/egl.h>
+#include <GLES2/gl2.h>
+
+#include "util.h"
+
+/*
+ * Presents fixed workloads through the cnativewindow harness, and with it
+ * hwcomposer or the fb HAL, and reports how fast frames get on screen:
+ *
+ *   fullscreen   the window redrawn every frame, like video
+ *   layers=N     the window under N-1 static translucent strips
+ *   partial      a quarter of the display redrawn over a static background
+ *
+ * Every scenario draws the same frames in the same order, so runs on
+ * different builds or devices compare. Each prints one "hwc_benchmark"
+ * line of key=value pairs.
+ *
+ * usage: hwc-benchmark [-n frames] [scenario ...]
+ */
+
+#define DEFAULT_FRAMES	600
+/* frames drawn before measuring, while buffers and caches settle */
+#define WARMUP_FRAMES	30
+
+static int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const int64_t *sorted, int count, double fraction) {
+	if (count == 0)
+		return 0.0;
+	return sorted[(int) (fraction * (count - 1))] / 1e6;
+}
+
+/* set up the layers of a scenario, returns the layer count or -1 */
+static int setup(struct CNativeWindow *win, const char *scenario,
+		int w, int h, int *partial) {
+	int layers, i;
+
+	cnw_clear_static_layers(win);
+	cnw_set_frame(win, 0, 0, 0, 0);
+	*partial = 0;
+
+	if (!strcmp(scenario, "fullscreen"))
+		return 1;
+
+	if (!strncmp(scenario, "layers=", 7)) {
+		layers = atoi(scenario + 7);
+		if (layers < 1 || layers > CNW_MAX_STATIC_LAYERS + 1)
+			return -1;
+		for (i = 1; i < layers; i++) {
+			int top = (i - 1) * h / (layers - 1);
+			int bottom = i * h / (layers - 1);
+			/* premultiplied half transparent grey */
+			if (cnw_add_static_layer(win, 0, top, w, bottom,
+					0x80404040, 1))
+				return -1;
+		}
+		return layers;
+	}
+
+	if (!strcmp(scenario, "partial")) {
+		if (cnw_add_static_layer(win, 0, 0, w, h, 0xff202020, 0))
+			return -1;
+		cnw_set_frame(win, w / 4, h / 4, w * 3 / 4, h * 3 / 4);
+		*partial = 1;
+		return 2;
+	}
+
+	return -1;
+}
+
+/* the same colors in the same order for every run */
+static void render(int frame, int w, int h, int partial) {
+	float v = (frame % 64) / 63.0f;
+
+	if (partial) {
+		glEnable(GL_SCISSOR_TEST);
+		glScissor(w / 4, h / 4, w / 2, h / 2);
+	}
+	glClearColor(v, 1.0f - v, 0.5f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	if (partial)
+		glDisable(GL_SCISSOR_TEST);
+}
+
+static int run(EGLDisplay display, EGLSurface surface, const char *scenario,
+		int w, int h, int frames) {
+	struct CNativeWindow *win = egl_window();
+	int64_t period = cnw_vsync_period(win);
+	int64_t *intervals;
+	int64_t last = 0, first = 0;
+	int layers, partial, missed = 0, i;
+
+	layers = setup(win, scenario, w, h, &partial);
+	if (layers < 0) {
+		fprintf(stderr, "unknown or unsupported scenario %s\n", scenario);
+		return -1;
+	}
+	if (!(intervals = malloc(frames * sizeof(*intervals))))
+		return -1;
+
+	for (i = -WARMUP_FRAMES; i <= frames; i++) {
+		render(i + WARMUP_FRAMES, w, h, partial);
+		eglSwapBuffers(display, surface);
+
+		int64_t t = now_ns();
+		if (i == 0)
+			first = t;
+		else if (i > 0) {
+			int64_t interval = t - last;
+			intervals[i - 1] = interval;
+			/* a frame taking n periods missed n - 1 vsyncs */
+			if (period > 0 && interval > period * 3 / 2)
+				missed += (interval + period / 2) / period - 1;
+		}
+		last = t;
+	}
+
+	qsort(intervals, frames, sizeof(*intervals), cmp_int64);
+	printf("hwc_benchmark scenario=%s layers=%d composer=%s frames=%d "
+		"fps=%.1f p50_ms=%.2f p90_ms=%.2f p99_ms=%.2f max_ms=%.2f "
+		"missed_vsyncs=%d vsync_ms=%.2f\n",
+		scenario, layers, cnw_has_hwc(win) ? "hwc" : "fb", frames,
+		frames * 1e9 / (last - first),
+		percentile_ms(intervals, frames, 0.50),
+		percentile_ms(intervals, frames, 0.90),
+		percentile_ms(intervals, frames, 0.99),
+		intervals[frames - 1] / 1e6,
+		missed, period / 1e6);
+
+	free(intervals);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	static const char *defaults[] = {
+		"fullscreen", "layers=2", "layers=4", "partial",
+	};
+	EGLDisplay display;
+	EGLSurface surface;
+	int w, h, c, i, res = 0;
+	int frames = DEFAULT_FRAMES;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			frames = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n frames] [scenario ...]\n",
+				argv[0]);
+			return -1;
+		}
+	}
+	if (frames < 1)
+		frames = DEFAULT_FRAMES;
+
+	if (egl_create(&display, &surface, &w, &h))
+		return -1;
+	eglSwapInterval(display, 1);
+
+	if (optind == argc) {
+		for (i = 0; i < (int) (sizeof(defaults) / sizeof(defaults[0])); i++)
+			res |= run(display, surface, defaults[i], w, h, frames);
+	} else {
+		for (i = optind; i < argc; i++)
+			res |= run(display, surface, argv[i], w, h, frames);
+	}
+
+	egl_destroy(display, surface);
+	return res ? -1 : 0;
+}
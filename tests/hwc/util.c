@@ -226,6 +226,10 @@ fail:
 	return -1;
 }
 
+struct CNativeWindow *egl_window(void) {
+	return _cnw;
+}
+
 void egl_destroy(EGLDisplay display, EGLSurface surface) {
 	if (_cnw) {
 		eglDestroySurface(display, surface);
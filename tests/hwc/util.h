@@ -17,6 +17,8 @@
 #ifndef _GL_UTIL_H_
 #define _GL_UTIL_H_
 
+#include <stdint.h>
+
 /* convenience */
 
 GLuint load_program(const char *vert_src, const char *frag_src);
@@ -35,4 +37,19 @@ void cnw_destroy(struct CNativeWindow *win);
 void cnw_info(struct CNativeWindow *win,
 	unsigned *w, unsigned *h, unsigned *fmt);
 
+/* workloads of benchmarks, static layers are composed by hwcomposer only */
+
+#define CNW_MAX_STATIC_LAYERS 6
+
+struct CNativeWindow *egl_window(void);
+int64_t cnw_vsync_period(struct CNativeWindow *win);
+int cnw_has_hwc(struct CNativeWindow *win);
+/* show the window buffer in a part of the display, empty for all of it */
+void cnw_set_frame(struct CNativeWindow *win,
+	int left, int top, int right, int bottom);
+/* a layer of one RGBA color, above the window premultiplied or below it */
+int cnw_add_static_layer(struct CNativeWindow *win, int left, int top,
+	int right, int bottom, uint32_t color, int above);
+void cnw_clear_static_layers(struct CNativeWindow *win);
+
 #endif
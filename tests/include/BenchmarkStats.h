@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ANDROID_HAL_TESTS_BENCHMARK_STATS__
+#define __ANDROID_HAL_TESTS_BENCHMARK_STATS__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+// Clock and latency statistics shared by the HAL benchmarks
+namespace benchmark {
+
+static inline int64_t MonotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Value the given fraction of the sorted samples are at or below
+static inline int64_t Percentile(const std::vector<int64_t>& sorted, double fraction) {
+    if (sorted.empty())
+        return 0;
+    return sorted[(size_t)(fraction * (sorted.size() - 1))];
+}
+
+// Sorts latencies and prints "  <what> latency: p50 .. us, p99 .. us, max .. us",
+// or "  no <none>" without any
+static inline void PrintLatencies(const char* what, const char* none,
+        std::vector<int64_t>* latencies) {
+    if (latencies->empty()) {
+        printf("  no %s\n", none);
+        return;
+    }
+    std::sort(latencies->begin(), latencies->end());
+    size_t n = latencies->size();
+    printf("  %s latency: p50 %lld us, p99 %lld us, max %lld us\n", what,
+            (long long) ((*latencies)[n / 2] / 1000),
+            (long long) ((*latencies)[n * 99 / 100] / 1000),
+            (long long) ((*latencies)[n - 1] / 1000));
+}
+
+}
+
+#endif
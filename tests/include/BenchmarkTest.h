@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __ANDROID_HAL_TESTS_BENCHMARK_TEST__
+#define __ANDROID_HAL_TESTS_BENCHMARK_TEST__
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "BenchmarkStats.h"
+
+// Scaffolding of the gtest based HAL benchmarks. They are skipped unless
+// given a duration, and run like this:
+//   $ export <MODULE>_TEST_BENCHMARK_SECONDS=5
+//   $ export <MODULE>_TEST_BENCHMARK_THREADS=4
+//   $ cd /data/nativetest/<test>
+//   $ ./<test> --gtest_output=xml
+//
+// Each operation of a run prints one line of key=value pairs, and records the
+// same values as test properties in the XML output.
+namespace benchmark {
+
+// Seconds each operation is benchmarked for, from the
+// <module>_TEST_BENCHMARK_SECONDS environment variable. 0 skips the benchmark.
+static inline int Seconds(const char* module) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s_TEST_BENCHMARK_SECONDS", module);
+    const char* env = getenv(name);
+    return env != NULL ? atoi(env) : 0;
+}
+
+// Threads of the concurrent runs, from <module>_TEST_BENCHMARK_THREADS
+static inline int Threads(const char* module) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s_TEST_BENCHMARK_THREADS", module);
+    const char* env = getenv(name);
+    int threads = env != NULL ? atoi(env) : 4;
+    return threads > 0 ? threads : 1;
+}
+
+// One thread of a concurrent run. The loop it runs times op until deadline,
+// at least once however slow, into latencies, one set per timed operation.
+struct Worker {
+    void* context;
+    int op;
+    int64_t deadline;
+    std::vector<int64_t> latencies[2];
+    int errors;
+    pthread_t thread;
+};
+
+// Runs loop on threads workers for seconds, then merges the latencies and the
+// errors they recorded into latencies and errors. Returns the elapsed time,
+// -1 if a thread could not be started.
+static inline int64_t RunWorkers(void* context, int op, int threads, int seconds,
+        void* (*loop)(void*), std::vector<int64_t> latencies[2], int* errors) {
+    std::vector<Worker> workers(threads);
+    int started = 0;
+
+    int64_t start = MonotonicNs();
+    for (; started < threads; started++) {
+        workers[started].context = context;
+        workers[started].op = op;
+        workers[started].deadline = start + seconds * 1000000000LL;
+        workers[started].errors = 0;
+        if (pthread_create(&workers[started].thread, NULL, loop, &workers[started]) != 0)
+            break;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        for (int j = 0; j < 2; j++)
+            latencies[j].insert(latencies[j].end(), workers[i].latencies[j].begin(),
+                    workers[i].latencies[j].end());
+        *errors += workers[i].errors;
+    }
+    int64_t elapsed = MonotonicNs() - start;
+    return started == threads ? elapsed : -1;
+}
+
+// Prints the "<tag> op=<op> <labels> threads=..." line of a run of op, and
+// records its rate and latencies as "<op>_<threads>threads_*" properties.
+static inline void ReportLatencies(const char* tag, const char* op, const char* labels,
+        int threads, int64_t elapsed, std::vector<int64_t>& latencies, int errors) {
+    std::sort(latencies.begin(), latencies.end());
+
+    double ops_per_sec = latencies.size() * 1e9 / elapsed;
+    int64_t p50 = Percentile(latencies, 0.50) / 1000;
+    int64_t p90 = Percentile(latencies, 0.90) / 1000;
+    int64_t p99 = Percentile(latencies, 0.99) / 1000;
+    int64_t max = latencies.empty() ? 0 : latencies.back() / 1000;
+
+    printf("%s op=%s %s threads=%d ops=%zu ops_per_sec=%.1f p50_us=%" PRId64
+            " p90_us=%" PRId64 " p99_us=%" PRId64 " max_us=%" PRId64 " errors=%d\n",
+            tag, op, labels, threads, latencies.size(), ops_per_sec, p50, p90, p99,
+            max, errors);
+
+    char prefix[64];
+    char key[96];
+    snprintf(prefix, sizeof(prefix), "%s_%dthreads", op, threads);
+    snprintf(key, sizeof(key), "%s_ops_per_sec", prefix);
+    ::testing::Test::RecordProperty(key, (int)(ops_per_sec + 0.5));
+    snprintf(key, sizeof(key), "%s_p50_us", prefix);
+    ::testing::Test::RecordProperty(key, (int)p50);
+    snprintf(key, sizeof(key), "%s_p90_us", prefix);
+    ::testing::Test::RecordProperty(key, (int)p90);
+    snprintf(key, sizeof(key), "%s_p99_us", prefix);
+    ::testing::Test::RecordProperty(key, (int)p99);
+    snprintf(key, sizeof(key), "%s_max_us", prefix);
+    ::testing::Test::RecordProperty(key, (int)max);
+}
+
+}
+
+#endif
@@ -4,6 +4,7 @@ LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
+    keymaster_benchmark.cpp \
     keymaster_test.cpp
 
 # Note that "bionic" is needed because of stlport
@@ -11,7 +12,8 @@ LOCAL_C_INCLUDES := \
     bionic \
     external/gtest/include \
     external/openssl/include \
-    external/stlport/stlport
+    external/stlport/stlport \
+    $(LOCAL_PATH)/../include
 
 LOCAL_SHARED_LIBRARIES := \
     liblog \
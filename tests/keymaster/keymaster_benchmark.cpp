@@ -0,0 +1,327 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include <hardware/keymaster.h>
+
+#include "BenchmarkTest.h"
+
+namespace android {
+
+using benchmark::MonotonicNs;
+
+static int BenchmarkSeconds() {
+    return benchmark::Seconds("KEYMASTER");
+}
+
+static int BenchmarkThreads() {
+    return benchmark::Threads("KEYMASTER");
+}
+
+struct KeyConfig {
+    keymaster_keypair_t type;
+    uint32_t bits;
+};
+
+static void PrintTo(const KeyConfig& config, std::ostream* os) {
+    *os << (config.type == TYPE_RSA ? "RSA" : "EC") << config.bits;
+}
+
+enum Operation {
+    OP_GENERATE,
+    OP_IMPORT,
+    OP_SIGN,
+    OP_VERIFY,
+};
+
+static const char* OperationName(Operation op) {
+    switch (op) {
+    case OP_GENERATE: return "generate";
+    case OP_IMPORT: return "import";
+    case OP_SIGN: return "sign";
+    default: return "verify";
+    }
+}
+
+// KeymasterBenchmark runs each keymaster operation back to back for a while
+// on one thread, then on several at once, for RSA and EC keys of several
+// sizes, and measures the operations per second and the distribution of
+// their latencies. A TEE keymaster shows its round trip cost in the short
+// operations, and how it serializes concurrent clients in the threaded runs.
+//
+// It runs as BenchmarkTest.h describes, with the KEYMASTER variables and
+// --gtest_filter="*KeymasterBenchmark*", and prints "keymaster_benchmark" lines.
+class KeymasterBenchmark : public ::testing::TestWithParam<KeyConfig> {
+public:
+    static void SetUpTestCase() {
+        const hw_module_t* mod;
+        if (BenchmarkSeconds() <= 0)
+            return;
+        ASSERT_EQ(0, hw_get_module_by_class(KEYSTORE_HARDWARE_MODULE_ID, NULL, &mod))
+                << "Should be able to find a keymaster hardware module";
+        ASSERT_EQ(0, keymaster_open(mod, &sDevice))
+                << "Should be able to open the keymaster device";
+    }
+
+    static void TearDownTestCase() {
+        if (sDevice != NULL)
+            keymaster_close(sDevice);
+        sDevice = NULL;
+    }
+
+protected:
+    KeymasterBenchmark() :
+            mKeyBlob(NULL),
+            mKeyBlobLength(0),
+            mSignature(NULL),
+            mSignatureLength(0) {
+    }
+
+    virtual void SetUp() {
+        if (BenchmarkSeconds() <= 0)
+            return;
+        ASSERT_TRUE(sDevice != NULL);
+
+        const KeyConfig& config = GetParam();
+        ASSERT_NO_FATAL_FAILURE(MakePkcs8(config));
+        ASSERT_EQ(0, sDevice->import_keypair(sDevice, &mPkcs8[0], mPkcs8.size(),
+                &mKeyBlob, &mKeyBlobLength))
+                << "Should import the key to sign with";
+
+        // Raw RSA signs a block of the modulus size below the modulus, EC a digest
+        mData.assign(config.type == TYPE_RSA ? config.bits / 8 : 32, 0x5a);
+        mData[0] = 0;
+        ASSERT_EQ(0, Sign(&mSignature, &mSignatureLength))
+                << "Should sign with the imported key";
+    }
+
+    virtual void TearDown() {
+        free(mSignature);
+        if (mKeyBlob != NULL) {
+            if (sDevice->delete_keypair != NULL)
+                sDevice->delete_keypair(sDevice, mKeyBlob, mKeyBlobLength);
+            free(mKeyBlob);
+        }
+    }
+
+    // A PKCS#8 private key of the configuration, made with OpenSSL to import
+    void MakePkcs8(const KeyConfig& config) {
+        EVP_PKEY* pkey = EVP_PKEY_new();
+        ASSERT_TRUE(pkey != NULL);
+
+        if (config.type == TYPE_RSA) {
+            RSA* rsa = RSA_new();
+            BIGNUM* e = BN_new();
+            ASSERT_TRUE(rsa != NULL && e != NULL);
+            BN_set_word(e, RSA_F4);
+            ASSERT_EQ(1, RSA_generate_key_ex(rsa, config.bits, e, NULL));
+            EVP_PKEY_assign_RSA(pkey, rsa);
+            BN_free(e);
+        } else {
+            int nid;
+            switch (config.bits) {
+            case 224: nid = NID_secp224r1; break;
+            case 384: nid = NID_secp384r1; break;
+            case 521: nid = NID_secp521r1; break;
+            default: nid = NID_X9_62_prime256v1; break;
+            }
+            EC_KEY* ec = EC_KEY_new_by_curve_name(nid);
+            ASSERT_TRUE(ec != NULL);
+            EC_KEY_set_asn1_flag(ec, OPENSSL_EC_NAMED_CURVE);
+            ASSERT_EQ(1, EC_KEY_generate_key(ec));
+            EVP_PKEY_assign_EC_KEY(pkey, ec);
+        }
+
+        PKCS8_PRIV_KEY_INFO* pkcs8 = EVP_PKEY2PKCS8(pkey);
+        ASSERT_TRUE(pkcs8 != NULL);
+        int length = i2d_PKCS8_PRIV_KEY_INFO(pkcs8, NULL);
+        ASSERT_GT(length, 0);
+        mPkcs8.resize(length);
+        uint8_t* out = &mPkcs8[0];
+        i2d_PKCS8_PRIV_KEY_INFO(pkcs8, &out);
+        PKCS8_PRIV_KEY_INFO_free(pkcs8);
+        EVP_PKEY_free(pkey);
+    }
+
+    int Sign(uint8_t** sig, size_t* sig_length) {
+        keymaster_rsa_sign_params_t rsa_params = {
+                digest_type: DIGEST_NONE,
+                padding_type: PADDING_NONE,
+        };
+        keymaster_ec_sign_params_t ec_params = {
+                digest_type: DIGEST_NONE,
+        };
+        const void* params = GetParam().type == TYPE_RSA ?
+                (const void*)&rsa_params : (const void*)&ec_params;
+        return sDevice->sign_data(sDevice, params, mKeyBlob, mKeyBlobLength,
+                &mData[0], mData.size(), sig, sig_length);
+    }
+
+    // One operation, 0 on success
+    int RunOnce(Operation op) {
+        const KeyConfig& config = GetParam();
+        uint8_t* blob = NULL;
+        size_t length = 0;
+        int res;
+
+        switch (op) {
+        case OP_GENERATE:
+            if (config.type == TYPE_RSA) {
+                keymaster_rsa_keygen_params_t params = {
+                        modulus_size: config.bits,
+                        public_exponent: RSA_F4,
+                };
+                res = sDevice->generate_keypair(sDevice, TYPE_RSA, &params, &blob, &length);
+            } else {
+                keymaster_ec_keygen_params_t params = {
+                        field_size: config.bits,
+                };
+                res = sDevice->generate_keypair(sDevice, TYPE_EC, &params, &blob, &length);
+            }
+            break;
+        case OP_IMPORT:
+            res = sDevice->import_keypair(sDevice, &mPkcs8[0], mPkcs8.size(), &blob, &length);
+            break;
+        case OP_SIGN:
+            res = Sign(&blob, &length);
+            free(blob);
+            return res;
+        default: {
+            keymaster_rsa_sign_params_t rsa_params = {
+                    digest_type: DIGEST_NONE,
+                    padding_type: PADDING_NONE,
+            };
+            keymaster_ec_sign_params_t ec_params = {
+                    digest_type: DIGEST_NONE,
+            };
+            const void* params = config.type == TYPE_RSA ?
+                    (const void*)&rsa_params : (const void*)&ec_params;
+            return sDevice->verify_data(sDevice, params, mKeyBlob, mKeyBlobLength,
+                    &mData[0], mData.size(), mSignature, mSignatureLength);
+        }
+        }
+
+        // Keys stored by the keymaster are deleted so runs don't fill it up
+        if (res == 0 && blob != NULL) {
+            if (sDevice->delete_keypair != NULL)
+                sDevice->delete_keypair(sDevice, blob, length);
+            free(blob);
+        }
+        return res;
+    }
+
+    static void* WorkerLoop(void* arg) {
+        benchmark::Worker* worker = static_cast<benchmark::Worker*>(arg);
+        KeymasterBenchmark* benchmark = static_cast<KeymasterBenchmark*>(worker->context);
+
+        // Every worker does at least one operation, however slow
+        do {
+            int64_t start = MonotonicNs();
+            if (benchmark->RunOnce(static_cast<Operation>(worker->op)) != 0)
+                worker->errors++;
+            worker->latencies[0].push_back(MonotonicNs() - start);
+        } while (MonotonicNs() < worker->deadline);
+        return NULL;
+    }
+
+    void Run(Operation op, int threads) {
+        const KeyConfig& config = GetParam();
+        std::vector<int64_t> latencies[2];
+        int errors = 0;
+
+        int64_t elapsed = benchmark::RunWorkers(this, op, threads, BenchmarkSeconds(),
+                WorkerLoop, latencies, &errors);
+        ASSERT_GE(elapsed, 0) << "Should start " << threads << " threads";
+
+        char labels[64];
+        snprintf(labels, sizeof(labels), "type=%s bits=%u",
+                config.type == TYPE_RSA ? "RSA" : "EC", config.bits);
+        benchmark::ReportLatencies("keymaster_benchmark", OperationName(op), labels,
+                threads, elapsed, latencies[0], errors);
+
+        EXPECT_EQ(0, errors) << "Every " << OperationName(op) << " should succeed";
+    }
+
+    void RunAll(Operation op) {
+        Run(op, 1);
+        if (BenchmarkThreads() > 1)
+            Run(op, BenchmarkThreads());
+    }
+
+    static keymaster_device_t* sDevice;
+
+    std::vector<uint8_t> mPkcs8;
+    std::vector<uint8_t> mData;
+    uint8_t* mKeyBlob;
+    size_t mKeyBlobLength;
+    uint8_t* mSignature;
+    size_t mSignatureLength;
+};
+
+keymaster_device_t* KeymasterBenchmark::sDevice = NULL;
+
+TEST_P(KeymasterBenchmark, Generate) {
+    if (BenchmarkSeconds() <= 0)
+        return;
+    RunAll(OP_GENERATE);
+}
+
+TEST_P(KeymasterBenchmark, Import) {
+    if (BenchmarkSeconds() <= 0)
+        return;
+    RunAll(OP_IMPORT);
+}
+
+TEST_P(KeymasterBenchmark, Sign) {
+    if (BenchmarkSeconds() <= 0)
+        return;
+    RunAll(OP_SIGN);
+}
+
+TEST_P(KeymasterBenchmark, Verify) {
+    if (BenchmarkSeconds() <= 0)
+        return;
+    RunAll(OP_VERIFY);
+}
+
+static const KeyConfig kKeyConfigs[] = {
+    { TYPE_RSA, 1024 },
+    { TYPE_RSA, 2048 },
+    { TYPE_RSA, 4096 },
+    { TYPE_EC, 256 },
+    { TYPE_EC, 384 },
+    { TYPE_EC, 521 },
+};
+
+INSTANTIATE_TEST_CASE_P(Keys,
+                        KeymasterBenchmark,
+                        ::testing::ValuesIn(kKeyConfigs));
+
+}